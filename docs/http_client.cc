@@ -48,6 +48,18 @@ int main()
     std::cout << pair.first << ":::" << pair.second  << std::endl;
   }
 
+  // Stream a large body instead of storing it.
+  std::ofstream out("export.csv");
+  auto res = http_get("http://my_api.com/export.csv",
+                      s::on_body = [&] (std::string_view data) { out << data; });
+
+  // Borrow a client, and its cookies, for several requests.
+  {
+    auto client = default_http_client_pool().acquire();
+    client->post("http://my_api.com/login", s::post_parameters = mmm(s::name = "John"));
+    client->get("http://my_api.com/profile");
+  }
+
 }
 /*
 ## Reference
@@ -69,6 +81,15 @@ Available options:
   - `s::fetch_headers` : add the headers field to the return value.
   - `s::disable_check_certificate`: disable SSL certificate check.
   - `s::json_encoded` : JSON encode the POST parameters (default: url encode) 
+  - `s::on_body = f`: call `f(std::string_view)` with each part of the response body instead of
+    returning it in `result.body`. The transfer stops if `f` returns false.
+  - `s::body_buffer = &buffer`: write the response body in the `std::string` buffer instead of
+    `result.body`, reusing its memory from one request to the next.
+
+The free functions borrow a client from `default_http_client_pool()`, so the
+connections are reused from one call to the next. Clients are returned to the pool without
+their cookies. All the clients share one libcurl share handle holding the DNS cache and the
+TLS sessions; each client keeps its own connections. HTTP/2 is used over TLS when the server supports it.
 */
 
 
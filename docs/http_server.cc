@@ -58,6 +58,16 @@ Available options are:
 - `s::non_blocking`: do not block until the server stoped. default: blocking.
 - `s::threads`: number of threads, default to `std::thread::hardware_concurrency()`.
 
+Socket tuning options, the system defaults are kept when they are not given:
+- `s::listen_backlog`: length of the queue of pending connections. default: `SOMAXCONN`.
+- `s::tcp_nodelay = true`: disable Nagle's algorithm on the connections.
+- `s::tcp_defer_accept`: seconds to wait for the first request bytes before accepting a connection (Linux).
+- `s::tcp_fastopen`: length of the TCP Fast Open queue.
+- `s::send_buffer_size`, `s::receive_buffer_size`: SO_SNDBUF and SO_RCVBUF.
+- `s::busy_poll`: in microseconds. After each event the server threads poll without sleeping
+  during this time, and the sockets get SO_BUSY_POLL (Linux). It uses more CPU to reduce the
+  tail latency; `benchmarks/latency.cc` measures it with an open-loop load.
+
 For HTTPS, you must provide:
 - `s::ssl_key`: path of the SSL key.
 - `s::ssl_certificate`: path of the SSL certificate.
@@ -139,6 +149,21 @@ api.get("/unauthorized") = [&](http_request& request, http_response& response) {
   response.set_cookie("cookie_name", "cookie_value");
 };
 
+/*
+## Request memory
+
+`request.arena()` is a bump allocator freed in one shot after the response. Use it
+for handler scratch data, through `arena_allocator` or `arena_string` which
+`get_parameters`, `post_parameters` and `url_parameters` can also decode into:
+*/
+
+api.post("/arena") = [&](http_request& request, http_response& response) {
+  auto params = request.post_parameters(s::name = arena_string(request.arena()));
+  std::vector<int, arena_allocator<int>> scratch(request.arena());
+  scratch.resize(params.name.size());
+  // No free: everything allocated in the arena is released after the response.
+};
+
 /*
 ## Nested APIs
 
@@ -220,6 +245,7 @@ auto auth = li::http_authentication(
   s::email, // The user field used as login.
   s::password, // The user field used as password.
   // Optional but really recommended: password hashing.
+  // It runs on a worker thread of default_offload_pool(), so it must be thread safe.
   s::hash_password = [&] (auto login, auto password) { 
     return your_secure_hash_function(login, password);
   },
@@ -293,6 +319,239 @@ Note that `response.write_static_file` and `serve_directory` automatically set t
 All mime types of this list are supported: http://svn.apache.org/repos/asf/httpd/httpd/trunk/docs/conf/mime.types
 
 .
+## Server-Sent Events and long polling
+
+`sse_hub` is a topic based publish/subscribe hub. A handler subscribes to a topic and
+waits for events: its fiber is parked and does not use any CPU until something is published.
+`publish` can be called from any thread, it wakes up the subscribers on all the server threads.
+Each event is serialized once and the same bytes are written to all the subscribers.
+
+*/
+sse_hub hub;
+
+// Stream events with the text/event-stream content type.
+api.get("/notifications") = [&] (http_request& request, http_response& response) {
+  auto subscription = hub.subscribe(request, "news");
+  sse_stream stream(response);
+  while (auto event = subscription.wait())
+    stream.send(*event);
+};
+
+// Long polling: wait at most 30 seconds for the next event.
+api.get("/poll") = [&] (http_request& request, http_response& response) {
+  auto subscription = hub.subscribe(request, "news");
+  if (auto event = subscription.wait_for(std::chrono::seconds(30)))
+    response.write(event->data());
+  else
+    response.set_status(204);
+};
+
+// From any thread:
+hub.publish("news", "Hello subscribers!");
+// With an event name:
+hub.publish("news", "{\"id\":42}", "update");
+/*
+
+## Blocking calls
+
+Blocking or CPU heavy calls (blocking file I/O, password hashing, image processing,
+synchronous libraries) stall all the connections of the server thread running them.
+`await_blocking` runs them on a worker thread instead: the calling fiber is parked
+and resumed with the result, other requests are served meanwhile.
+
+*/
+api.get("/thumbnail") = [&] (http_request& request, http_response& response) {
+  std::string thumbnail = await_blocking(request.fiber, [&] { return resize_image("photo.jpg"); });
+  response.write(thumbnail);
+};
+/*
+
+`await_blocking` uses `default_offload_pool()`, one worker per core.
+A dedicated `offload_pool pool(nthreads, max_queue_size)` limits the threads used by one kind
+of work; when its queue is full, `pool.await_blocking` fails with a 503 error.
+`pool.stats()` returns the queue depth, its maximum, the number of busy workers and the
+counts of completed and rejected jobs.
+
+## Admission control and load shedding
+
+When requests arrive faster than they are served, they queue up and every response gets
+slower. Overloaded servers should answer some requests immediately with a
+`503 Service Unavailable` and a `Retry-After` header instead.
+
+`http_serve` sheds requests based on their queueing delay, the time they waited in the
+server thread before their handler runs. It follows CoDel: when this delay stayed above
+`s::codel_target` milliseconds during a whole `s::codel_interval` (default 100ms), requests
+waiting more than the target are shed until the queue drains.
+
+*/
+http_serve(api, 8080, s::codel_target = 5, s::retry_after = 1);
+
+// To read the counts of admitted and shed requests:
+admission_control admission(s::codel_target = 5);
+http_serve(api, 8080, s::admission_control = &admission);
+auto stats = admission.stats(); // stats.admitted, stats.shed_queue_delay
+/*
+
+A `concurrency_limit` (bulkhead) caps the number of requests of some routes running at the
+same time on each server thread, so that a slow dependency cannot take all the fibers.
+`s::max_queue` requests can wait for a slot, managed with the same CoDel rule; the others
+get a 503 response.
+
+*/
+concurrency_limit report_limit(s::max_in_flight = 10, s::max_queue = 50);
+api.get("/report") = report_limit([&] (http_request& request, http_response& response) {
+  response.write(build_report(request));
+});
+// report_limit.stats(): admitted, shed_in_flight (queue full), shed_queue_delay.
+/*
+
+## Rate limiting
+
+A `rate_limiter` gives each client a token bucket refilled at `s::rate` tokens per second,
+holding up to `s::burst` tokens. Requests finding an empty bucket get a
+`429 Too Many Requests` response with a `Retry-After` header, without calling the handler.
+Clients are identified by their ip address, or by the string returned by `s::key`.
+
+*/
+rate_limiter limiter(s::rate = 10, s::burst = 20);
+api.get("/search") = limiter([&] (http_request& request, http_response& response) { ... });
+
+// Limit all the routes of an api, per api key.
+rate_limiter by_api_key(s::rate = 1000, s::key = [] (http_request& request) {
+  return std::string(request.header("X-Api-Key"));
+});
+api.add_subapi("/v1", by_api_key(v1_api));
+// by_api_key.stats(): admitted, rejected, evicted.
+/*
+
+Each server thread updates its own buckets without locking, and reconciles them with the
+other threads every `s::sync_interval` milliseconds (default 100). The limit is approximate:
+between two reconciliations, each thread can admit a burst. Each thread keeps at most
+`s::max_keys` buckets (default 100000) and evicts the coldest ones.
+
+## Reverse proxy
+
+`upstream` forwards requests to a set of backend servers from inside the handler fiber,
+without blocking the server thread. Each server thread keeps a pool of keep-alive connections
+per backend (`s::max_idle_connections`, default 64). Responses are streamed back to the
+client: bodies are not buffered, and large ones are moved with `splice` on Linux.
+
+*/
+upstream backends({"10.0.0.1:8080", "10.0.0.2:8080"},
+                  // round_robin (default), least_outstanding or power_of_two_choices.
+                  s::balancing = upstream_balancing::least_outstanding,
+                  s::timeout = 5000, // milliseconds without progress.
+                  s::retries = 2);
+api.get("/api/{{path...}}") = [&] (http_request& request, http_response& response) {
+  backends.forward(request, response); // Or forward(request, response, "/other/target").
+};
+// backends.stats(): requests, connections, reused, retries, failures.
+/*
+
+Failed connections are retried on the next backend, lost connections only for idempotent
+methods. When no backend answers, the client gets `502 Bad Gateway`, or
+`504 Gateway Timeout` after `s::timeout` milliseconds without progress.
+
+## Calling other services
+
+`http_client` blocks its thread until the response arrives, and so freezes all the other
+connections of the server thread. From a handler, use `async_http_client` instead: it
+takes the fiber of the request, and parks it while it waits for the response. It takes
+the same arguments and returns the same objects as `http_client`.
+
+*/
+async_http_client users_service(s::timeout = 2000); // milliseconds without progress.
+api.get("/profile") = [&] (http_request& request, http_response& response) {
+  auto user = users_service.get(request.fiber, "http://users:8080/user",
+                                s::get_parameters = mmm(s::id = 42), s::fetch_headers);
+  // user.status, user.body, user.headers
+  response.write(user.body);
+};
+// Or with a client shared by the whole process:
+auto r = http_post(request.fiber, "http://10.0.0.3/log", s::post_parameters = mmm(s::msg = "hi"),
+                   s::json_encoded);
+/*
+
+Each server thread keeps its own keep-alive connections per host
+(`s::max_idle_connections`, default 16). Host names are resolved on the offload pool.
+Errors throw `std::runtime_error`. Only `http://` urls are supported.
+
+## Fiber synchronization
+
+`fiber_mutex`, `fiber_semaphore`, `fiber_condition_variable`, `fiber_event` and the
+bounded `fiber_channel<T>` let the fibers of one server thread wait for each other
+without polling: waiting fibers are parked and resumed by the fiber that releases them.
+They are not thread safe, use them from a single reactor (for example with `s::nthreads = 1`).
+Waits take an optional deadline and return false if it expires or if the client closes the connection.
+
+*/
+// Only one fiber refreshes the cache, the others wait for it.
+fiber_mutex refresh_mutex;
+api.get("/data") = [&] (http_request& request, http_response& response) {
+  if (fiber_lock_guard lock{refresh_mutex, request.fiber}) {
+    if (cache_is_stale())
+      refresh_cache();
+    response.write(cache);
+  }
+};
+/*
+
+## Concurrent sub-tasks
+
+`fork_join` runs sub-tasks of a request in child fibers of the same thread and waits for them.
+Each child gets its own fiber context, so it can take its own SQL connection. Child stacks
+come from a per-thread pool. The first exception thrown by a child cancels the others
+(they see their connection closed) and is rethrown by `fork_join`.
+
+*/
+api.get("/queries") = [&] (http_request& request, http_response& response) {
+  // 4 lookups running concurrently on 4 connections.
+  auto numbers = fork_join(request.fiber, 4, [&] (async_fiber_context& child, int i) {
+    return random_numbers.connect(child).find_one(s::id = 1 + rand() % 10000).value();
+  });
+  response.write_json(numbers);
+};
+// Tasks returning different types:
+auto [user, posts] = fork_join_all(request.fiber,
+    [&] (async_fiber_context& child) { return users.connect(child).find_one(s::id = 1); },
+    [&] (async_fiber_context& child) { return count_posts(child, 1); });
+/*
+
+`fiber_group` gives more control: `spawn` children one by one, `cancel` them and `join`.
+
+## Coroutines (C++20)
+
+On Linux and with a C++20 compiler, `http_serve_coro` serves an API whose handlers are
+stackless coroutines returning `coro_task<>`, instead of running them on fibers.
+The request and response objects have the same methods as `http_request` and `http_response`.
+`request.fiber.connection` is the `coro_connection` of the request, its waits are awaitables:
+
+*/
+coro_http_api api;
+api.get("/hello") = [&] (coro_http_request& request, coro_http_response& response) -> coro_task<> {
+  co_await request.fiber.connection->sleep_for(std::chrono::milliseconds(10));
+  co_await request.fiber.connection->yield();
+  response.write("hello world.");
+};
+http_serve_coro(api, 8080);
+/*
+
+`coro_connection` also provides `read`, `write`, `writev`, `sleep_until`, and
+`epoll_add(fd, flags)` + `wait_event()` to wait on other file descriptors.
+The fiber server and its API stay available and unchanged.
+
+Limitations: no HTTPS, request bodies are read entirely before calling the handler and are
+limited to 64KB (larger ones get a 413 response), and the SQL connectors still
+expect a fiber: use their blocking `connect()` from coroutine handlers.
+
+An idle keep-alive connection costs less memory than with fibers since it does not
+own a stack (`benchmarks/coro_vs_fiber.cc`, one server thread, 10000 connections):
+
+| server     | bytes per idle connection | requests/s |
+|------------|---------------------------|------------|
+| fibers     | 9689                      | 58470      |
+| coroutines | 3100                      | 55178      |
+
 ## Testing
 
 Using `http_client` and the `s::non_blocking` flag of http_serve
@@ -309,5 +568,54 @@ http_serve(my_api, 12344, s::non_blocking);
 auto r = http_get("http://localhost:12344/hello_world", s::get_parameters = mmm(s::name = "John")));
 assert(r.status == 200);
 assert(r.body == "expected response body");
+/*
+
+`http_injector` runs raw requests through the parser, the router and the handlers of
+an api without any socket, on the calling thread. It is deterministic and does no
+syscall, which also makes it a good tool to benchmark an api end to end:
+
+*/
+http_injector inject(my_api);
+std::string_view response = inject("GET /hello_world?name=John HTTP/1.1\r\n\r\n");
+// Pipelined requests, delivered to the server 10 bytes at a time:
+response = inject(several_requests, 10);
+// With an operator new incrementing li::impl::allocation_count linked in the program
+// (libraries/http_server/tests/count_allocations.cc):
+long long n = inject.allocations(); // Calls to operator new during the last call.
+/*
+
+Handlers waiting for other connections (async sql, `async_http_client`) need `http_serve`.
+
+*/
+
+### Capture and replay
+
+The `s::capture` option of `http_serve` records every request received by the server,
+with its arrival time, its connection and the status of the response, to a binary file.
+A background thread writes the file; requests are dropped rather than slowing the server
+when the writer falls behind (more than 64MB pending).
+
+*/
+http_serve(my_api, 8080, s::capture = "traffic.bin");
+// Or, to read the counters and flush the file while the server runs:
+traffic_capture capture("traffic.bin");
+http_serve(my_api, 8080, s::non_blocking, s::capture = &capture);
+// capture.recorded(), capture.dropped(), capture.flush()
+/*
 
+`bench_replay` (libraries/http_server/benchmarks/replay.cc) plays a capture against a
+server: each captured connection on its own connection, with the original timing
+(or N times faster, or as fast as possible), and prints the latency percentiles of each
+route and the responses whose status differs from the captured one.
+
+```
+bench_replay traffic.bin 8080 1      # Original timing.
+bench_replay traffic.bin 8080 10     # 10 times faster.
+bench_replay traffic.bin 8080 max 64 # Back to back, at most 64 connections.
+```
+
+Captured request bodies are the raw bytes of the request; chunked request bodies are not
+supported. `traffic_capture_reader` reads the records of a capture.
+
+*/
 }
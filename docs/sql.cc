@@ -130,7 +130,6 @@ that you wrap you fibers (or coroutine, light thread, green thread, ...) with th
 */
 
 struct fiber_wrapper {
-  typedef std::runtime_error exception_type;
   int fiber_id = 0;
   // A sleeping fiber need to be woken up.
   // Plan to wake it up.
@@ -148,7 +147,14 @@ struct fiber_wrapper {
   inline void epoll_mod(int fd, int flags) {}
 
   // yield this fiber.
+  // If the client of the fiber goes away, keep yielding normally: the pending query
+  // completes so the connection can go back to the pool.
   inline void yield() {}
+
+  // Optional: true once the client of the fiber is gone. Then, connect() and new
+  // queries throw sql_client_closed instead of starting database work for nobody.
+  // http_serve drops these requests silently.
+  inline bool is_closed() const { return false; }
 };
 
 /*
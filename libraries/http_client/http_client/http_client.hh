@@ -10,8 +10,13 @@
 #include <iostream>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <sstream>
+#include <string>
+#include <string_view>
+#include <type_traits>
 #include <unordered_map>
+#include <vector>
 
 #include <li/http_client/symbols.hh>
 #include <li/json/json.hh>
@@ -41,19 +46,90 @@ inline size_t curl_header_callback(char* buffer, size_t size, size_t nitems, voi
   return total_size;
 }
 
+namespace impl {
+
+// Process wide libcurl share handle: the clients share their DNS cache and TLS sessions.
+// The connection cache is not shared: libcurl does not support sharing it between threads
+// running transfers concurrently. Each client keeps its own connections, and the pool keeps
+// the clients alive between requests.
+struct curl_share_handle {
+  curl_share_handle() {
+    curl_global_init(CURL_GLOBAL_ALL);
+    share = curl_share_init();
+    curl_share_setopt(share, CURLSHOPT_LOCKFUNC, lock);
+    curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, unlock);
+    curl_share_setopt(share, CURLSHOPT_USERDATA, this);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+  }
+  ~curl_share_handle() { curl_share_cleanup(share); }
+
+  static void lock(CURL*, curl_lock_data data, curl_lock_access, void* userptr) {
+    ((curl_share_handle*)userptr)->mutexes[data].lock();
+  }
+  static void unlock(CURL*, curl_lock_data data, void* userptr) {
+    ((curl_share_handle*)userptr)->mutexes[data].unlock();
+  }
+
+  CURLSH* share;
+  std::mutex mutexes[CURL_LOCK_DATA_LAST];
+};
+
+inline CURLSH* curl_share() {
+  static curl_share_handle handle;
+  return handle.share;
+}
+
+// Text of a url or post parameter.
+template <typename T> std::string curl_parameter_string(const T& v) {
+  if constexpr (std::is_convertible_v<const T&, std::string_view>)
+    return std::string(std::string_view(v));
+  else if constexpr (std::is_integral_v<T> and sizeof(T) > 1)
+    return std::to_string(v);
+  else {
+    std::ostringstream ss;
+    ss << v;
+    return ss.str();
+  }
+}
+
+// Write callback streaming the response body to the callable pointed by \userdata.
+// The transfer is aborted if it returns false.
+template <typename F>
+size_t curl_stream_callback(char* ptr, size_t size, size_t nmemb, void* userdata) {
+  F& f = *(F*)userdata;
+  std::string_view data(ptr, size * nmemb);
+  if constexpr (std::is_same_v<std::invoke_result_t<F&, std::string_view>, bool>)
+    return f(data) ? data.size() : 0;
+  else {
+    f(data);
+    return data.size();
+  }
+}
+
+} // namespace impl
+
 struct http_client {
 
   enum http_method { HTTP_GET, HTTP_POST, HTTP_PUT, HTTP_DELETE };
 
   inline http_client(const std::string& prefix = "") : url_prefix_(prefix) {
-    curl_global_init(CURL_GLOBAL_ALL);
+    share_ = impl::curl_share();
     curl_ = curl_easy_init();
   }
 
   inline ~http_client() { curl_easy_cleanup(curl_); }
 
+  http_client(const http_client&) = delete;
   inline http_client& operator=(const http_client&) = delete;
 
+  // Options, in addition to s::get_parameters, s::post_parameters, s::json_encoded,
+  // s::fetch_headers and s::disable_check_certificate:
+  //   s::on_body = [] (std::string_view data) { ... }: stream the response body to a
+  //                callable instead of returning it. Returning false aborts the transfer.
+  //   s::body_buffer = &buffer: write the response body in the std::string buffer, reusing
+  //                its memory across requests.
+  // With s::on_body or s::body_buffer, the result has no s::body.
   template <typename... A>
   inline auto operator()(http_method http_method, const std::string_view& url, const A&... args) {
 
@@ -61,52 +137,48 @@ struct http_client {
 
     auto arguments = mmm(args...);
     constexpr bool fetch_headers = has_key<decltype(arguments)>(s::fetch_headers);
+    constexpr bool stream_body = has_key<decltype(arguments)>(s::on_body);
+    constexpr bool user_buffer = has_key<decltype(arguments)>(s::body_buffer);
+
+    // Options are set again for each request. The connections, the caches and the cookies
+    // of the handle are kept.
+    curl_easy_reset(curl_);
+    curl_easy_setopt(curl_, CURLOPT_SHARE, share_);
+    curl_easy_setopt(curl_, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
 
     // Generate url.
-    std::ostringstream url_ss;
-    url_ss << url_prefix_ << url;
+    std::string url_string;
+    url_string.reserve(url_prefix_.size() + url.size());
+    url_string.append(url_prefix_).append(url);
 
     // Get params
     auto get_params = li::get_or(arguments, s::get_parameters, mmm());
     bool first = true;
     li::map(get_params, [&](auto k, auto v) {
-      if (first)
-        url_ss << '?';
-      else
-        url_ss << "&";
-      std::ostringstream value_ss;
-      value_ss << v;
-      char* escaped = curl_easy_escape(curl_, value_ss.str().c_str(), value_ss.str().size());
-      url_ss << li::symbol_string(k) << '=' << escaped;
+      url_string += first ? '?' : '&';
+      url_string += li::symbol_string(k);
+      url_string += '=';
+      append_escaped(url_string, impl::curl_parameter_string(v));
       first = false;
-      curl_free(escaped);
     });
 
-    // std::cout << url_ss.str() << std::endl;
     // Pass the url to libcurl.
-    curl_easy_setopt(curl_, CURLOPT_URL, url_ss.str().c_str());
+    curl_easy_setopt(curl_, CURLOPT_URL, url_string.c_str());
 
     // HTTP_POST parameters.
     bool is_urlencoded = not li::has_key(arguments, s::json_encoded);
-    std::ostringstream post_stream;
     std::string rq_body;
     if (is_urlencoded) { // urlencoded
-      req_body_buffer_.str("");
-
       auto post_params = li::get_or(arguments, s::post_parameters, mmm());
       first = true;
       li::map(post_params, [&](auto k, auto v) {
         if (!first)
-          post_stream << "&";
-        post_stream << li::symbol_string(k) << "=";
-        std::ostringstream value_str;
-        value_str << v;
-        char* escaped = curl_easy_escape(curl_, value_str.str().c_str(), value_str.str().size());
+          rq_body += '&';
+        rq_body += li::symbol_string(k);
+        rq_body += '=';
+        append_escaped(rq_body, impl::curl_parameter_string(v));
         first = false;
-        post_stream << escaped;
-        curl_free(escaped);
       });
-      rq_body = post_stream.str();
       req_body_buffer_.str(rq_body);
 
     } else // Json encoded
@@ -115,6 +187,7 @@ struct http_client {
     // HTTP HTTP_POST
     if (http_method == HTTP_POST) {
       curl_easy_setopt(curl_, CURLOPT_POST, 1);
+      curl_easy_setopt(curl_, CURLOPT_POSTFIELDSIZE, long(rq_body.size()));
       curl_easy_setopt(curl_, CURLOPT_POSTFIELDS, rq_body.c_str());
     }
 
@@ -145,9 +218,21 @@ struct http_client {
     curl_easy_setopt(curl_, CURLOPT_COOKIEJAR,
                      0); // Enable cookies but do no write a cookiejar.
 
+    // Response body.
     body_buffer_.clear();
-    curl_easy_setopt(curl_, CURLOPT_WRITEFUNCTION, curl_write_callback);
-    curl_easy_setopt(curl_, CURLOPT_WRITEDATA, this);
+    if constexpr (stream_body) {
+      curl_easy_setopt(curl_, CURLOPT_WRITEFUNCTION,
+                       impl::curl_stream_callback<std::decay_t<decltype(arguments.on_body)>>);
+      curl_easy_setopt(curl_, CURLOPT_WRITEDATA, &arguments.on_body);
+    } else if constexpr (user_buffer) {
+      std::string* buffer = arguments.body_buffer;
+      buffer->clear();
+      curl_easy_setopt(curl_, CURLOPT_WRITEFUNCTION, curl_append_callback);
+      curl_easy_setopt(curl_, CURLOPT_WRITEDATA, buffer);
+    } else {
+      curl_easy_setopt(curl_, CURLOPT_WRITEFUNCTION, curl_write_callback);
+      curl_easy_setopt(curl_, CURLOPT_WRITEDATA, this);
+    }
 
     curl_easy_setopt(curl_, CURLOPT_HTTPHEADER, headers_list);
 
@@ -163,23 +248,31 @@ struct http_client {
 
     // Send the request.
     char errbuf[CURL_ERROR_SIZE];
+    errbuf[0] = 0;
     curl_easy_setopt(curl_, CURLOPT_ERRORBUFFER, errbuf);
-    if (curl_easy_perform(curl_) != CURLE_OK) {
+    CURLcode res = curl_easy_perform(curl_);
+    curl_slist_free_all(headers_list);
+    if (res != CURLE_OK) {
       std::ostringstream errss;
-      errss << "Libcurl error when sending request: " << errbuf;
+      errss << "Libcurl error when sending request: "
+            << (errbuf[0] ? errbuf : curl_easy_strerror(res));
       throw std::runtime_error(errss.str());
     }
-    curl_slist_free_all(headers_list);
     // Read response code.
     long response_code;
     curl_easy_getinfo(curl_, CURLINFO_RESPONSE_CODE, &response_code);
 
     // Return response object.
-    if constexpr (fetch_headers)
-      return mmm(s::status = response_code, s::body = body_buffer_,
-                 s::headers = response_headers_map);
+    if constexpr (stream_body or user_buffer) {
+      if constexpr (fetch_headers)
+        return mmm(s::status = response_code, s::headers = std::move(response_headers_map));
+      else
+        return mmm(s::status = response_code);
+    } else if constexpr (fetch_headers)
+      return mmm(s::status = response_code, s::body = std::move(body_buffer_),
+                 s::headers = std::move(response_headers_map));
     else
-      return mmm(s::status = response_code, s::body = body_buffer_);
+      return mmm(s::status = response_code, s::body = std::move(body_buffer_));
   }
 
   template <typename... P> auto get(const std::string& url, P... params) {
@@ -195,6 +288,9 @@ struct http_client {
     return this->operator()(HTTP_DELETE, url, params...);
   }
 
+  // Forget the cookies received by this client.
+  inline void clear_cookies() { curl_easy_setopt(curl_, CURLOPT_COOKIELIST, "ALL"); }
+
   inline void read(char* ptr, int size) { body_buffer_.append(ptr, size); }
 
   inline std::streamsize write(char* ptr, int size) {
@@ -202,7 +298,19 @@ struct http_client {
     return ret;
   }
 
+  inline void append_escaped(std::string& out, const std::string& value) {
+    char* escaped = curl_easy_escape(curl_, value.c_str(), value.size());
+    out += escaped;
+    curl_free(escaped);
+  }
+
+  static size_t curl_append_callback(char* ptr, size_t size, size_t nmemb, void* userdata) {
+    ((std::string*)userdata)->append(ptr, size * nmemb);
+    return size * nmemb;
+  }
+
   CURL* curl_;
+  CURLSH* share_;
   std::map<std::string, std::string> cookies_;
   std::string body_buffer_;
   std::stringbuf req_body_buffer_;
@@ -220,17 +328,95 @@ size_t curl_write_callback(char* ptr, size_t size, size_t nmemb, void* userdata)
   return size * nmemb;
 }
 
+// Idle http_clients kept for reuse, with their connections. Thread safe.
+//
+//   http_client_pool pool;
+//   auto r = pool.get("http://example.com/"); // Borrows a client for the request.
+//   {
+//     auto client = pool.acquire(); // Borrows a client (and its cookies) for several requests.
+//     client->post(...);
+//     client->get(...);
+//   } // Goes back to the pool, without its cookies.
+struct http_client_pool {
+
+  struct releaser {
+    http_client_pool* pool;
+    void operator()(http_client* client) const { pool->release(client); }
+  };
+  typedef std::unique_ptr<http_client, releaser> handle;
+
+  inline http_client_pool(int max_idle_clients = 16) : max_idle_clients_(max_idle_clients) {
+    impl::curl_share(); // Created first, destroyed after the pool.
+  }
+
+  inline ~http_client_pool() {
+    for (http_client* client : idle_)
+      delete client;
+  }
+
+  http_client_pool(const http_client_pool&) = delete;
+  http_client_pool& operator=(const http_client_pool&) = delete;
+
+  inline handle acquire() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!idle_.empty()) {
+        http_client* client = idle_.back();
+        idle_.pop_back();
+        return handle(client, releaser{this});
+      }
+    }
+    return handle(new http_client, releaser{this});
+  }
+
+  template <typename... P> auto get(const std::string& url, P... params) {
+    return acquire()->get(url, params...);
+  }
+  template <typename... P> auto put(const std::string& url, P... params) {
+    return acquire()->put(url, params...);
+  }
+  template <typename... P> auto post(const std::string& url, P... params) {
+    return acquire()->post(url, params...);
+  }
+  template <typename... P> auto delete_(const std::string& url, P... params) {
+    return acquire()->delete_(url, params...);
+  }
+
+private:
+  inline void release(http_client* client) {
+    client->clear_cookies();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (int(idle_.size()) < max_idle_clients_) {
+        idle_.push_back(client);
+        return;
+      }
+    }
+    delete client;
+  }
+
+  int max_idle_clients_;
+  std::mutex mutex_;
+  std::vector<http_client*> idle_;
+};
+
+// The pool used by http_get, http_post, http_put and http_delete.
+inline http_client_pool& default_http_client_pool() {
+  static http_client_pool pool;
+  return pool;
+}
+
 template <typename... P> auto http_get(const std::string& url, P... params) {
-  return http_client{}.get(url, params...);
+  return default_http_client_pool().get(url, params...);
 }
 template <typename... P> auto http_post(const std::string& url, P... params) {
-  return http_client{}.post(url, params...);
+  return default_http_client_pool().post(url, params...);
 }
 template <typename... P> auto http_put(const std::string& url, P... params) {
-  return http_client{}.put(url, params...);
+  return default_http_client_pool().put(url, params...);
 }
 template <typename... P> auto http_delete(const std::string& url, P... params) {
-  return http_client{}.delete_(url, params...);
+  return default_http_client_pool().delete_(url, params...);
 }
 
 } // namespace li
@@ -5,6 +5,11 @@
     LI_SYMBOL(body)
 #endif
 
+#ifndef LI_SYMBOL_body_buffer
+#define LI_SYMBOL_body_buffer
+    LI_SYMBOL(body_buffer)
+#endif
+
 #ifndef LI_SYMBOL_disable_check_certificate
 #define LI_SYMBOL_disable_check_certificate
     LI_SYMBOL(disable_check_certificate)
@@ -30,6 +35,11 @@
     LI_SYMBOL(json_encoded)
 #endif
 
+#ifndef LI_SYMBOL_on_body
+#define LI_SYMBOL_on_body
+    LI_SYMBOL(on_body)
+#endif
+
 #ifndef LI_SYMBOL_post_parameters
 #define LI_SYMBOL_post_parameters
     LI_SYMBOL(post_parameters)
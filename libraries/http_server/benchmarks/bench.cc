@@ -223,6 +223,24 @@ auto make_api() {
 
     response.write_json(numbers);
   };
+  my_api.get("/queries-parallel") = [&](http_request& request, http_response& response) {
+    set_max_sql_connections_per_thread(queries_nconn);
+    std::string N_str = request.get_parameters(s::N = std::optional<std::string>()).N.value_or("1");
+    int N = atoi(N_str.c_str());
+
+    N = std::max(1, std::min(N, 500));
+
+    // Spread the lookups over child fibers, each with its own connection.
+    int n_children = std::min(N, 4);
+    std::vector<decltype(random_numbers.all_fields())> numbers(N);
+    fork_join(request.fiber, n_children, [&](async_fiber_context& child, int k) {
+      auto c = random_numbers.connect(child);
+      for (int i = k; i < N; i += n_children)
+        numbers[i] = c.find_one(s::id = 1 + rand() % 9990).value();
+    });
+
+    response.write_json(numbers);
+  };
   my_api.get("/querie2") = [&](http_request& request, http_response& response) {
     set_max_sql_connections_per_thread(queries_nconn);
     std::string N_str = request.get_parameters(s::N = std::optional<std::string>()).N.value_or("1");
@@ -0,0 +1,163 @@
+#include <lithium_http_server.hh>
+#include "symbols.hh"
+
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+using namespace li;
+
+// Compare the fiber server (http_serve) with the coroutine server (http_serve_coro):
+// resident memory per idle keep-alive connection, and requests per second.
+//
+// Usage: bench_coro_vs_fiber [N idle connections] [seconds]
+// Each server runs in a child process, on one thread, and only its memory is measured.
+// Needs -std=c++20.
+
+#if LITHIUM_COROUTINES
+
+long resident_memory(pid_t pid) {
+  long pages = 0, resident = 0;
+  std::string path = "/proc/" + std::to_string(pid) + "/statm";
+  FILE* f = fopen(path.c_str(), "r");
+  if (!f or 2 != fscanf(f, "%ld %ld", &pages, &resident))
+    resident = 0;
+  if (f)
+    fclose(f);
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+int connect_to(int port, int i) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  sockaddr_in source;
+  memset(&source, 0, sizeof(source));
+  source.sin_family = AF_INET;
+  source.sin_addr.s_addr = htonl(INADDR_LOOPBACK + 1 + i / 20000);
+  sockaddr_in server;
+  memset(&server, 0, sizeof(server));
+  server.sin_family = AF_INET;
+  server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  server.sin_port = htons(port);
+  if (bind(fd, (sockaddr*)&source, sizeof(source)) or
+      connect(fd, (sockaddr*)&server, sizeof(server))) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+const std::string request = "GET /hello HTTP/1.1\r\nHost: localhost\r\n\r\n";
+const std::string body = "hello world.";
+
+// Send one request on \fd and read its response.
+bool round_trip(int fd) {
+  if (send(fd, request.data(), request.size(), 0) != int(request.size()))
+    return false;
+  char buf[1000];
+  std::string response;
+  while (response.find(body) == std::string::npos) {
+    int n = recv(fd, buf, sizeof(buf), 0);
+    if (n <= 0)
+      return false;
+    response.append(buf, n);
+  }
+  return true;
+}
+
+// Open \n connections doing one request each, return the memory of \server per connection.
+long idle_memory_per_connection(pid_t server, int port, int n, std::vector<int>& sockets) {
+  long memory_start = resident_memory(server);
+  for (int i = 0; i < n; i++) {
+    int fd = connect_to(port, i);
+    if (fd < 0 or !round_trip(fd))
+      break;
+    sockets.push_back(fd);
+  }
+  usleep(500000);
+  if (sockets.empty())
+    return 0;
+  return (resident_memory(server) - memory_start) / long(sockets.size());
+}
+
+// Requests per second of 4 client threads with 16 connections each.
+double requests_per_second(int port, int seconds) {
+  std::atomic<long> total = 0;
+  std::atomic<bool> stop = false;
+  std::vector<std::thread> clients;
+  for (int t = 0; t < 4; t++)
+    clients.emplace_back([&] {
+      std::vector<int> fds;
+      for (int i = 0; i < 16; i++)
+        if (int fd = connect_to(port, 0); fd >= 0)
+          fds.push_back(fd);
+      long count = 0;
+      while (!stop)
+        for (int fd : fds)
+          count += round_trip(fd);
+      for (int fd : fds)
+        close(fd);
+      total += count;
+    });
+  sleep(seconds);
+  stop = true;
+  for (auto& t : clients)
+    t.join();
+  return double(total) / seconds;
+}
+
+template <typename F> void run(const char* name, int port, int n, int seconds, F start_server) {
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    start_server();
+    _exit(0);
+  }
+  usleep(300000);
+  std::vector<int> sockets;
+  long memory = idle_memory_per_connection(pid, port, n, sockets);
+  int n_idle = sockets.size();
+  for (int fd : sockets)
+    close(fd);
+  usleep(300000);
+  double rps = requests_per_second(port, seconds);
+  printf("%-10s %8d %20ld %15.0f\n", name, n_idle, memory, rps);
+  kill(pid, SIGKILL);
+  waitpid(pid, nullptr, 0);
+}
+
+int main(int argc, char* argv[]) {
+
+  int n = argc > 1 ? atoi(argv[1]) : 10000;
+  int seconds = argc > 2 ? atoi(argv[2]) : 5;
+
+  rlimit limit;
+  getrlimit(RLIMIT_NOFILE, &limit);
+  limit.rlim_cur = std::min<rlim_t>(limit.rlim_max, n + 1000);
+  setrlimit(RLIMIT_NOFILE, &limit);
+
+  printf("%-10s %8s %20s %15s\n", "server", "conns", "bytes/idle conn", "req/s");
+
+  run("fibers", 12371, n, seconds, [] {
+    http_api api;
+    api.get("/hello") = [&](http_request& request, http_response& response) {
+      response.write("hello world.");
+    };
+    http_serve(api, 12371, s::nthreads = 1);
+  });
+
+  run("coroutines", 12372, n, seconds, [] {
+    coro_http_api api;
+    api.get("/hello") = [&](coro_http_request& request,
+                            coro_http_response& response) -> coro_task<> {
+      response.write("hello world.");
+      co_return;
+    };
+    http_serve_coro(api, 12372, s::nthreads = 1);
+  });
+}
+
+#else
+int main() { std::cout << "Coroutines are not supported by this compiler." << std::endl; }
+#endif
@@ -0,0 +1,196 @@
+#include <lithium_http_server.hh>
+#include "symbols.hh"
+
+#include <dirent.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+using namespace li;
+
+// Cost of idle keep-alive connections.
+//
+// Opens N connections (default 10000, C100K with 100000, C1M with 1000000), sends one
+// request on each one and keeps them open. Then reports, for the server:
+//   - the rate at which it accepted the connections and answered their first request,
+//   - its resident memory per connection,
+//   - its CPU time and context switches (wakeups) while all the connections are idle,
+//   - the latency of a trickle of requests on a few active connections
+//     (http_benchmark_open_loop), while the idle connections stay open.
+//
+// Usage: bench_idle_connections [N] [active connections] [requests/s] [seconds]
+// Defaults: 10000 idle connections, 100 active ones, 1000 requests/s, 5 seconds.
+// More than ~28000 connections needs several source addresses: the connections are
+// spread over 127.0.0.2, 127.0.0.3, ... Raise the open files limit before running it
+// (ulimit -n 250000), and for C1M fs.nr_open and fs.file-max. The server runs in a child
+// process, on one thread.
+
+long resident_memory(pid_t pid) {
+  long pages = 0, resident = 0;
+  std::string path = "/proc/" + std::to_string(pid) + "/statm";
+  FILE* f = fopen(path.c_str(), "r");
+  if (!f or 2 != fscanf(f, "%ld %ld", &pages, &resident))
+    resident = 0;
+  if (f)
+    fclose(f);
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+// User and system CPU time of a process, in seconds.
+double cpu_time(pid_t pid) {
+  std::string path = "/proc/" + std::to_string(pid) + "/stat";
+  FILE* f = fopen(path.c_str(), "r");
+  if (!f)
+    return 0;
+  char buffer[1024];
+  size_t n = fread(buffer, 1, sizeof(buffer) - 1, f);
+  fclose(f);
+  buffer[n] = 0;
+  // utime and stime are the 12th and 13th fields after the command name.
+  const char* fields = strrchr(buffer, ')');
+  unsigned long utime = 0, stime = 0;
+  if (!fields or 2 != sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                             &utime, &stime))
+    return 0;
+  return double(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+// Context switches of all the threads of a process.
+long context_switches(pid_t pid) {
+  std::string tasks = "/proc/" + std::to_string(pid) + "/task";
+  DIR* dir = opendir(tasks.c_str());
+  if (!dir)
+    return 0;
+  long total = 0;
+  while (dirent* entry = readdir(dir)) {
+    if (entry->d_name[0] == '.')
+      continue;
+    FILE* f = fopen((tasks + "/" + entry->d_name + "/status").c_str(), "r");
+    if (!f)
+      continue;
+    char line[256];
+    long n;
+    while (fgets(line, sizeof(line), f))
+      if (1 == sscanf(line, "voluntary_ctxt_switches: %ld", &n) or
+          1 == sscanf(line, "nonvoluntary_ctxt_switches: %ld", &n))
+        total += n;
+    fclose(f);
+  }
+  closedir(dir);
+  return total;
+}
+
+int connect_to(int port, int i) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+
+  sockaddr_in source;
+  memset(&source, 0, sizeof(source));
+  source.sin_family = AF_INET;
+  source.sin_addr.s_addr = htonl(INADDR_LOOPBACK + 1 + i / 20000);
+  sockaddr_in server;
+  memset(&server, 0, sizeof(server));
+  server.sin_family = AF_INET;
+  server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  server.sin_port = htons(port);
+  if (bind(fd, (sockaddr*)&source, sizeof(source)) or
+      connect(fd, (sockaddr*)&server, sizeof(server))) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int main(int argc, char* argv[]) {
+
+  int N = argc > 1 ? atoi(argv[1]) : 10000;
+  int nactive = argc > 2 ? atoi(argv[2]) : 100;
+  int rate = argc > 3 ? atoi(argv[3]) : 1000;
+  int seconds = argc > 4 ? atoi(argv[4]) : 5;
+  int port = 12370;
+
+  rlimit limit;
+  getrlimit(RLIMIT_NOFILE, &limit);
+  rlim_t needed = N + nactive + 100;
+  limit.rlim_cur = std::min<rlim_t>(limit.rlim_max, needed);
+  setrlimit(RLIMIT_NOFILE, &limit);
+  if (limit.rlim_cur < needed)
+    std::cerr << "Warning: the open files limit (" << limit.rlim_cur
+              << ") is too low for " << N << " connections." << std::endl;
+
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    http_api api;
+    api.get("/hello") = [&](http_request& request, http_response& response) {
+      response.write("hello world.");
+    };
+    http_serve(api, port, s::nthreads = 1, s::tcp_nodelay = true);
+    _exit(0);
+  }
+  usleep(300000);
+
+  const std::string request = "GET /hello HTTP/1.1\r\nHost: localhost\r\n\r\n";
+  long memory_start = resident_memory(pid);
+
+  std::vector<int> sockets;
+  timer t;
+  t.start();
+  for (int i = 0; i < N; i++) {
+    int fd = connect_to(port, i);
+    if (fd < 0) {
+      std::cerr << "Cannot open connection " << i << ": " << strerror(errno) << std::endl;
+      break;
+    }
+    sockets.push_back(fd);
+
+    // One request, so the connection used its buffers once.
+    char buf[1000];
+    std::string response;
+    if (send(fd, request.data(), request.size(), 0) != int(request.size()))
+      break;
+    while (response.find("hello world.") == std::string::npos) {
+      int n = recv(fd, buf, sizeof(buf), 0);
+      if (n <= 0)
+        break;
+      response.append(buf, n);
+    }
+  }
+  t.end();
+  int n = sockets.size();
+
+  // Let the server go idle, then measure its memory and its activity.
+  usleep(500000);
+  long memory_idle = resident_memory(pid);
+  double cpu_start = cpu_time(pid);
+  long switches_start = context_switches(pid);
+  sleep(seconds);
+  double idle_cpu = (cpu_time(pid) - cpu_start) / seconds;
+  double idle_wakeups = double(context_switches(pid) - switches_start) / seconds;
+
+  printf("%d idle connections\n", n);
+  printf("accept rate: %.0f connections/s (connect and first request)\n",
+         n / std::max(1e-6, t.us() / 1e6));
+  printf("resident memory: %ld MB\n", (memory_idle - memory_start) / (1024 * 1024));
+  if (n)
+    printf("per connection: %ld bytes\n", (memory_idle - memory_start) / n);
+  printf("idle: %.2f%% cpu, %.1f wakeups/s\n", idle_cpu * 100, idle_wakeups);
+
+  // A trickle of requests on other connections, next to the idle ones.
+  if (nactive > 0 and rate > 0) {
+    cpu_start = cpu_time(pid);
+    auto result = http_benchmark_open_loop(
+        port, s::rate = rate, s::duration = seconds * 1000, s::connections = nactive,
+        s::poisson, s::requests = std::vector<std::string>{request});
+    printf("\n%d requests/s on %d active connections (latencies in microseconds), %.2f%% cpu\n",
+           rate, nactive, (cpu_time(pid) - cpu_start) / result.seconds * 100);
+    result.print({"/hello"});
+  }
+
+  kill(pid, SIGKILL);
+  waitpid(pid, nullptr, 0);
+  for (int fd : sockets)
+    close(fd);
+  return 0;
+}
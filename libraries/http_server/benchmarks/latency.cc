@@ -0,0 +1,73 @@
+#include <lithium_http_server.hh>
+#include "symbols.hh"
+
+#include <signal.h>
+#include <sys/wait.h>
+
+using namespace li;
+
+// Open-loop latency benchmark of http_serve, with and without busy polling.
+//
+// Usage: bench_latency [requests/s] [seconds] [connections] [busy poll us] [poisson|constant]
+//
+// Requests are sent on a fixed schedule whatever the response times, and latencies are
+// measured from the scheduled send time, so a slow response also counts the requests
+// queued behind it (see http_benchmark_open_loop). The server runs in a child process,
+// on one thread. The load mixes a plaintext and a json route, on keep-alive connections
+// without pipelining.
+
+template <typename F> void run(const char* name, int port, int rate, int seconds, int nconnections,
+                               bool poisson, F start_server) {
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    start_server();
+    _exit(0);
+  }
+  usleep(300000);
+  std::vector<std::string> requests = {"GET /hello HTTP/1.1\r\nHost: localhost\r\n\r\n",
+                                       "GET /json HTTP/1.1\r\nHost: localhost\r\n\r\n"};
+  std::vector<double> weights = {9, 1};
+  auto bench = [&](auto... arrivals) {
+    return http_benchmark_open_loop(port, s::rate = rate, s::duration = seconds * 1000,
+                                    s::connections = nconnections, s::requests = requests,
+                                    s::weights = weights, arrivals...);
+  };
+  auto result = poisson ? bench(s::poisson) : bench();
+  kill(pid, SIGKILL);
+  waitpid(pid, nullptr, 0);
+
+  printf("\n%s\n", name);
+  result.print({"/hello", "/json"});
+}
+
+int main(int argc, char* argv[]) {
+
+  int rate = argc > 1 ? atoi(argv[1]) : 10000;
+  int seconds = argc > 2 ? atoi(argv[2]) : 5;
+  int nconnections = argc > 3 ? atoi(argv[3]) : 10;
+  int busy_poll_us = argc > 4 ? atoi(argv[4]) : 50;
+  bool poisson = argc > 5 ? std::string(argv[5]) == "poisson" : true;
+
+  auto make_api = [] {
+    http_api api;
+    api.get("/hello") = [&](http_request& request, http_response& response) {
+      response.write("hello world.");
+    };
+    api.get("/json") = [&](http_request& request, http_response& response) {
+      response.write_json(s::message = "Hello, World!");
+    };
+    return api;
+  };
+
+  printf("%d requests/s (%s arrivals) on %d connections for %ds. Latencies in microseconds.\n",
+         rate, poisson ? "poisson" : "constant", nconnections, seconds);
+
+  run("epoll_wait(1ms)", 12373, rate, seconds, nconnections, poisson, [&] {
+    http_serve(make_api(), 12373, s::nthreads = 1, s::tcp_nodelay = true);
+  });
+  run("busy poll", 12374, rate, seconds, nconnections, poisson, [&] {
+    http_serve(make_api(), 12374, s::nthreads = 1, s::tcp_nodelay = true,
+               s::busy_poll = busy_poll_us);
+  });
+}
@@ -0,0 +1,287 @@
+#include <lithium_http_server.hh>
+#include <lithium_sqlite.hh>
+#include "symbols.hh"
+
+#include <fstream>
+
+using namespace li;
+
+// Microbenchmarks of the hot path components of the server.
+//
+// Usage: li_microbench [--filter substring] [--save file] [--baseline file] [--threshold %]
+//
+// Prints one json object per benchmark: {"name":"url_decode","ns_per_op":85.2,"iterations":...}.
+// --save writes these lines to a file. --baseline reads such a file, adds the baseline
+// time and the ratio to the output, and exits with 1 if a benchmark is slower than its
+// baseline by more than --threshold percent (default 10).
+//
+// Each benchmark runs batches of about 20ms and keeps the fastest batch, which is the
+// least disturbed by the rest of the machine. Compare results from the same machine.
+
+// Results are summed in a volatile so the compiler cannot skip the benchmarked code.
+static volatile size_t sink = 0;
+
+// Return the nanoseconds per operation of \f. One call of \f runs \ops operations.
+template <typename F> std::pair<double, long> measure(F f, int ops = 1) {
+  timer t;
+  long n = 1;
+  // Find a batch size lasting at least 20ms.
+  while (true) {
+    t.start();
+    for (long i = 0; i < n; i++)
+      sink += f();
+    t.end();
+    if (t.ns() > 20000000 or n > (1l << 30))
+      break;
+    n *= 2;
+  }
+  double best = double(t.ns()) / n;
+  for (int batch = 0; batch < 5; batch++) {
+    t.start();
+    for (long i = 0; i < n; i++)
+      sink += f();
+    t.end();
+    best = std::min(best, double(t.ns()) / n);
+  }
+  return {best / ops, n * 6 * ops};
+}
+
+// A connection serving pipelined requests from memory, and dropping the responses.
+struct memory_fiber {
+  int socket_fd = -1;
+  std::string_view input;
+  size_t position = 0;
+  size_t written = 0;
+
+  int read(char* buf, int max_size) {
+    int n = std::min(size_t(max_size), input.size() - position);
+    memcpy(buf, input.data() + position, n);
+    position += n;
+    return n;
+  }
+  int read_nowait(char* buf, int max_size) { return read(buf, max_size); }
+  bool write(const char* buf, int size, int flags = 0) {
+    written += size;
+    return true;
+  }
+  bool writev(iovec* iov, int iovcnt, int flags = 0) {
+    for (int i = 0; i < iovcnt; i++)
+      written += iov[i].iov_len;
+    return true;
+  }
+  void park() {}
+  bool is_closed() { return false; }
+};
+
+struct route_value {
+  int id = 0;
+  std::function<void()> handler;
+};
+
+int main(int argc, char* argv[]) {
+
+  std::string filter, save_path, baseline_path;
+  double threshold = 10;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string arg = argv[i];
+    if (arg == "--filter")
+      filter = argv[i + 1];
+    else if (arg == "--save")
+      save_path = argv[i + 1];
+    else if (arg == "--baseline")
+      baseline_path = argv[i + 1];
+    else if (arg == "--threshold")
+      threshold = atof(argv[i + 1]);
+    else {
+      std::cerr << "Unknown option " << arg << std::endl;
+      return 2;
+    }
+  }
+
+  std::unordered_map<std::string, double> baseline;
+  if (baseline_path.size()) {
+    std::ifstream f(baseline_path);
+    if (!f) {
+      std::cerr << "Cannot open " << baseline_path << std::endl;
+      return 2;
+    }
+    std::string line;
+    while (std::getline(f, line)) {
+      auto r = mmm(s::name = std::string(), s::ns_per_op = double(), s::iterations = long());
+      if (json_decode(line, r).good())
+        baseline[r.name] = r.ns_per_op;
+    }
+  }
+
+  std::ofstream save;
+  if (save_path.size())
+    save.open(save_path);
+
+  int regressions = 0;
+  auto bench = [&](const char* name, auto f, int ops = 1) {
+    if (filter.size() and std::string(name).find(filter) == std::string::npos)
+      return;
+    auto [ns, iterations] = measure(f, ops);
+    auto result = mmm(s::name = name, s::ns_per_op = ns, s::iterations = iterations);
+    if (save.is_open())
+      save << json_encode(result) << std::endl;
+    auto it = baseline.find(name);
+    if (it == baseline.end()) {
+      std::cout << json_encode(result) << std::endl;
+      return;
+    }
+    double ratio = ns / it->second;
+    std::cout << json_encode(mmm(s::name = name, s::ns_per_op = ns, s::iterations = iterations,
+                                 s::baseline = it->second, s::ratio = ratio))
+              << std::endl;
+    if (ratio > 1 + threshold / 100) {
+      std::cerr << name << ": " << int((ratio - 1) * 100) << "% slower than the baseline."
+                << std::endl;
+      regressions++;
+    }
+  };
+
+  // Header scan of make_http_processor on pipelined browser-like requests, without and
+  // with the indexing of the headers of every request.
+  std::string request = "GET /api/v1/users/42?fields=name,email HTTP/1.1\r\n"
+                        "Host: www.example.com\r\n"
+                        "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 "
+                        "Firefox/115.0\r\n"
+                        "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+                        "Accept-Language: en-US,en;q=0.5\r\n"
+                        "Accept-Encoding: gzip, deflate, br\r\n"
+                        "Referer: https://www.example.com/users\r\n"
+                        "Connection: keep-alive\r\n"
+                        "Cookie: session=0123456789abcdef0123456789abcdef; theme=dark\r\n"
+                        "Upgrade-Insecure-Requests: 1\r\n"
+                        "Cache-Control: max-age=0\r\n"
+                        "\r\n";
+  const int pipelined = 100;
+  std::string requests;
+  for (int i = 0; i < pipelined; i++)
+    requests += request;
+
+  auto scan = [&](auto handler) {
+    return [&requests, handler] {
+      memory_fiber fiber{-1, requests};
+      http_async_impl::make_http_processor(handler)(fiber);
+      return fiber.position;
+    };
+  };
+  bench("header_scan", scan([](auto& ctx) {}), pipelined);
+  bench("header_scan+index_headers",
+        scan([](auto& ctx) { sink += ctx.header("User-Agent").size(); }), pipelined);
+
+  // The same requests through an api: parsing, routing, handler and json response.
+  http_api api;
+  api.get("/api/v1/users/{{id}}") = [](http_request& request, http_response& response) {
+    auto params = request.url_parameters(s::id = int());
+    response.write_json(s::id = params.id, s::name = "John Doe", s::email = "john@example.com");
+  };
+  http_injector inject(api);
+  bench("api_end_to_end", [&] { return inject(requests).size(); }, pipelined);
+
+  // Routing table of a REST api with 300 routes.
+  const char* resources[] = {"users", "posts", "comments", "orders", "products", "invoices",
+                             "customers", "sessions", "tags", "files"};
+  dynamic_routing_table<route_value> table;
+  std::vector<std::string> urls;
+  for (int version = 1; version <= 5; version++)
+    for (auto r : resources) {
+      std::string prefix = "/api/v" + std::to_string(version) + "/" + r;
+      for (auto suffix : {"", "/{{id}}", "/{{id}}/history", "/{{id}}/owner", "/search", "/count"})
+        table[prefix + suffix] = route_value{1, [] {}};
+      urls.push_back(prefix);
+      urls.push_back(prefix + "/42");
+      urls.push_back(prefix + "/42/history");
+      urls.push_back(prefix + "/search");
+    }
+  urls.push_back("/not/found");
+  bench("dynamic_routing_table::find",
+        [&] {
+          size_t found = 0;
+          for (auto& url : urls)
+            found += table.find(url, [](const route_value& v) { return v.handler != nullptr; }) !=
+                     table.end();
+          return found;
+        },
+        urls.size());
+
+  // Query string of a form.
+  std::string query = "name=John%20Doe&email=john.doe%40example.com&age=42&id=123456&"
+                      "message=Hello+from+the+other+side";
+  bench("url_decode", [&] {
+    auto params = mmm(s::name = std::string(), s::email = std::string(), s::age = int(),
+                      s::id = int(), s::message = std::string());
+    url_decode(query, params);
+    return params.name.size() + params.age;
+  });
+
+  // url_unescape works in place: restore the input before each call.
+  std::string escaped = "%2Fstatic%2Fimages%2Fmy%20photo%20%281%29.jpg";
+  std::string unescape_buffer = escaped;
+  bench("url_unescape", [&] {
+    memcpy(unescape_buffer.data(), escaped.data(), escaped.size());
+    return url_unescape(std::string_view(unescape_buffer.data(), escaped.size())).size();
+  });
+
+  // A page of 20 users.
+  typedef decltype(mmm(s::id = int(), s::name = std::string(), s::email = std::string(),
+                       s::age = int(), s::tags = std::vector<std::string>())) user;
+  std::vector<user> users;
+  for (int i = 0; i < 20; i++)
+    users.push_back(mmm(s::id = i, s::name = "User " + std::to_string(i),
+                        s::email = "user" + std::to_string(i) + "@example.com", s::age = 20 + i,
+                        s::tags = std::vector<std::string>{"admin", "beta \"tester\""}));
+  output_buffer json_buffer(64 * 1024);
+  bench("json_encode", [&] {
+    json_buffer.reset();
+    json_encode(json_buffer, users);
+    return json_buffer.to_string_view().size();
+  });
+  std::string users_json = json_encode(users);
+  bench("json_decode", [&] {
+    std::vector<user> decoded;
+    json_decode(users_json, decoded);
+    return decoded.size();
+  });
+
+  std::string text = "Line 1\n\t\"quoted\" back\\slash, caf\xc3\xa9 \xe6\x97\xa5\xe6\x9c\xac "
+                     "and a long enough ascii tail to be representative of user content.";
+  bench("utf8_to_json", [&] {
+    json_buffer.reset();
+    utf8_to_json(text, json_buffer);
+    return json_buffer.to_string_view().size();
+  });
+
+  // Response header formatting.
+  output_buffer headers(4096);
+  bench("output_buffer", [&] {
+    headers.reset();
+    headers << "HTTP/1.1 200 OK\r\nContent-Length: " << 1234 << "\r\nContent-Type: "
+            << "application/json" << "\r\nX-Request-Id: " << 1234567890123ll
+            << "\r\nX-Load: " << 0.75 << "\r\n\r\n";
+    return headers.to_string_view().size();
+  });
+
+  // Reads of 1000 rows in metamaps from an in memory sqlite database.
+  auto db = sqlite_database(":memory:");
+  auto c = db.connect();
+  c("CREATE TABLE rows (id INTEGER PRIMARY KEY, randomNumber INTEGER, message TEXT);");
+  c("BEGIN;");
+  auto insert = c.prepare("INSERT INTO rows (id, randomNumber, message) VALUES (?, ?, ?);");
+  for (int i = 1; i <= 1000; i++)
+    insert(i, i * 7919 % 10000, "message number " + std::to_string(i));
+  c("COMMIT;");
+  auto select = c.prepare("SELECT id, randomNumber, message FROM rows;");
+  typedef decltype(mmm(s::id = int(), s::randomNumber = int(), s::message = std::string())) row;
+  bench("sql_metamap_row_read",
+        [&] {
+          size_t sum = 0;
+          select().map([&](const row& r) { sum += r.randomNumber + r.message.size(); });
+          return sum;
+        },
+        1000);
+
+  return regressions ? 1 : 0;
+}
@@ -0,0 +1,247 @@
+#include <lithium_http_server.hh>
+#include "symbols.hh"
+
+#include <map>
+
+using namespace li;
+
+// Replay a traffic capture (see traffic_capture and the s::capture option of http_serve)
+// against a server, and report the latency of each route and the responses whose status
+// differs from the captured one.
+//
+// Usage: bench_replay capture_file port [speed] [connections] [host]
+//
+// speed: 1 replays the requests at their captured times, N is N times faster, max sends
+// them as fast as the server answers. Each captured connection is replayed on its own
+// keep-alive connection, with its requests in order, at most \connections (default 256)
+// at a time. Latencies are measured from the scheduled send time (from the send time at
+// max speed), in microseconds.
+
+struct route_stats {
+  hdr_histogram latency;
+  long long mismatches = 0;
+};
+
+int main(int argc, char* argv[]) {
+
+  if (argc < 3) {
+    std::cerr << "Usage: " << argv[0] << " capture_file port [1|N|max] [connections] [host]"
+              << std::endl;
+    return 1;
+  }
+  typedef std::chrono::steady_clock clock;
+  using namespace http_benchmark_impl;
+
+  std::string speed_arg = argc > 3 ? argv[3] : "1";
+  bool max_speed = speed_arg == "max";
+  double speed = max_speed ? 0 : atof(speed_arg.c_str());
+  int max_connections = argc > 4 ? atoi(argv[4]) : 256;
+  std::string host = argc > 5 ? argv[5] : "127.0.0.1";
+  if (!max_speed and speed <= 0) {
+    std::cerr << "Invalid speed " << speed_arg << std::endl;
+    return 1;
+  }
+
+  sockaddr_in server;
+  memset(&server, 0, sizeof(server));
+  server.sin_family = AF_INET;
+  server.sin_addr.s_addr = inet_addr(host.c_str());
+  server.sin_port = htons(atoi(argv[2]));
+
+  // The requests, grouped by captured connection, in the order of their first request.
+  std::vector<traffic_record> records;
+  {
+    traffic_capture_reader reader(argv[1]);
+    traffic_record r;
+    while (reader.next(r))
+      records.push_back(std::move(r));
+  }
+  if (records.empty()) {
+    std::cerr << "No request in " << argv[1] << std::endl;
+    return 1;
+  }
+  std::sort(records.begin(), records.end(),
+            [](auto& a, auto& b) { return a.time < b.time; });
+  int64_t first_time = records.front().time;
+
+  struct connection {
+    std::vector<int> requests;
+    size_t next = 0;
+    int fd = -1;
+    bool in_flight = false;
+    clock::time_point sent;
+    clock::time_point scheduled;
+    std::string input;
+    std::string output;
+    response_reader reader;
+  };
+  std::vector<connection> connections;
+  std::unordered_map<uint32_t, int> connection_index;
+  for (int i = 0; i < int(records.size()); i++) {
+    auto it = connection_index.find(records[i].connection);
+    if (it == connection_index.end()) {
+      it = connection_index.emplace(records[i].connection, connections.size()).first;
+      connections.emplace_back();
+    }
+    connections[it->second].requests.push_back(i);
+  }
+
+  // Routes: method and path, without the query string.
+  std::vector<std::string> routes(records.size());
+  for (size_t i = 0; i < records.size(); i++) {
+    const std::string& r = records[i].request;
+    size_t path_end = r.find_first_of("? ", r.find(' ') + 1);
+    routes[i] = r.substr(0, std::min(path_end, r.find('\r')));
+  }
+  std::map<std::string, route_stats> stats;
+  long long completed = 0, errors = 0, mismatches = 0;
+
+  auto start = clock::now();
+  auto due = [&](int request) {
+    if (max_speed)
+      return start;
+    return start + std::chrono::duration_cast<clock::duration>(std::chrono::nanoseconds(
+                       int64_t((records[request].time - first_time) / speed)));
+  };
+
+  int epoll_fd = epoll_create1(0);
+  std::vector<int> active;  // Indexes of the open connections.
+  size_t next_connection = 0; // Next connection to open.
+
+  auto close_connection = [&](int i) {
+    connection& c = connections[i];
+    close(c.fd);
+    c.fd = -1;
+    active.erase(std::find(active.begin(), active.end(), i));
+  };
+  // A failed connection loses its remaining requests.
+  auto fail = [&](int i) {
+    connection& c = connections[i];
+    errors += c.requests.size() - c.next;
+    c.next = c.requests.size();
+    close_connection(i);
+  };
+  auto flush = [&](connection& c) {
+    while (c.output.size()) {
+      ssize_t n = ::send(c.fd, c.output.data(), c.output.size(), MSG_NOSIGNAL);
+      if (n <= 0)
+        return n < 0 and errno == EAGAIN;
+      c.output.erase(0, n);
+    }
+    return true;
+  };
+
+  epoll_event events[64];
+  while (next_connection < connections.size() or active.size()) {
+    auto now = clock::now();
+
+    // Open the connections whose first request is due.
+    while (next_connection < connections.size() and int(active.size()) < max_connections and
+           due(connections[next_connection].requests[0]) <= now) {
+      int i = next_connection++;
+      connection& c = connections[i];
+      c.fd = connect_blocking(server);
+      if (c.fd < 0) {
+        errors += c.requests.size();
+        c.next = c.requests.size();
+        continue;
+      }
+      epoll_event event;
+      event.data.u32 = i;
+      event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+      ::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c.fd, &event);
+      active.push_back(i);
+    }
+
+    // Send the requests that are due.
+    auto next_due = clock::time_point::max();
+    for (size_t k = 0; k < active.size(); k++) {
+      int i = active[k];
+      connection& c = connections[i];
+      if (c.in_flight)
+        continue;
+      auto scheduled = due(c.requests[c.next]);
+      if (scheduled > now) {
+        next_due = std::min(next_due, scheduled);
+        continue;
+      }
+      c.in_flight = true;
+      c.scheduled = scheduled;
+      c.sent = now;
+      c.output += records[c.requests[c.next]].request;
+      if (!flush(c)) {
+        fail(i);
+        k--;
+      }
+    }
+    if (next_connection < connections.size())
+      next_due = std::min(next_due, due(connections[next_connection].requests[0]));
+
+    auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(next_due - now);
+    int timeout = next_due == clock::time_point::max() ? 100 : std::max(0, int(wait.count()) - 1);
+    int n = epoll_wait(epoll_fd, events, 64, timeout);
+    now = clock::now();
+    for (int e = 0; e < n; e++) {
+      int i = events[e].data.u32;
+      connection& c = connections[i];
+      if (c.fd < 0)
+        continue;
+      if (events[e].events & EPOLLOUT and !flush(c)) {
+        fail(i);
+        continue;
+      }
+      bool closed = events[e].events & (EPOLLERR | EPOLLHUP);
+      char buf[65536];
+      while (!closed) {
+        ssize_t r = ::recv(c.fd, buf, sizeof(buf), 0);
+        if (r > 0)
+          c.input.append(buf, r);
+        else {
+          closed = r == 0 or errno != EAGAIN;
+          break;
+        }
+      }
+      c.reader.feed(
+          c.input,
+          [&] {
+            return c.next < c.requests.size() and
+                   routes[c.requests[c.next]].compare(0, 5, "HEAD ") == 0;
+          },
+          [&](int status) {
+            if (!c.in_flight)
+              return;
+            int request = c.requests[c.next];
+            route_stats& route = stats[routes[request]];
+            route.latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                     now - (max_speed ? c.sent : c.scheduled))
+                                     .count());
+            if (status != records[request].status) {
+              route.mismatches++;
+              mismatches++;
+            }
+            completed++;
+            c.in_flight = false;
+            c.next++;
+          });
+      if (c.next == c.requests.size())
+        close_connection(i);
+      else if (closed)
+        fail(i);
+    }
+  }
+  double seconds = std::chrono::duration<double>(clock::now() - start).count();
+  close(epoll_fd);
+
+  printf("%lld requests on %zu connections in %.2fs: %.0f requests/s, %lld errors, %lld "
+         "status mismatches\n",
+         (long long)records.size(), connections.size(), seconds, completed / seconds, errors,
+         mismatches);
+  printf("%-32s %8s %9s %9s %9s %9s %10s\n", "route", "count", "p50", "p99", "p999", "max",
+         "mismatches");
+  for (auto& [route, s] : stats)
+    printf("%-32s %8lld %9.1f %9.1f %9.1f %9.1f %10lld\n", route.c_str(),
+           (long long)s.latency.count(), s.latency.value_at_percentile(50) / 1e3,
+           s.latency.value_at_percentile(99) / 1e3, s.latency.value_at_percentile(99.9) / 1e3,
+           s.latency.max() / 1e3, s.mismatches);
+  return errors or mismatches ? 1 : 0;
+}
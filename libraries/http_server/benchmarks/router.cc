@@ -0,0 +1,75 @@
+#include <lithium_http_server.hh>
+#include "symbols.hh"
+
+using namespace li;
+
+// Compare the lookup speed of dynamic_routing_table and radix_router on a
+// REST like api with hundreds of routes.
+
+struct value {
+  int id = 0;
+};
+
+int main() {
+
+  const char* resources[] = {"users", "posts", "comments", "orders", "products", "invoices",
+                             "customers", "sessions", "tags", "files"};
+
+  std::vector<std::string> routes;
+  for (int version = 1; version <= 5; version++)
+    for (auto r : resources) {
+      std::string prefix = "/api/v" + std::to_string(version) + "/" + r;
+      routes.push_back(prefix);
+      routes.push_back(prefix + "/{{id}}");
+      routes.push_back(prefix + "/{{id}}/history");
+      routes.push_back(prefix + "/{{id}}/owner");
+      routes.push_back(prefix + "/search");
+      routes.push_back(prefix + "/count");
+    }
+  routes.push_back("/static/{{path...}}");
+
+  dynamic_routing_table<value> table;
+  for (int i = 0; i < int(routes.size()); i++)
+    table[routes[i]] = value{i + 1};
+  auto has_value = [](const value& v) { return v.id != 0; };
+  radix_router<value> router(table, has_value);
+
+  std::vector<std::string> urls;
+  for (int version = 1; version <= 5; version++)
+    for (auto r : resources) {
+      std::string prefix = "/api/v" + std::to_string(version) + "/" + r;
+      urls.push_back(prefix);
+      urls.push_back(prefix + "/42");
+      urls.push_back(prefix + "/42/history");
+      urls.push_back(prefix + "/search");
+    }
+  urls.push_back("/static/js/app.js");
+  urls.push_back("/not/found");
+
+  const int N = 10000;
+  long checksum = 0;
+
+  timer t;
+  t.start();
+  for (int i = 0; i < N; i++)
+    for (auto& url : urls) {
+      auto it = table.find(url, has_value);
+      if (it != table.end())
+        checksum += it->second.id;
+    }
+  t.end();
+  std::cout << "dynamic_routing_table: " << double(t.ns()) / (N * urls.size()) << "ns/lookup"
+            << std::endl;
+
+  t.start();
+  route_params params;
+  for (int i = 0; i < N; i++)
+    for (auto& url : urls)
+      if (auto* v = router.find(url, params))
+        checksum -= v->id;
+  t.end();
+  std::cout << "radix_router: " << double(t.ns()) / (N * urls.size()) << "ns/lookup" << std::endl;
+
+  std::cout << routes.size() << " routes, checksum " << checksum << std::endl;
+  return checksum != 0;
+}
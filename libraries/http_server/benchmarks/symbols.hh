@@ -15,16 +15,41 @@
     LI_SYMBOL(auto_increment)
 #endif
 
+#ifndef LI_SYMBOL_baseline
+#define LI_SYMBOL_baseline
+    LI_SYMBOL(baseline)
+#endif
+
+#ifndef LI_SYMBOL_busy_poll
+#define LI_SYMBOL_busy_poll
+    LI_SYMBOL(busy_poll)
+#endif
+
 #ifndef LI_SYMBOL_charset
 #define LI_SYMBOL_charset
     LI_SYMBOL(charset)
 #endif
 
+#ifndef LI_SYMBOL_connections
+#define LI_SYMBOL_connections
+    LI_SYMBOL(connections)
+#endif
+
 #ifndef LI_SYMBOL_database
 #define LI_SYMBOL_database
     LI_SYMBOL(database)
 #endif
 
+#ifndef LI_SYMBOL_duration
+#define LI_SYMBOL_duration
+    LI_SYMBOL(duration)
+#endif
+
+#ifndef LI_SYMBOL_email
+#define LI_SYMBOL_email
+    LI_SYMBOL(email)
+#endif
+
 #ifndef LI_SYMBOL_host
 #define LI_SYMBOL_host
     LI_SYMBOL(host)
@@ -35,16 +60,31 @@
     LI_SYMBOL(id)
 #endif
 
+#ifndef LI_SYMBOL_iterations
+#define LI_SYMBOL_iterations
+    LI_SYMBOL(iterations)
+#endif
+
 #ifndef LI_SYMBOL_message
 #define LI_SYMBOL_message
     LI_SYMBOL(message)
 #endif
 
+#ifndef LI_SYMBOL_name
+#define LI_SYMBOL_name
+    LI_SYMBOL(name)
+#endif
+
 #ifndef LI_SYMBOL_non_blocking
 #define LI_SYMBOL_non_blocking
     LI_SYMBOL(non_blocking)
 #endif
 
+#ifndef LI_SYMBOL_ns_per_op
+#define LI_SYMBOL_ns_per_op
+    LI_SYMBOL(ns_per_op)
+#endif
+
 #ifndef LI_SYMBOL_nthreads
 #define LI_SYMBOL_nthreads
     LI_SYMBOL(nthreads)
@@ -55,6 +95,11 @@
     LI_SYMBOL(password)
 #endif
 
+#ifndef LI_SYMBOL_poisson
+#define LI_SYMBOL_poisson
+    LI_SYMBOL(poisson)
+#endif
+
 #ifndef LI_SYMBOL_port
 #define LI_SYMBOL_port
     LI_SYMBOL(port)
@@ -70,8 +115,38 @@
     LI_SYMBOL(randomNumber)
 #endif
 
+#ifndef LI_SYMBOL_rate
+#define LI_SYMBOL_rate
+    LI_SYMBOL(rate)
+#endif
+
+#ifndef LI_SYMBOL_ratio
+#define LI_SYMBOL_ratio
+    LI_SYMBOL(ratio)
+#endif
+
+#ifndef LI_SYMBOL_requests
+#define LI_SYMBOL_requests
+    LI_SYMBOL(requests)
+#endif
+
+#ifndef LI_SYMBOL_tags
+#define LI_SYMBOL_tags
+    LI_SYMBOL(tags)
+#endif
+
+#ifndef LI_SYMBOL_tcp_nodelay
+#define LI_SYMBOL_tcp_nodelay
+    LI_SYMBOL(tcp_nodelay)
+#endif
+
 #ifndef LI_SYMBOL_user
 #define LI_SYMBOL_user
     LI_SYMBOL(user)
 #endif
 
+#ifndef LI_SYMBOL_weights
+#define LI_SYMBOL_weights
+    LI_SYMBOL(weights)
+#endif
+
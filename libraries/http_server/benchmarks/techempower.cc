@@ -0,0 +1,253 @@
+#include <lithium_http_server.hh>
+#include <lithium_pgsql.hh>
+#include <lithium_sqlite.hh>
+#include "symbols.hh"
+
+#include <signal.h>
+#include <sys/wait.h>
+
+using namespace li;
+
+// The database endpoints of the TechEmpower benchmark (/db, /queries, /updates, /fortunes,
+// /cached-worlds) without a database server to set up.
+//
+// Usage: bench_techempower [seconds per step] [p99 limit in ms] [connections]
+//
+// The tables live in an in-memory sqlite database, unless a postgres server answers with
+// the PGHOST, PGPORT, PGUSER, PGPASSWORD and PGDATABASE environment variables (default:
+// postgres@127.0.0.1:5432/postgres). The World and Fortune tables are created and filled
+// if they are empty.
+//
+// For each endpoint, the driver doubles the rate of an open-loop load (see
+// http_benchmark_open_loop) until the server drops requests or the p99 latency exceeds the
+// limit, and reports the highest rate it sustained with its latencies. The server runs in
+// a child process.
+
+template <typename B> void escape_html_entities(B& buffer, const std::string& data) {
+  for (char c : data) {
+    switch (c) {
+    case '&':
+      buffer << "&amp;";
+      break;
+    case '\"':
+      buffer << "&quot;";
+      break;
+    case '\'':
+      buffer << "&apos;";
+      break;
+    case '<':
+      buffer << "&lt;";
+      break;
+    case '>':
+      buffer << "&gt;";
+      break;
+    default:
+      buffer << c;
+      break;
+    }
+  }
+}
+
+int query_count(http_request& request) {
+  auto N = request.get_parameters(s::N = std::optional<std::string>()).N;
+  return std::max(1, std::min(atoi(N.value_or("1").c_str()), 500));
+}
+
+template <typename DB> auto make_api(DB& db) {
+  auto worlds = sql_orm_schema(db, "World")
+                    .fields(s::id(s::auto_increment, s::primary_key) = int(),
+                            s::randomNumber = int());
+  auto fortunes = sql_orm_schema(db, "Fortune")
+                      .fields(s::id(s::auto_increment, s::primary_key) = int(),
+                              s::message = std::string());
+  typedef decltype(worlds.all_fields()) world;
+  typedef decltype(fortunes.all_fields()) fortune;
+
+  // Create and fill the tables.
+  {
+    auto c = worlds.connect();
+    c.create_table_if_not_exists();
+    if (c.count() == 0) {
+      c.backend_connection()("BEGIN");
+      for (int i = 1; i <= 10000; i++)
+        c.insert(s::randomNumber = 1 + rand() % 10000);
+      c.backend_connection()("COMMIT");
+    }
+  }
+  {
+    auto c = fortunes.connect();
+    c.create_table_if_not_exists();
+    if (c.count() == 0)
+      for (const char* message :
+           {"fortune: No such file or directory",
+            "A computer scientist is someone who fixes things that aren't broken.",
+            "After enough decimal places, nobody gives a damn.",
+            "A bad random number generator: 1, 1, 1, 1, 1, 4.33e+67, 1, 1, 1",
+            "A computer program does what you tell it to do, not what you want it to do.",
+            "Emacs is a nice operating system, but I prefer UNIX. \xe2\x80\x94 Tom Christaensen",
+            "Any program that runs right is obsolete.",
+            "A list is only as strong as its weakest link. \xe2\x80\x94 Donald Knuth",
+            "Feature: A bug with seniority.", "Computers make very fast, very accurate mistakes.",
+            "<script>alert(\"This should not be displayed in a browser alert box.\");</script>",
+            "\xe3\x83\x95\xe3\x83\xac\xe3\x83\xbc\xe3\x83\xa0\xe3\x83\xaf\xe3\x83\xbc\xe3\x82\xaf"
+            "\xe3\x81\xae\xe3\x83\x99\xe3\x83\xb3\xe3\x83\x81\xe3\x83\x9e\xe3\x83\xbc\xe3\x82\xaf"})
+        c.insert(s::message = std::string(message));
+  }
+
+  auto cache = std::make_shared<std::vector<world>>();
+  worlds.connect().forall([&](const auto& w) { cache->push_back(metamap_clone(w)); });
+
+  http_api api;
+  api.get("/db") = [=](http_request& request, http_response& response) mutable {
+    response.write_json(
+        worlds.connect(request.fiber).find_one(s::id = 1 + rand() % 10000).value());
+  };
+  api.get("/queries") = [=](http_request& request, http_response& response) mutable {
+    int N = query_count(request);
+    std::vector<world> numbers(N);
+    auto c = worlds.connect(request.fiber);
+    for (int i = 0; i < N; i++)
+      numbers[i] = c.find_one(s::id = 1 + rand() % 10000).value();
+    response.write_json(numbers);
+  };
+  api.get("/updates") = [=](http_request& request, http_response& response) mutable {
+    int N = query_count(request);
+    std::vector<world> numbers(N);
+    auto c = worlds.connect(request.fiber);
+    for (int i = 0; i < N; i++) {
+      numbers[i] = c.find_one(s::id = 1 + rand() % 10000).value();
+      numbers[i].randomNumber = 1 + rand() % 10000;
+    }
+    // Sorted ids avoid deadlocks between concurrent updates.
+    std::sort(numbers.begin(), numbers.end(), [](auto& a, auto& b) { return a.id < b.id; });
+    c.bulk_update(numbers);
+    response.write_json(numbers);
+  };
+  api.get("/fortunes") = [=](http_request& request, http_response& response) mutable {
+    std::vector<fortune> table = {
+        fortune(0, std::string("Additional fortune added at request time."))};
+    fortunes.connect(request.fiber).forall([&](const auto& f) {
+      table.emplace_back(metamap_clone(f));
+    });
+    std::sort(table.begin(), table.end(),
+              [](const fortune& a, const fortune& b) { return a.message < b.message; });
+
+    char b[16 * 1024];
+    output_buffer ss(b, sizeof(b));
+    ss << "<!DOCTYPE html><html><head><title>Fortunes</title></head><body><table><tr><th>id</"
+          "th><th>message</th></tr>";
+    for (auto& f : table) {
+      ss << "<tr><td>" << f.id << "</td><td>";
+      escape_html_entities(ss, f.message);
+      ss << "</td></tr>";
+    }
+    ss << "</table></body></html>";
+    response.set_header("Content-Type", "text/html; charset=utf-8");
+    response.write(ss.to_string_view());
+  };
+  api.get("/cached-worlds") = [=](http_request& request, http_response& response) mutable {
+    int N = query_count(request);
+    std::vector<const world*> numbers(N);
+    for (int i = 0; i < N; i++)
+      numbers[i] = &(*cache)[rand() % cache->size()];
+    response.write_json(numbers);
+  };
+  return api;
+}
+
+std::string env(const char* name, const char* default_value) {
+  const char* v = getenv(name);
+  return std::string(v ? v : default_value);
+}
+
+// Connection string of the postgres server, if one answers.
+std::optional<std::string> discover_postgres() {
+  std::string conninfo = "host=" + env("PGHOST", "127.0.0.1") + " port=" + env("PGPORT", "5432") +
+                         " user=" + env("PGUSER", "postgres") +
+                         " dbname=" + env("PGDATABASE", "postgres") + " connect_timeout=1";
+  if (PQping(conninfo.c_str()) != PQPING_OK)
+    return std::nullopt;
+  return conninfo;
+}
+
+bool wait_for_server(int port) {
+  sockaddr_in server;
+  memset(&server, 0, sizeof(server));
+  server.sin_family = AF_INET;
+  server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  server.sin_port = htons(port);
+  for (int i = 0; i < 300; i++) {
+    int fd = http_benchmark_impl::connect_blocking(server);
+    if (fd >= 0) {
+      close(fd);
+      return true;
+    }
+    usleep(100000);
+  }
+  return false;
+}
+
+int main(int argc, char* argv[]) {
+
+  int step_seconds = argc > 1 ? atoi(argv[1]) : 2;
+  double p99_limit_ms = argc > 2 ? atof(argv[2]) : 10;
+  int nconnections = argc > 3 ? atoi(argv[3]) : 32;
+  int port = 12375;
+
+  auto postgres = discover_postgres();
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    if (postgres) {
+      auto db = pgsql_database(s::host = env("PGHOST", "127.0.0.1"),
+                               s::port = atoi(env("PGPORT", "5432").c_str()),
+                               s::user = env("PGUSER", "postgres"),
+                               s::password = env("PGPASSWORD", ""),
+                               s::database = env("PGDATABASE", "postgres"));
+      http_serve(make_api(db), port,
+                 s::nthreads = std::max(1, int(std::thread::hardware_concurrency()) / 2));
+    } else {
+      // One connection serializes the queries: a single server thread.
+      auto db = sqlite_database(":memory:");
+      http_serve(make_api(db), port, s::nthreads = 1);
+    }
+    _exit(0);
+  }
+  if (!wait_for_server(port)) {
+    kill(pid, SIGKILL);
+    std::cerr << "The server did not start." << std::endl;
+    return 1;
+  }
+
+  printf("%s, %d connections, %ds per step, p99 limit %.1fms. Latencies in microseconds.\n",
+         postgres ? postgres->c_str() : "sqlite in memory", nconnections, step_seconds,
+         p99_limit_ms);
+  printf("%-24s %12s %9s %9s %9s\n", "endpoint", "requests/s", "p50", "p99", "max");
+
+  for (std::string url : {"/db", "/queries?N=20", "/updates?N=20", "/fortunes",
+                          "/cached-worlds?N=100"}) {
+    std::string request = "GET " + url + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    double best_rate = 0;
+    http_benchmark_result best;
+    for (double rate = 250; rate < 4e6; rate *= 2) {
+      auto result = http_benchmark_open_loop(
+          port, s::rate = rate, s::duration = step_seconds * 1000, s::connections = nconnections,
+          s::nthreads = 2, s::poisson, s::requests = std::vector<std::string>{request});
+      if (result.errors or result.bad_status or result.completed < result.scheduled or
+          result.latency.value_at_percentile(99) > p99_limit_ms * 1e6)
+        break;
+      best_rate = result.completed / result.seconds;
+      best = result;
+    }
+    if (best_rate == 0)
+      printf("%-24s %12s\n", url.c_str(), "overloaded");
+    else
+      printf("%-24s %12.0f %9.1f %9.1f %9.1f\n", url.c_str(), best_rate,
+             best.latency.value_at_percentile(50) / 1e3,
+             best.latency.value_at_percentile(99) / 1e3, best.latency.max() / 1e3);
+    fflush(stdout);
+  }
+
+  kill(pid, SIGKILL);
+  waitpid(pid, nullptr, 0);
+}
@@ -0,0 +1,234 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include <li/http_server/error.hh>
+#include <li/http_server/fiber_sync.hh>
+#include <li/http_server/request.hh>
+#include <li/http_server/response.hh>
+#include <li/http_server/symbols.hh>
+#include <li/metamap/metamap.hh>
+
+namespace li {
+
+// CoDel (Nichols & Jacobson) adapted to request queues.
+// A queue is overloaded when its smallest queueing delay stayed above \target during a whole
+// \interval: a good queue drains at least once per interval, a standing queue never does.
+// Requests may wait \interval in a good queue, but only \target in an overloaded one.
+struct codel_controller {
+  typedef std::chrono::steady_clock clock;
+
+  codel_controller(std::chrono::microseconds target = std::chrono::milliseconds(5),
+                   std::chrono::microseconds interval = std::chrono::milliseconds(100))
+      : target(target), interval(interval) {}
+
+  // Longest time a request may wait now.
+  std::chrono::microseconds max_delay() const { return overloaded ? target : interval; }
+
+  // Record the queueing delay of a request. Return false if it must be shed.
+  bool admit(clock::duration delay, clock::time_point now = clock::now()) {
+    if (now >= interval_end) {
+      overloaded = interval_end != clock::time_point() and min_delay > target;
+      min_delay = clock::duration::max();
+      interval_end = now + interval;
+    }
+    min_delay = std::min(min_delay, delay);
+    return delay <= max_delay();
+  }
+
+  std::chrono::microseconds target;
+  std::chrono::microseconds interval;
+  bool overloaded = false;
+  clock::duration min_delay = clock::duration::max();
+  clock::time_point interval_end;
+};
+
+namespace impl {
+
+// Identity of an object having per-thread states (see thread_local_state).
+// Ids are never reused, unlike addresses: an object allocated where a destroyed one was
+// does not find its states. A copy gets a new id.
+struct thread_local_key {
+  thread_local_key() : id(next_id()), alive(std::make_shared<char>()) {}
+  thread_local_key(const thread_local_key&) : thread_local_key() {}
+  thread_local_key& operator=(const thread_local_key&) { return *this; }
+
+  static uint64_t next_id() {
+    static std::atomic<uint64_t> counter{0};
+    return ++counter;
+  }
+
+  uint64_t id;
+  std::shared_ptr<char> alive; // Expires with the owner.
+};
+
+// Per-thread state of an object shared by the server threads.
+// The states of destroyed owners are freed on each thread by the next call creating a state.
+template <typename T, typename F> T& thread_local_state(const thread_local_key& owner, F make) {
+  struct entry {
+    std::weak_ptr<char> alive;
+    std::unique_ptr<T> state;
+  };
+  static thread_local std::unordered_map<uint64_t, entry> states;
+  auto it = states.find(owner.id);
+  if (it != states.end())
+    return *it->second.state;
+
+  for (auto i = states.begin(); i != states.end();)
+    i = i->second.alive.expired() ? states.erase(i) : std::next(i);
+  entry& e = states[owner.id];
+  e.alive = owner.alive;
+  e.state.reset(new T(make()));
+  return *e.state;
+}
+
+} // namespace impl
+
+// Server wide load shedding of http_serve, with a codel_controller per server thread.
+// The queueing delay of a request is the time since its bytes arrived in the reactor
+// (async_reactor::ready_time): while a server thread is saturated, new events wait for the
+// handlers of the previous ones.
+// Overloaded server threads answer 503 with a Retry-After header without calling the api.
+//
+//   admission_control admission(s::codel_target = 5, s::codel_interval = 100, s::retry_after = 1);
+//   http_serve(api, 8080, s::admission_control = &admission);
+//   // or, without access to the metrics:
+//   http_serve(api, 8080, s::codel_target = 5);
+struct admission_control {
+
+  template <typename... O> admission_control(O... opts) {
+    auto options = mmm(opts...);
+    target = std::chrono::milliseconds(get_or(options, s::codel_target, 5));
+    interval = std::chrono::milliseconds(get_or(options, s::codel_interval, 100));
+    retry_after = std::to_string(get_or(options, s::retry_after, 1));
+  }
+
+  admission_control(const admission_control&) = delete;
+
+  bool admit(codel_controller::clock::duration queue_delay) {
+    auto& codel = impl::thread_local_state<codel_controller>(
+        thread_key, [this] { return codel_controller(target, interval); });
+    if (codel.admit(queue_delay)) {
+      admitted++;
+      return true;
+    }
+    shed_queue_delay++;
+    return false;
+  }
+
+  auto stats() const {
+    return mmm(s::admitted = admitted.load(), s::shed_queue_delay = shed_queue_delay.load());
+  }
+
+  std::chrono::microseconds target;
+  std::chrono::microseconds interval;
+  std::string retry_after;
+  std::atomic<long long> admitted = 0;
+  std::atomic<long long> shed_queue_delay = 0;
+
+private:
+  impl::thread_local_key thread_key;
+};
+
+// Bulkhead: limit the number of requests of some routes running at the same time on each
+// server thread, typically the routes using a resource with limited capacity (an SQL
+// connection pool, an upstream service...).
+//
+//   concurrency_limit db_limit(s::max_in_flight = 20, s::max_queue = 100);
+//   api.get("/report") = db_limit([&] (http_request& request, http_response& response) { ... });
+//
+// Requests over the limit wait in a FIFO queue of \max_queue requests. The queue is
+// managed with codel_controller: when it does not drain, requests waiting more than
+// s::codel_target (default 5ms) are shed. Shed requests get a 503 response with a
+// Retry-After header (s::retry_after seconds, default 1).
+struct concurrency_limit {
+
+  template <typename... O> concurrency_limit(O... opts) {
+    auto options = mmm(opts...);
+    max_in_flight = get_or(options, s::max_in_flight, 100);
+    max_queue = get_or(options, s::max_queue, 1000);
+    target = std::chrono::milliseconds(get_or(options, s::codel_target, 5));
+    interval = std::chrono::milliseconds(get_or(options, s::codel_interval, 100));
+    retry_after = std::to_string(get_or(options, s::retry_after, 1));
+  }
+
+  concurrency_limit(const concurrency_limit&) = delete;
+
+  // Wrap \handler. The concurrency_limit must outlive the server.
+  template <typename H> auto operator()(H handler) {
+    return [this, handler](http_request& request, http_response& response) {
+      slot held = enter(request, response);
+      handler(request, response);
+    };
+  }
+
+  auto stats() const {
+    return mmm(s::admitted = admitted.load(), s::shed_in_flight = shed_in_flight.load(),
+               s::shed_queue_delay = shed_queue_delay.load());
+  }
+
+  int max_in_flight;
+  int max_queue;
+  std::chrono::microseconds target;
+  std::chrono::microseconds interval;
+  std::string retry_after;
+  std::atomic<long long> admitted = 0;
+  std::atomic<long long> shed_in_flight = 0;   // The queue was full.
+  std::atomic<long long> shed_queue_delay = 0; // Waited too long in the queue.
+
+private:
+  impl::thread_local_key thread_key;
+
+  struct thread_state {
+    fiber_semaphore slots;
+    int waiting = 0;
+    codel_controller codel;
+  };
+
+  // Releases the slot of a running request.
+  struct slot {
+    thread_state* state;
+    slot(thread_state* state) : state(state) {}
+    slot(const slot&) = delete;
+    ~slot() { state->slots.release(); }
+  };
+
+  [[noreturn]] void shed(http_response& response, std::atomic<long long>& counter) {
+    counter++;
+    response.set_header("Retry-After", retry_after);
+    throw http_error::service_unavailable("Server overloaded, retry later.");
+  }
+
+  thread_state* enter(http_request& request, http_response& response) {
+    auto& state = impl::thread_local_state<thread_state>(thread_key, [this] {
+      return thread_state{fiber_semaphore(max_in_flight), 0, {target, interval}};
+    });
+
+    auto start = codel_controller::clock::now();
+    if (!state.slots.try_acquire()) {
+      if (state.waiting >= max_queue)
+        shed(response, shed_in_flight);
+      state.waiting++;
+      bool acquired = state.slots.acquire(request.fiber, start + state.codel.max_delay());
+      state.waiting--;
+      if (!acquired) {
+        state.codel.admit(codel_controller::clock::now() - start);
+        shed(response, shed_queue_delay);
+      }
+    }
+    auto now = codel_controller::clock::now();
+    if (!state.codel.admit(now - start, now)) {
+      state.slots.release();
+      shed(response, shed_queue_delay);
+    }
+    admitted++;
+    return &state;
+  }
+};
+
+} // namespace li
@@ -1,9 +1,11 @@
 #pragma once
 
+#include <array>
 #include <functional>
 #include <iostream>
 #include <li/http_server/dynamic_routing_table.hh>
 #include <li/http_server/error.hh>
+#include <li/http_server/radix_router.hh>
 #include <li/http_server/symbols.hh>
 #include <string_view>
 
@@ -18,32 +20,32 @@ template <typename T, typename F> struct delayed_assignator {
   F& f;
 };
 
-template <typename Req, typename Resp> struct api {
+// Handlers return \R: void, or coro_task<> for the coroutine server (see http_serve_coro).
+template <typename Req, typename Resp, typename R = void> struct api {
 
-  enum { ANY, GET, POST, PUT, HTTP_DELETE };
+  enum { ANY, GET, POST, PUT, HTTP_DELETE, N_VERBS };
 
-  typedef api<Req, Resp> self;
+  typedef api<Req, Resp, R> self;
 
   api(): is_global_handler(false), global_handler_(nullptr) { }
 
-  using H = std::function<void(Req&, Resp&)>;
+  using H = std::function<R(Req&, Resp&)>;
   struct VH {
     int verb = ANY;
     H handler;
     std::string url_spec;
+    route_params_layout url_params_layout;
   };
+  // The handlers of one route, indexed by verb.
+  typedef std::array<VH, N_VERBS> route_handlers;
 
-  H& operator()(std::string_view& route) {
-    auto& vh = routes_map_[route];
-    vh.verb = ANY;
-    vh.url_spec = route;
-    return vh.handler;
-  }
+  H& operator()(std::string_view& route) { return this->operator()(ANY, route); }
 
   H& operator()(int verb, std::string_view r) {
-    auto& vh = routes_map_[r];
+    auto& vh = route(r)[verb];
     vh.verb = verb;
     vh.url_spec = r;
+    vh.url_params_layout = route_params_layout(r);
     return vh.handler;
   }
   H& get(std::string_view r) { return this->operator()(GET, r); }
@@ -52,25 +54,38 @@ template <typename Req, typename Resp> struct api {
   H& delete_(std::string_view r) { return this->operator()(HTTP_DELETE, r); }
 
   int parse_verb(std::string_view method) const {
-    if (method == "GET")
-      return GET;
-    if (method == "PUT")
-      return PUT;
-    if (method == "POST")
-      return POST;
-    if (method == "HTTP_DELETE")
-      return HTTP_DELETE;
+    switch (method.size()) {
+    case 3:
+      if (method == "GET")
+        return GET;
+      if (method == "PUT")
+        return PUT;
+      break;
+    case 4:
+      if (method == "POST")
+        return POST;
+      break;
+    case 6:
+      if (method == "DELETE")
+        return HTTP_DELETE;
+      break;
+    }
     return ANY;
   }
 
   void add_subapi(std::string prefix, const self& subapi) {
-    subapi.routes_map_.for_all_routes([this, prefix](auto r, VH h) {
-      if (!r.empty() && r.back() == '/')
-        h.url_spec = prefix + r;
-      else
-        h.url_spec = prefix + '/' + r;
-
-      this->routes_map_[h.url_spec] = h;
+    subapi.routes_map_.for_all_routes([this, prefix](auto r, const route_handlers& handlers) {
+      for (VH h : handlers) {
+        if (!h.handler)
+          continue;
+        if (!r.empty() && r.back() == '/')
+          h.url_spec = prefix + r;
+        else
+          h.url_spec = prefix + '/' + r;
+        h.url_params_layout = route_params_layout(h.url_spec);
+
+        this->route(h.url_spec)[h.verb] = h;
+      }
     });
   }
 
@@ -79,48 +94,68 @@ template <typename Req, typename Resp> struct api {
     return global_handler_;
   }
   void print_routes() {
-    routes_map_.for_all_routes([this](auto r, auto h) { std::cout << r << '\n'; });
+    routes_map_.for_all_routes([this](auto r, const route_handlers& handlers) {
+      for (auto& h : handlers)
+        if (h.handler)
+          std::cout << h.url_spec << '\n';
+    });
     std::cout << std::endl;
   }
-  auto call(std::string_view method, std::string_view route, Req& request, Resp& response) const {
+
+  // Compile the routes into a radix_router. http_serve calls it before starting the
+  // server, call is thread safe after that. Otherwise call freezes the routes when they
+  // changed since the last freeze.
+  void freeze() {
+    router_ = radix_router<route_handlers>(routes_map_, [](const route_handlers& handlers) {
+      for (auto& h : handlers)
+        if (h.handler)
+          return true;
+      return false;
+    });
+    frozen_ = true;
+  }
+
+  R call(std::string_view method, std::string_view route, Req& request, Resp& response) const {
     if(is_global_handler)
-    {
-        global_handler_(request, response);
-        return;
-    }
-    if (route == last_called_route_)
-    {
-      if (last_handler_.verb == ANY or parse_verb(method) == last_handler_.verb) {
-        request.url_spec = last_handler_.url_spec;
-        last_handler_.handler(request, response);
-        return;
-      } else
-        throw http_error::not_found("Method ", method, " not implemented on route ", route);
-    }
+        return global_handler_(request, response);
+    if (!frozen_)
+      const_cast<self*>(this)->freeze();
 
     // skip the last / of the url.
     std::string_view route2(route);
     if (route2.size() != 0 and route2[route2.size() - 1] == '/')
       route2 = route2.substr(0, route2.size() - 1);
 
-    auto it = routes_map_.find(route2);
-    if (it != routes_map_.end()) {
-      if (it->second.verb == ANY or parse_verb(method) == it->second.verb) {
-        const_cast<self*>(this)->last_called_route_ = route;
-        const_cast<self*>(this)->last_handler_ = it->second;
-        request.url_spec = it->second.url_spec;
-        it->second.handler(request, response);
-      } else
-        throw http_error::not_found("Method ", method, " not implemented on route ", route2);
-    } else
+    const route_handlers* handlers = router_.find(route2, request.url_params);
+    if (!handlers)
       throw http_error::not_found("Route ", route2, " does not exist.");
+
+    // Handlers registered for a specific verb take precedence over ANY.
+    const VH* vh = &(*handlers)[parse_verb(method)];
+    if (!vh->handler)
+      vh = &(*handlers)[ANY];
+    if (!vh->handler)
+      throw http_error::not_found("Method ", method, " not implemented on route ", route2);
+
+    request.url_spec = vh->url_spec;
+    request.url_params_layout = &vh->url_params_layout;
+    return vh->handler(request, response);
   }
 
-  dynamic_routing_table<VH> routes_map_;
-  std::string last_called_route_;
-  VH last_handler_;
+  dynamic_routing_table<route_handlers> routes_map_;
+  radix_router<route_handlers> router_;
+  bool frozen_ = false;
   H global_handler_;
   bool is_global_handler;
+
+private:
+  // The handlers of route \r. The last / is ignored.
+  route_handlers& route(std::string_view r) {
+    frozen_ = false;
+    if (r.size() != 0 and r.back() == '/')
+      r = r.substr(0, r.size() - 1);
+    return routes_map_[r];
+  }
 };
 
 } // namespace li
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+#include <li/http_server/buffer_pool.hh>
+
+namespace li {
+
+// Bump allocator for the data of one request.
+//
+// Allocations are a pointer increment. Nothing is freed individually: reset() frees
+// everything at once after the response. Blocks come from the thread buffer pool, the
+// first one is kept by reset() and given back by release().
+// Destructors of the objects allocated in the arena are not called.
+struct monotonic_arena {
+
+  static constexpr int initial_block_size = 4 * 1024;
+
+  monotonic_arena() = default;
+  monotonic_arena(const monotonic_arena&) = delete;
+  monotonic_arena& operator=(const monotonic_arena&) = delete;
+  ~monotonic_arena() { release(); }
+
+  inline void* allocate(std::size_t size, std::size_t align = alignof(std::max_align_t)) {
+    char* p = align_up(cursor_, align);
+    if (!p or p + size > end_)
+      return allocate_in_new_block(size, align);
+    cursor_ = p + size;
+    return p;
+  }
+
+  // Copy \s in the arena.
+  std::string_view copy(std::string_view s) {
+    char* p = (char*)allocate(s.size(), 1);
+    memcpy(p, s.data(), s.size());
+    return std::string_view(p, s.size());
+  }
+
+  // Free all the allocations. Keeps the first block for the next request.
+  void reset() {
+    if (!first_)
+      return;
+    release_blocks(first_->next);
+    first_->next = nullptr;
+    current_ = first_;
+    cursor_ = first_->data();
+    end_ = (char*)first_ + first_->size;
+  }
+
+  // Free all the allocations and give the memory back to the pool.
+  void release() {
+    release_blocks(first_);
+    first_ = current_ = nullptr;
+    cursor_ = end_ = nullptr;
+  }
+
+  // Total size of the blocks used by the arena.
+  std::size_t capacity() const {
+    std::size_t total = 0;
+    for (block* b = first_; b; b = b->next)
+      total += b->size;
+    return total;
+  }
+
+private:
+  // Blocks start with this header.
+  struct block {
+    block* next;
+    int size;
+    char* data() { return (char*)this + sizeof(block); }
+  };
+
+  static char* align_up(char* p, std::size_t align) {
+    return (char*)((uintptr_t(p) + align - 1) & ~uintptr_t(align - 1));
+  }
+
+  void* allocate_in_new_block(std::size_t size, std::size_t align) {
+    // Blocks double in size, and are large enough for the allocation.
+    std::size_t min_size = sizeof(block) + size + align;
+    std::size_t block_size = current_ ? 2 * std::size_t(current_->size) : initial_block_size;
+    while (block_size < min_size)
+      block_size *= 2;
+
+    block* b = (block*)thread_buffer_pool().acquire(block_size);
+    b->next = nullptr;
+    b->size = block_size;
+    if (current_)
+      current_->next = b;
+    else
+      first_ = b;
+    current_ = b;
+    cursor_ = b->data();
+    end_ = (char*)b + block_size;
+
+    char* p = align_up(cursor_, align);
+    assert(p + size <= end_);
+    cursor_ = p + size;
+    return p;
+  }
+
+  static void release_blocks(block* b) {
+    while (b) {
+      block* next = b->next;
+      thread_buffer_pool().release((char*)b, b->size);
+      b = next;
+    }
+  }
+
+  block* first_ = nullptr;
+  block* current_ = nullptr;
+  char* cursor_ = nullptr;
+  char* end_ = nullptr;
+};
+
+// Standard allocator allocating in a monotonic_arena. deallocate does nothing.
+template <typename T> struct arena_allocator {
+  typedef T value_type;
+  typedef std::true_type propagate_on_container_copy_assignment;
+  typedef std::true_type propagate_on_container_move_assignment;
+  typedef std::true_type propagate_on_container_swap;
+
+  arena_allocator(monotonic_arena& arena) : arena(&arena) {}
+  template <typename U> arena_allocator(const arena_allocator<U>& o) : arena(o.arena) {}
+
+  T* allocate(std::size_t n) { return (T*)arena->allocate(n * sizeof(T), alignof(T)); }
+  void deallocate(T*, std::size_t) {}
+
+  template <typename U> bool operator==(const arena_allocator<U>& o) const {
+    return arena == o.arena;
+  }
+  template <typename U> bool operator!=(const arena_allocator<U>& o) const {
+    return arena != o.arena;
+  }
+
+  monotonic_arena* arena;
+};
+
+// String allocated in a request arena. url_decode and json_decode can decode into it.
+typedef std::basic_string<char, std::char_traits<char>, arena_allocator<char>> arena_string;
+
+} // namespace li
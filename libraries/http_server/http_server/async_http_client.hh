@@ -0,0 +1,483 @@
+#pragma once
+
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <netdb.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <li/http_server/admission_control.hh>
+#include <li/http_server/offload_pool.hh>
+#include <li/http_server/symbols.hh>
+#include <li/http_server/tcp_server.hh>
+#include <li/http_server/upstream.hh>
+#include <li/json/json.hh>
+#include <li/metamap/metamap.hh>
+
+namespace li {
+
+namespace impl {
+
+// Append \s to \out, percent-encoding everything but the unreserved characters.
+inline void url_escape(std::string& out, std::string_view s) {
+  static const char hex[] = "0123456789ABCDEF";
+  for (unsigned char c : s) {
+    if (isalnum(c) or c == '-' or c == '.' or c == '_' or c == '~')
+      out += c;
+    else {
+      out += '%';
+      out += hex[c >> 4];
+      out += hex[c & 15];
+    }
+  }
+}
+
+} // namespace impl
+
+// HTTP/1.1 client running in the fiber of a request. While it waits for the server, the
+// fiber is parked and the other connections of the thread keep being served.
+//
+//   async_http_client users_service(s::timeout = 2000);
+//   api.get("/profile") = [&] (http_request& request, http_response& response) {
+//     auto user = users_service.get(request.fiber, "http://users:8080/user",
+//                                   s::get_parameters = mmm(s::id = 42));
+//     response.write(user.body);
+//   };
+//
+// It takes the same arguments as http_client (s::get_parameters, s::post_parameters,
+// s::json_encoded, s::fetch_headers) and returns the same mmm(s::status, s::body[, s::headers]).
+// Errors throw std::runtime_error. Only http:// urls are supported.
+//
+// Each server thread keeps its own pool of keep-alive connections per host, used without
+// locks. Host names are resolved once per thread on the default offload_pool, numeric
+// addresses are used directly.
+//
+// Options:
+//   s::max_idle_connections: idle connections kept per host and per thread (default 16).
+//   s::timeout: milliseconds without progress before giving up (default 10000). The fiber
+//               waits on the reactor timers.
+struct async_http_client {
+
+  template <typename... O> async_http_client(O... opts) {
+    auto options = mmm(opts...);
+    max_idle_connections = get_or(options, s::max_idle_connections, 16);
+    timeout = std::chrono::milliseconds(get_or(options, s::timeout, 10000));
+  }
+
+  async_http_client(const async_http_client&) = delete;
+
+  template <typename... A>
+  auto operator()(async_fiber_context& fiber, std::string_view method, std::string_view url,
+                  const A&... args) {
+    auto arguments = mmm(args...);
+    constexpr bool fetch_headers = has_key<decltype(arguments)>(s::fetch_headers);
+
+    url_parts u = parse_url(url);
+
+    // Get params
+    std::string target(u.target);
+    bool first = target.find('?') == std::string::npos;
+    li::map(li::get_or(arguments, s::get_parameters, mmm()), [&](auto k, auto v) {
+      target += first ? '?' : '&';
+      target += li::symbol_string(k);
+      target += '=';
+      std::ostringstream value_ss;
+      value_ss << v;
+      impl::url_escape(target, value_ss.str());
+      first = false;
+    });
+
+    // Post params
+    std::string body;
+    std::string_view content_type;
+    if (method == "POST" or method == "PUT") {
+      if (li::has_key(arguments, s::json_encoded)) {
+        body = li::json_encode(li::get_or(arguments, s::post_parameters, mmm()));
+        content_type = "application/json";
+      } else {
+        first = true;
+        li::map(li::get_or(arguments, s::post_parameters, mmm()), [&](auto k, auto v) {
+          if (!first)
+            body += '&';
+          body += li::symbol_string(k);
+          body += '=';
+          std::ostringstream value_ss;
+          value_ss << v;
+          impl::url_escape(body, value_ss.str());
+          first = false;
+        });
+        content_type = "application/x-www-form-urlencoded";
+      }
+    }
+
+    std::string message;
+    message.reserve(256 + target.size() + body.size());
+    message.append(method).append(" ").append(target).append(" HTTP/1.1\r\n");
+    message.append("Host: ").append(u.host_port).append("\r\n");
+    if (content_type.size())
+      message.append("Content-Type: ").append(content_type).append("\r\n");
+    if (body.size() or content_type.size())
+      message.append("Content-Length: ").append(std::to_string(body.size())).append("\r\n");
+    message.append("\r\n").append(body);
+
+    std::string response_body;
+    std::unordered_map<std::string, std::string> response_headers;
+    long status = send(fiber, u, message, method == "HEAD", response_body,
+                       fetch_headers ? &response_headers : nullptr);
+
+    if constexpr (fetch_headers)
+      return mmm(s::status = status, s::body = std::move(response_body),
+                 s::headers = std::move(response_headers));
+    else
+      return mmm(s::status = status, s::body = std::move(response_body));
+  }
+
+  template <typename... P>
+  auto get(async_fiber_context& fiber, std::string_view url, const P&... params) {
+    return (*this)(fiber, "GET", url, params...);
+  }
+  template <typename... P>
+  auto put(async_fiber_context& fiber, std::string_view url, const P&... params) {
+    return (*this)(fiber, "PUT", url, params...);
+  }
+  template <typename... P>
+  auto post(async_fiber_context& fiber, std::string_view url, const P&... params) {
+    return (*this)(fiber, "POST", url, params...);
+  }
+  template <typename... P>
+  auto delete_(async_fiber_context& fiber, std::string_view url, const P&... params) {
+    return (*this)(fiber, "DELETE", url, params...);
+  }
+
+  auto stats() {
+    long long requests = 0, connections = 0, reused = 0;
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto& sh : shards) {
+      requests += sh->requests.load(std::memory_order_relaxed);
+      connections += sh->connections.load(std::memory_order_relaxed);
+      reused += sh->reused.load(std::memory_order_relaxed);
+    }
+    return mmm(s::requests = requests, s::connections = connections, s::reused = reused);
+  }
+
+  int max_idle_connections;
+  std::chrono::microseconds timeout;
+
+private:
+  static constexpr size_t read_buffer_size = 16 * 1024;
+  static constexpr size_t max_headers_size = 64 * 1024;
+
+  enum exchange_status { done, connection_lost, invalid_response };
+
+  struct url_parts {
+    std::string host;
+    std::string port;
+    std::string host_port; // As written in the url, the key of the connection pools.
+    std::string_view target;
+  };
+
+  struct pool {
+    std::vector<int> idle; // Keep-alive connections, the most recently used last.
+    sockaddr_storage addr;
+    socklen_t addr_len = 0; // 0 until the host is resolved.
+  };
+
+  // State of one server thread.
+  struct shard {
+    ~shard() {
+      for (auto& p : pools)
+        for (int fd : p.second.idle)
+          ::close(fd);
+    }
+
+    std::unordered_map<std::string, pool> pools;
+    std::atomic<long long> requests = 0;
+    std::atomic<long long> connections = 0;
+    std::atomic<long long> reused = 0;
+  };
+
+  // Closes the connection unless it goes back to the pool.
+  struct connection_guard {
+    int fd;
+    ~connection_guard() {
+      if (fd != -1)
+        ::close(fd);
+    }
+  };
+
+  template <typename... T> [[noreturn]] static void error(const T&... parts) {
+    std::ostringstream errss;
+    errss << "async_http_client: ";
+    (errss << ... << parts);
+    throw std::runtime_error(errss.str());
+  }
+
+  static url_parts parse_url(std::string_view url) {
+    if (url.substr(0, 7) != "http://")
+      error("only http:// urls are supported: ", url);
+    url.remove_prefix(7);
+    size_t target_start = url.find_first_of("/?");
+    url_parts u;
+    u.host_port = std::string(url.substr(0, target_start));
+    u.target = target_start == std::string_view::npos ? std::string_view("/")
+                                                       : url.substr(target_start);
+    if (u.target[0] == '?')
+      error("missing path in ", url);
+
+    std::string_view authority = u.host_port;
+    size_t host_end = authority[0] == '[' ? authority.find(']') : authority.find(':');
+    if (authority[0] == '[') { // [ipv6]:port
+      if (host_end == std::string_view::npos)
+        error("invalid host in ", url);
+      u.host = std::string(authority.substr(1, host_end - 1));
+      host_end = authority.find(':', host_end);
+    } else
+      u.host = std::string(authority.substr(0, host_end));
+    u.port = host_end == std::string_view::npos ? "80"
+                                                : std::string(authority.substr(host_end + 1));
+    if (u.host.empty())
+      error("invalid host in ", url);
+    return u;
+  }
+
+  shard* add_shard() {
+    std::lock_guard<std::mutex> lock(mutex);
+    shards.emplace_back(new shard);
+    return shards.back().get();
+  }
+
+  static void resolve(async_fiber_context& fiber, const url_parts& u, pool& p) {
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICHOST;
+    addrinfo* result = nullptr;
+    int err = getaddrinfo(u.host.c_str(), u.port.c_str(), &hints, &result);
+    if (err == EAI_NONAME) {
+      // Name lookups may block, run them on the offload pool.
+      hints.ai_flags = 0;
+      err = await_blocking(fiber, [&] {
+        return getaddrinfo(u.host.c_str(), u.port.c_str(), &hints, &result);
+      });
+    }
+    if (err)
+      error("cannot resolve ", u.host_port, ": ", gai_strerror(err));
+    memcpy(&p.addr, result->ai_addr, result->ai_addrlen);
+    p.addr_len = result->ai_addrlen;
+    freeaddrinfo(result);
+  }
+
+  // An idle connection of \p, or a new one if \fresh or if there is none. -1 on failure.
+  int take_connection(shard& sh, pool& p, impl::upstream_io& io, bool fresh, bool& reused) {
+    auto* reactor = io.fiber.reactor;
+    while (!fresh and !p.idle.empty()) {
+      int fd = p.idle.back();
+      p.idle.pop_back();
+      if (reactor->closed_fds[fd]) { // Closed by the server while idle.
+        ::close(fd);
+        continue;
+      }
+      io.fiber.reassign_fd_to_this_fiber(fd);
+      sh.reused.fetch_add(1, std::memory_order_relaxed);
+      reused = true;
+      return fd;
+    }
+    reused = false;
+    int fd = impl::upstream_connect(io, (const sockaddr*)&p.addr, p.addr_len);
+    if (fd != -1)
+      sh.connections.fetch_add(1, std::memory_order_relaxed);
+    return fd;
+  }
+
+  // Send \message and read the response. Return the status code.
+  long send(async_fiber_context& fiber, const url_parts& u, std::string_view message, bool head,
+            std::string& body, std::unordered_map<std::string, std::string>* headers) {
+    shard& sh = *impl::thread_local_state<shard*>(thread_key, [this] { return add_shard(); });
+    sh.requests.fetch_add(1, std::memory_order_relaxed);
+    pool& p = sh.pools[u.host_port];
+    if (!p.addr_len)
+      resolve(fiber, u, p);
+
+    for (int attempt = 0;; attempt++) {
+      impl::upstream_io io(fiber, timeout);
+      bool reused = false;
+      connection_guard connection{take_connection(sh, p, io, attempt > 0, reused)};
+      if (connection.fd == -1) {
+        if (io.timed_out)
+          error(u.host_port, " timed out.");
+        if (fiber.is_closed())
+          error("request to ", u.host_port, " cancelled: the client closed its connection.");
+        p.addr_len = 0; // Resolve the host again at the next request.
+        error("cannot connect to ", u.host_port, ".");
+      }
+
+      long status = 0;
+      bool keep_alive = false;
+      size_t received = 0;
+      exchange_status result = exchange(io, connection.fd, message, head, status, body, headers,
+                                        keep_alive, received);
+      if (result == done) {
+        if (keep_alive and int(p.idle.size()) < max_idle_connections) {
+          p.idle.push_back(connection.fd);
+          connection.fd = -1;
+        }
+        return status;
+      }
+      if (io.timed_out)
+        error(u.host_port, " timed out.");
+      if (fiber.is_closed())
+        error("request to ", u.host_port, " cancelled: the client closed its connection.");
+      if (result == invalid_response)
+        error("invalid response from ", u.host_port, ".");
+      // The server may have closed the idle connection while the request was sent.
+      if (!(reused and received == 0 and attempt == 0))
+        error("connection to ", u.host_port, " lost.");
+      body.clear();
+      if (headers)
+        headers->clear();
+    }
+  }
+
+  exchange_status exchange(impl::upstream_io& io, int fd, std::string_view message, bool head,
+                           long& status, std::string& body,
+                           std::unordered_map<std::string, std::string>* headers,
+                           bool& keep_alive, size_t& received) {
+    if (!io.send_all(fd, message.data(), message.size()))
+      return connection_lost;
+
+    // Read the status line and the headers.
+    std::string buf(read_buffer_size, '\0');
+    size_t filled = 0;
+    size_t headers_size = 0;
+    while (!headers_size) {
+      if (filled == buf.size()) {
+        if (buf.size() >= max_headers_size)
+          return invalid_response;
+        buf.resize(buf.size() * 2);
+      }
+      long n = io.recv_some(fd, &buf[filled], buf.size() - filled);
+      if (n <= 0)
+        return connection_lost;
+      received += n;
+      size_t search_start = filled < 3 ? 0 : filled - 3;
+      filled += n;
+      size_t pos = std::string_view(buf.data(), filled).find("\r\n\r\n", search_start);
+      if (pos != std::string_view::npos)
+        headers_size = pos + 4;
+    }
+
+    std::string_view response_headers(buf.data(), headers_size);
+    if (response_headers.size() < 12 or response_headers.substr(0, 7) != "HTTP/1.")
+      return invalid_response;
+    keep_alive = response_headers[7] == '1';
+    status = atoi(response_headers.data() + 9);
+
+    long long content_length = -1;
+    bool chunked = false;
+    size_t cur = response_headers.find("\r\n") + 2;
+    while (cur + 2 < response_headers.size()) {
+      size_t end = response_headers.find("\r\n", cur);
+      std::string_view line = response_headers.substr(cur, end - cur);
+      cur = end + 2;
+      size_t colon = line.find(':');
+      if (colon == std::string_view::npos)
+        continue;
+      std::string_view key = line.substr(0, colon);
+      std::string_view value = line.substr(colon + 1);
+      while (value.size() and value[0] == ' ')
+        value.remove_prefix(1);
+      while (value.size() and isspace(value.back()))
+        value.remove_suffix(1);
+
+      if (impl::header_equals(key, "Content-Length"))
+        content_length = atoll(std::string(value).c_str());
+      else if (impl::header_equals(key, "Transfer-Encoding"))
+        chunked = value.find("chunked") != std::string_view::npos;
+      else if (impl::header_equals(key, "Connection"))
+        keep_alive = impl::header_equals(value, "keep-alive") or
+                     (keep_alive and !impl::header_equals(value, "close"));
+      if (headers)
+        (*headers)[std::string(key)] = std::string(value);
+    }
+
+    std::string_view buffered(buf.data() + headers_size, filled - headers_size);
+    if (head or status == 204 or status == 304 or status < 200) {
+      keep_alive = keep_alive and buffered.empty();
+    } else if (chunked) {
+      impl::chunked_body_decoder decoder;
+      auto on_data = [&](std::string_view data) { body.append(data); };
+      size_t used = decoder.feed(buffered, on_data);
+      size_t last_read = buffered.size();
+      while (!decoder.finished()) {
+        long n = io.recv_some(fd, &buf[0], buf.size());
+        if (n <= 0)
+          return connection_lost;
+        used = decoder.feed(std::string_view(buf.data(), n), on_data);
+        last_read = n;
+      }
+      keep_alive = keep_alive and used == last_read;
+    } else if (content_length >= 0) {
+      size_t first = std::min<size_t>(buffered.size(), content_length);
+      keep_alive = keep_alive and first == buffered.size();
+      body.resize(content_length);
+      memcpy(&body[0], buffered.data(), first);
+      for (size_t pos = first; pos < size_t(content_length);) {
+        long n = io.recv_some(fd, &body[pos], content_length - pos);
+        if (n <= 0)
+          return connection_lost;
+        pos += n;
+      }
+    } else {
+      // The body ends when the server closes the connection.
+      keep_alive = false;
+      body.append(buffered);
+      long n;
+      while ((n = io.recv_some(fd, &buf[0], buf.size())) > 0)
+        body.append(buf.data(), n);
+      if (n < 0)
+        return connection_lost;
+    }
+    return done;
+  }
+
+  std::mutex mutex; // Protects shards.
+  std::vector<std::unique_ptr<shard>> shards;
+  impl::thread_local_key thread_key; // Finds the shard of the current thread.
+};
+
+// The client shared by the whole process.
+inline async_http_client& default_async_http_client() {
+  static async_http_client client;
+  return client;
+}
+
+// Requests from the fiber of a handler, with the default async_http_client.
+template <typename... P>
+auto http_get(async_fiber_context& fiber, std::string_view url, const P&... params) {
+  return default_async_http_client().get(fiber, url, params...);
+}
+template <typename... P>
+auto http_post(async_fiber_context& fiber, std::string_view url, const P&... params) {
+  return default_async_http_client().post(fiber, url, params...);
+}
+template <typename... P>
+auto http_put(async_fiber_context& fiber, std::string_view url, const P&... params) {
+  return default_async_http_client().put(fiber, url, params...);
+}
+template <typename... P>
+auto http_delete(async_fiber_context& fiber, std::string_view url, const P&... params) {
+  return default_async_http_client().delete_(fiber, url, params...);
+}
+
+} // namespace li
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+namespace li {
+
+// Free lists of I/O buffers, one per power of two size class from 1KB to 64KB.
+//
+// Connections borrow their buffers only while they process requests and give them
+// back when they go idle, so memory follows the number of active connections instead
+// of the number of open connections. Each reactor thread has its own pool (see
+// thread_buffer_pool), so no locking is needed.
+struct buffer_pool {
+
+  static constexpr int min_size = 1024;
+  static constexpr int n_classes = 7;
+  static constexpr int max_size = min_size << (n_classes - 1);
+  // Above this, released buffers are freed instead of cached.
+  static constexpr std::size_t max_cached_bytes = 16 * 1024 * 1024;
+
+  buffer_pool() = default;
+  buffer_pool(const buffer_pool&) = delete;
+  buffer_pool& operator=(const buffer_pool&) = delete;
+
+  ~buffer_pool() {
+    for (auto& list : free_)
+      for (char* b : list)
+        delete[] b;
+  }
+
+  // Size of the buffer returned by acquire(size).
+  static int class_size(int size) {
+    int c = size_class(size);
+    return c < 0 ? size : min_size << c;
+  }
+
+  // Return a buffer of class_size(size) bytes.
+  char* acquire(int size) {
+    int c = size_class(size);
+    if (c < 0)
+      return new char[size];
+    if (free_[c].empty())
+      return new char[min_size << c];
+    char* b = free_[c].back();
+    free_[c].pop_back();
+    cached_bytes_ -= min_size << c;
+    return b;
+  }
+
+  // Give back a buffer returned by acquire(size).
+  void release(char* b, int size) {
+    if (!b)
+      return;
+    int c = size_class(size);
+    if (c < 0 or cached_bytes_ + (min_size << c) > max_cached_bytes) {
+      delete[] b;
+      return;
+    }
+    free_[c].push_back(b);
+    cached_bytes_ += min_size << c;
+  }
+
+  std::size_t cached_bytes() const { return cached_bytes_; }
+
+private:
+  // Smallest class holding \size bytes, -1 if larger than max_size.
+  static int size_class(int size) {
+    int c = 0;
+    while (c < n_classes and (min_size << c) < size)
+      c++;
+    return c < n_classes ? c : -1;
+  }
+
+  std::vector<char*> free_[n_classes];
+  std::size_t cached_bytes_ = 0;
+};
+
+// Buffer pool of the calling thread.
+inline buffer_pool& thread_buffer_pool() {
+  static thread_local buffer_pool pool;
+  return pool;
+}
+
+} // namespace li
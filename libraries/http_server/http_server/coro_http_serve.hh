@@ -0,0 +1,231 @@
+#pragma once
+
+#include <li/http_server/coro_reactor.hh>
+
+#if LITHIUM_COROUTINES
+
+#include <string>
+
+#include <li/http_server/api.hh>
+#include <li/http_server/http_serve.hh>
+#include <li/http_server/request.hh>
+#include <li/http_server/response.hh>
+
+namespace li {
+
+namespace http_async_impl {
+
+// The fiber of generic_http_ctx on the coroutine server.
+// The request and its body are in the read buffer before the handler runs, and the
+// processor sends the responses when the handler co_awaits or returns: nothing here waits.
+struct coro_http_fiber {
+
+  coro_http_fiber(coro_connection& connection)
+      : connection(&connection), socket_fd(connection.socket_fd),
+        in_addr(connection.in_addr) {}
+
+  // Queue data sent by generic_http_ctx outside of output_stream: large bodies and the
+  // content of a full output_stream.
+  bool write(const char* buf, int size, int flags = 0) {
+    if (is_closed())
+      return false;
+    pending.append(buf, size);
+    return true;
+  }
+  bool writev(iovec* iov, int iovcnt, int flags = 0) {
+    for (int i = 0; i < iovcnt; i++)
+      write((const char*)iov[i].iov_base, iov[i].iov_len);
+    return !is_closed();
+  }
+
+  // The body is already in the read buffer.
+  int read(char* buf, int max_size) { return 0; }
+  int read_nowait(char* buf, int max_size) { return connection->read_nowait(buf, max_size); }
+
+  bool is_closed() const { return connection->is_closed(); }
+
+  // Give the memory of the pending data back while the connection is idle.
+  void release() { std::string().swap(pending); }
+
+  coro_connection* connection;
+  int socket_fd;
+  sockaddr in_addr;
+  std::string pending;
+  iovec iov[2];
+};
+
+typedef generic_http_ctx<coro_http_fiber> coro_http_ctx;
+
+// Send the pending data of the fiber then the responses of output_stream, with one writev.
+struct coro_send_responses : coro_connection::writev_operation {
+  coro_send_responses(coro_http_ctx& ctx)
+      : coro_connection::writev_operation(ctx.fiber.connection, ctx.fiber.iov, 2), ctx(ctx) {
+    auto out = ctx.output_stream.to_string_view();
+    ctx.fiber.iov[0] = {ctx.fiber.pending.data(), ctx.fiber.pending.size()};
+    ctx.fiber.iov[1] = {(void*)out.data(), out.size()};
+  }
+  bool await_resume() {
+    ctx.fiber.pending.clear();
+    ctx.output_stream.reset();
+    return coro_connection::writev_operation::await_resume();
+  }
+  coro_http_ctx& ctx;
+};
+
+// Coroutine version of make_http_processor.
+// It reads the whole request, body included, before calling \handler(ctx), which returns
+// a coro_task<>. The request bodies are limited to the size of the read buffer
+// (input_buffer::max_size), larger ones get a 413 response.
+template <typename F> coro_task<> coro_http_process(coro_connection& connection, const F& handler) {
+  input_buffer rb;
+  coro_http_fiber fiber(connection);
+  coro_http_ctx ctx(rb, fiber);
+  ctx.socket_fd = connection.socket_fd;
+
+  while (true) {
+    ctx.is_body_read_ = false;
+    ctx.header_lines.clear();
+    ctx.header_lines.reserve(100);
+
+    // Responses are coalesced while pipelined requests are already in the read buffer.
+    if (rb.empty()) {
+      if (!co_await coro_send_responses(ctx))
+        co_return;
+      int received;
+      while ((received = rb.read_more_nowait(fiber)) < 0) {
+        // The connection is idle: give its buffers back to the pool while waiting.
+        ctx.release_buffers();
+        fiber.release();
+        if (!co_await connection.wait_event())
+          co_return;
+      }
+      if (received == 0)
+        co_return;
+    }
+
+    // Read until there is a complete header.
+    int header_end = rb.cursor;
+    ctx.add_header_line(rb.data() + header_end);
+
+    bool complete_header = false;
+    const char* cur = rb.data() + header_end;
+    while (!complete_header) {
+      while ((cur - rb.data()) < rb.end - 3) {
+        if (cur[0] == '\r' and cur[1] == '\n') {
+          cur += 2; // skip \r\n
+          ctx.add_header_line(cur);
+          // If we read \r\n twice the header is complete.
+          if (cur[0] == '\r' and cur[1] == '\n') {
+            complete_header = true;
+            cur += 2; // skip \r\n
+            break;
+          }
+        } else
+          cur++;
+      }
+
+      if (!complete_header) {
+        if (!co_await coro_send_responses(ctx))
+          co_return;
+        // Grow the buffer if the headers fill it.
+        if (rb.end == rb.capacity())
+          ctx.move_header_lines(cur, rb.reserve(rb.current_size() + 1));
+        if (rb.end == rb.capacity()) {
+          std::cerr << "Error: request too long, read buffer full." << std::endl;
+          co_return;
+        }
+        int received = co_await connection.read(rb.data() + rb.end, rb.capacity() - rb.end);
+        if (received == 0)
+          co_return;
+        rb.end += received;
+      }
+    }
+
+    // Header is complete. Process it.
+    ctx.prepare_request();
+
+    int request_size = cur - ctx.header_lines[0] + ctx.content_length_;
+    if (request_size > input_buffer::max_size) {
+      ctx.set_status(413);
+      ctx.respond("Request body too large.");
+      co_await coro_send_responses(ctx);
+      co_return;
+    }
+
+    // Read the whole body before running the handler.
+    if (ctx.move_header_lines(cur, rb.reserve(request_size)))
+      ctx.prepare_request();
+    header_end = cur - rb.data();
+    while (rb.end - header_end < ctx.content_length_) {
+      int received = co_await connection.read(rb.data() + rb.end, rb.capacity() - rb.end);
+      if (received == 0)
+        co_return;
+      rb.end += received;
+    }
+
+    ctx.body_start = std::string_view(rb.data() + header_end, rb.end - header_end);
+    co_await handler(ctx);
+
+    // Update the cursor the beginning of the next request.
+    // Do not process the pipelined requests of a closed connection.
+    if (!ctx.prepare_next_request() or fiber.is_closed())
+      co_return;
+  }
+}
+
+} // namespace http_async_impl
+
+typedef basic_http_request<http_async_impl::coro_http_ctx> coro_http_request;
+typedef basic_http_response<http_async_impl::coro_http_ctx> coro_http_response;
+
+// Api of the coroutine server: handlers are coroutines returning coro_task<>.
+using coro_http_api = api<coro_http_request, coro_http_response, coro_task<>>;
+
+namespace http_async_impl {
+
+template <typename A> coro_task<> coro_http_call(const A& api, coro_http_ctx& ctx) {
+  coro_http_request rq{ctx};
+  coro_http_response resp(ctx);
+  try {
+    co_await api.call(ctx.method(), ctx.url(), rq, resp);
+  } catch (const http_error& e) {
+    ctx.respond_error(e.status(), e.what());
+  } catch (const sql_client_closed&) {
+    co_return;
+  } catch (const std::runtime_error& e) {
+    std::cerr << "INTERNAL SERVER ERROR: " << e.what() << std::endl;
+    ctx.respond_error(500, "Internal server error.");
+  }
+  ctx.respond_if_needed();
+}
+
+} // namespace http_async_impl
+
+// Same as http_serve, on the coroutine reactor.
+// request.fiber.connection is the coro_connection of the request: handlers can
+// co_await its sleep_for, yield or wait_event.
+template <typename... O> auto http_serve_coro(coro_http_api api, int port, O... opts) {
+
+  auto options = mmm(opts...);
+
+  int nthreads = get_or(options, s::nthreads, std::thread::hardware_concurrency());
+  tcp_server_options tcp_options = http_async_impl::make_tcp_server_options(options);
+
+  api.freeze();
+  auto handler = [api](http_async_impl::coro_http_ctx& ctx) {
+    return http_async_impl::coro_http_call(api, ctx);
+  };
+
+  http_async_impl::run_server(port, options, [=] {
+    start_coro_tcp_server(
+        port, SOCK_STREAM, nthreads,
+        [handler](coro_connection& connection) {
+          return http_async_impl::coro_http_process(connection, handler);
+        },
+        tcp_options);
+  });
+}
+
+} // namespace li
+
+#endif
@@ -0,0 +1,469 @@
+#pragma once
+
+// C++20 coroutine reactor, an alternative to the boost::context fibers of async_reactor.
+//
+// A connection is handled by a stackless coroutine: its frame only holds the variables
+// living across a co_await, instead of a full stack per connection.
+// Enabled when the compiler supports coroutines (-std=c++20), Linux only.
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>) && __linux__
+
+#define LITHIUM_COROUTINES 1
+
+#include <chrono>
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <optional>
+#include <queue>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include <li/http_server/tcp_server.hh>
+
+namespace li {
+
+namespace internal {
+
+template <typename T> struct coro_task_result {
+  template <typename U> void return_value(U&& v) { value.emplace(std::forward<U>(v)); }
+  T get() {
+    if (exception)
+      std::rethrow_exception(exception);
+    return std::move(*value);
+  }
+  std::optional<T> value;
+  std::exception_ptr exception;
+};
+
+template <> struct coro_task_result<void> {
+  void return_void() {}
+  void get() {
+    if (exception)
+      std::rethrow_exception(exception);
+  }
+  std::exception_ptr exception;
+};
+
+// Coroutine running on its own: it starts right away and frees its frame when it ends.
+struct coro_detached {
+  struct promise_type {
+    coro_detached get_return_object() { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+} // namespace internal
+
+// Coroutine returning a T.
+// It starts when it is awaited and resumes its awaiter when it ends, without going back
+// to the reactor. Its exceptions are rethrown in the awaiter.
+template <typename T = void> struct [[nodiscard]] coro_task {
+
+  struct promise_type : internal::coro_task_result<T> {
+
+    coro_task get_return_object() {
+      return coro_task(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    struct final_awaiter {
+      bool await_ready() noexcept { return false; }
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+        if (auto awaiter = h.promise().continuation)
+          return awaiter;
+        return std::noop_coroutine();
+      }
+      void await_resume() noexcept {}
+    };
+    final_awaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { this->exception = std::current_exception(); }
+
+    std::coroutine_handle<> continuation;
+  };
+
+  coro_task(coro_task&& o) : handle_(std::exchange(o.handle_, nullptr)) {}
+  coro_task& operator=(coro_task&& o) {
+    if (this != &o) {
+      if (handle_)
+        handle_.destroy();
+      handle_ = std::exchange(o.handle_, nullptr);
+    }
+    return *this;
+  }
+  coro_task(const coro_task&) = delete;
+  coro_task& operator=(const coro_task&) = delete;
+  ~coro_task() {
+    if (handle_)
+      handle_.destroy();
+  }
+
+  bool await_ready() const noexcept { return handle_.done(); }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept {
+    handle_.promise().continuation = awaiter;
+    return handle_;
+  }
+  T await_resume() { return handle_.promise().get(); }
+
+private:
+  explicit coro_task(std::coroutine_handle<promise_type> h) : handle_(h) {}
+  std::coroutine_handle<promise_type> handle_;
+};
+
+struct coro_reactor;
+
+// Connection handled by a coroutine of coro_reactor.
+//
+// read, write, yield, sleep and wait_event are awaitables. Like the fibers of async_reactor,
+// they return a closed status (0 or false) once the peer closed the connection.
+// Awaiting does not allocate: the operation lives in the frame of the awaiting coroutine
+// and the reactor retries it on each event of the connection until it completes.
+struct coro_connection {
+
+  // The operation the coroutine waits for.
+  struct operation {
+    bool (*attempt)(operation*); // Return true when the operation is complete.
+    std::coroutine_handle<> coroutine;
+  };
+
+  template <typename O> struct awaitable_operation : operation {
+    awaitable_operation(coro_connection* c) : connection(c) {
+      this->attempt = [](operation* o) { return static_cast<O*>(o)->try_complete(); };
+    }
+    bool await_ready() { return static_cast<O*>(this)->try_complete(); }
+    void await_suspend(std::coroutine_handle<> h) {
+      this->coroutine = h;
+      connection->pending = this;
+    }
+    coro_connection* connection;
+  };
+
+  struct read_operation : awaitable_operation<read_operation> {
+    read_operation(coro_connection* c, char* buf, int size)
+        : awaitable_operation<read_operation>(c), buf(buf), size(size) {}
+    bool try_complete() {
+      result = connection->read_nowait(buf, size);
+      return result >= 0;
+    }
+    int await_resume() { return result; }
+    char* buf;
+    int size;
+    int result = 0;
+  };
+
+  struct writev_operation : awaitable_operation<writev_operation> {
+    writev_operation(coro_connection* c, iovec* iov, int iovcnt)
+        : awaitable_operation<writev_operation>(c), iov(iov), iovcnt(iovcnt) {}
+    bool try_complete() {
+      while (iovcnt > 0 and !iov->iov_len) {
+        iov++;
+        iovcnt--;
+      }
+      while (iovcnt > 0) {
+        if (connection->closed)
+          return true;
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        ssize_t count = ::sendmsg(connection->socket_fd, &msg, MSG_NOSIGNAL);
+        if (count < 0) {
+          if (errno == EAGAIN)
+            return false;
+          connection->closed = true;
+          return true;
+        }
+        // Skip what was sent.
+        while (iovcnt > 0 and size_t(count) >= iov->iov_len) {
+          count -= iov->iov_len;
+          iov++;
+          iovcnt--;
+        }
+        if (iovcnt > 0) {
+          iov->iov_base = (char*)iov->iov_base + count;
+          iov->iov_len -= count;
+        }
+      }
+      return true;
+    }
+    bool await_resume() { return !connection->closed; }
+    iovec* iov;
+    int iovcnt;
+  };
+
+  struct write_operation : writev_operation {
+    write_operation(coro_connection* c, const char* buf, int size)
+        : writev_operation(c, &buffer, 1), buffer{(void*)buf, size_t(size)} {}
+    write_operation(const write_operation&) = delete;
+    iovec buffer;
+  };
+
+  struct sleep_operation : awaitable_operation<sleep_operation> {
+    sleep_operation(coro_connection* c, std::chrono::steady_clock::time_point deadline)
+        : awaitable_operation<sleep_operation>(c), deadline(deadline) {}
+    bool try_complete() {
+      return connection->closed or std::chrono::steady_clock::now() >= deadline;
+    }
+    inline void await_suspend(std::coroutine_handle<> h);
+    bool await_resume() { return !connection->closed; }
+    std::chrono::steady_clock::time_point deadline;
+  };
+
+  struct event_operation : awaitable_operation<event_operation> {
+    using awaitable_operation<event_operation>::awaitable_operation;
+    bool await_ready() { return connection->closed; }
+    bool try_complete() { return true; }
+    bool await_resume() { return !connection->closed; }
+  };
+
+  struct yield_operation {
+    bool await_ready() { return false; }
+    inline void await_suspend(std::coroutine_handle<> h);
+    bool await_resume() { return !connection->closed; }
+    coro_connection* connection;
+  };
+
+  inline coro_connection(coro_reactor* reactor, int socket_fd, sockaddr in_addr)
+      : reactor(reactor), socket_fd(socket_fd), in_addr(in_addr) {}
+  inline ~coro_connection();
+
+  coro_connection(const coro_connection&) = delete;
+  coro_connection& operator=(const coro_connection&) = delete;
+
+  // Read at most \size bytes. Return the number of bytes read, 0 if the connection is closed.
+  read_operation read(char* buf, int size) { return read_operation(this, buf, size); }
+  // Write \size bytes. Return false if the connection is closed.
+  write_operation write(const char* buf, int size) { return write_operation(this, buf, size); }
+  // Write several buffers with one sendmsg syscall. iov is modified to track partial writes.
+  writev_operation writev(iovec* iov, int iovcnt) { return writev_operation(this, iov, iovcnt); }
+  // Let the other connections run. Return false if the connection is closed.
+  yield_operation yield() { return yield_operation{this}; }
+  // Wait until \deadline. Return false if the connection was closed in the meantime.
+  sleep_operation sleep_until(std::chrono::steady_clock::time_point deadline) {
+    return sleep_operation(this, deadline);
+  }
+  template <typename R, typename P> sleep_operation sleep_for(std::chrono::duration<R, P> d) {
+    return sleep_until(std::chrono::steady_clock::now() + d);
+  }
+  // Wait for the next event on one of the file descriptors of the connection: the socket
+  // or the ones added with epoll_add, for example the socket of a database connection.
+  // Return false if the connection is closed.
+  event_operation wait_event() { return event_operation(this); }
+
+  // Subscribe to the events of \fd. They wake up the coroutine waiting in wait_event.
+  inline void epoll_add(int fd, int flags);
+
+  // Read without waiting. Return -1 if no data is available, 0 if the connection is closed.
+  int read_nowait(char* buf, int size) {
+    if (closed)
+      return 0;
+    ssize_t count = ::recv(socket_fd, buf, size, 0);
+    if (count < 0 and errno == EAGAIN)
+      return -1;
+    if (count <= 0)
+      closed = true;
+    return count < 0 ? 0 : count;
+  }
+
+  bool is_closed() const { return closed; }
+
+  // Called by the reactor on each event: complete the pending operation if possible.
+  void on_event() {
+    if (pending and pending->attempt(pending)) {
+      auto coroutine = pending->coroutine;
+      pending = nullptr;
+      coroutine.resume(); // May destroy this connection.
+    }
+  }
+
+  coro_reactor* reactor;
+  int socket_fd;
+  sockaddr in_addr;
+  bool closed = false;
+  operation* pending = nullptr;
+  uint64_t sleep_id = 0;     // Identifies the timer of the current sleep.
+  std::vector<int> user_fds; // File descriptors added with epoll_add.
+};
+
+// Epoll based reactor resuming the coroutines of its connections.
+struct coro_reactor {
+
+  int epoll_fd = -1;
+  tcp_server_options options;
+  std::vector<coro_connection*> fd_to_connection;
+
+  // Coroutines to resume at the next iteration of the loop. See coro_connection::yield.
+  std::vector<std::pair<coro_connection*, std::coroutine_handle<>>> ready, ready_batch;
+
+  // Sleeping connections: (deadline, socket fd, sleep id), ordered by deadline.
+  typedef std::tuple<std::chrono::steady_clock::time_point, int, uint64_t> timer_entry;
+  std::priority_queue<timer_entry, std::vector<timer_entry>, std::greater<timer_entry>> timers;
+  uint64_t sleep_counter = 0;
+
+  inline void epoll_add(int fd, int flags, coro_connection* connection) {
+    epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.data.fd = fd;
+    event.events = flags;
+    if (-1 == ::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) and errno != EEXIST)
+      std::cerr << "epoll_ctl error: " << strerror(errno) << std::endl;
+    if (int(fd_to_connection.size()) < fd + 1)
+      fd_to_connection.resize((fd + 1) * 2, nullptr);
+    fd_to_connection[fd] = connection;
+  }
+
+  inline void forget(coro_connection* connection) {
+    for (int fd : connection->user_fds)
+      if (fd_to_connection[fd] == connection)
+        fd_to_connection[fd] = nullptr;
+    fd_to_connection[connection->socket_fd] = nullptr;
+  }
+
+  template <typename H>
+  internal::coro_detached run_connection(H& handler, int socket_fd, sockaddr in_addr) {
+    {
+      coro_connection connection(this, socket_fd, in_addr);
+      epoll_add(socket_fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, &connection);
+      try {
+        co_await handler(connection);
+      } catch (const std::exception& e) {
+        std::cerr << "Error: exception in connection handler: " << e.what() << std::endl;
+      }
+    }
+    if (0 != close(socket_fd))
+      std::cerr << "Error when closing file descriptor " << socket_fd << ": "
+                << strerror(errno) << std::endl;
+  }
+
+  inline void process_timers() {
+    auto now = std::chrono::steady_clock::now();
+    while (!timers.empty() and std::get<0>(timers.top()) <= now) {
+      auto [deadline, fd, id] = timers.top();
+      timers.pop();
+      coro_connection* c = fd_to_connection[fd];
+      if (c and c->sleep_id == id)
+        c->on_event();
+    }
+  }
+
+  inline void process_ready() {
+    std::swap(ready, ready_batch);
+    for (auto [c, coroutine] : ready_batch)
+      coroutine.resume();
+    ready_batch.clear();
+  }
+
+  template <typename H> void event_loop(int listen_fd, H& handler) {
+
+    const int MAXEVENTS = 64;
+    epoll_fd = epoll_create1(0);
+    epoll_event listen_event;
+    memset(&listen_event, 0, sizeof(listen_event));
+    listen_event.data.fd = listen_fd;
+    listen_event.events = EPOLLIN | EPOLLET;
+    ::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &listen_event);
+    epoll_event events[MAXEVENTS];
+    impl::busy_poll_clock busy_poll(options.busy_poll_us);
+
+    while (!quit_signal_catched) {
+
+      // Wakeup to check if any quit signal has been catched.
+      int n_events =
+          epoll_wait(epoll_fd, events, MAXEVENTS, ready.empty() ? busy_poll.timeout() : 0);
+      if (quit_signal_catched)
+        break;
+      if (n_events > 0)
+        busy_poll.on_events();
+
+      for (int i = 0; i < n_events; i++) {
+        int event_fd = events[i].data.fd;
+
+        if (event_fd == listen_fd) {
+          if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+            std::cout << "FATAL ERROR: Error on server socket " << event_fd << std::endl;
+            quit_signal_catched = true;
+            break;
+          }
+          while (true) {
+            sockaddr in_addr;
+            socklen_t in_len = sizeof(in_addr);
+            int socket_fd = accept(listen_fd, &in_addr, &in_len);
+            if (socket_fd == -1)
+              break;
+            if (-1 == fcntl(socket_fd, F_SETFL, fcntl(socket_fd, F_GETFL, 0) | O_NONBLOCK)) {
+              close(socket_fd);
+              continue;
+            }
+            impl::configure_accepted_socket(socket_fd, options);
+            run_connection(handler, socket_fd, in_addr);
+          }
+          continue;
+        }
+
+        if (event_fd < 0 or event_fd >= int(fd_to_connection.size()))
+          continue;
+        coro_connection* c = fd_to_connection[event_fd];
+        if (!c)
+          continue;
+        if (event_fd == c->socket_fd and
+            (events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)))
+          c->closed = true;
+        c->on_event();
+      }
+
+      process_timers();
+      process_ready();
+    }
+    close(epoll_fd);
+  }
+};
+
+coro_connection::~coro_connection() { reactor->forget(this); }
+
+void coro_connection::epoll_add(int fd, int flags) {
+  reactor->epoll_add(fd, flags, this);
+  user_fds.push_back(fd);
+}
+
+void coro_connection::sleep_operation::await_suspend(std::coroutine_handle<> h) {
+  awaitable_operation<sleep_operation>::await_suspend(h);
+  connection->sleep_id = ++connection->reactor->sleep_counter;
+  connection->reactor->timers.emplace(deadline, connection->socket_fd, connection->sleep_id);
+}
+
+void coro_connection::yield_operation::await_suspend(std::coroutine_handle<> h) {
+  connection->reactor->ready.emplace_back(connection, h);
+}
+
+// Start \nthreads coroutine reactors accepting the connections on \port.
+// \conn_handler(coro_connection&) returns the coro_task handling the connection.
+template <typename H>
+void start_coro_tcp_server(int port, int socktype, int nthreads, H conn_handler,
+                           const tcp_server_options& options = tcp_server_options()) {
+
+  install_shutdown_handler();
+
+  int server_fd = impl::create_and_bind(port, socktype, options);
+  std::vector<std::thread> ths;
+  for (int i = 0; i < nthreads; i++)
+    ths.push_back(std::thread([&] {
+      coro_reactor reactor;
+      reactor.options = options;
+      reactor.event_loop(server_fd, conn_handler);
+    }));
+
+  for (auto& t : ths)
+    t.join();
+
+  close(server_fd);
+}
+
+} // namespace li
+
+#endif
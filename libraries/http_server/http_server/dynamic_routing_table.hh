@@ -14,7 +14,7 @@ namespace internal {
 
 template <typename V> struct drt_node {
 
-  drt_node() : v_{0, nullptr} {}
+  drt_node() : v_() {}
   
   struct iterator {
     const drt_node<V>* ptr;
@@ -42,10 +42,10 @@ template <typename V> struct drt_node {
 
     auto it = children_.find(k);
     if (it != children_.end())
-      return children_[k]->find_or_create(r, c);
+      return it->second->find_or_create(r, c);
     else
     {
-      auto new_node = new drt_node();
+      auto new_node = std::make_shared<drt_node>();
       children_.insert({k, new_node});
       return new_node->find_or_create(r, c);
     }
@@ -53,23 +53,23 @@ template <typename V> struct drt_node {
     return v_;
   }
 
+  // Call f on every node, including the ones that have children.
   template <typename F> void for_all_routes(F f, std::string prefix = "") const {
-    if (children_.size() == 0)
-      f(prefix, v_);
-    else {
-      if (prefix.size() && prefix.back() != '/')
-        prefix += '/';
-      for (auto pair : children_)
-        pair.second->for_all_routes(f, prefix + std::string(pair.first));
-    }
+    f(prefix, v_);
+    if (prefix.size() && prefix.back() != '/')
+      prefix += '/';
+    for (auto& pair : children_)
+      pair.second->for_all_routes(f, prefix + std::string(pair.first));
   }
-  iterator find(const std::string_view& r, unsigned int c) const {
+  // \has_value tells if a value is set.
+  template <typename F>
+  iterator find(const std::string_view& r, unsigned int c, F has_value) const {
     // We found the route r.
-    if ((c == r.size() and v_.handler != nullptr) or (children_.size() == 0))
+    if ((c == r.size() and has_value(v_)) or (children_.size() == 0))
       return iterator{this, r, v_};
 
     // r does not match any route.
-    if (c == r.size() and v_.handler == nullptr)
+    if (c == r.size())
       return iterator{nullptr, r, v_};
 
     if (r[c] == '/')
@@ -86,7 +86,7 @@ template <typename V> struct drt_node {
     // look for k in the children.
     auto it = children_.find(k);
     if (it != children_.end()) {
-      auto it2 = it->second->find(r, c); // search in the corresponding child.
+      auto it2 = it->second->find(r, c, has_value); // search in the corresponding child.
       if (it2 != it->second->end())
         return it2;
     }
@@ -97,14 +97,14 @@ template <typename V> struct drt_node {
         auto name = kv.first;
         if (name.size() > 4 and name[0] == '{' and name[1] == '{' and
             name[name.size() - 2] == '}' and name[name.size() - 1] == '}')
-          return kv.second->find(r, c);
+          return kv.second->find(r, c, has_value);
       }
       return end();
     }
   }
 
   V v_;
-  std::unordered_map<std::string_view, drt_node*> children_;
+  std::unordered_map<std::string_view, std::shared_ptr<drt_node>> children_;
 };
 } // namespace internal
 
@@ -122,8 +122,10 @@ template <typename V> struct dynamic_routing_table {
     return root.find_or_create(r2, 0);
   }
 
-  // Find a route and return an iterator.
-  auto find(const std::string_view& r) const { return root.find(r, 0); }
+  // Find a route and return an iterator. \has_value tells if a value is set.
+  template <typename F> auto find(const std::string_view& r, F has_value) const {
+    return root.find(r, 0, has_value);
+  }
 
   template <typename F> void for_all_routes(F f) const { root.for_all_routes(f); }
   auto end() const { return root.end(); }
@@ -39,6 +39,9 @@ public:
 
   LI_HTTP_ERROR(500, internal_server_error)
   LI_HTTP_ERROR(501, not_implemented)
+  LI_HTTP_ERROR(502, bad_gateway)
+  LI_HTTP_ERROR(503, service_unavailable)
+  LI_HTTP_ERROR(504, gateway_timeout)
 
 #undef LI_HTTP_ERROR
 
@@ -0,0 +1,277 @@
+#pragma once
+
+#include <cassert>
+#include <chrono>
+#include <deque>
+#include <optional>
+
+#include <li/http_server/tcp_server.hh>
+
+namespace li {
+
+// Synchronization between the fibers of one async_reactor: mutex, semaphore, condition
+// variable, channel and one-shot event.
+//
+// Waiting fibers are parked on intrusive wait lists (the nodes live on their stack) and
+// woken with defer_fiber_resume: nothing is polled. These primitives are not thread safe,
+// all their users must run on the same reactor (for example with s::nthreads = 1, or
+// one instance per thread). To wake fibers from other threads, use sse_hub.
+//
+// Waits return false without waiting if the connection of the fiber is closed, or
+// when their deadline expires.
+
+typedef std::chrono::steady_clock::time_point fiber_deadline;
+
+// A fiber waiting on a fiber_wait_list.
+struct fiber_waiter {
+  async_fiber_context* fiber;
+  fiber_waiter* prev = nullptr;
+  fiber_waiter* next = nullptr;
+  bool notified = false;
+};
+
+// Intrusive FIFO list of parked fibers.
+struct fiber_wait_list {
+
+  fiber_wait_list() = default;
+  fiber_wait_list(const fiber_wait_list&) = delete;
+  fiber_wait_list& operator=(const fiber_wait_list&) = delete;
+  ~fiber_wait_list() { assert(empty()); }
+
+  bool empty() const { return head == nullptr; }
+
+  // Park \fiber until it is notified or until \deadline.
+  // Return true if it was notified.
+  bool wait(async_fiber_context& fiber, fiber_deadline deadline = fiber_deadline::max()) {
+    fiber_waiter waiter{&fiber};
+    push_back(waiter);
+    while (!waiter.notified) {
+      bool alive = deadline == fiber_deadline::max() ? fiber.park() : fiber.park_until(deadline);
+      if (waiter.notified or !alive or std::chrono::steady_clock::now() >= deadline)
+        break;
+    }
+    if (!waiter.notified)
+      remove(waiter);
+    return waiter.notified;
+  }
+
+  // Wake up the first waiter. Return false if there is none.
+  bool notify_one() {
+    fiber_waiter* waiter = head;
+    if (!waiter)
+      return false;
+    remove(*waiter);
+    waiter->notified = true;
+    waiter->fiber->defer_fiber_resume(waiter->fiber->fiber_id);
+    return true;
+  }
+
+  void notify_all() {
+    while (notify_one())
+      ;
+  }
+
+private:
+  // \waiter lives on the stack of wait, which removes it from the list before returning.
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 12
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdangling-pointer"
+#endif
+  void push_back(fiber_waiter& waiter) {
+    waiter.prev = tail;
+    waiter.next = nullptr;
+    if (tail)
+      tail->next = &waiter;
+    else
+      head = &waiter;
+    tail = &waiter;
+  }
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 12
+#pragma GCC diagnostic pop
+#endif
+
+  void remove(fiber_waiter& waiter) {
+    (waiter.prev ? waiter.prev->next : head) = waiter.next;
+    (waiter.next ? waiter.next->prev : tail) = waiter.prev;
+    waiter.prev = waiter.next = nullptr;
+  }
+
+  fiber_waiter* head = nullptr;
+  fiber_waiter* tail = nullptr;
+};
+
+// Counting semaphore. release hands its unit directly to the first waiter, so the waiters
+// are served in FIFO order.
+struct fiber_semaphore {
+
+  fiber_semaphore(int count = 0) : count_(count) {}
+
+  bool try_acquire() {
+    if (count_ == 0)
+      return false;
+    count_--;
+    return true;
+  }
+
+  // Return true once a unit is acquired.
+  bool acquire(async_fiber_context& fiber, fiber_deadline deadline = fiber_deadline::max()) {
+    return try_acquire() or waiters_.wait(fiber, deadline);
+  }
+  template <typename D> bool acquire_for(async_fiber_context& fiber, D duration) {
+    return acquire(fiber, std::chrono::steady_clock::now() + duration);
+  }
+
+  void release() {
+    if (!waiters_.notify_one())
+      count_++;
+  }
+
+  int count() const { return count_; }
+
+private:
+  int count_;
+  fiber_wait_list waiters_;
+};
+
+// Mutex held across waits. unlock hands the lock to the first waiter.
+struct fiber_mutex {
+
+  bool try_lock() { return semaphore_.try_acquire(); }
+
+  // Return true once the lock is owned.
+  bool lock(async_fiber_context& fiber, fiber_deadline deadline = fiber_deadline::max()) {
+    return semaphore_.acquire(fiber, deadline);
+  }
+
+  void unlock() { semaphore_.release(); }
+
+  bool is_locked() const { return semaphore_.count() == 0; }
+
+private:
+  fiber_semaphore semaphore_{1};
+};
+
+// Scoped lock of a fiber_mutex. Check it before using the protected data:
+//   if (fiber_lock_guard lock{mutex, fiber}) { ... }
+struct fiber_lock_guard {
+  fiber_lock_guard(fiber_mutex& mutex, async_fiber_context& fiber)
+      : mutex(mutex), owns(mutex.lock(fiber)) {}
+  fiber_lock_guard(const fiber_lock_guard&) = delete;
+  ~fiber_lock_guard() {
+    if (owns)
+      mutex.unlock();
+  }
+  explicit operator bool() const { return owns; }
+
+  fiber_mutex& mutex;
+  bool owns;
+};
+
+// Condition variable. Fibers of a reactor do not run concurrently, so no mutex is needed
+// to check a condition and wait atomically.
+struct fiber_condition_variable {
+
+  // Wait for the next notification. May return true while the condition does not hold yet.
+  bool wait(async_fiber_context& fiber, fiber_deadline deadline = fiber_deadline::max()) {
+    return waiters_.wait(fiber, deadline);
+  }
+
+  // Wait until \predicate() is true. Return false if the connection closed or the
+  // deadline expired before.
+  template <typename P>
+  bool wait(async_fiber_context& fiber, P predicate,
+            fiber_deadline deadline = fiber_deadline::max()) {
+    while (!predicate())
+      if (!waiters_.wait(fiber, deadline))
+        return predicate();
+    return true;
+  }
+
+  void notify_one() { waiters_.notify_one(); }
+  void notify_all() { waiters_.notify_all(); }
+
+private:
+  fiber_wait_list waiters_;
+};
+
+// One-shot event: once set, all the current and future waits return true.
+struct fiber_event {
+
+  void set() {
+    is_set_ = true;
+    waiters_.notify_all();
+  }
+  bool is_set() const { return is_set_; }
+
+  bool wait(async_fiber_context& fiber, fiber_deadline deadline = fiber_deadline::max()) {
+    return is_set_ or waiters_.wait(fiber, deadline);
+  }
+
+private:
+  bool is_set_ = false;
+  fiber_wait_list waiters_;
+};
+
+// Bounded multi-producer multi-consumer channel.
+// send waits while the channel is full, receive waits while it is empty.
+// After close, send fails and receive drains the remaining values.
+template <typename T> struct fiber_channel {
+
+  fiber_channel(int capacity = 1) : capacity_(capacity) { assert(capacity > 0); }
+
+  bool try_send(T value) {
+    if (closed_ or int(values_.size()) >= capacity_)
+      return false;
+    values_.push_back(std::move(value));
+    receivers_.notify_one();
+    return true;
+  }
+
+  // Return false if the channel or the connection of \fiber is closed, or at \deadline.
+  bool send(async_fiber_context& fiber, T value,
+            fiber_deadline deadline = fiber_deadline::max()) {
+    while (!closed_ and int(values_.size()) >= capacity_)
+      if (!senders_.wait(fiber, deadline))
+        break;
+    return try_send(std::move(value));
+  }
+
+  std::optional<T> try_receive() {
+    if (values_.empty())
+      return std::nullopt;
+    std::optional<T> value(std::move(values_.front()));
+    values_.pop_front();
+    senders_.notify_one();
+    return value;
+  }
+
+  // Return nullopt if the channel is closed and empty, the connection of \fiber is closed,
+  // or at \deadline.
+  std::optional<T> receive(async_fiber_context& fiber,
+                           fiber_deadline deadline = fiber_deadline::max()) {
+    while (!closed_ and values_.empty())
+      if (!receivers_.wait(fiber, deadline))
+        break;
+    return try_receive();
+  }
+
+  // Wake up all the waiters: senders fail, receivers get the remaining values.
+  void close() {
+    closed_ = true;
+    senders_.notify_all();
+    receivers_.notify_all();
+  }
+
+  bool is_closed() const { return closed_; }
+  int size() const { return values_.size(); }
+  int capacity() const { return capacity_; }
+
+private:
+  int capacity_;
+  bool closed_ = false;
+  std::deque<T> values_;
+  fiber_wait_list senders_;
+  fiber_wait_list receivers_;
+};
+
+} // namespace li
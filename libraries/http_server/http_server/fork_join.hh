@@ -0,0 +1,132 @@
+#pragma once
+
+#include <exception>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <li/http_server/tcp_server.hh>
+
+namespace li {
+
+// A group of child fibers spawned from a request handler on its reactor.
+// Children get their own async_fiber_context: they can take their own SQL connection
+// (db.connect(child)) or wait on other file descriptors, while the parent waits in join.
+//
+// The first exception thrown by a child cancels the others and is rethrown by join.
+// Cancelled children, and all the children when the client closes the connection, see
+// child.is_closed(): yield and park return false.
+struct fiber_group {
+
+  fiber_group(async_fiber_context& parent) : parent(parent) {}
+  fiber_group(const fiber_group&) = delete;
+  fiber_group& operator=(const fiber_group&) = delete;
+
+  // Children reference the stack of the parent: wait for them even on errors.
+  ~fiber_group() {
+    if (running) {
+      cancel();
+      wait();
+    }
+  }
+
+  // Run \f(async_fiber_context& child) in a new fiber. It starts immediately and runs
+  // until its first yield.
+  template <typename F> void spawn(F f) {
+    running++;
+    int index = children.size();
+    children.push_back(-1);
+    int fiber_id = parent.reactor->spawn(parent, [this, index, f = std::move(f)](
+                                                     async_fiber_context& child) mutable {
+      child.cancelled = &cancelled;
+      if (!cancelled) {
+        try {
+          f(child);
+        } catch (boost::context::detail::forced_unwind&) {
+          // The reactor unwinds the stack of a suspended child it destroys.
+          throw;
+        } catch (...) {
+          if (!error)
+            error = std::current_exception();
+          cancel();
+        }
+      }
+      children[index] = -2;
+      if (--running == 0)
+        child.defer_fiber_resume(parent.fiber_id);
+    });
+    // -2 if the child already returned.
+    if (children[index] == -1)
+      children[index] = fiber_id;
+  }
+
+  // Wake up the running children: they see their connection closed.
+  void cancel() {
+    if (cancelled)
+      return;
+    cancelled = true;
+    for (int fiber_id : children)
+      if (fiber_id >= 0)
+        parent.defer_fiber_resume(fiber_id);
+  }
+  bool is_cancelled() const { return cancelled; }
+
+  // Wait for all the children, then rethrow the first exception thrown by one of them.
+  void join() {
+    wait();
+    if (error)
+      std::rethrow_exception(std::exchange(error, nullptr));
+  }
+
+private:
+  void wait() {
+    // If the client is gone, park returns immediately: yield until the children,
+    // which also see the connection closed, return.
+    while (running)
+      if (!parent.park())
+        parent.yield();
+  }
+
+  async_fiber_context& parent;
+  int running = 0;
+  // Fiber ids of the children, negative once they returned.
+  std::vector<int> children;
+  bool cancelled = false;
+  std::exception_ptr error;
+};
+
+// Run \task(child, i) for i in [0, n) in n child fibers and wait for them.
+// Return the vector of the results, or nothing if \task returns void.
+template <typename F> auto fork_join(async_fiber_context& fiber, int n, F task) {
+  typedef std::invoke_result_t<F&, async_fiber_context&, int> R;
+  fiber_group group(fiber);
+  if constexpr (std::is_void_v<R>) {
+    for (int i = 0; i < n; i++)
+      group.spawn([&task, i](async_fiber_context& child) { task(child, i); });
+    group.join();
+  } else {
+    std::vector<R> results(n);
+    for (int i = 0; i < n; i++)
+      group.spawn([&task, &results, i](async_fiber_context& child) { results[i] = task(child, i); });
+    group.join();
+    return results;
+  }
+}
+
+// Run each of \tasks(child) in its own child fiber and wait for them.
+// Return the tuple of the results. Tasks cannot return void.
+template <typename... F> auto fork_join_all(async_fiber_context& fiber, F... tasks) {
+  std::tuple<std::invoke_result_t<F&, async_fiber_context&>...> results;
+  fiber_group group(fiber);
+  std::apply(
+      [&](auto&... result) {
+        (group.spawn([&task = tasks, &result](async_fiber_context& child) { result = task(child); }),
+         ...);
+      },
+      results);
+  group.join();
+  return results;
+}
+
+} // namespace li
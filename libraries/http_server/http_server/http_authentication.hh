@@ -3,6 +3,7 @@
 #include <optional>
 
 #include <li/http_server/api.hh>
+#include <li/http_server/offload_pool.hh>
 #include <li/http_server/sql_http_session.hh>
 
 namespace li {
@@ -29,8 +30,11 @@ struct http_authentication {
     auto lp = req.post_parameters(login_field_ = users_.all_fields()[login_field_],
                                   password_field_ = users_.all_fields()[password_field_]);
 
+    // Password hashing is slow by design: run it on the offload pool.
     if constexpr (has_key<decltype(callbacks_)>(s::hash_password))
-      lp[password_field_] = callbacks_[s::hash_password](lp[login_field_], lp[password_field_]);
+      lp[password_field_] = await_blocking(req.fiber, [&] {
+        return callbacks_[s::hash_password](lp[login_field_], lp[password_field_]);
+      });
 
     if (auto user = users_.connect(req.fiber).find_one(lp)) {
       sessions_.connect(req, resp).store(s::user_id = user->id);
@@ -59,8 +63,9 @@ struct http_authentication {
       if constexpr (has_key<decltype(callbacks_)>(s::update_secret_key))
         callbacks_[s::update_secret_key](new_user[login_field_], new_user[password_field_]);
       if constexpr (has_key<decltype(callbacks_)>(s::hash_password))
-        new_user[password_field_] =
-            callbacks_[s::hash_password](new_user[login_field_], new_user[password_field_]);
+        new_user[password_field_] = await_blocking(req.fiber, [&] {
+          return callbacks_[s::hash_password](new_user[login_field_], new_user[password_field_]);
+        });
       users.insert(new_user);
       return true;
     }
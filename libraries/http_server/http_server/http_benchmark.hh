@@ -1,11 +1,30 @@
 #pragma once
 
+#include <algorithm>
 #include <atomic>
 #include <boost/context/continuation.hpp>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <deque>
 #include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <string_view>
 #include <thread>
+#include <vector>
 
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <strings.h>
+#include <sys/epoll.h>
+
+#include <li/http_server/symbols.hh>
 #include <li/http_server/timer.hh>
+#include <li/http_server/upstream.hh>
+#include <li/metamap/metamap.hh>
 namespace ctx = boost::context;
 
 namespace li {
@@ -200,4 +219,483 @@ inline float http_benchmark(const std::vector<int>& sockets, int NTHREADS, int d
   return (1000. * nmessages / global_timer.ms());
 }
 
+// Histogram of positive integers with a fixed relative precision, with the layout of
+// HdrHistogram: values are grouped in buckets of power of two ranges, each split in
+// linear sub-buckets. With 3 significant digits, the values are stored with an error
+// below 0.1%, from 1 to \highest_value, in (log2(highest_value) - 10) * 1024 counters.
+struct hdr_histogram {
+
+  hdr_histogram(int64_t highest_value = 3600LL * 1000 * 1000 * 1000, int significant_digits = 3) {
+    int64_t largest_single_unit = 2 * int64_t(std::pow(10, significant_digits));
+    sub_bucket_half_count_magnitude = int(std::ceil(std::log2(double(largest_single_unit)))) - 1;
+    sub_bucket_half_count = 1 << sub_bucket_half_count_magnitude;
+    sub_bucket_count = 2 * sub_bucket_half_count;
+    int buckets = 1;
+    for (int64_t smallest_untrackable = sub_bucket_count; smallest_untrackable <= highest_value;
+         smallest_untrackable <<= 1)
+      buckets++;
+    counts.resize((buckets + 1) * sub_bucket_half_count, 0);
+    highest_trackable = highest_value;
+  }
+
+  // Values above the highest trackable value are clamped.
+  void record(int64_t value, int64_t count = 1) {
+    value = std::clamp<int64_t>(value, 0, highest_trackable);
+    counts[counts_index(value)] += count;
+    total += count;
+    sum += double(value) * count;
+    min_value = std::min(min_value, value);
+    max_value = std::max(max_value, value);
+  }
+
+  // Record \value measured by a closed-loop client sending a request every
+  // \expected_interval, and the requests it could not send while it was waiting
+  // (coordinated omission correction).
+  void record_corrected(int64_t value, int64_t expected_interval) {
+    record(value);
+    if (expected_interval <= 0)
+      return;
+    for (int64_t missed = value - expected_interval; missed >= expected_interval;
+         missed -= expected_interval)
+      record(missed);
+  }
+
+  void add(const hdr_histogram& other) {
+    for (size_t i = 0; i < other.counts.size(); i++)
+      if (other.counts[i])
+        record(value_from_index(i), other.counts[i]);
+  }
+
+  // Value below which \percentile percents of the recorded values are.
+  int64_t value_at_percentile(double percentile) const {
+    int64_t target = std::max<int64_t>(1, int64_t(std::ceil(percentile / 100 * total)));
+    int64_t seen = 0;
+    for (size_t i = 0; i < counts.size(); i++) {
+      seen += counts[i];
+      if (seen >= target)
+        return std::min(max_value, highest_equivalent_value(value_from_index(i)));
+    }
+    return max_value;
+  }
+
+  int64_t count() const { return total; }
+  int64_t min() const { return total ? min_value : 0; }
+  int64_t max() const { return max_value; }
+  double mean() const { return total ? sum / total : 0; }
+
+private:
+  int bucket_index(int64_t value) const {
+    int pow2_ceiling = 64 - __builtin_clzll(uint64_t(value) | (sub_bucket_count - 1));
+    return pow2_ceiling - (sub_bucket_half_count_magnitude + 1);
+  }
+
+  size_t counts_index(int64_t value) const {
+    int bucket = bucket_index(value);
+    int sub_bucket = int(value >> bucket);
+    return (size_t(bucket + 1) << sub_bucket_half_count_magnitude) + sub_bucket -
+           sub_bucket_half_count;
+  }
+
+  int64_t value_from_index(size_t index) const {
+    int bucket = int(index >> sub_bucket_half_count_magnitude) - 1;
+    int sub_bucket = int(index & (sub_bucket_half_count - 1)) + sub_bucket_half_count;
+    if (bucket < 0) {
+      sub_bucket -= sub_bucket_half_count;
+      bucket = 0;
+    }
+    return int64_t(sub_bucket) << bucket;
+  }
+
+  int64_t highest_equivalent_value(int64_t value) const {
+    int bucket = bucket_index(value);
+    int sub_bucket = int(value >> bucket);
+    int64_t range = int64_t(1) << (bucket + (sub_bucket >= sub_bucket_count ? 1 : 0));
+    return (int64_t(sub_bucket) << bucket) + range - 1;
+  }
+
+  int sub_bucket_half_count_magnitude;
+  int sub_bucket_half_count;
+  int sub_bucket_count;
+  int64_t highest_trackable;
+  std::vector<int64_t> counts;
+  int64_t total = 0;
+  double sum = 0;
+  int64_t min_value = INT64_MAX;
+  int64_t max_value = 0;
+};
+
+// One request sent by http_benchmark_open_loop. Times are in nanoseconds since the start.
+struct http_benchmark_record {
+  int request;       // Index in s::requests.
+  int64_t scheduled; // Send time given by the arrival schedule.
+  int64_t sent;
+  int64_t completed; // -1 if no response was received.
+  int status;
+};
+
+struct http_benchmark_result {
+  hdr_histogram latency;                   // Nanoseconds, from the scheduled send time.
+  std::vector<hdr_histogram> latency_per_request; // One per request template.
+  long long scheduled = 0;
+  long long completed = 0;
+  long long errors = 0;      // Requests without response: connection lost or still pending.
+  long long bad_status = 0;  // Responses with a status >= 400.
+  double seconds = 0;        // Duration of the schedule.
+  std::vector<http_benchmark_record> records; // Only with s::record_requests.
+
+  // Print the latency percentiles in microseconds, per request template and in total.
+  void print(const std::vector<std::string>& names = {}, FILE* out = stdout) const {
+    fprintf(out, "%-24s %10s %9s %9s %9s %9s\n", "request", "count", "p50", "p99", "p999", "max");
+    auto line = [&](const std::string& name, const hdr_histogram& h) {
+      fprintf(out, "%-24s %10lld %9.1f %9.1f %9.1f %9.1f\n", name.c_str(), (long long)h.count(),
+              h.value_at_percentile(50) / 1e3, h.value_at_percentile(99) / 1e3,
+              h.value_at_percentile(99.9) / 1e3, h.max() / 1e3);
+    };
+    if (latency_per_request.size() > 1)
+      for (size_t i = 0; i < latency_per_request.size(); i++)
+        line(i < names.size() ? names[i] : "#" + std::to_string(i), latency_per_request[i]);
+    line("all", latency);
+    fprintf(out, "%.0f requests/s, %lld errors, %lld responses >= 400\n", completed / seconds,
+            errors, bad_status);
+  }
+};
+
+namespace http_benchmark_impl {
+
+inline int connect_blocking(const sockaddr_in& server) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  if (connect(fd, (const sockaddr*)&server, sizeof(server))) {
+    close(fd);
+    return -1;
+  }
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+  return fd;
+}
+
+// Incremental parser of the responses of a connection.
+struct response_reader {
+
+  // Parse the responses in \buffer, calling \on_response(status) for each complete one.
+  // \no_body() tells if the next response has no body (response to HEAD).
+  template <typename N, typename F> void feed(std::string& buffer, N no_body, F on_response) {
+    size_t pos = 0;
+    while (pos < buffer.size()) {
+      if (!in_body) {
+        size_t end = buffer.find("\r\n\r\n", pos);
+        if (end == std::string::npos)
+          break;
+        std::string_view headers(buffer.data() + pos, end + 4 - pos);
+        pos = end + 4;
+        status = headers.size() > 12 ? atoi(headers.data() + 9) : 0;
+        remaining = 0;
+        chunked = false;
+        size_t cur = headers.find("\r\n") + 2;
+        while (cur < headers.size()) {
+          size_t line_end = headers.find("\r\n", cur);
+          std::string_view line = headers.substr(cur, line_end - cur);
+          cur = line_end + 2;
+          size_t colon = line.find(':');
+          if (colon == std::string_view::npos)
+            continue;
+          std::string_view key = line.substr(0, colon);
+          if (impl::header_equals(key, "Content-Length"))
+            remaining = atoll(line.data() + colon + 1);
+          else if (impl::header_equals(key, "Transfer-Encoding"))
+            chunked = line.find("chunked") != std::string_view::npos;
+        }
+        if (no_body() or status == 204 or status == 304 or status < 200)
+          remaining = 0, chunked = false;
+        decoder = impl::chunked_body_decoder();
+        in_body = true;
+      }
+      if (chunked) {
+        pos += decoder.feed(std::string_view(buffer.data() + pos, buffer.size() - pos),
+                            [](std::string_view) {});
+        if (!decoder.finished())
+          break;
+      } else {
+        size_t n = std::min<size_t>(remaining, buffer.size() - pos);
+        pos += n;
+        remaining -= n;
+        if (remaining)
+          break;
+      }
+      in_body = false;
+      on_response(status);
+    }
+    buffer.erase(0, pos);
+  }
+
+  bool in_body = false;
+  bool chunked = false;
+  int status = 0;
+  long long remaining = 0;
+  impl::chunked_body_decoder decoder;
+};
+
+} // namespace http_benchmark_impl
+
+// Open-loop load generator: requests are sent on a fixed schedule, whatever the response
+// times of the server, like independent clients would do. Latencies are measured from the
+// scheduled send time, so a request waiting behind a slow response also counts the wait
+// (no coordinated omission).
+//
+//   auto result = http_benchmark_open_loop(8080, s::rate = 20000, s::duration = 10000,
+//                                          s::connections = 64, s::poisson,
+//                                          s::requests = std::vector<std::string>{
+//                                            "GET /a HTTP/1.1\r\nHost: x\r\n\r\n",
+//                                            "GET /b HTTP/1.1\r\nHost: x\r\n\r\n"},
+//                                          s::weights = std::vector<double>{9, 1});
+//   result.print({"/a", "/b"});
+//
+// Options:
+//   s::rate: requests per second (default 1000).
+//   s::duration: length of the schedule in milliseconds (default 5000).
+//   s::connections: keep-alive connections (default 10), opened before the schedule starts.
+//   s::nthreads: client threads (default 1), each one sends rate / nthreads requests per
+//                second on connections / nthreads connections.
+//   s::poisson: exponential intervals between requests. Default: constant interval.
+//   s::requests: raw request templates (default: GET /). s::weights: their frequencies.
+//   s::pipelined: send each request as soon as it is scheduled, on the next connection.
+//                 Default: at most one request in flight per connection, the others wait
+//                 for a free connection.
+//   s::record_requests: fill result.records with the timestamps of every request.
+//   s::host: ipv4 address of the server (default 127.0.0.1).
+template <typename... O> http_benchmark_result http_benchmark_open_loop(int port, O... opts) {
+  typedef std::chrono::steady_clock clock;
+  using namespace http_benchmark_impl;
+
+  auto options = mmm(opts...);
+  double rate = get_or(options, s::rate, 1000);
+  int duration_ms = get_or(options, s::duration, 5000);
+  int nconnections = get_or(options, s::connections, 10);
+  int nthreads = std::max(1, std::min<int>(get_or(options, s::nthreads, 1), nconnections));
+  bool poisson = has_key(options, s::poisson);
+  bool pipelined = has_key(options, s::pipelined);
+  bool record_requests = has_key(options, s::record_requests);
+  std::vector<std::string> requests =
+      get_or(options, s::requests, std::vector<std::string>{"GET / HTTP/1.1\r\n\r\n"});
+  std::vector<double> weights =
+      get_or(options, s::weights, std::vector<double>(requests.size(), 1.));
+  std::string host = get_or(options, s::host, std::string("127.0.0.1"));
+
+  sockaddr_in server;
+  memset(&server, 0, sizeof(server));
+  server.sin_family = AF_INET;
+  server.sin_addr.s_addr = inet_addr(host.c_str());
+  server.sin_port = htons(port);
+
+  std::vector<bool> head(requests.size());
+  for (size_t i = 0; i < requests.size(); i++)
+    head[i] = requests[i].compare(0, 5, "HEAD ") == 0;
+
+  http_benchmark_result result;
+  result.latency_per_request.resize(requests.size());
+  result.seconds = duration_ms / 1000.;
+  std::mutex result_mutex;
+
+  auto start = clock::now() + std::chrono::milliseconds(100);
+  auto end = start + std::chrono::milliseconds(duration_ms);
+  auto drain_deadline = end + std::chrono::seconds(2);
+  auto since_start = [&](clock::time_point t) {
+    return int64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(t - start).count());
+  };
+
+  auto client = [&](int thread_id) {
+    struct pending {
+      int request;
+      clock::time_point scheduled;
+      clock::time_point sent;
+    };
+    struct connection {
+      int fd = -1;
+      std::string input;
+      std::string output;
+      std::deque<pending> in_flight;
+      response_reader reader;
+    };
+
+    int first = thread_id * nconnections / nthreads;
+    int last = (thread_id + 1) * nconnections / nthreads;
+    std::vector<connection> connections(last - first);
+    int epoll_fd = epoll_create1(0);
+    auto open = [&](int i) {
+      connection& c = connections[i];
+      c = connection();
+      c.fd = connect_blocking(server);
+      if (c.fd < 0)
+        return false;
+      epoll_event event;
+      event.data.u32 = i;
+      event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+      ::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c.fd, &event);
+      return true;
+    };
+    for (size_t i = 0; i < connections.size(); i++)
+      if (!open(i))
+        http_benchmark_impl::error("Cannot connect to server");
+
+    std::mt19937_64 random(thread_id + 1);
+    std::discrete_distribution<int> pick_request(weights.begin(), weights.end());
+    double thread_rate = rate / nthreads;
+    std::exponential_distribution<double> exponential(thread_rate);
+    auto next_interval = [&] {
+      double seconds = poisson ? exponential(random) : 1. / thread_rate;
+      return std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(seconds));
+    };
+
+    hdr_histogram latency;
+    std::vector<hdr_histogram> latency_per_request(requests.size());
+    std::vector<http_benchmark_record> records;
+    long long scheduled = 0, completed = 0, errors = 0, bad_status = 0;
+    std::deque<pending> backlog; // Scheduled, waiting for a free connection.
+    size_t next_connection = 0;
+    size_t in_flight = 0;
+
+    auto finish = [&](const pending& p, clock::time_point now, int status) {
+      if (status) {
+        int64_t ns = int64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                 now - p.scheduled).count());
+        latency.record(ns);
+        latency_per_request[p.request].record(ns);
+        completed++;
+        bad_status += status >= 400;
+      } else
+        errors++;
+      if (record_requests)
+        records.push_back({p.request, since_start(p.scheduled), since_start(p.sent),
+                           status ? since_start(now) : -1, status});
+    };
+
+    auto flush = [&](connection& c) {
+      while (c.output.size()) {
+        ssize_t n = ::send(c.fd, c.output.data(), c.output.size(), MSG_NOSIGNAL);
+        if (n <= 0)
+          return n < 0 and errno == EAGAIN;
+        c.output.erase(0, n);
+      }
+      return true;
+    };
+
+    // A failed connection loses its requests in flight, and is opened again.
+    auto reset = [&](int i, clock::time_point now) {
+      connection& c = connections[i];
+      for (auto& p : c.in_flight)
+        finish(p, now, 0);
+      in_flight -= c.in_flight.size();
+      close(c.fd);
+      open(i);
+    };
+
+    auto send_request = [&](int i, pending p, clock::time_point now) {
+      connection& c = connections[i];
+      p.sent = now;
+      c.output += requests[p.request];
+      c.in_flight.push_back(p);
+      in_flight++;
+      if (!flush(c))
+        reset(i, now);
+    };
+
+    auto next_arrival = start + next_interval() * thread_id / nthreads;
+    epoll_event events[64];
+    while (true) {
+      auto now = clock::now();
+      for (; next_arrival <= now and next_arrival < end; next_arrival += next_interval()) {
+        backlog.push_back({pick_request(random), next_arrival, next_arrival});
+        scheduled++;
+      }
+
+      // Dispatch the scheduled requests.
+      while (backlog.size()) {
+        int i = -1;
+        for (size_t k = 0; k < connections.size() and i == -1; k++) {
+          size_t c = (next_connection + k) % connections.size();
+          if (connections[c].fd != -1 and (pipelined or connections[c].in_flight.empty()))
+            i = c;
+        }
+        if (i == -1)
+          break;
+        next_connection = i + 1;
+        send_request(i, backlog.front(), now);
+        backlog.pop_front();
+      }
+
+      if (now >= drain_deadline or (now >= end and backlog.empty() and in_flight == 0))
+        break;
+
+      // Sleep until the next arrival, polling when it is less than a millisecond away.
+      auto until = next_arrival < end ? next_arrival : drain_deadline;
+      auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(until - now);
+      int n = epoll_wait(epoll_fd, events, 64, std::max(0, int(wait.count()) - 1));
+      now = clock::now();
+      for (int e = 0; e < n; e++) {
+        int i = events[e].data.u32;
+        connection& c = connections[i];
+        if (events[e].events & EPOLLOUT and !flush(c)) {
+          reset(i, now);
+          continue;
+        }
+        bool closed = events[e].events & (EPOLLERR | EPOLLHUP);
+        char buf[65536];
+        while (!closed) {
+          ssize_t r = ::recv(c.fd, buf, sizeof(buf), 0);
+          if (r > 0)
+            c.input.append(buf, r);
+          else {
+            closed = r == 0 or errno != EAGAIN;
+            break;
+          }
+        }
+        c.reader.feed(
+            c.input, [&] { return c.in_flight.size() and head[c.in_flight.front().request]; },
+            [&](int status) {
+              if (c.in_flight.empty())
+                return;
+              finish(c.in_flight.front(), now, status);
+              c.in_flight.pop_front();
+              in_flight--;
+            });
+        if (closed)
+          reset(i, now);
+      }
+    }
+
+    // Requests that did not get a response before the drain deadline.
+    auto now = clock::now();
+    for (auto& p : backlog)
+      finish(p, now, 0);
+    for (auto& c : connections) {
+      for (auto& p : c.in_flight)
+        finish(p, now, 0);
+      close(c.fd);
+    }
+    close(epoll_fd);
+
+    std::lock_guard<std::mutex> lock(result_mutex);
+    result.latency.add(latency);
+    for (size_t i = 0; i < requests.size(); i++)
+      result.latency_per_request[i].add(latency_per_request[i]);
+    result.scheduled += scheduled;
+    result.completed += completed;
+    result.errors += errors;
+    result.bad_status += bad_status;
+    result.records.insert(result.records.end(), records.begin(), records.end());
+  };
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < nthreads; t++)
+    threads.emplace_back(client, t);
+  for (auto& t : threads)
+    t.join();
+  if (record_requests)
+    std::sort(result.records.begin(), result.records.end(),
+              [](auto& a, auto& b) { return a.scheduled < b.scheduled; });
+  return result;
+}
+
 } // namespace li
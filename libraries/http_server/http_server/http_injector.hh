@@ -0,0 +1,92 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <string_view>
+
+#include <boost/context/continuation.hpp>
+#include <boost/context/pooled_fixedsize_stack.hpp>
+
+#include <li/http_server/api.hh>
+#include <li/http_server/http_serve.hh>
+#include <li/http_server/tcp_server.hh>
+
+namespace li {
+
+namespace impl {
+// Calls to operator new in this thread. Only counted when the program replaces operator
+// new to increment it, see http_injector.
+inline thread_local long long allocation_count = 0;
+} // namespace impl
+
+// Run raw requests through make_http_processor and an api without sockets: the connection
+// is a fiber reading from and writing to memory. Parsing, routing, handlers and response
+// formatting are the ones of http_serve, with zero syscalls.
+//
+//   http_injector inject(api);
+//   std::string_view response = inject("GET /hello HTTP/1.1\r\n\r\n");
+//
+// Handlers run on the calling thread. They can yield and park, the injector resumes them
+// right away, but they cannot wait for other file descriptors: async sql connections,
+// async_http_client, upstream and spawned fibers need http_serve.
+//
+// To count the allocations of a call, link a replacement of the global operator new that
+// increments impl::allocation_count, like tests/count_allocations.cc.
+struct http_injector {
+
+  typedef boost::context::continuation continuation;
+
+  inline http_injector(api<http_request, http_response> api) {
+    api.freeze();
+    // The Date header is set once, http_serve updates it every second.
+    http_async_impl::http_top_header.tick();
+    processor_ = http_async_impl::make_http_processor(http_async_impl::make_api_handler(api));
+    reactor_.epoll_fd = -1;
+    reactor_.closed_fds.resize(1);
+    reactor_.parked_fibers.resize(1);
+    sockaddr_in peer{};
+    peer.sin_family = AF_INET;
+    peer.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    memcpy(&peer_, &peer, sizeof(peer));
+  }
+
+  // Process \input on a new connection: one request or pipelined requests. Bodies need a
+  // Content-Length: the server does not detect Transfer-Encoding: chunked request bodies
+  // (it looks at the Content-Type). The server reads at most \read_size bytes at a time
+  // (0: all the input at once). Return the bytes written by the server, valid until the
+  // next call.
+  inline std::string_view operator()(std::string_view input, int read_size = 0) {
+    socket_.input = input;
+    socket_.read_size = read_size;
+    socket_.output.clear();
+    long long allocations_start = impl::allocation_count;
+
+    continuation fiber =
+        boost::context::callcc(std::allocator_arg, stack_, [this](continuation&& sink) {
+          async_fiber_context ctx(&reactor_, std::move(sink), 0, 0, peer_);
+          ctx.memory = &socket_;
+          processor_(ctx);
+          return std::move(ctx.sink);
+        });
+    while (fiber)
+      fiber = fiber.resume();
+
+    // Timers of park_until are not used: parked fibers are resumed right away.
+    reactor_.timers = decltype(reactor_.timers)();
+    allocations_ = impl::allocation_count - allocations_start;
+    return socket_.output;
+  }
+
+  // Calls to operator new during the last call. 0 when they are not counted.
+  inline long long allocations() const { return allocations_; }
+
+private:
+  std::function<void(async_fiber_context&)> processor_;
+  async_reactor reactor_;
+  boost::context::pooled_fixedsize_stack stack_;
+  memory_socket socket_;
+  sockaddr peer_;
+  long long allocations_ = 0;
+};
+
+} // namespace li
@@ -14,15 +14,18 @@
 
 #include <boost/lexical_cast.hpp>
 
+#include <li/http_server/arena.hh>
 #include <li/http_server/output_buffer.hh>
 #include <li/http_server/input_buffer.hh>
 #include <li/http_server/error.hh>
 #include <li/http_server/symbols.hh>
 #include <li/http_server/tcp_server.hh>
+#include <li/http_server/traffic_capture.hh>
 #include <li/http_server/url_unescape.hh>
 #include <li/http_server/http_top_header_builder.hh>
 
 #include <li/http_server/content_types.hh>
+#include <li/sql/sql_common.hh>
 
 namespace li {
 
@@ -40,17 +43,39 @@ http_top_header_builder http_top_header [[gnu::weak]];
 template <typename FIBER>
 struct generic_http_ctx {
 
+  typedef FIBER fiber_type;
+
+  // Sinks of the response buffers, called without indirection.
+  struct socket_sink {
+    FIBER* fiber;
+    void operator()(const char* d, int s) { fiber->write(d, s, impl::send_more_flag); }
+  };
+  typedef basic_output_buffer<socket_sink> output_stream_type;
+
+  struct output_stream_sink {
+    output_stream_type* output_stream;
+    void operator()(const char* d, int s) { *output_stream << std::string_view(d, s); }
+  };
+  typedef basic_output_buffer<output_stream_sink> response_stream_type;
+
+  typedef std::unordered_map<
+      std::string_view, std::string_view, std::hash<std::string_view>,
+      std::equal_to<std::string_view>,
+      arena_allocator<std::pair<const std::string_view, std::string_view>>>
+      string_view_map;
+
   generic_http_ctx(input_buffer& _rb, FIBER& _fiber) : rb(_rb), fiber(_fiber) {
-    get_parameters_map.reserve(10);
     response_headers.reserve(20);
 
-    output_stream = output_buffer(50*1024, [&](const char* d, int s) { fiber.write(d, s); });
-
-    headers_stream =
-        output_buffer(1000, [&](const char* d, int s) { output_stream << std::string_view(d, s); });
+    // The output stream only flushes by itself when it is full, and then more responses follow.
+    output_stream = output_stream_type(50 * 1024, socket_sink{&fiber});
 
-    json_stream = output_buffer(
-        50 * 1024, [&](const char* d, int s) { output_stream << std::string_view(d, s); });
+    // The headers and the JSON body are written before the status line and the
+    // Content-Length: they grow instead of flushing into the output stream.
+    headers_stream = response_stream_type(1000, output_stream_sink{&output_stream});
+    headers_stream.set_segment_chain(true);
+    json_stream = response_stream_type(4 * 1024, output_stream_sink{&output_stream});
+    json_stream.set_segment_chain(true);
   }
 
   generic_http_ctx& operator=(const generic_http_ctx&) = delete;
@@ -137,7 +162,7 @@ struct generic_http_ctx {
     return http_version_;
   }
 
-  inline void format_top_headers(output_buffer& output_stream) {
+  template <typename O> inline void format_top_headers(O& output_stream) {
     if (status_code_ == 200)
       output_stream << http_top_header.top_header_200();
     else
@@ -194,11 +219,55 @@ struct generic_http_ctx {
   //   return respond(std::string_view(s, strlen(s)));
   // }
 
+  // Bodies larger than this are not copied in output_stream. They are sent
+  // together with the pending responses with one writev.
+  static constexpr int zero_copy_body_threshold = 16 * 1024;
+
+  // Send the pending responses followed by \body with one vectored write.
+  void write_with_pending_responses(std::string_view body) {
+    auto pending = output_stream.to_string_view();
+    iovec iov[2] = {{(void*)pending.data(), pending.size()}, {(void*)body.data(), body.size()}};
+    fiber.writev(iov, 2);
+    output_stream.reset();
+  }
+
+  // Same with a body made of the segments of \body_stream.
+  void write_with_pending_responses(response_stream_type& body_stream) {
+    constexpr int max_iov = 32;
+    if (body_stream.segments_count() >= max_iov)
+      return write_with_pending_responses(body_stream.to_string_view());
+
+    iovec iov[max_iov];
+    auto pending = output_stream.to_string_view();
+    iov[0] = {(void*)pending.data(), pending.size()};
+    int n = 1;
+    body_stream.for_each_segment(
+        [&](std::string_view s) { iov[n++] = {(void*)s.data(), s.size()}; });
+    fiber.writev(iov, n);
+    output_stream.reset();
+  }
+
+  // Add \body after the headers, copying it only if it is small.
+  void respond_body(std::string_view body) {
+    if (body.size() >= zero_copy_body_threshold)
+      write_with_pending_responses(body);
+    else
+      output_stream << body;
+  }
+
+  void respond_body(response_stream_type& body_stream) {
+    if (body_stream.size() >= zero_copy_body_threshold)
+      write_with_pending_responses(body_stream);
+    else
+      body_stream.flush(); // flushes to output_stream.
+  }
+
   void respond(const std::string_view& s) {
     response_written_ = true;
     format_top_headers(output_stream);
     headers_stream.flush();                                             // flushes to output_stream.
-    output_stream << "Content-Length: " << s.size() << "\r\n\r\n" << s; // Add body
+    output_stream << "Content-Length: " << s.size() << "\r\n\r\n";
+    respond_body(s);
   }
 
   template <typename O> void respond_json(const O& obj) {
@@ -208,8 +277,9 @@ struct generic_http_ctx {
 
     format_top_headers(output_stream);
     headers_stream.flush(); // flushes to output_stream.
-    output_stream << "Content-Length: " << json_stream.to_string_view().size() << "\r\n\r\n";
-    json_stream.flush(); // flushes to output_stream.
+    output_stream << "Content-Length: " << json_stream.size() << "\r\n\r\n";
+    respond_body(json_stream);
+    json_stream.reset();
   }
 
   template <typename F> void respond_json_generator(int N, F callback) {
@@ -219,13 +289,76 @@ struct generic_http_ctx {
 
     format_top_headers(output_stream);
     headers_stream.flush(); // flushes to output_stream.
-    output_stream << "Content-Length: " << json_stream.to_string_view().size() << "\r\n\r\n";
-    json_stream.flush(); // flushes to output_stream.
-    
+    output_stream << "Content-Length: " << json_stream.size() << "\r\n\r\n";
+    respond_body(json_stream);
+    json_stream.reset();
+  }
+
+
+  // Chunked responses (Transfer-Encoding: chunked), used to stream a response of unknown size.
+  // start_chunked_response sends the status line and headers right away.
+  void start_chunked_response() {
+    response_written_ = true;
+    chunked_response_ = true;
+    format_top_headers(output_stream);
+    headers_stream.flush(); // flushes to output_stream.
+    output_stream << "Transfer-Encoding: chunked\r\n\r\n";
+    flush_responses();
+  }
+
+  // Send one chunk of a chunked response.
+  void write_chunk(std::string_view data) {
+    if (data.empty())
+      return; // An empty chunk would end the response.
+    char size[20];
+    int size_len = snprintf(size, sizeof(size), "%zx\r\n", data.size());
+    output_stream << std::string_view(size, size_len) << data << "\r\n";
+    flush_responses();
+  }
+
+  // Send a chunk that is already framed as "<hex size>\r\n<data>\r\n".
+  // This allows to serialize once a chunk sent to many connections.
+  void write_framed_chunk(std::string_view frame) {
+    flush_responses();
+    fiber.write(frame.data(), frame.size());
+  }
+
+  // Responses of known size streamed by the handler: start_response sends the status line,
+  // the headers and the Content-Length, then the handler sends the body with write_body.
+  void start_response(size_t content_length) {
+    response_written_ = true;
+    format_top_headers(output_stream);
+    headers_stream.flush(); // flushes to output_stream.
+    output_stream << "Content-Length: " << content_length << "\r\n\r\n";
   }
 
+  void write_body(std::string_view data) {
+    output_stream << data;
+    flush_responses();
+  }
+
+  void end_chunked_response() {
+    if (chunked_response_) {
+      output_stream << "0\r\n\r\n";
+      chunked_response_ = false;
+    }
+  }
+
+  // Answer an error thrown by the handler. Once the response is started, a second response
+  // would be read as part of the first one: the connection is closed after the partial
+  // response instead, without the last chunk so the client sees it truncated.
+  void respond_error(int status, std::string_view message) {
+    if (response_written_) {
+      chunked_response_ = false;
+      close_connection_ = true;
+      return;
+    }
+    set_status(status);
+    respond(message);
+  }
 
   void respond_if_needed() {
+    end_chunked_response();
     if (!response_written_) {
       response_written_ = true;
 
@@ -295,15 +428,40 @@ struct generic_http_ctx {
     case 409:
       status_ = "409 Conflict";
       break;
+    case 413:
+      status_ = "413 Payload Too Large";
+      break;
+    case 429:
+      status_ = "429 Too Many Requests";
+      break;
     case 500:
       status_ = "500 Internal Server Error";
       break;
+    case 502:
+      status_ = "502 Bad Gateway";
+      break;
+    case 503:
+      status_ = "503 Service Unavailable";
+      break;
+    case 504:
+      status_ = "504 Gateway Timeout";
+      break;
     default:
       status_ = "200 OK";
       break;
     }
   }
 
+  // Status without a case in set_status, for example forwarded from an upstream server.
+  // \status_line is the code followed by the reason phrase: "418 I'm a teapot".
+  void set_status(int status, std::string_view status_line) {
+    status_code_ = status;
+    char* line = (char*)arena.allocate(status_line.size() + 1, 1);
+    memcpy(line, status_line.data(), status_line.size());
+    line[status_line.size()] = 0;
+    status_ = line;
+  }
+
   void send_static_file(const char* path) {
     auto it = static_files.find(path);
     if (static_files.end() == it or !it->second.first.size()) {
@@ -342,6 +500,16 @@ struct generic_http_ctx {
   // private:
 
   void add_header_line(const char* l) { header_lines.push_back(l); }
+
+  // Follow the read buffer after input_buffer::reserve moved it by \offset.
+  bool move_header_lines(const char*& cur, long offset) {
+    if (!offset)
+      return false;
+    for (auto& l : header_lines)
+      l += offset;
+    cur += offset;
+    return true;
+  }
   const char* last_header_line() { return header_lines.back(); }
 
   // split a string, starting from cur and ending with split_char.
@@ -450,6 +618,10 @@ struct generic_http_ctx {
 
       while (content_length_ > n_body_read) {
         std::string_view part = rb.read_more_str(fiber);
+        if (part.empty()) {
+          connection_closed_ = true;
+          break;
+        }
         int l = part.size();
         int bl = std::min(l, content_length_ - n_body_read);
         part = std::string_view(part.data(), bl);
@@ -462,20 +634,20 @@ struct generic_http_ctx {
     } else if (chunked_) {
       // Chunked decoding.
       const char* cur = body_start.data();
-      int chunked_size = strtol(rb.read_until(read, cur, '\r').data(), nullptr, 16);
-      cur++; // skip \n
-      while (chunked_size > 0) {
+      int chunked_size;
+      while ((chunked_size = read_chunk_size(cur)) > 0) {
         // Read chunk.
-        std::string_view chunk = rb.read_n(read, cur, chunked_size);
+        std::string_view chunk = rb.read_n(fiber, cur, chunked_size);
+        if (int(chunk.size()) < chunked_size) {
+          connection_closed_ = true;
+          break;
+        }
         callback(chunk);
         rb.free(chunk);
         cur += chunked_size + 2; // skip \r\n.
-
-        // Read next chunk size.
-        chunked_size = strtol(rb.read_until(read, cur, '\r').data(), nullptr, 16);
-        cur++; // skip \n
       }
-      cur += 2; // skip the terminaison chunk.
+      if (!connection_closed_)
+        cur += 2; // skip the terminaison chunk.
       body_end_ = cur;
       body_ = std::string_view(body_start.data(), cur - body_start.data());
     }
@@ -490,16 +662,20 @@ struct generic_http_ctx {
 
     if (content_length_) {
       body_ = rb.read_n(fiber, body_start.data(), content_length_);
-      body_end_ = body_.data() + content_length_;
+      body_end_ = body_.data() + body_.size();
+      connection_closed_ = int(body_.size()) < content_length_;
     } else if (chunked_) {
       // Chunked decoding.
       char* out = (char*)body_start.data();
       const char* cur = body_start.data();
-      int chunked_size = strtol(rb.read_until(fiber, cur, '\r').data(), nullptr, 16);
-      cur++; // skip \n
-      while (chunked_size > 0) {
+      int chunked_size;
+      while ((chunked_size = read_chunk_size(cur)) > 0) {
         // Read chunk.
         std::string_view chunk = rb.read_n(fiber, cur, chunked_size);
+        if (int(chunk.size()) < chunked_size) {
+          connection_closed_ = true;
+          break;
+        }
         cur += chunked_size + 2; // skip \r\n.
         // Copy the body into a contiguous string.
         if (out + chunk.size() > chunk.data()) // use memmove if overlap.
@@ -508,12 +684,9 @@ struct generic_http_ctx {
           std::memcpy(out, chunk.data(), chunk.size());
 
         out += chunk.size();
-
-        // Read next chunk size.
-        chunked_size = strtol(rb.read_until(fiber, cur, '\r').data(), nullptr, 16);
-        cur++; // skip \n
       }
-      cur += 2; // skip the terminaison chunk.
+      if (!connection_closed_)
+        cur += 2; // skip the terminaison chunk.
       body_end_ = cur;
       body_ = std::string_view(body_start.data(), out - body_start.data());
     }
@@ -522,6 +695,19 @@ struct generic_http_ctx {
     return body_;
   }
 
+  // Read the size line of the next chunk and move \cur after it. Return -1 if the connection
+  // is closed before.
+  int read_chunk_size(const char*& cur) {
+    std::string_view line = rb.read_until(fiber, cur, '\r');
+    if (!line.data()) {
+      connection_closed_ = true;
+      return -1;
+    }
+    int size = strtol(line.data(), nullptr, 16);
+    cur++; // skip \n
+    return size;
+  }
+
   void read_multipart_formdata() {}
 
   template <typename F> void post_iterate(F kv_callback) {
@@ -540,7 +726,7 @@ struct generic_http_ctx {
   }
 
   // Read post parameters in the body.
-  std::unordered_map<std::string_view, std::string_view> post_parameters() {
+  const string_view_map& post_parameters() {
     if (content_type_ == "application/x-www-form-urlencoded") {
       if (!is_body_read_)
         read_whole_body();
@@ -552,9 +738,15 @@ struct generic_http_ctx {
     return post_parameters_map;
   }
 
-  void prepare_next_request() {
+  // Return false if the connection was closed before the end of the body, or must be closed
+  // after a broken response (see respond_error).
+  bool prepare_next_request() {
+    if (close_connection_)
+      return false;
     if (!is_body_read_)
       read_whole_body();
+    if (connection_closed_)
+      return false;
 
     // std::cout <<"free line0: " << uint64_t(header_lines[0]) << std::endl;
     // std::cout << rb.current_size() << " " << rb.cursor << std::endl;
@@ -563,21 +755,45 @@ struct generic_http_ctx {
     // rb.cursor = rb.end = 0;
     // assert(rb.cursor == 0);
     headers_stream.reset();
+    status_code_ = 200;
     status_ = "200 OK";
+    body_ = std::string_view();
     method_ = std::string_view();
     url_ = std::string_view();
     http_version_ = std::string_view();
     content_type_ = std::string_view();
-    header_map.clear();
-    cookie_map.clear();
     response_headers.clear();
-    get_parameters_map.clear();
-    post_parameters_map.clear();
     get_parameters_string_ = std::string_view();
     response_written_ = false;
+    chunked_response_ = false;
+
+    // The maps are allocated in the arena: drop them before resetting it.
+    header_map = string_view_map(arena);
+    cookie_map = string_view_map(arena);
+    get_parameters_map = string_view_map(arena);
+    post_parameters_map = string_view_map(arena);
+    arena.reset();
+    return true;
   }
 
-  void flush_responses() { output_stream.flush(); }
+  // Give the memory of the buffers back to the pool while the connection is idle.
+  // All the responses must be sent.
+  void release_buffers() {
+    rb.release();
+    output_stream.release();
+    headers_stream.release();
+    json_stream.release();
+    arena.release();
+  }
+
+  // Send the pending responses. This is the last write of a batch, so no MSG_MORE here.
+  void flush_responses() {
+    if (output_stream.size()) {
+      auto pending = output_stream.to_string_view();
+      fiber.write(pending.data(), pending.size());
+      output_stream.reset();
+    }
+  }
 
   int socket_fd;
   input_buffer& rb;
@@ -590,15 +806,21 @@ struct generic_http_ctx {
   std::string_view content_type_;
   bool chunked_;
   int content_length_;
-  std::unordered_map<std::string_view, std::string_view> header_map;
-  std::unordered_map<std::string_view, std::string_view> cookie_map;
+
+  // Memory of the current request, reset after the response.
+  monotonic_arena arena;
+  string_view_map header_map{arena};
+  string_view_map cookie_map{arena};
   std::vector<std::pair<std::string_view, std::string_view>> response_headers;
-  std::unordered_map<std::string_view, std::string_view> get_parameters_map;
-  std::unordered_map<std::string_view, std::string_view> post_parameters_map;
+  string_view_map get_parameters_map{arena};
+  string_view_map post_parameters_map{arena};
   std::string_view get_parameters_string_;
   // std::vector<std::string> strings_saver;
 
   bool is_body_read_ = false;
+  // Set when the connection is closed before the end of the body, which is then truncated.
+  bool connection_closed_ = false;
+  bool close_connection_ = false;
   std::string body_local_buffer_;
   std::string_view body_;
   std::string_view body_start;
@@ -606,27 +828,48 @@ struct generic_http_ctx {
   std::vector<const char*> header_lines;
   FIBER& fiber;
 
-  output_buffer headers_stream;
+  response_stream_type headers_stream;
   bool response_written_ = false;
+  bool chunked_response_ = false;
 
-  output_buffer output_stream;
-  output_buffer json_stream;
+  output_stream_type output_stream;
+  response_stream_type json_stream;
 };
 using http_ctx = generic_http_ctx<async_fiber_context>;
 
-template <typename F> auto make_http_processor(F handler) {
-  return [handler](auto& fiber) {
+// With \capture, the requests and the status of their responses are recorded.
+template <typename F> auto make_http_processor(F handler, traffic_capture* capture = nullptr) {
+  return [handler, capture](auto& fiber) {
     try {
       input_buffer rb;
       bool socket_is_valid = true;
 
       auto ctx = generic_http_ctx(rb, fiber);
       ctx.socket_fd = fiber.socket_fd;
+
+      uint32_t connection_id = capture ? capture->new_connection() : 0;
+      std::string captured_headers;
+      std::chrono::steady_clock::time_point arrival;
       
       while (true) {
         ctx.is_body_read_ = false;
         ctx.header_lines.clear();
         ctx.header_lines.reserve(100);
+
+        // Responses are coalesced while pipelined requests are already in the read buffer.
+        // They are sent just before waiting for more data from the socket.
+        if (rb.empty()) {
+          ctx.flush_responses();
+          int received;
+          while ((received = rb.read_more_nowait(fiber)) < 0) {
+            // The connection is idle: give its buffers back to the pool while waiting.
+            ctx.release_buffers();
+            fiber.park();
+          }
+          if (received == 0)
+            return;
+        }
+
         // Read until there is a complete header.
         int header_start = rb.cursor;
         int header_end = rb.cursor;
@@ -638,10 +881,6 @@ template <typename F> auto make_http_processor(F handler) {
 
         bool complete_header = false;
 
-        if (rb.empty())
-          if (!rb.read_more(fiber))
-            return;
-
         const char* cur = rb.data() + header_end;
         const char* rbend = rb.data() + rb.end - 3;
         while (!complete_header) {
@@ -674,22 +913,45 @@ template <typename F> auto make_http_processor(F handler) {
           }
 
           // Read more data from the socket if the headers are not complete.
-          if (!complete_header && 0 == rb.read_more(fiber)) return;
+          if (!complete_header) {
+            ctx.flush_responses();
+            // Grow the buffer if the headers fill it.
+            if (rb.end == rb.capacity())
+              ctx.move_header_lines(cur, rb.reserve(rb.current_size() + 1));
+            if (0 == rb.read_more(fiber))
+              return;
+          }
         }
 
         // Header is complete. Process it.
+        ctx.prepare_request();
+
+        // Make room for the body before the handler keeps pointers to the headers.
+        int body_size = ctx.chunked_ ? input_buffer::max_size : ctx.content_length_;
+        if (ctx.move_header_lines(cur, rb.reserve(cur - ctx.header_lines[0] + body_size)))
+          ctx.prepare_request();
+        header_end = cur - rb.data();
+
+        // The handler may overwrite the headers while reading the body: copy them.
+        if (capture) {
+          arrival = std::chrono::steady_clock::now();
+          captured_headers.assign(ctx.header_lines[0], cur);
+        }
+
         // Run the handler.
         assert(rb.cursor <= rb.end);
         ctx.body_start = std::string_view(rb.data() + header_end, rb.end - header_end);
-        ctx.prepare_request();
         handler(ctx);
         assert(rb.cursor <= rb.end);
 
+        if (capture)
+          capture->record(connection_id, arrival, ctx.status_code_, captured_headers,
+                          ctx.is_body_read_ ? ctx.body_ : ctx.read_whole_body());
+
         // Update the cursor the beginning of the next request.
-        ctx.prepare_next_request();
-        // if read buffer is empty, we can flush the output buffer.
-        if (rb.empty())
-          ctx.flush_responses();
+        // Do not process the pipelined requests of a closed connection.
+        if (!ctx.prepare_next_request() or fiber.is_closed())
+          return;
       }
     } catch (const std::runtime_error& e) {
       std::cerr << "Error: " << e.what() << std::endl;
@@ -703,43 +965,117 @@ template <typename F> auto make_http_processor(F handler) {
 
 #include <li/http_server/request.hh>
 #include <li/http_server/response.hh>
+#include <li/http_server/admission_control.hh>
 
 namespace li {
 
+namespace http_async_impl {
 
-template <typename... O>
-auto http_serve(api<http_request, http_response> api, int port, O... opts) {
+// Run \start_server in a server thread, next to the thread updating the Date header.
+// Return right away with the s::non_blocking option.
+template <typename O, typename F> void run_server(int port, O options, F start_server) {
 
-  auto options = mmm(opts...);
+  auto date_thread = std::make_shared<std::thread>([&]() {
+    while (!quit_signal_catched) {
+      li::http_async_impl::http_top_header.tick();
+      usleep(1e6);
+    }
+  });
 
-  int nthreads = get_or(options, s::nthreads, std::thread::hardware_concurrency());
+  auto server_thread = std::make_shared<std::thread>([=]() {
+    std::cout << "Starting lithium::http_server on port " << port << std::endl;
+    start_server();
+    date_thread->join();
+  });
 
-  auto handler = [api](auto& ctx) {
+  if constexpr (has_key<decltype(options), s::non_blocking_t>()) {
+    usleep(0.1e6);
+    date_thread->detach();
+    server_thread->detach();
+    // return mmm(s::server_thread = server_thread, s::date_thread = date_thread);
+  } else
+    server_thread->join();
+}
+
+// Socket options of http_serve: s::listen_backlog, s::tcp_nodelay, s::tcp_defer_accept,
+// s::tcp_fastopen, s::send_buffer_size, s::receive_buffer_size and s::busy_poll (in
+// microseconds). See tcp_server_options.
+template <typename O> tcp_server_options make_tcp_server_options(const O& options) {
+  tcp_server_options tcp;
+  tcp.listen_backlog = get_or(options, s::listen_backlog, tcp.listen_backlog);
+  tcp.tcp_nodelay = get_or(options, s::tcp_nodelay, tcp.tcp_nodelay);
+  tcp.tcp_defer_accept = get_or(options, s::tcp_defer_accept, tcp.tcp_defer_accept);
+  tcp.tcp_fastopen = get_or(options, s::tcp_fastopen, tcp.tcp_fastopen);
+  tcp.send_buffer_size = get_or(options, s::send_buffer_size, tcp.send_buffer_size);
+  tcp.receive_buffer_size = get_or(options, s::receive_buffer_size, tcp.receive_buffer_size);
+  tcp.busy_poll_us = get_or(options, s::busy_poll, tcp.busy_poll_us);
+  return tcp;
+}
+
+// Handler of make_http_processor calling \api, and answering the http errors it throws.
+// With \admission, the requests are first checked by the admission control.
+inline auto make_api_handler(api<http_request, http_response> api,
+                             std::shared_ptr<admission_control> admission = nullptr) {
+  return [api, admission](auto& ctx) {
+    if (admission and
+        !admission->admit(std::chrono::steady_clock::now() - ctx.fiber.reactor->ready_time)) {
+      ctx.set_status(503);
+      ctx.set_header("Retry-After", admission->retry_after);
+      ctx.respond("Server overloaded, retry later.");
+      return;
+    }
     http_request rq{ctx};
     http_response resp(ctx);
     try {
       api.call(ctx.method(), ctx.url(), rq, resp);
     } catch (const http_error& e) {
-      ctx.set_status(e.status());
-      ctx.respond(e.what());
+      ctx.respond_error(e.status(), e.what());
+    } catch (const sql_client_closed&) {
+      // The client is gone: nobody reads the response.
+      return;
     } catch (const std::runtime_error& e) {
       std::cerr << "INTERNAL SERVER ERROR: " << e.what() << std::endl;
-      ctx.set_status(500);
-      ctx.respond("Internal server error.");
+      ctx.respond_error(500, "Internal server error.");
     }
     ctx.respond_if_needed();
   };
+}
 
-  auto date_thread = std::make_shared<std::thread>([&]() {
-    while (!quit_signal_catched) {
-      li::http_async_impl::http_top_header.tick();
-      usleep(1e6);
-    }
-  });
+} // namespace http_async_impl
 
-  auto server_thread = std::make_shared<std::thread>([=]() {
-    std::cout << "Starting lithium::http_server on port " << port << std::endl;
+template <typename... O>
+auto http_serve(api<http_request, http_response> api, int port, O... opts) {
+
+  auto options = mmm(opts...);
 
+  int nthreads = get_or(options, s::nthreads, std::thread::hardware_concurrency());
+  tcp_server_options tcp_options = http_async_impl::make_tcp_server_options(options);
+
+  // Load shedding based on the queueing delay in the reactors. See admission_control.
+  std::shared_ptr<admission_control> admission;
+  if constexpr (has_key(options, s::admission_control))
+    admission = std::shared_ptr<admission_control>(options.admission_control,
+                                                   [](admission_control*) {});
+  else if constexpr (has_key(options, s::codel_target))
+    admission = std::make_shared<admission_control>(
+        s::codel_target = options.codel_target,
+        s::codel_interval = get_or(options, s::codel_interval, 100),
+        s::retry_after = get_or(options, s::retry_after, 1));
+
+  // Capture of the requests, see traffic_capture. s::capture is a file path or a
+  // traffic_capture*.
+  std::shared_ptr<traffic_capture> capture;
+  if constexpr (has_key(options, s::capture)) {
+    if constexpr (std::is_same<std::decay_t<decltype(options.capture)>, traffic_capture*>::value)
+      capture = std::shared_ptr<traffic_capture>(options.capture, [](traffic_capture*) {});
+    else
+      capture = std::make_shared<traffic_capture>(std::string(options.capture));
+  }
+
+  api.freeze();
+  auto handler = http_async_impl::make_api_handler(api, admission);
+
+  http_async_impl::run_server(port, options, [=] {
     if constexpr (has_key(options, s::ssl_key))
     {
       static_assert(has_key(options, s::ssl_certificate), "You need to provide both the ssl_certificate option and the ssl_key option.");
@@ -751,21 +1087,13 @@ auto http_serve(api<http_request, http_response> api, int port, O... opts) {
         ssl_ciphers = options.ssl_ciphers;
       }
       start_tcp_server(port, SOCK_STREAM, nthreads,
-                       http_async_impl::make_http_processor(std::move(handler)),
-                       ssl_key, ssl_cert, ssl_ciphers);
+                       http_async_impl::make_http_processor(std::move(handler), capture.get()),
+                       ssl_key, ssl_cert, ssl_ciphers, tcp_options);
     }
     else
       start_tcp_server(port, SOCK_STREAM, nthreads,
-                       http_async_impl::make_http_processor(std::move(handler)));
-    date_thread->join();
+                       http_async_impl::make_http_processor(std::move(handler), capture.get()),
+                       "", "", "", tcp_options);
   });
-
-  if constexpr (has_key<decltype(options), s::non_blocking_t>()) {
-    usleep(0.1e6);
-    date_thread->detach();
-    server_thread->detach();
-    // return mmm(s::server_thread = server_thread, s::date_thread = date_thread);
-  } else
-    server_thread->join();
 }
 } // namespace li
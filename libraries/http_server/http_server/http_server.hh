@@ -13,10 +13,21 @@ namespace li {
 using http_api = api<http_request, http_response>;
 }
 
+#include <li/http_server/coro_http_serve.hh>
+
 #include <li/http_server/hashmap_http_session.hh>
 #include <li/http_server/http_authentication.hh>
 //#include <li/http_server/mhd.hh>
 #include <li/http_server/serve_directory.hh>
+#include <li/http_server/fiber_sync.hh>
+#include <li/http_server/admission_control.hh>
+#include <li/http_server/fork_join.hh>
+#include <li/http_server/offload_pool.hh>
+#include <li/http_server/rate_limiter.hh>
+#include <li/http_server/sse.hh>
+#include <li/http_server/upstream.hh>
+#include <li/http_server/async_http_client.hh>
+#include <li/http_server/http_injector.hh>
 #include <li/http_server/sql_crud_api.hh>
 #include <li/http_server/sql_http_session.hh>
 #include <li/http_server/symbols.hh>
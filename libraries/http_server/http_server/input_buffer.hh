@@ -1,27 +1,75 @@
 #pragma once
 
+#include <algorithm>
 #include <string_view>
 #include <vector>
 #include <memory>
 #include <cassert>
+#include <cstring>
+#include <stdexcept>
 
+#include <li/http_server/buffer_pool.hh>
 
 namespace li {
 
+// Read buffer of a connection.
+// The memory is borrowed from the thread buffer pool on the first read, starting with a
+// small buffer that grows with reserve() up to max_size. release() gives it back.
 struct input_buffer {
 
-  std::vector<char> buffer_;
+  static constexpr int initial_size = 4 * 1024;
+  static constexpr int max_size = 64 * 1024;
+
+  char* buffer_ = nullptr;
+  int capacity_ = 0;
   int cursor = 0; // First index of the currently used buffer area
   int end = 0;    // Index of the last read character
 
-  input_buffer() : buffer_(50 * 1024), cursor(0), end(0) {}
+  input_buffer() = default;
+  input_buffer(const input_buffer&) = delete;
+  input_buffer& operator=(const input_buffer&) = delete;
+  ~input_buffer() { thread_buffer_pool().release(buffer_, capacity_); }
+
+  int capacity() const { return capacity_; }
+
+  // Give the memory back to the pool. The buffer must be empty.
+  void release() {
+    assert(empty());
+    thread_buffer_pool().release(buffer_, capacity_);
+    buffer_ = nullptr;
+    capacity_ = cursor = end = 0;
+  }
+
+  // Make room for \size bytes after cursor (capped to max_size), moving the data to the
+  // beginning of the buffer or to a larger buffer if needed.
+  // Return the offset to add to the pointers in the data, 0 if it did not move.
+  long reserve(int size) {
+    size = std::min(size, max_size);
+    if (cursor + size <= capacity_)
+      return 0;
+    const char* old_data = buffer_ + cursor;
+    if (size <= capacity_)
+      std::memmove(buffer_, buffer_ + cursor, end - cursor);
+    else {
+      auto& pool = thread_buffer_pool();
+      int new_capacity = std::min(std::max(size, 2 * capacity_), max_size);
+      char* b = pool.acquire(new_capacity);
+      std::memcpy(b, buffer_ + cursor, end - cursor);
+      pool.release(buffer_, capacity_);
+      buffer_ = b;
+      capacity_ = new_capacity;
+    }
+    end -= cursor;
+    cursor = 0;
+    return buffer_ - old_data;
+  }
 
   // Free unused space in the buffer in [i1, i2[.
   // This may move data in [i2, end[ if needed.
   void free(int i1, int i2) {
     assert(i1 < i2);
-    assert(i1 >= 0 and i1 < buffer_.size());
-    assert(i2 > 0 and i2 <= buffer_.size());
+    assert(i1 >= 0 and i1 < capacity_);
+    assert(i2 > 0 and i2 <= capacity_);
 
     if (i1 == cursor and i2 == end) // eat the whole buffer.
       cursor = end = 0;
@@ -31,21 +79,20 @@ struct input_buffer {
       end = i1;         // eat the end of the buffer.
     else if (i2 != end) // eat somewhere in the middle.
     {
-      if (buffer_.size() - end < buffer_.size() / 4) {
+      if (capacity_ - end < capacity_ / 4) {
         if (end - i2 > i2 - i1) // use memmove if overlap.
-          std::memmove(buffer_.data() + i1, buffer_.data() + i2, end - i2);
+          std::memmove(buffer_ + i1, buffer_ + i2, end - i2);
         else
-          std::memcpy(buffer_.data() + i1, buffer_.data() + cursor, end - cursor);
+          std::memcpy(buffer_ + i1, buffer_ + cursor, end - cursor);
       }
     }
   }
 
   void free(const char* i1, const char* i2) {
-    assert(i1 >= buffer_.data());
-    assert(i1 <= &buffer_.back());
-    // std::cout << (i2 - &buffer_.front()) << " " << buffer_.size() <<  << std::endl;
-    assert(i2 >= buffer_.data() and i2 <= &buffer_.back() + 1);
-    free(i1 - buffer_.data(), i2 - buffer_.data());
+    assert(i1 >= buffer_);
+    assert(i1 < buffer_ + capacity_);
+    assert(i2 >= buffer_ and i2 <= buffer_ + capacity_);
+    free(i1 - buffer_, i2 - buffer_);
   }
   void free(const std::string_view& str) { free(str.data(), str.data() + str.size()); }
 
@@ -59,50 +106,74 @@ struct input_buffer {
   // Return 0 on error.
   template <typename F> int read_more(F& fiber, int size = -1) {
 
+    if (!buffer_) {
+      capacity_ = initial_size;
+      buffer_ = thread_buffer_pool().acquire(capacity_);
+    }
+
     // If size is not specified, read potentially until the end of the buffer.
     if (size == -1)
-      size = buffer_.size() - end;
+      size = capacity_ - end;
 
-    if (end == buffer_.size() || size > (buffer_.size() - end))
+    if (end == capacity_ || size > (capacity_ - end))
       throw std::runtime_error("Error: request too long, read buffer full.");
 
-    int received = fiber.read(buffer_.data() + end, size);
+    int received = fiber.read(buffer_ + end, size);
     end = end + received;
-    assert(end <= buffer_.size());
+    assert(end <= capacity_);
+    return received;
+  }
+
+  // Read the data available on the socket without waiting. The buffer must be empty.
+  // Return -1 if there is nothing to read, 0 on error.
+  template <typename F> int read_more_nowait(F& fiber) {
+    assert(empty());
+    cursor = end = 0;
+    if (!buffer_) {
+      capacity_ = initial_size;
+      buffer_ = thread_buffer_pool().acquire(capacity_);
+    }
+    int received = fiber.read_nowait(buffer_, capacity_);
+    if (received > 0)
+      end = received;
     return received;
   }
 
   template <typename F> std::string_view read_more_str(F& fiber) {
     int l = read_more(fiber);
-    return std::string_view(buffer_.data() + end - l);
+    return std::string_view(buffer_ + end - l, l);
   }
 
+  // Return less than \size characters if the connection is closed before.
   template <typename F> std::string_view read_n(F&& fiber, const char* start, int size) {
-    int str_start = start - buffer_.data();
+    int str_start = start - buffer_;
     int str_end = size + str_start;
     if (end < str_end) {
       // Read more body on the socket.
       int current_size = end - str_start;
-      while (current_size < size)
-        current_size += read_more(fiber);
+      while (current_size < size) {
+        int received = read_more(fiber);
+        if (!received)
+          return std::string_view(start, current_size);
+        current_size += received;
+      }
     }
     return std::string_view(start, size);
   }
 
+  // Return a null string_view if the connection is closed before \delimiter.
   template <typename F> std::string_view read_until(F&& fiber, const char*& start, char delimiter) {
     const char* str_end = start;
 
     while (true) {
-      const char* buffer_end = buffer_.data() + end;
+      const char* buffer_end = buffer_ + end;
       while (str_end < buffer_end and *str_end != delimiter)
         str_end++;
 
-      if (*str_end == delimiter)
+      if (str_end < buffer_end)
         break;
-      else {
-        if (!read_more(fiber))
-          break;
-      }
+      if (!read_more(fiber))
+        return std::string_view();
     }
 
     auto res = std::string_view(start, str_end - start);
@@ -122,9 +193,9 @@ struct input_buffer {
       end = cursor = 0;
     else {
       if (cursor > end - cursor) // use memmove if overlap.
-        std::memmove(buffer_.data(), buffer_.data() + cursor, end - cursor);
+        std::memmove(buffer_, buffer_ + cursor, end - cursor);
       else
-        std::memcpy(buffer_.data(), buffer_.data() + cursor, end - cursor);
+        std::memcpy(buffer_, buffer_ + cursor, end - cursor);
 
       // if (
       // memcpy(buffer_.data(), buffer_.data() + cursor, end - cursor);
@@ -136,7 +207,7 @@ struct input_buffer {
 
   // On success return the number of bytes read.
   // On error return 0.
-  char* data() { return buffer_.data(); }
+  char* data() { return buffer_; }
 };
 
 } // namespace li
@@ -228,6 +228,7 @@ template <typename A, typename... O> auto http_serve(A& api, int port, O... opts
   int thread_pool_size = get_or(options, s::nthreads, std::thread::hardware_concurrency());
 
   using api_t = std::decay_t<decltype(api)>;
+  api.freeze();
 
   MHD_Daemon* d;
 
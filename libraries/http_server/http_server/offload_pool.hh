@@ -0,0 +1,168 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <li/http_server/error.hh>
+#include <li/http_server/tcp_server.hh>
+
+namespace li {
+
+// A blocking call waiting for a worker of an offload_pool.
+// It lives on the stack of the waiting fiber.
+struct offload_job {
+  async_reactor* reactor;
+  int fiber_id;
+  void (*run)(void*);
+  void* arg;
+  std::atomic<bool> done = false;
+};
+
+struct offload_pool_stats {
+  int threads;
+  int queue_depth;      // Jobs waiting for a worker.
+  int max_queue_depth;  // Highest queue_depth since the creation of the pool.
+  int busy_workers;
+  long long completed;
+  long long rejected;   // Jobs refused because the queue was full.
+};
+
+// Worker threads running blocking or CPU heavy functions for the fibers of the reactors.
+//
+//   auto hash = pool.await_blocking(request.fiber, [&] { return bcrypt(password); });
+//
+// The calling fiber parks while the function runs on a worker, the other connections of
+// its thread keep being served. The worker wakes the fiber on its own reactor with
+// async_reactor::remote_fiber_resume (an eventfd write). Exceptions are rethrown in the fiber.
+struct offload_pool {
+
+  // \max_queue_size: maximum number of jobs waiting for a worker, 0 for no limit.
+  // await_blocking throws http_error::service_unavailable when the queue is full.
+  offload_pool(int nthreads = std::thread::hardware_concurrency(), int max_queue_size = 0)
+      : max_queue_size_(max_queue_size) {
+    for (int i = 0; i < std::max(1, nthreads); i++)
+      workers_.emplace_back([this] { worker_loop(); });
+  }
+
+  offload_pool(const offload_pool&) = delete;
+  offload_pool& operator=(const offload_pool&) = delete;
+
+  // Wait for the jobs in the queue, then stop the workers.
+  ~offload_pool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    jobs_cv_.notify_all();
+    for (auto& t : workers_)
+      t.join();
+  }
+
+  // Run \fn() on a worker and return its result. The fiber waits even if its client
+  // closes the connection since fn may reference its stack.
+  template <typename F> auto await_blocking(async_fiber_context& fiber, F fn) {
+    typedef std::invoke_result_t<F&> R;
+    std::conditional_t<std::is_void_v<R>, bool, std::optional<R>> result;
+    std::exception_ptr error;
+    auto call = [&] {
+      try {
+        if constexpr (std::is_void_v<R>)
+          fn();
+        else
+          result.emplace(fn());
+      } catch (...) {
+        error = std::current_exception();
+      }
+    };
+
+    offload_job job{fiber.reactor, fiber.fiber_id,
+                    [](void* arg) { (*(decltype(call)*)arg)(); }, &call};
+    submit(job);
+    while (!job.done.load(std::memory_order_acquire))
+      if (!fiber.park())
+        fiber.yield();
+
+    if (error)
+      std::rethrow_exception(error);
+    if constexpr (!std::is_void_v<R>)
+      return std::move(*result);
+  }
+
+  offload_pool_stats stats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return offload_pool_stats{int(workers_.size()), int(jobs_.size()), max_queue_depth_,
+                              busy_workers_,        completed_,         rejected_};
+  }
+
+private:
+  void submit(offload_job& job) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (max_queue_size_ and int(jobs_.size()) >= max_queue_size_) {
+        rejected_++;
+        throw http_error::service_unavailable("Offload queue full.");
+      }
+      jobs_.push_back(&job);
+      max_queue_depth_ = std::max(max_queue_depth_, int(jobs_.size()));
+    }
+    jobs_cv_.notify_one();
+  }
+
+  void worker_loop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      jobs_cv_.wait(lock, [this] { return stopping_ or !jobs_.empty(); });
+      if (jobs_.empty())
+        return;
+      offload_job* job = jobs_.front();
+      jobs_.pop_front();
+      busy_workers_++;
+      lock.unlock();
+
+      job->run(job->arg);
+
+      lock.lock();
+      busy_workers_--;
+      completed_++;
+      lock.unlock();
+
+      // The job is gone as soon as done is set: the fiber may wake up spuriously and see it.
+      async_reactor* reactor = job->reactor;
+      int fiber_id = job->fiber_id;
+      job->done.store(true, std::memory_order_release);
+      reactor->remote_fiber_resume(fiber_id);
+      lock.lock();
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable jobs_cv_;
+  std::deque<offload_job*> jobs_;
+  std::vector<std::thread> workers_;
+  int max_queue_size_;
+  bool stopping_ = false;
+  int max_queue_depth_ = 0;
+  int busy_workers_ = 0;
+  long long completed_ = 0;
+  long long rejected_ = 0;
+};
+
+// The pool shared by the whole process, with one thread per core.
+inline offload_pool& default_offload_pool() {
+  static offload_pool pool;
+  return pool;
+}
+
+// Run \fn() on the default offload pool. See offload_pool::await_blocking.
+template <typename F> auto await_blocking(async_fiber_context& fiber, F fn) {
+  return default_offload_pool().await_blocking(fiber, std::move(fn));
+}
+
+} // namespace li
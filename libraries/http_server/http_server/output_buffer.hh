@@ -1,119 +1,293 @@
 #pragma once
 
-#include <functional>
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <charconv>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <new>
 #include <string_view>
+#include <type_traits>
+#include <vector>
 #include <boost/lexical_cast.hpp>
 
+#include <li/http_server/buffer_pool.hh>
 
 namespace li {
 
-struct output_buffer {
+// Default sink of output_buffer.
+// Holds a small callable (a lambda capturing a few references or pointers) inline
+// and calls it through a plain function pointer: no allocation and no std::function.
+struct output_buffer_flush_fn {
 
-  output_buffer() : buffer_(nullptr), own_buffer_(false), cursor_(nullptr), end_(nullptr), flush_([] (const char*, int) constexpr {}) {}
+  output_buffer_flush_fn() : call_(nullptr) {}
 
-  output_buffer(output_buffer&& o)
-      : buffer_(o.buffer_), own_buffer_(o.own_buffer_), cursor_(o.cursor_), end_(o.end_),
-        flush_(o.flush_) {
-    o.buffer_ = nullptr;
-    o.own_buffer_ = false;
+  template <typename F, typename = std::enable_if_t<
+                            !std::is_same<std::decay_t<F>, output_buffer_flush_fn>::value>>
+  output_buffer_flush_fn(F f) {
+    static_assert(sizeof(F) <= sizeof(storage_) and alignof(F) <= alignof(void*) and
+                      std::is_trivially_copy_constructible<F>::value and
+                      std::is_trivially_destructible<F>::value,
+                  "output_buffer flush callbacks must be small trivially copyable callables, "
+                  "for example lambdas capturing references.");
+    new (storage_) F(f);
+    call_ = [](void* f, const char* s, int size) { (*(F*)f)(s, size); };
   }
 
-  output_buffer(
-      int capacity, std::function<void(const char*, int)> flush_ = [](const char*, int) {})
-      : buffer_(new char[capacity]), own_buffer_(true), cursor_(buffer_), end_(buffer_ + capacity),
-        flush_(flush_) {
-    assert(buffer_);
+  inline void operator()(const char* s, int size) {
+    if (call_)
+      call_(storage_, s, size);
   }
 
-  output_buffer(
-      void* buffer, int capacity,
-      std::function<void(const char*, int)> flush_ = [](const char*, int) {})
+  alignas(void*) char storage_[3 * sizeof(void*)];
+  void (*call_)(void*, const char*, int);
+};
+
+// Write buffer calling \Sink(const char*, int) when it is full and on flush().
+//
+// When the buffer is not given to the constructor, it is borrowed from the thread
+// buffer pool on the first write, and given back by release().
+//
+// In segment chain mode (set_segment_chain), a full buffer is not flushed: the data
+// continues in a new segment. The size of the whole content is then known before
+// sending it, and the segments can be sent with one writev (see for_each_segment).
+template <typename Sink> struct basic_output_buffer {
+
+  basic_output_buffer()
+      : buffer_(nullptr), own_buffer_(false), cursor_(nullptr), end_(nullptr), flush_() {}
+
+  basic_output_buffer(basic_output_buffer&& o) { take(o); }
+
+  basic_output_buffer(int capacity, Sink flush = Sink())
+      : buffer_(nullptr), own_buffer_(true), cursor_(nullptr), end_(nullptr), flush_(flush),
+        capacity_(capacity) {}
+
+  basic_output_buffer(void* buffer, int capacity, Sink flush = Sink())
       : buffer_((char*)buffer), own_buffer_(false), cursor_(buffer_), end_(buffer_ + capacity),
-        flush_(flush_) {
+        flush_(flush), segment_(buffer_), capacity_(capacity) {
     assert(buffer_);
   }
 
-  ~output_buffer() {
+  ~basic_output_buffer() { free_memory(); }
+
+  basic_output_buffer& operator=(basic_output_buffer&& o) {
+    if (this != &o) {
+      free_memory();
+      take(o);
+    }
+    return *this;
+  }
+
+  // Drop the content and give the memory back to the pool.
+  void release() {
+    free_memory();
     if (own_buffer_)
-      delete[] buffer_;
+      buffer_ = nullptr;
+    reset();
   }
 
-  output_buffer& operator=(output_buffer&& o) {
-    buffer_ = o.buffer_;
-    own_buffer_ = o.own_buffer_;
-    cursor_ = o.cursor_;
-    end_ = o.end_;
-    flush_ = o.flush_;
-    o.buffer_ = nullptr;
-    o.own_buffer_ = false;
-    return *this;
+  // Grow in new segments instead of flushing when the buffer is full.
+  void set_segment_chain(bool enabled) { segment_chain_ = enabled; }
+
+  // Drop the content. The segments allocated by the chain are kept for the next use.
+  void reset() {
+    segments_.clear();
+    chain_size_ = 0;
+    blocks_used_ = 0;
+    segment_ = buffer_;
+    cursor_ = buffer_;
+    end_ = buffer_ ? buffer_ + capacity_ : nullptr;
   }
 
-  void reset() { cursor_ = buffer_; }
+  std::size_t size() { return chain_size_ + (cursor_ - segment_); }
 
-  std::size_t size() { return cursor_ - buffer_; }
   void flush() {
-    flush_(buffer_, size());
+    for (auto s : segments_)
+      flush_(s.data(), s.size());
+    if (cursor_ != segment_)
+      flush_(segment_, cursor_ - segment_);
     reset();
   }
 
-  output_buffer& operator<<(std::string_view s) {
-    if (cursor_ + s.size() >= end_)
-      flush();
+  // Call \f on each segment of the content, in order.
+  template <typename F> void for_each_segment(F f) {
+    for (auto s : segments_)
+      f(s);
+    f(std::string_view(segment_, cursor_ - segment_));
+  }
+  int segments_count() { return segments_.size() + 1; }
+
+  // Contiguous view of the content. Merges the segments if there are more than one.
+  std::string_view to_string_view() {
+    if (!segments_.empty()) {
+      int total = size();
+      char* merged = allocate_block(total);
+      int pos = 0;
+      for_each_segment([&](std::string_view s) {
+        memcpy(merged + pos, s.data(), s.size());
+        pos += s.size();
+      });
+      segments_.clear();
+      chain_size_ = 0;
+      segment_ = merged;
+      cursor_ = merged + total;
+      end_ = merged + blocks_[blocks_used_ - 1].size;
+    }
+    return std::string_view(segment_, cursor_ - segment_);
+  }
 
-    assert(cursor_ + s.size() < end_);
+  basic_output_buffer& operator<<(std::string_view s) {
+    if (end_ - cursor_ < long(s.size()) and !make_room(s.size())) {
+      // s does not fit in the empty buffer: send it directly.
+      flush_(s.data(), s.size());
+      return *this;
+    }
     memcpy(cursor_, s.data(), s.size());
     cursor_ += s.size();
     return *this;
   }
 
-  output_buffer& operator<<(const char* s) { return operator<<(std::string_view(s, strlen(s))); }
-  output_buffer& operator<<(char v) {
-    cursor_[0] = v;
+  basic_output_buffer& operator<<(const char* s) {
+    return operator<<(std::string_view(s, strlen(s)));
+  }
+
+  basic_output_buffer& operator<<(char v) {
+    if (cursor_ == end_ and !make_room(1))
+      return operator<<(std::string_view(&v, 1));
+    *cursor_ = v;
     cursor_++;
     return *this;
   }
 
-  inline output_buffer& append(const char c) { return (*this) << c; }
-  
-  output_buffer& operator<<(std::size_t v) {
-    if (v == 0)
-      operator<<('0');
+  inline basic_output_buffer& append(const char c) { return (*this) << c; }
 
-    char buffer[10];
-    char* str_start = buffer;
-    for (int i = 0; i < 10; i++) {
-      if (v > 0)
-        str_start = buffer + 9 - i;
-      buffer[9 - i] = (v % 10) + '0';
-      v /= 10;
+  template <typename T> basic_output_buffer& operator<<(const T& v) {
+    if constexpr (std::is_same<T, bool>::value)
+      return operator<<(v ? '1' : '0');
+    else if constexpr (std::is_same<T, signed char>::value or std::is_same<T, unsigned char>::value)
+      return operator<<(char(v));
+    else if constexpr (std::is_integral<T>::value)
+      return append_number(v, std::numeric_limits<T>::digits10 + 3);
+#if defined(__cpp_lib_to_chars)
+    else if constexpr (std::is_floating_point<T>::value)
+      // Shortest representation that reads back to the same value.
+      return append_number(v, 64);
+#endif
+    else if constexpr (std::is_convertible<const T&, std::string_view>::value)
+      return operator<<(std::string_view(v));
+    else {
+      typedef std::array<char, 150> buf_t;
+      buf_t b = boost::lexical_cast<buf_t>(v);
+      return operator<<(std::string_view(b.begin(), strlen(b.begin())));
     }
-    operator<<(std::string_view(str_start, buffer + 10 - str_start));
-    return *this;
   }
-  // template <typename I>
-  // output_buffer& operator<<(unsigned long s)
-  // {
-  //   typedef std::array<char, 150> buf_t;
-  //   buf_t b = boost::lexical_cast<buf_t>(v);
-  //   return operator<<(std::string_view(b.begin(), strlen(b.begin())));
-  // }
-
-  template <typename I>
-  output_buffer& operator<<(I v) {
-    typedef std::array<char, 150> buf_t;
-    buf_t b = boost::lexical_cast<buf_t>(v);
-    return operator<<(std::string_view(b.begin(), strlen(b.begin())));
-  }
-
-  
-  std::string_view to_string_view() { return std::string_view(buffer_, cursor_ - buffer_); }
 
   char* buffer_;
   bool own_buffer_;
   char* cursor_;
   char* end_;
-  std::function<void(const char* s, int d)> flush_;
+  Sink flush_;
+
+private:
+  // Format \v with to_chars, in place when \max_size bytes are available.
+  template <typename T> basic_output_buffer& append_number(T v, int max_size) {
+    if (end_ - cursor_ < max_size and !make_room(max_size)) {
+      char tmp[64];
+      auto r = std::to_chars(tmp, tmp + sizeof(tmp), v);
+      return operator<<(std::string_view(tmp, r.ptr - tmp));
+    }
+    cursor_ = std::to_chars(cursor_, end_, v).ptr;
+    return *this;
+  }
+
+  // Make room for \n bytes. Return false if they do not fit in the empty buffer.
+  bool make_room(int n) {
+    if (!buffer_ and capacity_) {
+      capacity_ = buffer_pool::class_size(capacity_);
+      buffer_ = thread_buffer_pool().acquire(capacity_);
+      reset();
+      if (end_ - cursor_ >= n)
+        return true;
+    }
+    if (segment_chain_) {
+      next_segment(n);
+      return true;
+    }
+    flush();
+    return end_ - cursor_ >= n;
+  }
+
+  // Close the current segment and continue in a block of at least \n bytes.
+  // Blocks grow with the content to keep the number of segments small.
+  void next_segment(int n) {
+    if (cursor_ != segment_) {
+      segments_.push_back(std::string_view(segment_, cursor_ - segment_));
+      chain_size_ += cursor_ - segment_;
+    }
+    segment_ = cursor_ = allocate_block(std::max<long>(n, std::max<long>(capacity_, size())));
+    end_ = segment_ + blocks_[blocks_used_ - 1].size;
+  }
+
+  char* allocate_block(int size) {
+    if (blocks_used_ == int(blocks_.size()))
+      blocks_.emplace_back();
+    block& b = blocks_[blocks_used_++];
+    if (b.size < size) {
+      thread_buffer_pool().release(b.data, b.size);
+      b.size = buffer_pool::class_size(size);
+      b.data = thread_buffer_pool().acquire(b.size);
+    }
+    return b.data;
+  }
+
+  void free_memory() {
+    auto& pool = thread_buffer_pool();
+    if (own_buffer_)
+      pool.release(buffer_, capacity_);
+    for (auto& b : blocks_)
+      pool.release(b.data, b.size);
+    blocks_.clear();
+    segments_.clear();
+    blocks_used_ = 0;
+  }
+
+  void take(basic_output_buffer& o) {
+    buffer_ = o.buffer_;
+    own_buffer_ = o.own_buffer_;
+    cursor_ = o.cursor_;
+    end_ = o.end_;
+    flush_ = o.flush_;
+    segment_ = o.segment_;
+    capacity_ = o.capacity_;
+    segment_chain_ = o.segment_chain_;
+    segments_ = std::move(o.segments_);
+    chain_size_ = o.chain_size_;
+    blocks_ = std::move(o.blocks_);
+    blocks_used_ = o.blocks_used_;
+    o.buffer_ = nullptr;
+    o.own_buffer_ = false;
+    o.cursor_ = o.end_ = o.segment_ = nullptr;
+    o.capacity_ = 0;
+    o.chain_size_ = 0;
+    o.blocks_used_ = 0;
+  }
+
+  struct block {
+    char* data = nullptr;
+    int size = 0;
+  };
+
+  char* segment_ = nullptr; // Start of the current segment.
+  int capacity_ = 0;
+  bool segment_chain_ = false;
+  std::vector<std::string_view> segments_; // Previous segments.
+  std::size_t chain_size_ = 0;            // Size of the previous segments.
+  std::vector<block> blocks_;              // Allocated by the chain, reused after reset.
+  int blocks_used_ = 0;
 };
 
+typedef basic_output_buffer<output_buffer_flush_fn> output_buffer;
+
 } // namespace li
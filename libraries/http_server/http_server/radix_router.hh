@@ -0,0 +1,257 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <li/http_server/dynamic_routing_table.hh>
+#include <li/symbol/symbol.hh>
+
+namespace li {
+
+// Values of the url parameters of a route, in the order of the url spec.
+// A {{path...}} parameter value starts with its leading /.
+struct route_params {
+  static constexpr int max_size = 16;
+
+  inline void push_back(std::string_view v) {
+    if (size < max_size)
+      values[size] = v;
+    size++;
+  }
+
+  int size = 0;
+  std::string_view values[max_size];
+};
+
+namespace internal {
+
+inline bool is_url_param(std::string_view s) {
+  return s.size() > 4 and s[0] == '{' and s[1] == '{' and s[s.size() - 2] == '}' and
+         s[s.size() - 1] == '}';
+}
+inline bool is_url_path_param(std::string_view s) {
+  return is_url_param(s) and s.size() > 7 and s.substr(s.size() - 5, 3) == "...";
+}
+
+} // namespace internal
+
+// Names of the url parameters of a route, parsed once when the route is registered.
+// params[i] is the name of route_params::values[i].
+struct route_params_layout {
+
+  struct param {
+    uint64_t name_hash; // symbol_hash of the name.
+    int name_start;     // Location of the name in the url spec.
+    int name_size;
+    bool is_path;       // {{name...}}
+  };
+
+  route_params_layout() = default;
+
+  inline route_params_layout(std::string_view url_spec) {
+    int c = 0;
+    while (c < int(url_spec.size())) {
+      if (url_spec[c] == '/')
+        c++;
+      int s = c;
+      while (c < int(url_spec.size()) and url_spec[c] != '/')
+        c++;
+      std::string_view segment = url_spec.substr(s, c - s);
+      if (!internal::is_url_param(segment))
+        continue;
+      if (size == route_params::max_size)
+        throw std::runtime_error(std::string("Too many url parameters in route ") +
+                                 std::string(url_spec));
+      bool is_path = internal::is_url_path_param(segment);
+      int name_size = segment.size() - (is_path ? 7 : 4);
+      params[size++] =
+          param{symbol_hash(segment.substr(2, name_size)), s + 2, name_size, is_path};
+    }
+  }
+
+  // Index of the parameter whose name hash is \name_hash, -1 if none.
+  int find(uint64_t name_hash) const {
+    for (int i = 0; i < size; i++)
+      if (params[i].name_hash == name_hash)
+        return i;
+    return -1;
+  }
+
+  int size = 0;
+  param params[route_params::max_size];
+};
+
+// Immutable routing tree compiled from a dynamic_routing_table.
+//
+// The nodes, edges and labels are stored in flat arrays. Chains of nodes without
+// values are merged into one edge ("/api/v1/users" is one label when "/api" and
+// "/api/v1" have no handler).
+// Lookups do not modify the router: it can be shared by all the reactor threads.
+//
+// Matching rules are the ones of dynamic_routing_table:
+//  - A static segment is tried first, then the {{param}} child, then the {{param...}} child.
+//  - A node without children matches any remaining path.
+template <typename V> struct radix_router {
+
+  radix_router() = default;
+
+  // \has_value tells if a value of the table is set.
+  template <typename F> radix_router(const dynamic_routing_table<V>& table, F has_value) {
+    compile(table.root, has_value);
+  }
+
+  // Return the value matching \path or nullptr. Fill \params with the values of the
+  // url parameters.
+  inline const V* find(std::string_view path, route_params& params) const {
+    params.size = 0;
+    if (nodes_.empty())
+      return nullptr;
+    int n = find(0, path, 0, params);
+    if (n < 0 or params.size > route_params::max_size)
+      return nullptr;
+    return &values_[nodes_[n].value];
+  }
+
+  bool empty() const { return nodes_.empty(); }
+
+private:
+  struct node {
+    int first_edge = 0;
+    int n_edges = 0;
+    int param_child = -1; // {{param}}
+    int rest_child = -1;  // {{param...}}
+    int value = -1;       // index in values_.
+    bool is_leaf = false;
+  };
+
+  struct edge {
+    int label_start;
+    int label_size;
+    char first_char; // Checked before comparing the whole label, '\0' for an empty segment.
+    int child;
+  };
+
+  // Labels are short, a loop is faster than a call to memcmp.
+  static bool equal(const char* a, const char* b, int size) {
+    for (int i = 0; i < size; i++)
+      if (a[i] != b[i])
+        return false;
+    return true;
+  }
+
+  typedef internal::drt_node<V> drt_node;
+
+  template <typename F> int compile(const drt_node& n, F& has_value) {
+    int id = nodes_.size();
+    nodes_.emplace_back();
+    if (has_value(n.v_)) {
+      nodes_[id].value = values_.size();
+      values_.push_back(n.v_);
+    }
+    nodes_[id].is_leaf = n.children_.empty();
+
+    // Sort the children to get a deterministic choice when several {{params}}
+    // are registered at the same level: the first one in alphabetic order wins.
+    std::vector<std::pair<std::string_view, const drt_node*>> children;
+    for (auto& kv : n.children_)
+      children.emplace_back(kv.first, kv.second.get());
+    std::sort(children.begin(), children.end(),
+              [](auto& a, auto& b) { return a.first < b.first; });
+
+    std::vector<edge> edges;
+    for (auto& [segment, child] : children) {
+      if (internal::is_url_path_param(segment)) {
+        if (nodes_[id].rest_child < 0)
+          nodes_[id].rest_child = compile(*child, has_value);
+      } else if (internal::is_url_param(segment)) {
+        if (nodes_[id].param_child < 0)
+          nodes_[id].param_child = compile(*child, has_value);
+      } else {
+        // Merge the chain of static nodes that only lead to one child.
+        int label_start = labels_.size();
+        labels_.append(segment);
+        const drt_node* last = child;
+        while (!has_value(last->v_) and last->children_.size() == 1 and
+               !internal::is_url_param(last->children_.begin()->first)) {
+          labels_.append("/").append(last->children_.begin()->first);
+          last = last->children_.begin()->second.get();
+        }
+        edges.push_back(edge{label_start, int(labels_.size()) - label_start,
+                             segment.empty() ? '\0' : segment[0], -1});
+        edges.back().child = compile(*last, has_value);
+      }
+    }
+
+    // The edges of a node are contiguous in edges_.
+    nodes_[id].first_edge = edges_.size();
+    nodes_[id].n_edges = edges.size();
+    edges_.insert(edges_.end(), edges.begin(), edges.end());
+    return id;
+  }
+
+  int find(int n, std::string_view path, int c, route_params& params) const {
+    const node& nd = nodes_[n];
+    const int size = path.size();
+
+    if (c == size and nd.value >= 0)
+      return n;
+    if (nd.is_leaf)
+      return nd.value >= 0 ? n : -1;
+    if (c == size)
+      return -1;
+
+    int segment_start = c;
+    int s = path[c] == '/' ? c + 1 : c;
+
+    // Static children: compare the labels with the path without looking for the end of the
+    // segment first. At most one label can match.
+    char first_char = (s == size or path[s] == '/') ? '\0' : path[s];
+    const edge* end = edges_.data() + nd.first_edge + nd.n_edges;
+    for (const edge* e = edges_.data() + nd.first_edge; e != end; e++) {
+      int label_end = s + e->label_size;
+      if (e->first_char != first_char or label_end > size or
+          (label_end != size and path[label_end] != '/') or
+          !equal(path.data() + s, labels_.data() + e->label_start, e->label_size))
+        continue;
+      int r = find(e->child, path, label_end, params);
+      if (r >= 0)
+        return r;
+      break;
+    }
+
+    if (nd.param_child < 0 and nd.rest_child < 0)
+      return -1;
+
+    // {{param}}
+    if (nd.param_child >= 0) {
+      c = s;
+      while (c < size and path[c] != '/')
+        c++;
+      int saved_size = params.size;
+      params.push_back(path.substr(s, c - s));
+      int r = find(nd.param_child, path, c, params);
+      if (r >= 0)
+        return r;
+      params.size = saved_size;
+    }
+
+    // {{param...}}
+    if (nd.rest_child >= 0 and nodes_[nd.rest_child].value >= 0) {
+      params.push_back(path.substr(segment_start));
+      return nd.rest_child;
+    }
+
+    return -1;
+  }
+
+  std::vector<node> nodes_;
+  std::vector<edge> edges_;
+  std::string labels_;
+  std::vector<V> values_;
+};
+
+} // namespace li
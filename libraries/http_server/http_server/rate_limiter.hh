@@ -0,0 +1,235 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <li/http_server/admission_control.hh>
+#include <li/http_server/api.hh>
+#include <li/http_server/request.hh>
+#include <li/http_server/response.hh>
+#include <li/http_server/symbols.hh>
+#include <li/metamap/metamap.hh>
+
+namespace li {
+
+// Token bucket rate limiter, keyed by client ip (default) or by any string computed from the
+// request.
+//
+//   rate_limiter limiter(s::rate = 10, s::burst = 20);
+//   api.get("/search") = limiter([&] (http_request& request, http_response& response) { ... });
+//   // Limit a whole api, keyed by api key:
+//   rate_limiter by_api_key(s::rate = 1000, s::key = [] (http_request& request) {
+//     return std::string(request.header("X-Api-Key"));
+//   });
+//   api.add_subapi("/v1", by_api_key(v1_api));
+//
+// Requests over the limit get a 429 response with a Retry-After header, the handler is not
+// called.
+//
+// Each server thread has its own shard of buckets and updates it without locks. Every
+// s::sync_interval milliseconds (default 100), a shard reconciles the buckets it used with a
+// global bucket per key, under a mutex: it charges the global bucket with its own requests and
+// takes its token count. The limit is thus approximate across threads: between two
+// reconciliations, each thread may admit up to s::burst + s::rate * s::sync_interval requests
+// of a key.
+//
+// A shard holds at most s::max_keys buckets (default 100000). When it is full, the CLOCK
+// algorithm evicts a bucket that was not used since the hand last passed over it.
+struct rate_limiter {
+  typedef std::chrono::steady_clock clock;
+
+  template <typename... O> rate_limiter(O... opts) {
+    auto options = mmm(opts...);
+    rate = get_or(options, s::rate, 100);
+    burst = get_or(options, s::burst, std::max(1, int(rate)));
+    max_keys = get_or(options, s::max_keys, 100000);
+    sync_interval = std::chrono::milliseconds(get_or(options, s::sync_interval, 100));
+    if constexpr (has_key(options, s::key))
+      key = options.key;
+    else
+      key = [](http_request& request) { return request.ip_address(); };
+  }
+
+  rate_limiter(const rate_limiter&) = delete;
+
+  // Wrap \handler. The rate_limiter must outlive the server.
+  template <typename H> auto operator()(H handler) {
+    return [this, handler](http_request& request, http_response& response) {
+      int retry_after = try_acquire(key(request));
+      if (retry_after) {
+        response.set_status(429);
+        response.set_header("Retry-After", std::to_string(retry_after));
+        response.write("Too many requests.");
+        return;
+      }
+      handler(request, response);
+    };
+  }
+
+  // Wrap all the handlers of \subapi, to pass to api::add_subapi.
+  template <typename Req, typename Resp> api<Req, Resp> operator()(const api<Req, Resp>& subapi) {
+    api<Req, Resp> limited;
+    subapi.routes_map_.for_all_routes([&](auto r, const auto& handlers) {
+      for (auto& h : handlers)
+        if (h.handler)
+          limited(h.verb, h.url_spec) = (*this)(h.handler);
+    });
+    return limited;
+  }
+
+  // Take a token from the bucket of \k, in the shard of the calling thread.
+  // Return 0 on success, or the number of seconds before the next token.
+  int try_acquire(const std::string& k) {
+    shard& sh = *impl::thread_local_state<shard*>(thread_key, [this] { return add_shard(); });
+    auto now = clock::now();
+    if (now >= sh.next_sync)
+      reconcile(sh, now);
+
+    int i = find_or_insert(sh, k, now);
+    bucket& b = sh.buckets[i];
+    b.referenced = true;
+    b.tokens = refill(b.tokens, now - b.refill_time);
+    b.refill_time = now;
+    if (b.tokens < 1) {
+      sh.rejected.fetch_add(1, std::memory_order_relaxed);
+      return std::max(1, int(std::ceil((1 - b.tokens) / rate)));
+    }
+    b.tokens -= 1;
+    b.unsynced++;
+    if (!b.dirty) {
+      b.dirty = true;
+      sh.dirty.push_back(i);
+    }
+    sh.admitted.fetch_add(1, std::memory_order_relaxed);
+    return 0;
+  }
+
+  auto stats() {
+    long long admitted = 0, rejected = 0, evicted = 0;
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto& sh : shards) {
+      admitted += sh->admitted.load(std::memory_order_relaxed);
+      rejected += sh->rejected.load(std::memory_order_relaxed);
+      evicted += sh->evicted.load(std::memory_order_relaxed);
+    }
+    return mmm(s::admitted = admitted, s::rejected = rejected, s::evicted = evicted);
+  }
+
+  double rate; // Tokens per second.
+  int burst;   // Bucket capacity.
+  int max_keys;
+  std::chrono::microseconds sync_interval;
+  std::function<std::string(http_request&)> key;
+
+private:
+  struct bucket {
+    std::string key;
+    double tokens;
+    clock::time_point refill_time;
+    int unsynced = 0; // Tokens taken since the last reconciliation.
+    bool referenced = false;
+    bool dirty = false; // In shard::dirty.
+  };
+
+  struct shard {
+    std::unordered_map<std::string, int> index;
+    std::vector<bucket> buckets;
+    int clock_hand = 0;
+    std::vector<int> dirty;
+    clock::time_point next_sync;
+    std::atomic<long long> admitted = 0;
+    std::atomic<long long> rejected = 0;
+    std::atomic<long long> evicted = 0;
+  };
+
+  struct global_bucket {
+    double tokens;
+    clock::time_point refill_time;
+  };
+
+  // Tokens of a bucket holding \tokens, \elapsed later.
+  double refill(double tokens, clock::duration elapsed) const {
+    return std::min(double(burst), tokens + rate * std::chrono::duration<double>(elapsed).count());
+  }
+
+  shard* add_shard() {
+    std::lock_guard<std::mutex> lock(mutex);
+    shards.emplace_back(new shard);
+    return shards.back().get();
+  }
+
+  int find_or_insert(shard& sh, const std::string& k, clock::time_point now) {
+    auto it = sh.index.find(k);
+    if (it != sh.index.end())
+      return it->second;
+
+    int i;
+    if (int(sh.buckets.size()) < max_keys) {
+      i = sh.buckets.size();
+      sh.buckets.emplace_back();
+    } else {
+      while (sh.buckets[sh.clock_hand].referenced) {
+        sh.buckets[sh.clock_hand].referenced = false;
+        sh.clock_hand = (sh.clock_hand + 1) % sh.buckets.size();
+      }
+      i = sh.clock_hand;
+      sh.clock_hand = (sh.clock_hand + 1) % sh.buckets.size();
+      // Tokens taken since the last reconciliation are lost.
+      sh.index.erase(sh.buckets[i].key);
+      sh.evicted.fetch_add(1, std::memory_order_relaxed);
+    }
+    bucket& b = sh.buckets[i];
+    b.key = k;
+    b.tokens = burst;
+    b.refill_time = now;
+    b.unsynced = 0;
+    sh.index.emplace(k, i);
+    return i;
+  }
+
+  // Charge the global buckets with the tokens taken by \sh, and update its buckets with
+  // the tokens left.
+  void reconcile(shard& sh, clock::time_point now) {
+    sh.next_sync = now + sync_interval;
+    if (sh.dirty.empty())
+      return;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    for (int i : sh.dirty) {
+      bucket& b = sh.buckets[i];
+      auto& g = global.try_emplace(b.key, global_bucket{double(burst), now}).first->second;
+      g.tokens = refill(g.tokens, now - g.refill_time);
+      g.refill_time = now;
+      g.tokens -= b.unsynced;
+      b.tokens = g.tokens;
+      b.refill_time = now;
+      b.unsynced = 0;
+      b.dirty = false;
+    }
+    sh.dirty.clear();
+
+    // Full global buckets carry no information, drop them when the map grows too big.
+    if (global.size() > shards.size() * max_keys)
+      for (auto it = global.begin(); it != global.end();) {
+        if (refill(it->second.tokens, now - it->second.refill_time) >= burst)
+          it = global.erase(it);
+        else
+          ++it;
+      }
+  }
+
+  std::mutex mutex; // Protects shards and global.
+  std::vector<std::unique_ptr<shard>> shards;
+  impl::thread_local_key thread_key; // Finds the shard of the current thread.
+  std::unordered_map<std::string, global_bucket> global;
+};
+
+} // namespace li
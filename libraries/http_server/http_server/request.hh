@@ -1,244 +1,283 @@
-#pragma once
-
-#include <arpa/inet.h>
-#include <boost/lexical_cast.hpp>
-#include <iostream>
-#include <set>
-#include <string>
-#include <string_view>
-#include <unordered_map>
-#include <vector>
-
-
-#include <li/http_server/error.hh>
-#include <li/http_server/url_decode.hh>
-
-#include <li/metamap/metamap.hh>
-
-namespace li {
-
-struct http_request {
-
-  http_request(http_async_impl::http_ctx& http_ctx) : http_ctx(http_ctx), fiber(http_ctx.fiber) {}
-
-  inline std::string_view header(const char* k) const;
-  inline std::string_view cookie(const char* k) const;
-
-  inline std::string ip_address() const;
-
-  // With list of parameters: s::id = int(), s::name = string(), ...
-  template <typename S, typename V, typename... T>
-  auto url_parameters(assign_exp<S, V> e, T... tail) const;
-  template <typename S, typename V, typename... T>
-  auto get_parameters(assign_exp<S, V> e, T... tail) const;
-  template <typename S, typename V, typename... T>
-  auto post_parameters(assign_exp<S, V> e, T... tail) const;
-
-  // Const wrapper.
-  template <typename O> auto url_parameters(const O& res) const;
-  template <typename O> auto get_parameters(const O& res) const;
-  template <typename O> auto post_parameters(const O& res) const;
-
-  // With a metamap.
-  template <typename O> auto url_parameters(O& res) const;
-  template <typename O> auto get_parameters(O& res) const;
-  template <typename O> auto post_parameters(O& res) const;
-
-  http_async_impl::http_ctx& http_ctx;
-  async_fiber_context& fiber;
-  std::string_view url_spec;
-};
-
-struct url_parser_info_node {
-  int slash_pos;
-  bool is_path;
-};
-using url_parser_info = std::unordered_map<std::string, url_parser_info_node>;
-
-inline auto make_url_parser_info(const std::string_view url) {
-
-  url_parser_info info;
-
-  auto check_pattern = [](const char* s, char a) { return *s == a and *(s + 1) == a; };
-
-  int slash_pos = -1;
-  for (int i = 0; i < int(url.size()); i++) {
-    if (url[i] == '/')
-      slash_pos++;
-    // param must start with {{
-    if (check_pattern(url.data() + i, '{')) {
-      const char* param_name_start = url.data() + i + 2;
-      const char* param_name_end = param_name_start;
-      // param must end with }}
-      while (!check_pattern(param_name_end, '}'))
-        param_name_end++;
-
-      if (param_name_end != param_name_start and check_pattern(param_name_end, '}')) {
-        int size = param_name_end - param_name_start;
-        bool is_path = false;
-        if (size > 3 and param_name_end[-1] == '.' and param_name_end[-2] == '.' and
-            param_name_end[-3] == '.') {
-          is_path = true;
-          param_name_end -= 3;
-        }
-        std::string_view param_name(param_name_start, param_name_end - param_name_start);
-        info.emplace(param_name, url_parser_info_node{slash_pos, is_path});
-      }
-    }
-  }
-  return info;
-}
-
-template <typename O>
-auto parse_url_parameters(const url_parser_info& fmt, const std::string_view url, O& obj) {
-  // get the indexes of the slashes in url.
-  std::vector<int> slashes;
-  for (int i = 0; i < int(url.size()); i++) {
-    if (url[i] == '/')
-      slashes.push_back(i);
-  }
-
-  // For each field in O...
-  //  find the location of the field in the url thanks to fmt.
-  //  get it.
-  map(obj, [&](auto k, auto v) {
-    const char* symbol_str = symbol_string(k);
-    auto it = fmt.find(symbol_str);
-    if (it == fmt.end()) {
-      throw std::runtime_error(std::string("Parameter ") + symbol_str + " not found in url " +
-                               url.data());
-    } else {
-      // Location of the parameter in the url.
-      int param_slash = it->second.slash_pos; // index of slash before param.
-      if (param_slash >= int(slashes.size()))
-        throw http_error::bad_request("Missing url parameter ", symbol_str);
-
-      int param_start = slashes[param_slash] + 1;
-      if (it->second.is_path) {
-        if constexpr (std::is_same<std::decay_t<decltype(obj[k])>, std::string>::value or
-                      std::is_same<std::decay_t<decltype(obj[k])>, std::string_view>::value) {
-          obj[k] = std::string_view(url.data() + param_start - 1,
-                                    url.size() - param_start + 1); // -1 to include the first /.
-        } else {
-          throw std::runtime_error(
-              "{{path...}} parameters only accept std::string or std::string_view types.");
-        }
-
-      } else {
-        int param_end = param_start;
-        while (int(url.size()) > (param_end) and url[param_end] != '/')
-          param_end++;
-
-        std::string_view content(url.data() + param_start, param_end - param_start);
-        try {
-          if constexpr (std::is_same<std::remove_reference_t<decltype(v)>, std::string>::value or
-                        std::is_same<std::remove_reference_t<decltype(v)>, std::string_view>::value)
-            obj[k] = content;
-          else
-            obj[k] = boost::lexical_cast<decltype(v)>(content);
-        } catch (const std::bad_cast& e) {
-          throw http_error::bad_request("Cannot decode url parameter ", li::symbol_string(k), " : ",
-                                        e.what());
-        }
-      }
-    }
-  });
-  return obj;
-}
-
-inline std::string_view http_request::header(const char* k) const { return http_ctx.header(k); }
-
-inline std::string_view http_request::cookie(const char* k) const {
-  return http_ctx.cookie(k);
-  // FIXME return MHD_lookup_connection_value(mhd_connection, MHD_COOKIE_KIND, k);
-}
-
-inline std::string http_request::ip_address() const {
-  std::string s;
-  switch (fiber.in_addr.sa_family) {
-  case AF_INET: {
-    sockaddr_in* addr_in = (struct sockaddr_in*)&fiber.in_addr;
-    s.resize(INET_ADDRSTRLEN);
-    inet_ntop(AF_INET, &(addr_in->sin_addr), s.data(), INET_ADDRSTRLEN);
-    break;
-  }
-  case AF_INET6: {
-    sockaddr_in6* addr_in6 = (struct sockaddr_in6*)&fiber.in_addr;
-    s.resize(INET6_ADDRSTRLEN);
-    inet_ntop(AF_INET6, &(addr_in6->sin6_addr), s.data(), INET6_ADDRSTRLEN);
-    break;
-  }
-  default:
-    return "unsuported protocol";
-    break;
-  }
-
-  return s;
-}
-
-template <typename S, typename V, typename... T>
-auto http_request::url_parameters(assign_exp<S, V> e, T... tail) const {
-  return url_parameters(mmm(e, tail...));
-}
-
-template <typename S, typename V, typename... T>
-auto http_request::get_parameters(assign_exp<S, V> e, T... tail) const {
-  return get_parameters(mmm(e, tail...));
-}
-
-template <typename S, typename V, typename... T>
-auto http_request::post_parameters(assign_exp<S, V> e, T... tail) const {
-  auto o = mmm(e, tail...);
-  return post_parameters(o);
-}
-
-template <typename O> auto http_request::url_parameters(const O& res) const {
-  O r;
-  return url_parameters(r);
-}
-
-template <typename O> auto http_request::get_parameters(const O& res) const {
-  O r;
-  return get_parameters(r);
-}
-template <typename O> auto http_request::post_parameters(const O& res) const {
-  O r;
-  return post_parameters(r);
-}
-
-template <typename O> auto http_request::url_parameters(O& res) const {
-  auto info = make_url_parser_info(url_spec);
-  return parse_url_parameters(info, http_ctx.url(), res);
-}
-
-template <typename O> auto http_request::get_parameters(O& res) const {
-
-  try {
-    url_decode(http_ctx.get_parameters_string(), res);
-  } catch (const std::runtime_error& e) {
-    throw http_error::bad_request("Error while decoding the GET parameter: ", e.what());
-  }
-
-  return res;
-}
-
-template <typename O> auto http_request::post_parameters(O& res) const {
-  try {
-    std::string_view encoding = this->header("Content-Type");
-    if (!encoding.data())
-      throw http_error::bad_request(
-          std::string("Content-Type is required to decode the POST parameters"));
-
-    std::string_view body = http_ctx.read_whole_body();
-    if (encoding == std::string_view("application/x-www-form-urlencoded"))
-      url_decode(url_unescape(body), res);
-    else if (encoding == std::string_view("application/json"))
-      json_decode(body, res);
-  } catch (std::exception e) {
-    throw http_error::bad_request("Error while decoding the POST parameters: ", e.what());
-  }
-
-  return res;
-}
-
-} // namespace li
+#pragma once
+
+#include <arpa/inet.h>
+#include <boost/lexical_cast.hpp>
+#include <iostream>
+#include <set>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+
+#include <li/http_server/arena.hh>
+#include <li/http_server/error.hh>
+#include <li/http_server/radix_router.hh>
+#include <li/http_server/url_decode.hh>
+
+#include <li/metamap/metamap.hh>
+
+namespace li {
+
+// Request of a generic_http_ctx: http_request with the fibers of async_reactor,
+// coro_http_request with the coroutines of coro_reactor.
+template <typename CTX> struct basic_http_request {
+
+  basic_http_request(CTX& http_ctx) : http_ctx(http_ctx), fiber(http_ctx.fiber) {}
+
+  inline std::string_view header(const char* k) const;
+  inline std::string_view cookie(const char* k) const;
+
+  inline std::string ip_address() const;
+
+  // Memory freed in one shot after the response, for the handler scratch data.
+  // For example: arena_string name(request.arena());
+  inline monotonic_arena& arena() const;
+
+  // With list of parameters: s::id = int(), s::name = string(), ...
+  template <typename S, typename V, typename... T>
+  auto url_parameters(assign_exp<S, V> e, T... tail) const;
+  template <typename S, typename V, typename... T>
+  auto get_parameters(assign_exp<S, V> e, T... tail) const;
+  template <typename S, typename V, typename... T>
+  auto post_parameters(assign_exp<S, V> e, T... tail) const;
+
+  // Const wrapper.
+  template <typename O> auto url_parameters(const O& res) const;
+  template <typename O> auto get_parameters(const O& res) const;
+  template <typename O> auto post_parameters(const O& res) const;
+
+  // With a metamap.
+  template <typename O> auto url_parameters(O& res) const;
+  template <typename O> auto get_parameters(O& res) const;
+  template <typename O> auto post_parameters(O& res) const;
+
+  CTX& http_ctx;
+  typename CTX::fiber_type& fiber;
+  std::string_view url_spec;
+  // Values of the url parameters and their names, set by the router.
+  route_params url_params;
+  const route_params_layout* url_params_layout = nullptr;
+};
+
+struct url_parser_info_node {
+  int slash_pos;
+  bool is_path;
+};
+using url_parser_info = std::unordered_map<std::string, url_parser_info_node>;
+
+inline auto make_url_parser_info(const std::string_view url) {
+
+  url_parser_info info;
+
+  auto check_pattern = [](const char* s, char a) { return *s == a and *(s + 1) == a; };
+
+  int slash_pos = -1;
+  for (int i = 0; i < int(url.size()); i++) {
+    if (url[i] == '/')
+      slash_pos++;
+    // param must start with {{
+    if (check_pattern(url.data() + i, '{')) {
+      const char* param_name_start = url.data() + i + 2;
+      const char* param_name_end = param_name_start;
+      // param must end with }}
+      while (!check_pattern(param_name_end, '}'))
+        param_name_end++;
+
+      if (param_name_end != param_name_start and check_pattern(param_name_end, '}')) {
+        int size = param_name_end - param_name_start;
+        bool is_path = false;
+        if (size > 3 and param_name_end[-1] == '.' and param_name_end[-2] == '.' and
+            param_name_end[-3] == '.') {
+          is_path = true;
+          param_name_end -= 3;
+        }
+        std::string_view param_name(param_name_start, param_name_end - param_name_start);
+        info.emplace(param_name, url_parser_info_node{slash_pos, is_path});
+      }
+    }
+  }
+  return info;
+}
+
+// Decode the url parameter \k of \obj from its value in the url.
+template <typename K, typename O>
+void decode_url_parameter(K k, std::string_view content, bool is_path, O& obj) {
+  auto& v = obj[k];
+  if (is_path) {
+    if constexpr (internal::is_basic_string<std::decay_t<decltype(v)>>::value or
+                  std::is_same<std::decay_t<decltype(v)>, std::string_view>::value) {
+      v = content;
+    } else {
+      throw std::runtime_error(
+          "{{path...}} parameters only accept std::string or std::string_view types.");
+    }
+  } else if (!url_decode_value(content, v))
+    throw http_error::bad_request("Cannot decode url parameter ", li::symbol_string(k));
+}
+
+template <typename O>
+auto parse_url_parameters(const url_parser_info& fmt, const std::string_view url, O& obj) {
+  // For each field in O...
+  //  find the location of the field in the url thanks to fmt.
+  //  get it.
+  map(obj, [&](auto k, auto v) {
+    const char* symbol_str = symbol_string(k);
+    auto it = fmt.find(symbol_str);
+    if (it == fmt.end()) {
+      throw std::runtime_error(std::string("Parameter ") + symbol_str + " not found in url " +
+                               url.data());
+    } else {
+      // Location of the parameter in the url: find the slash before the param.
+      int param_slash = it->second.slash_pos;
+      int param_start = 0;
+      for (int n = -1; n < param_slash; param_start++) {
+        if (param_start == int(url.size()))
+          throw http_error::bad_request("Missing url parameter ", symbol_str);
+        if (url[param_start] == '/')
+          n++;
+      }
+
+      if (it->second.is_path)
+        decode_url_parameter(k, url.substr(param_start - 1), true, obj); // -1 to include the first /.
+      else {
+        int param_end = param_start;
+        while (int(url.size()) > (param_end) and url[param_end] != '/')
+          param_end++;
+        decode_url_parameter(k, url.substr(param_start, param_end - param_start), false, obj);
+      }
+    }
+  });
+  return obj;
+}
+
+template <typename CTX>
+inline std::string_view basic_http_request<CTX>::header(const char* k) const {
+  return http_ctx.header(k);
+}
+
+template <typename CTX>
+inline monotonic_arena& basic_http_request<CTX>::arena() const { return http_ctx.arena; }
+
+template <typename CTX>
+inline std::string_view basic_http_request<CTX>::cookie(const char* k) const {
+  return http_ctx.cookie(k);
+  // FIXME return MHD_lookup_connection_value(mhd_connection, MHD_COOKIE_KIND, k);
+}
+
+template <typename CTX>
+inline std::string basic_http_request<CTX>::ip_address() const {
+  std::string s;
+  switch (fiber.in_addr.sa_family) {
+  case AF_INET: {
+    sockaddr_in* addr_in = (struct sockaddr_in*)&fiber.in_addr;
+    s.resize(INET_ADDRSTRLEN);
+    inet_ntop(AF_INET, &(addr_in->sin_addr), s.data(), INET_ADDRSTRLEN);
+    break;
+  }
+  case AF_INET6: {
+    sockaddr_in6* addr_in6 = (struct sockaddr_in6*)&fiber.in_addr;
+    s.resize(INET6_ADDRSTRLEN);
+    inet_ntop(AF_INET6, &(addr_in6->sin6_addr), s.data(), INET6_ADDRSTRLEN);
+    break;
+  }
+  default:
+    return "unsuported protocol";
+    break;
+  }
+
+  s.resize(strlen(s.c_str())); // inet_ntop wrote less than the maximum length.
+  return s;
+}
+
+template <typename CTX>
+template <typename S, typename V, typename... T>
+auto basic_http_request<CTX>::url_parameters(assign_exp<S, V> e, T... tail) const {
+  return url_parameters(mmm(e, tail...));
+}
+
+template <typename CTX>
+template <typename S, typename V, typename... T>
+auto basic_http_request<CTX>::get_parameters(assign_exp<S, V> e, T... tail) const {
+  return get_parameters(mmm(e, tail...));
+}
+
+template <typename CTX>
+template <typename S, typename V, typename... T>
+auto basic_http_request<CTX>::post_parameters(assign_exp<S, V> e, T... tail) const {
+  auto o = mmm(e, tail...);
+  return post_parameters(o);
+}
+
+template <typename CTX>
+template <typename O> auto basic_http_request<CTX>::url_parameters(const O& res) const {
+  O r;
+  return url_parameters(r);
+}
+
+template <typename CTX>
+template <typename O> auto basic_http_request<CTX>::get_parameters(const O& res) const {
+  O r;
+  return get_parameters(r);
+}
+template <typename CTX>
+template <typename O> auto basic_http_request<CTX>::post_parameters(const O& res) const {
+  O r;
+  return post_parameters(r);
+}
+
+template <typename CTX>
+template <typename O> auto basic_http_request<CTX>::url_parameters(O& res) const {
+  // The request was not routed by api::call, parse the url spec.
+  if (!url_params_layout) {
+    auto info = make_url_parser_info(url_spec);
+    return parse_url_parameters(info, http_ctx.url(), res);
+  }
+
+  map(res, [&](auto k, auto v) {
+    int i = url_params_layout->find(symbol_hash(k));
+    if (i < 0 or i >= url_params.size or
+        url_spec.substr(url_params_layout->params[i].name_start,
+                        url_params_layout->params[i].name_size) != symbol_string(k))
+      throw std::runtime_error(std::string("Parameter ") + symbol_string(k) +
+                               " not found in url " + std::string(url_spec));
+    decode_url_parameter(k, url_params.values[i], url_params_layout->params[i].is_path, res);
+  });
+  return res;
+}
+
+template <typename CTX>
+template <typename O> auto basic_http_request<CTX>::get_parameters(O& res) const {
+
+  try {
+    url_decode(http_ctx.get_parameters_string(), res, &arena());
+  } catch (const std::runtime_error& e) {
+    throw http_error::bad_request("Error while decoding the GET parameter: ", e.what());
+  }
+
+  return res;
+}
+
+template <typename CTX>
+template <typename O> auto basic_http_request<CTX>::post_parameters(O& res) const {
+  try {
+    std::string_view encoding = this->header("Content-Type");
+    if (!encoding.data())
+      throw http_error::bad_request(
+          std::string("Content-Type is required to decode the POST parameters"));
+
+    std::string_view body = http_ctx.read_whole_body();
+    if (encoding == std::string_view("application/x-www-form-urlencoded"))
+      url_decode(body, res, &arena());
+    else if (encoding == std::string_view("application/json"))
+      json_decode(body, res);
+  } catch (std::exception e) {
+    throw http_error::bad_request("Error while decoding the POST parameters: ", e.what());
+  }
+
+  return res;
+}
+
+typedef basic_http_request<http_async_impl::http_ctx> http_request;
+
+} // namespace li
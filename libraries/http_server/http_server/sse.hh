@@ -0,0 +1,232 @@
+#pragma once
+
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <li/http_server/request.hh>
+#include <li/http_server/response.hh>
+#include <li/http_server/tcp_server.hh>
+
+namespace li {
+
+// An event published on a sse_hub topic.
+// It is serialized once at publish time and then shared by all the subscribers.
+struct sse_event {
+
+  sse_event(std::string_view data, std::string_view event_name) : data_(data) {
+    // text/event-stream framing.
+    std::string payload;
+    if (event_name.size())
+      payload.append("event: ").append(event_name).append("\n");
+    size_t line_start = 0;
+    while (line_start <= data.size()) {
+      size_t line_end = data.find('\n', line_start);
+      if (line_end == std::string_view::npos)
+        line_end = data.size();
+      payload.append("data: ").append(data.substr(line_start, line_end - line_start)).append("\n");
+      line_start = line_end + 1;
+    }
+    payload.append("\n");
+
+    // HTTP chunk framing.
+    char size[20];
+    int size_len = snprintf(size, sizeof(size), "%zx\r\n", payload.size());
+    frame_.reserve(size_len + payload.size() + 2);
+    frame_.append(size, size_len).append(payload).append("\r\n");
+  }
+
+  // The raw payload, as passed to publish. Used by long polling handlers.
+  std::string_view data() const { return data_; }
+  // The event serialized as a text/event-stream message inside a HTTP chunk.
+  std::string_view frame() const { return frame_; }
+
+private:
+  std::string data_;
+  std::string frame_;
+};
+
+typedef std::shared_ptr<const sse_event> sse_event_ptr;
+
+namespace internal {
+
+// State shared by the hub and a subscription.
+struct sse_subscriber {
+  async_reactor* reactor;
+  int fiber_id;
+  std::mutex mutex;
+  std::deque<sse_event_ptr> queue;
+};
+
+} // namespace internal
+
+struct sse_hub;
+
+// A subscription to one topic of a sse_hub. It unsubscribes when destroyed.
+// The wait methods park the calling fiber until an event is published.
+struct sse_subscription {
+
+  inline sse_subscription(sse_hub& hub, async_fiber_context& fiber, std::string topic,
+                          std::shared_ptr<internal::sse_subscriber> subscriber)
+      : hub_(&hub), fiber_(&fiber), topic_(std::move(topic)), subscriber_(std::move(subscriber)) {}
+
+  sse_subscription(sse_subscription&&) = default;
+  sse_subscription& operator=(sse_subscription&&) = delete;
+  inline ~sse_subscription();
+
+  // Return the next event, or nullptr if the server is shutting down or the client
+  // closed the connection.
+  inline sse_event_ptr wait() {
+    return wait_until(std::chrono::steady_clock::time_point::max());
+  }
+
+  // Return the next event, or nullptr if nothing was published before \deadline or the
+  // client closed the connection.
+  inline sse_event_ptr wait_until(std::chrono::steady_clock::time_point deadline) {
+    while (true) {
+      if (auto event = try_pop())
+        return event;
+      if (quit_signal_catched or std::chrono::steady_clock::now() >= deadline)
+        return nullptr;
+      bool open = deadline == std::chrono::steady_clock::time_point::max()
+                      ? fiber_->park()
+                      : fiber_->park_until(deadline);
+      if (!open)
+        return nullptr;
+    }
+  }
+
+  template <typename R, typename P>
+  inline sse_event_ptr wait_for(std::chrono::duration<R, P> timeout) {
+    return wait_until(std::chrono::steady_clock::now() + timeout);
+  }
+
+  // Return the next event if one is already queued, nullptr otherwise.
+  inline sse_event_ptr try_pop() {
+    std::lock_guard<std::mutex> lock(subscriber_->mutex);
+    if (subscriber_->queue.empty())
+      return nullptr;
+    sse_event_ptr event = std::move(subscriber_->queue.front());
+    subscriber_->queue.pop_front();
+    return event;
+  }
+
+private:
+  sse_hub* hub_;
+  async_fiber_context* fiber_;
+  std::string topic_;
+  std::shared_ptr<internal::sse_subscriber> subscriber_;
+};
+
+// Topic based publish/subscribe hub.
+// publish is thread safe: it wakes up the subscribed fibers on every reactor.
+struct sse_hub {
+
+  // Subscribers keep at most max_queue_size events, older events are dropped.
+  inline sse_hub(int max_queue_size = 1000) : max_queue_size_(max_queue_size) {}
+
+  inline sse_subscription subscribe(http_request& request, std::string topic) {
+    return subscribe(request.fiber, std::move(topic));
+  }
+
+  inline sse_subscription subscribe(async_fiber_context& fiber, std::string topic) {
+    auto subscriber = std::make_shared<internal::sse_subscriber>();
+    subscriber->reactor = fiber.reactor;
+    subscriber->fiber_id = fiber.fiber_id;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      topics_[topic].push_back(subscriber);
+    }
+    return sse_subscription(*this, fiber, std::move(topic), std::move(subscriber));
+  }
+
+  // Publish \data on \topic. Return the number of subscribers that received it.
+  inline int publish(std::string_view topic, std::string_view data,
+                     std::string_view event_name = std::string_view()) {
+    auto event = std::make_shared<const sse_event>(data, event_name);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = topics_.find(std::string(topic));
+    if (it == topics_.end())
+      return 0;
+    for (auto& subscriber : it->second) {
+      {
+        std::lock_guard<std::mutex> sub_lock(subscriber->mutex);
+        if (int(subscriber->queue.size()) >= max_queue_size_)
+          subscriber->queue.pop_front();
+        subscriber->queue.push_back(event);
+      }
+      subscriber->reactor->remote_fiber_resume(subscriber->fiber_id);
+    }
+    return it->second.size();
+  }
+
+  inline int subscribers_count(std::string_view topic) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = topics_.find(std::string(topic));
+    return it == topics_.end() ? 0 : it->second.size();
+  }
+
+  inline void unsubscribe(const std::string& topic,
+                          const std::shared_ptr<internal::sse_subscriber>& subscriber) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = topics_.find(topic);
+    if (it == topics_.end())
+      return;
+    auto& subscribers = it->second;
+    for (int i = 0; i < int(subscribers.size()); i++)
+      if (subscribers[i] == subscriber) {
+        subscribers[i] = std::move(subscribers.back());
+        subscribers.pop_back();
+        break;
+      }
+    if (subscribers.empty())
+      topics_.erase(it);
+  }
+
+private:
+  int max_queue_size_;
+  std::mutex mutex_;
+  std::unordered_map<std::string, std::vector<std::shared_ptr<internal::sse_subscriber>>> topics_;
+};
+
+sse_subscription::~sse_subscription() {
+  if (subscriber_)
+    hub_->unsubscribe(topic_, subscriber_);
+}
+
+// Stream text/event-stream events on a response:
+//
+//   auto sub = hub.subscribe(request, "news");
+//   sse_stream stream(response);
+//   while (auto event = sub.wait())
+//     stream.send(*event);
+//
+struct sse_stream {
+
+  inline sse_stream(http_response& response) : ctx_(response.http_ctx) {
+    ctx_.set_header("Content-Type", "text/event-stream");
+    ctx_.set_header("Cache-Control", "no-cache");
+    ctx_.start_chunked_response();
+  }
+
+  // Send an event serialized by sse_hub::publish.
+  inline void send(const sse_event& event) { ctx_.write_framed_chunk(event.frame()); }
+
+  inline void send(std::string_view data, std::string_view event_name = std::string_view()) {
+    send(sse_event(data, event_name));
+  }
+
+  // The response is terminated when the handler returns, end allows to terminate it earlier.
+  inline void end() { ctx_.end_chunked_response(); }
+
+private:
+  http_async_impl::http_ctx& ctx_;
+};
+
+} // namespace li
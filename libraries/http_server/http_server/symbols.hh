@@ -1,10 +1,60 @@
 // Generated by the lithium symbol generator.
 #include <lithium_symbol.hh>
+#ifndef LI_SYMBOL_admission_control
+#define LI_SYMBOL_admission_control
+    LI_SYMBOL(admission_control)
+#endif
+
+#ifndef LI_SYMBOL_admitted
+#define LI_SYMBOL_admitted
+    LI_SYMBOL(admitted)
+#endif
+
+#ifndef LI_SYMBOL_balancing
+#define LI_SYMBOL_balancing
+    LI_SYMBOL(balancing)
+#endif
+
 #ifndef LI_SYMBOL_blocking
 #define LI_SYMBOL_blocking
     LI_SYMBOL(blocking)
 #endif
 
+#ifndef LI_SYMBOL_body
+#define LI_SYMBOL_body
+    LI_SYMBOL(body)
+#endif
+
+#ifndef LI_SYMBOL_burst
+#define LI_SYMBOL_burst
+    LI_SYMBOL(burst)
+#endif
+
+#ifndef LI_SYMBOL_busy_poll
+#define LI_SYMBOL_busy_poll
+    LI_SYMBOL(busy_poll)
+#endif
+
+#ifndef LI_SYMBOL_capture
+#define LI_SYMBOL_capture
+    LI_SYMBOL(capture)
+#endif
+
+#ifndef LI_SYMBOL_codel_interval
+#define LI_SYMBOL_codel_interval
+    LI_SYMBOL(codel_interval)
+#endif
+
+#ifndef LI_SYMBOL_codel_target
+#define LI_SYMBOL_codel_target
+    LI_SYMBOL(codel_target)
+#endif
+
+#ifndef LI_SYMBOL_connections
+#define LI_SYMBOL_connections
+    LI_SYMBOL(connections)
+#endif
+
 #ifndef LI_SYMBOL_create_secret_key
 #define LI_SYMBOL_create_secret_key
     LI_SYMBOL(create_secret_key)
@@ -15,11 +65,46 @@
     LI_SYMBOL(date_thread)
 #endif
 
+#ifndef LI_SYMBOL_duration
+#define LI_SYMBOL_duration
+    LI_SYMBOL(duration)
+#endif
+
+#ifndef LI_SYMBOL_evicted
+#define LI_SYMBOL_evicted
+    LI_SYMBOL(evicted)
+#endif
+
+#ifndef LI_SYMBOL_failures
+#define LI_SYMBOL_failures
+    LI_SYMBOL(failures)
+#endif
+
+#ifndef LI_SYMBOL_fetch_headers
+#define LI_SYMBOL_fetch_headers
+    LI_SYMBOL(fetch_headers)
+#endif
+
+#ifndef LI_SYMBOL_get_parameters
+#define LI_SYMBOL_get_parameters
+    LI_SYMBOL(get_parameters)
+#endif
+
 #ifndef LI_SYMBOL_hash_password
 #define LI_SYMBOL_hash_password
     LI_SYMBOL(hash_password)
 #endif
 
+#ifndef LI_SYMBOL_headers
+#define LI_SYMBOL_headers
+    LI_SYMBOL(headers)
+#endif
+
+#ifndef LI_SYMBOL_host
+#define LI_SYMBOL_host
+    LI_SYMBOL(host)
+#endif
+
 #ifndef LI_SYMBOL_https_cert
 #define LI_SYMBOL_https_cert
     LI_SYMBOL(https_cert)
@@ -35,11 +120,46 @@
     LI_SYMBOL(id)
 #endif
 
+#ifndef LI_SYMBOL_json_encoded
+#define LI_SYMBOL_json_encoded
+    LI_SYMBOL(json_encoded)
+#endif
+
+#ifndef LI_SYMBOL_key
+#define LI_SYMBOL_key
+    LI_SYMBOL(key)
+#endif
+
 #ifndef LI_SYMBOL_linux_epoll
 #define LI_SYMBOL_linux_epoll
     LI_SYMBOL(linux_epoll)
 #endif
 
+#ifndef LI_SYMBOL_listen_backlog
+#define LI_SYMBOL_listen_backlog
+    LI_SYMBOL(listen_backlog)
+#endif
+
+#ifndef LI_SYMBOL_max_idle_connections
+#define LI_SYMBOL_max_idle_connections
+    LI_SYMBOL(max_idle_connections)
+#endif
+
+#ifndef LI_SYMBOL_max_in_flight
+#define LI_SYMBOL_max_in_flight
+    LI_SYMBOL(max_in_flight)
+#endif
+
+#ifndef LI_SYMBOL_max_keys
+#define LI_SYMBOL_max_keys
+    LI_SYMBOL(max_keys)
+#endif
+
+#ifndef LI_SYMBOL_max_queue
+#define LI_SYMBOL_max_queue
+    LI_SYMBOL(max_queue)
+#endif
+
 #ifndef LI_SYMBOL_name
 #define LI_SYMBOL_name
     LI_SYMBOL(name)
@@ -65,21 +185,81 @@
     LI_SYMBOL(path)
 #endif
 
+#ifndef LI_SYMBOL_pipelined
+#define LI_SYMBOL_pipelined
+    LI_SYMBOL(pipelined)
+#endif
+
+#ifndef LI_SYMBOL_poisson
+#define LI_SYMBOL_poisson
+    LI_SYMBOL(poisson)
+#endif
+
+#ifndef LI_SYMBOL_post_parameters
+#define LI_SYMBOL_post_parameters
+    LI_SYMBOL(post_parameters)
+#endif
+
 #ifndef LI_SYMBOL_primary_key
 #define LI_SYMBOL_primary_key
     LI_SYMBOL(primary_key)
 #endif
 
+#ifndef LI_SYMBOL_rate
+#define LI_SYMBOL_rate
+    LI_SYMBOL(rate)
+#endif
+
 #ifndef LI_SYMBOL_read_only
 #define LI_SYMBOL_read_only
     LI_SYMBOL(read_only)
 #endif
 
+#ifndef LI_SYMBOL_receive_buffer_size
+#define LI_SYMBOL_receive_buffer_size
+    LI_SYMBOL(receive_buffer_size)
+#endif
+
+#ifndef LI_SYMBOL_record_requests
+#define LI_SYMBOL_record_requests
+    LI_SYMBOL(record_requests)
+#endif
+
+#ifndef LI_SYMBOL_rejected
+#define LI_SYMBOL_rejected
+    LI_SYMBOL(rejected)
+#endif
+
+#ifndef LI_SYMBOL_requests
+#define LI_SYMBOL_requests
+    LI_SYMBOL(requests)
+#endif
+
+#ifndef LI_SYMBOL_retries
+#define LI_SYMBOL_retries
+    LI_SYMBOL(retries)
+#endif
+
+#ifndef LI_SYMBOL_retry_after
+#define LI_SYMBOL_retry_after
+    LI_SYMBOL(retry_after)
+#endif
+
+#ifndef LI_SYMBOL_reused
+#define LI_SYMBOL_reused
+    LI_SYMBOL(reused)
+#endif
+
 #ifndef LI_SYMBOL_select
 #define LI_SYMBOL_select
     LI_SYMBOL(select)
 #endif
 
+#ifndef LI_SYMBOL_send_buffer_size
+#define LI_SYMBOL_send_buffer_size
+    LI_SYMBOL(send_buffer_size)
+#endif
+
 #ifndef LI_SYMBOL_server_thread
 #define LI_SYMBOL_server_thread
     LI_SYMBOL(server_thread)
@@ -90,6 +270,16 @@
     LI_SYMBOL(session_id)
 #endif
 
+#ifndef LI_SYMBOL_shed_in_flight
+#define LI_SYMBOL_shed_in_flight
+    LI_SYMBOL(shed_in_flight)
+#endif
+
+#ifndef LI_SYMBOL_shed_queue_delay
+#define LI_SYMBOL_shed_queue_delay
+    LI_SYMBOL(shed_queue_delay)
+#endif
+
 #ifndef LI_SYMBOL_ssl_certificate
 #define LI_SYMBOL_ssl_certificate
     LI_SYMBOL(ssl_certificate)
@@ -105,6 +295,36 @@
     LI_SYMBOL(ssl_key)
 #endif
 
+#ifndef LI_SYMBOL_status
+#define LI_SYMBOL_status
+    LI_SYMBOL(status)
+#endif
+
+#ifndef LI_SYMBOL_sync_interval
+#define LI_SYMBOL_sync_interval
+    LI_SYMBOL(sync_interval)
+#endif
+
+#ifndef LI_SYMBOL_tcp_defer_accept
+#define LI_SYMBOL_tcp_defer_accept
+    LI_SYMBOL(tcp_defer_accept)
+#endif
+
+#ifndef LI_SYMBOL_tcp_fastopen
+#define LI_SYMBOL_tcp_fastopen
+    LI_SYMBOL(tcp_fastopen)
+#endif
+
+#ifndef LI_SYMBOL_tcp_nodelay
+#define LI_SYMBOL_tcp_nodelay
+    LI_SYMBOL(tcp_nodelay)
+#endif
+
+#ifndef LI_SYMBOL_timeout
+#define LI_SYMBOL_timeout
+    LI_SYMBOL(timeout)
+#endif
+
 #ifndef LI_SYMBOL_update_secret_key
 #define LI_SYMBOL_update_secret_key
     LI_SYMBOL(update_secret_key)
@@ -115,3 +335,8 @@
     LI_SYMBOL(user_id)
 #endif
 
+#ifndef LI_SYMBOL_weights
+#define LI_SYMBOL_weights
+    LI_SYMBOL(weights)
+#endif
+
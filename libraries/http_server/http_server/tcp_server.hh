@@ -13,27 +13,111 @@
 
 #if __linux__
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #elif __APPLE__
 #include <sys/event.h>
 #endif
 
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <algorithm>
+#include <chrono>
 #include <deque>
+#include <mutex>
+#include <queue>
 #include <thread>
+#include <tuple>
 #include <vector>
 
 #include <boost/context/continuation.hpp>
+#include <boost/context/pooled_fixedsize_stack.hpp>
 
 #include <li/http_server/ssl_context.hh>
 
 namespace li {
 
+// Socket and reactor tuning. 0 keeps the system default.
+struct tcp_server_options {
+  int listen_backlog = SOMAXCONN;
+  // Disable Nagle's algorithm on the accepted sockets.
+  bool tcp_nodelay = false;
+  // Seconds to wait for the first request bytes before waking the reactor (Linux).
+  int tcp_defer_accept = 0;
+  // Length of the TCP Fast Open queue of pending connections.
+  int tcp_fastopen = 0;
+  // SO_SNDBUF and SO_RCVBUF of the accepted sockets.
+  int send_buffer_size = 0;
+  int receive_buffer_size = 0;
+  // Busy polling, in microseconds: after an event, the reactor spins with
+  // epoll_wait(..., 0) this long before sleeping again, and the accepted sockets get
+  // SO_BUSY_POLL / SO_PREFER_BUSY_POLL (Linux). Trades CPU for latency.
+  int busy_poll_us = 0;
+};
+
 namespace impl {
 
+static void set_socket_option(int fd, int level, int option, int value, const char* name) {
+  if (-1 == setsockopt(fd, level, option, &value, sizeof(value)))
+    std::cerr << "Warning: cannot set " << name << " on socket " << fd << ": " << strerror(errno)
+              << std::endl;
+}
+
+// Options of the listening socket.
+static void configure_listen_socket(int fd, const tcp_server_options& options) {
+  if (options.receive_buffer_size) // Inherited by the accepted sockets.
+    set_socket_option(fd, SOL_SOCKET, SO_RCVBUF, options.receive_buffer_size, "SO_RCVBUF");
+#ifdef TCP_DEFER_ACCEPT
+  if (options.tcp_defer_accept)
+    set_socket_option(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, options.tcp_defer_accept,
+                      "TCP_DEFER_ACCEPT");
+#endif
+#ifdef TCP_FASTOPEN
+  if (options.tcp_fastopen)
+    set_socket_option(fd, IPPROTO_TCP, TCP_FASTOPEN, options.tcp_fastopen, "TCP_FASTOPEN");
+#endif
+}
+
+// Options of an accepted socket.
+static void configure_accepted_socket(int fd, const tcp_server_options& options) {
+  if (options.tcp_nodelay)
+    set_socket_option(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+  if (options.send_buffer_size)
+    set_socket_option(fd, SOL_SOCKET, SO_SNDBUF, options.send_buffer_size, "SO_SNDBUF");
+#if __linux__
+  if (options.busy_poll_us) {
+    // Values above net.core.busy_read need CAP_NET_ADMIN: fail silently, the reactor
+    // still spins.
+    int busy_poll = options.busy_poll_us;
+    setsockopt(fd, SOL_SOCKET, 46 /* SO_BUSY_POLL */, &busy_poll, sizeof(busy_poll));
+    int prefer = 1; // Since Linux 5.11.
+    setsockopt(fd, SOL_SOCKET, 69 /* SO_PREFER_BUSY_POLL */, &prefer, sizeof(prefer));
+  }
+#endif
+}
+
+// Timeout of epoll_wait: 0 (spin) during \busy_poll_us after the last event, 1ms otherwise
+// so the reactors regularly check the quit signal.
+struct busy_poll_clock {
+  busy_poll_clock(int busy_poll_us) : budget(busy_poll_us) {}
+
+  int timeout() {
+    if (budget.count() == 0)
+      return 1;
+    return std::chrono::steady_clock::now() < spin_until ? 0 : 1;
+  }
+  void on_events() {
+    if (budget.count())
+      spin_until = std::chrono::steady_clock::now() + budget;
+  }
+
+  std::chrono::microseconds budget;
+  std::chrono::steady_clock::time_point spin_until;
+};
+
 // Helper to create a TCP/UDP server socket.
-static int create_and_bind(int port, int socktype) {
+static int create_and_bind(int port, int socktype, const tcp_server_options& options = {}) {
   struct addrinfo hints;
   struct addrinfo *result, *rp;
   int s, sfd;
@@ -74,11 +158,21 @@ static int create_and_bind(int port, int socktype) {
 
   int flags = fcntl(sfd, F_GETFL, 0);
   fcntl(sfd, F_SETFL, flags | O_NONBLOCK);
-  ::listen(sfd, SOMAXCONN);
+  if (socktype == SOCK_STREAM)
+    configure_listen_socket(sfd, options);
+  ::listen(sfd, options.listen_backlog);
 
   return sfd;
 }
 
+// send flag telling the kernel that more data is coming, so it can wait before sending
+// a partial TCP segment. Not available on MacOS.
+#ifdef MSG_MORE
+static constexpr int send_more_flag = MSG_MORE;
+#else
+static constexpr int send_more_flag = 0;
+#endif
+
 } // namespace impl
 
 static volatile int quit_signal_catched = 0;
@@ -87,7 +181,12 @@ struct async_fiber_context;
 
 // Epoll based Reactor:
 // Orchestrates a set of fiber (boost::context::continuation).
+//
+// When the peer closes a connection, the fiber is resumed normally and the connection is
+// marked closed: read returns 0, write returns false, yield and park return false.
+// No exception is thrown through the fiber stack.
 
+// Not thrown by the reactor anymore. Kept for code catching it.
 struct fiber_exception {
 
   std::string what;
@@ -99,6 +198,28 @@ struct fiber_exception {
 
 struct async_reactor;
 
+// In-memory peer of a fiber, replacing its socket (see http_injector): reads consume
+// \input, at most \read_size bytes at a time (0: no limit), and writes are appended to
+// \output. A read at the end of the input returns 0, like a closed connection.
+struct memory_socket {
+  std::string_view input;
+  int read_size = 0;
+  std::string output;
+
+  inline int read(char* buf, int size) {
+    if (read_size > 0)
+      size = std::min(size, read_size);
+    size = std::min(size_t(size), input.size());
+    memcpy(buf, input.data(), size);
+    input.remove_prefix(size);
+    return size;
+  }
+  inline int write(const char* buf, int size) {
+    output.append(buf, size);
+    return size;
+  }
+};
+
 // The fiber context passed to all fibers so they can do
 //  yield, non blocking read/write on the socket fd, and subscribe to
 //  other file descriptors events.
@@ -112,6 +233,10 @@ struct async_fiber_context {
   int socket_fd;
   sockaddr in_addr;
   SSL* ssl = nullptr;
+  // Set instead of socket_fd when the connection is in memory.
+  memory_socket* memory = nullptr;
+  // Set on the child fibers of async_reactor::spawn to cancel them.
+  const bool* cancelled = nullptr;
 
   inline async_fiber_context& operator=(const async_fiber_context&) = delete;
   inline async_fiber_context(const async_fiber_context&) = delete;
@@ -122,7 +247,24 @@ struct async_fiber_context {
         fiber_id(fiber_id), socket_fd(socket_fd),
         in_addr(in_addr) {}
 
-  inline void yield() { sink = sink.resume(); }
+  // True once the peer closed the connection or an error occurred on the socket.
+  // Child fibers also see their parent's connection closed when they are cancelled.
+  inline bool is_closed() const;
+
+  // Let the other fibers run. Return false if the connection is closed.
+  inline bool yield() {
+    sink = sink.resume();
+    return !is_closed();
+  }
+
+  // Suspend the fiber until something explicitly wakes it up: an event on one of its file
+  // descriptors, defer_fiber_resume, async_reactor::remote_fiber_resume or a timer.
+  // Unlike yield, a parked fiber is skipped when the reactor is idle so it does not use any CPU.
+  // park may return spuriously, callers have to check their wake up condition in a loop.
+  // Return false without waiting if the connection is closed.
+  inline bool park();
+  // Same as park, but also wake up the fiber at \deadline.
+  inline bool park_until(std::chrono::steady_clock::time_point deadline);
        
   inline bool ssl_handshake(std::unique_ptr<ssl_context>& ssl_ctx) {
     if (!ssl_ctx) return false;
@@ -134,9 +276,10 @@ struct async_fiber_context {
       if (ret == 1) return true;
 
       int err = SSL_get_error(ssl, ret);
-      if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ)
-        this->yield();
-      else
+      if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ) {
+        if (!this->yield())
+          return false;
+      } else
       {
         ERR_print_errors_fp(stderr);
         return false;
@@ -164,47 +307,102 @@ struct async_fiber_context {
   inline int read_impl(char* buf, int size) {
     if (ssl)
       return SSL_read(ssl, buf, size);
+    else if (memory)
+      return memory->read(buf, size);
     else
       return ::recv(socket_fd, buf, size, 0);
   }
-  inline int write_impl(const char* buf, int size) {
+  inline int write_impl(const char* buf, int size, int flags = 0) {
     if (ssl)
       return SSL_write(ssl, buf, size);
+    else if (memory)
+      return memory->write(buf, size);
     else
-      return ::send(socket_fd, buf, size, 0);
+      return ::send(socket_fd, buf, size, flags);
+  }
+
+  // Read without waiting. Return -1 if no data is available, 0 if the connection is closed.
+  inline int read_nowait(char* buf, int max_size) {
+    if (is_closed())
+      return 0;
+    ssize_t count = read_impl(buf, max_size);
+    if (count < 0 and errno == EAGAIN)
+      return -1;
+    return count < 0 ? 0 : count;
   }
 
   inline int read(char* buf, int max_size) {
+    if (is_closed())
+      return 0;
     ssize_t count = read_impl(buf, max_size);
     while (count <= 0) {
       if ((count < 0 and errno != EAGAIN) or count == 0)
         return ssize_t(0);
-      sink = sink.resume();
+      if (!yield())
+        return 0;
       count = read_impl(buf, max_size);
     }
     return count;
   };
 
-  inline bool write(const char* buf, int size) {
-    if (!buf or !size) {
-      // std::cout << "pause" << std::endl;
-      sink = sink.resume();
-      return true;
-    }
+  // \flags are passed to send, for example impl::send_more_flag when more data follows.
+  inline bool write(const char* buf, int size, int flags = 0) {
+    if (!buf or !size)
+      return yield();
+    if (is_closed())
+      return false;
     const char* end = buf + size;
-    ssize_t count = write_impl(buf, end - buf);
+    ssize_t count = write_impl(buf, end - buf, flags);
     if (count > 0)
       buf += count;
     while (buf != end) {
       if ((count < 0 and errno != EAGAIN) or count == 0)
         return false;
-      sink = sink.resume();
-      count = write_impl(buf, end - buf);
+      if (!yield())
+        return false;
+      count = write_impl(buf, end - buf, flags);
       if (count > 0)
         buf += count;
     }
     return true;
   };
+
+  // Write several buffers with one sendmsg syscall (more if the socket buffer is full).
+  // iov is modified to track partial writes.
+  inline bool writev(iovec* iov, int iovcnt, int flags = 0) {
+    if (ssl or memory) {
+      for (int i = 0; i < iovcnt; i++)
+        if (iov[i].iov_len and !write((const char*)iov[i].iov_base, iov[i].iov_len))
+          return false;
+      return true;
+    }
+
+    if (is_closed())
+      return false;
+    while (iovcnt > 0) {
+      msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = iov;
+      msg.msg_iovlen = iovcnt;
+      ssize_t count = ::sendmsg(socket_fd, &msg, flags);
+      if (count < 0) {
+        if (errno != EAGAIN or !yield())
+          return false;
+        continue;
+      }
+      // Skip what was sent.
+      while (iovcnt > 0 and size_t(count) >= iov->iov_len) {
+        count -= iov->iov_len;
+        iov++;
+        iovcnt--;
+      }
+      if (iovcnt > 0) {
+        iov->iov_base = (char*)iov->iov_base + count;
+        iov->iov_len -= count;
+      }
+    }
+    return true;
+  }
 };
 
 struct async_reactor {
@@ -212,12 +410,184 @@ struct async_reactor {
   typedef boost::context::continuation continuation;
 
   int epoll_fd;
-  std::vector<continuation> fibers;
+  // A deque so that fibers spawned from another fiber do not move the running ones.
+  std::deque<continuation> fibers;
+  int next_fiber_idx = 0;
+  // Stacks of the fibers created by spawn.
+  boost::context::pooled_fixedsize_stack child_stacks;
+  // Slots that look free during spawn: the running parent and the child until its first
+  // yield do not have their continuation in fibers.
+  std::vector<int> spawning_slots;
   std::vector<int> fd_to_fiber_idx;
+  // closed_fds[fd] is set when the peer closed fd or an error occurred on it.
+  std::vector<char> closed_fds;
   std::unique_ptr<ssl_context> ssl_ctx = nullptr;
+  tcp_server_options options;
+  // When epoll_wait last returned, and an estimate of when its events arrived: when it
+  // returned without waiting, the events arrived while the previous ones were processed.
+  std::chrono::steady_clock::time_point loop_time;
+  std::chrono::steady_clock::time_point ready_time;
   std::vector<std::function<void()>> defered_functions;
   std::deque<int> defered_resume;
 
+  // parked_fibers[i] is set while fiber i waits in async_fiber_context::park.
+  std::vector<char> parked_fibers;
+
+  // Timers: fiber ids to resume, ordered by deadline. timer_ids[i] identifies the pending
+  // timer of fiber i (0 if none): the entries of a park_until that returned before its
+  // deadline are stale, they are skipped, and dropped when they make up most of the heap.
+  typedef std::tuple<std::chrono::steady_clock::time_point, int, uint64_t> timer_entry;
+  std::priority_queue<timer_entry, std::vector<timer_entry>, std::greater<timer_entry>> timers;
+  std::vector<uint64_t> timer_ids;
+  uint64_t timer_counter = 0;
+  int stale_timers = 0;
+
+  // Fibers to resume on behalf of other threads. See remote_fiber_resume.
+  int wakeup_fd_read = -1;
+  int wakeup_fd_write = -1;
+  std::mutex remote_resume_mutex;
+  std::vector<int> remote_resume;
+  std::vector<int> remote_resume_batch;
+
+  inline void resume_fiber(int fiber_id) {
+    if (fiber_id < 0 or fiber_id >= int(fibers.size()))
+      return;
+    auto& fiber = fibers[fiber_id];
+    if (fiber)
+      fiber = fiber.resume();
+  }
+
+  // Thread safe: resume fiber \fiber_id from any thread.
+  // Wakeups are batched, only the first one after the reactor drained the queue
+  // writes to the wakeup file descriptor.
+  inline void remote_fiber_resume(int fiber_id) {
+    bool was_empty;
+    {
+      std::lock_guard<std::mutex> lock(remote_resume_mutex);
+      was_empty = remote_resume.empty();
+      remote_resume.push_back(fiber_id);
+    }
+    if (was_empty) {
+      uint64_t one = 1;
+      if (-1 == ::write(wakeup_fd_write, &one, sizeof(one)) and errno != EAGAIN)
+        std::cerr << "remote_fiber_resume: cannot write the wakeup fd: " << strerror(errno)
+                  << std::endl;
+    }
+  }
+
+  inline void create_wakeup_fd() {
+#if __linux__
+    wakeup_fd_read = wakeup_fd_write = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    epoll_ctl(epoll_fd, wakeup_fd_read, EPOLL_CTL_ADD, EPOLLIN | EPOLLET);
+#elif __APPLE__
+    int fds[2];
+    if (0 == pipe(fds)) {
+      wakeup_fd_read = fds[0];
+      wakeup_fd_write = fds[1];
+      for (int fd : fds)
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+      epoll_ctl(epoll_fd, wakeup_fd_read, EV_ADD, EVFILT_READ);
+    }
+#endif
+  }
+
+  inline void close_wakeup_fd() {
+    if (wakeup_fd_write != wakeup_fd_read)
+      close(wakeup_fd_write);
+    close(wakeup_fd_read);
+  }
+
+  // Called when wakeup_fd_read is readable: resume the fibers queued by remote_fiber_resume.
+  inline void process_remote_resume() {
+    char buf[64];
+    while (::read(wakeup_fd_read, buf, sizeof(buf)) > 0)
+      ;
+    {
+      std::lock_guard<std::mutex> lock(remote_resume_mutex);
+      std::swap(remote_resume, remote_resume_batch);
+    }
+    for (int fiber_id : remote_resume_batch)
+      resume_fiber(fiber_id);
+    remote_resume_batch.clear();
+  }
+
+  inline void process_timers() {
+    if (timers.empty())
+      return;
+    auto now = std::chrono::steady_clock::now();
+    while (!timers.empty() and std::get<0>(timers.top()) <= now) {
+      auto [deadline, fiber_id, id] = timers.top();
+      timers.pop();
+      if (timer_ids[fiber_id] == id) {
+        timer_ids[fiber_id] = 0;
+        resume_fiber(fiber_id);
+      } else
+        stale_timers--;
+    }
+  }
+
+  // A park_until returned before its deadline.
+  inline void cancel_timer(int fiber_id) {
+    timer_ids[fiber_id] = 0;
+    if (++stale_timers < 64 or stale_timers * 2 < int(timers.size()))
+      return;
+    std::vector<timer_entry> live;
+    for (; !timers.empty(); timers.pop())
+      if (timer_ids[std::get<1>(timers.top())] == std::get<2>(timers.top()))
+        live.push_back(timers.top());
+    timers = decltype(timers)(std::greater<timer_entry>(), std::move(live));
+    stale_timers = 0;
+  }
+
+  inline void process_defered_resume() {
+    while (defered_resume.size()) {
+      int fiber_id = defered_resume.front();
+      defered_resume.pop_front();
+      assert(fiber_id < fibers.size());
+      resume_fiber(fiber_id);
+    }
+  }
+
+  // Index of a free slot in fibers.
+  inline int allocate_fiber_slot() {
+    int n = fibers.size();
+    for (int i = 0; i < n; i++) {
+      int fiber_idx = (next_fiber_idx + i) % n;
+      if (!fibers[fiber_idx] and std::find(spawning_slots.begin(), spawning_slots.end(),
+                                           fiber_idx) == spawning_slots.end()) {
+        next_fiber_idx = fiber_idx + 1;
+        parked_fibers[fiber_idx] = 0;
+        return fiber_idx;
+      }
+    }
+    fibers.resize((n + 1) * 2);
+    parked_fibers.resize(fibers.size(), 0);
+    timer_ids.resize(fibers.size(), 0);
+    next_fiber_idx = n + 1;
+    return n;
+  }
+
+  // Start a child fiber running \f(child_fiber_context) on this reactor.
+  // The child shares the socket of \parent, only to see it closed: it must not read or
+  // write it. It runs until its first yield before spawn returns its fiber id.
+  template <typename F> int spawn(async_fiber_context& parent, F f) {
+    spawning_slots.push_back(parent.fiber_id);
+    int fiber_idx = allocate_fiber_slot();
+    spawning_slots.push_back(fiber_idx);
+    int socket_fd = parent.socket_fd;
+    sockaddr in_addr = parent.in_addr;
+    continuation child = boost::context::callcc(
+        std::allocator_arg, child_stacks,
+        [this, socket_fd, fiber_idx, in_addr, f = std::move(f)](continuation&& sink) mutable {
+          auto ctx = async_fiber_context(this, std::move(sink), fiber_idx, socket_fd, in_addr);
+          f(ctx);
+          return std::move(ctx.sink);
+        });
+    spawning_slots.resize(spawning_slots.size() - 2);
+    fibers[fiber_idx] = std::move(child);
+    return fiber_idx;
+  }
+
   inline continuation& fd_to_fiber(int fd) {
     assert(fd >= 0 and fd < fd_to_fiber_idx.size());
     int fiber_idx = fd_to_fiber_idx[fd];
@@ -258,9 +628,12 @@ struct async_reactor {
     #endif
 
     // Associate new_fd to the fiber.
-    if (int(fd_to_fiber_idx.size()) < new_fd + 1)
+    if (int(fd_to_fiber_idx.size()) < new_fd + 1) {
       fd_to_fiber_idx.resize((new_fd + 1) * 2, -1);
+      closed_fds.resize(fd_to_fiber_idx.size(), 0);
+    }
     fd_to_fiber_idx[new_fd] = fiber_idx;
+    closed_fds[new_fd] = 0;
   }
 
   inline void epoll_mod(int fd, int flags) { 
@@ -278,6 +651,7 @@ struct async_reactor {
 #if __linux__
     this->epoll_fd = epoll_create1(0);
     epoll_ctl(epoll_fd, listen_fd, EPOLL_CTL_ADD, EPOLLIN | EPOLLET);
+    create_wakeup_fd();
     epoll_event events[MAXEVENTS];
 
 #elif __APPLE__
@@ -286,6 +660,7 @@ struct async_reactor {
     epoll_ctl(this->epoll_fd, SIGINT, EV_ADD, EVFILT_SIGNAL);
     epoll_ctl(this->epoll_fd, SIGKILL, EV_ADD, EVFILT_SIGNAL);
     epoll_ctl(this->epoll_fd, SIGTERM, EV_ADD, EVFILT_SIGNAL);
+    create_wakeup_fd();
     struct kevent events[MAXEVENTS];
 
     struct timespec timeout;
@@ -294,24 +669,42 @@ struct async_reactor {
 #endif
 
 
+    impl::busy_poll_clock busy_poll(options.busy_poll_us);
+    auto last_idle_resume = std::chrono::steady_clock::now();
+
     // Main loop.
     while (!quit_signal_catched) {
 
+      auto wait_start = std::chrono::steady_clock::now();
 #if __linux__
       // Wakeup to check if any quit signal has been catched.
-      int n_events = epoll_wait(epoll_fd, events, MAXEVENTS, 1);
+      int epoll_timeout = busy_poll.timeout();
+      int n_events = epoll_wait(epoll_fd, events, MAXEVENTS, epoll_timeout);
 #elif __APPLE__
       // kevent is already listening to quit signals.
+      int epoll_timeout = 1;
       int n_events = kevent(epoll_fd, NULL, 0, events, MAXEVENTS, &timeout);
 #endif
 
       if (quit_signal_catched)
         break;
 
-      if (n_events == 0 )
+      auto previous_loop_time = loop_time;
+      loop_time = std::chrono::steady_clock::now();
+      ready_time = loop_time - wait_start < std::chrono::microseconds(100) ? previous_loop_time
+                                                                          : loop_time;
+      if (n_events > 0)
+        busy_poll.on_events();
+
+      // Resume the yielding fibers when idle, at most every millisecond while spinning.
+      if (n_events == 0 and
+          (epoll_timeout != 0 or
+           std::chrono::steady_clock::now() - last_idle_resume >= std::chrono::milliseconds(1))) {
+        last_idle_resume = std::chrono::steady_clock::now();
         for (int i = 0; i < fibers.size(); i++)
-          if (fibers[i])
+          if (fibers[i] and !parked_fibers[i])
             fibers[i] = fibers[i].resume();
+      }
 
       for (int i = 0; i < n_events; i++) {
 
@@ -335,6 +728,13 @@ struct async_reactor {
 #endif
 
 
+        // Wakeups from other threads.
+        if (event_fd == wakeup_fd_read) {
+          process_remote_resume();
+          process_defered_resume();
+          continue;
+        }
+
         // Handle errors on sockets.
 #if __linux__
         if (event_flags & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
@@ -345,12 +745,12 @@ struct async_reactor {
             std::cout << "FATAL ERROR: Error on server socket " << event_fd << std::endl;
             quit_signal_catched = true;
           } else {
+            // Mark the fd closed and let the fiber see it in the return value of its
+            // next I/O call.
+            closed_fds[event_fd] = 1;
             continuation& fiber = fd_to_fiber(event_fd);
             if (fiber)
-              fiber = fiber.resume_with(std::move([](auto&& sink) {
-                throw fiber_exception(std::move(sink), "EPOLLRDHUP");
-                return std::move(sink);
-              }));
+              fiber = fiber.resume();
           }
         }
         // Handle new connections.
@@ -370,18 +770,14 @@ struct async_reactor {
 
             // ============================================
             // Find a free fiber for this new connection.
-            int fiber_idx = 0;
-            while (fiber_idx < fibers.size() && fibers[fiber_idx])
-              fiber_idx++;
-            if (fiber_idx >= fibers.size())
-              fibers.resize((fibers.size() + 1) * 2);
-            assert(fiber_idx < fibers.size());
+            int fiber_idx = allocate_fiber_slot();
             // ============================================
 
             // ============================================
             // Subscribe epoll to the socket file descriptor.
             if (-1 == fcntl(socket_fd, F_SETFL, fcntl(socket_fd, F_GETFL, 0) | O_NONBLOCK))
               continue;
+            impl::configure_accepted_socket(socket_fd, options);
 #if __linux__
             this->epoll_add(socket_fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, fiber_idx);
 #elif __APPLE__
@@ -415,8 +811,6 @@ struct async_reactor {
                   return std::move(ctx.sink);
                 }
                 handler(ctx);
-              } catch (fiber_exception& ex) {
-                return std::move(ex.c);
               } catch (const std::runtime_error& e) {
                 std::cerr << "FATAL ERRROR: exception in fiber: " << e.what() << std::endl;
                 assert(0);
@@ -439,22 +833,13 @@ struct async_reactor {
         }
 
         // Wakeup fibers if needed.
-        while (defered_resume.size())
-        {
-          int fiber_id = defered_resume.front();
-          defered_resume.pop_front();
-          assert(fiber_id < fibers.size());
-          auto& fiber = fibers[fiber_id];
-          if (fiber)
-          {
-            // std::cout << "wakeup " << fiber_id << std::endl; 
-            fiber = fiber.resume();
-          }
-        }
-
-
+        process_defered_resume();
       }
 
+      // Wakeup fibers whose timer expired, and the fibers they woke up.
+      process_timers();
+      process_defered_resume();
+
       // Call and Flush the defered functions.
       if (defered_functions.size())
       {
@@ -465,6 +850,7 @@ struct async_reactor {
 
     }
     std::cout << "END OF EVENT LOOP" << std::endl;
+    close_wakeup_fd();
     close(epoll_fd);
   }
 };
@@ -474,6 +860,17 @@ static void shutdown_handler(int sig) {
   std::cout << "The server will shutdown..." << std::endl;
 }
 
+// Stop the event loops on SIGINT, SIGTERM and SIGQUIT.
+inline void install_shutdown_handler() {
+  struct sigaction act;
+  memset(&act, 0, sizeof(act));
+  act.sa_handler = shutdown_handler;
+
+  sigaction(SIGINT, &act, 0);
+  sigaction(SIGTERM, &act, 0);
+  sigaction(SIGQUIT, &act, 0);
+}
+
 void async_fiber_context::epoll_add(int fd, int flags) {
   reactor->epoll_add(fd, flags, fiber_id);
 }
@@ -489,6 +886,31 @@ void async_fiber_context::defer_fiber_resume(int fiber_id)
   this->reactor->defered_resume.push_back(fiber_id);
 }
 
+bool async_fiber_context::is_closed() const {
+  return reactor->closed_fds[socket_fd] or (cancelled and *cancelled);
+}
+
+bool async_fiber_context::park() {
+  if (is_closed())
+    return false;
+  reactor->parked_fibers[fiber_id] = 1;
+  this->yield();
+  reactor->parked_fibers[fiber_id] = 0;
+  return !is_closed();
+}
+
+bool async_fiber_context::park_until(std::chrono::steady_clock::time_point deadline) {
+  if (is_closed())
+    return false;
+  uint64_t id = ++reactor->timer_counter;
+  reactor->timer_ids[fiber_id] = id;
+  reactor->timers.emplace(deadline, fiber_id, id);
+  bool open = this->park();
+  if (reactor->timer_ids[fiber_id] == id)
+    reactor->cancel_timer(fiber_id);
+  return open;
+}
+
 void async_fiber_context::reassign_fd_to_this_fiber(int fd) {
   this->reactor->reassign_fd_to_fiber(fd, this->fiber_id);
 }
@@ -496,21 +918,17 @@ void async_fiber_context::reassign_fd_to_this_fiber(int fd) {
 template <typename H>
 void start_tcp_server(int port, int socktype, int nthreads, H conn_handler,
                       std::string ssl_key_path = "", std::string ssl_cert_path = "",
-                      std::string ssl_ciphers = "") {
+                      std::string ssl_ciphers = "",
+                      const tcp_server_options& options = tcp_server_options()) {
 
-  struct sigaction act;
-  memset(&act, 0, sizeof(act));
-  act.sa_handler = shutdown_handler;
-
-  sigaction(SIGINT, &act, 0);
-  sigaction(SIGTERM, &act, 0);
-  sigaction(SIGQUIT, &act, 0);
+  install_shutdown_handler();
 
-  int server_fd = impl::create_and_bind(port, socktype);
+  int server_fd = impl::create_and_bind(port, socktype, options);
   std::vector<std::thread> ths;
   for (int i = 0; i < nthreads; i++)
     ths.push_back(std::thread([&] {
       async_reactor reactor;
+      reactor.options = options;
       if (ssl_cert_path.size()) // Initialize the SSL/TLS context.
         reactor.ssl_ctx = std::make_unique<ssl_context>(ssl_key_path, ssl_cert_path, ssl_ciphers);
       reactor.event_loop(server_fd, conn_handler);
@@ -0,0 +1,195 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+
+namespace li {
+
+// One request of a traffic capture.
+struct traffic_record {
+  int64_t time;        // Nanoseconds since the start of the capture, when the headers arrived.
+  uint32_t connection; // Requests received on the same connection have the same id.
+  int status;          // Status of the response of the server.
+  std::string request; // Raw request: headers and body.
+};
+
+// Binary log of the requests received by http_serve, written by a background thread:
+//
+//   http_serve(api, 8080, s::capture = "traffic.bin");
+//
+// The file starts with traffic_capture::magic, followed by one record per request: time
+// (int64), connection (uint32), status (uint32), request size (uint32) in host byte
+// order, then the request bytes. Requests are dropped when more than \max_pending bytes
+// wait for the writer. See traffic_capture_reader and benchmarks/replay.cc.
+struct traffic_capture {
+
+  static constexpr const char* magic = "LITHIUM_CAPTURE_1\n";
+  static constexpr int record_header_size = 20;
+
+  inline traffic_capture(const std::string& path, size_t max_pending = 64 * 1024 * 1024)
+      : max_pending_(max_pending), start_(std::chrono::steady_clock::now()) {
+    file_ = fopen(path.c_str(), "wb");
+    if (!file_)
+      throw std::runtime_error("traffic_capture: cannot open " + path + ": " + strerror(errno));
+    fwrite(magic, 1, strlen(magic), file_);
+    writer_ = std::thread([this] { write_loop(); });
+  }
+
+  traffic_capture(const traffic_capture&) = delete;
+  traffic_capture& operator=(const traffic_capture&) = delete;
+
+  // Write the pending requests and close the file.
+  inline ~traffic_capture() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    wakeup_.notify_one();
+    writer_.join();
+    fclose(file_);
+  }
+
+  // Id of a new connection.
+  inline uint32_t new_connection() { return next_connection_++; }
+
+  // Add a request. Called by the server threads.
+  inline void record(uint32_t connection, std::chrono::steady_clock::time_point arrival,
+                     int status, std::string_view headers, std::string_view body) {
+    int64_t time =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(arrival - start_).count();
+    uint32_t size = headers.size() + body.size();
+    uint32_t status32 = status;
+    char header[record_header_size];
+    memcpy(header, &time, 8);
+    memcpy(header + 8, &connection, 4);
+    memcpy(header + 12, &status32, 4);
+    memcpy(header + 16, &size, 4);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (pending_.size() + sizeof(header) + size > max_pending_) {
+      dropped_++;
+      return;
+    }
+    pending_.append(header, sizeof(header));
+    pending_.append(headers);
+    pending_.append(body);
+    recorded_++;
+  }
+
+  // Block until the requests recorded so far are written to the file.
+  inline void flush() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    long long target = recorded_;
+    flush_requested_ = true;
+    wakeup_.notify_one();
+    flushed_.wait(lock, [&] { return written_ >= target; });
+  }
+
+  inline long long recorded() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return recorded_;
+  }
+  inline long long dropped() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return dropped_;
+  }
+
+private:
+  inline void write_loop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      wakeup_.wait_for(lock, std::chrono::milliseconds(100),
+                       [&] { return stop_ or flush_requested_; });
+      bool stop = stop_;
+      flush_requested_ = false;
+      long long batch_end = recorded_;
+      std::swap(pending_, writing_);
+      lock.unlock();
+
+      if (writing_.size()) {
+        fwrite(writing_.data(), 1, writing_.size(), file_);
+        fflush(file_);
+        writing_.clear();
+      }
+
+      lock.lock();
+      written_ = batch_end;
+      flushed_.notify_all();
+      if (stop)
+        return;
+    }
+  }
+
+  FILE* file_ = nullptr;
+  size_t max_pending_;
+  std::chrono::steady_clock::time_point start_;
+  std::atomic<uint32_t> next_connection_{0};
+
+  std::mutex mutex_;
+  std::condition_variable wakeup_;
+  std::condition_variable flushed_;
+  std::string pending_;
+  std::string writing_;
+  bool stop_ = false;
+  bool flush_requested_ = false;
+  long long recorded_ = 0;
+  long long written_ = 0;
+  long long dropped_ = 0;
+  std::thread writer_;
+};
+
+// Read the records of a file written by traffic_capture.
+//
+//   traffic_capture_reader reader("traffic.bin");
+//   traffic_record r;
+//   while (reader.next(r)) ...
+struct traffic_capture_reader {
+
+  inline traffic_capture_reader(const std::string& path) {
+    file_ = fopen(path.c_str(), "rb");
+    if (!file_)
+      throw std::runtime_error("traffic_capture_reader: cannot open " + path + ": " +
+                               strerror(errno));
+    size_t magic_size = strlen(traffic_capture::magic);
+    std::string magic(magic_size, 0);
+    if (fread(magic.data(), 1, magic_size, file_) != magic_size or
+        magic != traffic_capture::magic) {
+      fclose(file_);
+      throw std::runtime_error("traffic_capture_reader: " + path + " is not a traffic capture.");
+    }
+  }
+
+  traffic_capture_reader(const traffic_capture_reader&) = delete;
+  traffic_capture_reader& operator=(const traffic_capture_reader&) = delete;
+  inline ~traffic_capture_reader() { fclose(file_); }
+
+  // Read the next record in \r. Return false at the end of the file, or on a truncated
+  // record.
+  inline bool next(traffic_record& r) {
+    char header[traffic_capture::record_header_size];
+    if (fread(header, 1, sizeof(header), file_) != sizeof(header))
+      return false;
+    uint32_t status, size;
+    memcpy(&r.time, header, 8);
+    memcpy(&r.connection, header + 8, 4);
+    memcpy(&status, header + 12, 4);
+    memcpy(&size, header + 16, 4);
+    r.status = status;
+    r.request.resize(size);
+    return fread(r.request.data(), 1, size, file_) == size;
+  }
+
+private:
+  FILE* file_ = nullptr;
+};
+
+} // namespace li
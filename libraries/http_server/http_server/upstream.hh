@@ -0,0 +1,687 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <li/http_server/admission_control.hh>
+#include <li/http_server/error.hh>
+#include <li/http_server/request.hh>
+#include <li/http_server/response.hh>
+#include <li/http_server/symbols.hh>
+#include <li/http_server/tcp_server.hh>
+#include <li/metamap/metamap.hh>
+
+namespace li {
+
+enum class upstream_balancing { round_robin, least_outstanding, power_of_two_choices };
+
+namespace impl {
+
+#ifdef MSG_NOSIGNAL
+static constexpr int send_nosignal_flag = MSG_NOSIGNAL;
+#else
+static constexpr int send_nosignal_flag = 0;
+#endif
+
+inline bool header_equals(std::string_view a, std::string_view b) {
+  return a.size() == b.size() and 0 == strncasecmp(a.data(), b.data(), a.size());
+}
+
+// Headers that only concern one connection, not forwarded by proxies.
+inline bool is_hop_by_hop_header(std::string_view key) {
+  for (const char* h : {"Connection", "Keep-Alive", "Proxy-Connection", "Proxy-Authenticate",
+                        "Proxy-Authorization", "TE", "Trailer", "Transfer-Encoding", "Upgrade"})
+    if (header_equals(key, h))
+      return true;
+  return false;
+}
+
+// Incremental decoder of a chunked body (Transfer-Encoding: chunked).
+struct chunked_body_decoder {
+
+  // Decode \data, calling \on_data with the content of the chunks.
+  // Return the number of bytes used, less than data.size() if the body ends before.
+  template <typename F> size_t feed(std::string_view data, F on_data) {
+    const char* cur = data.data();
+    const char* end = cur + data.size();
+    while (cur < end and state != done) {
+      switch (state) {
+      case size_line: // Hexadecimal size, optional extensions, \r\n.
+        if (*cur == '\n') {
+          state = chunk_size ? chunk_data : trailer;
+          in_extension = false;
+        } else if (!in_extension) {
+          int digit = (*cur >= '0' and *cur <= '9')   ? *cur - '0'
+                      : (*cur >= 'a' and *cur <= 'f') ? *cur - 'a' + 10
+                      : (*cur >= 'A' and *cur <= 'F') ? *cur - 'A' + 10
+                                                      : -1;
+          if (digit >= 0)
+            chunk_size = chunk_size * 16 + digit;
+          else
+            in_extension = true;
+        }
+        cur++;
+        break;
+      case chunk_data: {
+        size_t n = std::min(chunk_size, size_t(end - cur));
+        on_data(std::string_view(cur, n));
+        cur += n;
+        chunk_size -= n;
+        if (!chunk_size)
+          state = chunk_end;
+        break;
+      }
+      case chunk_end: // \r\n after the data.
+        if (*cur++ == '\n')
+          state = size_line;
+        break;
+      case trailer: // Trailer lines, up to an empty line.
+        if (*cur == '\n') {
+          if (line_length == 0)
+            state = done;
+          line_length = 0;
+        } else if (*cur != '\r')
+          line_length++;
+        cur++;
+        break;
+      case done:
+        break;
+      }
+    }
+    return cur - data.data();
+  }
+
+  bool finished() const { return state == done; }
+
+  enum { size_line, chunk_data, chunk_end, trailer, done } state = size_line;
+  size_t chunk_size = 0;
+  bool in_extension = false;
+  int line_length = 0;
+};
+
+// Non blocking I/O on an upstream socket, from the fiber of a request.
+// The fiber parks while the socket is not ready. It gives up when nothing happened
+// during \timeout, or when the client closed its connection.
+struct upstream_io {
+  typedef std::chrono::steady_clock clock;
+
+  upstream_io(async_fiber_context& fiber, std::chrono::microseconds timeout)
+      : fiber(fiber), timeout(timeout), deadline(clock::now() + timeout) {}
+
+  void progress() { deadline = clock::now() + timeout; }
+
+  // Wait for an event on the sockets of the fiber.
+  bool wait() {
+    if (clock::now() >= deadline) {
+      timed_out = true;
+      return false;
+    }
+    return fiber.park_until(deadline);
+  }
+
+  bool send_all(int fd, const char* data, size_t size) {
+    while (size) {
+      ssize_t n = ::send(fd, data, size, send_nosignal_flag);
+      if (n > 0) {
+        data += n;
+        size -= n;
+        progress();
+      } else if (n == -1 and errno == EAGAIN) {
+        if (!wait())
+          return false;
+      } else
+        return false;
+    }
+    return true;
+  }
+
+  // Return the number of bytes read, 0 if the upstream closed the connection, -1 on error.
+  long recv_some(int fd, char* buf, size_t size) {
+    while (true) {
+      ssize_t n = ::recv(fd, buf, size, 0);
+      if (n >= 0) {
+        progress();
+        return n;
+      }
+      if (errno != EAGAIN or !wait())
+        return -1;
+    }
+  }
+
+#if __linux__
+  // Send \size bytes of \from to the client through \pipe_fds, without copying them in
+  // user space. On failure, the pipe may still contain data.
+  bool splice_all(int from, const int* pipe_fds, size_t size) {
+    size_t in_pipe = 0;
+    while (size or in_pipe) {
+      bool moved = false;
+      if (size) {
+        ssize_t n = ::splice(from, nullptr, pipe_fds[1], nullptr, size,
+                             SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == 0 or (n == -1 and errno != EAGAIN))
+          return false;
+        if (n > 0) {
+          size -= n;
+          in_pipe += n;
+          moved = true;
+        }
+      }
+      if (in_pipe) {
+        ssize_t n = ::splice(pipe_fds[0], nullptr, fiber.socket_fd, nullptr, in_pipe,
+                             SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == 0 or (n == -1 and errno != EAGAIN))
+          return false;
+        if (n > 0) {
+          in_pipe -= n;
+          moved = true;
+        }
+      }
+      if (moved)
+        progress();
+      else if (!wait())
+        return false;
+    }
+    return true;
+  }
+#endif
+
+  async_fiber_context& fiber;
+  std::chrono::microseconds timeout;
+  clock::time_point deadline;
+  bool timed_out = false;
+};
+
+// Open a non blocking connection to \addr, registered in the reactor of io.fiber.
+// Return -1 if the connection fails.
+inline int upstream_connect(upstream_io& io, const sockaddr* addr, socklen_t addr_len) {
+  int fd = ::socket(addr->sa_family, SOCK_STREAM, 0);
+  if (fd == -1)
+    return -1;
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+  impl::set_socket_option(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+  int ret = ::connect(fd, addr, addr_len);
+  if (ret == -1 and errno != EINPROGRESS) {
+    ::close(fd);
+    return -1;
+  }
+  // Registered after connect: epoll reports unconnected sockets as hung up.
+#if __linux__
+  io.fiber.epoll_add(fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+#elif __APPLE__
+  io.fiber.epoll_add(fd, EVFILT_READ | EVFILT_WRITE);
+#endif
+  if (ret == -1) {
+    pollfd p{fd, POLLOUT, 0};
+    while (::poll(&p, 1, 0) == 0)
+      if (!io.wait()) {
+        ::close(fd);
+        return -1;
+      }
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (-1 == getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) or err) {
+      ::close(fd);
+      return -1;
+    }
+  }
+  return fd;
+}
+
+} // namespace impl
+
+// Reverse proxy: forward requests to a set of upstream HTTP/1.1 servers.
+//
+//   upstream backends({"10.0.0.1:8080", "10.0.0.2:8080"},
+//                     s::balancing = upstream_balancing::least_outstanding);
+//   api.get("/search") = [&] (http_request& request, http_response& response) {
+//     backends.forward(request, response);
+//   };
+//
+// Each server thread keeps its own pools of keep-alive connections to the upstreams, used
+// without locks. The responses are streamed to the client as they arrive; on Linux, large
+// bodies of known size go from the upstream socket to the client socket with splice.
+//
+// Options:
+//   s::balancing: round_robin (default), least_outstanding (fewest requests in flight on this
+//                 thread) or power_of_two_choices (the least loaded of two random upstreams).
+//   s::max_idle_connections: idle connections kept per upstream and per thread (default 64).
+//   s::timeout: milliseconds without progress before giving up with a 504 (default 10000).
+//   s::retries: attempts on other upstreams after a connection failure (default 2).
+//               Requests that were sent are only retried if their method is idempotent.
+//
+// When no upstream answers, forward throws a 502 http_error. If the connection to the
+// upstream fails in the middle of the response, the client connection is closed.
+struct upstream {
+  typedef std::chrono::steady_clock clock;
+
+  template <typename... O> upstream(const std::vector<std::string>& backends, O... opts) {
+    auto options = mmm(opts...);
+    balancing = get_or(options, s::balancing, upstream_balancing::round_robin);
+    max_idle_connections = get_or(options, s::max_idle_connections, 64);
+    timeout = std::chrono::milliseconds(get_or(options, s::timeout, 10000));
+    retries = get_or(options, s::retries, 2);
+    for (const std::string& b : backends)
+      addresses.push_back(resolve(b));
+  }
+
+  upstream(const upstream&) = delete;
+
+  // Forward the request to an upstream and stream its response. \target replaces the url
+  // and query string of the request if it is not empty.
+  void forward(http_request& request, http_response& response,
+               std::string_view target = std::string_view()) {
+    auto& ctx = request.http_ctx;
+    shard& sh = *impl::thread_local_state<shard*>(thread_key, [this] { return add_shard(); });
+    sh.requests.fetch_add(1, std::memory_order_relaxed);
+
+    std::string_view method = ctx.method();
+    std::string_view body = ctx.read_whole_body();
+    arena_string message = make_request(request, target, body);
+    bool idempotent = method == "GET" or method == "HEAD" or method == "PUT" or
+                      method == "DELETE" or method == "OPTIONS" or method == "TRACE";
+
+    int failed = -1;
+    for (int attempt = 0;; attempt++) {
+      int b = pick(sh, failed);
+      sh.pools[b].outstanding++;
+      exchange_status status = exchange(request, sh, b, message, method == "HEAD");
+      sh.pools[b].outstanding--;
+
+      if (status == done or status == client_closed)
+        return;
+      sh.failures.fetch_add(1, std::memory_order_relaxed);
+      if (status == response_started) {
+        // The client already received a part of the response.
+        ::shutdown(request.fiber.socket_fd, SHUT_RDWR);
+        request.fiber.reactor->closed_fds[request.fiber.socket_fd] = 1;
+        return;
+      }
+      bool may_retry = status == connect_failed or (status == connection_lost and idempotent);
+      if (!may_retry or attempt >= retries) {
+        if (status == timed_out)
+          throw http_error::gateway_timeout("Upstream ", addresses[b].name, " timed out.");
+        throw http_error::bad_gateway("Upstream ", addresses[b].name, " failed.");
+      }
+      sh.retries.fetch_add(1, std::memory_order_relaxed);
+      failed = b;
+    }
+  }
+
+  auto stats() {
+    long long requests = 0, connections = 0, reused = 0, retries = 0, failures = 0;
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto& sh : shards) {
+      requests += sh->requests.load(std::memory_order_relaxed);
+      connections += sh->connections.load(std::memory_order_relaxed);
+      reused += sh->reused.load(std::memory_order_relaxed);
+      retries += sh->retries.load(std::memory_order_relaxed);
+      failures += sh->failures.load(std::memory_order_relaxed);
+    }
+    return mmm(s::requests = requests, s::connections = connections, s::reused = reused,
+               s::retries = retries, s::failures = failures);
+  }
+
+  upstream_balancing balancing;
+  int max_idle_connections;
+  std::chrono::microseconds timeout;
+  int retries;
+
+private:
+  // Bodies smaller than this are copied through the read buffer instead of spliced.
+  static constexpr size_t splice_threshold = 64 * 1024;
+  static constexpr size_t read_buffer_size = 16 * 1024;
+
+  enum exchange_status {
+    done,
+    connect_failed,  // Nothing was sent.
+    connection_lost, // The request may have been sent, no response was received.
+    timed_out,
+    invalid_response,
+    response_started, // The connection failed after the response headers were sent.
+    client_closed
+  };
+
+  struct address {
+    std::string name;
+    sockaddr_storage addr;
+    socklen_t addr_len;
+  };
+
+  struct pool {
+    std::vector<int> idle; // Keep-alive connections, the most recently used last.
+    int outstanding = 0;   // Requests in flight from this thread.
+  };
+
+  // State of one server thread.
+  struct shard {
+    ~shard() {
+      for (auto& p : pools)
+        for (int fd : p.idle)
+          ::close(fd);
+      close_pipe();
+    }
+
+    bool open_pipe() {
+#if __linux__
+      if (pipe_fds[0] == -1 and -1 == ::pipe2(pipe_fds, O_NONBLOCK | O_CLOEXEC))
+        pipe_fds[0] = pipe_fds[1] = -1;
+#endif
+      return pipe_fds[0] != -1;
+    }
+    void close_pipe() {
+      if (pipe_fds[0] != -1) {
+        ::close(pipe_fds[0]);
+        ::close(pipe_fds[1]);
+      }
+      pipe_fds[0] = pipe_fds[1] = -1;
+    }
+
+    std::vector<pool> pools;
+    unsigned next = 0;
+    uint32_t random_state = 2463534242u;
+    int pipe_fds[2] = {-1, -1};
+    std::atomic<long long> requests = 0;
+    std::atomic<long long> connections = 0;
+    std::atomic<long long> reused = 0;
+    std::atomic<long long> retries = 0;
+    std::atomic<long long> failures = 0;
+  };
+
+  // Closes the upstream connection unless it goes back to the pool.
+  struct connection_guard {
+    int fd;
+    ~connection_guard() {
+      if (fd != -1)
+        ::close(fd);
+    }
+  };
+
+  static address resolve(const std::string& name) {
+    size_t colon = name.rfind(':');
+    if (colon == std::string::npos)
+      throw std::runtime_error("upstream: " + name + " is not a host:port address.");
+    std::string host = name.substr(0, colon);
+    std::string port = name.substr(colon + 1);
+
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* result;
+    if (int err = getaddrinfo(host.c_str(), port.c_str(), &hints, &result))
+      throw std::runtime_error("upstream: cannot resolve " + name + ": " + gai_strerror(err));
+    address a;
+    a.name = name;
+    memcpy(&a.addr, result->ai_addr, result->ai_addrlen);
+    a.addr_len = result->ai_addrlen;
+    freeaddrinfo(result);
+    return a;
+  }
+
+  shard* add_shard() {
+    std::lock_guard<std::mutex> lock(mutex);
+    shards.emplace_back(new shard);
+    shards.back()->pools.resize(addresses.size());
+    shards.back()->random_state += shards.size();
+    return shards.back().get();
+  }
+
+  // Choose an upstream, other than \failed if possible.
+  int pick(shard& sh, int failed) {
+    int n = addresses.size();
+    if (n == 1)
+      return 0;
+    int b = 0;
+    switch (balancing) {
+    case upstream_balancing::round_robin:
+      b = sh.next++ % n;
+      break;
+    case upstream_balancing::least_outstanding: {
+      int start = sh.next++ % n;
+      b = -1;
+      for (int i = 0; i < n; i++) {
+        int c = (start + i) % n;
+        if (c != failed and (b == -1 or sh.pools[c].outstanding < sh.pools[b].outstanding))
+          b = c;
+      }
+      break;
+    }
+    case upstream_balancing::power_of_two_choices: {
+      int first = next_random(sh) % n;
+      int second = next_random(sh) % (n - 1);
+      if (second >= first)
+        second++;
+      b = sh.pools[first].outstanding <= sh.pools[second].outstanding ? first : second;
+      break;
+    }
+    }
+    return b == failed ? (b + 1) % n : b;
+  }
+
+  static uint32_t next_random(shard& sh) {
+    uint32_t x = sh.random_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return sh.random_state = x;
+  }
+
+  // Serialize the request to send upstream.
+  arena_string make_request(http_request& request, std::string_view target,
+                            std::string_view body) {
+    auto& ctx = request.http_ctx;
+    if (target.empty()) {
+      std::string_view url = ctx.url();
+      std::string_view query = ctx.get_parameters_string();
+      target = query.size() ? std::string_view(url.data(), query.data() + query.size() - url.data())
+                            : url;
+    }
+
+    arena_string message(request.arena());
+    message.reserve(1024 + body.size());
+    message.append(ctx.method()).append(" ").append(target).append(" HTTP/1.1\r\n");
+    std::string_view forwarded_for;
+    for (int i = 1; i + 1 < int(ctx.header_lines.size()); i++) {
+      std::string_view line(ctx.header_lines[i], ctx.header_lines[i + 1] - ctx.header_lines[i]);
+      std::string_view key = line.substr(0, line.find(':'));
+      if (impl::header_equals(key, "X-Forwarded-For")) {
+        forwarded_for = line.substr(key.size() + 1);
+        while (forwarded_for.size() and forwarded_for[0] == ' ')
+          forwarded_for.remove_prefix(1);
+        while (forwarded_for.size() and isspace(forwarded_for.back()))
+          forwarded_for.remove_suffix(1);
+        continue;
+      }
+      if (impl::is_hop_by_hop_header(key) or impl::header_equals(key, "Content-Length") or
+          impl::header_equals(key, "Expect"))
+        continue;
+      message.append(line);
+    }
+    message.append("X-Forwarded-For: ");
+    if (forwarded_for.size())
+      message.append(forwarded_for).append(", ");
+    message.append(request.ip_address()).append("\r\n");
+    if (body.size() or ctx.method() == "POST" or ctx.method() == "PUT")
+      message.append("Content-Length: ").append(std::to_string(body.size())).append("\r\n");
+    message.append("\r\n").append(body);
+    return message;
+  }
+
+  // An idle connection to upstream \b, or a new one. -1 if the connection fails.
+  int take_connection(shard& sh, int b, impl::upstream_io& io) {
+    auto& idle = sh.pools[b].idle;
+    auto* reactor = io.fiber.reactor;
+    while (!idle.empty()) {
+      int fd = idle.back();
+      idle.pop_back();
+      if (reactor->closed_fds[fd]) { // Closed by the upstream while idle.
+        ::close(fd);
+        continue;
+      }
+      io.fiber.reassign_fd_to_this_fiber(fd);
+      sh.reused.fetch_add(1, std::memory_order_relaxed);
+      return fd;
+    }
+    const address& a = addresses[b];
+    int fd = impl::upstream_connect(io, (const sockaddr*)&a.addr, a.addr_len);
+    if (fd == -1)
+      return -1;
+    sh.connections.fetch_add(1, std::memory_order_relaxed);
+    return fd;
+  }
+
+  // Send the request to upstream \b and stream back its response.
+  exchange_status exchange(http_request& request, shard& sh, int b, std::string_view message,
+                           bool head) {
+    auto& ctx = request.http_ctx;
+    auto& fiber = request.fiber;
+    impl::upstream_io io(fiber, timeout);
+    auto failure = [&](exchange_status status) {
+      return io.timed_out ? timed_out : fiber.is_closed() ? client_closed : status;
+    };
+
+    connection_guard connection{take_connection(sh, b, io)};
+    int fd = connection.fd;
+    if (fd == -1)
+      return failure(connect_failed);
+    if (!io.send_all(fd, message.data(), message.size()))
+      return failure(connection_lost);
+
+    // Read the status line and the headers.
+    char* buf = (char*)request.arena().allocate(read_buffer_size, 1);
+    size_t filled = 0;
+    const char* headers_end = nullptr;
+    while (!headers_end) {
+      if (filled == read_buffer_size)
+        return invalid_response;
+      long n = io.recv_some(fd, buf + filled, read_buffer_size - filled);
+      if (n <= 0)
+        return failure(connection_lost);
+      size_t search_start = filled < 3 ? 0 : filled - 3;
+      filled += n;
+      std::string_view received(buf + search_start, filled - search_start);
+      size_t pos = received.find("\r\n\r\n");
+      if (pos != std::string_view::npos)
+        headers_end = received.data() + pos + 4;
+    }
+
+    std::string_view headers(buf, headers_end - buf);
+    if (headers.size() < 12 or headers.substr(0, 7) != "HTTP/1.")
+      return invalid_response;
+    bool keep_alive = headers[7] == '1';
+    int status = atoi(headers.data() + 9);
+    size_t line_end = headers.find('\r');
+    ctx.set_status(status, headers.substr(9, line_end - 9));
+
+    long long content_length = -1;
+    bool chunked = false;
+    size_t cur = line_end + 2;
+    while (cur + 2 < headers.size()) {
+      size_t end = headers.find("\r\n", cur);
+      std::string_view line = headers.substr(cur, end - cur);
+      cur = end + 2;
+      size_t colon = line.find(':');
+      if (colon == std::string_view::npos)
+        continue;
+      std::string_view key = line.substr(0, colon);
+      std::string_view value = line.substr(colon + 1);
+      while (value.size() and value[0] == ' ')
+        value.remove_prefix(1);
+
+      if (impl::header_equals(key, "Content-Length"))
+        content_length = atoll(std::string(value).c_str());
+      else if (impl::header_equals(key, "Transfer-Encoding"))
+        chunked = value.find("chunked") != std::string_view::npos;
+      else if (impl::header_equals(key, "Connection") and impl::header_equals(value, "close"))
+        keep_alive = false;
+      // Date and Server are set by this server.
+      if (!impl::is_hop_by_hop_header(key) and !impl::header_equals(key, "Content-Length") and
+          !impl::header_equals(key, "Date") and !impl::header_equals(key, "Server"))
+        ctx.set_header(key, value);
+    }
+
+    std::string_view buffered(headers_end, buf + filled - headers_end);
+    bool reusable = keep_alive;
+    if (head or status == 204 or status == 304 or status < 200) {
+      ctx.start_response(content_length > 0 ? content_length : 0);
+      reusable = reusable and buffered.empty();
+    } else if (chunked) {
+      ctx.start_chunked_response();
+      impl::chunked_body_decoder decoder;
+      auto on_data = [&](std::string_view data) { ctx.write_chunk(data); };
+      size_t used = decoder.feed(buffered, on_data);
+      size_t received = buffered.size();
+      while (!decoder.finished()) {
+        if (fiber.is_closed())
+          return client_closed;
+        long n = io.recv_some(fd, buf, read_buffer_size);
+        if (n <= 0)
+          return failure(response_started);
+        used = decoder.feed(std::string_view(buf, n), on_data);
+        received = n;
+      }
+      reusable = reusable and used == received;
+    } else if (content_length >= 0) {
+      ctx.start_response(content_length);
+      size_t first = std::min<size_t>(buffered.size(), content_length);
+      ctx.write_body(buffered.substr(0, first));
+      reusable = reusable and first == buffered.size();
+      size_t remaining = content_length - first;
+#if __linux__
+      if (remaining >= splice_threshold and !fiber.ssl and sh.open_pipe()) {
+        if (!io.splice_all(fd, sh.pipe_fds, remaining)) {
+          sh.close_pipe(); // It may still contain a part of the body.
+          return failure(response_started);
+        }
+        remaining = 0;
+      }
+#endif
+      while (remaining) {
+        long n = io.recv_some(fd, buf, std::min(remaining, read_buffer_size));
+        if (n <= 0)
+          return failure(response_started);
+        if (!fiber.write(buf, n))
+          return client_closed;
+        remaining -= n;
+      }
+    } else {
+      // The body ends when the upstream closes the connection.
+      reusable = false;
+      ctx.start_chunked_response();
+      ctx.write_chunk(buffered);
+      long n;
+      while ((n = io.recv_some(fd, buf, read_buffer_size)) > 0)
+        ctx.write_chunk(std::string_view(buf, n));
+      if (n < 0)
+        return failure(response_started);
+    }
+
+    if (reusable and int(sh.pools[b].idle.size()) < max_idle_connections) {
+      sh.pools[b].idle.push_back(fd);
+      connection.fd = -1;
+    }
+    return done;
+  }
+
+  std::vector<address> addresses;
+  std::mutex mutex; // Protects shards.
+  std::vector<std::unique_ptr<shard>> shards;
+  impl::thread_local_key thread_key; // Finds the shard of the current thread.
+};
+
+} // namespace li
@@ -1,8 +1,14 @@
-#include <map>
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bitset>
+#include <charconv>
+#include <cstdint>
 #include <optional>
-#include <set>
 #include <string>
 #include <string_view>
+#include <utility>
 #include <vector>
 
 #if defined(_MSC_VER)
@@ -10,208 +16,365 @@
 #endif
 
 #include <boost/lexical_cast.hpp>
+#include <li/http_server/arena.hh>
 #include <li/http_server/error.hh>
 #include <li/http_server/symbols.hh>
 #include <li/metamap/metamap.hh>
 
 namespace li {
-// Decode a plain value.
-template <typename O>
-std::string_view url_decode2(std::set<void*>& found, std::string_view str, O& obj) {
-  if (str.size() == 0)
-    throw std::runtime_error(format_error("url_decode error: expected key end"));
-
-  if (str[0] != '=')
-    throw std::runtime_error(format_error("url_decode error: expected =, got ", str[0]));
-
-  int start = 1;
-  int end = 1;
-
-  while (str.size() != end && str[end] != '&')
-    end++;
-
-  if (start != end) {
-    std::string content(str.substr(start, end - start));
-    // Url escape.
-    //content.resize(MHD_http_unescape(&content[0]));
-    if constexpr(std::is_same<std::remove_reference_t<decltype(obj)>, std::string>::value or
-                std::is_same<std::remove_reference_t<decltype(obj)>, std::string_view>::value)
-      obj = content;
-    else
-      obj = boost::lexical_cast<O>(content);
-    found.insert(&obj);
+
+namespace internal {
+// std::string, or a string with another allocator like arena_string.
+template <typename T> struct is_basic_string : std::false_type {};
+template <typename A>
+struct is_basic_string<std::basic_string<char, std::char_traits<char>, A>> : std::true_type {};
+} // namespace internal
+
+namespace internal {
+// std::from_chars rejects the leading + that boost::lexical_cast accepts.
+inline std::string_view url_skip_plus_sign(std::string_view str) {
+  if (str.size() > 1 and str[0] == '+' and str[1] != '-')
+    str.remove_prefix(1);
+  return str;
+}
+} // namespace internal
+
+// Parse \str into \v. Return false if \str is not a valid \T.
+// Numbers are parsed with std::from_chars, other types with boost::lexical_cast.
+template <typename T> bool url_decode_value(std::string_view str, T& v) {
+  if constexpr (internal::is_basic_string<T>::value or std::is_same<T, std::string_view>::value) {
+    v = str;
+    return true;
+  } else if constexpr (std::is_integral<T>::value and !std::is_same<T, bool>::value and
+                       !std::is_same<T, char>::value) {
+    str = internal::url_skip_plus_sign(str);
+    auto [end, error] = std::from_chars(str.data(), str.data() + str.size(), v);
+    return error == std::errc() and end == str.data() + str.size();
+  }
+#if defined(__cpp_lib_to_chars)
+  else if constexpr (std::is_floating_point<T>::value) {
+    str = internal::url_skip_plus_sign(str);
+    auto [end, error] = std::from_chars(str.data(), str.data() + str.size(), v);
+    return error == std::errc() and end == str.data() + str.size();
+  }
+#endif
+  else {
+    try {
+      v = boost::lexical_cast<T>(str);
+      return true;
+    } catch (const boost::bad_lexical_cast&) {
+      return false;
+    }
   }
-  if (end == str.size())
-    return str.substr(end, 0);
-  else
-    return str.substr(end + 1, str.size() - end - 1);
 }
 
-template <typename O>
-std::string_view url_decode2(std::set<void*>& found, std::string_view str, std::optional<O>& obj) {
-  O o;
-  auto ret = url_decode2(found, str, o);
-  obj = o;
-  return ret;
+namespace internal {
+
+inline bool url_is_escaped(std::string_view s) {
+  for (char c : s)
+    if (c == '%' or c == '+')
+      return true;
+  return false;
 }
 
-template <typename... O>
-std::string_view url_decode2(std::set<void*>& found, std::string_view str, metamap<O...>& obj,
-                             bool root = false);
+inline int url_hex_value(char c) {
+  if (c >= '0' and c <= '9')
+    return c - '0';
+  if (c >= 'a' and c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' and c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
 
-// Decode an array element.
-template <typename O>
-std::string_view url_decode2(std::set<void*>& found, std::string_view str, std::vector<O>& obj) {
-  if (str.size() == 0)
-    throw std::runtime_error(format_error("url_decode error: expected key end", str[0]));
+// Decode %XX sequences and + into \out. \out can be \in.data().
+// Return the size of the decoded string.
+inline int url_unescape_to(std::string_view in, char* out) {
+  int o = 0;
+  for (int i = 0; i < int(in.size()); i++) {
+    int h, l;
+    if (in[i] == '+')
+      out[o++] = ' ';
+    else if (in[i] == '%' and i + 2 < int(in.size()) and (h = url_hex_value(in[i + 1])) >= 0 and
+             (l = url_hex_value(in[i + 2])) >= 0) {
+      out[o++] = char(h * 16 + l);
+      i += 2;
+    } else
+      out[o++] = in[i];
+  }
+  return o;
+}
+
+// Decode a value, unescaping it only if it contains % or +.
+// Escaped std::string_view values are decoded in \arena, the input is never modified.
+template <typename T>
+bool url_decode_escaped_value(std::string_view str, T& v, monotonic_arena* arena) {
+  if (!url_is_escaped(str))
+    return url_decode_value(str, v);
+
+  if constexpr (std::is_same<T, std::string_view>::value) {
+    if (!arena)
+      throw std::runtime_error(
+          "url_decode error: escaped std::string_view values need an arena");
+    char* data = (char*)arena->allocate(str.size(), 1);
+    v = std::string_view(data, url_unescape_to(str, data));
+    return true;
+  } else if constexpr (is_basic_string<T>::value) {
+    v.resize(str.size());
+    v.resize(url_unescape_to(str, v.data()));
+    return true;
+  } else {
+    char buffer[64];
+    if (str.size() > sizeof(buffer))
+      return false;
+    return url_decode_value(std::string_view(buffer, url_unescape_to(str, buffer)), v);
+  }
+}
+
+// Number of values that must be present to decode a T.
+// Optionals and arrays are not required.
+template <typename T> struct url_decode_required_fields { static constexpr int value = 1; };
+template <typename T> struct url_decode_required_fields<std::optional<T>> {
+  static constexpr int value = 0;
+};
+template <typename T> struct url_decode_required_fields<std::vector<T>> {
+  static constexpr int value = 0;
+};
+template <typename... M> struct url_decode_required_fields<metamap<M...>> {
+  static constexpr int value =
+      (0 + ... + url_decode_required_fields<typename M::_iod_value_type>::value);
+};
+
+// Compile time perfect hash of the keys of metamap<M...>. The slot of a key is
+// (symbol_hash(key) >> shift) & (table_size - 1).
+template <typename... M> struct url_decode_keys {
+
+  static constexpr int size = sizeof...(M);
+  static constexpr std::array<uint64_t, size> hashes = {
+      symbol_hash(typename M::_iod_symbol_type{})...};
+
+  // Position of the presence bits of each member.
+  static constexpr std::array<int, size + 1> offsets = [] {
+    std::array<int, size + 1> res{};
+    int n[] = {0, url_decode_required_fields<typename M::_iod_value_type>::value...};
+    for (int i = 0; i < size; i++)
+      res[i + 1] = res[i] + n[i + 1];
+    return res;
+  }();
+
+  // Find the smallest table and the shift that give a different slot to each key.
+  static constexpr std::pair<int, int> parameters = [] {
+    for (int table_size = 1;; table_size *= 2) {
+      if (table_size < size)
+        continue;
+      for (int shift = 0; shift < 48; shift++) {
+        bool collision = false;
+        for (int i = 0; i < size and !collision; i++)
+          for (int j = i + 1; j < size and !collision; j++)
+            collision = ((hashes[i] >> shift) & (table_size - 1)) ==
+                        ((hashes[j] >> shift) & (table_size - 1));
+        if (!collision)
+          return std::make_pair(table_size, shift);
+      }
+    }
+  }();
+  static constexpr int table_size = parameters.first;
+  static constexpr int shift = parameters.second;
+
+  // Index of the member of each slot, -1 if the slot is empty.
+  static constexpr std::array<int, table_size> table = [] {
+    std::array<int, table_size> res{};
+    for (int i = 0; i < table_size; i++)
+      res[i] = -1;
+    for (int i = 0; i < size; i++)
+      res[(hashes[i] >> shift) & (table_size - 1)] = i;
+    return res;
+  }();
+
+  // Index of the member named \key, -1 if none.
+  static int find(std::string_view key) {
+    if constexpr (size == 0)
+      return -1;
+    else {
+      uint64_t h = symbol_hash(key);
+      int i = table[(h >> shift) & (table_size - 1)];
+      if (i < 0 or hashes[i] != h)
+        return -1;
+      return i;
+    }
+  }
+};
+
+// Call f(k, obj[k], i) on the i-th member of \obj.
+template <typename... M, typename F, std::size_t... I>
+void url_decode_member(metamap<M...>& obj, int i, F f, std::index_sequence<I...>) {
+  (void)((i == int(I) ? (f(typename M::_iod_symbol_type{}, obj[typename M::_iod_symbol_type{}], I),
+                         true)
+                      : false) or
+         ...);
+}
 
-  if (str[0] != '[')
-    throw std::runtime_error(format_error("url_decode error: expected [, got ", str[0]));
+// Decode \value in \obj at the location described by \key, for example
+// "name", "[name]", "[3]" or "[3][name]".
+// \found tracks the required fields that are decoded, \slot is the index of \obj in \found.
+template <typename B, typename O>
+void url_decode2(B& found, int slot, std::string_view key, std::string_view value, O& obj,
+                 monotonic_arena* arena) {
+  if (key.size())
+    throw std::runtime_error(format_error("url_decode error: expected =, got ", key[0]));
+  if (value.size() == 0)
+    return;
+  if (!url_decode_escaped_value(value, obj, arena))
+    throw std::runtime_error(format_error("url_decode error: invalid value ", value));
+  found.set(slot);
+}
 
-  // Get the index substring.
-  int index_start = 1;
-  int index_end = 1;
+template <typename B, typename... M>
+void url_decode2(B& found, int slot, std::string_view key, std::string_view value,
+                 metamap<M...>& obj, monotonic_arena* arena, bool root = false);
 
-  while (str.size() != index_end and str[index_end] != ']')
-    index_end++;
+template <typename B, typename O>
+void url_decode2(B& found, int slot, std::string_view key, std::string_view value,
+                 std::optional<O>& obj, monotonic_arena* arena) {
+  std::bitset<url_decode_required_fields<O>::value + 1> element_found;
+  O o;
+  url_decode2(element_found, 0, key, value, o, arena);
+  if (value.size())
+    obj = std::move(o);
+}
 
-  if (str.size() == 0)
-    throw std::runtime_error(format_error("url_decode error: expected key end", str[0]));
+template <typename B, typename O>
+void url_decode2(B& found, int slot, std::string_view key, std::string_view value,
+                 std::vector<O>& obj, monotonic_arena* arena) {
+  if (key.size() == 0 or key[0] != '[')
+    throw std::runtime_error("url_decode error: expected [");
+  size_t index_end = key.find(']');
+  if (index_end == std::string_view::npos)
+    throw std::runtime_error("url_decode error: expected ]");
 
-  auto next_str = str.substr(index_end + 1, str.size() - index_end - 1);
+  std::string_view index = key.substr(1, index_end - 1);
+  std::string_view next_key = key.substr(index_end + 1);
 
-  if (index_end == index_start) // [] syntax, push back a value.
+  // Required fields are not checked inside arrays.
+  std::bitset<url_decode_required_fields<O>::value + 1> element_found;
+
+  if (index.size() == 0) // [] syntax, push back a value.
   {
     O x;
-    auto ret = url_decode2(found, next_str, x);
-    obj.push_back(x);
-    return ret;
+    url_decode2(element_found, 0, next_key, value, x, arena);
+    obj.push_back(std::move(x));
   } else // [idx] set index idx.
   {
-    int idx = std::strtol(str.data() + index_start, nullptr, 10);
-    if (idx >= 0 and idx <= 9999) {
-      if (int(obj.size()) <= idx)
-        obj.resize(idx + 1);
-      return url_decode2(found, next_str, obj[idx]);
-    } else
+    int idx = -1;
+    url_decode_value(index, idx);
+    if (idx < 0 or idx > 9999)
       throw std::runtime_error(format_error("url_decode error: out of bound array subscript."));
+    if (int(obj.size()) <= idx)
+      obj.resize(idx + 1);
+    url_decode2(element_found, 0, next_key, value, obj[idx], arena);
   }
 }
 
-// Decode an object member.
-template <typename... O>
-std::string_view url_decode2(std::set<void*>& found, std::string_view str, metamap<O...>& obj,
-                             bool root) {
-  if (str.size() == 0)
-    throw http_error::bad_request("url_decode error: expected key end", str[0]);
-
-  int key_start = 0;
-  int key_end = key_start + 1;
-
-  int next = 0;
-
-  if (!root) {
-    if (str[0] != '[')
-      throw std::runtime_error(format_error("url_decode error: expected [, got ", str[0]));
-
-    key_start = 1;
-    while (key_end != str.size() && str[key_end] != ']' && str[key_end] != '=')
-      key_end++;
-
-    if (key_end == str.size())
-      throw std::runtime_error("url_decode error: unexpected end.");
-    next = key_end + 1; // skip the ]
+template <typename B, typename... M>
+void url_decode2(B& found, int slot, std::string_view key, std::string_view value,
+                 metamap<M...>& obj, monotonic_arena* arena, bool root) {
+  std::string_view name;
+  if (root) {
+    size_t end = key.find('[');
+    name = key.substr(0, end);
+    key = end == std::string_view::npos ? std::string_view() : key.substr(end);
   } else {
-    while (key_end < str.size() && str[key_end] != '[' && str[key_end] != '=')
-      key_end++;
-    next = key_end;
+    size_t end = key.find(']');
+    if (key.size() == 0 or key[0] != '[' or end == std::string_view::npos)
+      throw std::runtime_error("url_decode error: expected [key]");
+    name = key.substr(1, end - 1);
+    key = key.substr(end + 1);
   }
 
-  auto key = str.substr(key_start, key_end - key_start);
-  auto next_str = str.substr(next, str.size() - next);
-
-  std::string_view ret;
-  map(obj, [&](auto k, auto& v) {
-    if (li::symbol_string(k) == key) {
-      try {
-        ret = url_decode2(found, next_str, v);
-      } catch (std::exception e) {
-        throw std::runtime_error(
-            format_error("url_decode error: cannot decode parameter ", li::symbol_string(k)));
-      }
-    }
-  });
-  return ret;
+  typedef url_decode_keys<M...> keys;
+  int i = keys::find(name);
+  if (i < 0) // Unknown keys are ignored.
+    return;
+  url_decode_member(
+      obj, i,
+      [&](auto k, auto& v, int member_index) {
+        if (name != symbol_string(k))
+          return;
+        try {
+          url_decode2(found, slot + keys::offsets[member_index], key, value, v, arena);
+        } catch (const std::exception& e) {
+          throw std::runtime_error(
+              format_error("url_decode error: cannot decode parameter ", li::symbol_string(k)));
+        }
+      },
+      std::index_sequence_for<M...>{});
 }
 
-template <typename O>
-std::string url_decode_check_missing_fields(const std::set<void*>& found, std::optional<O>& obj) {
-  return std::string();
+// Return the name of the first required field of \obj that is missing, prefixed with its path.
+template <typename B, typename O>
+std::string url_decode_check_missing_fields(const B& found, int slot, O& obj) {
+  return found.test(slot) ? std::string() : std::string(" ");
 }
-
-template <typename O>
-std::string url_decode_check_missing_fields(const std::set<void*>& found, O& obj) {
-  if (found.find(&obj) == found.end())
-    return " ";
-  else
-    return std::string();
+template <typename B, typename O>
+std::string url_decode_check_missing_fields(const B& found, int slot, std::optional<O>& obj) {
+  return std::string();
 }
-
-template <typename O>
-std::string url_decode_check_missing_fields(const std::set<void*>& found, std::vector<O>& obj) {
-  // Fixme : implement missing fields checking in std::vector<metamap<O...>>
-  // for (int i = 0; i < obj.size(); i++)
-  // {
-  //   std::string missing = url_decode_check_missing_fields(found, obj[i]);
-  //   if (missing.size())
-  //   {
-  //     std::ostringstream ss;
-  //     ss << '[' << i << "]" << missing;
-  //     return ss.str();
-  //   }
-  // }
+template <typename B, typename O>
+std::string url_decode_check_missing_fields(const B& found, int slot, std::vector<O>& obj) {
   return std::string();
 }
-
-template <typename... O>
-std::string url_decode_check_missing_fields(const std::set<void*>& found, metamap<O...>& obj,
+template <typename B, typename... M>
+std::string url_decode_check_missing_fields(const B& found, int slot, metamap<M...>& obj,
                                             bool root = false) {
+  typedef url_decode_keys<M...> keys;
   std::string missing;
+  int i = 0;
   map(obj, [&](auto k, auto& v) {
-    if (missing.size())
-      return;
-    missing = url_decode_check_missing_fields(found, v);
-    if (missing.size())
-      missing = (root ? "" : ".") + std::string(li::symbol_string(k)) + missing;
+    if (missing.empty()) {
+      missing = url_decode_check_missing_fields(found, slot + keys::offsets[i], v);
+      if (missing.size())
+        missing = (root ? "" : ".") + std::string(li::symbol_string(k)) + missing;
+    }
+    i++;
   });
   return missing;
 }
 
-template <typename S, typename... O>
-std::string url_decode_check_missing_fields_on_subset(const std::set<void*>& found,
-                                                      metamap<O...>& obj, bool root = false) {
-  std::string missing;
-  map(S(), [&](auto k, auto) {
-    if (missing.size())
-      return;
-    auto& v = obj[k];
-    missing = url_decode_check_missing_fields(found, v);
-    if (missing.size())
-      missing = (root ? "" : ".") + std::string(li::symbol_string(k)) + missing;
-  });
-  return missing;
-}
+} // namespace internal
 
-// Frontend.
-template <typename O> void url_decode(std::string_view str, O& obj) {
-  std::set<void*> found;
+// Decode the urlencoded string \str in \obj. \str is not modified.
+// Keys and values are unescaped only when they contain % or +. std::string_view members
+// point in \str, or in \arena when their value is escaped (an error without \arena).
+template <typename O>
+void url_decode(std::string_view str, O& obj, monotonic_arena* arena = nullptr) {
+  std::bitset<internal::url_decode_required_fields<O>::value + 1> found;
+
+  while (str.size() > 0) {
+    size_t end = str.find('&');
+    std::string_view key_value = str.substr(0, end);
+    str = end == std::string_view::npos ? std::string_view() : str.substr(end + 1);
+    if (key_value.empty())
+      continue;
+
+    size_t equal = key_value.find('=');
+    if (equal == std::string_view::npos)
+      throw std::runtime_error("url_decode error: expected =");
+    std::string_view key = key_value.substr(0, equal);
+    std::string_view value = key_value.substr(equal + 1);
+
+    // Escaped keys are decoded in a buffer, the input string is left untouched.
+    char key_buffer[256];
+    if (internal::url_is_escaped(key)) {
+      if (key.size() > sizeof(key_buffer))
+        continue;
+      key = std::string_view(key_buffer, internal::url_unescape_to(key, key_buffer));
+    }
 
-  // Parse the urlencoded string
-  while (str.size() > 0)
-    str = url_decode2(found, str, obj, true);
+    internal::url_decode2(found, 0, key, value, obj, arena, true);
+  }
 
   // Check for missing fields.
-  std::string missing = url_decode_check_missing_fields(found, obj, true);
+  std::string missing = internal::url_decode_check_missing_fields(found, 0, obj, true);
   if (missing.size())
     throw std::runtime_error(format_error("Missing argument ", missing));
 }
@@ -0,0 +1,101 @@
+#include <lithium_http_server.hh>
+#include <lithium_http_client.hh>
+
+#include "symbols.hh"
+#include "test.hh"
+
+using namespace li;
+
+void sleep_ms(async_fiber_context& fiber, int ms) {
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+  while (std::chrono::steady_clock::now() < deadline and fiber.park_until(deadline))
+    ;
+}
+
+int main() {
+
+  // CoDel: shed only once the minimum delay stayed above target for a whole interval.
+  {
+    using std::chrono::milliseconds;
+    codel_controller codel(milliseconds(5), milliseconds(100));
+    auto t = codel_controller::clock::now();
+    CHECK_EQUAL("good queue", codel.admit(milliseconds(50), t), true);
+    CHECK_EQUAL("good queue", codel.admit(milliseconds(20), t + milliseconds(50)), true);
+    CHECK_EQUAL("standing queue", codel.admit(milliseconds(20), t + milliseconds(100)), false);
+    CHECK_EQUAL("standing queue", codel.admit(milliseconds(2), t + milliseconds(150)), true);
+    CHECK_EQUAL("drained queue", codel.admit(milliseconds(20), t + milliseconds(200)), true);
+    CHECK_EQUAL("max delay", codel.max_delay().count(), 100000);
+  }
+
+  concurrency_limit limit(s::max_in_flight = 2, s::max_queue = 2, s::codel_interval = 1000,
+                          s::retry_after = 3);
+  int inside = 0, max_inside = 0;
+
+  http_api api;
+  api.get("/limited") = limit([&](http_request& request, http_response& response) {
+    inside++;
+    max_inside = std::max(max_inside, inside);
+    sleep_ms(request.fiber, 200);
+    inside--;
+    response.write("ok");
+  });
+  api.get("/busy") = [&](http_request& request, http_response& response) {
+    // Block the reactor, its other requests queue up.
+    auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(5);
+    while (std::chrono::steady_clock::now() < end)
+      ;
+    response.write("ok");
+  };
+  http_serve(api, 12370, s::non_blocking, s::nthreads = 1);
+
+  // Bulkhead: 2 requests run, 2 wait, the others are shed immediately.
+  std::vector<int> status(6);
+  std::vector<int> retry_after(6);
+  std::vector<std::thread> clients;
+  for (int i = 0; i < 6; i++)
+    clients.emplace_back([&, i] {
+      auto r = http_get("http://localhost:12370/limited", s::fetch_headers);
+      status[i] = r.status;
+      retry_after[i] = atoi(r.headers["Retry-After"].c_str());
+    });
+  for (auto& t : clients)
+    t.join();
+  CHECK_EQUAL("bulkhead admitted", std::count(status.begin(), status.end(), 200), 4);
+  CHECK_EQUAL("bulkhead shed", std::count(status.begin(), status.end(), 503), 2);
+  CHECK_EQUAL("max in flight", max_inside, 2);
+  CHECK_EQUAL("retry after", std::count(retry_after.begin(), retry_after.end(), 3), 2);
+  auto stats = limit.stats();
+  CHECK_EQUAL("admitted", stats.admitted, 4);
+  CHECK_EQUAL("shed", stats.shed_in_flight, 2);
+
+  // An admission_control created where a destroyed one was starts with a fresh controller.
+  for (int i = 0; i < 2; i++) {
+    admission_control fresh(s::codel_target = 5, s::codel_interval = 20);
+    CHECK_EQUAL("fresh controller", fresh.admit(std::chrono::milliseconds(10)), true);
+    usleep(25000);
+    CHECK_EQUAL("overloaded controller", fresh.admit(std::chrono::milliseconds(10)), false);
+  }
+
+  // Server wide: clients saturating a reactor get 503s once its queue stops draining.
+  admission_control admission(s::codel_target = 5, s::codel_interval = 20);
+  http_serve(api, 12371, s::non_blocking, s::nthreads = 1, s::admission_control = &admission);
+  std::atomic<int> ok = 0, shed = 0;
+  clients.clear();
+  for (int i = 0; i < 20; i++)
+    clients.emplace_back([&] {
+      for (int j = 0; j < 20; j++) {
+        auto r = http_get("http://localhost:12371/busy", s::fetch_headers);
+        if (r.status == 503 and atoi(r.headers["Retry-After"].c_str()) == 1)
+          shed++;
+        else if (r.status == 200)
+          ok++;
+      }
+    });
+  for (auto& t : clients)
+    t.join();
+  CHECK_EQUAL("all answered", ok + shed, 400);
+  assert(ok > 0 and shed > 0);
+  auto server_stats = admission.stats();
+  CHECK_EQUAL("admitted", server_stats.admitted, ok.load());
+  CHECK_EQUAL("shed queue delay", server_stats.shed_queue_delay, shed.load());
+}
@@ -0,0 +1,54 @@
+#include "test.hh"
+#include <lithium_http_server.hh>
+
+#include "symbols.hh"
+
+using namespace li;
+
+int main() {
+
+  monotonic_arena arena;
+
+  // Alignment and growth.
+  char* c = (char*)arena.allocate(1, 1);
+  double* d = (double*)arena.allocate(sizeof(double), alignof(double));
+  assert(c and d and uintptr_t(d) % alignof(double) == 0);
+  void* big = arena.allocate(100 * 1024);
+  assert(big);
+  CHECK_EQUAL("copy", arena.copy("hello"), "hello");
+
+  // reset keeps only the first block.
+  arena.reset();
+  CHECK_EQUAL("reset", arena.capacity(), monotonic_arena::initial_block_size);
+  CHECK_EQUAL("reuse", (char*)arena.allocate(1, 1), c);
+
+  // Standard containers.
+  {
+    std::vector<int, arena_allocator<int>> v(arena);
+    for (int i = 0; i < 1000; i++)
+      v.push_back(i);
+    CHECK_EQUAL("vector", v[999], 999);
+
+    std::unordered_map<std::string_view, int, std::hash<std::string_view>,
+                       std::equal_to<std::string_view>,
+                       arena_allocator<std::pair<const std::string_view, int>>>
+        m(arena);
+    m["a"] = 1;
+    m["b"] = 2;
+    CHECK_EQUAL("map", m["a"] + m["b"], 3);
+  }
+  arena.release();
+  CHECK_EQUAL("release", arena.capacity(), 0);
+
+  // Decoding strings in the arena.
+  {
+    auto obj = mmm(s::name = arena_string(arena));
+    url_decode("name=a%20long%20name%20that%20does%20not%20fit%20in%20sso", obj);
+    CHECK_EQUAL("url_decode", std::string_view(obj.name),
+                "a long name that does not fit in sso");
+    assert(obj.name.get_allocator().arena == &arena);
+
+    json_decode(R"({"name":"another long name in the arena"})", obj);
+    CHECK_EQUAL("json_decode", std::string_view(obj.name), "another long name in the arena");
+  }
+}
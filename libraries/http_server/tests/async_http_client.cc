@@ -0,0 +1,107 @@
+#include <lithium_http_server.hh>
+#include <lithium_http_client.hh>
+
+#include "symbols.hh"
+#include "test.hh"
+
+using namespace li;
+
+int main() {
+
+  // The server has one thread and calls itself: a blocking client would deadlock.
+  async_http_client client(s::max_idle_connections = 4);
+  async_http_client impatient(s::timeout = 100);
+
+  http_api api;
+  api.get("/hello") = [](http_request& request, http_response& response) {
+    auto params = request.get_parameters(s::name = std::string());
+    response.set_header("X-Test", "1");
+    response.write("hello ", params.name);
+  };
+  api.post("/form") = [](http_request& request, http_response& response) {
+    response.write(request.post_parameters(s::name = std::string()).name);
+  };
+  api.post("/json") = [](http_request& request, http_response& response) {
+    response.write(request.http_ctx.read_whole_body());
+  };
+  api.get("/chunked") = [](http_request& request, http_response& response) {
+    response.http_ctx.start_chunked_response();
+    response.http_ctx.write_chunk("abc");
+    response.http_ctx.write_chunk("def");
+  };
+  api.get("/slow") = [](http_request& request, http_response& response) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(500);
+    while (std::chrono::steady_clock::now() < deadline and request.fiber.park_until(deadline))
+      ;
+    response.write("slow");
+  };
+
+  api.get("/call_hello") = [&](http_request& request, http_response& response) {
+    auto r = client.get(request.fiber, "http://127.0.0.1:12390/hello",
+                        s::get_parameters = mmm(s::name = "john doe"), s::fetch_headers);
+    response.write(r.status, " ", r.body, " ", r.headers["X-Test"]);
+  };
+  api.get("/call_form") = [&](http_request& request, http_response& response) {
+    response.write(client.post(request.fiber, "http://127.0.0.1:12390/form",
+                               s::post_parameters = mmm(s::name = "a&b=c"))
+                       .body);
+  };
+  api.get("/call_json") = [&](http_request& request, http_response& response) {
+    response.write(client.post(request.fiber, "http://127.0.0.1:12390/json",
+                               s::post_parameters = mmm(s::id = 42), s::json_encoded)
+                       .body);
+  };
+  api.get("/call_chunked") = [&](http_request& request, http_response& response) {
+    response.write(client.get(request.fiber, "http://127.0.0.1:12390/chunked").body);
+  };
+  api.get("/call_missing") = [&](http_request& request, http_response& response) {
+    response.write(client.get(request.fiber, "http://127.0.0.1:12390/missing").status);
+  };
+  api.get("/call_localhost") = [&](http_request& request, http_response& response) {
+    response.write(http_get(request.fiber, "http://localhost:12390/hello?name=local").body);
+  };
+  auto expect_error = [](auto f) {
+    try {
+      f();
+      return std::string("no error");
+    } catch (const std::runtime_error& e) {
+      return std::string(e.what());
+    }
+  };
+  api.get("/call_slow") = [&](http_request& request, http_response& response) {
+    response.write(
+        expect_error([&] { impatient.get(request.fiber, "http://127.0.0.1:12390/slow"); }));
+  };
+  api.get("/call_closed_port") = [&](http_request& request, http_response& response) {
+    response.write(expect_error([&] { client.get(request.fiber, "http://127.0.0.1:12399/"); }));
+  };
+  // A client created where a destroyed one was gets its own shard.
+  long long temporary_requests = 0;
+  api.get("/call_temporary") = [&](http_request& request, http_response& response) {
+    async_http_client temporary;
+    response.write(temporary.get(request.fiber, "http://127.0.0.1:12390/hello?name=t").body);
+    temporary_requests += temporary.stats().requests;
+  };
+  http_serve(api, 12390, s::non_blocking, s::nthreads = 1);
+
+  for (int i = 0; i < 3; i++)
+    CHECK_EQUAL("get", http_get("http://localhost:12390/call_hello").body, "200 hello john doe 1");
+  auto stats = client.stats();
+  CHECK_EQUAL("requests", stats.requests, 3);
+  CHECK_EQUAL("connections", stats.connections, 1);
+  CHECK_EQUAL("reused", stats.reused, 2);
+
+  CHECK_EQUAL("form", http_get("http://localhost:12390/call_form").body, "a&b=c");
+  CHECK_EQUAL("json", http_get("http://localhost:12390/call_json").body, R"({"id":42})");
+  CHECK_EQUAL("chunked", http_get("http://localhost:12390/call_chunked").body, "abcdef");
+  CHECK_EQUAL("status", http_get("http://localhost:12390/call_missing").body, "404");
+  CHECK_EQUAL("resolve", http_get("http://localhost:12390/call_localhost").body, "hello local");
+  CHECK_EQUAL("timeout", http_get("http://localhost:12390/call_slow").body,
+              "async_http_client: 127.0.0.1:12390 timed out.");
+  CHECK_EQUAL("refused", http_get("http://localhost:12390/call_closed_port").body,
+              "async_http_client: cannot connect to 127.0.0.1:12399.");
+
+  for (int i = 0; i < 3; i++)
+    CHECK_EQUAL("temporary", http_get("http://localhost:12390/call_temporary").body, "hello t");
+  CHECK_EQUAL("temporary requests", temporary_requests, 3);
+}
@@ -9,12 +9,12 @@
 //  other file descriptors events.
 struct benchmark_fiber {
 
-  typedef std::runtime_error exception_type;
-
   inline benchmark_fiber& operator=(const benchmark_fiber&) = delete;
   inline benchmark_fiber(const benchmark_fiber&) = delete;
 
-  inline void yield() { }
+  inline bool yield() { return true; }
+  inline bool park() { return true; }
+  inline bool is_closed() { return false; }
 
   inline ~benchmark_fiber() {}
 
@@ -40,7 +40,13 @@ struct benchmark_fiber {
     return count;
   };
 
-  inline bool write(const char* buf, int size) {
+  inline int read_nowait(char* buf, int max_size) { return read(buf, max_size); }
+
+  inline bool write(const char* buf, int size, int flags = 0) {
+    return true;
+  };
+
+  inline bool writev(iovec* iov, int iovcnt, int flags = 0) {
     return true;
   };
 
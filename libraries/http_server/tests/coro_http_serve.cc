@@ -0,0 +1,97 @@
+#include <lithium_http_server.hh>
+#include <lithium_http_client.hh>
+
+#include "symbols.hh"
+#include "test.hh"
+
+using namespace li;
+
+// Needs -std=c++20.
+#if LITHIUM_COROUTINES
+
+int main() {
+
+  coro_http_api api;
+
+  api.get("/hello") = [&](coro_http_request& request,
+                          coro_http_response& response) -> coro_task<> {
+    response.write("hello world.");
+    co_return;
+  };
+
+  api.get("/sleep") = [&](coro_http_request& request,
+                          coro_http_response& response) -> coro_task<> {
+    auto params = request.get_parameters(s::ms = int());
+    co_await request.fiber.connection->sleep_for(std::chrono::milliseconds(params.ms));
+    response.write("slept ", params.ms);
+  };
+
+  api.post("/echo") = [&](coro_http_request& request,
+                          coro_http_response& response) -> coro_task<> {
+    auto params = request.post_parameters(s::message = std::string());
+    response.write(params.message);
+    co_return;
+  };
+
+  api.get("/error") = [&](coro_http_request& request,
+                          coro_http_response& response) -> coro_task<> {
+    co_await request.fiber.connection->yield();
+    throw http_error::forbidden("forbidden");
+  };
+
+  http_serve_coro(api, 12364, s::non_blocking, s::nthreads = 2);
+
+  CHECK_EQUAL("hello", http_get("http://localhost:12364/hello").body, "hello world.");
+  CHECK_EQUAL("not found", http_get("http://localhost:12364/nope").status, 404);
+  CHECK_EQUAL("error", http_get("http://localhost:12364/error").status, 403);
+
+  // Sleeping requests do not block the others.
+  timer t;
+  t.start();
+  std::thread sleeper([] {
+    CHECK_EQUAL("sleep", http_get("http://localhost:12364/sleep?ms=300").body, "slept 300");
+  });
+  usleep(50000);
+  CHECK_EQUAL("hello while sleeping", http_get("http://localhost:12364/hello").body,
+              "hello world.");
+  sleeper.join();
+  t.end();
+  assert(t.ms() >= 300);
+
+  // Bodies larger than the initial read buffer.
+  std::string message(30000, 'x');
+  CHECK_EQUAL("echo", http_post("http://localhost:12364/echo",
+                                s::post_parameters = mmm(s::message = message))
+                          .body,
+              message);
+
+  // Pipelined requests.
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in server;
+  server.sin_addr.s_addr = inet_addr("127.0.0.1");
+  server.sin_family = AF_INET;
+  server.sin_port = htons(12364);
+  CHECK_EQUAL("connect", connect(fd, (const sockaddr*)&server, sizeof(server)), 0);
+  std::string rq = "GET /hello HTTP/1.1\r\nHost: localhost\r\n\r\n";
+  std::string rqs = rq + rq + rq;
+  CHECK_EQUAL("send", ::send(fd, rqs.data(), rqs.size(), 0), ssize_t(rqs.size()));
+  std::string received;
+  char buf[1000];
+  while (received.size() < 3 * strlen("hello world.") or
+         received.rfind("hello world.") != received.size() - strlen("hello world.")) {
+    int n = ::recv(fd, buf, sizeof(buf), 0);
+    if (n <= 0)
+      break;
+    received.append(buf, n);
+  }
+  int count = 0;
+  for (auto p = received.find("hello world."); p != std::string::npos;
+       p = received.find("hello world.", p + 1))
+    count++;
+  CHECK_EQUAL("pipelining", count, 3);
+  close(fd);
+}
+
+#else
+int main() { std::cout << "Coroutines are not supported by this compiler." << std::endl; }
+#endif
@@ -0,0 +1,16 @@
+#include <cstdlib>
+#include <new>
+
+#include <lithium_http_server.hh>
+
+// Replaces the global operator new to count the allocations of each thread in
+// li::impl::allocation_count (see http_injector::allocations). Link it into the program.
+
+void* operator new(std::size_t size) {
+  li::impl::allocation_count++;
+  if (void* p = std::malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
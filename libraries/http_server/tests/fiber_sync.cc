@@ -0,0 +1,161 @@
+#include <lithium_http_server.hh>
+#include <lithium_http_client.hh>
+
+#include "symbols.hh"
+#include "test.hh"
+
+using namespace li;
+
+void sleep_ms(async_fiber_context& fiber, int ms) {
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+  while (std::chrono::steady_clock::now() < deadline and fiber.park_until(deadline))
+    ;
+}
+
+// Run \n concurrent GET requests on \url, return their bodies.
+std::vector<std::string> parallel_get(int n, std::string url) {
+  std::vector<std::string> bodies(n);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < n; i++)
+    threads.emplace_back([&, i] { bodies[i] = http_get(url).body; });
+  for (auto& t : threads)
+    t.join();
+  return bodies;
+}
+
+int main() {
+
+  // All the primitives are used from the single reactor of the server.
+  fiber_mutex mutex;
+  fiber_semaphore semaphore(2);
+  fiber_channel<std::string> channel(2);
+  fiber_event event;
+  fiber_condition_variable cv;
+  int counter = 0;
+  int inside = 0, max_inside = 0;
+
+  http_api api;
+
+  auto critical_section = [&](async_fiber_context& fiber) {
+    inside++;
+    max_inside = std::max(max_inside, inside);
+    sleep_ms(fiber, 20);
+    inside--;
+  };
+
+  api.get("/mutex") = [&](http_request& request, http_response& response) {
+    if (fiber_lock_guard lock{mutex, request.fiber}) {
+      critical_section(request.fiber);
+      response.write("locked");
+    }
+  };
+
+  api.get("/semaphore") = [&](http_request& request, http_response& response) {
+    if (semaphore.acquire(request.fiber)) {
+      critical_section(request.fiber);
+      semaphore.release();
+      response.write("acquired");
+    }
+  };
+
+  api.get("/send") = [&](http_request& request, http_response& response) {
+    auto params = request.get_parameters(s::value = std::string());
+    response.write(channel.send(request.fiber, params.value) ? "sent" : "closed");
+  };
+
+  api.get("/receive") = [&](http_request& request, http_response& response) {
+    auto params = request.get_parameters(s::ms = int());
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(params.ms);
+    if (auto value = channel.receive(request.fiber, deadline))
+      response.write(*value);
+    else
+      response.set_status(204);
+  };
+
+  api.get("/wait_event") = [&](http_request& request, http_response& response) {
+    response.write(event.wait(request.fiber) ? "set" : "closed");
+  };
+  api.get("/set_event") = [&](http_request& request, http_response& response) { event.set(); };
+
+  api.get("/wait_counter") = [&](http_request& request, http_response& response) {
+    response.write(cv.wait(request.fiber, [&] { return counter >= 3; }) ? "3" : "closed");
+  };
+  api.get("/increment") = [&](http_request& request, http_response& response) {
+    counter++;
+    cv.notify_all();
+  };
+
+  // Waits woken before their deadline do not leave their timer in the reactor.
+  api.get("/early_wakeups") = [&](http_request& request, http_response& response) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(60);
+    for (int i = 0; i < 1000; i++) {
+      request.fiber.defer_fiber_resume(request.fiber.fiber_id);
+      request.fiber.park_until(deadline);
+    }
+    response.write(std::to_string(request.fiber.reactor->timers.size() < 100));
+  };
+
+  http_serve(api, 12365, s::non_blocking, s::nthreads = 1);
+
+  // Mutex: one fiber at a time.
+  for (auto& body : parallel_get(5, "http://localhost:12365/mutex"))
+    CHECK_EQUAL("mutex", body, "locked");
+  CHECK_EQUAL("mutex exclusion", max_inside, 1);
+  assert(!mutex.is_locked());
+
+  // Semaphore: two fibers at a time.
+  max_inside = 0;
+  for (auto& body : parallel_get(6, "http://localhost:12365/semaphore"))
+    CHECK_EQUAL("semaphore", body, "acquired");
+  CHECK_EQUAL("semaphore limit", max_inside, 2);
+  CHECK_EQUAL("semaphore count", semaphore.count(), 2);
+
+  // Channel: receivers wait for senders, senders wait when the channel is full.
+  std::thread receivers([] {
+    auto bodies = parallel_get(4, "http://localhost:12365/receive?ms=5000");
+    std::sort(bodies.begin(), bodies.end());
+    CHECK_EQUAL("receive", bodies[0] + bodies[1] + bodies[2] + bodies[3], "abcd");
+  });
+  usleep(100000);
+  for (std::string v : {"a", "b", "c", "d"})
+    CHECK_EQUAL("send", http_get("http://localhost:12365/send?value=" + v).body, "sent");
+  receivers.join();
+  for (std::string v : {"e", "f"})
+    CHECK_EQUAL("send buffered", http_get("http://localhost:12365/send?value=" + v).body, "sent");
+  std::thread full_sender([] {
+    CHECK_EQUAL("send when full", http_get("http://localhost:12365/send?value=g").body, "sent");
+  });
+  usleep(100000);
+  CHECK_EQUAL("receive buffered", http_get("http://localhost:12365/receive?ms=0").body, "e");
+  full_sender.join();
+  CHECK_EQUAL("receive f", http_get("http://localhost:12365/receive?ms=0").body, "f");
+  CHECK_EQUAL("receive g", http_get("http://localhost:12365/receive?ms=0").body, "g");
+
+  // Receive timeout.
+  timer t;
+  t.start();
+  CHECK_EQUAL("receive timeout", http_get("http://localhost:12365/receive?ms=100").status, 204);
+  t.end();
+  assert(t.ms() >= 100);
+
+  // Event.
+  std::thread event_waiters([] {
+    for (auto& body : parallel_get(3, "http://localhost:12365/wait_event"))
+      CHECK_EQUAL("event", body, "set");
+  });
+  usleep(100000);
+  http_get("http://localhost:12365/set_event");
+  event_waiters.join();
+  CHECK_EQUAL("event already set", http_get("http://localhost:12365/wait_event").body, "set");
+
+  // Condition variable.
+  std::thread cv_waiter(
+      [] { CHECK_EQUAL("cv", http_get("http://localhost:12365/wait_counter").body, "3"); });
+  for (int i = 0; i < 3; i++) {
+    usleep(50000);
+    http_get("http://localhost:12365/increment");
+  }
+  cv_waiter.join();
+
+  CHECK_EQUAL("early wakeups", http_get("http://localhost:12365/early_wakeups").body, "1");
+}
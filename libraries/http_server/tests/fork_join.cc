@@ -0,0 +1,96 @@
+#include <lithium_http_server.hh>
+#include <lithium_http_client.hh>
+
+#include "symbols.hh"
+#include "test.hh"
+
+using namespace li;
+
+// Return false if the fiber was cancelled before \ms.
+bool sleep_ms(async_fiber_context& fiber, int ms) {
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+  while (std::chrono::steady_clock::now() < deadline)
+    if (!fiber.park_until(deadline))
+      return false;
+  return true;
+}
+
+int main() {
+
+  std::atomic<int> cancelled_children = 0;
+
+  http_api api;
+
+  api.get("/parallel") = [&](http_request& request, http_response& response) {
+    auto results = fork_join(request.fiber, 4, [](async_fiber_context& child, int i) {
+      sleep_ms(child, 200);
+      return i * 10;
+    });
+    response.write(results[0] + results[1] + results[2] + results[3]);
+  };
+
+  api.get("/all") = [&](http_request& request, http_response& response) {
+    auto [a, b] = fork_join_all(
+        request.fiber, [](async_fiber_context& child) { return std::string("a"); },
+        [](async_fiber_context& child) {
+          sleep_ms(child, 10);
+          return 42;
+        });
+    response.write(a, b);
+  };
+
+  api.get("/error") = [&](http_request& request, http_response& response) {
+    fork_join(request.fiber, 2, [&](async_fiber_context& child, int i) {
+      if (i == 0) {
+        sleep_ms(child, 10);
+        throw http_error::bad_request("child failed");
+      }
+      if (!sleep_ms(child, 5000))
+        cancelled_children++;
+    });
+  };
+
+  api.get("/nested") = [&](http_request& request, http_response& response) {
+    auto results = fork_join(request.fiber, 3, [](async_fiber_context& child, int i) {
+      auto sub = fork_join(child, 3, [i](async_fiber_context& grandchild, int j) {
+        sleep_ms(grandchild, 5);
+        return i * 3 + j;
+      });
+      return sub[0] + sub[1] + sub[2];
+    });
+    response.write(results[0] + results[1] + results[2]);
+  };
+
+  api.get("/many") = [&](http_request& request, http_response& response) {
+    auto results = fork_join(request.fiber, 1000, [](async_fiber_context& child, int i) {
+      child.yield();
+      return 1;
+    });
+    int sum = 0;
+    for (int r : results)
+      sum += r;
+    response.write(sum);
+  };
+
+  http_serve(api, 12366, s::non_blocking, s::nthreads = 1);
+
+  // The children run concurrently.
+  timer t;
+  t.start();
+  CHECK_EQUAL("parallel", http_get("http://localhost:12366/parallel").body, "60");
+  t.end();
+  assert(t.ms() >= 200 and t.ms() < 600);
+
+  CHECK_EQUAL("fork_join_all", http_get("http://localhost:12366/all").body, "a42");
+
+  // The first error cancels the other children and is rethrown in the handler.
+  t.start();
+  CHECK_EQUAL("error", http_get("http://localhost:12366/error").status, 400);
+  t.end();
+  assert(t.ms() < 1000);
+  CHECK_EQUAL("cancelled", int(cancelled_children), 1);
+
+  CHECK_EQUAL("nested", http_get("http://localhost:12366/nested").body, "36");
+  for (int i = 0; i < 3; i++)
+    CHECK_EQUAL("many", http_get("http://localhost:12366/many").body, "1000");
+}
@@ -0,0 +1,57 @@
+#include <lithium_http_server.hh>
+
+#include "symbols.hh"
+#include "test.hh"
+
+using namespace li;
+
+int main() {
+
+  // Values are kept with 3 significant digits.
+  hdr_histogram h;
+  for (int i = 1; i <= 100000; i++)
+    h.record(i * 1000);
+  CHECK_EQUAL("count", h.count(), 100000);
+  CHECK_EQUAL("min", h.min(), 1000);
+  CHECK_EQUAL("max", h.max(), 100000000);
+  assert(std::abs(h.value_at_percentile(50) - 50000000) < 50000);
+  assert(std::abs(h.value_at_percentile(99) - 99000000) < 99000);
+  CHECK_EQUAL("p100", h.value_at_percentile(100), h.max());
+
+  // A closed-loop client sending every 10 units, blocked during 100: 9 requests missed.
+  hdr_histogram corrected;
+  corrected.record_corrected(100, 10);
+  CHECK_EQUAL("corrected", corrected.count(), 10);
+
+  http_api api;
+  api.get("/a") = [](http_request& request, http_response& response) { response.write("a"); };
+  api.get("/chunked") = [](http_request& request, http_response& response) {
+    response.http_ctx.start_chunked_response();
+    response.http_ctx.write_chunk("abc");
+    response.http_ctx.write_chunk("def");
+  };
+  // Without TCP_NODELAY, the second write of a chunked response waits for a delayed ACK.
+  http_serve(api, 12392, s::non_blocking, s::nthreads = 1, s::tcp_nodelay = true);
+
+  auto result = http_benchmark_open_loop(
+      12392, s::rate = 1000, s::duration = 500, s::connections = 4, s::nthreads = 2, s::poisson,
+      s::requests = std::vector<std::string>{"GET /a HTTP/1.1\r\n\r\n",
+                                             "GET /chunked HTTP/1.1\r\n\r\n",
+                                             "GET /missing HTTP/1.1\r\n\r\n"},
+      s::record_requests);
+  CHECK_EQUAL("errors", result.errors, 0);
+  CHECK_EQUAL("all completed", result.completed, result.scheduled);
+  CHECK_EQUAL("histogram", result.latency.count(), result.completed);
+  CHECK_EQUAL("records", result.records.size(), size_t(result.scheduled));
+  long long missing = result.latency_per_request[2].count();
+  CHECK_EQUAL("bad status", result.bad_status, missing);
+  assert(result.scheduled > 300 and result.scheduled < 700);
+  for (auto& r : result.records)
+    assert(r.sent >= r.scheduled and r.completed >= r.sent);
+
+  // Pipelined, constant rate.
+  result = http_benchmark_open_loop(
+      12392, s::rate = 1000, s::duration = 200, s::connections = 1, s::pipelined,
+      s::requests = std::vector<std::string>{"GET /a HTTP/1.1\r\n\r\n"});
+  CHECK_EQUAL("pipelined", result.completed, 200);
+}
@@ -0,0 +1,79 @@
+#include <lithium_http_server.hh>
+#include <lithium_http_client.hh>
+
+#include "symbols.hh"
+#include "test.hh"
+
+using namespace li;
+
+int main() {
+
+  std::string big(1 << 20, 'a');
+
+  http_api api;
+  api.get("/hello") = [](http_request& request, http_response& response) {
+    auto params = request.get_parameters(s::name = std::string(), s::id = int());
+    response.write("hello ", params.name, " ", params.id);
+  };
+  api.post("/form") = [](http_request& request, http_response& response) {
+    response.write(request.post_parameters(s::name = std::string()).name);
+  };
+  api.get("/big") = [&](http_request& request, http_response& response) {
+    response.write(std::string_view(big));
+  };
+  api.get("/set_cookie") = [](http_request& request, http_response& response) {
+    response.set_cookie("c", "v");
+  };
+  api.get("/read_cookie") = [](http_request& request, http_response& response) {
+    response.write(request.cookie("c").substr(0, 1)); // The value may end with \r.
+  };
+  http_serve(api, 12391, s::non_blocking, s::nthreads = 1);
+
+  CHECK_EQUAL("get", http_get("http://localhost:12391/hello",
+                              s::get_parameters = mmm(s::name = "john doe", s::id = 42))
+                         .body,
+              "hello john doe 42");
+  CHECK_EQUAL("post", http_post("http://localhost:12391/form",
+                                s::post_parameters = mmm(s::name = "a&b=c"))
+                          .body,
+              "a&b=c");
+
+  // Stream the body to a callback.
+  size_t received = 0;
+  auto r = http_get("http://localhost:12391/big",
+                    s::on_body = [&](std::string_view data) { received += data.size(); });
+  CHECK_EQUAL("stream status", r.status, 200);
+  CHECK_EQUAL("stream size", received, big.size());
+
+  // Abort the transfer.
+  bool aborted = false;
+  try {
+    http_get("http://localhost:12391/big", s::on_body = [](std::string_view data) { return false; });
+  } catch (const std::runtime_error&) {
+    aborted = true;
+  }
+  CHECK_EQUAL("abort", aborted, true);
+
+  // Write the body in a user buffer.
+  std::string buffer = "previous content";
+  http_get("http://localhost:12391/big", s::body_buffer = &buffer);
+  CHECK_EQUAL("user buffer", buffer == big, true);
+
+  // Pooled clients keep their connections, and lose their cookies when released.
+  http_client_pool pool;
+  http_client* first;
+  {
+    auto client = pool.acquire();
+    first = client.get();
+    client->get("http://localhost:12391/set_cookie");
+    CHECK_EQUAL("cookie", client->get("http://localhost:12391/read_cookie").body, "v");
+  }
+  {
+    auto client = pool.acquire();
+    CHECK_EQUAL("reused client", client.get() == first, true);
+    CHECK_EQUAL("no cookie", client->get("http://localhost:12391/read_cookie").body, "");
+    long connects = -1;
+    curl_easy_getinfo(client->curl_, CURLINFO_NUM_CONNECTS, &connects);
+    CHECK_EQUAL("reused connection", connects, 0);
+  }
+}
@@ -0,0 +1,96 @@
+#include <lithium_http_server.hh>
+
+#include "symbols.hh"
+#include "test.hh"
+
+using namespace li;
+
+int count(std::string_view s, std::string_view pattern) {
+  int n = 0;
+  for (size_t pos = s.find(pattern); pos != std::string_view::npos; pos = s.find(pattern, pos + 1))
+    n++;
+  return n;
+}
+
+int main() {
+
+  http_api api;
+  api.get("/hello") = [](http_request& request, http_response& response) {
+    response.write("hello ", request.get_parameters(s::name = std::string()).name);
+  };
+  api.get("/json") = [](http_request& request, http_response& response) {
+    response.write_json(s::message = "Hello, World!", s::id = 42);
+  };
+  api.post("/echo") = [](http_request& request, http_response& response) {
+    response.write(request.http_ctx.read_whole_body());
+  };
+  api.get("/chunked") = [](http_request& request, http_response& response) {
+    response.http_ctx.start_chunked_response();
+    response.http_ctx.write_chunk("abc");
+    response.http_ctx.write_chunk("def");
+  };
+  api.get("/broken_stream") = [](http_request& request, http_response& response) {
+    response.http_ctx.start_chunked_response();
+    response.http_ctx.write_chunk("abc");
+    throw http_error::bad_request("error in the middle of the stream");
+  };
+  api.get("/client_closed") = [](http_request& request, http_response& response) {
+    throw sql_client_closed();
+  };
+  api.get("/ip") = [](http_request& request, http_response& response) {
+    response.write(request.ip_address());
+  };
+
+  http_injector inject(api);
+
+  std::string r(inject("GET /hello?name=john HTTP/1.1\r\nHost: localhost\r\n\r\n"));
+  CHECK_EQUAL("status", r.substr(0, 15), "HTTP/1.1 200 OK");
+  CHECK_EQUAL("body", r.substr(r.size() - 10), "hello john");
+  CHECK_EQUAL("ip", std::string(inject("GET /ip HTTP/1.1\r\n\r\n")).find("127.0.0.1") !=
+                        std::string::npos, true);
+  CHECK_EQUAL("sql client closed",
+              count(inject("GET /client_closed HTTP/1.1\r\n\r\n"), "HTTP/1.1"), 0);
+  CHECK_EQUAL("not found", std::string(inject("GET /missing HTTP/1.1\r\n\r\n")).substr(0, 12),
+              "HTTP/1.1 404");
+
+  // Pipelined requests, delivered in reads of various sizes.
+  std::string pipelined;
+  for (int i = 0; i < 10; i++)
+    pipelined += "GET /json HTTP/1.1\r\nHost: localhost\r\n\r\n";
+  for (int read_size : {0, 1, 7, 100}) {
+    std::string_view responses = inject(pipelined, read_size);
+    CHECK_EQUAL("pipelined", count(responses, "HTTP/1.1 200 OK"), 10);
+    CHECK_EQUAL("json", count(responses, R"({"message":"Hello, World!","id":42})"), 10);
+  }
+
+  // A body split in several reads, and a chunked response.
+  std::string post = "POST /echo HTTP/1.1\r\nContent-Length: 11\r\n\r\nhello world";
+  std::string echo(inject(post, 5));
+  CHECK_EQUAL("body", echo.substr(echo.size() - 11), "hello world");
+  std::string chunked(inject("GET /chunked HTTP/1.1\r\n\r\n"));
+  CHECK_EQUAL("chunked", chunked.substr(chunked.find("\r\n\r\n") + 4),
+              "3\r\nabc\r\n3\r\ndef\r\n0\r\n\r\n");
+
+  // An error after the start of the response does not write a second response: the
+  // connection is closed after the partial response.
+  std::string broken(inject("GET /broken_stream HTTP/1.1\r\n\r\nGET /json HTTP/1.1\r\n\r\n"));
+  CHECK_EQUAL("broken stream", count(broken, "HTTP/1.1"), 1);
+  CHECK_EQUAL("broken stream body", broken.substr(broken.find("\r\n\r\n") + 4), "3\r\nabc\r\n");
+
+  // A body truncated by the end of the connection: the processor returns, the responses
+  // are not sent on the closed connection.
+  std::string truncated = "POST /echo HTTP/1.1\r\nContent-Length: 100\r\n\r\n0123456789";
+  CHECK_EQUAL("truncated body", count(inject(truncated, 4), "HTTP/1.1"), 0);
+  CHECK_EQUAL("truncated body not read",
+              count(inject("POST /hello HTTP/1.1\r\nContent-Length: 100\r\n\r\nabc"), "HTTP/1.1"),
+              0);
+  CHECK_EQUAL("after truncated body", count(inject(pipelined), "HTTP/1.1 200 OK"), 10);
+
+  // Allocations are deterministic once the buffers are pooled.
+  inject(pipelined);
+  inject(pipelined);
+  long long allocations = inject.allocations();
+  inject(pipelined);
+  CHECK_EQUAL("allocations", inject.allocations(), allocations);
+  assert(allocations > 0 and allocations < 10 * 20);
+}
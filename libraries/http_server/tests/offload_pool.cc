@@ -0,0 +1,87 @@
+#include <lithium_http_server.hh>
+#include <lithium_http_client.hh>
+
+#include "symbols.hh"
+#include "test.hh"
+
+using namespace li;
+
+int main() {
+
+  offload_pool pool(2);
+  offload_pool small_pool(1, 1);
+
+  http_api api;
+
+  api.get("/hello") = [&](http_request& request, http_response& response) {
+    response.write("hello");
+  };
+
+  api.get("/block") = [&](http_request& request, http_response& response) {
+    int x = pool.await_blocking(request.fiber, [] {
+      usleep(300000);
+      return 42;
+    });
+    response.write(x);
+  };
+
+  api.get("/throw") = [&](http_request& request, http_response& response) {
+    pool.await_blocking(request.fiber, [] { throw http_error::bad_request("bad"); });
+  };
+
+  api.get("/small") = [&](http_request& request, http_response& response) {
+    small_pool.await_blocking(request.fiber, [] { usleep(300000); });
+    response.write("done");
+  };
+
+  api.get("/default") = [&](http_request& request, http_response& response) {
+    std::thread::id server_thread = std::this_thread::get_id();
+    bool other_thread = await_blocking(request.fiber, [&] {
+      return std::this_thread::get_id() != server_thread;
+    });
+    response.write(other_thread ? "worker" : "server");
+  };
+
+  // One reactor: a blocking call must not stall the other connections.
+  http_serve(api, 12367, s::non_blocking, s::nthreads = 1);
+
+  timer t;
+  t.start();
+  std::thread blocked([] { CHECK_EQUAL("block", http_get("http://localhost:12367/block").body, "42"); });
+  usleep(50000);
+  CHECK_EQUAL("hello while blocked", http_get("http://localhost:12367/hello").body, "hello");
+  t.end();
+  assert(t.ms() < 250);
+  blocked.join();
+
+  CHECK_EQUAL("exception", http_get("http://localhost:12367/throw").status, 400);
+  CHECK_EQUAL("default pool", http_get("http://localhost:12367/default").body, "worker");
+
+  // Two blocking calls run concurrently on the 2 workers.
+  t.start();
+  std::thread b1([] { http_get("http://localhost:12367/block"); });
+  std::thread b2([] { http_get("http://localhost:12367/block"); });
+  b1.join();
+  b2.join();
+  t.end();
+  assert(t.ms() < 550);
+
+  // 1 worker and 1 queued job: the third call is rejected.
+  std::vector<int> statuses(3);
+  std::vector<std::thread> small;
+  for (int i = 0; i < 3; i++) {
+    small.emplace_back([&, i] { statuses[i] = http_get("http://localhost:12367/small").status; });
+    usleep(50000);
+  }
+  for (auto& th : small)
+    th.join();
+  std::sort(statuses.begin(), statuses.end());
+  CHECK_EQUAL("queue limit", statuses[0] + statuses[1] + statuses[2], 200 + 200 + 503);
+
+  auto stats = small_pool.stats();
+  CHECK_EQUAL("completed", stats.completed, 2);
+  CHECK_EQUAL("rejected", stats.rejected, 1);
+  CHECK_EQUAL("max queue depth", stats.max_queue_depth, 1);
+  CHECK_EQUAL("queue depth", stats.queue_depth, 0);
+  CHECK_EQUAL("busy", stats.busy_workers, 0);
+}
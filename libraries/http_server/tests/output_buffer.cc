@@ -0,0 +1,74 @@
+#include "test.hh"
+#include <lithium_http_server.hh>
+
+#include "symbols.hh"
+
+using namespace li;
+
+template <typename T> std::string format(T v) {
+  output_buffer b(100);
+  b << v;
+  return std::string(b.to_string_view());
+}
+
+int main() {
+
+  // Numbers.
+  CHECK_EQUAL("zero", format(0), "0");
+  CHECK_EQUAL("int", format(-42), "-42");
+  CHECK_EQUAL("size_t", format(std::size_t(12345678901234567890ull)), "12345678901234567890");
+  CHECK_EQUAL("int64 min", format(std::numeric_limits<int64_t>::min()), "-9223372036854775808");
+  CHECK_EQUAL("bool", format(true), "1");
+  CHECK_EQUAL("char", format('c'), "c");
+  CHECK_EQUAL("unsigned char", format((unsigned char)'c'), "c");
+  CHECK_EQUAL("string", format(std::string("abc")), "abc");
+  CHECK_EQUAL("double", std::stod(format(0.1)), 0.1);
+  CHECK_EQUAL("float", std::stof(format(1.5f)), 1.5f);
+
+  // Flush when full, and values larger than the buffer.
+  {
+    std::string out;
+    output_buffer b(8, [&](const char* s, int size) { out.append(s, size); });
+    for (int i = 0; i < 10; i++)
+      b << 'a';
+    b << 123456789 << "0123456789abcdef";
+    b.flush();
+    CHECK_EQUAL("flush", out, "aaaaaaaaaa1234567890123456789abcdef");
+  }
+
+  // Segment chain: no flush until flush().
+  {
+    int n_flush = 0;
+    std::string out;
+    output_buffer b(8, [&](const char* s, int size) {
+      n_flush++;
+      out.append(s, size);
+    });
+    b.set_segment_chain(true);
+    std::string ref;
+    for (int i = 0; i < 1000; i++) {
+      b << i << ',';
+      ref += std::to_string(i) + ',';
+    }
+    CHECK_EQUAL("chain no flush", n_flush, 0);
+    CHECK_EQUAL("chain size", b.size(), ref.size());
+
+    std::string segments;
+    b.for_each_segment([&](std::string_view s) { segments += s; });
+    CHECK_EQUAL("chain segments", segments, ref);
+    CHECK_EQUAL("chain view", b.to_string_view(), ref);
+    b.flush();
+    CHECK_EQUAL("chain flush", out, ref);
+
+    // Reuse after reset.
+    b << "abc";
+    CHECK_EQUAL("chain reset", b.to_string_view(), "abc");
+  }
+
+  {
+    growing_output_buffer<> b;
+    std::string ref(10000, 'x');
+    b << ref << 42;
+    CHECK_EQUAL("growing", b.to_string_view(), ref + "42");
+  }
+}
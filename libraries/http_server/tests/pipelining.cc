@@ -0,0 +1,131 @@
+#include <lithium_http_server.hh>
+#include <lithium_http_client.hh>
+
+#include "symbols.hh"
+#include "test.hh"
+
+using namespace li;
+
+int count(const std::string& s, const std::string& pattern) {
+  int n = 0;
+  for (size_t pos = s.find(pattern); pos != std::string::npos; pos = s.find(pattern, pos + 1))
+    n++;
+  return n;
+}
+
+// Send \requests in one write and read until \n_responses are received.
+// The last response body must end with "small".
+std::string send_pipelined(int port, const std::string& requests, int n_responses) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in server;
+  server.sin_addr.s_addr = inet_addr("127.0.0.1");
+  server.sin_family = AF_INET;
+  server.sin_port = htons(port);
+  CHECK_EQUAL("connect", connect(fd, (const sockaddr*)&server, sizeof(server)), 0);
+  CHECK_EQUAL("send", ::send(fd, requests.data(), requests.size(), 0),
+              ssize_t(requests.size()));
+
+  std::string received;
+  char buf[10000];
+  while (count(received, "HTTP/1.1 200 OK") < n_responses or received.size() < 5 or
+         received.compare(received.size() - 5, 5, "small")) {
+    int n = ::recv(fd, buf, sizeof(buf), 0);
+    if (n <= 0)
+      break;
+    received.append(buf, n);
+  }
+  close(fd);
+  return received;
+}
+
+// Send \request and close the connection without reading the response.
+void send_and_close(int port, const std::string& request) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in server;
+  server.sin_addr.s_addr = inet_addr("127.0.0.1");
+  server.sin_family = AF_INET;
+  server.sin_port = htons(port);
+  CHECK_EQUAL("connect", connect(fd, (const sockaddr*)&server, sizeof(server)), 0);
+  CHECK_EQUAL("send", ::send(fd, request.data(), request.size(), 0), ssize_t(request.size()));
+  close(fd);
+}
+
+int main() {
+
+  // Larger than the output buffer.
+  std::string big(200 * 1024, 'x');
+  // Larger than the zero copy threshold but fits in the json buffer.
+  std::string medium(30 * 1024, 'y');
+
+  http_api api;
+  api.get("/small") = [&](http_request& request, http_response& response) {
+    response.write("small");
+  };
+  api.get("/big") = [&](http_request& request, http_response& response) {
+    response.write(big);
+  };
+  api.get("/big_json") = [&](http_request& request, http_response& response) {
+    response.write_json(s::message = medium);
+  };
+
+  api.get("/huge_json") = [&](http_request& request, http_response& response) {
+    response.set_header("X-Big", std::string(2000, 'h'));
+    response.write_json(s::message = big, s::values = std::vector<int>(10000, 42));
+  };
+
+  api.get("/long_header") = [&](http_request& request, http_response& response) {
+    response.write(request.header("X-Long") == std::string(10000, 'h') ? "small" : "wrong");
+  };
+  api.post("/echo") = [&](http_request& request, http_response& response) {
+    response.write_json(request.post_parameters(s::message = std::string()));
+  };
+
+  http_serve(api, 12363, s::non_blocking);
+
+  // Large bodies.
+  CHECK_EQUAL("big", http_get("http://localhost:12363/big").body == big, true);
+  CHECK_EQUAL("big json",
+              http_get("http://localhost:12363/big_json").body == json_encode(s::message = medium),
+              true);
+  // JSON and headers larger than their buffers.
+  auto huge = http_get("http://localhost:12363/huge_json", s::fetch_headers);
+  assert(huge.body == json_encode(s::message = big, s::values = std::vector<int>(10000, 42)));
+  assert(huge.headers["X-Big"].compare(0, 2000, std::string(2000, 'h')) == 0);
+
+  // Pipelined requests: responses must come back complete and in order.
+  std::string get_small = "GET /small HTTP/1.1\r\nHost: localhost\r\n\r\n";
+  std::string get_big = "GET /big HTTP/1.1\r\nHost: localhost\r\n\r\n";
+  std::string requests;
+  for (int i = 0; i < 50; i++)
+    requests += get_small;
+  requests += get_big + get_small + get_big + get_small;
+
+  std::string received = send_pipelined(12363, requests, 54);
+  assert(count(received, "HTTP/1.1 200 OK") == 54);
+  assert(count(received, "small") == 52);
+  assert(received.size() > 2 * big.size());
+  size_t first_big = received.find(big);
+  assert(first_big != std::string::npos);
+  assert(received.find(big, first_big + big.size()) != std::string::npos);
+
+  // One request per connection.
+  CHECK_EQUAL("one request", count(send_pipelined(12363, get_small, 1), "HTTP/1.1 200 OK"), 1);
+
+  // Requests larger than the initial read buffer.
+  std::string long_header =
+      "GET /long_header HTTP/1.1\r\nX-Long: " + std::string(10000, 'h') + "\r\n\r\n";
+  CHECK_EQUAL("long header",
+              count(send_pipelined(12363, get_small + long_header, 2), "HTTP/1.1 200 OK"), 2);
+
+  // Bodies truncated by the end of the connection do not stall the reactors.
+  std::string truncated = "POST /echo HTTP/1.1\r\nContent-Length: 100\r\n\r\nmessage=ab";
+  for (int i = 0; i < 64; i++)
+    send_and_close(12363, truncated);
+  for (int i = 0; i < 16; i++)
+    CHECK_EQUAL("after truncated body", http_get("http://localhost:12363/small").body, "small");
+
+  CHECK_EQUAL("echo",
+              http_post("http://localhost:12363/echo", s::post_parameters = mmm(s::message = medium))
+                      .body == json_encode(s::message = medium),
+              true);
+}
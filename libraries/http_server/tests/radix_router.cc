@@ -0,0 +1,109 @@
+#include "test.hh"
+#include <lithium_http_server.hh>
+
+#include "symbols.hh"
+
+using namespace li;
+
+// Build a router from a list of routes. The value of a route is its spec.
+auto make_router(std::vector<std::string> routes) {
+  dynamic_routing_table<std::string> table;
+  for (auto r : routes)
+    table[r] = r.empty() ? "root" : r;
+  return radix_router<std::string>(table, [](const std::string& v) { return !v.empty(); });
+}
+
+std::string find(const radix_router<std::string>& router, std::string_view path) {
+  route_params params;
+  const std::string* v = router.find(path, params);
+  return v ? *v : "not found";
+}
+
+// The request and response of an api called directly, without a server.
+struct direct_request {
+  route_params url_params;
+  std::string_view url_spec;
+  const route_params_layout* url_params_layout = nullptr;
+};
+
+int main() {
+
+  {
+    auto router = make_router({"/hello", "/hello/world", "/api/v1/users", "/api/v1/users/{{id}}",
+                               "/api/v1/users/{{id}}/posts", "/api/v2/users", "/files/{{path...}}",
+                               "/x/me/z", "/x/{{id}}/y"});
+
+    CHECK_EQUAL("static", find(router, "/hello"), "/hello");
+    CHECK_EQUAL("static2", find(router, "/hello/world"), "/hello/world");
+    CHECK_EQUAL("merged", find(router, "/api/v1/users"), "/api/v1/users");
+    CHECK_EQUAL("merged_partial", find(router, "/api/v1"), "not found");
+    CHECK_EQUAL("merged_prefix", find(router, "/api/v1/usersx"), "not found");
+    CHECK_EQUAL("v2", find(router, "/api/v2/users"), "/api/v2/users");
+    CHECK_EQUAL("param", find(router, "/api/v1/users/42"), "/api/v1/users/{{id}}");
+    CHECK_EQUAL("param_child", find(router, "/api/v1/users/42/posts"), "/api/v1/users/{{id}}/posts");
+    CHECK_EQUAL("unknown", find(router, "/nothing"), "not found");
+    CHECK_EQUAL("path", find(router, "/files/a/b/c"), "/files/{{path...}}");
+
+    // A route without children matches any remaining path.
+    CHECK_EQUAL("leaf", find(router, "/hello/world/and/more"), "/hello/world");
+
+    // Backtracking from a static segment to a parameter.
+    CHECK_EQUAL("backtrack", find(router, "/x/me/y"), "/x/{{id}}/y");
+    CHECK_EQUAL("no_backtrack", find(router, "/x/me/z"), "/x/me/z");
+    CHECK_EQUAL("no_match", find(router, "/x/me"), "not found");
+
+    route_params params;
+    router.find("/api/v1/users/42/posts", params);
+    assert(params.size == 1 and params.values[0] == "42");
+    router.find("/files/a/b/c", params);
+    assert(params.size == 1 and params.values[0] == "/a/b/c");
+    router.find("/x/me/y", params);
+    assert(params.size == 1 and params.values[0] == "me");
+  }
+
+  {
+    // Root route.
+    auto router = make_router({"", "/a"});
+    CHECK_EQUAL("root", find(router, ""), "root");
+    CHECK_EQUAL("a", find(router, "/a"), "/a");
+    CHECK_EQUAL("empty", find(make_router({}), "/a"), "not found");
+  }
+
+  {
+    // Per verb handlers, DELETE and the last /.
+    http_api api;
+    api.get("/item/{{id}}") = [](http_request& request, http_response& response) {};
+    api.delete_("/item/{{id}}/") = [](http_request& request, http_response& response) {};
+    api.post("/sub/") = [](http_request& request, http_response& response) {};
+    assert(api.parse_verb("DELETE") == http_api::HTTP_DELETE);
+    assert(api.parse_verb("GET") == http_api::GET);
+    assert(api.parse_verb("PATCH") == http_api::ANY);
+
+    http_api root;
+    root.add_subapi("/v1", api);
+    root.freeze();
+    route_params params;
+    auto* handlers = root.router_.find("/v1/item/12", params);
+    assert(handlers);
+    assert((*handlers)[http_api::GET].handler);
+    assert((*handlers)[http_api::HTTP_DELETE].handler);
+    assert(!(*handlers)[http_api::POST].handler);
+    assert((*handlers)[http_api::GET].url_spec == "/v1/item/{{id}}");
+    assert(root.router_.find("/v1/sub", params));
+  }
+
+  {
+    // call freezes the routes when they changed.
+    api<direct_request, std::string> api;
+    api.get("/a") = [](direct_request& request, std::string& response) { response = "a"; };
+    direct_request request;
+    std::string response;
+    api.call("GET", "/a", request, response);
+    CHECK_EQUAL("call before freeze", response, "a");
+    api.get("/b/{{id}}") = [](direct_request& request, std::string& response) {
+      response = std::string(request.url_spec);
+    };
+    api.call("GET", "/b/42", request, response);
+    CHECK_EQUAL("route added after freeze", response, "/b/{{id}}");
+  }
+}
@@ -0,0 +1,78 @@
+#include <lithium_http_server.hh>
+#include <lithium_http_client.hh>
+
+#include "symbols.hh"
+#include "test.hh"
+
+using namespace li;
+
+int main() {
+
+  rate_limiter per_client(s::rate = 0.01, s::burst = 3, s::key = [](http_request& request) {
+    return request.get_parameters(s::client = std::string()).client;
+  });
+  rate_limiter per_ip(s::rate = 0.01, s::burst = 2);
+
+  http_api api;
+  api.get("/limited") = per_client([](http_request& request, http_response& response) {
+    response.write("ok");
+  });
+  http_api v1;
+  v1.get("/x") = [](http_request& request, http_response& response) { response.write("x"); };
+  v1.get("/y") = [](http_request& request, http_response& response) { response.write("y"); };
+  api.add_subapi("/v1", per_ip(v1));
+  http_serve(api, 12372, s::non_blocking, s::nthreads = 1);
+
+  // Per route, keyed by a get parameter.
+  for (int i = 0; i < 3; i++)
+    CHECK_EQUAL("burst", http_get("http://localhost:12372/limited?client=a").status, 200);
+  auto r = http_get("http://localhost:12372/limited?client=a", s::fetch_headers);
+  CHECK_EQUAL("limited", r.status, 429);
+  CHECK_EQUAL("retry after", atoi(r.headers["Retry-After"].c_str()), 100);
+  CHECK_EQUAL("other key", http_get("http://localhost:12372/limited?client=b").status, 200);
+
+  // Per api subtree: all the routes share the bucket of the client ip.
+  CHECK_EQUAL("subapi x", http_get("http://localhost:12372/v1/x").body, "x");
+  CHECK_EQUAL("subapi y", http_get("http://localhost:12372/v1/y").body, "y");
+  CHECK_EQUAL("subapi limited", http_get("http://localhost:12372/v1/x").status, 429);
+
+  auto stats = per_client.stats();
+  CHECK_EQUAL("admitted", stats.admitted, 4);
+  CHECK_EQUAL("rejected", stats.rejected, 1);
+
+  // Shards reconcile with the global buckets: a second thread sees the tokens taken by the first.
+  {
+    rate_limiter limiter(s::rate = 0.001, s::burst = 10, s::sync_interval = 0);
+    std::thread([&] {
+      for (int i = 0; i < 10; i++)
+        CHECK_EQUAL("thread 1", limiter.try_acquire("k"), 0);
+      assert(limiter.try_acquire("k") > 0);
+    }).join();
+    int admitted = 0;
+    std::thread([&] {
+      for (int i = 0; i < 5; i++)
+        admitted += limiter.try_acquire("k") == 0;
+    }).join();
+    // The first request of the new bucket is admitted before its first reconciliation.
+    CHECK_EQUAL("thread 2", admitted, 1);
+  }
+
+  // A limiter created where a destroyed one was gets its own shards.
+  for (int i = 0; i < 2; i++) {
+    rate_limiter limiter(s::rate = 0.001, s::burst = 1);
+    CHECK_EQUAL("new limiter", limiter.try_acquire("k"), 0);
+    assert(limiter.try_acquire("k") > 0);
+    CHECK_EQUAL("new limiter stats", limiter.stats().admitted, 1);
+  }
+
+  // CLOCK eviction of cold keys.
+  {
+    rate_limiter limiter(s::rate = 0.001, s::burst = 1, s::max_keys = 2);
+    CHECK_EQUAL("a", limiter.try_acquire("a"), 0);
+    CHECK_EQUAL("b", limiter.try_acquire("b"), 0);
+    CHECK_EQUAL("c evicts a", limiter.try_acquire("c"), 0);
+    assert(limiter.try_acquire("b") > 0);
+    CHECK_EQUAL("a is back with a full bucket", limiter.try_acquire("a"), 0);
+    CHECK_EQUAL("evicted", limiter.stats().evicted, 2);
+  }
+}
@@ -21,6 +21,20 @@ int main() {
   my_api.get("/url/{{id}}") = [&](http_request& request, http_response& response) {
     response.write_json(request.url_parameters(s::id = int()));
   };
+  my_api.get("/url/{{id}}/files/{{path...}}") = [&](http_request& request,
+                                                  http_response& response) {
+    response.write_json(request.url_parameters(s::path = std::string(), s::id = int()));
+  };
+  my_api.get("/scale/{{factor}}") = [&](http_request& request, http_response& response) {
+    response.write(std::to_string(request.url_parameters(s::factor = float()).factor * 2));
+  };
+  // Decoding the query string twice gives the same values: the request is not modified.
+  my_api.get("/twice") = [&](http_request& request, http_response& response) {
+    auto first = request.get_parameters(s::name = std::string_view(), s::id = int());
+    auto second = request.get_parameters(s::name = std::string_view(), s::id = int());
+    response.write(std::string(first.name) + "|" + std::string(second.name) + "|" +
+                   std::string(request.http_ctx.get_parameters_string()));
+  };
   my_api.post("/optional_not_set") = [&](http_request& request, http_response& response) {
     assert(!request.get_parameters(s::id = std::optional<int>()).id);
     assert(!request.post_parameters(s::id = std::optional<int>()).id);
@@ -66,6 +80,14 @@ int main() {
 
   CHECK_EQUAL("url", http_get("http://localhost:12338/url/42").body, ref);
   CHECK_EQUAL("url invalid type", http_get("http://localhost:12338/url/xxx").status, 400);
+  CHECK_EQUAL("url path", http_get("http://localhost:12338/url/42/files/a/b.txt").body,
+              json_encode(mmm(s::path = "/a/b.txt", s::id = 42)));
+  CHECK_EQUAL("url float", http_get("http://localhost:12338/scale/1.25").body, "2.500000");
+  CHECK_EQUAL("url invalid float", http_get("http://localhost:12338/scale/1.2x").status, 400);
+
+  CHECK_EQUAL("get string_view twice",
+              http_get("http://localhost:12338/twice?name=100%2541&id=%2B3").body,
+              "100%41|100%41|name=100%2541&id=%2B3");
 
   CHECK_EQUAL("not setting optionals.", http_post("http://localhost:12338/optional_not_set").status,
               200);
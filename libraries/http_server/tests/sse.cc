@@ -0,0 +1,121 @@
+#include <lithium_http_server.hh>
+#include <lithium_http_client.hh>
+
+#include "symbols.hh"
+#include "test.hh"
+
+using namespace li;
+
+// Open a raw connection, send a request and read until \expected is received.
+std::string read_until(int fd, const std::string& expected) {
+  std::string received;
+  char buf[1000];
+  while (received.find(expected) == std::string::npos) {
+    int n = ::recv(fd, buf, sizeof(buf), 0);
+    if (n <= 0)
+      break;
+    received.append(buf, n);
+  }
+  return received;
+}
+
+int open_event_stream(int port, const char* url) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in server;
+  server.sin_addr.s_addr = inet_addr("127.0.0.1");
+  server.sin_family = AF_INET;
+  server.sin_port = htons(port);
+  CHECK_EQUAL("connect", connect(fd, (const sockaddr*)&server, sizeof(server)), 0);
+  std::string rq = std::string("GET ") + url + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+  CHECK_EQUAL("send", ::send(fd, rq.data(), rq.size(), 0), ssize_t(rq.size()));
+  return fd;
+}
+
+void wait_for_subscribers(sse_hub& hub, std::string topic, int n) {
+  while (hub.subscribers_count(topic) != n)
+    usleep(1000);
+}
+
+int main() {
+
+  sse_hub hub;
+  http_api api;
+
+  api.get("/events") = [&](http_request& request, http_response& response) {
+    auto subscription = hub.subscribe(request, "news");
+    sse_stream stream(response);
+    while (auto event = subscription.wait())
+      stream.send(*event);
+  };
+
+  api.get("/poll") = [&](http_request& request, http_response& response) {
+    auto subscription = hub.subscribe(request, "poll");
+    if (auto event = subscription.wait_for(std::chrono::milliseconds(300)))
+      response.write(event->data());
+    else
+      response.set_status(204);
+  };
+
+  std::atomic<int> hangups = 0;
+  api.get("/wait") = [&](http_request& request, http_response& response) {
+    auto subscription = hub.subscribe(request, "wait");
+    if (!subscription.wait())
+      hangups++;
+  };
+
+  http_serve(api, 12362, s::non_blocking, s::nthreads = 2);
+
+  { // Long polling timeout.
+    timer t;
+    t.start();
+    auto r = http_get("http://localhost:12362/poll");
+    t.end();
+    assert(r.status == 204);
+    assert(t.ms() >= 300);
+    assert(hub.subscribers_count("poll") == 0);
+  }
+
+  { // Long polling, publish from another thread.
+    std::thread publisher([&] {
+      wait_for_subscribers(hub, "poll", 1);
+      CHECK_EQUAL("publish poll", hub.publish("poll", "hello"), 1);
+    });
+    auto r = http_get("http://localhost:12362/poll");
+    publisher.join();
+    assert(r.status == 200);
+    assert(r.body == "hello");
+  }
+
+  { // Server sent events, fan-out to two connections.
+    int fd1 = open_event_stream(12362, "/events");
+    int fd2 = open_event_stream(12362, "/events");
+    wait_for_subscribers(hub, "news", 2);
+
+    CHECK_EQUAL("publish news", hub.publish("news", "line1\nline2", "update"), 2);
+    std::string expected = "event: update\ndata: line1\ndata: line2\n\n";
+    for (int fd : {fd1, fd2}) {
+      std::string received = read_until(fd, expected);
+      std::cout << received << std::endl;
+      assert(received.find("Transfer-Encoding: chunked") != std::string::npos);
+      assert(received.find("Content-Type: text/event-stream") != std::string::npos);
+      assert(received.find(expected) != std::string::npos);
+    }
+
+    CHECK_EQUAL("publish second", hub.publish("news", "second"), 2);
+    std::string second = read_until(fd1, "data: second\n\n");
+    assert(second.find("data: second\n\n") != std::string::npos);
+
+    // Closing the connection unsubscribes.
+    close(fd1);
+    close(fd2);
+    wait_for_subscribers(hub, "news", 0);
+  }
+
+  { // The client hangs up while the handler waits: wait returns nullptr.
+    int fd = open_event_stream(12362, "/wait");
+    wait_for_subscribers(hub, "wait", 1);
+    close(fd);
+    wait_for_subscribers(hub, "wait", 0);
+    assert(hangups == 1);
+  }
+}
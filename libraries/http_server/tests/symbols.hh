@@ -5,6 +5,11 @@
     LI_SYMBOL(address)
 #endif
 
+#ifndef LI_SYMBOL_admission_control
+#define LI_SYMBOL_admission_control
+    LI_SYMBOL(admission_control)
+#endif
+
 #ifndef LI_SYMBOL_age
 #define LI_SYMBOL_age
     LI_SYMBOL(age)
@@ -15,11 +20,36 @@
     LI_SYMBOL(auto_increment)
 #endif
 
+#ifndef LI_SYMBOL_balancing
+#define LI_SYMBOL_balancing
+    LI_SYMBOL(balancing)
+#endif
+
 #ifndef LI_SYMBOL_before_insert
 #define LI_SYMBOL_before_insert
     LI_SYMBOL(before_insert)
 #endif
 
+#ifndef LI_SYMBOL_body_buffer
+#define LI_SYMBOL_body_buffer
+    LI_SYMBOL(body_buffer)
+#endif
+
+#ifndef LI_SYMBOL_burst
+#define LI_SYMBOL_burst
+    LI_SYMBOL(burst)
+#endif
+
+#ifndef LI_SYMBOL_busy_poll
+#define LI_SYMBOL_busy_poll
+    LI_SYMBOL(busy_poll)
+#endif
+
+#ifndef LI_SYMBOL_capture
+#define LI_SYMBOL_capture
+    LI_SYMBOL(capture)
+#endif
+
 #ifndef LI_SYMBOL_charset
 #define LI_SYMBOL_charset
     LI_SYMBOL(charset)
@@ -30,6 +60,26 @@
     LI_SYMBOL(city)
 #endif
 
+#ifndef LI_SYMBOL_client
+#define LI_SYMBOL_client
+    LI_SYMBOL(client)
+#endif
+
+#ifndef LI_SYMBOL_codel_interval
+#define LI_SYMBOL_codel_interval
+    LI_SYMBOL(codel_interval)
+#endif
+
+#ifndef LI_SYMBOL_codel_target
+#define LI_SYMBOL_codel_target
+    LI_SYMBOL(codel_target)
+#endif
+
+#ifndef LI_SYMBOL_connections
+#define LI_SYMBOL_connections
+    LI_SYMBOL(connections)
+#endif
+
 #ifndef LI_SYMBOL_database
 #define LI_SYMBOL_database
     LI_SYMBOL(database)
@@ -40,6 +90,21 @@
     LI_SYMBOL(disable_check_certificate)
 #endif
 
+#ifndef LI_SYMBOL_duration
+#define LI_SYMBOL_duration
+    LI_SYMBOL(duration)
+#endif
+
+#ifndef LI_SYMBOL_factor
+#define LI_SYMBOL_factor
+    LI_SYMBOL(factor)
+#endif
+
+#ifndef LI_SYMBOL_fetch_headers
+#define LI_SYMBOL_fetch_headers
+    LI_SYMBOL(fetch_headers)
+#endif
+
 #ifndef LI_SYMBOL_get
 #define LI_SYMBOL_get
     LI_SYMBOL(get)
@@ -75,16 +140,51 @@
     LI_SYMBOL(json_encoded)
 #endif
 
+#ifndef LI_SYMBOL_key
+#define LI_SYMBOL_key
+    LI_SYMBOL(key)
+#endif
+
+#ifndef LI_SYMBOL_listen_backlog
+#define LI_SYMBOL_listen_backlog
+    LI_SYMBOL(listen_backlog)
+#endif
+
 #ifndef LI_SYMBOL_login
 #define LI_SYMBOL_login
     LI_SYMBOL(login)
 #endif
 
+#ifndef LI_SYMBOL_max_idle_connections
+#define LI_SYMBOL_max_idle_connections
+    LI_SYMBOL(max_idle_connections)
+#endif
+
+#ifndef LI_SYMBOL_max_in_flight
+#define LI_SYMBOL_max_in_flight
+    LI_SYMBOL(max_in_flight)
+#endif
+
+#ifndef LI_SYMBOL_max_keys
+#define LI_SYMBOL_max_keys
+    LI_SYMBOL(max_keys)
+#endif
+
+#ifndef LI_SYMBOL_max_queue
+#define LI_SYMBOL_max_queue
+    LI_SYMBOL(max_queue)
+#endif
+
 #ifndef LI_SYMBOL_message
 #define LI_SYMBOL_message
     LI_SYMBOL(message)
 #endif
 
+#ifndef LI_SYMBOL_ms
+#define LI_SYMBOL_ms
+    LI_SYMBOL(ms)
+#endif
+
 #ifndef LI_SYMBOL_name
 #define LI_SYMBOL_name
     LI_SYMBOL(name)
@@ -100,6 +200,11 @@
     LI_SYMBOL(nthreads)
 #endif
 
+#ifndef LI_SYMBOL_on_body
+#define LI_SYMBOL_on_body
+    LI_SYMBOL(on_body)
+#endif
+
 #ifndef LI_SYMBOL_password
 #define LI_SYMBOL_password
     LI_SYMBOL(password)
@@ -110,6 +215,16 @@
     LI_SYMBOL(path)
 #endif
 
+#ifndef LI_SYMBOL_pipelined
+#define LI_SYMBOL_pipelined
+    LI_SYMBOL(pipelined)
+#endif
+
+#ifndef LI_SYMBOL_poisson
+#define LI_SYMBOL_poisson
+    LI_SYMBOL(poisson)
+#endif
+
 #ifndef LI_SYMBOL_port
 #define LI_SYMBOL_port
     LI_SYMBOL(port)
@@ -130,6 +245,36 @@
     LI_SYMBOL(primary_key)
 #endif
 
+#ifndef LI_SYMBOL_rate
+#define LI_SYMBOL_rate
+    LI_SYMBOL(rate)
+#endif
+
+#ifndef LI_SYMBOL_ratio
+#define LI_SYMBOL_ratio
+    LI_SYMBOL(ratio)
+#endif
+
+#ifndef LI_SYMBOL_record_requests
+#define LI_SYMBOL_record_requests
+    LI_SYMBOL(record_requests)
+#endif
+
+#ifndef LI_SYMBOL_requests
+#define LI_SYMBOL_requests
+    LI_SYMBOL(requests)
+#endif
+
+#ifndef LI_SYMBOL_retries
+#define LI_SYMBOL_retries
+    LI_SYMBOL(retries)
+#endif
+
+#ifndef LI_SYMBOL_retry_after
+#define LI_SYMBOL_retry_after
+    LI_SYMBOL(retry_after)
+#endif
+
 #ifndef LI_SYMBOL_secret_key
 #define LI_SYMBOL_secret_key
     LI_SYMBOL(secret_key)
@@ -150,6 +295,16 @@
     LI_SYMBOL(ssl_key)
 #endif
 
+#ifndef LI_SYMBOL_sync_interval
+#define LI_SYMBOL_sync_interval
+    LI_SYMBOL(sync_interval)
+#endif
+
+#ifndef LI_SYMBOL_tcp_nodelay
+#define LI_SYMBOL_tcp_nodelay
+    LI_SYMBOL(tcp_nodelay)
+#endif
+
 #ifndef LI_SYMBOL_test1
 #define LI_SYMBOL_test1
     LI_SYMBOL(test1)
@@ -160,6 +315,11 @@
     LI_SYMBOL(test2)
 #endif
 
+#ifndef LI_SYMBOL_timeout
+#define LI_SYMBOL_timeout
+    LI_SYMBOL(timeout)
+#endif
+
 #ifndef LI_SYMBOL_user
 #define LI_SYMBOL_user
     LI_SYMBOL(user)
@@ -170,3 +330,13 @@
     LI_SYMBOL(user_id)
 #endif
 
+#ifndef LI_SYMBOL_value
+#define LI_SYMBOL_value
+    LI_SYMBOL(value)
+#endif
+
+#ifndef LI_SYMBOL_values
+#define LI_SYMBOL_values
+    LI_SYMBOL(values)
+#endif
+
@@ -0,0 +1,50 @@
+#include <lithium_http_server.hh>
+#include <lithium_http_client.hh>
+
+#include "symbols.hh"
+#include "test.hh"
+
+using namespace li;
+
+int get_socket_option(int fd, int level, int option) {
+  int value = 0;
+  socklen_t len = sizeof(value);
+  getsockopt(fd, level, option, &value, &len);
+  return value;
+}
+
+int main() {
+
+  tcp_server_options options;
+  options.listen_backlog = 16;
+  options.tcp_nodelay = true;
+  options.send_buffer_size = 64 * 1024;
+  options.receive_buffer_size = 64 * 1024;
+  options.tcp_defer_accept = 1;
+
+  // Listening socket.
+  int listen_fd = impl::create_and_bind(12368, SOCK_STREAM, options);
+  assert(listen_fd >= 0);
+  // Linux doubles the buffer sizes to account for its bookkeeping.
+  assert(get_socket_option(listen_fd, SOL_SOCKET, SO_RCVBUF) >= 64 * 1024);
+  CHECK_EQUAL("defer accept", get_socket_option(listen_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT) > 0,
+              true);
+  close(listen_fd);
+
+  // Accepted sockets.
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  impl::configure_accepted_socket(fd, options);
+  CHECK_EQUAL("nodelay", get_socket_option(fd, IPPROTO_TCP, TCP_NODELAY), 1);
+  assert(get_socket_option(fd, SOL_SOCKET, SO_SNDBUF) >= 64 * 1024);
+  close(fd);
+
+  // A busy polling server.
+  http_api api;
+  api.get("/hello") = [&](http_request& request, http_response& response) {
+    response.write("hello");
+  };
+  http_serve(api, 12369, s::non_blocking, s::nthreads = 1, s::busy_poll = 50,
+             s::tcp_nodelay = true, s::listen_backlog = 128);
+  for (int i = 0; i < 10; i++)
+    CHECK_EQUAL("busy poll", http_get("http://localhost:12369/hello").body, "hello");
+}
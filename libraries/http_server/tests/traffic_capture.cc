@@ -0,0 +1,57 @@
+#include <lithium_http_server.hh>
+#include <lithium_http_client.hh>
+
+#include "symbols.hh"
+#include "test.hh"
+
+using namespace li;
+
+int main() {
+
+  std::string path = "/tmp/lithium_traffic_capture_test.bin";
+  traffic_capture capture(path);
+
+  http_api api;
+  api.get("/hello") = [](http_request& request, http_response& response) {
+    response.write("hello");
+  };
+  api.post("/echo") = [](http_request& request, http_response& response) {
+    response.write(request.http_ctx.read_whole_body());
+  };
+  api.get("/error") = [](http_request& request, http_response& response) {
+    throw http_error::bad_request("bad");
+  };
+  http_serve(api, 12393, s::non_blocking, s::nthreads = 1, s::capture = &capture);
+
+  http_client client;
+  client.get("http://localhost:12393/hello?name=john");
+  client.post("http://localhost:12393/echo", s::post_parameters = mmm(s::name = "a"));
+  client.get("http://localhost:12393/error");
+  client.get("http://localhost:12393/hello");
+  http_get("http://localhost:12393/missing");
+
+  capture.flush();
+  CHECK_EQUAL("recorded", capture.recorded(), 5);
+  CHECK_EQUAL("dropped", capture.dropped(), 0);
+
+  traffic_capture_reader reader(path);
+  std::vector<traffic_record> records;
+  traffic_record r;
+  while (reader.next(r))
+    records.push_back(r);
+  CHECK_EQUAL("records", records.size(), 5);
+
+  CHECK_EQUAL("request", records[0].request.substr(0, 26), "GET /hello?name=john HTTP/");
+  CHECK_EQUAL("end of headers", records[0].request.substr(records[0].request.size() - 4),
+              "\r\n\r\n");
+  CHECK_EQUAL("body", records[1].request.substr(records[1].request.size() - 6), "name=a");
+  CHECK_EQUAL("status", records[0].status, 200);
+  CHECK_EQUAL("error status", records[2].status, 400);
+  CHECK_EQUAL("status after error", records[3].status, 200);
+  CHECK_EQUAL("not found", records[4].status, 404);
+
+  // The client keeps its connection alive.
+  CHECK_EQUAL("same connection", records[3].connection, records[0].connection);
+  for (size_t i = 1; i < records.size(); i++)
+    assert(records[i].time >= records[i - 1].time);
+}
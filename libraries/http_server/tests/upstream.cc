@@ -0,0 +1,119 @@
+#include <lithium_http_server.hh>
+#include <lithium_http_client.hh>
+
+#include "symbols.hh"
+#include "test.hh"
+
+using namespace li;
+
+http_api make_backend(std::string name, const std::string& big) {
+  http_api api;
+  api.get("/hello") = [name](http_request& request, http_response& response) {
+    auto params = request.get_parameters(s::name = std::string());
+    response.set_header("X-Backend", name);
+    response.write("hello ", params.name);
+  };
+  api.get("/big") = [&big](http_request& request, http_response& response) {
+    response.write(std::string_view(big));
+  };
+  api.get("/chunked") = [](http_request& request, http_response& response) {
+    response.http_ctx.start_chunked_response();
+    response.http_ctx.write_chunk("abc");
+    response.http_ctx.write_chunk("def");
+  };
+  api.post("/echo") = [](http_request& request, http_response& response) {
+    response.write(request.http_ctx.read_whole_body());
+  };
+  api.get("/forwarded") = [](http_request& request, http_response& response) {
+    response.write(request.header("X-Forwarded-For"));
+  };
+  api.get("/missing") = [](http_request& request, http_response& response) {
+    throw http_error::not_found("nope");
+  };
+  return api;
+}
+
+auto forward_to(upstream& u, std::string target = "") {
+  return [&u, target](http_request& request, http_response& response) {
+    u.forward(request, response, target);
+  };
+}
+
+int main() {
+
+  std::string big(1 << 20, 0);
+  for (int i = 0; i < int(big.size()); i++)
+    big[i] = 'a' + i % 26;
+
+  http_serve(make_backend("A", big), 12380, s::non_blocking, s::nthreads = 1);
+  http_serve(make_backend("B", big), 12381, s::non_blocking, s::nthreads = 1);
+
+  upstream round_robin({"127.0.0.1:12380", "127.0.0.1:12381"});
+  upstream single({"127.0.0.1:12380"});
+  upstream with_dead({"127.0.0.1:12389", "127.0.0.1:12380"});
+  upstream dead({"127.0.0.1:12389"}, s::retries = 0);
+  upstream p2c({"127.0.0.1:12380", "127.0.0.1:12381"},
+               s::balancing = upstream_balancing::power_of_two_choices);
+
+  http_api proxy;
+  proxy.get("/hello") = forward_to(round_robin);
+  proxy.get("/big") = forward_to(single);
+  proxy.get("/chunked") = forward_to(single);
+  proxy.post("/echo") = forward_to(single);
+  proxy.get("/forwarded") = forward_to(single);
+  proxy.get("/missing") = forward_to(single);
+  proxy.get("/retry") = forward_to(with_dead, "/hello?name=retry");
+  proxy.get("/dead") = forward_to(dead, "/hello");
+  proxy.get("/p2c") = forward_to(p2c, "/hello?name=p2c");
+  // An upstream created where a destroyed one was gets its own shard.
+  long long temporary_requests = 0;
+  proxy.get("/temporary") = [&](http_request& request, http_response& response) {
+    upstream temporary(std::vector<std::string>{"127.0.0.1:12380"});
+    temporary.forward(request, response, "/hello?name=temporary");
+    temporary_requests += temporary.stats().requests;
+  };
+  // Read by the server thread, after the previous handlers returned.
+  proxy.get("/temporary_requests") = [&](http_request& request, http_response& response) {
+    response.write(std::to_string(temporary_requests));
+  };
+  http_serve(proxy, 12382, s::non_blocking, s::nthreads = 1);
+
+  // Round robin over keep-alive connections.
+  for (int i = 0; i < 4; i++) {
+    auto r = http_get("http://localhost:12382/hello", s::get_parameters = mmm(s::name = "john"),
+                      s::fetch_headers);
+    CHECK_EQUAL("hello", r.body, "hello john");
+    CHECK_EQUAL("round robin", r.headers["X-Backend"].substr(0, 1), std::string(i % 2 ? "B" : "A"));
+  }
+  auto stats = round_robin.stats();
+  CHECK_EQUAL("requests", stats.requests, 4);
+  CHECK_EQUAL("connections", stats.connections, 2);
+  CHECK_EQUAL("reused", stats.reused, 2);
+
+  // Bodies: spliced, chunked, posted.
+  CHECK_EQUAL("big", http_get("http://localhost:12382/big").body == big, true);
+  CHECK_EQUAL("chunked", http_get("http://localhost:12382/chunked").body, "abcdef");
+  CHECK_EQUAL("echo",
+              http_post("http://localhost:12382/echo", s::post_parameters = mmm(s::name = "john"))
+                  .body,
+              "name=john");
+  CHECK_EQUAL("forwarded for", http_get("http://localhost:12382/forwarded").body, "127.0.0.1");
+  auto missing = http_get("http://localhost:12382/missing");
+  CHECK_EQUAL("status", missing.status, 404);
+  CHECK_EQUAL("status body", missing.body, "nope");
+  CHECK_EQUAL("single connection", single.stats().connections, 1);
+
+  // Retries on connection failures.
+  CHECK_EQUAL("retry", http_get("http://localhost:12382/retry").body, "hello retry");
+  CHECK_EQUAL("retries", with_dead.stats().retries, 1);
+  CHECK_EQUAL("bad gateway", http_get("http://localhost:12382/dead").status, 502);
+
+  for (int i = 0; i < 4; i++)
+    CHECK_EQUAL("p2c", http_get("http://localhost:12382/p2c").body, "hello p2c");
+
+  for (int i = 0; i < 3; i++)
+    CHECK_EQUAL("temporary", http_get("http://localhost:12382/temporary").body,
+                "hello temporary");
+  CHECK_EQUAL("temporary requests", http_get("http://localhost:12382/temporary_requests").body,
+              "3");
+}
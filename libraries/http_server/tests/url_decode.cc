@@ -40,6 +40,62 @@ int main() {
     assert(obj.name == "Jo hn");
   }
 
+  { // Escaped values and keys are decoded, unknown keys are skipped.
+    std::string s = "unknown=1&test1%5Bname%5D=John+Doe&test1[age]=4%32&city=New%20York&ratio=0.5";
+    auto obj = mmm(s::test1 = mmm(s::name = std::string(), s::age = int()),
+                   s::city = std::string_view(), s::ratio = float());
+    monotonic_arena arena;
+    url_decode(s, obj, &arena);
+    assert(obj.test1.name == "John Doe");
+    assert(obj.test1.age == 42);
+    assert(obj.city == "New York");
+    assert(obj.ratio == 0.5f);
+
+    // Escaped std::string_view values are decoded in the arena, the input is unchanged.
+    const std::string input = s;
+    auto obj2 = mmm(s::city = std::string_view());
+    url_decode(s, obj2, &arena);
+    assert(obj2.city == "New York");
+    assert(s == input);
+
+    // Without an arena, escaped std::string_view values are an error, not a write in
+    // the input (which can be read only).
+    assert(is_error("city=New%20York", obj2));
+    auto literal = mmm(s::name = std::string_view());
+    url_decode("name=a%20b", literal, &arena);
+    assert(literal.name == "a b");
+  }
+
+  { // Escaped % decodes once: %2541 is %41.
+    monotonic_arena arena;
+    std::string s = "name=100%2541&id=3";
+    auto obj = mmm(s::name = std::string_view(), s::id = int());
+    url_decode(s, obj, &arena);
+    assert(obj.name == "100%41");
+    url_decode(s, obj, &arena);
+    assert(obj.name == "100%41");
+    assert(s == "name=100%2541&id=3");
+  }
+
+  { // Leading + sign of numbers, escaped as %2B.
+    auto obj = mmm(s::id = int(), s::ratio = double());
+    url_decode("id=%2B5&ratio=%2B0.25", obj);
+    assert(obj.id == 5);
+    assert(obj.ratio == 0.25);
+    url_decode("id=-5&ratio=-0.25", obj);
+    assert(obj.id == -5);
+    assert(obj.ratio == -0.25);
+    assert(is_error("id=%2B-5", obj));
+  }
+
+  { // Optional values.
+    auto obj = mmm(s::name = std::optional<std::string>(), s::age = std::optional<int>());
+    url_decode("age=3", obj);
+    assert(!obj.name);
+    assert(obj.age.value() == 3);
+    url_decode("", obj);
+  }
+
   { // Simple Array.
     const std::string s = "age[0]=42&age[1]=22";
 
@@ -92,8 +92,9 @@ template <typename S> struct json_parser {
       return JSON_INVALID_TYPE<T>::error;
   }
 
-  // Strings
-  inline json_error_code fill(std::string& str) {
+  // Strings, with any allocator.
+  template <typename A>
+  inline json_error_code fill(std::basic_string<char, std::char_traits<char>, A>& str) {
     eat_spaces();
     str.clear();
     return json_to_utf8(ss, str);
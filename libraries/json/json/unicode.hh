@@ -21,7 +21,8 @@ inline decltype(auto) wrap_json_output_stream(std::ostringstream& s) {
   return mmm(s::append = [&s](auto c) { s << c; });
 }
 
-inline decltype(auto) wrap_json_output_stream(std::string& s) {
+template <typename A>
+inline decltype(auto) wrap_json_output_stream(std::basic_string<char, std::char_traits<char>, A>& s) {
   return mmm(s::append = [&s](auto c) {
     using C = std::remove_reference_t<decltype(c)>;
     if constexpr(std::is_same_v<C, char> || std::is_same_v<C, unsigned char> || std::is_same_v<C, int>)
@@ -59,15 +59,10 @@ template <typename Y> struct mysql_functions_non_blocking {
 
     bool error = false;
     while (status) {
-      try {
-        fiber_.yield();
-      } catch (typename Y::exception_type& e) {
-        // Yield thrown a exception (probably because a closed connection).
-        // Mark the connection as broken because it is left in a undefined state.
-        connection_status = 1;
-        throw std::move(e);
-      }
-
+      // A closed client connection does not interrupt the call: the connection would be
+      // left in an undefined state. The next query fails instead
+      // (LI_MYSQL_NONBLOCKING_QUERY_WRAPPER).
+      fiber_.yield();
       status = fn_cont(&ret, std::forward<A1>(a1), status);
     }
     if (ret and ret != MYSQL_NO_DATA and ret != MYSQL_DATA_TRUNCATED)
@@ -83,18 +78,25 @@ template <typename Y> struct mysql_functions_non_blocking {
   template <typename... A> auto FN(int& connection_status, A&&... a) {                                                     \
     return mysql_non_blocking_call(connection_status, #FN, ERR, ::FN##_start, ::FN##_cont, std::forward<A>(a)...);              \
   }
+// Calls starting a new query fail fast when the client is gone.
+#define LI_MYSQL_NONBLOCKING_QUERY_WRAPPER(ERR, FN)                                                     \
+  template <typename... A> auto FN(int& connection_status, A&&... a) {                                                     \
+    sql_check_client_connection(fiber_);                                                             \
+    return mysql_non_blocking_call(connection_status, #FN, ERR, ::FN##_start, ::FN##_cont, std::forward<A>(a)...);              \
+  }
 
   LI_MYSQL_NONBLOCKING_WRAPPER(mysql_error, mysql_fetch_row)
-  LI_MYSQL_NONBLOCKING_WRAPPER(mysql_error, mysql_real_query)
+  LI_MYSQL_NONBLOCKING_QUERY_WRAPPER(mysql_error, mysql_real_query)
   LI_MYSQL_NONBLOCKING_WRAPPER(mysql_error, mysql_free_result)
-  LI_MYSQL_NONBLOCKING_WRAPPER(mysql_stmt_error, mysql_stmt_execute)
+  LI_MYSQL_NONBLOCKING_QUERY_WRAPPER(mysql_stmt_error, mysql_stmt_execute)
   LI_MYSQL_NONBLOCKING_WRAPPER(mysql_stmt_error, mysql_stmt_reset)
-  LI_MYSQL_NONBLOCKING_WRAPPER(mysql_stmt_error, mysql_stmt_prepare)
+  LI_MYSQL_NONBLOCKING_QUERY_WRAPPER(mysql_stmt_error, mysql_stmt_prepare)
   LI_MYSQL_NONBLOCKING_WRAPPER(mysql_stmt_error, mysql_stmt_fetch)
   LI_MYSQL_NONBLOCKING_WRAPPER(mysql_stmt_error, mysql_stmt_free_result)
   LI_MYSQL_NONBLOCKING_WRAPPER(mysql_stmt_error, mysql_stmt_store_result)
 
 #undef LI_MYSQL_NONBLOCKING_WRAPPER
+#undef LI_MYSQL_NONBLOCKING_QUERY_WRAPPER
 
   Y& fiber_;
 };
@@ -101,17 +101,10 @@ inline mysql_connection_data* mysql_database_impl::new_connection(Y& fiber) {
       fiber.epoll_add(mysql_fd, EVFILT_READ | EVFILT_WRITE);
     #endif
       
-    while (status)
-      try {
-        fiber.yield();
-        status = mysql_real_connect_cont(&connection, mysql, status);
-      } catch (typename Y::exception_type& e) {
-        // Yield thrown a exception (probably because a closed connection).
-        // std::cerr << "Warning: yield threw an exception while connecting to mysql: "
-        //  << total_number_of_mysql_connections << std::endl;
-        mysql_close(mysql);
-        throw std::move(e);
-      }
+    while (status) {
+      fiber.yield();
+      status = mysql_real_connect_cont(&connection, mysql, status);
+    }
     if (!connection) {
       // Error in mysql_real_connect_cont
       return nullptr;
@@ -43,6 +43,8 @@ template <typename B> struct mysql_result {
   bool end_of_result_ = false;
   int current_row_num_fields_ = 0;
   
+  mysql_result(B& mysql_wrapper, std::shared_ptr<mysql_connection_data> connection)
+      : mysql_wrapper_(mysql_wrapper), connection_(std::move(connection)) {}
   mysql_result& operator=(mysql_result&) = delete;
   mysql_result(const mysql_result&) = delete;
 
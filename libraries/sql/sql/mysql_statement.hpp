@@ -30,8 +30,7 @@ sql_result<mysql_statement_result<B>> mysql_statement<B>::operator()(T&&... args
   mysql_wrapper_.mysql_stmt_execute(connection_->error_, data_.stmt_);
 
   // Return the wrapped mysql result.
-  return sql_result<mysql_statement_result<B>>{
-      mysql_statement_result<B>{mysql_wrapper_, data_, connection_}};
+  return sql_result<mysql_statement_result<B>>{mysql_wrapper_, data_, connection_};
 }
 
 } // namespace li
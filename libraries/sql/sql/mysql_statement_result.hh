@@ -21,6 +21,9 @@ namespace li {
  */
 template <typename B> struct mysql_statement_result {
 
+  mysql_statement_result(B& mysql_wrapper, mysql_statement_data& data,
+                         std::shared_ptr<mysql_connection_data> connection)
+      : mysql_wrapper_(mysql_wrapper), data_(data), connection_(std::move(connection)) {}
   mysql_statement_result& operator=(mysql_statement_result&) = delete;
   mysql_statement_result(const mysql_statement_result&) = delete;
 
@@ -58,10 +58,10 @@ template <typename Y> struct pgsql_connection {
   // pgsql_statement<Y> operator()(const std::string& rq) { return prepare(rq)(); }
 
   auto operator()(const std::string& rq) {
+    sql_check_client_connection(fiber_);
     if (!PQsendQueryParams(connection_, rq.c_str(), 0, nullptr, nullptr, nullptr, nullptr, 1))
       throw std::runtime_error(std::string("Postresql error:") + PQerrorMessage(connection_));
-    return sql_result<pgsql_result<Y>>{
-        pgsql_result<Y>{this->data_, this->fiber_, data_->error_}};
+    return sql_result<pgsql_result<Y>>{this->data_, this->fiber_, data_->error_};
   }
 
   // PQsendQueryParams
@@ -81,6 +81,7 @@ template <typename Y> struct pgsql_connection {
     }
     std::string stmt_name = boost::lexical_cast<std::string>(stm_cache_.size());
 
+    sql_check_client_connection(fiber_);
     if (!PQsendPrepare(connection_, stmt_name.c_str(), rq.c_str(), 0, nullptr)) {
       throw std::runtime_error(std::string("PQsendPrepare error") + PQerrorMessage(connection_));
     }
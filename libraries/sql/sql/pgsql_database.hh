@@ -104,24 +104,18 @@ struct pgsql_database_impl {
       fiber.epoll_add(pgsql_fd, EVFILT_READ | EVFILT_WRITE);
     #endif
 
-    try {
-      while (status != PGRES_POLLING_FAILED and status != PGRES_POLLING_OK) {
-        int new_pgsql_fd = PQsocket(connection);
-        if (new_pgsql_fd != pgsql_fd) {
-          pgsql_fd = new_pgsql_fd;
-          #if __linux__
-            fiber.epoll_add(pgsql_fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP);
-          #elif __APPLE__
-            fiber.epoll_add(pgsql_fd, EVFILT_READ | EVFILT_WRITE);
-          #endif
-        }
-        fiber.yield();
-        status = PQconnectPoll(connection);
+    while (status != PGRES_POLLING_FAILED and status != PGRES_POLLING_OK) {
+      int new_pgsql_fd = PQsocket(connection);
+      if (new_pgsql_fd != pgsql_fd) {
+        pgsql_fd = new_pgsql_fd;
+        #if __linux__
+          fiber.epoll_add(pgsql_fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP);
+        #elif __APPLE__
+          fiber.epoll_add(pgsql_fd, EVFILT_READ | EVFILT_WRITE);
+        #endif
       }
-    } catch (typename Y::exception_type& e) {
-      // Yield thrown a exception (probably because a closed connection).
-      PQfinish(connection);
-      throw std::move(e);
+      fiber.yield();
+      status = PQconnectPoll(connection);
     }
     // std::cout << "CONNECTED " << std::endl;
     #if __linux__
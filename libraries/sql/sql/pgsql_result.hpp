@@ -39,28 +39,10 @@ PGresult* pg_wait_for_next_result(PGconn* connection, Y& fiber,
 
     if (PQisBusy(connection)) {
       // std::cout << "isbusy" << std::endl;
-      try {
-        fiber.yield();
-      } catch (typename Y::exception_type& e) {
-        // Free results.
-        // Yield thrown a exception (probably because a closed connection).
-        // Flush the remaining results.
-        while (true)
-        {
-          if (PQconsumeInput(connection) == 0)
-          {
-            connection_status = 1;
-            break;
-          }
-          if (!PQisBusy(connection))
-          {
-            PGresult* res = PQgetResult(connection);
-            if (res) PQclear(res);
-            else break;
-          }
-        }
-        throw std::move(e);
-      }
+      // If the client closed its connection, keep waiting: the query completes and the
+      // database connection goes back to the pool in a clean state. The next query of
+      // this client fails (sql_check_client_connection).
+      fiber.yield();
     } else {
       // std::cout << "notbusy" << std::endl;
       PGresult* res = PQgetResult(connection);
@@ -89,18 +71,13 @@ template <typename Y> PGresult* pgsql_result<Y>::wait_for_next_result() {
 }
 
 template <typename Y> void pgsql_result<Y>::flush_results() {
-  try {
-    while (true)
-    {
-      if (connection_->error_ == 1) break;
-      PGresult* res = pg_wait_for_next_result(connection_->pgconn_, fiber_, connection_->error_, true);
-      if (res)
-        PQclear(res);
-      else break;
-    }
-  } catch (typename Y::exception_type& e) {
-    // Forward fiber execptions.
-    throw std::move(e);
+  while (true)
+  {
+    if (connection_->error_ == 1) break;
+    PGresult* res = pg_wait_for_next_result(connection_->pgconn_, fiber_, connection_->error_, true);
+    if (res)
+      PQclear(res);
+    else break;
   }
 }
 
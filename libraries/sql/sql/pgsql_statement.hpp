@@ -127,6 +127,7 @@ sql_result<pgsql_result<Y>> pgsql_statement<Y>::operator()(T&&... args) {
     i += bind_compute_nparam(a);
   });
 
+  sql_check_client_connection(fiber_);
   if (!PQsendQueryPrepared(connection_->pgconn_, data_.stmt_name.c_str(), nparams, values, lengths, binary,
                            1)) {
     throw std::runtime_error(std::string("Postresql error:") + PQerrorMessage(connection_->pgconn_));
@@ -135,8 +136,7 @@ sql_result<pgsql_result<Y>> pgsql_statement<Y>::operator()(T&&... args) {
   // Now calling pqflush seems to work aswell...
   // connection_->flush(this->fiber_);
 
-  return sql_result<pgsql_result<Y>>{
-      pgsql_result<Y>{this->connection_, this->fiber_}};
+  return sql_result<pgsql_result<Y>>{this->connection_, this->fiber_};
 }
 
 // FIXME long long int affected_rows() { return pgsql_stmt_affected_rows(data_.stmt_); }
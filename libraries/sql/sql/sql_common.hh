@@ -1,8 +1,35 @@
 #pragma once
 
+#include <stdexcept>
 #include <string>
+#include <type_traits>
+#include <utility>
 
 namespace li {
+
+// True if the fiber type Y knows when the client connection it serves is closed.
+template <typename Y, typename = void> struct has_is_closed : std::false_type {};
+template <typename Y>
+struct has_is_closed<Y, std::void_t<decltype(std::declval<Y&>().is_closed())>> : std::true_type {
+};
+
+// Thrown when the client of the fiber closed its connection. It is not an application
+// error: the handlers of http_serve drop the request silently, without logging it or
+// answering.
+struct sql_client_closed : public std::runtime_error {
+  sql_client_closed()
+      : std::runtime_error("sql request cancelled: the client closed its connection.") {}
+};
+
+// Throw sql_client_closed if the client of \fiber closed its connection: no new query or
+// database connection is started for a client that is gone. Calls already sent to the
+// database complete, so the database connection goes back to the pool in a clean state.
+template <typename Y> void sql_check_client_connection(Y& fiber) {
+  if constexpr (has_is_closed<Y>::value)
+    if (fiber.is_closed())
+      throw sql_client_closed();
+}
+
 struct sql_blob : public std::string {
   using std::string::string;
   using std::string::operator=;
@@ -1,8 +1,12 @@
 #pragma once
 
+#include <algorithm>
 #include <deque>
+#include <type_traits>
 #include <unordered_map>
 
+#include <li/sql/sql_common.hh>
+
 namespace li {
 // thread local map of sql_database<I>* -> sql_database_thread_local_data<I>*;
 // This is used to store the thread local async connection pool.
@@ -22,7 +26,6 @@ template <typename I> struct sql_database_thread_local_data {
 };
 
 struct active_yield {
-  typedef std::runtime_error exception_type;
   int fiber_id = 0;
   inline void defer(std::function<void()>) {}
   inline void defer_fiber_resume(int fiber_id) {}
@@ -33,6 +36,12 @@ struct active_yield {
   inline void yield() {}
 };
 
+// True if the fiber type Y can park: wait without being resumed until another fiber
+// calls defer_fiber_resume(Y::fiber_id).
+template <typename Y, typename = void> struct has_park : std::false_type {};
+template <typename Y>
+struct has_park<Y, std::void_t<decltype(std::declval<Y&>().park())>> : std::true_type {};
+
 template <typename I> struct sql_database {
   I impl;
 
@@ -100,6 +109,9 @@ template <typename I> struct sql_database {
    *                                            descriptor fd
    *    - void yield() // Yield the current epoll fiber.
    *
+   *  When the pool is full, fibers providing bool park() are parked until a connection
+   *  is released instead of yielding in a loop.
+   *
    * @return the new connection.
    */
   template <typename Y> inline auto connect(Y& fiber) {
@@ -124,6 +136,7 @@ template <typename I> struct sql_database {
     bool reuse = false;
     while (!data) {
 
+      sql_check_client_connection(fiber);
       if (!pool.connections.empty()) {
         auto lock = [&pool, this] {
           if constexpr (std::is_same_v<Y, active_yield>)
@@ -139,18 +152,28 @@ template <typename I> struct sql_database {
             throw std::runtime_error("Maximum number of sql connection exeeded.");
           else
           {
-            // std::cout << "Waiting for a free sql connection..." << std::endl;
-            //  pool.waiting_list.push_back(fiber.fiber_id);
-            fiber.yield();
+            // Wait for a connection to go back to the pool: the deleter of the connection
+            // resumes the first fiber of waiting_list. Fibers that cannot park keep
+            // yielding. A fiber whose client is gone stops at the next iteration.
+            if constexpr (has_park<Y>::value) {
+              pool.waiting_list.push_back(fiber.fiber_id);
+              if (!fiber.park())
+                fiber.yield();
+              auto it = std::find(pool.waiting_list.begin(), pool.waiting_list.end(),
+                                  fiber.fiber_id);
+              if (it != pool.waiting_list.end())
+                pool.waiting_list.erase(it);
+            } else
+              fiber.yield();
           }
           continue;
         }
         pool.n_connections++;
         try {
           data = impl.new_connection(fiber);
-        } catch (typename Y::exception_type& e) {
+        } catch (...) {
           pool.n_connections--;
-          throw std::move(e);
+          throw;
         }
 
         if (!data)
@@ -162,6 +185,14 @@ template <typename I> struct sql_database {
     assert(data->error_ == 0);
     
     auto sptr = std::shared_ptr<connection_data_type>(data, [pool, this, &fiber](connection_data_type* data) {
+          // The released connection, or its slot, goes to the first waiting fiber.
+          if constexpr (!std::is_same_v<Y, active_yield>)
+            if (pool.waiting_list.size()) {
+              int next_fiber_id = pool.waiting_list.front();
+              pool.waiting_list.pop_front();
+              fiber.defer_fiber_resume(next_fiber_id);
+            }
+
           if (!data->error_ && pool.connections.size() < pool.max_connections) {
             auto lock = [&pool, this] {
               if constexpr (std::is_same_v<Y, active_yield>)
@@ -170,14 +201,6 @@ template <typename I> struct sql_database {
             }();
 
             pool.connections.push_back(data);
-            if constexpr (!std::is_same_v<Y, active_yield>)
-             if (pool.waiting_list.size())
-             {
-               int next_fiber_id = pool.waiting_list.front();
-               pool.waiting_list.pop_front();
-               fiber.defer_fiber_resume(next_fiber_id);
-             }
-           
           } else {
             // This is not an error since connection pool.max_connections can vary during execution.
             // It is ok just to discard extraneous in order to reach a lower pool.max_connections.
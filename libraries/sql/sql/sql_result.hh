@@ -29,7 +29,8 @@ template <typename I> struct sql_result {
 
   I impl_;
 
-  sql_result() = delete;
+  // Construct the implementation in place with \args.
+  template <typename... A> sql_result(A&&... args) : impl_{std::forward<A>(args)...} {}
   sql_result& operator=(sql_result&) = delete;
   sql_result(const sql_result&) = delete;
 
@@ -1,6 +1,9 @@
 #pragma once
 
+#include <cstdint>
 #include <li/symbol/ast.hh>
+#include <string_view>
+#include <type_traits>
 #include <utility>
 
 namespace li {
@@ -50,7 +53,7 @@ class symbol : public assignable<S>,
     }                                                                                              \
     template <typename T> static constexpr auto has_member(long) { return std::false_type{}; }     \
                                                                                                    \
-    static inline auto symbol_string() { return #NAME; }                                           \
+    static constexpr auto symbol_string() { return #NAME; }                                        \
     static inline auto json_key_string() { return "\"" #NAME "\":"; }                              \
   };                                                                                               \
   static constexpr NAME##_t NAME;                                                                  \
@@ -108,9 +111,22 @@ template <typename T, typename S> decltype(auto) symbol_member_or_getter_access(
   }
 }
 
-template <typename S> auto symbol_string(symbol<S> v) { return S::symbol_string(); }
+template <typename S> constexpr auto symbol_string(symbol<S> v) { return S::symbol_string(); }
 
 template <typename V> auto symbol_string(V v, typename V::_iod_symbol_type* = 0) {
   return V::_iod_symbol_type::symbol_string();
 }
+
+// FNV-1a hash of a string. Allows to match a string known at runtime against symbols.
+constexpr uint64_t symbol_hash(std::string_view str) {
+  uint64_t h = 0xcbf29ce484222325ull;
+  for (char c : str)
+    h = (h ^ uint8_t(c)) * 0x100000001b3ull;
+  return h;
+}
+
+// Hash of the symbol name, computed at compile time.
+template <typename S> constexpr uint64_t symbol_hash(symbol<S>) {
+  return std::integral_constant<uint64_t, symbol_hash(std::string_view(S::symbol_string()))>::value;
+}
 } // namespace li
@@ -7,18 +7,32 @@
 
 #pragma once
 
+#include <algorithm>
 #include <any>
 #include <arpa/inet.h>
+#include <array>
 #include <atomic>
+#include <bitset>
 #include <boost/context/continuation.hpp>
+#include <boost/context/pooled_fixedsize_stack.hpp>
 #include <boost/lexical_cast.hpp>
 #include <cassert>
+#include <cctype>
+#include <charconv>
 #include <chrono>
 #include <cmath>
+#include <condition_variable>
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#endif
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
 #include <cstring>
 #include <curl/curl.h>
 #include <deque>
 #include <errno.h>
+#include <exception>
 #include <fcntl.h>
 #include <functional>
 #include <iostream>
@@ -26,6 +40,7 @@
 #include <libkern/OSByteOrder.h>
 #endif
 #include <libpq-fe.h>
+#include <limits>
 #if __APPLE__
 #include <machine/endian.h>
 #endif
@@ -34,26 +49,35 @@
 #include <mutex>
 #include <mysql.h>
 #include <netdb.h>
+#include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <new>
 #include <openssl/err.h>
 #include <openssl/ssl.h>
 #include <optional>
+#include <poll.h>
+#include <queue>
 #include <random>
 #include <set>
 #include <signal.h>
 #include <sqlite3.h>
 #include <sstream>
+#include <stdexcept>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <string>
 #include <string_view>
+#include <strings.h>
 #if __linux__
 #include <sys/epoll.h>
 #endif
 #if __APPLE__
 #include <sys/event.h>
 #endif
+#if __linux__
+#include <sys/eventfd.h>
+#endif
 #include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -61,6 +85,7 @@
 #include <sys/uio.h>
 #include <thread>
 #include <tuple>
+#include <type_traits>
 #include <unistd.h>
 #include <unordered_map>
 #include <utility>
@@ -769,7 +794,7 @@ class symbol : public assignable<S>,
     }                                                                                              \
     template <typename T> static constexpr auto has_member(long) { return std::false_type{}; }     \
                                                                                                    \
-    static inline auto symbol_string() { return #NAME; }                                           \
+    static constexpr auto symbol_string() { return #NAME; }                                        \
     static inline auto json_key_string() { return "\"" #NAME "\":"; }                              \
   };                                                                                               \
   static constexpr NAME##_t NAME;                                                                  \
@@ -827,11 +852,24 @@ template <typename T, typename S> decltype(auto) symbol_member_or_getter_access(
   }
 }
 
-template <typename S> auto symbol_string(symbol<S> v) { return S::symbol_string(); }
+template <typename S> constexpr auto symbol_string(symbol<S> v) { return S::symbol_string(); }
 
 template <typename V> auto symbol_string(V v, typename V::_iod_symbol_type* = 0) {
   return V::_iod_symbol_type::symbol_string();
 }
+
+// FNV-1a hash of a string. Allows to match a string known at runtime against symbols.
+constexpr uint64_t symbol_hash(std::string_view str) {
+  uint64_t h = 0xcbf29ce484222325ull;
+  for (char c : str)
+    h = (h ^ uint8_t(c)) * 0x100000001b3ull;
+  return h;
+}
+
+// Hash of the symbol name, computed at compile time.
+template <typename S> constexpr uint64_t symbol_hash(symbol<S>) {
+  return std::integral_constant<uint64_t, symbol_hash(std::string_view(S::symbol_string()))>::value;
+}
 } // namespace li
 
 #endif // LITHIUM_SINGLE_HEADER_GUARD_LI_SYMBOL_SYMBOL_HH
@@ -1091,6 +1129,30 @@ constexpr auto forward_tuple_as_metamap(std::tuple<S...> keys, const std::tuple<
 
 
 namespace li {
+
+// True if the fiber type Y knows when the client connection it serves is closed.
+template <typename Y, typename = void> struct has_is_closed : std::false_type {};
+template <typename Y>
+struct has_is_closed<Y, std::void_t<decltype(std::declval<Y&>().is_closed())>> : std::true_type {
+};
+
+// Thrown when the client of the fiber closed its connection. It is not an application
+// error: the handlers of http_serve drop the request silently, without logging it or
+// answering.
+struct sql_client_closed : public std::runtime_error {
+  sql_client_closed()
+      : std::runtime_error("sql request cancelled: the client closed its connection.") {}
+};
+
+// Throw sql_client_closed if the client of \fiber closed its connection: no new query or
+// database connection is started for a client that is gone. Calls already sent to the
+// database complete, so the database connection goes back to the pool in a clean state.
+template <typename Y> void sql_check_client_connection(Y& fiber) {
+  if constexpr (has_is_closed<Y>::value)
+    if (fiber.is_closed())
+      throw sql_client_closed();
+}
+
 struct sql_blob : public std::string {
   using std::string::string;
   using std::string::operator=;
@@ -1326,7 +1388,8 @@ template <typename I> struct sql_result {
 
   I impl_;
 
-  sql_result() = delete;
+  // Construct the implementation in place with \args.
+  template <typename... A> sql_result(A&&... args) : impl_{std::forward<A>(args)...} {}
   sql_result& operator=(sql_result&) = delete;
   sql_result(const sql_result&) = delete;
 
@@ -1652,8 +1715,7 @@ struct sqlite_statement {
     if (last_step_ret != SQLITE_ROW and last_step_ret != SQLITE_DONE)
       throw std::runtime_error(sqlite3_errstr(last_step_ret));
 
-    return sql_result<sqlite_statement_result>{
-        sqlite_statement_result{this->db_, this->stmt_, last_step_ret}};
+    return sql_result<sqlite_statement_result>{this->db_, this->stmt_, last_step_ret};
   }
 
   inline int bind(sqlite3_stmt* stmt, int pos, double d) const {
@@ -1813,6 +1875,11 @@ struct sqlite_database {
     LI_SYMBOL(body)
 #endif
 
+#ifndef LI_SYMBOL_body_buffer
+#define LI_SYMBOL_body_buffer
+    LI_SYMBOL(body_buffer)
+#endif
+
 #ifndef LI_SYMBOL_disable_check_certificate
 #define LI_SYMBOL_disable_check_certificate
     LI_SYMBOL(disable_check_certificate)
@@ -1838,6 +1905,11 @@ struct sqlite_database {
     LI_SYMBOL(json_encoded)
 #endif
 
+#ifndef LI_SYMBOL_on_body
+#define LI_SYMBOL_on_body
+    LI_SYMBOL(on_body)
+#endif
+
 #ifndef LI_SYMBOL_post_parameters
 #define LI_SYMBOL_post_parameters
     LI_SYMBOL(post_parameters)
@@ -2134,7 +2206,8 @@ inline decltype(auto) wrap_json_output_stream(std::ostringstream& s) {
   return mmm(s::append = [&s](auto c) { s << c; });
 }
 
-inline decltype(auto) wrap_json_output_stream(std::string& s) {
+template <typename A>
+inline decltype(auto) wrap_json_output_stream(std::basic_string<char, std::char_traits<char>, A>& s) {
   return mmm(s::append = [&s](auto c) {
     using C = std::remove_reference_t<decltype(c)>;
     if constexpr(std::is_same_v<C, char> || std::is_same_v<C, unsigned char> || std::is_same_v<C, int>)
@@ -2679,8 +2752,9 @@ template <typename S> struct json_parser {
       return JSON_INVALID_TYPE<T>::error;
   }
 
-  // Strings
-  inline json_error_code fill(std::string& str) {
+  // Strings, with any allocator.
+  template <typename A>
+  inline json_error_code fill(std::basic_string<char, std::char_traits<char>, A>& str) {
     eat_spaces();
     str.clear();
     return json_to_utf8(ss, str);
@@ -3319,19 +3393,90 @@ inline size_t curl_header_callback(char* buffer, size_t size, size_t nitems, voi
   return total_size;
 }
 
+namespace impl {
+
+// Process wide libcurl share handle: the clients share their DNS cache and TLS sessions.
+// The connection cache is not shared: libcurl does not support sharing it between threads
+// running transfers concurrently. Each client keeps its own connections, and the pool keeps
+// the clients alive between requests.
+struct curl_share_handle {
+  curl_share_handle() {
+    curl_global_init(CURL_GLOBAL_ALL);
+    share = curl_share_init();
+    curl_share_setopt(share, CURLSHOPT_LOCKFUNC, lock);
+    curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, unlock);
+    curl_share_setopt(share, CURLSHOPT_USERDATA, this);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+  }
+  ~curl_share_handle() { curl_share_cleanup(share); }
+
+  static void lock(CURL*, curl_lock_data data, curl_lock_access, void* userptr) {
+    ((curl_share_handle*)userptr)->mutexes[data].lock();
+  }
+  static void unlock(CURL*, curl_lock_data data, void* userptr) {
+    ((curl_share_handle*)userptr)->mutexes[data].unlock();
+  }
+
+  CURLSH* share;
+  std::mutex mutexes[CURL_LOCK_DATA_LAST];
+};
+
+inline CURLSH* curl_share() {
+  static curl_share_handle handle;
+  return handle.share;
+}
+
+// Text of a url or post parameter.
+template <typename T> std::string curl_parameter_string(const T& v) {
+  if constexpr (std::is_convertible_v<const T&, std::string_view>)
+    return std::string(std::string_view(v));
+  else if constexpr (std::is_integral_v<T> and sizeof(T) > 1)
+    return std::to_string(v);
+  else {
+    std::ostringstream ss;
+    ss << v;
+    return ss.str();
+  }
+}
+
+// Write callback streaming the response body to the callable pointed by \userdata.
+// The transfer is aborted if it returns false.
+template <typename F>
+size_t curl_stream_callback(char* ptr, size_t size, size_t nmemb, void* userdata) {
+  F& f = *(F*)userdata;
+  std::string_view data(ptr, size * nmemb);
+  if constexpr (std::is_same_v<std::invoke_result_t<F&, std::string_view>, bool>)
+    return f(data) ? data.size() : 0;
+  else {
+    f(data);
+    return data.size();
+  }
+}
+
+} // namespace impl
+
 struct http_client {
 
   enum http_method { HTTP_GET, HTTP_POST, HTTP_PUT, HTTP_DELETE };
 
   inline http_client(const std::string& prefix = "") : url_prefix_(prefix) {
-    curl_global_init(CURL_GLOBAL_ALL);
+    share_ = impl::curl_share();
     curl_ = curl_easy_init();
   }
 
   inline ~http_client() { curl_easy_cleanup(curl_); }
 
+  http_client(const http_client&) = delete;
   inline http_client& operator=(const http_client&) = delete;
 
+  // Options, in addition to s::get_parameters, s::post_parameters, s::json_encoded,
+  // s::fetch_headers and s::disable_check_certificate:
+  //   s::on_body = [] (std::string_view data) { ... }: stream the response body to a
+  //                callable instead of returning it. Returning false aborts the transfer.
+  //   s::body_buffer = &buffer: write the response body in the std::string buffer, reusing
+  //                its memory across requests.
+  // With s::on_body or s::body_buffer, the result has no s::body.
   template <typename... A>
   inline auto operator()(http_method http_method, const std::string_view& url, const A&... args) {
 
@@ -3339,52 +3484,48 @@ struct http_client {
 
     auto arguments = mmm(args...);
     constexpr bool fetch_headers = has_key<decltype(arguments)>(s::fetch_headers);
+    constexpr bool stream_body = has_key<decltype(arguments)>(s::on_body);
+    constexpr bool user_buffer = has_key<decltype(arguments)>(s::body_buffer);
+
+    // Options are set again for each request. The connections, the caches and the cookies
+    // of the handle are kept.
+    curl_easy_reset(curl_);
+    curl_easy_setopt(curl_, CURLOPT_SHARE, share_);
+    curl_easy_setopt(curl_, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
 
     // Generate url.
-    std::ostringstream url_ss;
-    url_ss << url_prefix_ << url;
+    std::string url_string;
+    url_string.reserve(url_prefix_.size() + url.size());
+    url_string.append(url_prefix_).append(url);
 
     // Get params
     auto get_params = li::get_or(arguments, s::get_parameters, mmm());
     bool first = true;
     li::map(get_params, [&](auto k, auto v) {
-      if (first)
-        url_ss << '?';
-      else
-        url_ss << "&";
-      std::ostringstream value_ss;
-      value_ss << v;
-      char* escaped = curl_easy_escape(curl_, value_ss.str().c_str(), value_ss.str().size());
-      url_ss << li::symbol_string(k) << '=' << escaped;
+      url_string += first ? '?' : '&';
+      url_string += li::symbol_string(k);
+      url_string += '=';
+      append_escaped(url_string, impl::curl_parameter_string(v));
       first = false;
-      curl_free(escaped);
     });
 
-    // std::cout << url_ss.str() << std::endl;
     // Pass the url to libcurl.
-    curl_easy_setopt(curl_, CURLOPT_URL, url_ss.str().c_str());
+    curl_easy_setopt(curl_, CURLOPT_URL, url_string.c_str());
 
     // HTTP_POST parameters.
     bool is_urlencoded = not li::has_key(arguments, s::json_encoded);
-    std::ostringstream post_stream;
     std::string rq_body;
     if (is_urlencoded) { // urlencoded
-      req_body_buffer_.str("");
-
       auto post_params = li::get_or(arguments, s::post_parameters, mmm());
       first = true;
       li::map(post_params, [&](auto k, auto v) {
         if (!first)
-          post_stream << "&";
-        post_stream << li::symbol_string(k) << "=";
-        std::ostringstream value_str;
-        value_str << v;
-        char* escaped = curl_easy_escape(curl_, value_str.str().c_str(), value_str.str().size());
+          rq_body += '&';
+        rq_body += li::symbol_string(k);
+        rq_body += '=';
+        append_escaped(rq_body, impl::curl_parameter_string(v));
         first = false;
-        post_stream << escaped;
-        curl_free(escaped);
       });
-      rq_body = post_stream.str();
       req_body_buffer_.str(rq_body);
 
     } else // Json encoded
@@ -3393,6 +3534,7 @@ struct http_client {
     // HTTP HTTP_POST
     if (http_method == HTTP_POST) {
       curl_easy_setopt(curl_, CURLOPT_POST, 1);
+      curl_easy_setopt(curl_, CURLOPT_POSTFIELDSIZE, long(rq_body.size()));
       curl_easy_setopt(curl_, CURLOPT_POSTFIELDS, rq_body.c_str());
     }
 
@@ -3423,9 +3565,21 @@ struct http_client {
     curl_easy_setopt(curl_, CURLOPT_COOKIEJAR,
                      0); // Enable cookies but do no write a cookiejar.
 
+    // Response body.
     body_buffer_.clear();
-    curl_easy_setopt(curl_, CURLOPT_WRITEFUNCTION, curl_write_callback);
-    curl_easy_setopt(curl_, CURLOPT_WRITEDATA, this);
+    if constexpr (stream_body) {
+      curl_easy_setopt(curl_, CURLOPT_WRITEFUNCTION,
+                       impl::curl_stream_callback<std::decay_t<decltype(arguments.on_body)>>);
+      curl_easy_setopt(curl_, CURLOPT_WRITEDATA, &arguments.on_body);
+    } else if constexpr (user_buffer) {
+      std::string* buffer = arguments.body_buffer;
+      buffer->clear();
+      curl_easy_setopt(curl_, CURLOPT_WRITEFUNCTION, curl_append_callback);
+      curl_easy_setopt(curl_, CURLOPT_WRITEDATA, buffer);
+    } else {
+      curl_easy_setopt(curl_, CURLOPT_WRITEFUNCTION, curl_write_callback);
+      curl_easy_setopt(curl_, CURLOPT_WRITEDATA, this);
+    }
 
     curl_easy_setopt(curl_, CURLOPT_HTTPHEADER, headers_list);
 
@@ -3441,23 +3595,31 @@ struct http_client {
 
     // Send the request.
     char errbuf[CURL_ERROR_SIZE];
+    errbuf[0] = 0;
     curl_easy_setopt(curl_, CURLOPT_ERRORBUFFER, errbuf);
-    if (curl_easy_perform(curl_) != CURLE_OK) {
+    CURLcode res = curl_easy_perform(curl_);
+    curl_slist_free_all(headers_list);
+    if (res != CURLE_OK) {
       std::ostringstream errss;
-      errss << "Libcurl error when sending request: " << errbuf;
+      errss << "Libcurl error when sending request: "
+            << (errbuf[0] ? errbuf : curl_easy_strerror(res));
       throw std::runtime_error(errss.str());
     }
-    curl_slist_free_all(headers_list);
     // Read response code.
     long response_code;
     curl_easy_getinfo(curl_, CURLINFO_RESPONSE_CODE, &response_code);
 
     // Return response object.
-    if constexpr (fetch_headers)
-      return mmm(s::status = response_code, s::body = body_buffer_,
-                 s::headers = response_headers_map);
+    if constexpr (stream_body or user_buffer) {
+      if constexpr (fetch_headers)
+        return mmm(s::status = response_code, s::headers = std::move(response_headers_map));
+      else
+        return mmm(s::status = response_code);
+    } else if constexpr (fetch_headers)
+      return mmm(s::status = response_code, s::body = std::move(body_buffer_),
+                 s::headers = std::move(response_headers_map));
     else
-      return mmm(s::status = response_code, s::body = body_buffer_);
+      return mmm(s::status = response_code, s::body = std::move(body_buffer_));
   }
 
   template <typename... P> auto get(const std::string& url, P... params) {
@@ -3473,6 +3635,9 @@ struct http_client {
     return this->operator()(HTTP_DELETE, url, params...);
   }
 
+  // Forget the cookies received by this client.
+  inline void clear_cookies() { curl_easy_setopt(curl_, CURLOPT_COOKIELIST, "ALL"); }
+
   inline void read(char* ptr, int size) { body_buffer_.append(ptr, size); }
 
   inline std::streamsize write(char* ptr, int size) {
@@ -3480,7 +3645,19 @@ struct http_client {
     return ret;
   }
 
+  inline void append_escaped(std::string& out, const std::string& value) {
+    char* escaped = curl_easy_escape(curl_, value.c_str(), value.size());
+    out += escaped;
+    curl_free(escaped);
+  }
+
+  static size_t curl_append_callback(char* ptr, size_t size, size_t nmemb, void* userdata) {
+    ((std::string*)userdata)->append(ptr, size * nmemb);
+    return size * nmemb;
+  }
+
   CURL* curl_;
+  CURLSH* share_;
   std::map<std::string, std::string> cookies_;
   std::string body_buffer_;
   std::stringbuf req_body_buffer_;
@@ -3498,17 +3675,95 @@ size_t curl_write_callback(char* ptr, size_t size, size_t nmemb, void* userdata)
   return size * nmemb;
 }
 
+// Idle http_clients kept for reuse, with their connections. Thread safe.
+//
+//   http_client_pool pool;
+//   auto r = pool.get("http://example.com/"); // Borrows a client for the request.
+//   {
+//     auto client = pool.acquire(); // Borrows a client (and its cookies) for several requests.
+//     client->post(...);
+//     client->get(...);
+//   } // Goes back to the pool, without its cookies.
+struct http_client_pool {
+
+  struct releaser {
+    http_client_pool* pool;
+    void operator()(http_client* client) const { pool->release(client); }
+  };
+  typedef std::unique_ptr<http_client, releaser> handle;
+
+  inline http_client_pool(int max_idle_clients = 16) : max_idle_clients_(max_idle_clients) {
+    impl::curl_share(); // Created first, destroyed after the pool.
+  }
+
+  inline ~http_client_pool() {
+    for (http_client* client : idle_)
+      delete client;
+  }
+
+  http_client_pool(const http_client_pool&) = delete;
+  http_client_pool& operator=(const http_client_pool&) = delete;
+
+  inline handle acquire() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!idle_.empty()) {
+        http_client* client = idle_.back();
+        idle_.pop_back();
+        return handle(client, releaser{this});
+      }
+    }
+    return handle(new http_client, releaser{this});
+  }
+
+  template <typename... P> auto get(const std::string& url, P... params) {
+    return acquire()->get(url, params...);
+  }
+  template <typename... P> auto put(const std::string& url, P... params) {
+    return acquire()->put(url, params...);
+  }
+  template <typename... P> auto post(const std::string& url, P... params) {
+    return acquire()->post(url, params...);
+  }
+  template <typename... P> auto delete_(const std::string& url, P... params) {
+    return acquire()->delete_(url, params...);
+  }
+
+private:
+  inline void release(http_client* client) {
+    client->clear_cookies();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (int(idle_.size()) < max_idle_clients_) {
+        idle_.push_back(client);
+        return;
+      }
+    }
+    delete client;
+  }
+
+  int max_idle_clients_;
+  std::mutex mutex_;
+  std::vector<http_client*> idle_;
+};
+
+// The pool used by http_get, http_post, http_put and http_delete.
+inline http_client_pool& default_http_client_pool() {
+  static http_client_pool pool;
+  return pool;
+}
+
 template <typename... P> auto http_get(const std::string& url, P... params) {
-  return http_client{}.get(url, params...);
+  return default_http_client_pool().get(url, params...);
 }
 template <typename... P> auto http_post(const std::string& url, P... params) {
-  return http_client{}.post(url, params...);
+  return default_http_client_pool().post(url, params...);
 }
 template <typename... P> auto http_put(const std::string& url, P... params) {
-  return http_client{}.put(url, params...);
+  return default_http_client_pool().put(url, params...);
 }
 template <typename... P> auto http_delete(const std::string& url, P... params) {
-  return http_client{}.delete_(url, params...);
+  return default_http_client_pool().delete_(url, params...);
 }
 
 } // namespace li
@@ -4118,15 +4373,10 @@ template <typename Y> struct mysql_functions_non_blocking {
 
     bool error = false;
     while (status) {
-      try {
-        fiber_.yield();
-      } catch (typename Y::exception_type& e) {
-        // Yield thrown a exception (probably because a closed connection).
-        // Mark the connection as broken because it is left in a undefined state.
-        connection_status = 1;
-        throw std::move(e);
-      }
-
+      // A closed client connection does not interrupt the call: the connection would be
+      // left in an undefined state. The next query fails instead
+      // (LI_MYSQL_NONBLOCKING_QUERY_WRAPPER).
+      fiber_.yield();
       status = fn_cont(&ret, std::forward<A1>(a1), status);
     }
     if (ret and ret != MYSQL_NO_DATA and ret != MYSQL_DATA_TRUNCATED)
@@ -4142,18 +4392,25 @@ template <typename Y> struct mysql_functions_non_blocking {
   template <typename... A> auto FN(int& connection_status, A&&... a) {                                                     \
     return mysql_non_blocking_call(connection_status, #FN, ERR, ::FN##_start, ::FN##_cont, std::forward<A>(a)...);              \
   }
+// Calls starting a new query fail fast when the client is gone.
+#define LI_MYSQL_NONBLOCKING_QUERY_WRAPPER(ERR, FN)                                                     \
+  template <typename... A> auto FN(int& connection_status, A&&... a) {                                                     \
+    sql_check_client_connection(fiber_);                                                             \
+    return mysql_non_blocking_call(connection_status, #FN, ERR, ::FN##_start, ::FN##_cont, std::forward<A>(a)...);              \
+  }
 
   LI_MYSQL_NONBLOCKING_WRAPPER(mysql_error, mysql_fetch_row)
-  LI_MYSQL_NONBLOCKING_WRAPPER(mysql_error, mysql_real_query)
+  LI_MYSQL_NONBLOCKING_QUERY_WRAPPER(mysql_error, mysql_real_query)
   LI_MYSQL_NONBLOCKING_WRAPPER(mysql_error, mysql_free_result)
-  LI_MYSQL_NONBLOCKING_WRAPPER(mysql_stmt_error, mysql_stmt_execute)
+  LI_MYSQL_NONBLOCKING_QUERY_WRAPPER(mysql_stmt_error, mysql_stmt_execute)
   LI_MYSQL_NONBLOCKING_WRAPPER(mysql_stmt_error, mysql_stmt_reset)
-  LI_MYSQL_NONBLOCKING_WRAPPER(mysql_stmt_error, mysql_stmt_prepare)
+  LI_MYSQL_NONBLOCKING_QUERY_WRAPPER(mysql_stmt_error, mysql_stmt_prepare)
   LI_MYSQL_NONBLOCKING_WRAPPER(mysql_stmt_error, mysql_stmt_fetch)
   LI_MYSQL_NONBLOCKING_WRAPPER(mysql_stmt_error, mysql_stmt_free_result)
   LI_MYSQL_NONBLOCKING_WRAPPER(mysql_stmt_error, mysql_stmt_store_result)
 
 #undef LI_MYSQL_NONBLOCKING_WRAPPER
+#undef LI_MYSQL_NONBLOCKING_QUERY_WRAPPER
 
   Y& fiber_;
 };
@@ -4457,6 +4714,9 @@ namespace li {
  */
 template <typename B> struct mysql_statement_result {
 
+  mysql_statement_result(B& mysql_wrapper, mysql_statement_data& data,
+                         std::shared_ptr<mysql_connection_data> connection)
+      : mysql_wrapper_(mysql_wrapper), data_(data), connection_(std::move(connection)) {}
   mysql_statement_result& operator=(mysql_statement_result&) = delete;
   mysql_statement_result(const mysql_statement_result&) = delete;
 
@@ -4745,8 +5005,7 @@ sql_result<mysql_statement_result<B>> mysql_statement<B>::operator()(T&&... args
   mysql_wrapper_.mysql_stmt_execute(connection_->error_, data_.stmt_);
 
   // Return the wrapped mysql result.
-  return sql_result<mysql_statement_result<B>>{
-      mysql_statement_result<B>{mysql_wrapper_, data_, connection_}};
+  return sql_result<mysql_statement_result<B>>{mysql_wrapper_, data_, connection_};
 }
 
 } // namespace li
@@ -4784,6 +5043,8 @@ template <typename B> struct mysql_result {
   bool end_of_result_ = false;
   int current_row_num_fields_ = 0;
   
+  mysql_result(B& mysql_wrapper, std::shared_ptr<mysql_connection_data> connection)
+      : mysql_wrapper_(mysql_wrapper), connection_(std::move(connection)) {}
   mysql_result& operator=(mysql_result&) = delete;
   mysql_result(const mysql_result&) = delete;
 
@@ -4967,8 +5228,7 @@ template <typename B> long long int mysql_connection<B>::last_insert_rowid() {
 template <typename B>
 sql_result<mysql_result<B>> mysql_connection<B>::operator()(const std::string& rq) {
   mysql_wrapper_.mysql_real_query(data_->error_, data_->connection_, rq.c_str(), rq.size());
-  return sql_result<mysql_result<B>>{
-      mysql_result<B>{mysql_wrapper_, data_}};
+  return sql_result<mysql_result<B>>{mysql_wrapper_, data_};
 }
 
 template <typename B>
@@ -5025,6 +5285,7 @@ template <typename B> mysql_statement<B> mysql_connection<B>::prepare(const std:
 #define LITHIUM_SINGLE_HEADER_GUARD_LI_SQL_SQL_DATABASE_HH
 
 
+
 namespace li {
 // thread local map of sql_database<I>* -> sql_database_thread_local_data<I>*;
 // This is used to store the thread local async connection pool.
@@ -5044,7 +5305,6 @@ template <typename I> struct sql_database_thread_local_data {
 };
 
 struct active_yield {
-  typedef std::runtime_error exception_type;
   int fiber_id = 0;
   inline void defer(std::function<void()>) {}
   inline void defer_fiber_resume(int fiber_id) {}
@@ -5055,6 +5315,12 @@ struct active_yield {
   inline void yield() {}
 };
 
+// True if the fiber type Y can park: wait without being resumed until another fiber
+// calls defer_fiber_resume(Y::fiber_id).
+template <typename Y, typename = void> struct has_park : std::false_type {};
+template <typename Y>
+struct has_park<Y, std::void_t<decltype(std::declval<Y&>().park())>> : std::true_type {};
+
 template <typename I> struct sql_database {
   I impl;
 
@@ -5122,6 +5388,9 @@ template <typename I> struct sql_database {
    *                                            descriptor fd
    *    - void yield() // Yield the current epoll fiber.
    *
+   *  When the pool is full, fibers providing bool park() are parked until a connection
+   *  is released instead of yielding in a loop.
+   *
    * @return the new connection.
    */
   template <typename Y> inline auto connect(Y& fiber) {
@@ -5146,6 +5415,7 @@ template <typename I> struct sql_database {
     bool reuse = false;
     while (!data) {
 
+      sql_check_client_connection(fiber);
       if (!pool.connections.empty()) {
         auto lock = [&pool, this] {
           if constexpr (std::is_same_v<Y, active_yield>)
@@ -5161,18 +5431,28 @@ template <typename I> struct sql_database {
             throw std::runtime_error("Maximum number of sql connection exeeded.");
           else
           {
-            // std::cout << "Waiting for a free sql connection..." << std::endl;
-            //  pool.waiting_list.push_back(fiber.fiber_id);
-            fiber.yield();
+            // Wait for a connection to go back to the pool: the deleter of the connection
+            // resumes the first fiber of waiting_list. Fibers that cannot park keep
+            // yielding. A fiber whose client is gone stops at the next iteration.
+            if constexpr (has_park<Y>::value) {
+              pool.waiting_list.push_back(fiber.fiber_id);
+              if (!fiber.park())
+                fiber.yield();
+              auto it = std::find(pool.waiting_list.begin(), pool.waiting_list.end(),
+                                  fiber.fiber_id);
+              if (it != pool.waiting_list.end())
+                pool.waiting_list.erase(it);
+            } else
+              fiber.yield();
           }
           continue;
         }
         pool.n_connections++;
         try {
           data = impl.new_connection(fiber);
-        } catch (typename Y::exception_type& e) {
+        } catch (...) {
           pool.n_connections--;
-          throw std::move(e);
+          throw;
         }
 
         if (!data)
@@ -5184,6 +5464,14 @@ template <typename I> struct sql_database {
     assert(data->error_ == 0);
     
     auto sptr = std::shared_ptr<connection_data_type>(data, [pool, this, &fiber](connection_data_type* data) {
+          // The released connection, or its slot, goes to the first waiting fiber.
+          if constexpr (!std::is_same_v<Y, active_yield>)
+            if (pool.waiting_list.size()) {
+              int next_fiber_id = pool.waiting_list.front();
+              pool.waiting_list.pop_front();
+              fiber.defer_fiber_resume(next_fiber_id);
+            }
+
           if (!data->error_ && pool.connections.size() < pool.max_connections) {
             auto lock = [&pool, this] {
               if constexpr (std::is_same_v<Y, active_yield>)
@@ -5192,14 +5480,6 @@ template <typename I> struct sql_database {
             }();
 
             pool.connections.push_back(data);
-            if constexpr (!std::is_same_v<Y, active_yield>)
-             if (pool.waiting_list.size())
-             {
-               int next_fiber_id = pool.waiting_list.front();
-               pool.waiting_list.pop_front();
-               fiber.defer_fiber_resume(next_fiber_id);
-             }
-           
           } else {
             // This is not an error since connection pool.max_connections can vary during execution.
             // It is ok just to discard extraneous in order to reach a lower pool.max_connections.
@@ -5349,17 +5629,10 @@ inline mysql_connection_data* mysql_database_impl::new_connection(Y& fiber) {
       fiber.epoll_add(mysql_fd, EVFILT_READ | EVFILT_WRITE);
     #endif
       
-    while (status)
-      try {
-        fiber.yield();
-        status = mysql_real_connect_cont(&connection, mysql, status);
-      } catch (typename Y::exception_type& e) {
-        // Yield thrown a exception (probably because a closed connection).
-        // std::cerr << "Warning: yield threw an exception while connecting to mysql: "
-        //  << total_number_of_mysql_connections << std::endl;
-        mysql_close(mysql);
-        throw std::move(e);
-      }
+    while (status) {
+      fiber.yield();
+      status = mysql_real_connect_cont(&connection, mysql, status);
+    }
     if (!connection) {
       // Error in mysql_real_connect_cont
       return nullptr;
@@ -5544,28 +5817,10 @@ PGresult* pg_wait_for_next_result(PGconn* connection, Y& fiber,
 
     if (PQisBusy(connection)) {
       // std::cout << "isbusy" << std::endl;
-      try {
-        fiber.yield();
-      } catch (typename Y::exception_type& e) {
-        // Free results.
-        // Yield thrown a exception (probably because a closed connection).
-        // Flush the remaining results.
-        while (true)
-        {
-          if (PQconsumeInput(connection) == 0)
-          {
-            connection_status = 1;
-            break;
-          }
-          if (!PQisBusy(connection))
-          {
-            PGresult* res = PQgetResult(connection);
-            if (res) PQclear(res);
-            else break;
-          }
-        }
-        throw std::move(e);
-      }
+      // If the client closed its connection, keep waiting: the query completes and the
+      // database connection goes back to the pool in a clean state. The next query of
+      // this client fails (sql_check_client_connection).
+      fiber.yield();
     } else {
       // std::cout << "notbusy" << std::endl;
       PGresult* res = PQgetResult(connection);
@@ -5594,18 +5849,13 @@ template <typename Y> PGresult* pgsql_result<Y>::wait_for_next_result() {
 }
 
 template <typename Y> void pgsql_result<Y>::flush_results() {
-  try {
-    while (true)
-    {
-      if (connection_->error_ == 1) break;
-      PGresult* res = pg_wait_for_next_result(connection_->pgconn_, fiber_, connection_->error_, true);
-      if (res)
-        PQclear(res);
-      else break;
-    }
-  } catch (typename Y::exception_type& e) {
-    // Forward fiber execptions.
-    throw std::move(e);
+  while (true)
+  {
+    if (connection_->error_ == 1) break;
+    PGresult* res = pg_wait_for_next_result(connection_->pgconn_, fiber_, connection_->error_, true);
+    if (res)
+      PQclear(res);
+    else break;
   }
 }
 
@@ -5926,6 +6176,7 @@ sql_result<pgsql_result<Y>> pgsql_statement<Y>::operator()(T&&... args) {
     i += bind_compute_nparam(a);
   });
 
+  sql_check_client_connection(fiber_);
   if (!PQsendQueryPrepared(connection_->pgconn_, data_.stmt_name.c_str(), nparams, values, lengths, binary,
                            1)) {
     throw std::runtime_error(std::string("Postresql error:") + PQerrorMessage(connection_->pgconn_));
@@ -5934,8 +6185,7 @@ sql_result<pgsql_result<Y>> pgsql_statement<Y>::operator()(T&&... args) {
   // Now calling pqflush seems to work aswell...
   // connection_->flush(this->fiber_);
 
-  return sql_result<pgsql_result<Y>>{
-      pgsql_result<Y>{this->connection_, this->fiber_}};
+  return sql_result<pgsql_result<Y>>{this->connection_, this->fiber_};
 }
 
 // FIXME long long int affected_rows() { return pgsql_stmt_affected_rows(data_.stmt_); }
@@ -5980,10 +6230,10 @@ template <typename Y> struct pgsql_connection {
   // pgsql_statement<Y> operator()(const std::string& rq) { return prepare(rq)(); }
 
   auto operator()(const std::string& rq) {
+    sql_check_client_connection(fiber_);
     if (!PQsendQueryParams(connection_, rq.c_str(), 0, nullptr, nullptr, nullptr, nullptr, 1))
       throw std::runtime_error(std::string("Postresql error:") + PQerrorMessage(connection_));
-    return sql_result<pgsql_result<Y>>{
-        pgsql_result<Y>{this->data_, this->fiber_, data_->error_}};
+    return sql_result<pgsql_result<Y>>{this->data_, this->fiber_, data_->error_};
   }
 
   // PQsendQueryParams
@@ -6003,6 +6253,7 @@ template <typename Y> struct pgsql_connection {
     }
     std::string stmt_name = boost::lexical_cast<std::string>(stm_cache_.size());
 
+    sql_check_client_connection(fiber_);
     if (!PQsendPrepare(connection_, stmt_name.c_str(), rq.c_str(), 0, nullptr)) {
       throw std::runtime_error(std::string("PQsendPrepare error") + PQerrorMessage(connection_));
     }
@@ -6110,24 +6361,18 @@ struct pgsql_database_impl {
       fiber.epoll_add(pgsql_fd, EVFILT_READ | EVFILT_WRITE);
     #endif
 
-    try {
-      while (status != PGRES_POLLING_FAILED and status != PGRES_POLLING_OK) {
-        int new_pgsql_fd = PQsocket(connection);
-        if (new_pgsql_fd != pgsql_fd) {
-          pgsql_fd = new_pgsql_fd;
-          #if __linux__
-            fiber.epoll_add(pgsql_fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP);
-          #elif __APPLE__
-            fiber.epoll_add(pgsql_fd, EVFILT_READ | EVFILT_WRITE);
-          #endif
-        }
-        fiber.yield();
-        status = PQconnectPoll(connection);
+    while (status != PGRES_POLLING_FAILED and status != PGRES_POLLING_OK) {
+      int new_pgsql_fd = PQsocket(connection);
+      if (new_pgsql_fd != pgsql_fd) {
+        pgsql_fd = new_pgsql_fd;
+        #if __linux__
+          fiber.epoll_add(pgsql_fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP);
+        #elif __APPLE__
+          fiber.epoll_add(pgsql_fd, EVFILT_READ | EVFILT_WRITE);
+        #endif
       }
-    } catch (typename Y::exception_type& e) {
-      // Yield thrown a exception (probably because a closed connection).
-      PQfinish(connection);
-      throw std::move(e);
+      fiber.yield();
+      status = PQconnectPoll(connection);
     }
     // std::cout << "CONNECTED " << std::endl;
     #if __linux__
@@ -6180,7 +6425,7 @@ namespace internal {
 
 template <typename V> struct drt_node {
 
-  drt_node() : v_{0, nullptr} {}
+  drt_node() : v_() {}
   
   struct iterator {
     const drt_node<V>* ptr;
@@ -6208,10 +6453,10 @@ template <typename V> struct drt_node {
 
     auto it = children_.find(k);
     if (it != children_.end())
-      return children_[k]->find_or_create(r, c);
+      return it->second->find_or_create(r, c);
     else
     {
-      auto new_node = new drt_node();
+      auto new_node = std::make_shared<drt_node>();
       children_.insert({k, new_node});
       return new_node->find_or_create(r, c);
     }
@@ -6219,23 +6464,23 @@ template <typename V> struct drt_node {
     return v_;
   }
 
+  // Call f on every node, including the ones that have children.
   template <typename F> void for_all_routes(F f, std::string prefix = "") const {
-    if (children_.size() == 0)
-      f(prefix, v_);
-    else {
-      if (prefix.size() && prefix.back() != '/')
-        prefix += '/';
-      for (auto pair : children_)
-        pair.second->for_all_routes(f, prefix + std::string(pair.first));
-    }
+    f(prefix, v_);
+    if (prefix.size() && prefix.back() != '/')
+      prefix += '/';
+    for (auto& pair : children_)
+      pair.second->for_all_routes(f, prefix + std::string(pair.first));
   }
-  iterator find(const std::string_view& r, unsigned int c) const {
+  // \has_value tells if a value is set.
+  template <typename F>
+  iterator find(const std::string_view& r, unsigned int c, F has_value) const {
     // We found the route r.
-    if ((c == r.size() and v_.handler != nullptr) or (children_.size() == 0))
+    if ((c == r.size() and has_value(v_)) or (children_.size() == 0))
       return iterator{this, r, v_};
 
     // r does not match any route.
-    if (c == r.size() and v_.handler == nullptr)
+    if (c == r.size())
       return iterator{nullptr, r, v_};
 
     if (r[c] == '/')
@@ -6252,7 +6497,7 @@ template <typename V> struct drt_node {
     // look for k in the children.
     auto it = children_.find(k);
     if (it != children_.end()) {
-      auto it2 = it->second->find(r, c); // search in the corresponding child.
+      auto it2 = it->second->find(r, c, has_value); // search in the corresponding child.
       if (it2 != it->second->end())
         return it2;
     }
@@ -6263,14 +6508,14 @@ template <typename V> struct drt_node {
         auto name = kv.first;
         if (name.size() > 4 and name[0] == '{' and name[1] == '{' and
             name[name.size() - 2] == '}' and name[name.size() - 1] == '}')
-          return kv.second->find(r, c);
+          return kv.second->find(r, c, has_value);
       }
       return end();
     }
   }
 
   V v_;
-  std::unordered_map<std::string_view, drt_node*> children_;
+  std::unordered_map<std::string_view, std::shared_ptr<drt_node>> children_;
 };
 } // namespace internal
 
@@ -6288,8 +6533,10 @@ template <typename V> struct dynamic_routing_table {
     return root.find_or_create(r2, 0);
   }
 
-  // Find a route and return an iterator.
-  auto find(const std::string_view& r) const { return root.find(r, 0); }
+  // Find a route and return an iterator. \has_value tells if a value is set.
+  template <typename F> auto find(const std::string_view& r, F has_value) const {
+    return root.find(r, 0, has_value);
+  }
 
   template <typename F> void for_all_routes(F f) const { root.for_all_routes(f); }
   auto end() const { return root.end(); }
@@ -6342,6 +6589,9 @@ public:
 
   LI_HTTP_ERROR(500, internal_server_error)
   LI_HTTP_ERROR(501, not_implemented)
+  LI_HTTP_ERROR(502, bad_gateway)
+  LI_HTTP_ERROR(503, service_unavailable)
+  LI_HTTP_ERROR(504, gateway_timeout)
 
 #undef LI_HTTP_ERROR
 
@@ -6354,66 +6604,439 @@ private:
 
 #endif // LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_ERROR_HH
 
+#ifndef LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_RADIX_ROUTER_HH
+#define LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_RADIX_ROUTER_HH
+
+
+
+namespace li {
+
+// Values of the url parameters of a route, in the order of the url spec.
+// A {{path...}} parameter value starts with its leading /.
+struct route_params {
+  static constexpr int max_size = 16;
+
+  inline void push_back(std::string_view v) {
+    if (size < max_size)
+      values[size] = v;
+    size++;
+  }
+
+  int size = 0;
+  std::string_view values[max_size];
+};
+
+namespace internal {
+
+inline bool is_url_param(std::string_view s) {
+  return s.size() > 4 and s[0] == '{' and s[1] == '{' and s[s.size() - 2] == '}' and
+         s[s.size() - 1] == '}';
+}
+inline bool is_url_path_param(std::string_view s) {
+  return is_url_param(s) and s.size() > 7 and s.substr(s.size() - 5, 3) == "...";
+}
+
+} // namespace internal
+
+// Names of the url parameters of a route, parsed once when the route is registered.
+// params[i] is the name of route_params::values[i].
+struct route_params_layout {
+
+  struct param {
+    uint64_t name_hash; // symbol_hash of the name.
+    int name_start;     // Location of the name in the url spec.
+    int name_size;
+    bool is_path;       // {{name...}}
+  };
+
+  route_params_layout() = default;
+
+  inline route_params_layout(std::string_view url_spec) {
+    int c = 0;
+    while (c < int(url_spec.size())) {
+      if (url_spec[c] == '/')
+        c++;
+      int s = c;
+      while (c < int(url_spec.size()) and url_spec[c] != '/')
+        c++;
+      std::string_view segment = url_spec.substr(s, c - s);
+      if (!internal::is_url_param(segment))
+        continue;
+      if (size == route_params::max_size)
+        throw std::runtime_error(std::string("Too many url parameters in route ") +
+                                 std::string(url_spec));
+      bool is_path = internal::is_url_path_param(segment);
+      int name_size = segment.size() - (is_path ? 7 : 4);
+      params[size++] =
+          param{symbol_hash(segment.substr(2, name_size)), s + 2, name_size, is_path};
+    }
+  }
+
+  // Index of the parameter whose name hash is \name_hash, -1 if none.
+  int find(uint64_t name_hash) const {
+    for (int i = 0; i < size; i++)
+      if (params[i].name_hash == name_hash)
+        return i;
+    return -1;
+  }
+
+  int size = 0;
+  param params[route_params::max_size];
+};
+
+// Immutable routing tree compiled from a dynamic_routing_table.
+//
+// The nodes, edges and labels are stored in flat arrays. Chains of nodes without
+// values are merged into one edge ("/api/v1/users" is one label when "/api" and
+// "/api/v1" have no handler).
+// Lookups do not modify the router: it can be shared by all the reactor threads.
+//
+// Matching rules are the ones of dynamic_routing_table:
+//  - A static segment is tried first, then the {{param}} child, then the {{param...}} child.
+//  - A node without children matches any remaining path.
+template <typename V> struct radix_router {
+
+  radix_router() = default;
+
+  // \has_value tells if a value of the table is set.
+  template <typename F> radix_router(const dynamic_routing_table<V>& table, F has_value) {
+    compile(table.root, has_value);
+  }
+
+  // Return the value matching \path or nullptr. Fill \params with the values of the
+  // url parameters.
+  inline const V* find(std::string_view path, route_params& params) const {
+    params.size = 0;
+    if (nodes_.empty())
+      return nullptr;
+    int n = find(0, path, 0, params);
+    if (n < 0 or params.size > route_params::max_size)
+      return nullptr;
+    return &values_[nodes_[n].value];
+  }
+
+  bool empty() const { return nodes_.empty(); }
+
+private:
+  struct node {
+    int first_edge = 0;
+    int n_edges = 0;
+    int param_child = -1; // {{param}}
+    int rest_child = -1;  // {{param...}}
+    int value = -1;       // index in values_.
+    bool is_leaf = false;
+  };
+
+  struct edge {
+    int label_start;
+    int label_size;
+    char first_char; // Checked before comparing the whole label, '\0' for an empty segment.
+    int child;
+  };
+
+  // Labels are short, a loop is faster than a call to memcmp.
+  static bool equal(const char* a, const char* b, int size) {
+    for (int i = 0; i < size; i++)
+      if (a[i] != b[i])
+        return false;
+    return true;
+  }
+
+  typedef internal::drt_node<V> drt_node;
+
+  template <typename F> int compile(const drt_node& n, F& has_value) {
+    int id = nodes_.size();
+    nodes_.emplace_back();
+    if (has_value(n.v_)) {
+      nodes_[id].value = values_.size();
+      values_.push_back(n.v_);
+    }
+    nodes_[id].is_leaf = n.children_.empty();
+
+    // Sort the children to get a deterministic choice when several {{params}}
+    // are registered at the same level: the first one in alphabetic order wins.
+    std::vector<std::pair<std::string_view, const drt_node*>> children;
+    for (auto& kv : n.children_)
+      children.emplace_back(kv.first, kv.second.get());
+    std::sort(children.begin(), children.end(),
+              [](auto& a, auto& b) { return a.first < b.first; });
+
+    std::vector<edge> edges;
+    for (auto& [segment, child] : children) {
+      if (internal::is_url_path_param(segment)) {
+        if (nodes_[id].rest_child < 0)
+          nodes_[id].rest_child = compile(*child, has_value);
+      } else if (internal::is_url_param(segment)) {
+        if (nodes_[id].param_child < 0)
+          nodes_[id].param_child = compile(*child, has_value);
+      } else {
+        // Merge the chain of static nodes that only lead to one child.
+        int label_start = labels_.size();
+        labels_.append(segment);
+        const drt_node* last = child;
+        while (!has_value(last->v_) and last->children_.size() == 1 and
+               !internal::is_url_param(last->children_.begin()->first)) {
+          labels_.append("/").append(last->children_.begin()->first);
+          last = last->children_.begin()->second.get();
+        }
+        edges.push_back(edge{label_start, int(labels_.size()) - label_start,
+                             segment.empty() ? '\0' : segment[0], -1});
+        edges.back().child = compile(*last, has_value);
+      }
+    }
+
+    // The edges of a node are contiguous in edges_.
+    nodes_[id].first_edge = edges_.size();
+    nodes_[id].n_edges = edges.size();
+    edges_.insert(edges_.end(), edges.begin(), edges.end());
+    return id;
+  }
+
+  int find(int n, std::string_view path, int c, route_params& params) const {
+    const node& nd = nodes_[n];
+    const int size = path.size();
+
+    if (c == size and nd.value >= 0)
+      return n;
+    if (nd.is_leaf)
+      return nd.value >= 0 ? n : -1;
+    if (c == size)
+      return -1;
+
+    int segment_start = c;
+    int s = path[c] == '/' ? c + 1 : c;
+
+    // Static children: compare the labels with the path without looking for the end of the
+    // segment first. At most one label can match.
+    char first_char = (s == size or path[s] == '/') ? '\0' : path[s];
+    const edge* end = edges_.data() + nd.first_edge + nd.n_edges;
+    for (const edge* e = edges_.data() + nd.first_edge; e != end; e++) {
+      int label_end = s + e->label_size;
+      if (e->first_char != first_char or label_end > size or
+          (label_end != size and path[label_end] != '/') or
+          !equal(path.data() + s, labels_.data() + e->label_start, e->label_size))
+        continue;
+      int r = find(e->child, path, label_end, params);
+      if (r >= 0)
+        return r;
+      break;
+    }
+
+    if (nd.param_child < 0 and nd.rest_child < 0)
+      return -1;
+
+    // {{param}}
+    if (nd.param_child >= 0) {
+      c = s;
+      while (c < size and path[c] != '/')
+        c++;
+      int saved_size = params.size;
+      params.push_back(path.substr(s, c - s));
+      int r = find(nd.param_child, path, c, params);
+      if (r >= 0)
+        return r;
+      params.size = saved_size;
+    }
+
+    // {{param...}}
+    if (nd.rest_child >= 0 and nodes_[nd.rest_child].value >= 0) {
+      params.push_back(path.substr(segment_start));
+      return nd.rest_child;
+    }
+
+    return -1;
+  }
+
+  std::vector<node> nodes_;
+  std::vector<edge> edges_;
+  std::string labels_;
+  std::vector<V> values_;
+};
+
+} // namespace li
+
+#endif // LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_RADIX_ROUTER_HH
+
 #ifndef LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_SYMBOLS_HH
 #define LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_SYMBOLS_HH
 
+#ifndef LI_SYMBOL_admission_control
+#define LI_SYMBOL_admission_control
+    LI_SYMBOL(admission_control)
+#endif
+
+#ifndef LI_SYMBOL_admitted
+#define LI_SYMBOL_admitted
+    LI_SYMBOL(admitted)
+#endif
+
+#ifndef LI_SYMBOL_balancing
+#define LI_SYMBOL_balancing
+    LI_SYMBOL(balancing)
+#endif
+
 #ifndef LI_SYMBOL_blocking
 #define LI_SYMBOL_blocking
     LI_SYMBOL(blocking)
 #endif
 
-#ifndef LI_SYMBOL_create_secret_key
-#define LI_SYMBOL_create_secret_key
-    LI_SYMBOL(create_secret_key)
+#ifndef LI_SYMBOL_body
+#define LI_SYMBOL_body
+    LI_SYMBOL(body)
 #endif
 
-#ifndef LI_SYMBOL_date_thread
-#define LI_SYMBOL_date_thread
-    LI_SYMBOL(date_thread)
+#ifndef LI_SYMBOL_burst
+#define LI_SYMBOL_burst
+    LI_SYMBOL(burst)
 #endif
 
-#ifndef LI_SYMBOL_hash_password
-#define LI_SYMBOL_hash_password
-    LI_SYMBOL(hash_password)
+#ifndef LI_SYMBOL_busy_poll
+#define LI_SYMBOL_busy_poll
+    LI_SYMBOL(busy_poll)
 #endif
 
-#ifndef LI_SYMBOL_https_cert
-#define LI_SYMBOL_https_cert
-    LI_SYMBOL(https_cert)
+#ifndef LI_SYMBOL_capture
+#define LI_SYMBOL_capture
+    LI_SYMBOL(capture)
 #endif
 
-#ifndef LI_SYMBOL_https_key
-#define LI_SYMBOL_https_key
-    LI_SYMBOL(https_key)
+#ifndef LI_SYMBOL_codel_interval
+#define LI_SYMBOL_codel_interval
+    LI_SYMBOL(codel_interval)
 #endif
 
-#ifndef LI_SYMBOL_id
-#define LI_SYMBOL_id
-    LI_SYMBOL(id)
+#ifndef LI_SYMBOL_codel_target
+#define LI_SYMBOL_codel_target
+    LI_SYMBOL(codel_target)
 #endif
 
-#ifndef LI_SYMBOL_linux_epoll
-#define LI_SYMBOL_linux_epoll
-    LI_SYMBOL(linux_epoll)
+#ifndef LI_SYMBOL_connections
+#define LI_SYMBOL_connections
+    LI_SYMBOL(connections)
 #endif
 
-#ifndef LI_SYMBOL_name
-#define LI_SYMBOL_name
-    LI_SYMBOL(name)
+#ifndef LI_SYMBOL_create_secret_key
+#define LI_SYMBOL_create_secret_key
+    LI_SYMBOL(create_secret_key)
 #endif
 
-#ifndef LI_SYMBOL_non_blocking
-#define LI_SYMBOL_non_blocking
-    LI_SYMBOL(non_blocking)
+#ifndef LI_SYMBOL_date_thread
+#define LI_SYMBOL_date_thread
+    LI_SYMBOL(date_thread)
 #endif
 
-#ifndef LI_SYMBOL_nthreads
-#define LI_SYMBOL_nthreads
-    LI_SYMBOL(nthreads)
+#ifndef LI_SYMBOL_duration
+#define LI_SYMBOL_duration
+    LI_SYMBOL(duration)
 #endif
 
-#ifndef LI_SYMBOL_one_thread_per_connection
-#define LI_SYMBOL_one_thread_per_connection
+#ifndef LI_SYMBOL_evicted
+#define LI_SYMBOL_evicted
+    LI_SYMBOL(evicted)
+#endif
+
+#ifndef LI_SYMBOL_failures
+#define LI_SYMBOL_failures
+    LI_SYMBOL(failures)
+#endif
+
+#ifndef LI_SYMBOL_fetch_headers
+#define LI_SYMBOL_fetch_headers
+    LI_SYMBOL(fetch_headers)
+#endif
+
+#ifndef LI_SYMBOL_get_parameters
+#define LI_SYMBOL_get_parameters
+    LI_SYMBOL(get_parameters)
+#endif
+
+#ifndef LI_SYMBOL_hash_password
+#define LI_SYMBOL_hash_password
+    LI_SYMBOL(hash_password)
+#endif
+
+#ifndef LI_SYMBOL_headers
+#define LI_SYMBOL_headers
+    LI_SYMBOL(headers)
+#endif
+
+#ifndef LI_SYMBOL_host
+#define LI_SYMBOL_host
+    LI_SYMBOL(host)
+#endif
+
+#ifndef LI_SYMBOL_https_cert
+#define LI_SYMBOL_https_cert
+    LI_SYMBOL(https_cert)
+#endif
+
+#ifndef LI_SYMBOL_https_key
+#define LI_SYMBOL_https_key
+    LI_SYMBOL(https_key)
+#endif
+
+#ifndef LI_SYMBOL_id
+#define LI_SYMBOL_id
+    LI_SYMBOL(id)
+#endif
+
+#ifndef LI_SYMBOL_json_encoded
+#define LI_SYMBOL_json_encoded
+    LI_SYMBOL(json_encoded)
+#endif
+
+#ifndef LI_SYMBOL_key
+#define LI_SYMBOL_key
+    LI_SYMBOL(key)
+#endif
+
+#ifndef LI_SYMBOL_linux_epoll
+#define LI_SYMBOL_linux_epoll
+    LI_SYMBOL(linux_epoll)
+#endif
+
+#ifndef LI_SYMBOL_listen_backlog
+#define LI_SYMBOL_listen_backlog
+    LI_SYMBOL(listen_backlog)
+#endif
+
+#ifndef LI_SYMBOL_max_idle_connections
+#define LI_SYMBOL_max_idle_connections
+    LI_SYMBOL(max_idle_connections)
+#endif
+
+#ifndef LI_SYMBOL_max_in_flight
+#define LI_SYMBOL_max_in_flight
+    LI_SYMBOL(max_in_flight)
+#endif
+
+#ifndef LI_SYMBOL_max_keys
+#define LI_SYMBOL_max_keys
+    LI_SYMBOL(max_keys)
+#endif
+
+#ifndef LI_SYMBOL_max_queue
+#define LI_SYMBOL_max_queue
+    LI_SYMBOL(max_queue)
+#endif
+
+#ifndef LI_SYMBOL_name
+#define LI_SYMBOL_name
+    LI_SYMBOL(name)
+#endif
+
+#ifndef LI_SYMBOL_non_blocking
+#define LI_SYMBOL_non_blocking
+    LI_SYMBOL(non_blocking)
+#endif
+
+#ifndef LI_SYMBOL_nthreads
+#define LI_SYMBOL_nthreads
+    LI_SYMBOL(nthreads)
+#endif
+
+#ifndef LI_SYMBOL_one_thread_per_connection
+#define LI_SYMBOL_one_thread_per_connection
     LI_SYMBOL(one_thread_per_connection)
 #endif
 
@@ -6422,21 +7045,81 @@ private:
     LI_SYMBOL(path)
 #endif
 
+#ifndef LI_SYMBOL_pipelined
+#define LI_SYMBOL_pipelined
+    LI_SYMBOL(pipelined)
+#endif
+
+#ifndef LI_SYMBOL_poisson
+#define LI_SYMBOL_poisson
+    LI_SYMBOL(poisson)
+#endif
+
+#ifndef LI_SYMBOL_post_parameters
+#define LI_SYMBOL_post_parameters
+    LI_SYMBOL(post_parameters)
+#endif
+
 #ifndef LI_SYMBOL_primary_key
 #define LI_SYMBOL_primary_key
     LI_SYMBOL(primary_key)
 #endif
 
+#ifndef LI_SYMBOL_rate
+#define LI_SYMBOL_rate
+    LI_SYMBOL(rate)
+#endif
+
 #ifndef LI_SYMBOL_read_only
 #define LI_SYMBOL_read_only
     LI_SYMBOL(read_only)
 #endif
 
+#ifndef LI_SYMBOL_receive_buffer_size
+#define LI_SYMBOL_receive_buffer_size
+    LI_SYMBOL(receive_buffer_size)
+#endif
+
+#ifndef LI_SYMBOL_record_requests
+#define LI_SYMBOL_record_requests
+    LI_SYMBOL(record_requests)
+#endif
+
+#ifndef LI_SYMBOL_rejected
+#define LI_SYMBOL_rejected
+    LI_SYMBOL(rejected)
+#endif
+
+#ifndef LI_SYMBOL_requests
+#define LI_SYMBOL_requests
+    LI_SYMBOL(requests)
+#endif
+
+#ifndef LI_SYMBOL_retries
+#define LI_SYMBOL_retries
+    LI_SYMBOL(retries)
+#endif
+
+#ifndef LI_SYMBOL_retry_after
+#define LI_SYMBOL_retry_after
+    LI_SYMBOL(retry_after)
+#endif
+
+#ifndef LI_SYMBOL_reused
+#define LI_SYMBOL_reused
+    LI_SYMBOL(reused)
+#endif
+
 #ifndef LI_SYMBOL_select
 #define LI_SYMBOL_select
     LI_SYMBOL(select)
 #endif
 
+#ifndef LI_SYMBOL_send_buffer_size
+#define LI_SYMBOL_send_buffer_size
+    LI_SYMBOL(send_buffer_size)
+#endif
+
 #ifndef LI_SYMBOL_server_thread
 #define LI_SYMBOL_server_thread
     LI_SYMBOL(server_thread)
@@ -6447,6 +7130,16 @@ private:
     LI_SYMBOL(session_id)
 #endif
 
+#ifndef LI_SYMBOL_shed_in_flight
+#define LI_SYMBOL_shed_in_flight
+    LI_SYMBOL(shed_in_flight)
+#endif
+
+#ifndef LI_SYMBOL_shed_queue_delay
+#define LI_SYMBOL_shed_queue_delay
+    LI_SYMBOL(shed_queue_delay)
+#endif
+
 #ifndef LI_SYMBOL_ssl_certificate
 #define LI_SYMBOL_ssl_certificate
     LI_SYMBOL(ssl_certificate)
@@ -6462,6 +7155,36 @@ private:
     LI_SYMBOL(ssl_key)
 #endif
 
+#ifndef LI_SYMBOL_status
+#define LI_SYMBOL_status
+    LI_SYMBOL(status)
+#endif
+
+#ifndef LI_SYMBOL_sync_interval
+#define LI_SYMBOL_sync_interval
+    LI_SYMBOL(sync_interval)
+#endif
+
+#ifndef LI_SYMBOL_tcp_defer_accept
+#define LI_SYMBOL_tcp_defer_accept
+    LI_SYMBOL(tcp_defer_accept)
+#endif
+
+#ifndef LI_SYMBOL_tcp_fastopen
+#define LI_SYMBOL_tcp_fastopen
+    LI_SYMBOL(tcp_fastopen)
+#endif
+
+#ifndef LI_SYMBOL_tcp_nodelay
+#define LI_SYMBOL_tcp_nodelay
+    LI_SYMBOL(tcp_nodelay)
+#endif
+
+#ifndef LI_SYMBOL_timeout
+#define LI_SYMBOL_timeout
+    LI_SYMBOL(timeout)
+#endif
+
 #ifndef LI_SYMBOL_update_secret_key
 #define LI_SYMBOL_update_secret_key
     LI_SYMBOL(update_secret_key)
@@ -6472,6 +7195,11 @@ private:
     LI_SYMBOL(user_id)
 #endif
 
+#ifndef LI_SYMBOL_weights
+#define LI_SYMBOL_weights
+    LI_SYMBOL(weights)
+#endif
+
 
 #endif // LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_SYMBOLS_HH
 
@@ -6487,32 +7215,32 @@ template <typename T, typename F> struct delayed_assignator {
   F& f;
 };
 
-template <typename Req, typename Resp> struct api {
+// Handlers return \R: void, or coro_task<> for the coroutine server (see http_serve_coro).
+template <typename Req, typename Resp, typename R = void> struct api {
 
-  enum { ANY, GET, POST, PUT, HTTP_DELETE };
+  enum { ANY, GET, POST, PUT, HTTP_DELETE, N_VERBS };
 
-  typedef api<Req, Resp> self;
+  typedef api<Req, Resp, R> self;
 
   api(): is_global_handler(false), global_handler_(nullptr) { }
 
-  using H = std::function<void(Req&, Resp&)>;
+  using H = std::function<R(Req&, Resp&)>;
   struct VH {
     int verb = ANY;
     H handler;
     std::string url_spec;
+    route_params_layout url_params_layout;
   };
+  // The handlers of one route, indexed by verb.
+  typedef std::array<VH, N_VERBS> route_handlers;
 
-  H& operator()(std::string_view& route) {
-    auto& vh = routes_map_[route];
-    vh.verb = ANY;
-    vh.url_spec = route;
-    return vh.handler;
-  }
+  H& operator()(std::string_view& route) { return this->operator()(ANY, route); }
 
   H& operator()(int verb, std::string_view r) {
-    auto& vh = routes_map_[r];
+    auto& vh = route(r)[verb];
     vh.verb = verb;
     vh.url_spec = r;
+    vh.url_params_layout = route_params_layout(r);
     return vh.handler;
   }
   H& get(std::string_view r) { return this->operator()(GET, r); }
@@ -6521,25 +7249,38 @@ template <typename Req, typename Resp> struct api {
   H& delete_(std::string_view r) { return this->operator()(HTTP_DELETE, r); }
 
   int parse_verb(std::string_view method) const {
-    if (method == "GET")
-      return GET;
-    if (method == "PUT")
-      return PUT;
-    if (method == "POST")
-      return POST;
-    if (method == "HTTP_DELETE")
-      return HTTP_DELETE;
+    switch (method.size()) {
+    case 3:
+      if (method == "GET")
+        return GET;
+      if (method == "PUT")
+        return PUT;
+      break;
+    case 4:
+      if (method == "POST")
+        return POST;
+      break;
+    case 6:
+      if (method == "DELETE")
+        return HTTP_DELETE;
+      break;
+    }
     return ANY;
   }
 
   void add_subapi(std::string prefix, const self& subapi) {
-    subapi.routes_map_.for_all_routes([this, prefix](auto r, VH h) {
-      if (!r.empty() && r.back() == '/')
-        h.url_spec = prefix + r;
-      else
-        h.url_spec = prefix + '/' + r;
+    subapi.routes_map_.for_all_routes([this, prefix](auto r, const route_handlers& handlers) {
+      for (VH h : handlers) {
+        if (!h.handler)
+          continue;
+        if (!r.empty() && r.back() == '/')
+          h.url_spec = prefix + r;
+        else
+          h.url_spec = prefix + '/' + r;
+        h.url_params_layout = route_params_layout(h.url_spec);
 
-      this->routes_map_[h.url_spec] = h;
+        this->route(h.url_spec)[h.verb] = h;
+      }
     });
   }
 
@@ -6548,48 +7289,68 @@ template <typename Req, typename Resp> struct api {
     return global_handler_;
   }
   void print_routes() {
-    routes_map_.for_all_routes([this](auto r, auto h) { std::cout << r << '\n'; });
+    routes_map_.for_all_routes([this](auto r, const route_handlers& handlers) {
+      for (auto& h : handlers)
+        if (h.handler)
+          std::cout << h.url_spec << '\n';
+    });
     std::cout << std::endl;
   }
-  auto call(std::string_view method, std::string_view route, Req& request, Resp& response) const {
+
+  // Compile the routes into a radix_router. http_serve calls it before starting the
+  // server, call is thread safe after that. Otherwise call freezes the routes when they
+  // changed since the last freeze.
+  void freeze() {
+    router_ = radix_router<route_handlers>(routes_map_, [](const route_handlers& handlers) {
+      for (auto& h : handlers)
+        if (h.handler)
+          return true;
+      return false;
+    });
+    frozen_ = true;
+  }
+
+  R call(std::string_view method, std::string_view route, Req& request, Resp& response) const {
     if(is_global_handler)
-    {
-        global_handler_(request, response);
-        return;
-    }
-    if (route == last_called_route_)
-    {
-      if (last_handler_.verb == ANY or parse_verb(method) == last_handler_.verb) {
-        request.url_spec = last_handler_.url_spec;
-        last_handler_.handler(request, response);
-        return;
-      } else
-        throw http_error::not_found("Method ", method, " not implemented on route ", route);
-    }
+        return global_handler_(request, response);
+    if (!frozen_)
+      const_cast<self*>(this)->freeze();
 
     // skip the last / of the url.
     std::string_view route2(route);
     if (route2.size() != 0 and route2[route2.size() - 1] == '/')
       route2 = route2.substr(0, route2.size() - 1);
 
-    auto it = routes_map_.find(route2);
-    if (it != routes_map_.end()) {
-      if (it->second.verb == ANY or parse_verb(method) == it->second.verb) {
-        const_cast<self*>(this)->last_called_route_ = route;
-        const_cast<self*>(this)->last_handler_ = it->second;
-        request.url_spec = it->second.url_spec;
-        it->second.handler(request, response);
-      } else
-        throw http_error::not_found("Method ", method, " not implemented on route ", route2);
-    } else
+    const route_handlers* handlers = router_.find(route2, request.url_params);
+    if (!handlers)
       throw http_error::not_found("Route ", route2, " does not exist.");
+
+    // Handlers registered for a specific verb take precedence over ANY.
+    const VH* vh = &(*handlers)[parse_verb(method)];
+    if (!vh->handler)
+      vh = &(*handlers)[ANY];
+    if (!vh->handler)
+      throw http_error::not_found("Method ", method, " not implemented on route ", route2);
+
+    request.url_spec = vh->url_spec;
+    request.url_params_layout = &vh->url_params_layout;
+    return vh->handler(request, response);
   }
 
-  dynamic_routing_table<VH> routes_map_;
-  std::string last_called_route_;
-  VH last_handler_;
+  dynamic_routing_table<route_handlers> routes_map_;
+  radix_router<route_handlers> router_;
+  bool frozen_ = false;
   H global_handler_;
   bool is_global_handler;
+
+private:
+  // The handlers of route \r. The last / is ignored.
+  route_handlers& route(std::string_view r) {
+    frozen_ = false;
+    if (r.size() != 0 and r.back() == '/')
+      r = r.substr(0, r.size() - 1);
+    return routes_map_[r];
+  }
 };
 
 } // namespace li
@@ -6601,171 +7362,608 @@ template <typename Req, typename Resp> struct api {
 
 
 
-#ifndef LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_OUTPUT_BUFFER_HH
-#define LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_OUTPUT_BUFFER_HH
+#ifndef LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_ARENA_HH
+#define LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_ARENA_HH
 
 
+#ifndef LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_BUFFER_POOL_HH
+#define LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_BUFFER_POOL_HH
+
 
 namespace li {
 
-struct output_buffer {
+// Free lists of I/O buffers, one per power of two size class from 1KB to 64KB.
+//
+// Connections borrow their buffers only while they process requests and give them
+// back when they go idle, so memory follows the number of active connections instead
+// of the number of open connections. Each reactor thread has its own pool (see
+// thread_buffer_pool), so no locking is needed.
+struct buffer_pool {
+
+  static constexpr int min_size = 1024;
+  static constexpr int n_classes = 7;
+  static constexpr int max_size = min_size << (n_classes - 1);
+  // Above this, released buffers are freed instead of cached.
+  static constexpr std::size_t max_cached_bytes = 16 * 1024 * 1024;
+
+  buffer_pool() = default;
+  buffer_pool(const buffer_pool&) = delete;
+  buffer_pool& operator=(const buffer_pool&) = delete;
+
+  ~buffer_pool() {
+    for (auto& list : free_)
+      for (char* b : list)
+        delete[] b;
+  }
+
+  // Size of the buffer returned by acquire(size).
+  static int class_size(int size) {
+    int c = size_class(size);
+    return c < 0 ? size : min_size << c;
+  }
+
+  // Return a buffer of class_size(size) bytes.
+  char* acquire(int size) {
+    int c = size_class(size);
+    if (c < 0)
+      return new char[size];
+    if (free_[c].empty())
+      return new char[min_size << c];
+    char* b = free_[c].back();
+    free_[c].pop_back();
+    cached_bytes_ -= min_size << c;
+    return b;
+  }
+
+  // Give back a buffer returned by acquire(size).
+  void release(char* b, int size) {
+    if (!b)
+      return;
+    int c = size_class(size);
+    if (c < 0 or cached_bytes_ + (min_size << c) > max_cached_bytes) {
+      delete[] b;
+      return;
+    }
+    free_[c].push_back(b);
+    cached_bytes_ += min_size << c;
+  }
 
-  output_buffer() : buffer_(nullptr), own_buffer_(false), cursor_(nullptr), end_(nullptr), flush_([] (const char*, int) constexpr {}) {}
+  std::size_t cached_bytes() const { return cached_bytes_; }
 
-  output_buffer(output_buffer&& o)
-      : buffer_(o.buffer_), own_buffer_(o.own_buffer_), cursor_(o.cursor_), end_(o.end_),
-        flush_(o.flush_) {
-    o.buffer_ = nullptr;
-    o.own_buffer_ = false;
+private:
+  // Smallest class holding \size bytes, -1 if larger than max_size.
+  static int size_class(int size) {
+    int c = 0;
+    while (c < n_classes and (min_size << c) < size)
+      c++;
+    return c < n_classes ? c : -1;
   }
 
-  output_buffer(
-      int capacity, std::function<void(const char*, int)> flush_ = [](const char*, int) {})
-      : buffer_(new char[capacity]), own_buffer_(true), cursor_(buffer_), end_(buffer_ + capacity),
-        flush_(flush_) {
-    assert(buffer_);
-  }
+  std::vector<char*> free_[n_classes];
+  std::size_t cached_bytes_ = 0;
+};
 
-  output_buffer(
-      void* buffer, int capacity,
-      std::function<void(const char*, int)> flush_ = [](const char*, int) {})
-      : buffer_((char*)buffer), own_buffer_(false), cursor_(buffer_), end_(buffer_ + capacity),
-        flush_(flush_) {
-    assert(buffer_);
+// Buffer pool of the calling thread.
+inline buffer_pool& thread_buffer_pool() {
+  static thread_local buffer_pool pool;
+  return pool;
+}
+
+} // namespace li
+
+#endif // LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_BUFFER_POOL_HH
+
+
+namespace li {
+
+// Bump allocator for the data of one request.
+//
+// Allocations are a pointer increment. Nothing is freed individually: reset() frees
+// everything at once after the response. Blocks come from the thread buffer pool, the
+// first one is kept by reset() and given back by release().
+// Destructors of the objects allocated in the arena are not called.
+struct monotonic_arena {
+
+  static constexpr int initial_block_size = 4 * 1024;
+
+  monotonic_arena() = default;
+  monotonic_arena(const monotonic_arena&) = delete;
+  monotonic_arena& operator=(const monotonic_arena&) = delete;
+  ~monotonic_arena() { release(); }
+
+  inline void* allocate(std::size_t size, std::size_t align = alignof(std::max_align_t)) {
+    char* p = align_up(cursor_, align);
+    if (!p or p + size > end_)
+      return allocate_in_new_block(size, align);
+    cursor_ = p + size;
+    return p;
   }
 
-  ~output_buffer() {
-    if (own_buffer_)
-      delete[] buffer_;
+  // Copy \s in the arena.
+  std::string_view copy(std::string_view s) {
+    char* p = (char*)allocate(s.size(), 1);
+    memcpy(p, s.data(), s.size());
+    return std::string_view(p, s.size());
   }
 
-  output_buffer& operator=(output_buffer&& o) {
-    buffer_ = o.buffer_;
-    own_buffer_ = o.own_buffer_;
-    cursor_ = o.cursor_;
-    end_ = o.end_;
-    flush_ = o.flush_;
-    o.buffer_ = nullptr;
-    o.own_buffer_ = false;
-    return *this;
+  // Free all the allocations. Keeps the first block for the next request.
+  void reset() {
+    if (!first_)
+      return;
+    release_blocks(first_->next);
+    first_->next = nullptr;
+    current_ = first_;
+    cursor_ = first_->data();
+    end_ = (char*)first_ + first_->size;
   }
 
-  void reset() { cursor_ = buffer_; }
+  // Free all the allocations and give the memory back to the pool.
+  void release() {
+    release_blocks(first_);
+    first_ = current_ = nullptr;
+    cursor_ = end_ = nullptr;
+  }
 
-  std::size_t size() { return cursor_ - buffer_; }
-  void flush() {
-    flush_(buffer_, size());
-    reset();
+  // Total size of the blocks used by the arena.
+  std::size_t capacity() const {
+    std::size_t total = 0;
+    for (block* b = first_; b; b = b->next)
+      total += b->size;
+    return total;
   }
 
-  output_buffer& operator<<(std::string_view s) {
-    if (cursor_ + s.size() >= end_)
-      flush();
+private:
+  // Blocks start with this header.
+  struct block {
+    block* next;
+    int size;
+    char* data() { return (char*)this + sizeof(block); }
+  };
 
-    assert(cursor_ + s.size() < end_);
-    memcpy(cursor_, s.data(), s.size());
-    cursor_ += s.size();
-    return *this;
+  static char* align_up(char* p, std::size_t align) {
+    return (char*)((uintptr_t(p) + align - 1) & ~uintptr_t(align - 1));
   }
 
-  output_buffer& operator<<(const char* s) { return operator<<(std::string_view(s, strlen(s))); }
-  output_buffer& operator<<(char v) {
-    cursor_[0] = v;
-    cursor_++;
-    return *this;
-  }
+  void* allocate_in_new_block(std::size_t size, std::size_t align) {
+    // Blocks double in size, and are large enough for the allocation.
+    std::size_t min_size = sizeof(block) + size + align;
+    std::size_t block_size = current_ ? 2 * std::size_t(current_->size) : initial_block_size;
+    while (block_size < min_size)
+      block_size *= 2;
 
-  inline output_buffer& append(const char c) { return (*this) << c; }
-  
-  output_buffer& operator<<(std::size_t v) {
-    if (v == 0)
-      operator<<('0');
-
-    char buffer[10];
-    char* str_start = buffer;
-    for (int i = 0; i < 10; i++) {
-      if (v > 0)
-        str_start = buffer + 9 - i;
-      buffer[9 - i] = (v % 10) + '0';
-      v /= 10;
-    }
-    operator<<(std::string_view(str_start, buffer + 10 - str_start));
-    return *this;
+    block* b = (block*)thread_buffer_pool().acquire(block_size);
+    b->next = nullptr;
+    b->size = block_size;
+    if (current_)
+      current_->next = b;
+    else
+      first_ = b;
+    current_ = b;
+    cursor_ = b->data();
+    end_ = (char*)b + block_size;
+
+    char* p = align_up(cursor_, align);
+    assert(p + size <= end_);
+    cursor_ = p + size;
+    return p;
+  }
+
+  static void release_blocks(block* b) {
+    while (b) {
+      block* next = b->next;
+      thread_buffer_pool().release((char*)b, b->size);
+      b = next;
+    }
   }
-  // template <typename I>
-  // output_buffer& operator<<(unsigned long s)
-  // {
-  //   typedef std::array<char, 150> buf_t;
-  //   buf_t b = boost::lexical_cast<buf_t>(v);
-  //   return operator<<(std::string_view(b.begin(), strlen(b.begin())));
-  // }
 
-  template <typename I>
-  output_buffer& operator<<(I v) {
-    typedef std::array<char, 150> buf_t;
-    buf_t b = boost::lexical_cast<buf_t>(v);
-    return operator<<(std::string_view(b.begin(), strlen(b.begin())));
-  }
+  block* first_ = nullptr;
+  block* current_ = nullptr;
+  char* cursor_ = nullptr;
+  char* end_ = nullptr;
+};
 
-  
-  std::string_view to_string_view() { return std::string_view(buffer_, cursor_ - buffer_); }
+// Standard allocator allocating in a monotonic_arena. deallocate does nothing.
+template <typename T> struct arena_allocator {
+  typedef T value_type;
+  typedef std::true_type propagate_on_container_copy_assignment;
+  typedef std::true_type propagate_on_container_move_assignment;
+  typedef std::true_type propagate_on_container_swap;
 
-  char* buffer_;
-  bool own_buffer_;
-  char* cursor_;
-  char* end_;
-  std::function<void(const char* s, int d)> flush_;
+  arena_allocator(monotonic_arena& arena) : arena(&arena) {}
+  template <typename U> arena_allocator(const arena_allocator<U>& o) : arena(o.arena) {}
+
+  T* allocate(std::size_t n) { return (T*)arena->allocate(n * sizeof(T), alignof(T)); }
+  void deallocate(T*, std::size_t) {}
+
+  template <typename U> bool operator==(const arena_allocator<U>& o) const {
+    return arena == o.arena;
+  }
+  template <typename U> bool operator!=(const arena_allocator<U>& o) const {
+    return arena != o.arena;
+  }
+
+  monotonic_arena* arena;
 };
 
+// String allocated in a request arena. url_decode and json_decode can decode into it.
+typedef std::basic_string<char, std::char_traits<char>, arena_allocator<char>> arena_string;
+
 } // namespace li
 
-#endif // LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_OUTPUT_BUFFER_HH
+#endif // LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_ARENA_HH
 
-#ifndef LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_INPUT_BUFFER_HH
-#define LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_INPUT_BUFFER_HH
+#ifndef LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_OUTPUT_BUFFER_HH
+#define LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_OUTPUT_BUFFER_HH
 
 
 
 namespace li {
 
-struct input_buffer {
+// Default sink of output_buffer.
+// Holds a small callable (a lambda capturing a few references or pointers) inline
+// and calls it through a plain function pointer: no allocation and no std::function.
+struct output_buffer_flush_fn {
 
-  std::vector<char> buffer_;
-  int cursor = 0; // First index of the currently used buffer area
-  int end = 0;    // Index of the last read character
+  output_buffer_flush_fn() : call_(nullptr) {}
 
-  input_buffer() : buffer_(50 * 1024), cursor(0), end(0) {}
+  template <typename F, typename = std::enable_if_t<
+                            !std::is_same<std::decay_t<F>, output_buffer_flush_fn>::value>>
+  output_buffer_flush_fn(F f) {
+    static_assert(sizeof(F) <= sizeof(storage_) and alignof(F) <= alignof(void*) and
+                      std::is_trivially_copy_constructible<F>::value and
+                      std::is_trivially_destructible<F>::value,
+                  "output_buffer flush callbacks must be small trivially copyable callables, "
+                  "for example lambdas capturing references.");
+    new (storage_) F(f);
+    call_ = [](void* f, const char* s, int size) { (*(F*)f)(s, size); };
+  }
 
-  // Free unused space in the buffer in [i1, i2[.
-  // This may move data in [i2, end[ if needed.
-  void free(int i1, int i2) {
-    assert(i1 < i2);
-    assert(i1 >= 0 and i1 < buffer_.size());
-    assert(i2 > 0 and i2 <= buffer_.size());
+  inline void operator()(const char* s, int size) {
+    if (call_)
+      call_(storage_, s, size);
+  }
 
-    if (i1 == cursor and i2 == end) // eat the whole buffer.
-      cursor = end = 0;
-    else if (i1 == cursor) // eat the beggining of the buffer.
-      cursor = i2;
-    else if (i2 == end)
-      end = i1;         // eat the end of the buffer.
-    else if (i2 != end) // eat somewhere in the middle.
-    {
-      if (buffer_.size() - end < buffer_.size() / 4) {
-        if (end - i2 > i2 - i1) // use memmove if overlap.
-          std::memmove(buffer_.data() + i1, buffer_.data() + i2, end - i2);
-        else
-          std::memcpy(buffer_.data() + i1, buffer_.data() + cursor, end - cursor);
+  alignas(void*) char storage_[3 * sizeof(void*)];
+  void (*call_)(void*, const char*, int);
+};
+
+// Write buffer calling \Sink(const char*, int) when it is full and on flush().
+//
+// When the buffer is not given to the constructor, it is borrowed from the thread
+// buffer pool on the first write, and given back by release().
+//
+// In segment chain mode (set_segment_chain), a full buffer is not flushed: the data
+// continues in a new segment. The size of the whole content is then known before
+// sending it, and the segments can be sent with one writev (see for_each_segment).
+template <typename Sink> struct basic_output_buffer {
+
+  basic_output_buffer()
+      : buffer_(nullptr), own_buffer_(false), cursor_(nullptr), end_(nullptr), flush_() {}
+
+  basic_output_buffer(basic_output_buffer&& o) { take(o); }
+
+  basic_output_buffer(int capacity, Sink flush = Sink())
+      : buffer_(nullptr), own_buffer_(true), cursor_(nullptr), end_(nullptr), flush_(flush),
+        capacity_(capacity) {}
+
+  basic_output_buffer(void* buffer, int capacity, Sink flush = Sink())
+      : buffer_((char*)buffer), own_buffer_(false), cursor_(buffer_), end_(buffer_ + capacity),
+        flush_(flush), segment_(buffer_), capacity_(capacity) {
+    assert(buffer_);
+  }
+
+  ~basic_output_buffer() { free_memory(); }
+
+  basic_output_buffer& operator=(basic_output_buffer&& o) {
+    if (this != &o) {
+      free_memory();
+      take(o);
+    }
+    return *this;
+  }
+
+  // Drop the content and give the memory back to the pool.
+  void release() {
+    free_memory();
+    if (own_buffer_)
+      buffer_ = nullptr;
+    reset();
+  }
+
+  // Grow in new segments instead of flushing when the buffer is full.
+  void set_segment_chain(bool enabled) { segment_chain_ = enabled; }
+
+  // Drop the content. The segments allocated by the chain are kept for the next use.
+  void reset() {
+    segments_.clear();
+    chain_size_ = 0;
+    blocks_used_ = 0;
+    segment_ = buffer_;
+    cursor_ = buffer_;
+    end_ = buffer_ ? buffer_ + capacity_ : nullptr;
+  }
+
+  std::size_t size() { return chain_size_ + (cursor_ - segment_); }
+
+  void flush() {
+    for (auto s : segments_)
+      flush_(s.data(), s.size());
+    if (cursor_ != segment_)
+      flush_(segment_, cursor_ - segment_);
+    reset();
+  }
+
+  // Call \f on each segment of the content, in order.
+  template <typename F> void for_each_segment(F f) {
+    for (auto s : segments_)
+      f(s);
+    f(std::string_view(segment_, cursor_ - segment_));
+  }
+  int segments_count() { return segments_.size() + 1; }
+
+  // Contiguous view of the content. Merges the segments if there are more than one.
+  std::string_view to_string_view() {
+    if (!segments_.empty()) {
+      int total = size();
+      char* merged = allocate_block(total);
+      int pos = 0;
+      for_each_segment([&](std::string_view s) {
+        memcpy(merged + pos, s.data(), s.size());
+        pos += s.size();
+      });
+      segments_.clear();
+      chain_size_ = 0;
+      segment_ = merged;
+      cursor_ = merged + total;
+      end_ = merged + blocks_[blocks_used_ - 1].size;
+    }
+    return std::string_view(segment_, cursor_ - segment_);
+  }
+
+  basic_output_buffer& operator<<(std::string_view s) {
+    if (end_ - cursor_ < long(s.size()) and !make_room(s.size())) {
+      // s does not fit in the empty buffer: send it directly.
+      flush_(s.data(), s.size());
+      return *this;
+    }
+    memcpy(cursor_, s.data(), s.size());
+    cursor_ += s.size();
+    return *this;
+  }
+
+  basic_output_buffer& operator<<(const char* s) {
+    return operator<<(std::string_view(s, strlen(s)));
+  }
+
+  basic_output_buffer& operator<<(char v) {
+    if (cursor_ == end_ and !make_room(1))
+      return operator<<(std::string_view(&v, 1));
+    *cursor_ = v;
+    cursor_++;
+    return *this;
+  }
+
+  inline basic_output_buffer& append(const char c) { return (*this) << c; }
+
+  template <typename T> basic_output_buffer& operator<<(const T& v) {
+    if constexpr (std::is_same<T, bool>::value)
+      return operator<<(v ? '1' : '0');
+    else if constexpr (std::is_same<T, signed char>::value or std::is_same<T, unsigned char>::value)
+      return operator<<(char(v));
+    else if constexpr (std::is_integral<T>::value)
+      return append_number(v, std::numeric_limits<T>::digits10 + 3);
+#if defined(__cpp_lib_to_chars)
+    else if constexpr (std::is_floating_point<T>::value)
+      // Shortest representation that reads back to the same value.
+      return append_number(v, 64);
+#endif
+    else if constexpr (std::is_convertible<const T&, std::string_view>::value)
+      return operator<<(std::string_view(v));
+    else {
+      typedef std::array<char, 150> buf_t;
+      buf_t b = boost::lexical_cast<buf_t>(v);
+      return operator<<(std::string_view(b.begin(), strlen(b.begin())));
+    }
+  }
+
+  char* buffer_;
+  bool own_buffer_;
+  char* cursor_;
+  char* end_;
+  Sink flush_;
+
+private:
+  // Format \v with to_chars, in place when \max_size bytes are available.
+  template <typename T> basic_output_buffer& append_number(T v, int max_size) {
+    if (end_ - cursor_ < max_size and !make_room(max_size)) {
+      char tmp[64];
+      auto r = std::to_chars(tmp, tmp + sizeof(tmp), v);
+      return operator<<(std::string_view(tmp, r.ptr - tmp));
+    }
+    cursor_ = std::to_chars(cursor_, end_, v).ptr;
+    return *this;
+  }
+
+  // Make room for \n bytes. Return false if they do not fit in the empty buffer.
+  bool make_room(int n) {
+    if (!buffer_ and capacity_) {
+      capacity_ = buffer_pool::class_size(capacity_);
+      buffer_ = thread_buffer_pool().acquire(capacity_);
+      reset();
+      if (end_ - cursor_ >= n)
+        return true;
+    }
+    if (segment_chain_) {
+      next_segment(n);
+      return true;
+    }
+    flush();
+    return end_ - cursor_ >= n;
+  }
+
+  // Close the current segment and continue in a block of at least \n bytes.
+  // Blocks grow with the content to keep the number of segments small.
+  void next_segment(int n) {
+    if (cursor_ != segment_) {
+      segments_.push_back(std::string_view(segment_, cursor_ - segment_));
+      chain_size_ += cursor_ - segment_;
+    }
+    segment_ = cursor_ = allocate_block(std::max<long>(n, std::max<long>(capacity_, size())));
+    end_ = segment_ + blocks_[blocks_used_ - 1].size;
+  }
+
+  char* allocate_block(int size) {
+    if (blocks_used_ == int(blocks_.size()))
+      blocks_.emplace_back();
+    block& b = blocks_[blocks_used_++];
+    if (b.size < size) {
+      thread_buffer_pool().release(b.data, b.size);
+      b.size = buffer_pool::class_size(size);
+      b.data = thread_buffer_pool().acquire(b.size);
+    }
+    return b.data;
+  }
+
+  void free_memory() {
+    auto& pool = thread_buffer_pool();
+    if (own_buffer_)
+      pool.release(buffer_, capacity_);
+    for (auto& b : blocks_)
+      pool.release(b.data, b.size);
+    blocks_.clear();
+    segments_.clear();
+    blocks_used_ = 0;
+  }
+
+  void take(basic_output_buffer& o) {
+    buffer_ = o.buffer_;
+    own_buffer_ = o.own_buffer_;
+    cursor_ = o.cursor_;
+    end_ = o.end_;
+    flush_ = o.flush_;
+    segment_ = o.segment_;
+    capacity_ = o.capacity_;
+    segment_chain_ = o.segment_chain_;
+    segments_ = std::move(o.segments_);
+    chain_size_ = o.chain_size_;
+    blocks_ = std::move(o.blocks_);
+    blocks_used_ = o.blocks_used_;
+    o.buffer_ = nullptr;
+    o.own_buffer_ = false;
+    o.cursor_ = o.end_ = o.segment_ = nullptr;
+    o.capacity_ = 0;
+    o.chain_size_ = 0;
+    o.blocks_used_ = 0;
+  }
+
+  struct block {
+    char* data = nullptr;
+    int size = 0;
+  };
+
+  char* segment_ = nullptr; // Start of the current segment.
+  int capacity_ = 0;
+  bool segment_chain_ = false;
+  std::vector<std::string_view> segments_; // Previous segments.
+  std::size_t chain_size_ = 0;            // Size of the previous segments.
+  std::vector<block> blocks_;              // Allocated by the chain, reused after reset.
+  int blocks_used_ = 0;
+};
+
+typedef basic_output_buffer<output_buffer_flush_fn> output_buffer;
+
+} // namespace li
+
+#endif // LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_OUTPUT_BUFFER_HH
+
+#ifndef LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_INPUT_BUFFER_HH
+#define LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_INPUT_BUFFER_HH
+
+
+
+namespace li {
+
+// Read buffer of a connection.
+// The memory is borrowed from the thread buffer pool on the first read, starting with a
+// small buffer that grows with reserve() up to max_size. release() gives it back.
+struct input_buffer {
+
+  static constexpr int initial_size = 4 * 1024;
+  static constexpr int max_size = 64 * 1024;
+
+  char* buffer_ = nullptr;
+  int capacity_ = 0;
+  int cursor = 0; // First index of the currently used buffer area
+  int end = 0;    // Index of the last read character
+
+  input_buffer() = default;
+  input_buffer(const input_buffer&) = delete;
+  input_buffer& operator=(const input_buffer&) = delete;
+  ~input_buffer() { thread_buffer_pool().release(buffer_, capacity_); }
+
+  int capacity() const { return capacity_; }
+
+  // Give the memory back to the pool. The buffer must be empty.
+  void release() {
+    assert(empty());
+    thread_buffer_pool().release(buffer_, capacity_);
+    buffer_ = nullptr;
+    capacity_ = cursor = end = 0;
+  }
+
+  // Make room for \size bytes after cursor (capped to max_size), moving the data to the
+  // beginning of the buffer or to a larger buffer if needed.
+  // Return the offset to add to the pointers in the data, 0 if it did not move.
+  long reserve(int size) {
+    size = std::min(size, max_size);
+    if (cursor + size <= capacity_)
+      return 0;
+    const char* old_data = buffer_ + cursor;
+    if (size <= capacity_)
+      std::memmove(buffer_, buffer_ + cursor, end - cursor);
+    else {
+      auto& pool = thread_buffer_pool();
+      int new_capacity = std::min(std::max(size, 2 * capacity_), max_size);
+      char* b = pool.acquire(new_capacity);
+      std::memcpy(b, buffer_ + cursor, end - cursor);
+      pool.release(buffer_, capacity_);
+      buffer_ = b;
+      capacity_ = new_capacity;
+    }
+    end -= cursor;
+    cursor = 0;
+    return buffer_ - old_data;
+  }
+
+  // Free unused space in the buffer in [i1, i2[.
+  // This may move data in [i2, end[ if needed.
+  void free(int i1, int i2) {
+    assert(i1 < i2);
+    assert(i1 >= 0 and i1 < capacity_);
+    assert(i2 > 0 and i2 <= capacity_);
+
+    if (i1 == cursor and i2 == end) // eat the whole buffer.
+      cursor = end = 0;
+    else if (i1 == cursor) // eat the beggining of the buffer.
+      cursor = i2;
+    else if (i2 == end)
+      end = i1;         // eat the end of the buffer.
+    else if (i2 != end) // eat somewhere in the middle.
+    {
+      if (capacity_ - end < capacity_ / 4) {
+        if (end - i2 > i2 - i1) // use memmove if overlap.
+          std::memmove(buffer_ + i1, buffer_ + i2, end - i2);
+        else
+          std::memcpy(buffer_ + i1, buffer_ + cursor, end - cursor);
       }
     }
   }
 
   void free(const char* i1, const char* i2) {
-    assert(i1 >= buffer_.data());
-    assert(i1 <= &buffer_.back());
-    // std::cout << (i2 - &buffer_.front()) << " " << buffer_.size() <<  << std::endl;
-    assert(i2 >= buffer_.data() and i2 <= &buffer_.back() + 1);
-    free(i1 - buffer_.data(), i2 - buffer_.data());
+    assert(i1 >= buffer_);
+    assert(i1 < buffer_ + capacity_);
+    assert(i2 >= buffer_ and i2 <= buffer_ + capacity_);
+    free(i1 - buffer_, i2 - buffer_);
   }
   void free(const std::string_view& str) { free(str.data(), str.data() + str.size()); }
 
@@ -6779,50 +7977,74 @@ struct input_buffer {
   // Return 0 on error.
   template <typename F> int read_more(F& fiber, int size = -1) {
 
+    if (!buffer_) {
+      capacity_ = initial_size;
+      buffer_ = thread_buffer_pool().acquire(capacity_);
+    }
+
     // If size is not specified, read potentially until the end of the buffer.
     if (size == -1)
-      size = buffer_.size() - end;
+      size = capacity_ - end;
 
-    if (end == buffer_.size() || size > (buffer_.size() - end))
+    if (end == capacity_ || size > (capacity_ - end))
       throw std::runtime_error("Error: request too long, read buffer full.");
 
-    int received = fiber.read(buffer_.data() + end, size);
+    int received = fiber.read(buffer_ + end, size);
     end = end + received;
-    assert(end <= buffer_.size());
+    assert(end <= capacity_);
+    return received;
+  }
+
+  // Read the data available on the socket without waiting. The buffer must be empty.
+  // Return -1 if there is nothing to read, 0 on error.
+  template <typename F> int read_more_nowait(F& fiber) {
+    assert(empty());
+    cursor = end = 0;
+    if (!buffer_) {
+      capacity_ = initial_size;
+      buffer_ = thread_buffer_pool().acquire(capacity_);
+    }
+    int received = fiber.read_nowait(buffer_, capacity_);
+    if (received > 0)
+      end = received;
     return received;
   }
 
   template <typename F> std::string_view read_more_str(F& fiber) {
     int l = read_more(fiber);
-    return std::string_view(buffer_.data() + end - l);
+    return std::string_view(buffer_ + end - l, l);
   }
 
+  // Return less than \size characters if the connection is closed before.
   template <typename F> std::string_view read_n(F&& fiber, const char* start, int size) {
-    int str_start = start - buffer_.data();
+    int str_start = start - buffer_;
     int str_end = size + str_start;
     if (end < str_end) {
       // Read more body on the socket.
       int current_size = end - str_start;
-      while (current_size < size)
-        current_size += read_more(fiber);
+      while (current_size < size) {
+        int received = read_more(fiber);
+        if (!received)
+          return std::string_view(start, current_size);
+        current_size += received;
+      }
     }
     return std::string_view(start, size);
   }
 
+  // Return a null string_view if the connection is closed before \delimiter.
   template <typename F> std::string_view read_until(F&& fiber, const char*& start, char delimiter) {
     const char* str_end = start;
 
     while (true) {
-      const char* buffer_end = buffer_.data() + end;
+      const char* buffer_end = buffer_ + end;
       while (str_end < buffer_end and *str_end != delimiter)
         str_end++;
 
-      if (*str_end == delimiter)
+      if (str_end < buffer_end)
         break;
-      else {
-        if (!read_more(fiber))
-          break;
-      }
+      if (!read_more(fiber))
+        return std::string_view();
     }
 
     auto res = std::string_view(start, str_end - start);
@@ -6842,9 +8064,9 @@ struct input_buffer {
       end = cursor = 0;
     else {
       if (cursor > end - cursor) // use memmove if overlap.
-        std::memmove(buffer_.data(), buffer_.data() + cursor, end - cursor);
+        std::memmove(buffer_, buffer_ + cursor, end - cursor);
       else
-        std::memcpy(buffer_.data(), buffer_.data() + cursor, end - cursor);
+        std::memcpy(buffer_, buffer_ + cursor, end - cursor);
 
       // if (
       // memcpy(buffer_.data(), buffer_.data() + cursor, end - cursor);
@@ -6856,7 +8078,7 @@ struct input_buffer {
 
   // On success return the number of bytes read.
   // On error return 0.
-  char* data() { return buffer_.data(); }
+  char* data() { return buffer_; }
 };
 
 } // namespace li
@@ -6941,10 +8163,86 @@ struct ssl_context {
 
 namespace li {
 
+// Socket and reactor tuning. 0 keeps the system default.
+struct tcp_server_options {
+  int listen_backlog = SOMAXCONN;
+  // Disable Nagle's algorithm on the accepted sockets.
+  bool tcp_nodelay = false;
+  // Seconds to wait for the first request bytes before waking the reactor (Linux).
+  int tcp_defer_accept = 0;
+  // Length of the TCP Fast Open queue of pending connections.
+  int tcp_fastopen = 0;
+  // SO_SNDBUF and SO_RCVBUF of the accepted sockets.
+  int send_buffer_size = 0;
+  int receive_buffer_size = 0;
+  // Busy polling, in microseconds: after an event, the reactor spins with
+  // epoll_wait(..., 0) this long before sleeping again, and the accepted sockets get
+  // SO_BUSY_POLL / SO_PREFER_BUSY_POLL (Linux). Trades CPU for latency.
+  int busy_poll_us = 0;
+};
+
 namespace impl {
 
+static void set_socket_option(int fd, int level, int option, int value, const char* name) {
+  if (-1 == setsockopt(fd, level, option, &value, sizeof(value)))
+    std::cerr << "Warning: cannot set " << name << " on socket " << fd << ": " << strerror(errno)
+              << std::endl;
+}
+
+// Options of the listening socket.
+static void configure_listen_socket(int fd, const tcp_server_options& options) {
+  if (options.receive_buffer_size) // Inherited by the accepted sockets.
+    set_socket_option(fd, SOL_SOCKET, SO_RCVBUF, options.receive_buffer_size, "SO_RCVBUF");
+#ifdef TCP_DEFER_ACCEPT
+  if (options.tcp_defer_accept)
+    set_socket_option(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, options.tcp_defer_accept,
+                      "TCP_DEFER_ACCEPT");
+#endif
+#ifdef TCP_FASTOPEN
+  if (options.tcp_fastopen)
+    set_socket_option(fd, IPPROTO_TCP, TCP_FASTOPEN, options.tcp_fastopen, "TCP_FASTOPEN");
+#endif
+}
+
+// Options of an accepted socket.
+static void configure_accepted_socket(int fd, const tcp_server_options& options) {
+  if (options.tcp_nodelay)
+    set_socket_option(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+  if (options.send_buffer_size)
+    set_socket_option(fd, SOL_SOCKET, SO_SNDBUF, options.send_buffer_size, "SO_SNDBUF");
+#if __linux__
+  if (options.busy_poll_us) {
+    // Values above net.core.busy_read need CAP_NET_ADMIN: fail silently, the reactor
+    // still spins.
+    int busy_poll = options.busy_poll_us;
+    setsockopt(fd, SOL_SOCKET, 46 /* SO_BUSY_POLL */, &busy_poll, sizeof(busy_poll));
+    int prefer = 1; // Since Linux 5.11.
+    setsockopt(fd, SOL_SOCKET, 69 /* SO_PREFER_BUSY_POLL */, &prefer, sizeof(prefer));
+  }
+#endif
+}
+
+// Timeout of epoll_wait: 0 (spin) during \busy_poll_us after the last event, 1ms otherwise
+// so the reactors regularly check the quit signal.
+struct busy_poll_clock {
+  busy_poll_clock(int busy_poll_us) : budget(busy_poll_us) {}
+
+  int timeout() {
+    if (budget.count() == 0)
+      return 1;
+    return std::chrono::steady_clock::now() < spin_until ? 0 : 1;
+  }
+  void on_events() {
+    if (budget.count())
+      spin_until = std::chrono::steady_clock::now() + budget;
+  }
+
+  std::chrono::microseconds budget;
+  std::chrono::steady_clock::time_point spin_until;
+};
+
 // Helper to create a TCP/UDP server socket.
-static int create_and_bind(int port, int socktype) {
+static int create_and_bind(int port, int socktype, const tcp_server_options& options = {}) {
   struct addrinfo hints;
   struct addrinfo *result, *rp;
   int s, sfd;
@@ -6985,11 +8283,21 @@ static int create_and_bind(int port, int socktype) {
 
   int flags = fcntl(sfd, F_GETFL, 0);
   fcntl(sfd, F_SETFL, flags | O_NONBLOCK);
-  ::listen(sfd, SOMAXCONN);
+  if (socktype == SOCK_STREAM)
+    configure_listen_socket(sfd, options);
+  ::listen(sfd, options.listen_backlog);
 
   return sfd;
 }
 
+// send flag telling the kernel that more data is coming, so it can wait before sending
+// a partial TCP segment. Not available on MacOS.
+#ifdef MSG_MORE
+static constexpr int send_more_flag = MSG_MORE;
+#else
+static constexpr int send_more_flag = 0;
+#endif
+
 } // namespace impl
 
 static volatile int quit_signal_catched = 0;
@@ -6998,7 +8306,12 @@ struct async_fiber_context;
 
 // Epoll based Reactor:
 // Orchestrates a set of fiber (boost::context::continuation).
+//
+// When the peer closes a connection, the fiber is resumed normally and the connection is
+// marked closed: read returns 0, write returns false, yield and park return false.
+// No exception is thrown through the fiber stack.
 
+// Not thrown by the reactor anymore. Kept for code catching it.
 struct fiber_exception {
 
   std::string what;
@@ -7010,6 +8323,28 @@ struct fiber_exception {
 
 struct async_reactor;
 
+// In-memory peer of a fiber, replacing its socket (see http_injector): reads consume
+// \input, at most \read_size bytes at a time (0: no limit), and writes are appended to
+// \output. A read at the end of the input returns 0, like a closed connection.
+struct memory_socket {
+  std::string_view input;
+  int read_size = 0;
+  std::string output;
+
+  inline int read(char* buf, int size) {
+    if (read_size > 0)
+      size = std::min(size, read_size);
+    size = std::min(size_t(size), input.size());
+    memcpy(buf, input.data(), size);
+    input.remove_prefix(size);
+    return size;
+  }
+  inline int write(const char* buf, int size) {
+    output.append(buf, size);
+    return size;
+  }
+};
+
 // The fiber context passed to all fibers so they can do
 //  yield, non blocking read/write on the socket fd, and subscribe to
 //  other file descriptors events.
@@ -7023,6 +8358,10 @@ struct async_fiber_context {
   int socket_fd;
   sockaddr in_addr;
   SSL* ssl = nullptr;
+  // Set instead of socket_fd when the connection is in memory.
+  memory_socket* memory = nullptr;
+  // Set on the child fibers of async_reactor::spawn to cancel them.
+  const bool* cancelled = nullptr;
 
   inline async_fiber_context& operator=(const async_fiber_context&) = delete;
   inline async_fiber_context(const async_fiber_context&) = delete;
@@ -7033,7 +8372,24 @@ struct async_fiber_context {
         fiber_id(fiber_id), socket_fd(socket_fd),
         in_addr(in_addr) {}
 
-  inline void yield() { sink = sink.resume(); }
+  // True once the peer closed the connection or an error occurred on the socket.
+  // Child fibers also see their parent's connection closed when they are cancelled.
+  inline bool is_closed() const;
+
+  // Let the other fibers run. Return false if the connection is closed.
+  inline bool yield() {
+    sink = sink.resume();
+    return !is_closed();
+  }
+
+  // Suspend the fiber until something explicitly wakes it up: an event on one of its file
+  // descriptors, defer_fiber_resume, async_reactor::remote_fiber_resume or a timer.
+  // Unlike yield, a parked fiber is skipped when the reactor is idle so it does not use any CPU.
+  // park may return spuriously, callers have to check their wake up condition in a loop.
+  // Return false without waiting if the connection is closed.
+  inline bool park();
+  // Same as park, but also wake up the fiber at \deadline.
+  inline bool park_until(std::chrono::steady_clock::time_point deadline);
        
   inline bool ssl_handshake(std::unique_ptr<ssl_context>& ssl_ctx) {
     if (!ssl_ctx) return false;
@@ -7045,9 +8401,10 @@ struct async_fiber_context {
       if (ret == 1) return true;
 
       int err = SSL_get_error(ssl, ret);
-      if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ)
-        this->yield();
-      else
+      if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ) {
+        if (!this->yield())
+          return false;
+      } else
       {
         ERR_print_errors_fp(stderr);
         return false;
@@ -7075,47 +8432,102 @@ struct async_fiber_context {
   inline int read_impl(char* buf, int size) {
     if (ssl)
       return SSL_read(ssl, buf, size);
+    else if (memory)
+      return memory->read(buf, size);
     else
       return ::recv(socket_fd, buf, size, 0);
   }
-  inline int write_impl(const char* buf, int size) {
+  inline int write_impl(const char* buf, int size, int flags = 0) {
     if (ssl)
       return SSL_write(ssl, buf, size);
+    else if (memory)
+      return memory->write(buf, size);
     else
-      return ::send(socket_fd, buf, size, 0);
+      return ::send(socket_fd, buf, size, flags);
+  }
+
+  // Read without waiting. Return -1 if no data is available, 0 if the connection is closed.
+  inline int read_nowait(char* buf, int max_size) {
+    if (is_closed())
+      return 0;
+    ssize_t count = read_impl(buf, max_size);
+    if (count < 0 and errno == EAGAIN)
+      return -1;
+    return count < 0 ? 0 : count;
   }
 
   inline int read(char* buf, int max_size) {
+    if (is_closed())
+      return 0;
     ssize_t count = read_impl(buf, max_size);
     while (count <= 0) {
       if ((count < 0 and errno != EAGAIN) or count == 0)
         return ssize_t(0);
-      sink = sink.resume();
+      if (!yield())
+        return 0;
       count = read_impl(buf, max_size);
     }
     return count;
   };
 
-  inline bool write(const char* buf, int size) {
-    if (!buf or !size) {
-      // std::cout << "pause" << std::endl;
-      sink = sink.resume();
-      return true;
-    }
+  // \flags are passed to send, for example impl::send_more_flag when more data follows.
+  inline bool write(const char* buf, int size, int flags = 0) {
+    if (!buf or !size)
+      return yield();
+    if (is_closed())
+      return false;
     const char* end = buf + size;
-    ssize_t count = write_impl(buf, end - buf);
+    ssize_t count = write_impl(buf, end - buf, flags);
     if (count > 0)
       buf += count;
     while (buf != end) {
       if ((count < 0 and errno != EAGAIN) or count == 0)
         return false;
-      sink = sink.resume();
-      count = write_impl(buf, end - buf);
+      if (!yield())
+        return false;
+      count = write_impl(buf, end - buf, flags);
       if (count > 0)
         buf += count;
     }
     return true;
   };
+
+  // Write several buffers with one sendmsg syscall (more if the socket buffer is full).
+  // iov is modified to track partial writes.
+  inline bool writev(iovec* iov, int iovcnt, int flags = 0) {
+    if (ssl or memory) {
+      for (int i = 0; i < iovcnt; i++)
+        if (iov[i].iov_len and !write((const char*)iov[i].iov_base, iov[i].iov_len))
+          return false;
+      return true;
+    }
+
+    if (is_closed())
+      return false;
+    while (iovcnt > 0) {
+      msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = iov;
+      msg.msg_iovlen = iovcnt;
+      ssize_t count = ::sendmsg(socket_fd, &msg, flags);
+      if (count < 0) {
+        if (errno != EAGAIN or !yield())
+          return false;
+        continue;
+      }
+      // Skip what was sent.
+      while (iovcnt > 0 and size_t(count) >= iov->iov_len) {
+        count -= iov->iov_len;
+        iov++;
+        iovcnt--;
+      }
+      if (iovcnt > 0) {
+        iov->iov_base = (char*)iov->iov_base + count;
+        iov->iov_len -= count;
+      }
+    }
+    return true;
+  }
 };
 
 struct async_reactor {
@@ -7123,12 +8535,184 @@ struct async_reactor {
   typedef boost::context::continuation continuation;
 
   int epoll_fd;
-  std::vector<continuation> fibers;
+  // A deque so that fibers spawned from another fiber do not move the running ones.
+  std::deque<continuation> fibers;
+  int next_fiber_idx = 0;
+  // Stacks of the fibers created by spawn.
+  boost::context::pooled_fixedsize_stack child_stacks;
+  // Slots that look free during spawn: the running parent and the child until its first
+  // yield do not have their continuation in fibers.
+  std::vector<int> spawning_slots;
   std::vector<int> fd_to_fiber_idx;
+  // closed_fds[fd] is set when the peer closed fd or an error occurred on it.
+  std::vector<char> closed_fds;
   std::unique_ptr<ssl_context> ssl_ctx = nullptr;
+  tcp_server_options options;
+  // When epoll_wait last returned, and an estimate of when its events arrived: when it
+  // returned without waiting, the events arrived while the previous ones were processed.
+  std::chrono::steady_clock::time_point loop_time;
+  std::chrono::steady_clock::time_point ready_time;
   std::vector<std::function<void()>> defered_functions;
   std::deque<int> defered_resume;
 
+  // parked_fibers[i] is set while fiber i waits in async_fiber_context::park.
+  std::vector<char> parked_fibers;
+
+  // Timers: fiber ids to resume, ordered by deadline. timer_ids[i] identifies the pending
+  // timer of fiber i (0 if none): the entries of a park_until that returned before its
+  // deadline are stale, they are skipped, and dropped when they make up most of the heap.
+  typedef std::tuple<std::chrono::steady_clock::time_point, int, uint64_t> timer_entry;
+  std::priority_queue<timer_entry, std::vector<timer_entry>, std::greater<timer_entry>> timers;
+  std::vector<uint64_t> timer_ids;
+  uint64_t timer_counter = 0;
+  int stale_timers = 0;
+
+  // Fibers to resume on behalf of other threads. See remote_fiber_resume.
+  int wakeup_fd_read = -1;
+  int wakeup_fd_write = -1;
+  std::mutex remote_resume_mutex;
+  std::vector<int> remote_resume;
+  std::vector<int> remote_resume_batch;
+
+  inline void resume_fiber(int fiber_id) {
+    if (fiber_id < 0 or fiber_id >= int(fibers.size()))
+      return;
+    auto& fiber = fibers[fiber_id];
+    if (fiber)
+      fiber = fiber.resume();
+  }
+
+  // Thread safe: resume fiber \fiber_id from any thread.
+  // Wakeups are batched, only the first one after the reactor drained the queue
+  // writes to the wakeup file descriptor.
+  inline void remote_fiber_resume(int fiber_id) {
+    bool was_empty;
+    {
+      std::lock_guard<std::mutex> lock(remote_resume_mutex);
+      was_empty = remote_resume.empty();
+      remote_resume.push_back(fiber_id);
+    }
+    if (was_empty) {
+      uint64_t one = 1;
+      if (-1 == ::write(wakeup_fd_write, &one, sizeof(one)) and errno != EAGAIN)
+        std::cerr << "remote_fiber_resume: cannot write the wakeup fd: " << strerror(errno)
+                  << std::endl;
+    }
+  }
+
+  inline void create_wakeup_fd() {
+#if __linux__
+    wakeup_fd_read = wakeup_fd_write = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    epoll_ctl(epoll_fd, wakeup_fd_read, EPOLL_CTL_ADD, EPOLLIN | EPOLLET);
+#elif __APPLE__
+    int fds[2];
+    if (0 == pipe(fds)) {
+      wakeup_fd_read = fds[0];
+      wakeup_fd_write = fds[1];
+      for (int fd : fds)
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+      epoll_ctl(epoll_fd, wakeup_fd_read, EV_ADD, EVFILT_READ);
+    }
+#endif
+  }
+
+  inline void close_wakeup_fd() {
+    if (wakeup_fd_write != wakeup_fd_read)
+      close(wakeup_fd_write);
+    close(wakeup_fd_read);
+  }
+
+  // Called when wakeup_fd_read is readable: resume the fibers queued by remote_fiber_resume.
+  inline void process_remote_resume() {
+    char buf[64];
+    while (::read(wakeup_fd_read, buf, sizeof(buf)) > 0)
+      ;
+    {
+      std::lock_guard<std::mutex> lock(remote_resume_mutex);
+      std::swap(remote_resume, remote_resume_batch);
+    }
+    for (int fiber_id : remote_resume_batch)
+      resume_fiber(fiber_id);
+    remote_resume_batch.clear();
+  }
+
+  inline void process_timers() {
+    if (timers.empty())
+      return;
+    auto now = std::chrono::steady_clock::now();
+    while (!timers.empty() and std::get<0>(timers.top()) <= now) {
+      auto [deadline, fiber_id, id] = timers.top();
+      timers.pop();
+      if (timer_ids[fiber_id] == id) {
+        timer_ids[fiber_id] = 0;
+        resume_fiber(fiber_id);
+      } else
+        stale_timers--;
+    }
+  }
+
+  // A park_until returned before its deadline.
+  inline void cancel_timer(int fiber_id) {
+    timer_ids[fiber_id] = 0;
+    if (++stale_timers < 64 or stale_timers * 2 < int(timers.size()))
+      return;
+    std::vector<timer_entry> live;
+    for (; !timers.empty(); timers.pop())
+      if (timer_ids[std::get<1>(timers.top())] == std::get<2>(timers.top()))
+        live.push_back(timers.top());
+    timers = decltype(timers)(std::greater<timer_entry>(), std::move(live));
+    stale_timers = 0;
+  }
+
+  inline void process_defered_resume() {
+    while (defered_resume.size()) {
+      int fiber_id = defered_resume.front();
+      defered_resume.pop_front();
+      assert(fiber_id < fibers.size());
+      resume_fiber(fiber_id);
+    }
+  }
+
+  // Index of a free slot in fibers.
+  inline int allocate_fiber_slot() {
+    int n = fibers.size();
+    for (int i = 0; i < n; i++) {
+      int fiber_idx = (next_fiber_idx + i) % n;
+      if (!fibers[fiber_idx] and std::find(spawning_slots.begin(), spawning_slots.end(),
+                                           fiber_idx) == spawning_slots.end()) {
+        next_fiber_idx = fiber_idx + 1;
+        parked_fibers[fiber_idx] = 0;
+        return fiber_idx;
+      }
+    }
+    fibers.resize((n + 1) * 2);
+    parked_fibers.resize(fibers.size(), 0);
+    timer_ids.resize(fibers.size(), 0);
+    next_fiber_idx = n + 1;
+    return n;
+  }
+
+  // Start a child fiber running \f(child_fiber_context) on this reactor.
+  // The child shares the socket of \parent, only to see it closed: it must not read or
+  // write it. It runs until its first yield before spawn returns its fiber id.
+  template <typename F> int spawn(async_fiber_context& parent, F f) {
+    spawning_slots.push_back(parent.fiber_id);
+    int fiber_idx = allocate_fiber_slot();
+    spawning_slots.push_back(fiber_idx);
+    int socket_fd = parent.socket_fd;
+    sockaddr in_addr = parent.in_addr;
+    continuation child = boost::context::callcc(
+        std::allocator_arg, child_stacks,
+        [this, socket_fd, fiber_idx, in_addr, f = std::move(f)](continuation&& sink) mutable {
+          auto ctx = async_fiber_context(this, std::move(sink), fiber_idx, socket_fd, in_addr);
+          f(ctx);
+          return std::move(ctx.sink);
+        });
+    spawning_slots.resize(spawning_slots.size() - 2);
+    fibers[fiber_idx] = std::move(child);
+    return fiber_idx;
+  }
+
   inline continuation& fd_to_fiber(int fd) {
     assert(fd >= 0 and fd < fd_to_fiber_idx.size());
     int fiber_idx = fd_to_fiber_idx[fd];
@@ -7169,9 +8753,12 @@ struct async_reactor {
     #endif
 
     // Associate new_fd to the fiber.
-    if (int(fd_to_fiber_idx.size()) < new_fd + 1)
+    if (int(fd_to_fiber_idx.size()) < new_fd + 1) {
       fd_to_fiber_idx.resize((new_fd + 1) * 2, -1);
+      closed_fds.resize(fd_to_fiber_idx.size(), 0);
+    }
     fd_to_fiber_idx[new_fd] = fiber_idx;
+    closed_fds[new_fd] = 0;
   }
 
   inline void epoll_mod(int fd, int flags) { 
@@ -7189,6 +8776,7 @@ struct async_reactor {
 #if __linux__
     this->epoll_fd = epoll_create1(0);
     epoll_ctl(epoll_fd, listen_fd, EPOLL_CTL_ADD, EPOLLIN | EPOLLET);
+    create_wakeup_fd();
     epoll_event events[MAXEVENTS];
 
 #elif __APPLE__
@@ -7197,6 +8785,7 @@ struct async_reactor {
     epoll_ctl(this->epoll_fd, SIGINT, EV_ADD, EVFILT_SIGNAL);
     epoll_ctl(this->epoll_fd, SIGKILL, EV_ADD, EVFILT_SIGNAL);
     epoll_ctl(this->epoll_fd, SIGTERM, EV_ADD, EVFILT_SIGNAL);
+    create_wakeup_fd();
     struct kevent events[MAXEVENTS];
 
     struct timespec timeout;
@@ -7205,24 +8794,42 @@ struct async_reactor {
 #endif
 
 
+    impl::busy_poll_clock busy_poll(options.busy_poll_us);
+    auto last_idle_resume = std::chrono::steady_clock::now();
+
     // Main loop.
     while (!quit_signal_catched) {
 
+      auto wait_start = std::chrono::steady_clock::now();
 #if __linux__
       // Wakeup to check if any quit signal has been catched.
-      int n_events = epoll_wait(epoll_fd, events, MAXEVENTS, 1);
+      int epoll_timeout = busy_poll.timeout();
+      int n_events = epoll_wait(epoll_fd, events, MAXEVENTS, epoll_timeout);
 #elif __APPLE__
       // kevent is already listening to quit signals.
+      int epoll_timeout = 1;
       int n_events = kevent(epoll_fd, NULL, 0, events, MAXEVENTS, &timeout);
 #endif
 
       if (quit_signal_catched)
         break;
 
-      if (n_events == 0 )
+      auto previous_loop_time = loop_time;
+      loop_time = std::chrono::steady_clock::now();
+      ready_time = loop_time - wait_start < std::chrono::microseconds(100) ? previous_loop_time
+                                                                          : loop_time;
+      if (n_events > 0)
+        busy_poll.on_events();
+
+      // Resume the yielding fibers when idle, at most every millisecond while spinning.
+      if (n_events == 0 and
+          (epoll_timeout != 0 or
+           std::chrono::steady_clock::now() - last_idle_resume >= std::chrono::milliseconds(1))) {
+        last_idle_resume = std::chrono::steady_clock::now();
         for (int i = 0; i < fibers.size(); i++)
-          if (fibers[i])
+          if (fibers[i] and !parked_fibers[i])
             fibers[i] = fibers[i].resume();
+      }
 
       for (int i = 0; i < n_events; i++) {
 
@@ -7246,6 +8853,13 @@ struct async_reactor {
 #endif
 
 
+        // Wakeups from other threads.
+        if (event_fd == wakeup_fd_read) {
+          process_remote_resume();
+          process_defered_resume();
+          continue;
+        }
+
         // Handle errors on sockets.
 #if __linux__
         if (event_flags & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
@@ -7256,12 +8870,12 @@ struct async_reactor {
             std::cout << "FATAL ERROR: Error on server socket " << event_fd << std::endl;
             quit_signal_catched = true;
           } else {
+            // Mark the fd closed and let the fiber see it in the return value of its
+            // next I/O call.
+            closed_fds[event_fd] = 1;
             continuation& fiber = fd_to_fiber(event_fd);
             if (fiber)
-              fiber = fiber.resume_with(std::move([](auto&& sink) {
-                throw fiber_exception(std::move(sink), "EPOLLRDHUP");
-                return std::move(sink);
-              }));
+              fiber = fiber.resume();
           }
         }
         // Handle new connections.
@@ -7281,18 +8895,14 @@ struct async_reactor {
 
             // ============================================
             // Find a free fiber for this new connection.
-            int fiber_idx = 0;
-            while (fiber_idx < fibers.size() && fibers[fiber_idx])
-              fiber_idx++;
-            if (fiber_idx >= fibers.size())
-              fibers.resize((fibers.size() + 1) * 2);
-            assert(fiber_idx < fibers.size());
+            int fiber_idx = allocate_fiber_slot();
             // ============================================
 
             // ============================================
             // Subscribe epoll to the socket file descriptor.
             if (-1 == fcntl(socket_fd, F_SETFL, fcntl(socket_fd, F_GETFL, 0) | O_NONBLOCK))
               continue;
+            impl::configure_accepted_socket(socket_fd, options);
 #if __linux__
             this->epoll_add(socket_fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, fiber_idx);
 #elif __APPLE__
@@ -7326,8 +8936,6 @@ struct async_reactor {
                   return std::move(ctx.sink);
                 }
                 handler(ctx);
-              } catch (fiber_exception& ex) {
-                return std::move(ex.c);
               } catch (const std::runtime_error& e) {
                 std::cerr << "FATAL ERRROR: exception in fiber: " << e.what() << std::endl;
                 assert(0);
@@ -7350,22 +8958,13 @@ struct async_reactor {
         }
 
         // Wakeup fibers if needed.
-        while (defered_resume.size())
-        {
-          int fiber_id = defered_resume.front();
-          defered_resume.pop_front();
-          assert(fiber_id < fibers.size());
-          auto& fiber = fibers[fiber_id];
-          if (fiber)
-          {
-            // std::cout << "wakeup " << fiber_id << std::endl; 
-            fiber = fiber.resume();
-          }
-        }
-
-
+        process_defered_resume();
       }
 
+      // Wakeup fibers whose timer expired, and the fibers they woke up.
+      process_timers();
+      process_defered_resume();
+
       // Call and Flush the defered functions.
       if (defered_functions.size())
       {
@@ -7376,6 +8975,7 @@ struct async_reactor {
 
     }
     std::cout << "END OF EVENT LOOP" << std::endl;
+    close_wakeup_fd();
     close(epoll_fd);
   }
 };
@@ -7385,6 +8985,17 @@ static void shutdown_handler(int sig) {
   std::cout << "The server will shutdown..." << std::endl;
 }
 
+// Stop the event loops on SIGINT, SIGTERM and SIGQUIT.
+inline void install_shutdown_handler() {
+  struct sigaction act;
+  memset(&act, 0, sizeof(act));
+  act.sa_handler = shutdown_handler;
+
+  sigaction(SIGINT, &act, 0);
+  sigaction(SIGTERM, &act, 0);
+  sigaction(SIGQUIT, &act, 0);
+}
+
 void async_fiber_context::epoll_add(int fd, int flags) {
   reactor->epoll_add(fd, flags, fiber_id);
 }
@@ -7400,6 +9011,31 @@ void async_fiber_context::defer_fiber_resume(int fiber_id)
   this->reactor->defered_resume.push_back(fiber_id);
 }
 
+bool async_fiber_context::is_closed() const {
+  return reactor->closed_fds[socket_fd] or (cancelled and *cancelled);
+}
+
+bool async_fiber_context::park() {
+  if (is_closed())
+    return false;
+  reactor->parked_fibers[fiber_id] = 1;
+  this->yield();
+  reactor->parked_fibers[fiber_id] = 0;
+  return !is_closed();
+}
+
+bool async_fiber_context::park_until(std::chrono::steady_clock::time_point deadline) {
+  if (is_closed())
+    return false;
+  uint64_t id = ++reactor->timer_counter;
+  reactor->timer_ids[fiber_id] = id;
+  reactor->timers.emplace(deadline, fiber_id, id);
+  bool open = this->park();
+  if (reactor->timer_ids[fiber_id] == id)
+    reactor->cancel_timer(fiber_id);
+  return open;
+}
+
 void async_fiber_context::reassign_fd_to_this_fiber(int fd) {
   this->reactor->reassign_fd_to_fiber(fd, this->fiber_id);
 }
@@ -7407,21 +9043,17 @@ void async_fiber_context::reassign_fd_to_this_fiber(int fd) {
 template <typename H>
 void start_tcp_server(int port, int socktype, int nthreads, H conn_handler,
                       std::string ssl_key_path = "", std::string ssl_cert_path = "",
-                      std::string ssl_ciphers = "") {
+                      std::string ssl_ciphers = "",
+                      const tcp_server_options& options = tcp_server_options()) {
 
-  struct sigaction act;
-  memset(&act, 0, sizeof(act));
-  act.sa_handler = shutdown_handler;
-
-  sigaction(SIGINT, &act, 0);
-  sigaction(SIGTERM, &act, 0);
-  sigaction(SIGQUIT, &act, 0);
+  install_shutdown_handler();
 
-  int server_fd = impl::create_and_bind(port, socktype);
+  int server_fd = impl::create_and_bind(port, socktype, options);
   std::vector<std::thread> ths;
   for (int i = 0; i < nthreads; i++)
     ths.push_back(std::thread([&] {
       async_reactor reactor;
+      reactor.options = options;
       if (ssl_cert_path.size()) // Initialize the SSL/TLS context.
         reactor.ssl_ctx = std::make_unique<ssl_context>(ssl_key_path, ssl_cert_path, ssl_ciphers);
       reactor.event_loop(server_fd, conn_handler);
@@ -7437,6 +9069,194 @@ void start_tcp_server(int port, int socktype, int nthreads, H conn_handler,
 
 #endif // LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_TCP_SERVER_HH
 
+#ifndef LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_TRAFFIC_CAPTURE_HH
+#define LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_TRAFFIC_CAPTURE_HH
+
+
+namespace li {
+
+// One request of a traffic capture.
+struct traffic_record {
+  int64_t time;        // Nanoseconds since the start of the capture, when the headers arrived.
+  uint32_t connection; // Requests received on the same connection have the same id.
+  int status;          // Status of the response of the server.
+  std::string request; // Raw request: headers and body.
+};
+
+// Binary log of the requests received by http_serve, written by a background thread:
+//
+//   http_serve(api, 8080, s::capture = "traffic.bin");
+//
+// The file starts with traffic_capture::magic, followed by one record per request: time
+// (int64), connection (uint32), status (uint32), request size (uint32) in host byte
+// order, then the request bytes. Requests are dropped when more than \max_pending bytes
+// wait for the writer. See traffic_capture_reader and benchmarks/replay.cc.
+struct traffic_capture {
+
+  static constexpr const char* magic = "LITHIUM_CAPTURE_1\n";
+  static constexpr int record_header_size = 20;
+
+  inline traffic_capture(const std::string& path, size_t max_pending = 64 * 1024 * 1024)
+      : max_pending_(max_pending), start_(std::chrono::steady_clock::now()) {
+    file_ = fopen(path.c_str(), "wb");
+    if (!file_)
+      throw std::runtime_error("traffic_capture: cannot open " + path + ": " + strerror(errno));
+    fwrite(magic, 1, strlen(magic), file_);
+    writer_ = std::thread([this] { write_loop(); });
+  }
+
+  traffic_capture(const traffic_capture&) = delete;
+  traffic_capture& operator=(const traffic_capture&) = delete;
+
+  // Write the pending requests and close the file.
+  inline ~traffic_capture() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    wakeup_.notify_one();
+    writer_.join();
+    fclose(file_);
+  }
+
+  // Id of a new connection.
+  inline uint32_t new_connection() { return next_connection_++; }
+
+  // Add a request. Called by the server threads.
+  inline void record(uint32_t connection, std::chrono::steady_clock::time_point arrival,
+                     int status, std::string_view headers, std::string_view body) {
+    int64_t time =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(arrival - start_).count();
+    uint32_t size = headers.size() + body.size();
+    uint32_t status32 = status;
+    char header[record_header_size];
+    memcpy(header, &time, 8);
+    memcpy(header + 8, &connection, 4);
+    memcpy(header + 12, &status32, 4);
+    memcpy(header + 16, &size, 4);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (pending_.size() + sizeof(header) + size > max_pending_) {
+      dropped_++;
+      return;
+    }
+    pending_.append(header, sizeof(header));
+    pending_.append(headers);
+    pending_.append(body);
+    recorded_++;
+  }
+
+  // Block until the requests recorded so far are written to the file.
+  inline void flush() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    long long target = recorded_;
+    flush_requested_ = true;
+    wakeup_.notify_one();
+    flushed_.wait(lock, [&] { return written_ >= target; });
+  }
+
+  inline long long recorded() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return recorded_;
+  }
+  inline long long dropped() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return dropped_;
+  }
+
+private:
+  inline void write_loop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      wakeup_.wait_for(lock, std::chrono::milliseconds(100),
+                       [&] { return stop_ or flush_requested_; });
+      bool stop = stop_;
+      flush_requested_ = false;
+      long long batch_end = recorded_;
+      std::swap(pending_, writing_);
+      lock.unlock();
+
+      if (writing_.size()) {
+        fwrite(writing_.data(), 1, writing_.size(), file_);
+        fflush(file_);
+        writing_.clear();
+      }
+
+      lock.lock();
+      written_ = batch_end;
+      flushed_.notify_all();
+      if (stop)
+        return;
+    }
+  }
+
+  FILE* file_ = nullptr;
+  size_t max_pending_;
+  std::chrono::steady_clock::time_point start_;
+  std::atomic<uint32_t> next_connection_{0};
+
+  std::mutex mutex_;
+  std::condition_variable wakeup_;
+  std::condition_variable flushed_;
+  std::string pending_;
+  std::string writing_;
+  bool stop_ = false;
+  bool flush_requested_ = false;
+  long long recorded_ = 0;
+  long long written_ = 0;
+  long long dropped_ = 0;
+  std::thread writer_;
+};
+
+// Read the records of a file written by traffic_capture.
+//
+//   traffic_capture_reader reader("traffic.bin");
+//   traffic_record r;
+//   while (reader.next(r)) ...
+struct traffic_capture_reader {
+
+  inline traffic_capture_reader(const std::string& path) {
+    file_ = fopen(path.c_str(), "rb");
+    if (!file_)
+      throw std::runtime_error("traffic_capture_reader: cannot open " + path + ": " +
+                               strerror(errno));
+    size_t magic_size = strlen(traffic_capture::magic);
+    std::string magic(magic_size, 0);
+    if (fread(magic.data(), 1, magic_size, file_) != magic_size or
+        magic != traffic_capture::magic) {
+      fclose(file_);
+      throw std::runtime_error("traffic_capture_reader: " + path + " is not a traffic capture.");
+    }
+  }
+
+  traffic_capture_reader(const traffic_capture_reader&) = delete;
+  traffic_capture_reader& operator=(const traffic_capture_reader&) = delete;
+  inline ~traffic_capture_reader() { fclose(file_); }
+
+  // Read the next record in \r. Return false at the end of the file, or on a truncated
+  // record.
+  inline bool next(traffic_record& r) {
+    char header[traffic_capture::record_header_size];
+    if (fread(header, 1, sizeof(header), file_) != sizeof(header))
+      return false;
+    uint32_t status, size;
+    memcpy(&r.time, header, 8);
+    memcpy(&r.connection, header + 8, 4);
+    memcpy(&status, header + 12, 4);
+    memcpy(&size, header + 16, 4);
+    r.status = status;
+    r.request.resize(size);
+    return fread(r.request.data(), 1, size, file_) == size;
+  }
+
+private:
+  FILE* file_ = nullptr;
+};
+
+} // namespace li
+
+#endif // LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_TRAFFIC_CAPTURE_HH
+
 #ifndef LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_URL_UNESCAPE_HH
 #define LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_URL_UNESCAPE_HH
 
@@ -8574,17 +10394,39 @@ http_top_header_builder http_top_header [[gnu::weak]];
 template <typename FIBER>
 struct generic_http_ctx {
 
+  typedef FIBER fiber_type;
+
+  // Sinks of the response buffers, called without indirection.
+  struct socket_sink {
+    FIBER* fiber;
+    void operator()(const char* d, int s) { fiber->write(d, s, impl::send_more_flag); }
+  };
+  typedef basic_output_buffer<socket_sink> output_stream_type;
+
+  struct output_stream_sink {
+    output_stream_type* output_stream;
+    void operator()(const char* d, int s) { *output_stream << std::string_view(d, s); }
+  };
+  typedef basic_output_buffer<output_stream_sink> response_stream_type;
+
+  typedef std::unordered_map<
+      std::string_view, std::string_view, std::hash<std::string_view>,
+      std::equal_to<std::string_view>,
+      arena_allocator<std::pair<const std::string_view, std::string_view>>>
+      string_view_map;
+
   generic_http_ctx(input_buffer& _rb, FIBER& _fiber) : rb(_rb), fiber(_fiber) {
-    get_parameters_map.reserve(10);
     response_headers.reserve(20);
 
-    output_stream = output_buffer(50*1024, [&](const char* d, int s) { fiber.write(d, s); });
-
-    headers_stream =
-        output_buffer(1000, [&](const char* d, int s) { output_stream << std::string_view(d, s); });
+    // The output stream only flushes by itself when it is full, and then more responses follow.
+    output_stream = output_stream_type(50 * 1024, socket_sink{&fiber});
 
-    json_stream = output_buffer(
-        50 * 1024, [&](const char* d, int s) { output_stream << std::string_view(d, s); });
+    // The headers and the JSON body are written before the status line and the
+    // Content-Length: they grow instead of flushing into the output stream.
+    headers_stream = response_stream_type(1000, output_stream_sink{&output_stream});
+    headers_stream.set_segment_chain(true);
+    json_stream = response_stream_type(4 * 1024, output_stream_sink{&output_stream});
+    json_stream.set_segment_chain(true);
   }
 
   generic_http_ctx& operator=(const generic_http_ctx&) = delete;
@@ -8671,7 +10513,7 @@ struct generic_http_ctx {
     return http_version_;
   }
 
-  inline void format_top_headers(output_buffer& output_stream) {
+  template <typename O> inline void format_top_headers(O& output_stream) {
     if (status_code_ == 200)
       output_stream << http_top_header.top_header_200();
     else
@@ -8728,11 +10570,55 @@ struct generic_http_ctx {
   //   return respond(std::string_view(s, strlen(s)));
   // }
 
+  // Bodies larger than this are not copied in output_stream. They are sent
+  // together with the pending responses with one writev.
+  static constexpr int zero_copy_body_threshold = 16 * 1024;
+
+  // Send the pending responses followed by \body with one vectored write.
+  void write_with_pending_responses(std::string_view body) {
+    auto pending = output_stream.to_string_view();
+    iovec iov[2] = {{(void*)pending.data(), pending.size()}, {(void*)body.data(), body.size()}};
+    fiber.writev(iov, 2);
+    output_stream.reset();
+  }
+
+  // Same with a body made of the segments of \body_stream.
+  void write_with_pending_responses(response_stream_type& body_stream) {
+    constexpr int max_iov = 32;
+    if (body_stream.segments_count() >= max_iov)
+      return write_with_pending_responses(body_stream.to_string_view());
+
+    iovec iov[max_iov];
+    auto pending = output_stream.to_string_view();
+    iov[0] = {(void*)pending.data(), pending.size()};
+    int n = 1;
+    body_stream.for_each_segment(
+        [&](std::string_view s) { iov[n++] = {(void*)s.data(), s.size()}; });
+    fiber.writev(iov, n);
+    output_stream.reset();
+  }
+
+  // Add \body after the headers, copying it only if it is small.
+  void respond_body(std::string_view body) {
+    if (body.size() >= zero_copy_body_threshold)
+      write_with_pending_responses(body);
+    else
+      output_stream << body;
+  }
+
+  void respond_body(response_stream_type& body_stream) {
+    if (body_stream.size() >= zero_copy_body_threshold)
+      write_with_pending_responses(body_stream);
+    else
+      body_stream.flush(); // flushes to output_stream.
+  }
+
   void respond(const std::string_view& s) {
     response_written_ = true;
     format_top_headers(output_stream);
     headers_stream.flush();                                             // flushes to output_stream.
-    output_stream << "Content-Length: " << s.size() << "\r\n\r\n" << s; // Add body
+    output_stream << "Content-Length: " << s.size() << "\r\n\r\n";
+    respond_body(s);
   }
 
   template <typename O> void respond_json(const O& obj) {
@@ -8742,8 +10628,9 @@ struct generic_http_ctx {
 
     format_top_headers(output_stream);
     headers_stream.flush(); // flushes to output_stream.
-    output_stream << "Content-Length: " << json_stream.to_string_view().size() << "\r\n\r\n";
-    json_stream.flush(); // flushes to output_stream.
+    output_stream << "Content-Length: " << json_stream.size() << "\r\n\r\n";
+    respond_body(json_stream);
+    json_stream.reset();
   }
 
   template <typename F> void respond_json_generator(int N, F callback) {
@@ -8753,13 +10640,76 @@ struct generic_http_ctx {
 
     format_top_headers(output_stream);
     headers_stream.flush(); // flushes to output_stream.
-    output_stream << "Content-Length: " << json_stream.to_string_view().size() << "\r\n\r\n";
-    json_stream.flush(); // flushes to output_stream.
-    
+    output_stream << "Content-Length: " << json_stream.size() << "\r\n\r\n";
+    respond_body(json_stream);
+    json_stream.reset();
+  }
+
+
+  // Chunked responses (Transfer-Encoding: chunked), used to stream a response of unknown size.
+  // start_chunked_response sends the status line and headers right away.
+  void start_chunked_response() {
+    response_written_ = true;
+    chunked_response_ = true;
+    format_top_headers(output_stream);
+    headers_stream.flush(); // flushes to output_stream.
+    output_stream << "Transfer-Encoding: chunked\r\n\r\n";
+    flush_responses();
+  }
+
+  // Send one chunk of a chunked response.
+  void write_chunk(std::string_view data) {
+    if (data.empty())
+      return; // An empty chunk would end the response.
+    char size[20];
+    int size_len = snprintf(size, sizeof(size), "%zx\r\n", data.size());
+    output_stream << std::string_view(size, size_len) << data << "\r\n";
+    flush_responses();
+  }
+
+  // Send a chunk that is already framed as "<hex size>\r\n<data>\r\n".
+  // This allows to serialize once a chunk sent to many connections.
+  void write_framed_chunk(std::string_view frame) {
+    flush_responses();
+    fiber.write(frame.data(), frame.size());
+  }
+
+  // Responses of known size streamed by the handler: start_response sends the status line,
+  // the headers and the Content-Length, then the handler sends the body with write_body.
+  void start_response(size_t content_length) {
+    response_written_ = true;
+    format_top_headers(output_stream);
+    headers_stream.flush(); // flushes to output_stream.
+    output_stream << "Content-Length: " << content_length << "\r\n\r\n";
+  }
+
+  void write_body(std::string_view data) {
+    output_stream << data;
+    flush_responses();
+  }
+
+  void end_chunked_response() {
+    if (chunked_response_) {
+      output_stream << "0\r\n\r\n";
+      chunked_response_ = false;
+    }
   }
 
+  // Answer an error thrown by the handler. Once the response is started, a second response
+  // would be read as part of the first one: the connection is closed after the partial
+  // response instead, without the last chunk so the client sees it truncated.
+  void respond_error(int status, std::string_view message) {
+    if (response_written_) {
+      chunked_response_ = false;
+      close_connection_ = true;
+      return;
+    }
+    set_status(status);
+    respond(message);
+  }
 
   void respond_if_needed() {
+    end_chunked_response();
     if (!response_written_) {
       response_written_ = true;
 
@@ -8829,15 +10779,40 @@ struct generic_http_ctx {
     case 409:
       status_ = "409 Conflict";
       break;
+    case 413:
+      status_ = "413 Payload Too Large";
+      break;
+    case 429:
+      status_ = "429 Too Many Requests";
+      break;
     case 500:
       status_ = "500 Internal Server Error";
       break;
+    case 502:
+      status_ = "502 Bad Gateway";
+      break;
+    case 503:
+      status_ = "503 Service Unavailable";
+      break;
+    case 504:
+      status_ = "504 Gateway Timeout";
+      break;
     default:
       status_ = "200 OK";
       break;
     }
   }
 
+  // Status without a case in set_status, for example forwarded from an upstream server.
+  // \status_line is the code followed by the reason phrase: "418 I'm a teapot".
+  void set_status(int status, std::string_view status_line) {
+    status_code_ = status;
+    char* line = (char*)arena.allocate(status_line.size() + 1, 1);
+    memcpy(line, status_line.data(), status_line.size());
+    line[status_line.size()] = 0;
+    status_ = line;
+  }
+
   void send_static_file(const char* path) {
     auto it = static_files.find(path);
     if (static_files.end() == it or !it->second.first.size()) {
@@ -8876,6 +10851,16 @@ struct generic_http_ctx {
   // private:
 
   void add_header_line(const char* l) { header_lines.push_back(l); }
+
+  // Follow the read buffer after input_buffer::reserve moved it by \offset.
+  bool move_header_lines(const char*& cur, long offset) {
+    if (!offset)
+      return false;
+    for (auto& l : header_lines)
+      l += offset;
+    cur += offset;
+    return true;
+  }
   const char* last_header_line() { return header_lines.back(); }
 
   // split a string, starting from cur and ending with split_char.
@@ -8984,6 +10969,10 @@ struct generic_http_ctx {
 
       while (content_length_ > n_body_read) {
         std::string_view part = rb.read_more_str(fiber);
+        if (part.empty()) {
+          connection_closed_ = true;
+          break;
+        }
         int l = part.size();
         int bl = std::min(l, content_length_ - n_body_read);
         part = std::string_view(part.data(), bl);
@@ -8996,20 +10985,20 @@ struct generic_http_ctx {
     } else if (chunked_) {
       // Chunked decoding.
       const char* cur = body_start.data();
-      int chunked_size = strtol(rb.read_until(read, cur, '\r').data(), nullptr, 16);
-      cur++; // skip \n
-      while (chunked_size > 0) {
+      int chunked_size;
+      while ((chunked_size = read_chunk_size(cur)) > 0) {
         // Read chunk.
-        std::string_view chunk = rb.read_n(read, cur, chunked_size);
+        std::string_view chunk = rb.read_n(fiber, cur, chunked_size);
+        if (int(chunk.size()) < chunked_size) {
+          connection_closed_ = true;
+          break;
+        }
         callback(chunk);
         rb.free(chunk);
         cur += chunked_size + 2; // skip \r\n.
-
-        // Read next chunk size.
-        chunked_size = strtol(rb.read_until(read, cur, '\r').data(), nullptr, 16);
-        cur++; // skip \n
       }
-      cur += 2; // skip the terminaison chunk.
+      if (!connection_closed_)
+        cur += 2; // skip the terminaison chunk.
       body_end_ = cur;
       body_ = std::string_view(body_start.data(), cur - body_start.data());
     }
@@ -9024,16 +11013,20 @@ struct generic_http_ctx {
 
     if (content_length_) {
       body_ = rb.read_n(fiber, body_start.data(), content_length_);
-      body_end_ = body_.data() + content_length_;
+      body_end_ = body_.data() + body_.size();
+      connection_closed_ = int(body_.size()) < content_length_;
     } else if (chunked_) {
       // Chunked decoding.
       char* out = (char*)body_start.data();
       const char* cur = body_start.data();
-      int chunked_size = strtol(rb.read_until(fiber, cur, '\r').data(), nullptr, 16);
-      cur++; // skip \n
-      while (chunked_size > 0) {
+      int chunked_size;
+      while ((chunked_size = read_chunk_size(cur)) > 0) {
         // Read chunk.
         std::string_view chunk = rb.read_n(fiber, cur, chunked_size);
+        if (int(chunk.size()) < chunked_size) {
+          connection_closed_ = true;
+          break;
+        }
         cur += chunked_size + 2; // skip \r\n.
         // Copy the body into a contiguous string.
         if (out + chunk.size() > chunk.data()) // use memmove if overlap.
@@ -9042,12 +11035,9 @@ struct generic_http_ctx {
           std::memcpy(out, chunk.data(), chunk.size());
 
         out += chunk.size();
-
-        // Read next chunk size.
-        chunked_size = strtol(rb.read_until(fiber, cur, '\r').data(), nullptr, 16);
-        cur++; // skip \n
       }
-      cur += 2; // skip the terminaison chunk.
+      if (!connection_closed_)
+        cur += 2; // skip the terminaison chunk.
       body_end_ = cur;
       body_ = std::string_view(body_start.data(), out - body_start.data());
     }
@@ -9056,6 +11046,19 @@ struct generic_http_ctx {
     return body_;
   }
 
+  // Read the size line of the next chunk and move \cur after it. Return -1 if the connection
+  // is closed before.
+  int read_chunk_size(const char*& cur) {
+    std::string_view line = rb.read_until(fiber, cur, '\r');
+    if (!line.data()) {
+      connection_closed_ = true;
+      return -1;
+    }
+    int size = strtol(line.data(), nullptr, 16);
+    cur++; // skip \n
+    return size;
+  }
+
   void read_multipart_formdata() {}
 
   template <typename F> void post_iterate(F kv_callback) {
@@ -9074,7 +11077,7 @@ struct generic_http_ctx {
   }
 
   // Read post parameters in the body.
-  std::unordered_map<std::string_view, std::string_view> post_parameters() {
+  const string_view_map& post_parameters() {
     if (content_type_ == "application/x-www-form-urlencoded") {
       if (!is_body_read_)
         read_whole_body();
@@ -9086,9 +11089,15 @@ struct generic_http_ctx {
     return post_parameters_map;
   }
 
-  void prepare_next_request() {
+  // Return false if the connection was closed before the end of the body, or must be closed
+  // after a broken response (see respond_error).
+  bool prepare_next_request() {
+    if (close_connection_)
+      return false;
     if (!is_body_read_)
       read_whole_body();
+    if (connection_closed_)
+      return false;
 
     // std::cout <<"free line0: " << uint64_t(header_lines[0]) << std::endl;
     // std::cout << rb.current_size() << " " << rb.cursor << std::endl;
@@ -9097,21 +11106,45 @@ struct generic_http_ctx {
     // rb.cursor = rb.end = 0;
     // assert(rb.cursor == 0);
     headers_stream.reset();
+    status_code_ = 200;
     status_ = "200 OK";
+    body_ = std::string_view();
     method_ = std::string_view();
     url_ = std::string_view();
     http_version_ = std::string_view();
     content_type_ = std::string_view();
-    header_map.clear();
-    cookie_map.clear();
     response_headers.clear();
-    get_parameters_map.clear();
-    post_parameters_map.clear();
     get_parameters_string_ = std::string_view();
     response_written_ = false;
+    chunked_response_ = false;
+
+    // The maps are allocated in the arena: drop them before resetting it.
+    header_map = string_view_map(arena);
+    cookie_map = string_view_map(arena);
+    get_parameters_map = string_view_map(arena);
+    post_parameters_map = string_view_map(arena);
+    arena.reset();
+    return true;
+  }
+
+  // Give the memory of the buffers back to the pool while the connection is idle.
+  // All the responses must be sent.
+  void release_buffers() {
+    rb.release();
+    output_stream.release();
+    headers_stream.release();
+    json_stream.release();
+    arena.release();
   }
 
-  void flush_responses() { output_stream.flush(); }
+  // Send the pending responses. This is the last write of a batch, so no MSG_MORE here.
+  void flush_responses() {
+    if (output_stream.size()) {
+      auto pending = output_stream.to_string_view();
+      fiber.write(pending.data(), pending.size());
+      output_stream.reset();
+    }
+  }
 
   int socket_fd;
   input_buffer& rb;
@@ -9124,15 +11157,21 @@ struct generic_http_ctx {
   std::string_view content_type_;
   bool chunked_;
   int content_length_;
-  std::unordered_map<std::string_view, std::string_view> header_map;
-  std::unordered_map<std::string_view, std::string_view> cookie_map;
+
+  // Memory of the current request, reset after the response.
+  monotonic_arena arena;
+  string_view_map header_map{arena};
+  string_view_map cookie_map{arena};
   std::vector<std::pair<std::string_view, std::string_view>> response_headers;
-  std::unordered_map<std::string_view, std::string_view> get_parameters_map;
-  std::unordered_map<std::string_view, std::string_view> post_parameters_map;
+  string_view_map get_parameters_map{arena};
+  string_view_map post_parameters_map{arena};
   std::string_view get_parameters_string_;
   // std::vector<std::string> strings_saver;
 
   bool is_body_read_ = false;
+  // Set when the connection is closed before the end of the body, which is then truncated.
+  bool connection_closed_ = false;
+  bool close_connection_ = false;
   std::string body_local_buffer_;
   std::string_view body_;
   std::string_view body_start;
@@ -9140,27 +11179,48 @@ struct generic_http_ctx {
   std::vector<const char*> header_lines;
   FIBER& fiber;
 
-  output_buffer headers_stream;
+  response_stream_type headers_stream;
   bool response_written_ = false;
+  bool chunked_response_ = false;
 
-  output_buffer output_stream;
-  output_buffer json_stream;
+  output_stream_type output_stream;
+  response_stream_type json_stream;
 };
 using http_ctx = generic_http_ctx<async_fiber_context>;
 
-template <typename F> auto make_http_processor(F handler) {
-  return [handler](auto& fiber) {
+// With \capture, the requests and the status of their responses are recorded.
+template <typename F> auto make_http_processor(F handler, traffic_capture* capture = nullptr) {
+  return [handler, capture](auto& fiber) {
     try {
       input_buffer rb;
       bool socket_is_valid = true;
 
       auto ctx = generic_http_ctx(rb, fiber);
       ctx.socket_fd = fiber.socket_fd;
+
+      uint32_t connection_id = capture ? capture->new_connection() : 0;
+      std::string captured_headers;
+      std::chrono::steady_clock::time_point arrival;
       
       while (true) {
         ctx.is_body_read_ = false;
         ctx.header_lines.clear();
         ctx.header_lines.reserve(100);
+
+        // Responses are coalesced while pipelined requests are already in the read buffer.
+        // They are sent just before waiting for more data from the socket.
+        if (rb.empty()) {
+          ctx.flush_responses();
+          int received;
+          while ((received = rb.read_more_nowait(fiber)) < 0) {
+            // The connection is idle: give its buffers back to the pool while waiting.
+            ctx.release_buffers();
+            fiber.park();
+          }
+          if (received == 0)
+            return;
+        }
+
         // Read until there is a complete header.
         int header_start = rb.cursor;
         int header_end = rb.cursor;
@@ -9172,10 +11232,6 @@ template <typename F> auto make_http_processor(F handler) {
 
         bool complete_header = false;
 
-        if (rb.empty())
-          if (!rb.read_more(fiber))
-            return;
-
         const char* cur = rb.data() + header_end;
         const char* rbend = rb.data() + rb.end - 3;
         while (!complete_header) {
@@ -9208,22 +11264,45 @@ template <typename F> auto make_http_processor(F handler) {
           }
 
           // Read more data from the socket if the headers are not complete.
-          if (!complete_header && 0 == rb.read_more(fiber)) return;
+          if (!complete_header) {
+            ctx.flush_responses();
+            // Grow the buffer if the headers fill it.
+            if (rb.end == rb.capacity())
+              ctx.move_header_lines(cur, rb.reserve(rb.current_size() + 1));
+            if (0 == rb.read_more(fiber))
+              return;
+          }
         }
 
         // Header is complete. Process it.
+        ctx.prepare_request();
+
+        // Make room for the body before the handler keeps pointers to the headers.
+        int body_size = ctx.chunked_ ? input_buffer::max_size : ctx.content_length_;
+        if (ctx.move_header_lines(cur, rb.reserve(cur - ctx.header_lines[0] + body_size)))
+          ctx.prepare_request();
+        header_end = cur - rb.data();
+
+        // The handler may overwrite the headers while reading the body: copy them.
+        if (capture) {
+          arrival = std::chrono::steady_clock::now();
+          captured_headers.assign(ctx.header_lines[0], cur);
+        }
+
         // Run the handler.
         assert(rb.cursor <= rb.end);
         ctx.body_start = std::string_view(rb.data() + header_end, rb.end - header_end);
-        ctx.prepare_request();
         handler(ctx);
         assert(rb.cursor <= rb.end);
 
+        if (capture)
+          capture->record(connection_id, arrival, ctx.status_code_, captured_headers,
+                          ctx.is_body_read_ ? ctx.body_ : ctx.read_whole_body());
+
         // Update the cursor the beginning of the next request.
-        ctx.prepare_next_request();
-        // if read buffer is empty, we can flush the output buffer.
-        if (rb.empty())
-          ctx.flush_responses();
+        // Do not process the pipelined requests of a closed connection.
+        if (!ctx.prepare_next_request() or fiber.is_closed())
+          return;
       }
     } catch (const std::runtime_error& e) {
       std::cerr << "Error: " << e.what() << std::endl;
@@ -9243,209 +11322,366 @@ template <typename F> auto make_http_processor(F handler) {
 #ifndef LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_URL_DECODE_HH
 #define LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_URL_DECODE_HH
 
+
 #if defined(_MSC_VER)
 #endif
 
 
 namespace li {
-// Decode a plain value.
-template <typename O>
-std::string_view url_decode2(std::set<void*>& found, std::string_view str, O& obj) {
-  if (str.size() == 0)
-    throw std::runtime_error(format_error("url_decode error: expected key end"));
-
-  if (str[0] != '=')
-    throw std::runtime_error(format_error("url_decode error: expected =, got ", str[0]));
-
-  int start = 1;
-  int end = 1;
-
-  while (str.size() != end && str[end] != '&')
-    end++;
-
-  if (start != end) {
-    std::string content(str.substr(start, end - start));
-    // Url escape.
-    //content.resize(MHD_http_unescape(&content[0]));
-    if constexpr(std::is_same<std::remove_reference_t<decltype(obj)>, std::string>::value or
-                std::is_same<std::remove_reference_t<decltype(obj)>, std::string_view>::value)
-      obj = content;
-    else
-      obj = boost::lexical_cast<O>(content);
-    found.insert(&obj);
+
+namespace internal {
+// std::string, or a string with another allocator like arena_string.
+template <typename T> struct is_basic_string : std::false_type {};
+template <typename A>
+struct is_basic_string<std::basic_string<char, std::char_traits<char>, A>> : std::true_type {};
+} // namespace internal
+
+namespace internal {
+// std::from_chars rejects the leading + that boost::lexical_cast accepts.
+inline std::string_view url_skip_plus_sign(std::string_view str) {
+  if (str.size() > 1 and str[0] == '+' and str[1] != '-')
+    str.remove_prefix(1);
+  return str;
+}
+} // namespace internal
+
+// Parse \str into \v. Return false if \str is not a valid \T.
+// Numbers are parsed with std::from_chars, other types with boost::lexical_cast.
+template <typename T> bool url_decode_value(std::string_view str, T& v) {
+  if constexpr (internal::is_basic_string<T>::value or std::is_same<T, std::string_view>::value) {
+    v = str;
+    return true;
+  } else if constexpr (std::is_integral<T>::value and !std::is_same<T, bool>::value and
+                       !std::is_same<T, char>::value) {
+    str = internal::url_skip_plus_sign(str);
+    auto [end, error] = std::from_chars(str.data(), str.data() + str.size(), v);
+    return error == std::errc() and end == str.data() + str.size();
+  }
+#if defined(__cpp_lib_to_chars)
+  else if constexpr (std::is_floating_point<T>::value) {
+    str = internal::url_skip_plus_sign(str);
+    auto [end, error] = std::from_chars(str.data(), str.data() + str.size(), v);
+    return error == std::errc() and end == str.data() + str.size();
+  }
+#endif
+  else {
+    try {
+      v = boost::lexical_cast<T>(str);
+      return true;
+    } catch (const boost::bad_lexical_cast&) {
+      return false;
+    }
   }
-  if (end == str.size())
-    return str.substr(end, 0);
-  else
-    return str.substr(end + 1, str.size() - end - 1);
 }
 
-template <typename O>
-std::string_view url_decode2(std::set<void*>& found, std::string_view str, std::optional<O>& obj) {
-  O o;
-  auto ret = url_decode2(found, str, o);
-  obj = o;
-  return ret;
+namespace internal {
+
+inline bool url_is_escaped(std::string_view s) {
+  for (char c : s)
+    if (c == '%' or c == '+')
+      return true;
+  return false;
 }
 
-template <typename... O>
-std::string_view url_decode2(std::set<void*>& found, std::string_view str, metamap<O...>& obj,
-                             bool root = false);
+inline int url_hex_value(char c) {
+  if (c >= '0' and c <= '9')
+    return c - '0';
+  if (c >= 'a' and c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' and c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
 
-// Decode an array element.
-template <typename O>
-std::string_view url_decode2(std::set<void*>& found, std::string_view str, std::vector<O>& obj) {
-  if (str.size() == 0)
-    throw std::runtime_error(format_error("url_decode error: expected key end", str[0]));
+// Decode %XX sequences and + into \out. \out can be \in.data().
+// Return the size of the decoded string.
+inline int url_unescape_to(std::string_view in, char* out) {
+  int o = 0;
+  for (int i = 0; i < int(in.size()); i++) {
+    int h, l;
+    if (in[i] == '+')
+      out[o++] = ' ';
+    else if (in[i] == '%' and i + 2 < int(in.size()) and (h = url_hex_value(in[i + 1])) >= 0 and
+             (l = url_hex_value(in[i + 2])) >= 0) {
+      out[o++] = char(h * 16 + l);
+      i += 2;
+    } else
+      out[o++] = in[i];
+  }
+  return o;
+}
 
-  if (str[0] != '[')
-    throw std::runtime_error(format_error("url_decode error: expected [, got ", str[0]));
+// Decode a value, unescaping it only if it contains % or +.
+// Escaped std::string_view values are decoded in \arena, the input is never modified.
+template <typename T>
+bool url_decode_escaped_value(std::string_view str, T& v, monotonic_arena* arena) {
+  if (!url_is_escaped(str))
+    return url_decode_value(str, v);
 
-  // Get the index substring.
-  int index_start = 1;
-  int index_end = 1;
+  if constexpr (std::is_same<T, std::string_view>::value) {
+    if (!arena)
+      throw std::runtime_error(
+          "url_decode error: escaped std::string_view values need an arena");
+    char* data = (char*)arena->allocate(str.size(), 1);
+    v = std::string_view(data, url_unescape_to(str, data));
+    return true;
+  } else if constexpr (is_basic_string<T>::value) {
+    v.resize(str.size());
+    v.resize(url_unescape_to(str, v.data()));
+    return true;
+  } else {
+    char buffer[64];
+    if (str.size() > sizeof(buffer))
+      return false;
+    return url_decode_value(std::string_view(buffer, url_unescape_to(str, buffer)), v);
+  }
+}
 
-  while (str.size() != index_end and str[index_end] != ']')
-    index_end++;
+// Number of values that must be present to decode a T.
+// Optionals and arrays are not required.
+template <typename T> struct url_decode_required_fields { static constexpr int value = 1; };
+template <typename T> struct url_decode_required_fields<std::optional<T>> {
+  static constexpr int value = 0;
+};
+template <typename T> struct url_decode_required_fields<std::vector<T>> {
+  static constexpr int value = 0;
+};
+template <typename... M> struct url_decode_required_fields<metamap<M...>> {
+  static constexpr int value =
+      (0 + ... + url_decode_required_fields<typename M::_iod_value_type>::value);
+};
 
-  if (str.size() == 0)
-    throw std::runtime_error(format_error("url_decode error: expected key end", str[0]));
+// Compile time perfect hash of the keys of metamap<M...>. The slot of a key is
+// (symbol_hash(key) >> shift) & (table_size - 1).
+template <typename... M> struct url_decode_keys {
 
-  auto next_str = str.substr(index_end + 1, str.size() - index_end - 1);
+  static constexpr int size = sizeof...(M);
+  static constexpr std::array<uint64_t, size> hashes = {
+      symbol_hash(typename M::_iod_symbol_type{})...};
 
-  if (index_end == index_start) // [] syntax, push back a value.
-  {
-    O x;
-    auto ret = url_decode2(found, next_str, x);
-    obj.push_back(x);
-    return ret;
-  } else // [idx] set index idx.
-  {
-    int idx = std::strtol(str.data() + index_start, nullptr, 10);
-    if (idx >= 0 and idx <= 9999) {
-      if (int(obj.size()) <= idx)
-        obj.resize(idx + 1);
-      return url_decode2(found, next_str, obj[idx]);
-    } else
-      throw std::runtime_error(format_error("url_decode error: out of bound array subscript."));
+  // Position of the presence bits of each member.
+  static constexpr std::array<int, size + 1> offsets = [] {
+    std::array<int, size + 1> res{};
+    int n[] = {0, url_decode_required_fields<typename M::_iod_value_type>::value...};
+    for (int i = 0; i < size; i++)
+      res[i + 1] = res[i] + n[i + 1];
+    return res;
+  }();
+
+  // Find the smallest table and the shift that give a different slot to each key.
+  static constexpr std::pair<int, int> parameters = [] {
+    for (int table_size = 1;; table_size *= 2) {
+      if (table_size < size)
+        continue;
+      for (int shift = 0; shift < 48; shift++) {
+        bool collision = false;
+        for (int i = 0; i < size and !collision; i++)
+          for (int j = i + 1; j < size and !collision; j++)
+            collision = ((hashes[i] >> shift) & (table_size - 1)) ==
+                        ((hashes[j] >> shift) & (table_size - 1));
+        if (!collision)
+          return std::make_pair(table_size, shift);
+      }
+    }
+  }();
+  static constexpr int table_size = parameters.first;
+  static constexpr int shift = parameters.second;
+
+  // Index of the member of each slot, -1 if the slot is empty.
+  static constexpr std::array<int, table_size> table = [] {
+    std::array<int, table_size> res{};
+    for (int i = 0; i < table_size; i++)
+      res[i] = -1;
+    for (int i = 0; i < size; i++)
+      res[(hashes[i] >> shift) & (table_size - 1)] = i;
+    return res;
+  }();
+
+  // Index of the member named \key, -1 if none.
+  static int find(std::string_view key) {
+    if constexpr (size == 0)
+      return -1;
+    else {
+      uint64_t h = symbol_hash(key);
+      int i = table[(h >> shift) & (table_size - 1)];
+      if (i < 0 or hashes[i] != h)
+        return -1;
+      return i;
+    }
   }
+};
+
+// Call f(k, obj[k], i) on the i-th member of \obj.
+template <typename... M, typename F, std::size_t... I>
+void url_decode_member(metamap<M...>& obj, int i, F f, std::index_sequence<I...>) {
+  (void)((i == int(I) ? (f(typename M::_iod_symbol_type{}, obj[typename M::_iod_symbol_type{}], I),
+                         true)
+                      : false) or
+         ...);
 }
 
-// Decode an object member.
-template <typename... O>
-std::string_view url_decode2(std::set<void*>& found, std::string_view str, metamap<O...>& obj,
-                             bool root) {
-  if (str.size() == 0)
-    throw http_error::bad_request("url_decode error: expected key end", str[0]);
+// Decode \value in \obj at the location described by \key, for example
+// "name", "[name]", "[3]" or "[3][name]".
+// \found tracks the required fields that are decoded, \slot is the index of \obj in \found.
+template <typename B, typename O>
+void url_decode2(B& found, int slot, std::string_view key, std::string_view value, O& obj,
+                 monotonic_arena* arena) {
+  if (key.size())
+    throw std::runtime_error(format_error("url_decode error: expected =, got ", key[0]));
+  if (value.size() == 0)
+    return;
+  if (!url_decode_escaped_value(value, obj, arena))
+    throw std::runtime_error(format_error("url_decode error: invalid value ", value));
+  found.set(slot);
+}
+
+template <typename B, typename... M>
+void url_decode2(B& found, int slot, std::string_view key, std::string_view value,
+                 metamap<M...>& obj, monotonic_arena* arena, bool root = false);
 
-  int key_start = 0;
-  int key_end = key_start + 1;
+template <typename B, typename O>
+void url_decode2(B& found, int slot, std::string_view key, std::string_view value,
+                 std::optional<O>& obj, monotonic_arena* arena) {
+  std::bitset<url_decode_required_fields<O>::value + 1> element_found;
+  O o;
+  url_decode2(element_found, 0, key, value, o, arena);
+  if (value.size())
+    obj = std::move(o);
+}
 
-  int next = 0;
+template <typename B, typename O>
+void url_decode2(B& found, int slot, std::string_view key, std::string_view value,
+                 std::vector<O>& obj, monotonic_arena* arena) {
+  if (key.size() == 0 or key[0] != '[')
+    throw std::runtime_error("url_decode error: expected [");
+  size_t index_end = key.find(']');
+  if (index_end == std::string_view::npos)
+    throw std::runtime_error("url_decode error: expected ]");
 
-  if (!root) {
-    if (str[0] != '[')
-      throw std::runtime_error(format_error("url_decode error: expected [, got ", str[0]));
+  std::string_view index = key.substr(1, index_end - 1);
+  std::string_view next_key = key.substr(index_end + 1);
 
-    key_start = 1;
-    while (key_end != str.size() && str[key_end] != ']' && str[key_end] != '=')
-      key_end++;
+  // Required fields are not checked inside arrays.
+  std::bitset<url_decode_required_fields<O>::value + 1> element_found;
 
-    if (key_end == str.size())
-      throw std::runtime_error("url_decode error: unexpected end.");
-    next = key_end + 1; // skip the ]
-  } else {
-    while (key_end < str.size() && str[key_end] != '[' && str[key_end] != '=')
-      key_end++;
-    next = key_end;
+  if (index.size() == 0) // [] syntax, push back a value.
+  {
+    O x;
+    url_decode2(element_found, 0, next_key, value, x, arena);
+    obj.push_back(std::move(x));
+  } else // [idx] set index idx.
+  {
+    int idx = -1;
+    url_decode_value(index, idx);
+    if (idx < 0 or idx > 9999)
+      throw std::runtime_error(format_error("url_decode error: out of bound array subscript."));
+    if (int(obj.size()) <= idx)
+      obj.resize(idx + 1);
+    url_decode2(element_found, 0, next_key, value, obj[idx], arena);
   }
+}
 
-  auto key = str.substr(key_start, key_end - key_start);
-  auto next_str = str.substr(next, str.size() - next);
+template <typename B, typename... M>
+void url_decode2(B& found, int slot, std::string_view key, std::string_view value,
+                 metamap<M...>& obj, monotonic_arena* arena, bool root) {
+  std::string_view name;
+  if (root) {
+    size_t end = key.find('[');
+    name = key.substr(0, end);
+    key = end == std::string_view::npos ? std::string_view() : key.substr(end);
+  } else {
+    size_t end = key.find(']');
+    if (key.size() == 0 or key[0] != '[' or end == std::string_view::npos)
+      throw std::runtime_error("url_decode error: expected [key]");
+    name = key.substr(1, end - 1);
+    key = key.substr(end + 1);
+  }
 
-  std::string_view ret;
-  map(obj, [&](auto k, auto& v) {
-    if (li::symbol_string(k) == key) {
-      try {
-        ret = url_decode2(found, next_str, v);
-      } catch (std::exception e) {
-        throw std::runtime_error(
-            format_error("url_decode error: cannot decode parameter ", li::symbol_string(k)));
-      }
-    }
-  });
-  return ret;
+  typedef url_decode_keys<M...> keys;
+  int i = keys::find(name);
+  if (i < 0) // Unknown keys are ignored.
+    return;
+  url_decode_member(
+      obj, i,
+      [&](auto k, auto& v, int member_index) {
+        if (name != symbol_string(k))
+          return;
+        try {
+          url_decode2(found, slot + keys::offsets[member_index], key, value, v, arena);
+        } catch (const std::exception& e) {
+          throw std::runtime_error(
+              format_error("url_decode error: cannot decode parameter ", li::symbol_string(k)));
+        }
+      },
+      std::index_sequence_for<M...>{});
 }
 
-template <typename O>
-std::string url_decode_check_missing_fields(const std::set<void*>& found, std::optional<O>& obj) {
-  return std::string();
+// Return the name of the first required field of \obj that is missing, prefixed with its path.
+template <typename B, typename O>
+std::string url_decode_check_missing_fields(const B& found, int slot, O& obj) {
+  return found.test(slot) ? std::string() : std::string(" ");
 }
-
-template <typename O>
-std::string url_decode_check_missing_fields(const std::set<void*>& found, O& obj) {
-  if (found.find(&obj) == found.end())
-    return " ";
-  else
-    return std::string();
+template <typename B, typename O>
+std::string url_decode_check_missing_fields(const B& found, int slot, std::optional<O>& obj) {
+  return std::string();
 }
-
-template <typename O>
-std::string url_decode_check_missing_fields(const std::set<void*>& found, std::vector<O>& obj) {
-  // Fixme : implement missing fields checking in std::vector<metamap<O...>>
-  // for (int i = 0; i < obj.size(); i++)
-  // {
-  //   std::string missing = url_decode_check_missing_fields(found, obj[i]);
-  //   if (missing.size())
-  //   {
-  //     std::ostringstream ss;
-  //     ss << '[' << i << "]" << missing;
-  //     return ss.str();
-  //   }
-  // }
+template <typename B, typename O>
+std::string url_decode_check_missing_fields(const B& found, int slot, std::vector<O>& obj) {
   return std::string();
 }
-
-template <typename... O>
-std::string url_decode_check_missing_fields(const std::set<void*>& found, metamap<O...>& obj,
+template <typename B, typename... M>
+std::string url_decode_check_missing_fields(const B& found, int slot, metamap<M...>& obj,
                                             bool root = false) {
+  typedef url_decode_keys<M...> keys;
   std::string missing;
+  int i = 0;
   map(obj, [&](auto k, auto& v) {
-    if (missing.size())
-      return;
-    missing = url_decode_check_missing_fields(found, v);
-    if (missing.size())
-      missing = (root ? "" : ".") + std::string(li::symbol_string(k)) + missing;
+    if (missing.empty()) {
+      missing = url_decode_check_missing_fields(found, slot + keys::offsets[i], v);
+      if (missing.size())
+        missing = (root ? "" : ".") + std::string(li::symbol_string(k)) + missing;
+    }
+    i++;
   });
   return missing;
 }
 
-template <typename S, typename... O>
-std::string url_decode_check_missing_fields_on_subset(const std::set<void*>& found,
-                                                      metamap<O...>& obj, bool root = false) {
-  std::string missing;
-  map(S(), [&](auto k, auto) {
-    if (missing.size())
-      return;
-    auto& v = obj[k];
-    missing = url_decode_check_missing_fields(found, v);
-    if (missing.size())
-      missing = (root ? "" : ".") + std::string(li::symbol_string(k)) + missing;
-  });
-  return missing;
-}
+} // namespace internal
 
-// Frontend.
-template <typename O> void url_decode(std::string_view str, O& obj) {
-  std::set<void*> found;
+// Decode the urlencoded string \str in \obj. \str is not modified.
+// Keys and values are unescaped only when they contain % or +. std::string_view members
+// point in \str, or in \arena when their value is escaped (an error without \arena).
+template <typename O>
+void url_decode(std::string_view str, O& obj, monotonic_arena* arena = nullptr) {
+  std::bitset<internal::url_decode_required_fields<O>::value + 1> found;
+
+  while (str.size() > 0) {
+    size_t end = str.find('&');
+    std::string_view key_value = str.substr(0, end);
+    str = end == std::string_view::npos ? std::string_view() : str.substr(end + 1);
+    if (key_value.empty())
+      continue;
 
-  // Parse the urlencoded string
-  while (str.size() > 0)
-    str = url_decode2(found, str, obj, true);
+    size_t equal = key_value.find('=');
+    if (equal == std::string_view::npos)
+      throw std::runtime_error("url_decode error: expected =");
+    std::string_view key = key_value.substr(0, equal);
+    std::string_view value = key_value.substr(equal + 1);
 
-  // Check for missing fields.
-  std::string missing = url_decode_check_missing_fields(found, obj, true);
-  if (missing.size())
+    // Escaped keys are decoded in a buffer, the input string is left untouched.
+    char key_buffer[256];
+    if (internal::url_is_escaped(key)) {
+      if (key.size() > sizeof(key_buffer))
+        continue;
+      key = std::string_view(key_buffer, internal::url_unescape_to(key, key_buffer));
+    }
+
+    internal::url_decode2(found, 0, key, value, obj, arena, true);
+  }
+
+  // Check for missing fields.
+  std::string missing = internal::url_decode_check_missing_fields(found, 0, obj, true);
+  if (missing.size())
     throw std::runtime_error(format_error("Missing argument ", missing));
 }
 
@@ -9457,15 +11693,21 @@ template <typename O> void url_decode(std::string_view str, O& obj) {
 
 namespace li {
 
-struct http_request {
+// Request of a generic_http_ctx: http_request with the fibers of async_reactor,
+// coro_http_request with the coroutines of coro_reactor.
+template <typename CTX> struct basic_http_request {
 
-  http_request(http_async_impl::http_ctx& http_ctx) : http_ctx(http_ctx), fiber(http_ctx.fiber) {}
+  basic_http_request(CTX& http_ctx) : http_ctx(http_ctx), fiber(http_ctx.fiber) {}
 
   inline std::string_view header(const char* k) const;
   inline std::string_view cookie(const char* k) const;
 
   inline std::string ip_address() const;
 
+  // Memory freed in one shot after the response, for the handler scratch data.
+  // For example: arena_string name(request.arena());
+  inline monotonic_arena& arena() const;
+
   // With list of parameters: s::id = int(), s::name = string(), ...
   template <typename S, typename V, typename... T>
   auto url_parameters(assign_exp<S, V> e, T... tail) const;
@@ -9484,9 +11726,12 @@ struct http_request {
   template <typename O> auto get_parameters(O& res) const;
   template <typename O> auto post_parameters(O& res) const;
 
-  http_async_impl::http_ctx& http_ctx;
-  async_fiber_context& fiber;
+  CTX& http_ctx;
+  typename CTX::fiber_type& fiber;
   std::string_view url_spec;
+  // Values of the url parameters and their names, set by the router.
+  route_params url_params;
+  const route_params_layout* url_params_layout = nullptr;
 };
 
 struct url_parser_info_node {
@@ -9529,15 +11774,24 @@ inline auto make_url_parser_info(const std::string_view url) {
   return info;
 }
 
+// Decode the url parameter \k of \obj from its value in the url.
+template <typename K, typename O>
+void decode_url_parameter(K k, std::string_view content, bool is_path, O& obj) {
+  auto& v = obj[k];
+  if (is_path) {
+    if constexpr (internal::is_basic_string<std::decay_t<decltype(v)>>::value or
+                  std::is_same<std::decay_t<decltype(v)>, std::string_view>::value) {
+      v = content;
+    } else {
+      throw std::runtime_error(
+          "{{path...}} parameters only accept std::string or std::string_view types.");
+    }
+  } else if (!url_decode_value(content, v))
+    throw http_error::bad_request("Cannot decode url parameter ", li::symbol_string(k));
+}
+
 template <typename O>
 auto parse_url_parameters(const url_parser_info& fmt, const std::string_view url, O& obj) {
-  // get the indexes of the slashes in url.
-  std::vector<int> slashes;
-  for (int i = 0; i < int(url.size()); i++) {
-    if (url[i] == '/')
-      slashes.push_back(i);
-  }
-
   // For each field in O...
   //  find the location of the field in the url thanks to fmt.
   //  get it.
@@ -9548,52 +11802,45 @@ auto parse_url_parameters(const url_parser_info& fmt, const std::string_view url
       throw std::runtime_error(std::string("Parameter ") + symbol_str + " not found in url " +
                                url.data());
     } else {
-      // Location of the parameter in the url.
-      int param_slash = it->second.slash_pos; // index of slash before param.
-      if (param_slash >= int(slashes.size()))
-        throw http_error::bad_request("Missing url parameter ", symbol_str);
-
-      int param_start = slashes[param_slash] + 1;
-      if (it->second.is_path) {
-        if constexpr (std::is_same<std::decay_t<decltype(obj[k])>, std::string>::value or
-                      std::is_same<std::decay_t<decltype(obj[k])>, std::string_view>::value) {
-          obj[k] = std::string_view(url.data() + param_start - 1,
-                                    url.size() - param_start + 1); // -1 to include the first /.
-        } else {
-          throw std::runtime_error(
-              "{{path...}} parameters only accept std::string or std::string_view types.");
-        }
+      // Location of the parameter in the url: find the slash before the param.
+      int param_slash = it->second.slash_pos;
+      int param_start = 0;
+      for (int n = -1; n < param_slash; param_start++) {
+        if (param_start == int(url.size()))
+          throw http_error::bad_request("Missing url parameter ", symbol_str);
+        if (url[param_start] == '/')
+          n++;
+      }
 
-      } else {
+      if (it->second.is_path)
+        decode_url_parameter(k, url.substr(param_start - 1), true, obj); // -1 to include the first /.
+      else {
         int param_end = param_start;
         while (int(url.size()) > (param_end) and url[param_end] != '/')
           param_end++;
-
-        std::string_view content(url.data() + param_start, param_end - param_start);
-        try {
-          if constexpr (std::is_same<std::remove_reference_t<decltype(v)>, std::string>::value or
-                        std::is_same<std::remove_reference_t<decltype(v)>, std::string_view>::value)
-            obj[k] = content;
-          else
-            obj[k] = boost::lexical_cast<decltype(v)>(content);
-        } catch (const std::bad_cast& e) {
-          throw http_error::bad_request("Cannot decode url parameter ", li::symbol_string(k), " : ",
-                                        e.what());
-        }
+        decode_url_parameter(k, url.substr(param_start, param_end - param_start), false, obj);
       }
     }
   });
   return obj;
 }
 
-inline std::string_view http_request::header(const char* k) const { return http_ctx.header(k); }
+template <typename CTX>
+inline std::string_view basic_http_request<CTX>::header(const char* k) const {
+  return http_ctx.header(k);
+}
+
+template <typename CTX>
+inline monotonic_arena& basic_http_request<CTX>::arena() const { return http_ctx.arena; }
 
-inline std::string_view http_request::cookie(const char* k) const {
+template <typename CTX>
+inline std::string_view basic_http_request<CTX>::cookie(const char* k) const {
   return http_ctx.cookie(k);
   // FIXME return MHD_lookup_connection_value(mhd_connection, MHD_COOKIE_KIND, k);
 }
 
-inline std::string http_request::ip_address() const {
+template <typename CTX>
+inline std::string basic_http_request<CTX>::ip_address() const {
   std::string s;
   switch (fiber.in_addr.sa_family) {
   case AF_INET: {
@@ -9613,48 +11860,71 @@ inline std::string http_request::ip_address() const {
     break;
   }
 
+  s.resize(strlen(s.c_str())); // inet_ntop wrote less than the maximum length.
   return s;
 }
 
+template <typename CTX>
 template <typename S, typename V, typename... T>
-auto http_request::url_parameters(assign_exp<S, V> e, T... tail) const {
+auto basic_http_request<CTX>::url_parameters(assign_exp<S, V> e, T... tail) const {
   return url_parameters(mmm(e, tail...));
 }
 
+template <typename CTX>
 template <typename S, typename V, typename... T>
-auto http_request::get_parameters(assign_exp<S, V> e, T... tail) const {
+auto basic_http_request<CTX>::get_parameters(assign_exp<S, V> e, T... tail) const {
   return get_parameters(mmm(e, tail...));
 }
 
+template <typename CTX>
 template <typename S, typename V, typename... T>
-auto http_request::post_parameters(assign_exp<S, V> e, T... tail) const {
+auto basic_http_request<CTX>::post_parameters(assign_exp<S, V> e, T... tail) const {
   auto o = mmm(e, tail...);
   return post_parameters(o);
 }
 
-template <typename O> auto http_request::url_parameters(const O& res) const {
+template <typename CTX>
+template <typename O> auto basic_http_request<CTX>::url_parameters(const O& res) const {
   O r;
   return url_parameters(r);
 }
 
-template <typename O> auto http_request::get_parameters(const O& res) const {
+template <typename CTX>
+template <typename O> auto basic_http_request<CTX>::get_parameters(const O& res) const {
   O r;
   return get_parameters(r);
 }
-template <typename O> auto http_request::post_parameters(const O& res) const {
+template <typename CTX>
+template <typename O> auto basic_http_request<CTX>::post_parameters(const O& res) const {
   O r;
   return post_parameters(r);
 }
 
-template <typename O> auto http_request::url_parameters(O& res) const {
-  auto info = make_url_parser_info(url_spec);
-  return parse_url_parameters(info, http_ctx.url(), res);
+template <typename CTX>
+template <typename O> auto basic_http_request<CTX>::url_parameters(O& res) const {
+  // The request was not routed by api::call, parse the url spec.
+  if (!url_params_layout) {
+    auto info = make_url_parser_info(url_spec);
+    return parse_url_parameters(info, http_ctx.url(), res);
+  }
+
+  map(res, [&](auto k, auto v) {
+    int i = url_params_layout->find(symbol_hash(k));
+    if (i < 0 or i >= url_params.size or
+        url_spec.substr(url_params_layout->params[i].name_start,
+                        url_params_layout->params[i].name_size) != symbol_string(k))
+      throw std::runtime_error(std::string("Parameter ") + symbol_string(k) +
+                               " not found in url " + std::string(url_spec));
+    decode_url_parameter(k, url_params.values[i], url_params_layout->params[i].is_path, res);
+  });
+  return res;
 }
 
-template <typename O> auto http_request::get_parameters(O& res) const {
+template <typename CTX>
+template <typename O> auto basic_http_request<CTX>::get_parameters(O& res) const {
 
   try {
-    url_decode(http_ctx.get_parameters_string(), res);
+    url_decode(http_ctx.get_parameters_string(), res, &arena());
   } catch (const std::runtime_error& e) {
     throw http_error::bad_request("Error while decoding the GET parameter: ", e.what());
   }
@@ -9662,7 +11932,8 @@ template <typename O> auto http_request::get_parameters(O& res) const {
   return res;
 }
 
-template <typename O> auto http_request::post_parameters(O& res) const {
+template <typename CTX>
+template <typename O> auto basic_http_request<CTX>::post_parameters(O& res) const {
   try {
     std::string_view encoding = this->header("Content-Type");
     if (!encoding.data())
@@ -9671,7 +11942,7 @@ template <typename O> auto http_request::post_parameters(O& res) const {
 
     std::string_view body = http_ctx.read_whole_body();
     if (encoding == std::string_view("application/x-www-form-urlencoded"))
-      url_decode(url_unescape(body), res);
+      url_decode(body, res, &arena());
     else if (encoding == std::string_view("application/json"))
       json_decode(body, res);
   } catch (std::exception e) {
@@ -9681,6 +11952,8 @@ template <typename O> auto http_request::post_parameters(O& res) const {
   return res;
 }
 
+typedef basic_http_request<http_async_impl::http_ctx> http_request;
+
 } // namespace li
 
 #endif // LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_REQUEST_HH
@@ -9699,8 +11972,8 @@ template <typename O> auto http_request::post_parameters(O& res) const {
 namespace li {
 using namespace li;
 
-struct http_response {
-  inline http_response(http_async_impl::http_ctx& ctx) : http_ctx(ctx) {}
+template <typename CTX> struct basic_http_response {
+  inline basic_http_response(CTX& ctx) : http_ctx(ctx) {}
 
   inline void set_header(std::string_view k, std::string_view v) { http_ctx.set_header(k, v); }
   inline void set_cookie(std::string_view k, std::string_view v) { http_ctx.set_cookie(k, v); }
@@ -9743,459 +12016,3684 @@ struct http_response {
     http_ctx.send_static_file(path.c_str());
   }
 
-  http_async_impl::http_ctx& http_ctx;
+  CTX& http_ctx;
   std::string body;
 };
 
+typedef basic_http_response<http_async_impl::http_ctx> http_response;
+
 } // namespace li
 
 #endif // LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_RESPONSE_HH
 
+#ifndef LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_ADMISSION_CONTROL_HH
+#define LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_ADMISSION_CONTROL_HH
+
+
+#ifndef LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_FIBER_SYNC_HH
+#define LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_FIBER_SYNC_HH
+
+
 
 namespace li {
 
+// Synchronization between the fibers of one async_reactor: mutex, semaphore, condition
+// variable, channel and one-shot event.
+//
+// Waiting fibers are parked on intrusive wait lists (the nodes live on their stack) and
+// woken with defer_fiber_resume: nothing is polled. These primitives are not thread safe,
+// all their users must run on the same reactor (for example with s::nthreads = 1, or
+// one instance per thread). To wake fibers from other threads, use sse_hub.
+//
+// Waits return false without waiting if the connection of the fiber is closed, or
+// when their deadline expires.
 
-template <typename... O>
-auto http_serve(api<http_request, http_response> api, int port, O... opts) {
+typedef std::chrono::steady_clock::time_point fiber_deadline;
 
-  auto options = mmm(opts...);
+// A fiber waiting on a fiber_wait_list.
+struct fiber_waiter {
+  async_fiber_context* fiber;
+  fiber_waiter* prev = nullptr;
+  fiber_waiter* next = nullptr;
+  bool notified = false;
+};
 
-  int nthreads = get_or(options, s::nthreads, std::thread::hardware_concurrency());
+// Intrusive FIFO list of parked fibers.
+struct fiber_wait_list {
 
-  auto handler = [api](auto& ctx) {
-    http_request rq{ctx};
-    http_response resp(ctx);
-    try {
-      api.call(ctx.method(), ctx.url(), rq, resp);
-    } catch (const http_error& e) {
-      ctx.set_status(e.status());
-      ctx.respond(e.what());
-    } catch (const std::runtime_error& e) {
-      std::cerr << "INTERNAL SERVER ERROR: " << e.what() << std::endl;
-      ctx.set_status(500);
-      ctx.respond("Internal server error.");
-    }
-    ctx.respond_if_needed();
-  };
+  fiber_wait_list() = default;
+  fiber_wait_list(const fiber_wait_list&) = delete;
+  fiber_wait_list& operator=(const fiber_wait_list&) = delete;
+  ~fiber_wait_list() { assert(empty()); }
 
-  auto date_thread = std::make_shared<std::thread>([&]() {
-    while (!quit_signal_catched) {
-      li::http_async_impl::http_top_header.tick();
-      usleep(1e6);
+  bool empty() const { return head == nullptr; }
+
+  // Park \fiber until it is notified or until \deadline.
+  // Return true if it was notified.
+  bool wait(async_fiber_context& fiber, fiber_deadline deadline = fiber_deadline::max()) {
+    fiber_waiter waiter{&fiber};
+    push_back(waiter);
+    while (!waiter.notified) {
+      bool alive = deadline == fiber_deadline::max() ? fiber.park() : fiber.park_until(deadline);
+      if (waiter.notified or !alive or std::chrono::steady_clock::now() >= deadline)
+        break;
     }
-  });
+    if (!waiter.notified)
+      remove(waiter);
+    return waiter.notified;
+  }
 
-  auto server_thread = std::make_shared<std::thread>([=]() {
-    std::cout << "Starting lithium::http_server on port " << port << std::endl;
+  // Wake up the first waiter. Return false if there is none.
+  bool notify_one() {
+    fiber_waiter* waiter = head;
+    if (!waiter)
+      return false;
+    remove(*waiter);
+    waiter->notified = true;
+    waiter->fiber->defer_fiber_resume(waiter->fiber->fiber_id);
+    return true;
+  }
 
-    if constexpr (has_key(options, s::ssl_key))
-    {
-      static_assert(has_key(options, s::ssl_certificate), "You need to provide both the ssl_certificate option and the ssl_key option.");
-      std::string ssl_key = options.ssl_key;
-      std::string ssl_cert = options.ssl_certificate;
-      std::string ssl_ciphers = "";
-      if constexpr (has_key(options, s::ssl_ciphers))
-      {
-        ssl_ciphers = options.ssl_ciphers;
-      }
-      start_tcp_server(port, SOCK_STREAM, nthreads,
-                       http_async_impl::make_http_processor(std::move(handler)),
-                       ssl_key, ssl_cert, ssl_ciphers);
-    }
+  void notify_all() {
+    while (notify_one())
+      ;
+  }
+
+private:
+  // \waiter lives on the stack of wait, which removes it from the list before returning.
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 12
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdangling-pointer"
+#endif
+  void push_back(fiber_waiter& waiter) {
+    waiter.prev = tail;
+    waiter.next = nullptr;
+    if (tail)
+      tail->next = &waiter;
     else
-      start_tcp_server(port, SOCK_STREAM, nthreads,
-                       http_async_impl::make_http_processor(std::move(handler)));
-    date_thread->join();
-  });
+      head = &waiter;
+    tail = &waiter;
+  }
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 12
+#pragma GCC diagnostic pop
+#endif
 
-  if constexpr (has_key<decltype(options), s::non_blocking_t>()) {
-    usleep(0.1e6);
-    date_thread->detach();
-    server_thread->detach();
-    // return mmm(s::server_thread = server_thread, s::date_thread = date_thread);
-  } else
-    server_thread->join();
-}
-} // namespace li
+  void remove(fiber_waiter& waiter) {
+    (waiter.prev ? waiter.prev->next : head) = waiter.next;
+    (waiter.next ? waiter.next->prev : tail) = waiter.prev;
+    waiter.prev = waiter.next = nullptr;
+  }
 
-#endif // LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_HTTP_SERVE_HH
+  fiber_waiter* head = nullptr;
+  fiber_waiter* tail = nullptr;
+};
 
+// Counting semaphore. release hands its unit directly to the first waiter, so the waiters
+// are served in FIFO order.
+struct fiber_semaphore {
 
-namespace li {
-using http_api = api<http_request, http_response>;
-}
+  fiber_semaphore(int count = 0) : count_(count) {}
 
-#ifndef LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_HASHMAP_HTTP_SESSION_HH
-#define LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_HASHMAP_HTTP_SESSION_HH
+  bool try_acquire() {
+    if (count_ == 0)
+      return false;
+    count_--;
+    return true;
+  }
 
-#ifndef LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_RANDOM_COOKIE_HH
-#define LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_RANDOM_COOKIE_HH
+  // Return true once a unit is acquired.
+  bool acquire(async_fiber_context& fiber, fiber_deadline deadline = fiber_deadline::max()) {
+    return try_acquire() or waiters_.wait(fiber, deadline);
+  }
+  template <typename D> bool acquire_for(async_fiber_context& fiber, D duration) {
+    return acquire(fiber, std::chrono::steady_clock::now() + duration);
+  }
 
+  void release() {
+    if (!waiters_.notify_one())
+      count_++;
+  }
 
-namespace li {
+  int count() const { return count_; }
 
-inline std::string generate_secret_tracking_id() {
-  std::ostringstream os;
-  std::random_device rd;
-  os << std::hex << rd() << rd() << rd() << rd();
-  return os.str();
-}
+private:
+  int count_;
+  fiber_wait_list waiters_;
+};
 
-inline std::string random_cookie(http_request& request, http_response& response,
-                                 const char* key = "silicon_token") {
-  std::string token;
-  std::string_view token_ = request.cookie(key);
-  if (!token_.data()) {
-    token = generate_secret_tracking_id();
-    response.set_cookie(key, token);
-  } else {
-    std::cout << "got token " << token_ << std::endl;
-    token = token_;
+// Mutex held across waits. unlock hands the lock to the first waiter.
+struct fiber_mutex {
+
+  bool try_lock() { return semaphore_.try_acquire(); }
+
+  // Return true once the lock is owned.
+  bool lock(async_fiber_context& fiber, fiber_deadline deadline = fiber_deadline::max()) {
+    return semaphore_.acquire(fiber, deadline);
   }
 
-  return token;
-}
+  void unlock() { semaphore_.release(); }
 
-} // namespace li
+  bool is_locked() const { return semaphore_.count() == 0; }
 
-#endif // LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_RANDOM_COOKIE_HH
+private:
+  fiber_semaphore semaphore_{1};
+};
 
+// Scoped lock of a fiber_mutex. Check it before using the protected data:
+//   if (fiber_lock_guard lock{mutex, fiber}) { ... }
+struct fiber_lock_guard {
+  fiber_lock_guard(fiber_mutex& mutex, async_fiber_context& fiber)
+      : mutex(mutex), owns(mutex.lock(fiber)) {}
+  fiber_lock_guard(const fiber_lock_guard&) = delete;
+  ~fiber_lock_guard() {
+    if (owns)
+      mutex.unlock();
+  }
+  explicit operator bool() const { return owns; }
 
-namespace li {
+  fiber_mutex& mutex;
+  bool owns;
+};
 
-template <typename O> struct connected_hashmap_http_session {
+// Condition variable. Fibers of a reactor do not run concurrently, so no mutex is needed
+// to check a condition and wait atomically.
+struct fiber_condition_variable {
 
-  connected_hashmap_http_session(std::string session_id_, O* values_,
-                                 std::unordered_map<std::string, O>& sessions_, std::mutex& mutex_)
-      : session_id_(session_id_), values_(values_), sessions_(sessions_), mutex_(mutex_) {}
+  // Wait for the next notification. May return true while the condition does not hold yet.
+  bool wait(async_fiber_context& fiber, fiber_deadline deadline = fiber_deadline::max()) {
+    return waiters_.wait(fiber, deadline);
+  }
 
-  // Store fiels into the session
-  template <typename... F> auto store(F... fields) {
-    map(mmm(fields...), [this](auto k, auto v) { values()[k] = v; });
+  // Wait until \predicate() is true. Return false if the connection closed or the
+  // deadline expired before.
+  template <typename P>
+  bool wait(async_fiber_context& fiber, P predicate,
+            fiber_deadline deadline = fiber_deadline::max()) {
+    while (!predicate())
+      if (!waiters_.wait(fiber, deadline))
+        return predicate();
+    return true;
   }
 
-  // Access values of the session.
-  O& values() {
-    if (!values_)
-      throw http_error::internal_server_error("Cannot access session values after logout.");
-    return *values_;
+  void notify_one() { waiters_.notify_one(); }
+  void notify_all() { waiters_.notify_all(); }
+
+private:
+  fiber_wait_list waiters_;
+};
+
+// One-shot event: once set, all the current and future waits return true.
+struct fiber_event {
+
+  void set() {
+    is_set_ = true;
+    waiters_.notify_all();
   }
+  bool is_set() const { return is_set_; }
 
-  // Delete the session from the database.
-  void logout() {
-    std::lock_guard<std::mutex> guard(mutex_);
-    sessions_.erase(session_id_);
+  bool wait(async_fiber_context& fiber, fiber_deadline deadline = fiber_deadline::max()) {
+    return is_set_ or waiters_.wait(fiber, deadline);
   }
 
 private:
-  std::string session_id_;
-  O* values_;
-  std::unordered_map<std::string, O>& sessions_;
-  std::mutex& mutex_;
+  bool is_set_ = false;
+  fiber_wait_list waiters_;
 };
 
-template <typename... F> struct hashmap_http_session {
+// Bounded multi-producer multi-consumer channel.
+// send waits while the channel is full, receive waits while it is empty.
+// After close, send fails and receive drains the remaining values.
+template <typename T> struct fiber_channel {
 
-  typedef decltype(mmm(std::declval<F>()...)) session_values_type;
-  inline hashmap_http_session(std::string cookie_name, F... fields)
-      : cookie_name_(cookie_name), default_values_(mmm(s::session_id = std::string(), fields...)) {}
+  fiber_channel(int capacity = 1) : capacity_(capacity) { assert(capacity > 0); }
 
-  inline auto connect(http_request& request, http_response& response) {
-    std::string session_id = random_cookie(request, response, cookie_name_.c_str());
-    auto it = sessions_.try_emplace(session_id, default_values_).first;
-    return connected_hashmap_http_session<session_values_type>{session_id, &it->second, sessions_,
-                                                               sessions_mutex_};
+  bool try_send(T value) {
+    if (closed_ or int(values_.size()) >= capacity_)
+      return false;
+    values_.push_back(std::move(value));
+    receivers_.notify_one();
+    return true;
   }
 
-  std::string cookie_name_;
-  session_values_type default_values_;
-  std::unordered_map<std::string, session_values_type> sessions_;
-  std::mutex sessions_mutex_;
-};
+  // Return false if the channel or the connection of \fiber is closed, or at \deadline.
+  bool send(async_fiber_context& fiber, T value,
+            fiber_deadline deadline = fiber_deadline::max()) {
+    while (!closed_ and int(values_.size()) >= capacity_)
+      if (!senders_.wait(fiber, deadline))
+        break;
+    return try_send(std::move(value));
+  }
 
-} // namespace li
+  std::optional<T> try_receive() {
+    if (values_.empty())
+      return std::nullopt;
+    std::optional<T> value(std::move(values_.front()));
+    values_.pop_front();
+    senders_.notify_one();
+    return value;
+  }
 
-#endif // LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_HASHMAP_HTTP_SESSION_HH
+  // Return nullopt if the channel is closed and empty, the connection of \fiber is closed,
+  // or at \deadline.
+  std::optional<T> receive(async_fiber_context& fiber,
+                           fiber_deadline deadline = fiber_deadline::max()) {
+    while (!closed_ and values_.empty())
+      if (!receivers_.wait(fiber, deadline))
+        break;
+    return try_receive();
+  }
 
-#ifndef LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_HTTP_AUTHENTICATION_HH
-#define LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_HTTP_AUTHENTICATION_HH
+  // Wake up all the waiters: senders fail, receivers get the remaining values.
+  void close() {
+    closed_ = true;
+    senders_.notify_all();
+    receivers_.notify_all();
+  }
 
+  bool is_closed() const { return closed_; }
+  int size() const { return values_.size(); }
+  int capacity() const { return capacity_; }
 
-#ifndef LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_SQL_HTTP_SESSION_HH
-#define LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_SQL_HTTP_SESSION_HH
+private:
+  int capacity_;
+  bool closed_ = false;
+  std::deque<T> values_;
+  fiber_wait_list senders_;
+  fiber_wait_list receivers_;
+};
 
+} // namespace li
 
-namespace li {
+#endif // LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_FIBER_SYNC_HH
 
-template <typename ORM> struct connected_sql_http_session {
 
-  // Construct the session.
-  // Retrive the cookie
-  // Retrieve it from the database.
-  // Insert it if it does not exists.
-  connected_sql_http_session(typename ORM::object_type& defaults, ORM&& orm,
-                             const std::string& session_id)
-      : loaded_(false), session_id_(session_id), orm_(std::forward<ORM>(orm)), values_(defaults) {}
+namespace li {
 
-  // Store fiels into the session
-  template <typename... F> auto store(F... fields) {
-    map(mmm(fields...), [this](auto k, auto v) { values_[k] = v; });
-    if (!orm_.exists(s::session_id = session_id_))
-      orm_.insert(s::session_id = session_id_, fields...);
-    else
-      orm_.update(s::session_id = session_id_, fields...);
+// CoDel (Nichols & Jacobson) adapted to request queues.
+// A queue is overloaded when its smallest queueing delay stayed above \target during a whole
+// \interval: a good queue drains at least once per interval, a standing queue never does.
+// Requests may wait \interval in a good queue, but only \target in an overloaded one.
+struct codel_controller {
+  typedef std::chrono::steady_clock clock;
+
+  codel_controller(std::chrono::microseconds target = std::chrono::milliseconds(5),
+                   std::chrono::microseconds interval = std::chrono::milliseconds(100))
+      : target(target), interval(interval) {}
+
+  // Longest time a request may wait now.
+  std::chrono::microseconds max_delay() const { return overloaded ? target : interval; }
+
+  // Record the queueing delay of a request. Return false if it must be shed.
+  bool admit(clock::duration delay, clock::time_point now = clock::now()) {
+    if (now >= interval_end) {
+      overloaded = interval_end != clock::time_point() and min_delay > target;
+      min_delay = clock::duration::max();
+      interval_end = now + interval;
+    }
+    min_delay = std::min(min_delay, delay);
+    return delay <= max_delay();
   }
 
-  // Access values of the session.
-  const auto values() {
-    load();
-    return values_;
-  }
+  std::chrono::microseconds target;
+  std::chrono::microseconds interval;
+  bool overloaded = false;
+  clock::duration min_delay = clock::duration::max();
+  clock::time_point interval_end;
+};
 
-  // Delete the session from the database.
-  void logout() { orm_.remove(s::session_id = session_id_); }
+namespace impl {
 
-private:
-  auto load() {
-    if (loaded_)
-      return;
-    if (auto new_values_ = orm_.find_one(s::session_id = session_id_))
-      values_ = *new_values_;
-    loaded_ = true;
+// Identity of an object having per-thread states (see thread_local_state).
+// Ids are never reused, unlike addresses: an object allocated where a destroyed one was
+// does not find its states. A copy gets a new id.
+struct thread_local_key {
+  thread_local_key() : id(next_id()), alive(std::make_shared<char>()) {}
+  thread_local_key(const thread_local_key&) : thread_local_key() {}
+  thread_local_key& operator=(const thread_local_key&) { return *this; }
+
+  static uint64_t next_id() {
+    static std::atomic<uint64_t> counter{0};
+    return ++counter;
   }
 
-  bool loaded_;
-  std::string session_id_;
-  ORM orm_;
-  typename ORM::object_type values_;
+  uint64_t id;
+  std::shared_ptr<char> alive; // Expires with the owner.
 };
 
-template <typename DB, typename... F>
-decltype(auto) create_session_orm(DB& db, std::string table_name, F... fields) {
-  return sql_orm_schema<DB>(db, table_name)
-      .fields(s::session_id(s::read_only, s::primary_key) = sql_varchar<32>(), fields...);
+// Per-thread state of an object shared by the server threads.
+// The states of destroyed owners are freed on each thread by the next call creating a state.
+template <typename T, typename F> T& thread_local_state(const thread_local_key& owner, F make) {
+  struct entry {
+    std::weak_ptr<char> alive;
+    std::unique_ptr<T> state;
+  };
+  static thread_local std::unordered_map<uint64_t, entry> states;
+  auto it = states.find(owner.id);
+  if (it != states.end())
+    return *it->second.state;
+
+  for (auto i = states.begin(); i != states.end();)
+    i = i->second.alive.expired() ? states.erase(i) : std::next(i);
+  entry& e = states[owner.id];
+  e.alive = owner.alive;
+  e.state.reset(new T(make()));
+  return *e.state;
 }
 
-template <typename DB, typename... F> struct sql_http_session {
+} // namespace impl
 
-  sql_http_session(DB& db, std::string table_name, std::string cookie_name, F... fields)
-      : cookie_name_(cookie_name),
-        default_values_(mmm(s::session_id = sql_varchar<32>(), fields...)),
-        session_table_(create_session_orm(db, table_name, fields...)) {}
+// Server wide load shedding of http_serve, with a codel_controller per server thread.
+// The queueing delay of a request is the time since its bytes arrived in the reactor
+// (async_reactor::ready_time): while a server thread is saturated, new events wait for the
+// handlers of the previous ones.
+// Overloaded server threads answer 503 with a Retry-After header without calling the api.
+//
+//   admission_control admission(s::codel_target = 5, s::codel_interval = 100, s::retry_after = 1);
+//   http_serve(api, 8080, s::admission_control = &admission);
+//   // or, without access to the metrics:
+//   http_serve(api, 8080, s::codel_target = 5);
+struct admission_control {
 
-  auto connect(http_request& request, http_response& response) {
-    return connected_sql_http_session(default_values_, session_table_.connect(request.fiber),
-                                      random_cookie(request, response, cookie_name_.c_str()));
+  template <typename... O> admission_control(O... opts) {
+    auto options = mmm(opts...);
+    target = std::chrono::milliseconds(get_or(options, s::codel_target, 5));
+    interval = std::chrono::milliseconds(get_or(options, s::codel_interval, 100));
+    retry_after = std::to_string(get_or(options, s::retry_after, 1));
+  }
+
+  admission_control(const admission_control&) = delete;
+
+  bool admit(codel_controller::clock::duration queue_delay) {
+    auto& codel = impl::thread_local_state<codel_controller>(
+        thread_key, [this] { return codel_controller(target, interval); });
+    if (codel.admit(queue_delay)) {
+      admitted++;
+      return true;
+    }
+    shed_queue_delay++;
+    return false;
+  }
+
+  auto stats() const {
+    return mmm(s::admitted = admitted.load(), s::shed_queue_delay = shed_queue_delay.load());
+  }
+
+  std::chrono::microseconds target;
+  std::chrono::microseconds interval;
+  std::string retry_after;
+  std::atomic<long long> admitted = 0;
+  std::atomic<long long> shed_queue_delay = 0;
+
+private:
+  impl::thread_local_key thread_key;
+};
+
+// Bulkhead: limit the number of requests of some routes running at the same time on each
+// server thread, typically the routes using a resource with limited capacity (an SQL
+// connection pool, an upstream service...).
+//
+//   concurrency_limit db_limit(s::max_in_flight = 20, s::max_queue = 100);
+//   api.get("/report") = db_limit([&] (http_request& request, http_response& response) { ... });
+//
+// Requests over the limit wait in a FIFO queue of \max_queue requests. The queue is
+// managed with codel_controller: when it does not drain, requests waiting more than
+// s::codel_target (default 5ms) are shed. Shed requests get a 503 response with a
+// Retry-After header (s::retry_after seconds, default 1).
+struct concurrency_limit {
+
+  template <typename... O> concurrency_limit(O... opts) {
+    auto options = mmm(opts...);
+    max_in_flight = get_or(options, s::max_in_flight, 100);
+    max_queue = get_or(options, s::max_queue, 1000);
+    target = std::chrono::milliseconds(get_or(options, s::codel_target, 5));
+    interval = std::chrono::milliseconds(get_or(options, s::codel_interval, 100));
+    retry_after = std::to_string(get_or(options, s::retry_after, 1));
+  }
+
+  concurrency_limit(const concurrency_limit&) = delete;
+
+  // Wrap \handler. The concurrency_limit must outlive the server.
+  template <typename H> auto operator()(H handler) {
+    return [this, handler](http_request& request, http_response& response) {
+      slot held = enter(request, response);
+      handler(request, response);
+    };
+  }
+
+  auto stats() const {
+    return mmm(s::admitted = admitted.load(), s::shed_in_flight = shed_in_flight.load(),
+               s::shed_queue_delay = shed_queue_delay.load());
+  }
+
+  int max_in_flight;
+  int max_queue;
+  std::chrono::microseconds target;
+  std::chrono::microseconds interval;
+  std::string retry_after;
+  std::atomic<long long> admitted = 0;
+  std::atomic<long long> shed_in_flight = 0;   // The queue was full.
+  std::atomic<long long> shed_queue_delay = 0; // Waited too long in the queue.
+
+private:
+  impl::thread_local_key thread_key;
+
+  struct thread_state {
+    fiber_semaphore slots;
+    int waiting = 0;
+    codel_controller codel;
+  };
+
+  // Releases the slot of a running request.
+  struct slot {
+    thread_state* state;
+    slot(thread_state* state) : state(state) {}
+    slot(const slot&) = delete;
+    ~slot() { state->slots.release(); }
+  };
+
+  [[noreturn]] void shed(http_response& response, std::atomic<long long>& counter) {
+    counter++;
+    response.set_header("Retry-After", retry_after);
+    throw http_error::service_unavailable("Server overloaded, retry later.");
+  }
+
+  thread_state* enter(http_request& request, http_response& response) {
+    auto& state = impl::thread_local_state<thread_state>(thread_key, [this] {
+      return thread_state{fiber_semaphore(max_in_flight), 0, {target, interval}};
+    });
+
+    auto start = codel_controller::clock::now();
+    if (!state.slots.try_acquire()) {
+      if (state.waiting >= max_queue)
+        shed(response, shed_in_flight);
+      state.waiting++;
+      bool acquired = state.slots.acquire(request.fiber, start + state.codel.max_delay());
+      state.waiting--;
+      if (!acquired) {
+        state.codel.admit(codel_controller::clock::now() - start);
+        shed(response, shed_queue_delay);
+      }
+    }
+    auto now = codel_controller::clock::now();
+    if (!state.codel.admit(now - start, now)) {
+      state.slots.release();
+      shed(response, shed_queue_delay);
+    }
+    admitted++;
+    return &state;
+  }
+};
+
+} // namespace li
+
+#endif // LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_ADMISSION_CONTROL_HH
+
+
+namespace li {
+
+namespace http_async_impl {
+
+// Run \start_server in a server thread, next to the thread updating the Date header.
+// Return right away with the s::non_blocking option.
+template <typename O, typename F> void run_server(int port, O options, F start_server) {
+
+  auto date_thread = std::make_shared<std::thread>([&]() {
+    while (!quit_signal_catched) {
+      li::http_async_impl::http_top_header.tick();
+      usleep(1e6);
+    }
+  });
+
+  auto server_thread = std::make_shared<std::thread>([=]() {
+    std::cout << "Starting lithium::http_server on port " << port << std::endl;
+    start_server();
+    date_thread->join();
+  });
+
+  if constexpr (has_key<decltype(options), s::non_blocking_t>()) {
+    usleep(0.1e6);
+    date_thread->detach();
+    server_thread->detach();
+    // return mmm(s::server_thread = server_thread, s::date_thread = date_thread);
+  } else
+    server_thread->join();
+}
+
+// Socket options of http_serve: s::listen_backlog, s::tcp_nodelay, s::tcp_defer_accept,
+// s::tcp_fastopen, s::send_buffer_size, s::receive_buffer_size and s::busy_poll (in
+// microseconds). See tcp_server_options.
+template <typename O> tcp_server_options make_tcp_server_options(const O& options) {
+  tcp_server_options tcp;
+  tcp.listen_backlog = get_or(options, s::listen_backlog, tcp.listen_backlog);
+  tcp.tcp_nodelay = get_or(options, s::tcp_nodelay, tcp.tcp_nodelay);
+  tcp.tcp_defer_accept = get_or(options, s::tcp_defer_accept, tcp.tcp_defer_accept);
+  tcp.tcp_fastopen = get_or(options, s::tcp_fastopen, tcp.tcp_fastopen);
+  tcp.send_buffer_size = get_or(options, s::send_buffer_size, tcp.send_buffer_size);
+  tcp.receive_buffer_size = get_or(options, s::receive_buffer_size, tcp.receive_buffer_size);
+  tcp.busy_poll_us = get_or(options, s::busy_poll, tcp.busy_poll_us);
+  return tcp;
+}
+
+// Handler of make_http_processor calling \api, and answering the http errors it throws.
+// With \admission, the requests are first checked by the admission control.
+inline auto make_api_handler(api<http_request, http_response> api,
+                             std::shared_ptr<admission_control> admission = nullptr) {
+  return [api, admission](auto& ctx) {
+    if (admission and
+        !admission->admit(std::chrono::steady_clock::now() - ctx.fiber.reactor->ready_time)) {
+      ctx.set_status(503);
+      ctx.set_header("Retry-After", admission->retry_after);
+      ctx.respond("Server overloaded, retry later.");
+      return;
+    }
+    http_request rq{ctx};
+    http_response resp(ctx);
+    try {
+      api.call(ctx.method(), ctx.url(), rq, resp);
+    } catch (const http_error& e) {
+      ctx.respond_error(e.status(), e.what());
+    } catch (const sql_client_closed&) {
+      // The client is gone: nobody reads the response.
+      return;
+    } catch (const std::runtime_error& e) {
+      std::cerr << "INTERNAL SERVER ERROR: " << e.what() << std::endl;
+      ctx.respond_error(500, "Internal server error.");
+    }
+    ctx.respond_if_needed();
+  };
+}
+
+} // namespace http_async_impl
+
+template <typename... O>
+auto http_serve(api<http_request, http_response> api, int port, O... opts) {
+
+  auto options = mmm(opts...);
+
+  int nthreads = get_or(options, s::nthreads, std::thread::hardware_concurrency());
+  tcp_server_options tcp_options = http_async_impl::make_tcp_server_options(options);
+
+  // Load shedding based on the queueing delay in the reactors. See admission_control.
+  std::shared_ptr<admission_control> admission;
+  if constexpr (has_key(options, s::admission_control))
+    admission = std::shared_ptr<admission_control>(options.admission_control,
+                                                   [](admission_control*) {});
+  else if constexpr (has_key(options, s::codel_target))
+    admission = std::make_shared<admission_control>(
+        s::codel_target = options.codel_target,
+        s::codel_interval = get_or(options, s::codel_interval, 100),
+        s::retry_after = get_or(options, s::retry_after, 1));
+
+  // Capture of the requests, see traffic_capture. s::capture is a file path or a
+  // traffic_capture*.
+  std::shared_ptr<traffic_capture> capture;
+  if constexpr (has_key(options, s::capture)) {
+    if constexpr (std::is_same<std::decay_t<decltype(options.capture)>, traffic_capture*>::value)
+      capture = std::shared_ptr<traffic_capture>(options.capture, [](traffic_capture*) {});
+    else
+      capture = std::make_shared<traffic_capture>(std::string(options.capture));
+  }
+
+  api.freeze();
+  auto handler = http_async_impl::make_api_handler(api, admission);
+
+  http_async_impl::run_server(port, options, [=] {
+    if constexpr (has_key(options, s::ssl_key))
+    {
+      static_assert(has_key(options, s::ssl_certificate), "You need to provide both the ssl_certificate option and the ssl_key option.");
+      std::string ssl_key = options.ssl_key;
+      std::string ssl_cert = options.ssl_certificate;
+      std::string ssl_ciphers = "";
+      if constexpr (has_key(options, s::ssl_ciphers))
+      {
+        ssl_ciphers = options.ssl_ciphers;
+      }
+      start_tcp_server(port, SOCK_STREAM, nthreads,
+                       http_async_impl::make_http_processor(std::move(handler), capture.get()),
+                       ssl_key, ssl_cert, ssl_ciphers, tcp_options);
+    }
+    else
+      start_tcp_server(port, SOCK_STREAM, nthreads,
+                       http_async_impl::make_http_processor(std::move(handler), capture.get()),
+                       "", "", "", tcp_options);
+  });
+}
+} // namespace li
+
+#endif // LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_HTTP_SERVE_HH
+
+
+namespace li {
+using http_api = api<http_request, http_response>;
+}
+
+#ifndef LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_CORO_HTTP_SERVE_HH
+#define LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_CORO_HTTP_SERVE_HH
+
+#ifndef LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_CORO_REACTOR_HH
+#define LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_CORO_REACTOR_HH
+
+// C++20 coroutine reactor, an alternative to the boost::context fibers of async_reactor.
+//
+// A connection is handled by a stackless coroutine: its frame only holds the variables
+// living across a co_await, instead of a full stack per connection.
+// Enabled when the compiler supports coroutines (-std=c++20), Linux only.
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>) && __linux__
+
+#define LITHIUM_COROUTINES 1
+
+
+
+namespace li {
+
+namespace internal {
+
+template <typename T> struct coro_task_result {
+  template <typename U> void return_value(U&& v) { value.emplace(std::forward<U>(v)); }
+  T get() {
+    if (exception)
+      std::rethrow_exception(exception);
+    return std::move(*value);
+  }
+  std::optional<T> value;
+  std::exception_ptr exception;
+};
+
+template <> struct coro_task_result<void> {
+  void return_void() {}
+  void get() {
+    if (exception)
+      std::rethrow_exception(exception);
+  }
+  std::exception_ptr exception;
+};
+
+// Coroutine running on its own: it starts right away and frees its frame when it ends.
+struct coro_detached {
+  struct promise_type {
+    coro_detached get_return_object() { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+} // namespace internal
+
+// Coroutine returning a T.
+// It starts when it is awaited and resumes its awaiter when it ends, without going back
+// to the reactor. Its exceptions are rethrown in the awaiter.
+template <typename T = void> struct [[nodiscard]] coro_task {
+
+  struct promise_type : internal::coro_task_result<T> {
+
+    coro_task get_return_object() {
+      return coro_task(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    struct final_awaiter {
+      bool await_ready() noexcept { return false; }
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+        if (auto awaiter = h.promise().continuation)
+          return awaiter;
+        return std::noop_coroutine();
+      }
+      void await_resume() noexcept {}
+    };
+    final_awaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { this->exception = std::current_exception(); }
+
+    std::coroutine_handle<> continuation;
+  };
+
+  coro_task(coro_task&& o) : handle_(std::exchange(o.handle_, nullptr)) {}
+  coro_task& operator=(coro_task&& o) {
+    if (this != &o) {
+      if (handle_)
+        handle_.destroy();
+      handle_ = std::exchange(o.handle_, nullptr);
+    }
+    return *this;
+  }
+  coro_task(const coro_task&) = delete;
+  coro_task& operator=(const coro_task&) = delete;
+  ~coro_task() {
+    if (handle_)
+      handle_.destroy();
+  }
+
+  bool await_ready() const noexcept { return handle_.done(); }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept {
+    handle_.promise().continuation = awaiter;
+    return handle_;
+  }
+  T await_resume() { return handle_.promise().get(); }
+
+private:
+  explicit coro_task(std::coroutine_handle<promise_type> h) : handle_(h) {}
+  std::coroutine_handle<promise_type> handle_;
+};
+
+struct coro_reactor;
+
+// Connection handled by a coroutine of coro_reactor.
+//
+// read, write, yield, sleep and wait_event are awaitables. Like the fibers of async_reactor,
+// they return a closed status (0 or false) once the peer closed the connection.
+// Awaiting does not allocate: the operation lives in the frame of the awaiting coroutine
+// and the reactor retries it on each event of the connection until it completes.
+struct coro_connection {
+
+  // The operation the coroutine waits for.
+  struct operation {
+    bool (*attempt)(operation*); // Return true when the operation is complete.
+    std::coroutine_handle<> coroutine;
+  };
+
+  template <typename O> struct awaitable_operation : operation {
+    awaitable_operation(coro_connection* c) : connection(c) {
+      this->attempt = [](operation* o) { return static_cast<O*>(o)->try_complete(); };
+    }
+    bool await_ready() { return static_cast<O*>(this)->try_complete(); }
+    void await_suspend(std::coroutine_handle<> h) {
+      this->coroutine = h;
+      connection->pending = this;
+    }
+    coro_connection* connection;
+  };
+
+  struct read_operation : awaitable_operation<read_operation> {
+    read_operation(coro_connection* c, char* buf, int size)
+        : awaitable_operation<read_operation>(c), buf(buf), size(size) {}
+    bool try_complete() {
+      result = connection->read_nowait(buf, size);
+      return result >= 0;
+    }
+    int await_resume() { return result; }
+    char* buf;
+    int size;
+    int result = 0;
+  };
+
+  struct writev_operation : awaitable_operation<writev_operation> {
+    writev_operation(coro_connection* c, iovec* iov, int iovcnt)
+        : awaitable_operation<writev_operation>(c), iov(iov), iovcnt(iovcnt) {}
+    bool try_complete() {
+      while (iovcnt > 0 and !iov->iov_len) {
+        iov++;
+        iovcnt--;
+      }
+      while (iovcnt > 0) {
+        if (connection->closed)
+          return true;
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        ssize_t count = ::sendmsg(connection->socket_fd, &msg, MSG_NOSIGNAL);
+        if (count < 0) {
+          if (errno == EAGAIN)
+            return false;
+          connection->closed = true;
+          return true;
+        }
+        // Skip what was sent.
+        while (iovcnt > 0 and size_t(count) >= iov->iov_len) {
+          count -= iov->iov_len;
+          iov++;
+          iovcnt--;
+        }
+        if (iovcnt > 0) {
+          iov->iov_base = (char*)iov->iov_base + count;
+          iov->iov_len -= count;
+        }
+      }
+      return true;
+    }
+    bool await_resume() { return !connection->closed; }
+    iovec* iov;
+    int iovcnt;
+  };
+
+  struct write_operation : writev_operation {
+    write_operation(coro_connection* c, const char* buf, int size)
+        : writev_operation(c, &buffer, 1), buffer{(void*)buf, size_t(size)} {}
+    write_operation(const write_operation&) = delete;
+    iovec buffer;
+  };
+
+  struct sleep_operation : awaitable_operation<sleep_operation> {
+    sleep_operation(coro_connection* c, std::chrono::steady_clock::time_point deadline)
+        : awaitable_operation<sleep_operation>(c), deadline(deadline) {}
+    bool try_complete() {
+      return connection->closed or std::chrono::steady_clock::now() >= deadline;
+    }
+    inline void await_suspend(std::coroutine_handle<> h);
+    bool await_resume() { return !connection->closed; }
+    std::chrono::steady_clock::time_point deadline;
+  };
+
+  struct event_operation : awaitable_operation<event_operation> {
+    using awaitable_operation<event_operation>::awaitable_operation;
+    bool await_ready() { return connection->closed; }
+    bool try_complete() { return true; }
+    bool await_resume() { return !connection->closed; }
+  };
+
+  struct yield_operation {
+    bool await_ready() { return false; }
+    inline void await_suspend(std::coroutine_handle<> h);
+    bool await_resume() { return !connection->closed; }
+    coro_connection* connection;
+  };
+
+  inline coro_connection(coro_reactor* reactor, int socket_fd, sockaddr in_addr)
+      : reactor(reactor), socket_fd(socket_fd), in_addr(in_addr) {}
+  inline ~coro_connection();
+
+  coro_connection(const coro_connection&) = delete;
+  coro_connection& operator=(const coro_connection&) = delete;
+
+  // Read at most \size bytes. Return the number of bytes read, 0 if the connection is closed.
+  read_operation read(char* buf, int size) { return read_operation(this, buf, size); }
+  // Write \size bytes. Return false if the connection is closed.
+  write_operation write(const char* buf, int size) { return write_operation(this, buf, size); }
+  // Write several buffers with one sendmsg syscall. iov is modified to track partial writes.
+  writev_operation writev(iovec* iov, int iovcnt) { return writev_operation(this, iov, iovcnt); }
+  // Let the other connections run. Return false if the connection is closed.
+  yield_operation yield() { return yield_operation{this}; }
+  // Wait until \deadline. Return false if the connection was closed in the meantime.
+  sleep_operation sleep_until(std::chrono::steady_clock::time_point deadline) {
+    return sleep_operation(this, deadline);
+  }
+  template <typename R, typename P> sleep_operation sleep_for(std::chrono::duration<R, P> d) {
+    return sleep_until(std::chrono::steady_clock::now() + d);
+  }
+  // Wait for the next event on one of the file descriptors of the connection: the socket
+  // or the ones added with epoll_add, for example the socket of a database connection.
+  // Return false if the connection is closed.
+  event_operation wait_event() { return event_operation(this); }
+
+  // Subscribe to the events of \fd. They wake up the coroutine waiting in wait_event.
+  inline void epoll_add(int fd, int flags);
+
+  // Read without waiting. Return -1 if no data is available, 0 if the connection is closed.
+  int read_nowait(char* buf, int size) {
+    if (closed)
+      return 0;
+    ssize_t count = ::recv(socket_fd, buf, size, 0);
+    if (count < 0 and errno == EAGAIN)
+      return -1;
+    if (count <= 0)
+      closed = true;
+    return count < 0 ? 0 : count;
+  }
+
+  bool is_closed() const { return closed; }
+
+  // Called by the reactor on each event: complete the pending operation if possible.
+  void on_event() {
+    if (pending and pending->attempt(pending)) {
+      auto coroutine = pending->coroutine;
+      pending = nullptr;
+      coroutine.resume(); // May destroy this connection.
+    }
+  }
+
+  coro_reactor* reactor;
+  int socket_fd;
+  sockaddr in_addr;
+  bool closed = false;
+  operation* pending = nullptr;
+  uint64_t sleep_id = 0;     // Identifies the timer of the current sleep.
+  std::vector<int> user_fds; // File descriptors added with epoll_add.
+};
+
+// Epoll based reactor resuming the coroutines of its connections.
+struct coro_reactor {
+
+  int epoll_fd = -1;
+  tcp_server_options options;
+  std::vector<coro_connection*> fd_to_connection;
+
+  // Coroutines to resume at the next iteration of the loop. See coro_connection::yield.
+  std::vector<std::pair<coro_connection*, std::coroutine_handle<>>> ready, ready_batch;
+
+  // Sleeping connections: (deadline, socket fd, sleep id), ordered by deadline.
+  typedef std::tuple<std::chrono::steady_clock::time_point, int, uint64_t> timer_entry;
+  std::priority_queue<timer_entry, std::vector<timer_entry>, std::greater<timer_entry>> timers;
+  uint64_t sleep_counter = 0;
+
+  inline void epoll_add(int fd, int flags, coro_connection* connection) {
+    epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.data.fd = fd;
+    event.events = flags;
+    if (-1 == ::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) and errno != EEXIST)
+      std::cerr << "epoll_ctl error: " << strerror(errno) << std::endl;
+    if (int(fd_to_connection.size()) < fd + 1)
+      fd_to_connection.resize((fd + 1) * 2, nullptr);
+    fd_to_connection[fd] = connection;
+  }
+
+  inline void forget(coro_connection* connection) {
+    for (int fd : connection->user_fds)
+      if (fd_to_connection[fd] == connection)
+        fd_to_connection[fd] = nullptr;
+    fd_to_connection[connection->socket_fd] = nullptr;
+  }
+
+  template <typename H>
+  internal::coro_detached run_connection(H& handler, int socket_fd, sockaddr in_addr) {
+    {
+      coro_connection connection(this, socket_fd, in_addr);
+      epoll_add(socket_fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, &connection);
+      try {
+        co_await handler(connection);
+      } catch (const std::exception& e) {
+        std::cerr << "Error: exception in connection handler: " << e.what() << std::endl;
+      }
+    }
+    if (0 != close(socket_fd))
+      std::cerr << "Error when closing file descriptor " << socket_fd << ": "
+                << strerror(errno) << std::endl;
+  }
+
+  inline void process_timers() {
+    auto now = std::chrono::steady_clock::now();
+    while (!timers.empty() and std::get<0>(timers.top()) <= now) {
+      auto [deadline, fd, id] = timers.top();
+      timers.pop();
+      coro_connection* c = fd_to_connection[fd];
+      if (c and c->sleep_id == id)
+        c->on_event();
+    }
+  }
+
+  inline void process_ready() {
+    std::swap(ready, ready_batch);
+    for (auto [c, coroutine] : ready_batch)
+      coroutine.resume();
+    ready_batch.clear();
+  }
+
+  template <typename H> void event_loop(int listen_fd, H& handler) {
+
+    const int MAXEVENTS = 64;
+    epoll_fd = epoll_create1(0);
+    epoll_event listen_event;
+    memset(&listen_event, 0, sizeof(listen_event));
+    listen_event.data.fd = listen_fd;
+    listen_event.events = EPOLLIN | EPOLLET;
+    ::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &listen_event);
+    epoll_event events[MAXEVENTS];
+    impl::busy_poll_clock busy_poll(options.busy_poll_us);
+
+    while (!quit_signal_catched) {
+
+      // Wakeup to check if any quit signal has been catched.
+      int n_events =
+          epoll_wait(epoll_fd, events, MAXEVENTS, ready.empty() ? busy_poll.timeout() : 0);
+      if (quit_signal_catched)
+        break;
+      if (n_events > 0)
+        busy_poll.on_events();
+
+      for (int i = 0; i < n_events; i++) {
+        int event_fd = events[i].data.fd;
+
+        if (event_fd == listen_fd) {
+          if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+            std::cout << "FATAL ERROR: Error on server socket " << event_fd << std::endl;
+            quit_signal_catched = true;
+            break;
+          }
+          while (true) {
+            sockaddr in_addr;
+            socklen_t in_len = sizeof(in_addr);
+            int socket_fd = accept(listen_fd, &in_addr, &in_len);
+            if (socket_fd == -1)
+              break;
+            if (-1 == fcntl(socket_fd, F_SETFL, fcntl(socket_fd, F_GETFL, 0) | O_NONBLOCK)) {
+              close(socket_fd);
+              continue;
+            }
+            impl::configure_accepted_socket(socket_fd, options);
+            run_connection(handler, socket_fd, in_addr);
+          }
+          continue;
+        }
+
+        if (event_fd < 0 or event_fd >= int(fd_to_connection.size()))
+          continue;
+        coro_connection* c = fd_to_connection[event_fd];
+        if (!c)
+          continue;
+        if (event_fd == c->socket_fd and
+            (events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)))
+          c->closed = true;
+        c->on_event();
+      }
+
+      process_timers();
+      process_ready();
+    }
+    close(epoll_fd);
+  }
+};
+
+coro_connection::~coro_connection() { reactor->forget(this); }
+
+void coro_connection::epoll_add(int fd, int flags) {
+  reactor->epoll_add(fd, flags, this);
+  user_fds.push_back(fd);
+}
+
+void coro_connection::sleep_operation::await_suspend(std::coroutine_handle<> h) {
+  awaitable_operation<sleep_operation>::await_suspend(h);
+  connection->sleep_id = ++connection->reactor->sleep_counter;
+  connection->reactor->timers.emplace(deadline, connection->socket_fd, connection->sleep_id);
+}
+
+void coro_connection::yield_operation::await_suspend(std::coroutine_handle<> h) {
+  connection->reactor->ready.emplace_back(connection, h);
+}
+
+// Start \nthreads coroutine reactors accepting the connections on \port.
+// \conn_handler(coro_connection&) returns the coro_task handling the connection.
+template <typename H>
+void start_coro_tcp_server(int port, int socktype, int nthreads, H conn_handler,
+                           const tcp_server_options& options = tcp_server_options()) {
+
+  install_shutdown_handler();
+
+  int server_fd = impl::create_and_bind(port, socktype, options);
+  std::vector<std::thread> ths;
+  for (int i = 0; i < nthreads; i++)
+    ths.push_back(std::thread([&] {
+      coro_reactor reactor;
+      reactor.options = options;
+      reactor.event_loop(server_fd, conn_handler);
+    }));
+
+  for (auto& t : ths)
+    t.join();
+
+  close(server_fd);
+}
+
+} // namespace li
+
+#endif
+
+#endif // LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_CORO_REACTOR_HH
+
+
+#if LITHIUM_COROUTINES
+
+
+
+namespace li {
+
+namespace http_async_impl {
+
+// The fiber of generic_http_ctx on the coroutine server.
+// The request and its body are in the read buffer before the handler runs, and the
+// processor sends the responses when the handler co_awaits or returns: nothing here waits.
+struct coro_http_fiber {
+
+  coro_http_fiber(coro_connection& connection)
+      : connection(&connection), socket_fd(connection.socket_fd),
+        in_addr(connection.in_addr) {}
+
+  // Queue data sent by generic_http_ctx outside of output_stream: large bodies and the
+  // content of a full output_stream.
+  bool write(const char* buf, int size, int flags = 0) {
+    if (is_closed())
+      return false;
+    pending.append(buf, size);
+    return true;
+  }
+  bool writev(iovec* iov, int iovcnt, int flags = 0) {
+    for (int i = 0; i < iovcnt; i++)
+      write((const char*)iov[i].iov_base, iov[i].iov_len);
+    return !is_closed();
+  }
+
+  // The body is already in the read buffer.
+  int read(char* buf, int max_size) { return 0; }
+  int read_nowait(char* buf, int max_size) { return connection->read_nowait(buf, max_size); }
+
+  bool is_closed() const { return connection->is_closed(); }
+
+  // Give the memory of the pending data back while the connection is idle.
+  void release() { std::string().swap(pending); }
+
+  coro_connection* connection;
+  int socket_fd;
+  sockaddr in_addr;
+  std::string pending;
+  iovec iov[2];
+};
+
+typedef generic_http_ctx<coro_http_fiber> coro_http_ctx;
+
+// Send the pending data of the fiber then the responses of output_stream, with one writev.
+struct coro_send_responses : coro_connection::writev_operation {
+  coro_send_responses(coro_http_ctx& ctx)
+      : coro_connection::writev_operation(ctx.fiber.connection, ctx.fiber.iov, 2), ctx(ctx) {
+    auto out = ctx.output_stream.to_string_view();
+    ctx.fiber.iov[0] = {ctx.fiber.pending.data(), ctx.fiber.pending.size()};
+    ctx.fiber.iov[1] = {(void*)out.data(), out.size()};
+  }
+  bool await_resume() {
+    ctx.fiber.pending.clear();
+    ctx.output_stream.reset();
+    return coro_connection::writev_operation::await_resume();
+  }
+  coro_http_ctx& ctx;
+};
+
+// Coroutine version of make_http_processor.
+// It reads the whole request, body included, before calling \handler(ctx), which returns
+// a coro_task<>. The request bodies are limited to the size of the read buffer
+// (input_buffer::max_size), larger ones get a 413 response.
+template <typename F> coro_task<> coro_http_process(coro_connection& connection, const F& handler) {
+  input_buffer rb;
+  coro_http_fiber fiber(connection);
+  coro_http_ctx ctx(rb, fiber);
+  ctx.socket_fd = connection.socket_fd;
+
+  while (true) {
+    ctx.is_body_read_ = false;
+    ctx.header_lines.clear();
+    ctx.header_lines.reserve(100);
+
+    // Responses are coalesced while pipelined requests are already in the read buffer.
+    if (rb.empty()) {
+      if (!co_await coro_send_responses(ctx))
+        co_return;
+      int received;
+      while ((received = rb.read_more_nowait(fiber)) < 0) {
+        // The connection is idle: give its buffers back to the pool while waiting.
+        ctx.release_buffers();
+        fiber.release();
+        if (!co_await connection.wait_event())
+          co_return;
+      }
+      if (received == 0)
+        co_return;
+    }
+
+    // Read until there is a complete header.
+    int header_end = rb.cursor;
+    ctx.add_header_line(rb.data() + header_end);
+
+    bool complete_header = false;
+    const char* cur = rb.data() + header_end;
+    while (!complete_header) {
+      while ((cur - rb.data()) < rb.end - 3) {
+        if (cur[0] == '\r' and cur[1] == '\n') {
+          cur += 2; // skip \r\n
+          ctx.add_header_line(cur);
+          // If we read \r\n twice the header is complete.
+          if (cur[0] == '\r' and cur[1] == '\n') {
+            complete_header = true;
+            cur += 2; // skip \r\n
+            break;
+          }
+        } else
+          cur++;
+      }
+
+      if (!complete_header) {
+        if (!co_await coro_send_responses(ctx))
+          co_return;
+        // Grow the buffer if the headers fill it.
+        if (rb.end == rb.capacity())
+          ctx.move_header_lines(cur, rb.reserve(rb.current_size() + 1));
+        if (rb.end == rb.capacity()) {
+          std::cerr << "Error: request too long, read buffer full." << std::endl;
+          co_return;
+        }
+        int received = co_await connection.read(rb.data() + rb.end, rb.capacity() - rb.end);
+        if (received == 0)
+          co_return;
+        rb.end += received;
+      }
+    }
+
+    // Header is complete. Process it.
+    ctx.prepare_request();
+
+    int request_size = cur - ctx.header_lines[0] + ctx.content_length_;
+    if (request_size > input_buffer::max_size) {
+      ctx.set_status(413);
+      ctx.respond("Request body too large.");
+      co_await coro_send_responses(ctx);
+      co_return;
+    }
+
+    // Read the whole body before running the handler.
+    if (ctx.move_header_lines(cur, rb.reserve(request_size)))
+      ctx.prepare_request();
+    header_end = cur - rb.data();
+    while (rb.end - header_end < ctx.content_length_) {
+      int received = co_await connection.read(rb.data() + rb.end, rb.capacity() - rb.end);
+      if (received == 0)
+        co_return;
+      rb.end += received;
+    }
+
+    ctx.body_start = std::string_view(rb.data() + header_end, rb.end - header_end);
+    co_await handler(ctx);
+
+    // Update the cursor the beginning of the next request.
+    // Do not process the pipelined requests of a closed connection.
+    if (!ctx.prepare_next_request() or fiber.is_closed())
+      co_return;
+  }
+}
+
+} // namespace http_async_impl
+
+typedef basic_http_request<http_async_impl::coro_http_ctx> coro_http_request;
+typedef basic_http_response<http_async_impl::coro_http_ctx> coro_http_response;
+
+// Api of the coroutine server: handlers are coroutines returning coro_task<>.
+using coro_http_api = api<coro_http_request, coro_http_response, coro_task<>>;
+
+namespace http_async_impl {
+
+template <typename A> coro_task<> coro_http_call(const A& api, coro_http_ctx& ctx) {
+  coro_http_request rq{ctx};
+  coro_http_response resp(ctx);
+  try {
+    co_await api.call(ctx.method(), ctx.url(), rq, resp);
+  } catch (const http_error& e) {
+    ctx.respond_error(e.status(), e.what());
+  } catch (const sql_client_closed&) {
+    co_return;
+  } catch (const std::runtime_error& e) {
+    std::cerr << "INTERNAL SERVER ERROR: " << e.what() << std::endl;
+    ctx.respond_error(500, "Internal server error.");
+  }
+  ctx.respond_if_needed();
+}
+
+} // namespace http_async_impl
+
+// Same as http_serve, on the coroutine reactor.
+// request.fiber.connection is the coro_connection of the request: handlers can
+// co_await its sleep_for, yield or wait_event.
+template <typename... O> auto http_serve_coro(coro_http_api api, int port, O... opts) {
+
+  auto options = mmm(opts...);
+
+  int nthreads = get_or(options, s::nthreads, std::thread::hardware_concurrency());
+  tcp_server_options tcp_options = http_async_impl::make_tcp_server_options(options);
+
+  api.freeze();
+  auto handler = [api](http_async_impl::coro_http_ctx& ctx) {
+    return http_async_impl::coro_http_call(api, ctx);
+  };
+
+  http_async_impl::run_server(port, options, [=] {
+    start_coro_tcp_server(
+        port, SOCK_STREAM, nthreads,
+        [handler](coro_connection& connection) {
+          return http_async_impl::coro_http_process(connection, handler);
+        },
+        tcp_options);
+  });
+}
+
+} // namespace li
+
+#endif
+
+#endif // LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_CORO_HTTP_SERVE_HH
+
+
+#ifndef LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_HASHMAP_HTTP_SESSION_HH
+#define LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_HASHMAP_HTTP_SESSION_HH
+
+#ifndef LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_RANDOM_COOKIE_HH
+#define LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_RANDOM_COOKIE_HH
+
+
+namespace li {
+
+inline std::string generate_secret_tracking_id() {
+  std::ostringstream os;
+  std::random_device rd;
+  os << std::hex << rd() << rd() << rd() << rd();
+  return os.str();
+}
+
+inline std::string random_cookie(http_request& request, http_response& response,
+                                 const char* key = "silicon_token") {
+  std::string token;
+  std::string_view token_ = request.cookie(key);
+  if (!token_.data()) {
+    token = generate_secret_tracking_id();
+    response.set_cookie(key, token);
+  } else {
+    std::cout << "got token " << token_ << std::endl;
+    token = token_;
+  }
+
+  return token;
+}
+
+} // namespace li
+
+#endif // LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_RANDOM_COOKIE_HH
+
+
+namespace li {
+
+template <typename O> struct connected_hashmap_http_session {
+
+  connected_hashmap_http_session(std::string session_id_, O* values_,
+                                 std::unordered_map<std::string, O>& sessions_, std::mutex& mutex_)
+      : session_id_(session_id_), values_(values_), sessions_(sessions_), mutex_(mutex_) {}
+
+  // Store fiels into the session
+  template <typename... F> auto store(F... fields) {
+    map(mmm(fields...), [this](auto k, auto v) { values()[k] = v; });
+  }
+
+  // Access values of the session.
+  O& values() {
+    if (!values_)
+      throw http_error::internal_server_error("Cannot access session values after logout.");
+    return *values_;
+  }
+
+  // Delete the session from the database.
+  void logout() {
+    std::lock_guard<std::mutex> guard(mutex_);
+    sessions_.erase(session_id_);
+  }
+
+private:
+  std::string session_id_;
+  O* values_;
+  std::unordered_map<std::string, O>& sessions_;
+  std::mutex& mutex_;
+};
+
+template <typename... F> struct hashmap_http_session {
+
+  typedef decltype(mmm(std::declval<F>()...)) session_values_type;
+  inline hashmap_http_session(std::string cookie_name, F... fields)
+      : cookie_name_(cookie_name), default_values_(mmm(s::session_id = std::string(), fields...)) {}
+
+  inline auto connect(http_request& request, http_response& response) {
+    std::string session_id = random_cookie(request, response, cookie_name_.c_str());
+    auto it = sessions_.try_emplace(session_id, default_values_).first;
+    return connected_hashmap_http_session<session_values_type>{session_id, &it->second, sessions_,
+                                                               sessions_mutex_};
+  }
+
+  std::string cookie_name_;
+  session_values_type default_values_;
+  std::unordered_map<std::string, session_values_type> sessions_;
+  std::mutex sessions_mutex_;
+};
+
+} // namespace li
+
+#endif // LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_HASHMAP_HTTP_SESSION_HH
+
+#ifndef LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_HTTP_AUTHENTICATION_HH
+#define LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_HTTP_AUTHENTICATION_HH
+
+
+#ifndef LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_OFFLOAD_POOL_HH
+#define LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_OFFLOAD_POOL_HH
+
+
+
+namespace li {
+
+// A blocking call waiting for a worker of an offload_pool.
+// It lives on the stack of the waiting fiber.
+struct offload_job {
+  async_reactor* reactor;
+  int fiber_id;
+  void (*run)(void*);
+  void* arg;
+  std::atomic<bool> done = false;
+};
+
+struct offload_pool_stats {
+  int threads;
+  int queue_depth;      // Jobs waiting for a worker.
+  int max_queue_depth;  // Highest queue_depth since the creation of the pool.
+  int busy_workers;
+  long long completed;
+  long long rejected;   // Jobs refused because the queue was full.
+};
+
+// Worker threads running blocking or CPU heavy functions for the fibers of the reactors.
+//
+//   auto hash = pool.await_blocking(request.fiber, [&] { return bcrypt(password); });
+//
+// The calling fiber parks while the function runs on a worker, the other connections of
+// its thread keep being served. The worker wakes the fiber on its own reactor with
+// async_reactor::remote_fiber_resume (an eventfd write). Exceptions are rethrown in the fiber.
+struct offload_pool {
+
+  // \max_queue_size: maximum number of jobs waiting for a worker, 0 for no limit.
+  // await_blocking throws http_error::service_unavailable when the queue is full.
+  offload_pool(int nthreads = std::thread::hardware_concurrency(), int max_queue_size = 0)
+      : max_queue_size_(max_queue_size) {
+    for (int i = 0; i < std::max(1, nthreads); i++)
+      workers_.emplace_back([this] { worker_loop(); });
+  }
+
+  offload_pool(const offload_pool&) = delete;
+  offload_pool& operator=(const offload_pool&) = delete;
+
+  // Wait for the jobs in the queue, then stop the workers.
+  ~offload_pool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    jobs_cv_.notify_all();
+    for (auto& t : workers_)
+      t.join();
+  }
+
+  // Run \fn() on a worker and return its result. The fiber waits even if its client
+  // closes the connection since fn may reference its stack.
+  template <typename F> auto await_blocking(async_fiber_context& fiber, F fn) {
+    typedef std::invoke_result_t<F&> R;
+    std::conditional_t<std::is_void_v<R>, bool, std::optional<R>> result;
+    std::exception_ptr error;
+    auto call = [&] {
+      try {
+        if constexpr (std::is_void_v<R>)
+          fn();
+        else
+          result.emplace(fn());
+      } catch (...) {
+        error = std::current_exception();
+      }
+    };
+
+    offload_job job{fiber.reactor, fiber.fiber_id,
+                    [](void* arg) { (*(decltype(call)*)arg)(); }, &call};
+    submit(job);
+    while (!job.done.load(std::memory_order_acquire))
+      if (!fiber.park())
+        fiber.yield();
+
+    if (error)
+      std::rethrow_exception(error);
+    if constexpr (!std::is_void_v<R>)
+      return std::move(*result);
+  }
+
+  offload_pool_stats stats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return offload_pool_stats{int(workers_.size()), int(jobs_.size()), max_queue_depth_,
+                              busy_workers_,        completed_,         rejected_};
+  }
+
+private:
+  void submit(offload_job& job) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (max_queue_size_ and int(jobs_.size()) >= max_queue_size_) {
+        rejected_++;
+        throw http_error::service_unavailable("Offload queue full.");
+      }
+      jobs_.push_back(&job);
+      max_queue_depth_ = std::max(max_queue_depth_, int(jobs_.size()));
+    }
+    jobs_cv_.notify_one();
+  }
+
+  void worker_loop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      jobs_cv_.wait(lock, [this] { return stopping_ or !jobs_.empty(); });
+      if (jobs_.empty())
+        return;
+      offload_job* job = jobs_.front();
+      jobs_.pop_front();
+      busy_workers_++;
+      lock.unlock();
+
+      job->run(job->arg);
+
+      lock.lock();
+      busy_workers_--;
+      completed_++;
+      lock.unlock();
+
+      // The job is gone as soon as done is set: the fiber may wake up spuriously and see it.
+      async_reactor* reactor = job->reactor;
+      int fiber_id = job->fiber_id;
+      job->done.store(true, std::memory_order_release);
+      reactor->remote_fiber_resume(fiber_id);
+      lock.lock();
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable jobs_cv_;
+  std::deque<offload_job*> jobs_;
+  std::vector<std::thread> workers_;
+  int max_queue_size_;
+  bool stopping_ = false;
+  int max_queue_depth_ = 0;
+  int busy_workers_ = 0;
+  long long completed_ = 0;
+  long long rejected_ = 0;
+};
+
+// The pool shared by the whole process, with one thread per core.
+inline offload_pool& default_offload_pool() {
+  static offload_pool pool;
+  return pool;
+}
+
+// Run \fn() on the default offload pool. See offload_pool::await_blocking.
+template <typename F> auto await_blocking(async_fiber_context& fiber, F fn) {
+  return default_offload_pool().await_blocking(fiber, std::move(fn));
+}
+
+} // namespace li
+
+#endif // LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_OFFLOAD_POOL_HH
+
+#ifndef LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_SQL_HTTP_SESSION_HH
+#define LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_SQL_HTTP_SESSION_HH
+
+
+namespace li {
+
+template <typename ORM> struct connected_sql_http_session {
+
+  // Construct the session.
+  // Retrive the cookie
+  // Retrieve it from the database.
+  // Insert it if it does not exists.
+  connected_sql_http_session(typename ORM::object_type& defaults, ORM&& orm,
+                             const std::string& session_id)
+      : loaded_(false), session_id_(session_id), orm_(std::forward<ORM>(orm)), values_(defaults) {}
+
+  // Store fiels into the session
+  template <typename... F> auto store(F... fields) {
+    map(mmm(fields...), [this](auto k, auto v) { values_[k] = v; });
+    if (!orm_.exists(s::session_id = session_id_))
+      orm_.insert(s::session_id = session_id_, fields...);
+    else
+      orm_.update(s::session_id = session_id_, fields...);
+  }
+
+  // Access values of the session.
+  const auto values() {
+    load();
+    return values_;
+  }
+
+  // Delete the session from the database.
+  void logout() { orm_.remove(s::session_id = session_id_); }
+
+private:
+  auto load() {
+    if (loaded_)
+      return;
+    if (auto new_values_ = orm_.find_one(s::session_id = session_id_))
+      values_ = *new_values_;
+    loaded_ = true;
+  }
+
+  bool loaded_;
+  std::string session_id_;
+  ORM orm_;
+  typename ORM::object_type values_;
+};
+
+template <typename DB, typename... F>
+decltype(auto) create_session_orm(DB& db, std::string table_name, F... fields) {
+  return sql_orm_schema<DB>(db, table_name)
+      .fields(s::session_id(s::read_only, s::primary_key) = sql_varchar<32>(), fields...);
+}
+
+template <typename DB, typename... F> struct sql_http_session {
+
+  sql_http_session(DB& db, std::string table_name, std::string cookie_name, F... fields)
+      : cookie_name_(cookie_name),
+        default_values_(mmm(s::session_id = sql_varchar<32>(), fields...)),
+        session_table_(create_session_orm(db, table_name, fields...)) {}
+
+  auto connect(http_request& request, http_response& response) {
+    return connected_sql_http_session(default_values_, session_table_.connect(request.fiber),
+                                      random_cookie(request, response, cookie_name_.c_str()));
   }
 
   auto orm() { return session_table_; }
 
-  std::string cookie_name_;
-  std::decay_t<decltype(mmm(s::session_id = sql_varchar<32>(), std::declval<F>()...))>
-      default_values_;
-  std::decay_t<decltype(
-      create_session_orm(std::declval<DB&>(), std::string(), std::declval<F>()...))>
-      session_table_;
+  std::string cookie_name_;
+  std::decay_t<decltype(mmm(s::session_id = sql_varchar<32>(), std::declval<F>()...))>
+      default_values_;
+  std::decay_t<decltype(
+      create_session_orm(std::declval<DB&>(), std::string(), std::declval<F>()...))>
+      session_table_;
+};
+
+} // namespace li
+
+#endif // LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_SQL_HTTP_SESSION_HH
+
+
+namespace li {
+
+template <typename S, typename U, typename L, typename P, typename... CB>
+struct http_authentication {
+  http_authentication(S& session, U& users, L login_field, P password_field, CB... callbacks)
+      : sessions_(session), users_(users), login_field_(login_field),
+        password_field_(password_field), callbacks_(mmm(callbacks...)) {
+
+    auto allowed_callbacks = mmm(s::hash_password, s::create_secret_key);
+
+    static_assert(metamap_size<decltype(substract(callbacks_, allowed_callbacks))>() == 0,
+                  "The only supported callbacks for http_authentication are: s::hash_password, "
+                  "s::create_secret_key");
+  }
+
+  template <typename SS, typename... A> void call_callback(SS s, A&&... args) {
+    if constexpr (has_key<decltype(callbacks_)>(s))
+      return callbacks_[s](std::forward<A>(args)...);
+  }
+
+  bool login(http_request& req, http_response& resp) {
+    auto lp = req.post_parameters(login_field_ = users_.all_fields()[login_field_],
+                                  password_field_ = users_.all_fields()[password_field_]);
+
+    // Password hashing is slow by design: run it on the offload pool.
+    if constexpr (has_key<decltype(callbacks_)>(s::hash_password))
+      lp[password_field_] = await_blocking(req.fiber, [&] {
+        return callbacks_[s::hash_password](lp[login_field_], lp[password_field_]);
+      });
+
+    if (auto user = users_.connect(req.fiber).find_one(lp)) {
+      sessions_.connect(req, resp).store(s::user_id = user->id);
+      return true;
+    } else
+      return false;
+  }
+
+  auto current_user(http_request& req, http_response& resp) {
+    auto sess = sessions_.connect(req, resp);
+    if (sess.values().user_id != -1)
+      return users_.connect().find_one(s::id = sess.values().user_id);
+    else
+      return decltype(users_.connect(req.fiber).find_one(s::id = sess.values().user_id)){};
+  }
+
+  void logout(http_request& req, http_response& resp) { sessions_.connect(req, resp).logout(); }
+
+  bool signup(http_request& req, http_response& resp) {
+    auto new_user = req.post_parameters(users_.all_fields_except_computed());
+    auto users = users_.connect(req.fiber);
+
+    if (users.exists(login_field_ = new_user[login_field_]))
+      return false;
+    else {
+      if constexpr (has_key<decltype(callbacks_)>(s::update_secret_key))
+        callbacks_[s::update_secret_key](new_user[login_field_], new_user[password_field_]);
+      if constexpr (has_key<decltype(callbacks_)>(s::hash_password))
+        new_user[password_field_] = await_blocking(req.fiber, [&] {
+          return callbacks_[s::hash_password](new_user[login_field_], new_user[password_field_]);
+        });
+      users.insert(new_user);
+      return true;
+    }
+  }
+
+  S& sessions_;
+  U& users_;
+  L login_field_;
+  P password_field_;
+  decltype(mmm(std::declval<CB>()...)) callbacks_;
+};
+
+template <typename... A> http_api http_authentication_api(http_authentication<A...>& auth) {
+
+  http_api api;
+
+  api.post("/login") = [&](http_request& request, http_response& response) {
+    if (!auth.login(request, response))
+      throw http_error::unauthorized("Bad login.");
+  };
+
+  api.get("/logout") = [&](http_request& request, http_response& response) {
+    auth.logout(request, response);
+  };
+
+  api.get("/signup") = [&](http_request& request, http_response& response) {
+    if (!auth.signup(request, response))
+      throw http_error::bad_request("User already exists.");
+  };
+
+  return api;
+}
+
+// Disable this for now. (No time to install nettle on windows.)
+// #include <nettle/sha3.h>
+// inline std::string hash_sha3_512(const std::string& str)
+// {
+//   struct sha3_512_ctx ctx;
+//   sha3_512_init(&ctx);
+//   sha3_512_update(&ctx, str.size(), (const uint8_t*) str.data());
+//   uint8_t h[SHA3_512_DIGEST_SIZE];
+//   sha3_512_digest(&ctx, sizeof(h), h);
+//   return std::string((const char*)h, sizeof(h));
+// }
+
+} // namespace li
+
+#endif // LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_HTTP_AUTHENTICATION_HH
+
+//#include <li/http_server/mhd.hh>
+#ifndef LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_SERVE_DIRECTORY_HH
+#define LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_SERVE_DIRECTORY_HH
+
+
+
+
+namespace li {
+
+namespace impl {
+  inline bool is_regular_file(const std::string& path) {
+    struct stat path_stat;
+    if (-1 == stat(path.c_str(), &path_stat))
+      return false;
+    return S_ISREG(path_stat.st_mode);
+  }
+
+  inline bool is_directory(const std::string& path) {
+    struct stat path_stat;
+    if (-1 == stat(path.c_str(), &path_stat))
+      return false;
+    return S_ISDIR(path_stat.st_mode);
+  }
+
+  inline bool starts_with(const char *pre, const char *str)
+  {
+      size_t lenpre = strlen(pre),
+            lenstr = strlen(str);
+      return lenstr < lenpre ? false : memcmp(pre, str, lenpre) == 0;
+  }
+} // namespace impl
+
+inline auto serve_file(const std::string& root, std::string_view path, http_response& response) {
+  static char dot = '.', slash = '/';
+
+  // remove first slash if needed.
+  if (!path.empty() && path[0] == slash) {
+    path = std::string_view(path.data() + 1, path.size() - 1); // erase(0, 1);
+  }
+
+  // Directory listing not supported.
+  std::string full_path(root + std::string(path));
+  if (path.empty() || !impl::is_regular_file(full_path)) {
+    throw http_error::not_found("file not found.");
+  }
+  
+  // Check if file exists by real file path.
+  char realpath_out[PATH_MAX]{0};
+  if (nullptr == realpath(full_path.c_str(), realpath_out))
+    throw http_error::not_found("file not found.");
+
+  // Check that path is within the root directory.
+  if (!impl::starts_with(root.c_str(), realpath_out))
+    throw http_error::not_found("Access denied.");
+
+  response.write_static_file(full_path);
+};
+
+inline auto serve_directory(const std::string& root) {
+  // extract root realpath. 
+  char realpath_out[PATH_MAX]{0};
+  if (nullptr == realpath(root.c_str(), realpath_out))
+    throw std::runtime_error(std::string("serve_directory error: Directory ") + root + " does not exists.");
+
+  // Check if it is a directory.
+  if (!impl::is_directory(realpath_out))
+  {
+    throw std::runtime_error(std::string("serve_directory error: ") + root + " is not a directory.");
+  }
+
+  // Ensure the root ends with a /
+  std::string real_root(realpath_out);
+  if (real_root.back() != '/')
+  {
+    real_root.push_back('/');
+  }
+
+  http_api api;
+  api.get("/{{path...}}") = [real_root](http_request& request, http_response& response) {
+    auto path = request.url_parameters(s::path = std::string_view()).path;
+    return serve_file(real_root, path, response);
+  };
+  return api;
+}
+
+} // namespace li
+
+#endif // LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_SERVE_DIRECTORY_HH
+
+#ifndef LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_FORK_JOIN_HH
+#define LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_FORK_JOIN_HH
+
+
+
+namespace li {
+
+// A group of child fibers spawned from a request handler on its reactor.
+// Children get their own async_fiber_context: they can take their own SQL connection
+// (db.connect(child)) or wait on other file descriptors, while the parent waits in join.
+//
+// The first exception thrown by a child cancels the others and is rethrown by join.
+// Cancelled children, and all the children when the client closes the connection, see
+// child.is_closed(): yield and park return false.
+struct fiber_group {
+
+  fiber_group(async_fiber_context& parent) : parent(parent) {}
+  fiber_group(const fiber_group&) = delete;
+  fiber_group& operator=(const fiber_group&) = delete;
+
+  // Children reference the stack of the parent: wait for them even on errors.
+  ~fiber_group() {
+    if (running) {
+      cancel();
+      wait();
+    }
+  }
+
+  // Run \f(async_fiber_context& child) in a new fiber. It starts immediately and runs
+  // until its first yield.
+  template <typename F> void spawn(F f) {
+    running++;
+    int index = children.size();
+    children.push_back(-1);
+    int fiber_id = parent.reactor->spawn(parent, [this, index, f = std::move(f)](
+                                                     async_fiber_context& child) mutable {
+      child.cancelled = &cancelled;
+      if (!cancelled) {
+        try {
+          f(child);
+        } catch (boost::context::detail::forced_unwind&) {
+          // The reactor unwinds the stack of a suspended child it destroys.
+          throw;
+        } catch (...) {
+          if (!error)
+            error = std::current_exception();
+          cancel();
+        }
+      }
+      children[index] = -2;
+      if (--running == 0)
+        child.defer_fiber_resume(parent.fiber_id);
+    });
+    // -2 if the child already returned.
+    if (children[index] == -1)
+      children[index] = fiber_id;
+  }
+
+  // Wake up the running children: they see their connection closed.
+  void cancel() {
+    if (cancelled)
+      return;
+    cancelled = true;
+    for (int fiber_id : children)
+      if (fiber_id >= 0)
+        parent.defer_fiber_resume(fiber_id);
+  }
+  bool is_cancelled() const { return cancelled; }
+
+  // Wait for all the children, then rethrow the first exception thrown by one of them.
+  void join() {
+    wait();
+    if (error)
+      std::rethrow_exception(std::exchange(error, nullptr));
+  }
+
+private:
+  void wait() {
+    // If the client is gone, park returns immediately: yield until the children,
+    // which also see the connection closed, return.
+    while (running)
+      if (!parent.park())
+        parent.yield();
+  }
+
+  async_fiber_context& parent;
+  int running = 0;
+  // Fiber ids of the children, negative once they returned.
+  std::vector<int> children;
+  bool cancelled = false;
+  std::exception_ptr error;
+};
+
+// Run \task(child, i) for i in [0, n) in n child fibers and wait for them.
+// Return the vector of the results, or nothing if \task returns void.
+template <typename F> auto fork_join(async_fiber_context& fiber, int n, F task) {
+  typedef std::invoke_result_t<F&, async_fiber_context&, int> R;
+  fiber_group group(fiber);
+  if constexpr (std::is_void_v<R>) {
+    for (int i = 0; i < n; i++)
+      group.spawn([&task, i](async_fiber_context& child) { task(child, i); });
+    group.join();
+  } else {
+    std::vector<R> results(n);
+    for (int i = 0; i < n; i++)
+      group.spawn([&task, &results, i](async_fiber_context& child) { results[i] = task(child, i); });
+    group.join();
+    return results;
+  }
+}
+
+// Run each of \tasks(child) in its own child fiber and wait for them.
+// Return the tuple of the results. Tasks cannot return void.
+template <typename... F> auto fork_join_all(async_fiber_context& fiber, F... tasks) {
+  std::tuple<std::invoke_result_t<F&, async_fiber_context&>...> results;
+  fiber_group group(fiber);
+  std::apply(
+      [&](auto&... result) {
+        (group.spawn([&task = tasks, &result](async_fiber_context& child) { result = task(child); }),
+         ...);
+      },
+      results);
+  group.join();
+  return results;
+}
+
+} // namespace li
+
+#endif // LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_FORK_JOIN_HH
+
+#ifndef LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_RATE_LIMITER_HH
+#define LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_RATE_LIMITER_HH
+
+
+
+namespace li {
+
+// Token bucket rate limiter, keyed by client ip (default) or by any string computed from the
+// request.
+//
+//   rate_limiter limiter(s::rate = 10, s::burst = 20);
+//   api.get("/search") = limiter([&] (http_request& request, http_response& response) { ... });
+//   // Limit a whole api, keyed by api key:
+//   rate_limiter by_api_key(s::rate = 1000, s::key = [] (http_request& request) {
+//     return std::string(request.header("X-Api-Key"));
+//   });
+//   api.add_subapi("/v1", by_api_key(v1_api));
+//
+// Requests over the limit get a 429 response with a Retry-After header, the handler is not
+// called.
+//
+// Each server thread has its own shard of buckets and updates it without locks. Every
+// s::sync_interval milliseconds (default 100), a shard reconciles the buckets it used with a
+// global bucket per key, under a mutex: it charges the global bucket with its own requests and
+// takes its token count. The limit is thus approximate across threads: between two
+// reconciliations, each thread may admit up to s::burst + s::rate * s::sync_interval requests
+// of a key.
+//
+// A shard holds at most s::max_keys buckets (default 100000). When it is full, the CLOCK
+// algorithm evicts a bucket that was not used since the hand last passed over it.
+struct rate_limiter {
+  typedef std::chrono::steady_clock clock;
+
+  template <typename... O> rate_limiter(O... opts) {
+    auto options = mmm(opts...);
+    rate = get_or(options, s::rate, 100);
+    burst = get_or(options, s::burst, std::max(1, int(rate)));
+    max_keys = get_or(options, s::max_keys, 100000);
+    sync_interval = std::chrono::milliseconds(get_or(options, s::sync_interval, 100));
+    if constexpr (has_key(options, s::key))
+      key = options.key;
+    else
+      key = [](http_request& request) { return request.ip_address(); };
+  }
+
+  rate_limiter(const rate_limiter&) = delete;
+
+  // Wrap \handler. The rate_limiter must outlive the server.
+  template <typename H> auto operator()(H handler) {
+    return [this, handler](http_request& request, http_response& response) {
+      int retry_after = try_acquire(key(request));
+      if (retry_after) {
+        response.set_status(429);
+        response.set_header("Retry-After", std::to_string(retry_after));
+        response.write("Too many requests.");
+        return;
+      }
+      handler(request, response);
+    };
+  }
+
+  // Wrap all the handlers of \subapi, to pass to api::add_subapi.
+  template <typename Req, typename Resp> api<Req, Resp> operator()(const api<Req, Resp>& subapi) {
+    api<Req, Resp> limited;
+    subapi.routes_map_.for_all_routes([&](auto r, const auto& handlers) {
+      for (auto& h : handlers)
+        if (h.handler)
+          limited(h.verb, h.url_spec) = (*this)(h.handler);
+    });
+    return limited;
+  }
+
+  // Take a token from the bucket of \k, in the shard of the calling thread.
+  // Return 0 on success, or the number of seconds before the next token.
+  int try_acquire(const std::string& k) {
+    shard& sh = *impl::thread_local_state<shard*>(thread_key, [this] { return add_shard(); });
+    auto now = clock::now();
+    if (now >= sh.next_sync)
+      reconcile(sh, now);
+
+    int i = find_or_insert(sh, k, now);
+    bucket& b = sh.buckets[i];
+    b.referenced = true;
+    b.tokens = refill(b.tokens, now - b.refill_time);
+    b.refill_time = now;
+    if (b.tokens < 1) {
+      sh.rejected.fetch_add(1, std::memory_order_relaxed);
+      return std::max(1, int(std::ceil((1 - b.tokens) / rate)));
+    }
+    b.tokens -= 1;
+    b.unsynced++;
+    if (!b.dirty) {
+      b.dirty = true;
+      sh.dirty.push_back(i);
+    }
+    sh.admitted.fetch_add(1, std::memory_order_relaxed);
+    return 0;
+  }
+
+  auto stats() {
+    long long admitted = 0, rejected = 0, evicted = 0;
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto& sh : shards) {
+      admitted += sh->admitted.load(std::memory_order_relaxed);
+      rejected += sh->rejected.load(std::memory_order_relaxed);
+      evicted += sh->evicted.load(std::memory_order_relaxed);
+    }
+    return mmm(s::admitted = admitted, s::rejected = rejected, s::evicted = evicted);
+  }
+
+  double rate; // Tokens per second.
+  int burst;   // Bucket capacity.
+  int max_keys;
+  std::chrono::microseconds sync_interval;
+  std::function<std::string(http_request&)> key;
+
+private:
+  struct bucket {
+    std::string key;
+    double tokens;
+    clock::time_point refill_time;
+    int unsynced = 0; // Tokens taken since the last reconciliation.
+    bool referenced = false;
+    bool dirty = false; // In shard::dirty.
+  };
+
+  struct shard {
+    std::unordered_map<std::string, int> index;
+    std::vector<bucket> buckets;
+    int clock_hand = 0;
+    std::vector<int> dirty;
+    clock::time_point next_sync;
+    std::atomic<long long> admitted = 0;
+    std::atomic<long long> rejected = 0;
+    std::atomic<long long> evicted = 0;
+  };
+
+  struct global_bucket {
+    double tokens;
+    clock::time_point refill_time;
+  };
+
+  // Tokens of a bucket holding \tokens, \elapsed later.
+  double refill(double tokens, clock::duration elapsed) const {
+    return std::min(double(burst), tokens + rate * std::chrono::duration<double>(elapsed).count());
+  }
+
+  shard* add_shard() {
+    std::lock_guard<std::mutex> lock(mutex);
+    shards.emplace_back(new shard);
+    return shards.back().get();
+  }
+
+  int find_or_insert(shard& sh, const std::string& k, clock::time_point now) {
+    auto it = sh.index.find(k);
+    if (it != sh.index.end())
+      return it->second;
+
+    int i;
+    if (int(sh.buckets.size()) < max_keys) {
+      i = sh.buckets.size();
+      sh.buckets.emplace_back();
+    } else {
+      while (sh.buckets[sh.clock_hand].referenced) {
+        sh.buckets[sh.clock_hand].referenced = false;
+        sh.clock_hand = (sh.clock_hand + 1) % sh.buckets.size();
+      }
+      i = sh.clock_hand;
+      sh.clock_hand = (sh.clock_hand + 1) % sh.buckets.size();
+      // Tokens taken since the last reconciliation are lost.
+      sh.index.erase(sh.buckets[i].key);
+      sh.evicted.fetch_add(1, std::memory_order_relaxed);
+    }
+    bucket& b = sh.buckets[i];
+    b.key = k;
+    b.tokens = burst;
+    b.refill_time = now;
+    b.unsynced = 0;
+    sh.index.emplace(k, i);
+    return i;
+  }
+
+  // Charge the global buckets with the tokens taken by \sh, and update its buckets with
+  // the tokens left.
+  void reconcile(shard& sh, clock::time_point now) {
+    sh.next_sync = now + sync_interval;
+    if (sh.dirty.empty())
+      return;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    for (int i : sh.dirty) {
+      bucket& b = sh.buckets[i];
+      auto& g = global.try_emplace(b.key, global_bucket{double(burst), now}).first->second;
+      g.tokens = refill(g.tokens, now - g.refill_time);
+      g.refill_time = now;
+      g.tokens -= b.unsynced;
+      b.tokens = g.tokens;
+      b.refill_time = now;
+      b.unsynced = 0;
+      b.dirty = false;
+    }
+    sh.dirty.clear();
+
+    // Full global buckets carry no information, drop them when the map grows too big.
+    if (global.size() > shards.size() * max_keys)
+      for (auto it = global.begin(); it != global.end();) {
+        if (refill(it->second.tokens, now - it->second.refill_time) >= burst)
+          it = global.erase(it);
+        else
+          ++it;
+      }
+  }
+
+  std::mutex mutex; // Protects shards and global.
+  std::vector<std::unique_ptr<shard>> shards;
+  impl::thread_local_key thread_key; // Finds the shard of the current thread.
+  std::unordered_map<std::string, global_bucket> global;
+};
+
+} // namespace li
+
+#endif // LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_RATE_LIMITER_HH
+
+#ifndef LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_SSE_HH
+#define LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_SSE_HH
+
+
+
+namespace li {
+
+// An event published on a sse_hub topic.
+// It is serialized once at publish time and then shared by all the subscribers.
+struct sse_event {
+
+  sse_event(std::string_view data, std::string_view event_name) : data_(data) {
+    // text/event-stream framing.
+    std::string payload;
+    if (event_name.size())
+      payload.append("event: ").append(event_name).append("\n");
+    size_t line_start = 0;
+    while (line_start <= data.size()) {
+      size_t line_end = data.find('\n', line_start);
+      if (line_end == std::string_view::npos)
+        line_end = data.size();
+      payload.append("data: ").append(data.substr(line_start, line_end - line_start)).append("\n");
+      line_start = line_end + 1;
+    }
+    payload.append("\n");
+
+    // HTTP chunk framing.
+    char size[20];
+    int size_len = snprintf(size, sizeof(size), "%zx\r\n", payload.size());
+    frame_.reserve(size_len + payload.size() + 2);
+    frame_.append(size, size_len).append(payload).append("\r\n");
+  }
+
+  // The raw payload, as passed to publish. Used by long polling handlers.
+  std::string_view data() const { return data_; }
+  // The event serialized as a text/event-stream message inside a HTTP chunk.
+  std::string_view frame() const { return frame_; }
+
+private:
+  std::string data_;
+  std::string frame_;
+};
+
+typedef std::shared_ptr<const sse_event> sse_event_ptr;
+
+namespace internal {
+
+// State shared by the hub and a subscription.
+struct sse_subscriber {
+  async_reactor* reactor;
+  int fiber_id;
+  std::mutex mutex;
+  std::deque<sse_event_ptr> queue;
+};
+
+} // namespace internal
+
+struct sse_hub;
+
+// A subscription to one topic of a sse_hub. It unsubscribes when destroyed.
+// The wait methods park the calling fiber until an event is published.
+struct sse_subscription {
+
+  inline sse_subscription(sse_hub& hub, async_fiber_context& fiber, std::string topic,
+                          std::shared_ptr<internal::sse_subscriber> subscriber)
+      : hub_(&hub), fiber_(&fiber), topic_(std::move(topic)), subscriber_(std::move(subscriber)) {}
+
+  sse_subscription(sse_subscription&&) = default;
+  sse_subscription& operator=(sse_subscription&&) = delete;
+  inline ~sse_subscription();
+
+  // Return the next event, or nullptr if the server is shutting down or the client
+  // closed the connection.
+  inline sse_event_ptr wait() {
+    return wait_until(std::chrono::steady_clock::time_point::max());
+  }
+
+  // Return the next event, or nullptr if nothing was published before \deadline or the
+  // client closed the connection.
+  inline sse_event_ptr wait_until(std::chrono::steady_clock::time_point deadline) {
+    while (true) {
+      if (auto event = try_pop())
+        return event;
+      if (quit_signal_catched or std::chrono::steady_clock::now() >= deadline)
+        return nullptr;
+      bool open = deadline == std::chrono::steady_clock::time_point::max()
+                      ? fiber_->park()
+                      : fiber_->park_until(deadline);
+      if (!open)
+        return nullptr;
+    }
+  }
+
+  template <typename R, typename P>
+  inline sse_event_ptr wait_for(std::chrono::duration<R, P> timeout) {
+    return wait_until(std::chrono::steady_clock::now() + timeout);
+  }
+
+  // Return the next event if one is already queued, nullptr otherwise.
+  inline sse_event_ptr try_pop() {
+    std::lock_guard<std::mutex> lock(subscriber_->mutex);
+    if (subscriber_->queue.empty())
+      return nullptr;
+    sse_event_ptr event = std::move(subscriber_->queue.front());
+    subscriber_->queue.pop_front();
+    return event;
+  }
+
+private:
+  sse_hub* hub_;
+  async_fiber_context* fiber_;
+  std::string topic_;
+  std::shared_ptr<internal::sse_subscriber> subscriber_;
+};
+
+// Topic based publish/subscribe hub.
+// publish is thread safe: it wakes up the subscribed fibers on every reactor.
+struct sse_hub {
+
+  // Subscribers keep at most max_queue_size events, older events are dropped.
+  inline sse_hub(int max_queue_size = 1000) : max_queue_size_(max_queue_size) {}
+
+  inline sse_subscription subscribe(http_request& request, std::string topic) {
+    return subscribe(request.fiber, std::move(topic));
+  }
+
+  inline sse_subscription subscribe(async_fiber_context& fiber, std::string topic) {
+    auto subscriber = std::make_shared<internal::sse_subscriber>();
+    subscriber->reactor = fiber.reactor;
+    subscriber->fiber_id = fiber.fiber_id;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      topics_[topic].push_back(subscriber);
+    }
+    return sse_subscription(*this, fiber, std::move(topic), std::move(subscriber));
+  }
+
+  // Publish \data on \topic. Return the number of subscribers that received it.
+  inline int publish(std::string_view topic, std::string_view data,
+                     std::string_view event_name = std::string_view()) {
+    auto event = std::make_shared<const sse_event>(data, event_name);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = topics_.find(std::string(topic));
+    if (it == topics_.end())
+      return 0;
+    for (auto& subscriber : it->second) {
+      {
+        std::lock_guard<std::mutex> sub_lock(subscriber->mutex);
+        if (int(subscriber->queue.size()) >= max_queue_size_)
+          subscriber->queue.pop_front();
+        subscriber->queue.push_back(event);
+      }
+      subscriber->reactor->remote_fiber_resume(subscriber->fiber_id);
+    }
+    return it->second.size();
+  }
+
+  inline int subscribers_count(std::string_view topic) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = topics_.find(std::string(topic));
+    return it == topics_.end() ? 0 : it->second.size();
+  }
+
+  inline void unsubscribe(const std::string& topic,
+                          const std::shared_ptr<internal::sse_subscriber>& subscriber) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = topics_.find(topic);
+    if (it == topics_.end())
+      return;
+    auto& subscribers = it->second;
+    for (int i = 0; i < int(subscribers.size()); i++)
+      if (subscribers[i] == subscriber) {
+        subscribers[i] = std::move(subscribers.back());
+        subscribers.pop_back();
+        break;
+      }
+    if (subscribers.empty())
+      topics_.erase(it);
+  }
+
+private:
+  int max_queue_size_;
+  std::mutex mutex_;
+  std::unordered_map<std::string, std::vector<std::shared_ptr<internal::sse_subscriber>>> topics_;
+};
+
+sse_subscription::~sse_subscription() {
+  if (subscriber_)
+    hub_->unsubscribe(topic_, subscriber_);
+}
+
+// Stream text/event-stream events on a response:
+//
+//   auto sub = hub.subscribe(request, "news");
+//   sse_stream stream(response);
+//   while (auto event = sub.wait())
+//     stream.send(*event);
+//
+struct sse_stream {
+
+  inline sse_stream(http_response& response) : ctx_(response.http_ctx) {
+    ctx_.set_header("Content-Type", "text/event-stream");
+    ctx_.set_header("Cache-Control", "no-cache");
+    ctx_.start_chunked_response();
+  }
+
+  // Send an event serialized by sse_hub::publish.
+  inline void send(const sse_event& event) { ctx_.write_framed_chunk(event.frame()); }
+
+  inline void send(std::string_view data, std::string_view event_name = std::string_view()) {
+    send(sse_event(data, event_name));
+  }
+
+  // The response is terminated when the handler returns, end allows to terminate it earlier.
+  inline void end() { ctx_.end_chunked_response(); }
+
+private:
+  http_async_impl::http_ctx& ctx_;
 };
 
 } // namespace li
 
-#endif // LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_SQL_HTTP_SESSION_HH
+#endif // LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_SSE_HH
+
+#ifndef LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_UPSTREAM_HH
+#define LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_UPSTREAM_HH
+
+
 
 
 namespace li {
 
-template <typename S, typename U, typename L, typename P, typename... CB>
-struct http_authentication {
-  http_authentication(S& session, U& users, L login_field, P password_field, CB... callbacks)
-      : sessions_(session), users_(users), login_field_(login_field),
-        password_field_(password_field), callbacks_(mmm(callbacks...)) {
+enum class upstream_balancing { round_robin, least_outstanding, power_of_two_choices };
 
-    auto allowed_callbacks = mmm(s::hash_password, s::create_secret_key);
+namespace impl {
 
-    static_assert(metamap_size<decltype(substract(callbacks_, allowed_callbacks))>() == 0,
-                  "The only supported callbacks for http_authentication are: s::hash_password, "
-                  "s::create_secret_key");
-  }
+#ifdef MSG_NOSIGNAL
+static constexpr int send_nosignal_flag = MSG_NOSIGNAL;
+#else
+static constexpr int send_nosignal_flag = 0;
+#endif
 
-  template <typename SS, typename... A> void call_callback(SS s, A&&... args) {
-    if constexpr (has_key<decltype(callbacks_)>(s))
-      return callbacks_[s](std::forward<A>(args)...);
+inline bool header_equals(std::string_view a, std::string_view b) {
+  return a.size() == b.size() and 0 == strncasecmp(a.data(), b.data(), a.size());
+}
+
+// Headers that only concern one connection, not forwarded by proxies.
+inline bool is_hop_by_hop_header(std::string_view key) {
+  for (const char* h : {"Connection", "Keep-Alive", "Proxy-Connection", "Proxy-Authenticate",
+                        "Proxy-Authorization", "TE", "Trailer", "Transfer-Encoding", "Upgrade"})
+    if (header_equals(key, h))
+      return true;
+  return false;
+}
+
+// Incremental decoder of a chunked body (Transfer-Encoding: chunked).
+struct chunked_body_decoder {
+
+  // Decode \data, calling \on_data with the content of the chunks.
+  // Return the number of bytes used, less than data.size() if the body ends before.
+  template <typename F> size_t feed(std::string_view data, F on_data) {
+    const char* cur = data.data();
+    const char* end = cur + data.size();
+    while (cur < end and state != done) {
+      switch (state) {
+      case size_line: // Hexadecimal size, optional extensions, \r\n.
+        if (*cur == '\n') {
+          state = chunk_size ? chunk_data : trailer;
+          in_extension = false;
+        } else if (!in_extension) {
+          int digit = (*cur >= '0' and *cur <= '9')   ? *cur - '0'
+                      : (*cur >= 'a' and *cur <= 'f') ? *cur - 'a' + 10
+                      : (*cur >= 'A' and *cur <= 'F') ? *cur - 'A' + 10
+                                                      : -1;
+          if (digit >= 0)
+            chunk_size = chunk_size * 16 + digit;
+          else
+            in_extension = true;
+        }
+        cur++;
+        break;
+      case chunk_data: {
+        size_t n = std::min(chunk_size, size_t(end - cur));
+        on_data(std::string_view(cur, n));
+        cur += n;
+        chunk_size -= n;
+        if (!chunk_size)
+          state = chunk_end;
+        break;
+      }
+      case chunk_end: // \r\n after the data.
+        if (*cur++ == '\n')
+          state = size_line;
+        break;
+      case trailer: // Trailer lines, up to an empty line.
+        if (*cur == '\n') {
+          if (line_length == 0)
+            state = done;
+          line_length = 0;
+        } else if (*cur != '\r')
+          line_length++;
+        cur++;
+        break;
+      case done:
+        break;
+      }
+    }
+    return cur - data.data();
   }
 
-  bool login(http_request& req, http_response& resp) {
-    auto lp = req.post_parameters(login_field_ = users_.all_fields()[login_field_],
-                                  password_field_ = users_.all_fields()[password_field_]);
+  bool finished() const { return state == done; }
 
-    if constexpr (has_key<decltype(callbacks_)>(s::hash_password))
-      lp[password_field_] = callbacks_[s::hash_password](lp[login_field_], lp[password_field_]);
+  enum { size_line, chunk_data, chunk_end, trailer, done } state = size_line;
+  size_t chunk_size = 0;
+  bool in_extension = false;
+  int line_length = 0;
+};
 
-    if (auto user = users_.connect(req.fiber).find_one(lp)) {
-      sessions_.connect(req, resp).store(s::user_id = user->id);
-      return true;
-    } else
+// Non blocking I/O on an upstream socket, from the fiber of a request.
+// The fiber parks while the socket is not ready. It gives up when nothing happened
+// during \timeout, or when the client closed its connection.
+struct upstream_io {
+  typedef std::chrono::steady_clock clock;
+
+  upstream_io(async_fiber_context& fiber, std::chrono::microseconds timeout)
+      : fiber(fiber), timeout(timeout), deadline(clock::now() + timeout) {}
+
+  void progress() { deadline = clock::now() + timeout; }
+
+  // Wait for an event on the sockets of the fiber.
+  bool wait() {
+    if (clock::now() >= deadline) {
+      timed_out = true;
       return false;
+    }
+    return fiber.park_until(deadline);
+  }
+
+  bool send_all(int fd, const char* data, size_t size) {
+    while (size) {
+      ssize_t n = ::send(fd, data, size, send_nosignal_flag);
+      if (n > 0) {
+        data += n;
+        size -= n;
+        progress();
+      } else if (n == -1 and errno == EAGAIN) {
+        if (!wait())
+          return false;
+      } else
+        return false;
+    }
+    return true;
   }
 
-  auto current_user(http_request& req, http_response& resp) {
-    auto sess = sessions_.connect(req, resp);
-    if (sess.values().user_id != -1)
-      return users_.connect().find_one(s::id = sess.values().user_id);
-    else
-      return decltype(users_.connect(req.fiber).find_one(s::id = sess.values().user_id)){};
+  // Return the number of bytes read, 0 if the upstream closed the connection, -1 on error.
+  long recv_some(int fd, char* buf, size_t size) {
+    while (true) {
+      ssize_t n = ::recv(fd, buf, size, 0);
+      if (n >= 0) {
+        progress();
+        return n;
+      }
+      if (errno != EAGAIN or !wait())
+        return -1;
+    }
   }
 
-  void logout(http_request& req, http_response& resp) { sessions_.connect(req, resp).logout(); }
+#if __linux__
+  // Send \size bytes of \from to the client through \pipe_fds, without copying them in
+  // user space. On failure, the pipe may still contain data.
+  bool splice_all(int from, const int* pipe_fds, size_t size) {
+    size_t in_pipe = 0;
+    while (size or in_pipe) {
+      bool moved = false;
+      if (size) {
+        ssize_t n = ::splice(from, nullptr, pipe_fds[1], nullptr, size,
+                             SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == 0 or (n == -1 and errno != EAGAIN))
+          return false;
+        if (n > 0) {
+          size -= n;
+          in_pipe += n;
+          moved = true;
+        }
+      }
+      if (in_pipe) {
+        ssize_t n = ::splice(pipe_fds[0], nullptr, fiber.socket_fd, nullptr, in_pipe,
+                             SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == 0 or (n == -1 and errno != EAGAIN))
+          return false;
+        if (n > 0) {
+          in_pipe -= n;
+          moved = true;
+        }
+      }
+      if (moved)
+        progress();
+      else if (!wait())
+        return false;
+    }
+    return true;
+  }
+#endif
 
-  bool signup(http_request& req, http_response& resp) {
-    auto new_user = req.post_parameters(users_.all_fields_except_computed());
-    auto users = users_.connect(req.fiber);
+  async_fiber_context& fiber;
+  std::chrono::microseconds timeout;
+  clock::time_point deadline;
+  bool timed_out = false;
+};
 
-    if (users.exists(login_field_ = new_user[login_field_]))
-      return false;
+// Open a non blocking connection to \addr, registered in the reactor of io.fiber.
+// Return -1 if the connection fails.
+inline int upstream_connect(upstream_io& io, const sockaddr* addr, socklen_t addr_len) {
+  int fd = ::socket(addr->sa_family, SOCK_STREAM, 0);
+  if (fd == -1)
+    return -1;
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+  impl::set_socket_option(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+  int ret = ::connect(fd, addr, addr_len);
+  if (ret == -1 and errno != EINPROGRESS) {
+    ::close(fd);
+    return -1;
+  }
+  // Registered after connect: epoll reports unconnected sockets as hung up.
+#if __linux__
+  io.fiber.epoll_add(fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+#elif __APPLE__
+  io.fiber.epoll_add(fd, EVFILT_READ | EVFILT_WRITE);
+#endif
+  if (ret == -1) {
+    pollfd p{fd, POLLOUT, 0};
+    while (::poll(&p, 1, 0) == 0)
+      if (!io.wait()) {
+        ::close(fd);
+        return -1;
+      }
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (-1 == getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) or err) {
+      ::close(fd);
+      return -1;
+    }
+  }
+  return fd;
+}
+
+} // namespace impl
+
+// Reverse proxy: forward requests to a set of upstream HTTP/1.1 servers.
+//
+//   upstream backends({"10.0.0.1:8080", "10.0.0.2:8080"},
+//                     s::balancing = upstream_balancing::least_outstanding);
+//   api.get("/search") = [&] (http_request& request, http_response& response) {
+//     backends.forward(request, response);
+//   };
+//
+// Each server thread keeps its own pools of keep-alive connections to the upstreams, used
+// without locks. The responses are streamed to the client as they arrive; on Linux, large
+// bodies of known size go from the upstream socket to the client socket with splice.
+//
+// Options:
+//   s::balancing: round_robin (default), least_outstanding (fewest requests in flight on this
+//                 thread) or power_of_two_choices (the least loaded of two random upstreams).
+//   s::max_idle_connections: idle connections kept per upstream and per thread (default 64).
+//   s::timeout: milliseconds without progress before giving up with a 504 (default 10000).
+//   s::retries: attempts on other upstreams after a connection failure (default 2).
+//               Requests that were sent are only retried if their method is idempotent.
+//
+// When no upstream answers, forward throws a 502 http_error. If the connection to the
+// upstream fails in the middle of the response, the client connection is closed.
+struct upstream {
+  typedef std::chrono::steady_clock clock;
+
+  template <typename... O> upstream(const std::vector<std::string>& backends, O... opts) {
+    auto options = mmm(opts...);
+    balancing = get_or(options, s::balancing, upstream_balancing::round_robin);
+    max_idle_connections = get_or(options, s::max_idle_connections, 64);
+    timeout = std::chrono::milliseconds(get_or(options, s::timeout, 10000));
+    retries = get_or(options, s::retries, 2);
+    for (const std::string& b : backends)
+      addresses.push_back(resolve(b));
+  }
+
+  upstream(const upstream&) = delete;
+
+  // Forward the request to an upstream and stream its response. \target replaces the url
+  // and query string of the request if it is not empty.
+  void forward(http_request& request, http_response& response,
+               std::string_view target = std::string_view()) {
+    auto& ctx = request.http_ctx;
+    shard& sh = *impl::thread_local_state<shard*>(thread_key, [this] { return add_shard(); });
+    sh.requests.fetch_add(1, std::memory_order_relaxed);
+
+    std::string_view method = ctx.method();
+    std::string_view body = ctx.read_whole_body();
+    arena_string message = make_request(request, target, body);
+    bool idempotent = method == "GET" or method == "HEAD" or method == "PUT" or
+                      method == "DELETE" or method == "OPTIONS" or method == "TRACE";
+
+    int failed = -1;
+    for (int attempt = 0;; attempt++) {
+      int b = pick(sh, failed);
+      sh.pools[b].outstanding++;
+      exchange_status status = exchange(request, sh, b, message, method == "HEAD");
+      sh.pools[b].outstanding--;
+
+      if (status == done or status == client_closed)
+        return;
+      sh.failures.fetch_add(1, std::memory_order_relaxed);
+      if (status == response_started) {
+        // The client already received a part of the response.
+        ::shutdown(request.fiber.socket_fd, SHUT_RDWR);
+        request.fiber.reactor->closed_fds[request.fiber.socket_fd] = 1;
+        return;
+      }
+      bool may_retry = status == connect_failed or (status == connection_lost and idempotent);
+      if (!may_retry or attempt >= retries) {
+        if (status == timed_out)
+          throw http_error::gateway_timeout("Upstream ", addresses[b].name, " timed out.");
+        throw http_error::bad_gateway("Upstream ", addresses[b].name, " failed.");
+      }
+      sh.retries.fetch_add(1, std::memory_order_relaxed);
+      failed = b;
+    }
+  }
+
+  auto stats() {
+    long long requests = 0, connections = 0, reused = 0, retries = 0, failures = 0;
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto& sh : shards) {
+      requests += sh->requests.load(std::memory_order_relaxed);
+      connections += sh->connections.load(std::memory_order_relaxed);
+      reused += sh->reused.load(std::memory_order_relaxed);
+      retries += sh->retries.load(std::memory_order_relaxed);
+      failures += sh->failures.load(std::memory_order_relaxed);
+    }
+    return mmm(s::requests = requests, s::connections = connections, s::reused = reused,
+               s::retries = retries, s::failures = failures);
+  }
+
+  upstream_balancing balancing;
+  int max_idle_connections;
+  std::chrono::microseconds timeout;
+  int retries;
+
+private:
+  // Bodies smaller than this are copied through the read buffer instead of spliced.
+  static constexpr size_t splice_threshold = 64 * 1024;
+  static constexpr size_t read_buffer_size = 16 * 1024;
+
+  enum exchange_status {
+    done,
+    connect_failed,  // Nothing was sent.
+    connection_lost, // The request may have been sent, no response was received.
+    timed_out,
+    invalid_response,
+    response_started, // The connection failed after the response headers were sent.
+    client_closed
+  };
+
+  struct address {
+    std::string name;
+    sockaddr_storage addr;
+    socklen_t addr_len;
+  };
+
+  struct pool {
+    std::vector<int> idle; // Keep-alive connections, the most recently used last.
+    int outstanding = 0;   // Requests in flight from this thread.
+  };
+
+  // State of one server thread.
+  struct shard {
+    ~shard() {
+      for (auto& p : pools)
+        for (int fd : p.idle)
+          ::close(fd);
+      close_pipe();
+    }
+
+    bool open_pipe() {
+#if __linux__
+      if (pipe_fds[0] == -1 and -1 == ::pipe2(pipe_fds, O_NONBLOCK | O_CLOEXEC))
+        pipe_fds[0] = pipe_fds[1] = -1;
+#endif
+      return pipe_fds[0] != -1;
+    }
+    void close_pipe() {
+      if (pipe_fds[0] != -1) {
+        ::close(pipe_fds[0]);
+        ::close(pipe_fds[1]);
+      }
+      pipe_fds[0] = pipe_fds[1] = -1;
+    }
+
+    std::vector<pool> pools;
+    unsigned next = 0;
+    uint32_t random_state = 2463534242u;
+    int pipe_fds[2] = {-1, -1};
+    std::atomic<long long> requests = 0;
+    std::atomic<long long> connections = 0;
+    std::atomic<long long> reused = 0;
+    std::atomic<long long> retries = 0;
+    std::atomic<long long> failures = 0;
+  };
+
+  // Closes the upstream connection unless it goes back to the pool.
+  struct connection_guard {
+    int fd;
+    ~connection_guard() {
+      if (fd != -1)
+        ::close(fd);
+    }
+  };
+
+  static address resolve(const std::string& name) {
+    size_t colon = name.rfind(':');
+    if (colon == std::string::npos)
+      throw std::runtime_error("upstream: " + name + " is not a host:port address.");
+    std::string host = name.substr(0, colon);
+    std::string port = name.substr(colon + 1);
+
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* result;
+    if (int err = getaddrinfo(host.c_str(), port.c_str(), &hints, &result))
+      throw std::runtime_error("upstream: cannot resolve " + name + ": " + gai_strerror(err));
+    address a;
+    a.name = name;
+    memcpy(&a.addr, result->ai_addr, result->ai_addrlen);
+    a.addr_len = result->ai_addrlen;
+    freeaddrinfo(result);
+    return a;
+  }
+
+  shard* add_shard() {
+    std::lock_guard<std::mutex> lock(mutex);
+    shards.emplace_back(new shard);
+    shards.back()->pools.resize(addresses.size());
+    shards.back()->random_state += shards.size();
+    return shards.back().get();
+  }
+
+  // Choose an upstream, other than \failed if possible.
+  int pick(shard& sh, int failed) {
+    int n = addresses.size();
+    if (n == 1)
+      return 0;
+    int b = 0;
+    switch (balancing) {
+    case upstream_balancing::round_robin:
+      b = sh.next++ % n;
+      break;
+    case upstream_balancing::least_outstanding: {
+      int start = sh.next++ % n;
+      b = -1;
+      for (int i = 0; i < n; i++) {
+        int c = (start + i) % n;
+        if (c != failed and (b == -1 or sh.pools[c].outstanding < sh.pools[b].outstanding))
+          b = c;
+      }
+      break;
+    }
+    case upstream_balancing::power_of_two_choices: {
+      int first = next_random(sh) % n;
+      int second = next_random(sh) % (n - 1);
+      if (second >= first)
+        second++;
+      b = sh.pools[first].outstanding <= sh.pools[second].outstanding ? first : second;
+      break;
+    }
+    }
+    return b == failed ? (b + 1) % n : b;
+  }
+
+  static uint32_t next_random(shard& sh) {
+    uint32_t x = sh.random_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return sh.random_state = x;
+  }
+
+  // Serialize the request to send upstream.
+  arena_string make_request(http_request& request, std::string_view target,
+                            std::string_view body) {
+    auto& ctx = request.http_ctx;
+    if (target.empty()) {
+      std::string_view url = ctx.url();
+      std::string_view query = ctx.get_parameters_string();
+      target = query.size() ? std::string_view(url.data(), query.data() + query.size() - url.data())
+                            : url;
+    }
+
+    arena_string message(request.arena());
+    message.reserve(1024 + body.size());
+    message.append(ctx.method()).append(" ").append(target).append(" HTTP/1.1\r\n");
+    std::string_view forwarded_for;
+    for (int i = 1; i + 1 < int(ctx.header_lines.size()); i++) {
+      std::string_view line(ctx.header_lines[i], ctx.header_lines[i + 1] - ctx.header_lines[i]);
+      std::string_view key = line.substr(0, line.find(':'));
+      if (impl::header_equals(key, "X-Forwarded-For")) {
+        forwarded_for = line.substr(key.size() + 1);
+        while (forwarded_for.size() and forwarded_for[0] == ' ')
+          forwarded_for.remove_prefix(1);
+        while (forwarded_for.size() and isspace(forwarded_for.back()))
+          forwarded_for.remove_suffix(1);
+        continue;
+      }
+      if (impl::is_hop_by_hop_header(key) or impl::header_equals(key, "Content-Length") or
+          impl::header_equals(key, "Expect"))
+        continue;
+      message.append(line);
+    }
+    message.append("X-Forwarded-For: ");
+    if (forwarded_for.size())
+      message.append(forwarded_for).append(", ");
+    message.append(request.ip_address()).append("\r\n");
+    if (body.size() or ctx.method() == "POST" or ctx.method() == "PUT")
+      message.append("Content-Length: ").append(std::to_string(body.size())).append("\r\n");
+    message.append("\r\n").append(body);
+    return message;
+  }
+
+  // An idle connection to upstream \b, or a new one. -1 if the connection fails.
+  int take_connection(shard& sh, int b, impl::upstream_io& io) {
+    auto& idle = sh.pools[b].idle;
+    auto* reactor = io.fiber.reactor;
+    while (!idle.empty()) {
+      int fd = idle.back();
+      idle.pop_back();
+      if (reactor->closed_fds[fd]) { // Closed by the upstream while idle.
+        ::close(fd);
+        continue;
+      }
+      io.fiber.reassign_fd_to_this_fiber(fd);
+      sh.reused.fetch_add(1, std::memory_order_relaxed);
+      return fd;
+    }
+    const address& a = addresses[b];
+    int fd = impl::upstream_connect(io, (const sockaddr*)&a.addr, a.addr_len);
+    if (fd == -1)
+      return -1;
+    sh.connections.fetch_add(1, std::memory_order_relaxed);
+    return fd;
+  }
+
+  // Send the request to upstream \b and stream back its response.
+  exchange_status exchange(http_request& request, shard& sh, int b, std::string_view message,
+                           bool head) {
+    auto& ctx = request.http_ctx;
+    auto& fiber = request.fiber;
+    impl::upstream_io io(fiber, timeout);
+    auto failure = [&](exchange_status status) {
+      return io.timed_out ? timed_out : fiber.is_closed() ? client_closed : status;
+    };
+
+    connection_guard connection{take_connection(sh, b, io)};
+    int fd = connection.fd;
+    if (fd == -1)
+      return failure(connect_failed);
+    if (!io.send_all(fd, message.data(), message.size()))
+      return failure(connection_lost);
+
+    // Read the status line and the headers.
+    char* buf = (char*)request.arena().allocate(read_buffer_size, 1);
+    size_t filled = 0;
+    const char* headers_end = nullptr;
+    while (!headers_end) {
+      if (filled == read_buffer_size)
+        return invalid_response;
+      long n = io.recv_some(fd, buf + filled, read_buffer_size - filled);
+      if (n <= 0)
+        return failure(connection_lost);
+      size_t search_start = filled < 3 ? 0 : filled - 3;
+      filled += n;
+      std::string_view received(buf + search_start, filled - search_start);
+      size_t pos = received.find("\r\n\r\n");
+      if (pos != std::string_view::npos)
+        headers_end = received.data() + pos + 4;
+    }
+
+    std::string_view headers(buf, headers_end - buf);
+    if (headers.size() < 12 or headers.substr(0, 7) != "HTTP/1.")
+      return invalid_response;
+    bool keep_alive = headers[7] == '1';
+    int status = atoi(headers.data() + 9);
+    size_t line_end = headers.find('\r');
+    ctx.set_status(status, headers.substr(9, line_end - 9));
+
+    long long content_length = -1;
+    bool chunked = false;
+    size_t cur = line_end + 2;
+    while (cur + 2 < headers.size()) {
+      size_t end = headers.find("\r\n", cur);
+      std::string_view line = headers.substr(cur, end - cur);
+      cur = end + 2;
+      size_t colon = line.find(':');
+      if (colon == std::string_view::npos)
+        continue;
+      std::string_view key = line.substr(0, colon);
+      std::string_view value = line.substr(colon + 1);
+      while (value.size() and value[0] == ' ')
+        value.remove_prefix(1);
+
+      if (impl::header_equals(key, "Content-Length"))
+        content_length = atoll(std::string(value).c_str());
+      else if (impl::header_equals(key, "Transfer-Encoding"))
+        chunked = value.find("chunked") != std::string_view::npos;
+      else if (impl::header_equals(key, "Connection") and impl::header_equals(value, "close"))
+        keep_alive = false;
+      // Date and Server are set by this server.
+      if (!impl::is_hop_by_hop_header(key) and !impl::header_equals(key, "Content-Length") and
+          !impl::header_equals(key, "Date") and !impl::header_equals(key, "Server"))
+        ctx.set_header(key, value);
+    }
+
+    std::string_view buffered(headers_end, buf + filled - headers_end);
+    bool reusable = keep_alive;
+    if (head or status == 204 or status == 304 or status < 200) {
+      ctx.start_response(content_length > 0 ? content_length : 0);
+      reusable = reusable and buffered.empty();
+    } else if (chunked) {
+      ctx.start_chunked_response();
+      impl::chunked_body_decoder decoder;
+      auto on_data = [&](std::string_view data) { ctx.write_chunk(data); };
+      size_t used = decoder.feed(buffered, on_data);
+      size_t received = buffered.size();
+      while (!decoder.finished()) {
+        if (fiber.is_closed())
+          return client_closed;
+        long n = io.recv_some(fd, buf, read_buffer_size);
+        if (n <= 0)
+          return failure(response_started);
+        used = decoder.feed(std::string_view(buf, n), on_data);
+        received = n;
+      }
+      reusable = reusable and used == received;
+    } else if (content_length >= 0) {
+      ctx.start_response(content_length);
+      size_t first = std::min<size_t>(buffered.size(), content_length);
+      ctx.write_body(buffered.substr(0, first));
+      reusable = reusable and first == buffered.size();
+      size_t remaining = content_length - first;
+#if __linux__
+      if (remaining >= splice_threshold and !fiber.ssl and sh.open_pipe()) {
+        if (!io.splice_all(fd, sh.pipe_fds, remaining)) {
+          sh.close_pipe(); // It may still contain a part of the body.
+          return failure(response_started);
+        }
+        remaining = 0;
+      }
+#endif
+      while (remaining) {
+        long n = io.recv_some(fd, buf, std::min(remaining, read_buffer_size));
+        if (n <= 0)
+          return failure(response_started);
+        if (!fiber.write(buf, n))
+          return client_closed;
+        remaining -= n;
+      }
+    } else {
+      // The body ends when the upstream closes the connection.
+      reusable = false;
+      ctx.start_chunked_response();
+      ctx.write_chunk(buffered);
+      long n;
+      while ((n = io.recv_some(fd, buf, read_buffer_size)) > 0)
+        ctx.write_chunk(std::string_view(buf, n));
+      if (n < 0)
+        return failure(response_started);
+    }
+
+    if (reusable and int(sh.pools[b].idle.size()) < max_idle_connections) {
+      sh.pools[b].idle.push_back(fd);
+      connection.fd = -1;
+    }
+    return done;
+  }
+
+  std::vector<address> addresses;
+  std::mutex mutex; // Protects shards.
+  std::vector<std::unique_ptr<shard>> shards;
+  impl::thread_local_key thread_key; // Finds the shard of the current thread.
+};
+
+} // namespace li
+
+#endif // LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_UPSTREAM_HH
+
+#ifndef LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_ASYNC_HTTP_CLIENT_HH
+#define LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_ASYNC_HTTP_CLIENT_HH
+
+
+
+
+namespace li {
+
+namespace impl {
+
+// Append \s to \out, percent-encoding everything but the unreserved characters.
+inline void url_escape(std::string& out, std::string_view s) {
+  static const char hex[] = "0123456789ABCDEF";
+  for (unsigned char c : s) {
+    if (isalnum(c) or c == '-' or c == '.' or c == '_' or c == '~')
+      out += c;
     else {
-      if constexpr (has_key<decltype(callbacks_)>(s::update_secret_key))
-        callbacks_[s::update_secret_key](new_user[login_field_], new_user[password_field_]);
-      if constexpr (has_key<decltype(callbacks_)>(s::hash_password))
-        new_user[password_field_] =
-            callbacks_[s::hash_password](new_user[login_field_], new_user[password_field_]);
-      users.insert(new_user);
-      return true;
+      out += '%';
+      out += hex[c >> 4];
+      out += hex[c & 15];
+    }
+  }
+}
+
+} // namespace impl
+
+// HTTP/1.1 client running in the fiber of a request. While it waits for the server, the
+// fiber is parked and the other connections of the thread keep being served.
+//
+//   async_http_client users_service(s::timeout = 2000);
+//   api.get("/profile") = [&] (http_request& request, http_response& response) {
+//     auto user = users_service.get(request.fiber, "http://users:8080/user",
+//                                   s::get_parameters = mmm(s::id = 42));
+//     response.write(user.body);
+//   };
+//
+// It takes the same arguments as http_client (s::get_parameters, s::post_parameters,
+// s::json_encoded, s::fetch_headers) and returns the same mmm(s::status, s::body[, s::headers]).
+// Errors throw std::runtime_error. Only http:// urls are supported.
+//
+// Each server thread keeps its own pool of keep-alive connections per host, used without
+// locks. Host names are resolved once per thread on the default offload_pool, numeric
+// addresses are used directly.
+//
+// Options:
+//   s::max_idle_connections: idle connections kept per host and per thread (default 16).
+//   s::timeout: milliseconds without progress before giving up (default 10000). The fiber
+//               waits on the reactor timers.
+struct async_http_client {
+
+  template <typename... O> async_http_client(O... opts) {
+    auto options = mmm(opts...);
+    max_idle_connections = get_or(options, s::max_idle_connections, 16);
+    timeout = std::chrono::milliseconds(get_or(options, s::timeout, 10000));
+  }
+
+  async_http_client(const async_http_client&) = delete;
+
+  template <typename... A>
+  auto operator()(async_fiber_context& fiber, std::string_view method, std::string_view url,
+                  const A&... args) {
+    auto arguments = mmm(args...);
+    constexpr bool fetch_headers = has_key<decltype(arguments)>(s::fetch_headers);
+
+    url_parts u = parse_url(url);
+
+    // Get params
+    std::string target(u.target);
+    bool first = target.find('?') == std::string::npos;
+    li::map(li::get_or(arguments, s::get_parameters, mmm()), [&](auto k, auto v) {
+      target += first ? '?' : '&';
+      target += li::symbol_string(k);
+      target += '=';
+      std::ostringstream value_ss;
+      value_ss << v;
+      impl::url_escape(target, value_ss.str());
+      first = false;
+    });
+
+    // Post params
+    std::string body;
+    std::string_view content_type;
+    if (method == "POST" or method == "PUT") {
+      if (li::has_key(arguments, s::json_encoded)) {
+        body = li::json_encode(li::get_or(arguments, s::post_parameters, mmm()));
+        content_type = "application/json";
+      } else {
+        first = true;
+        li::map(li::get_or(arguments, s::post_parameters, mmm()), [&](auto k, auto v) {
+          if (!first)
+            body += '&';
+          body += li::symbol_string(k);
+          body += '=';
+          std::ostringstream value_ss;
+          value_ss << v;
+          impl::url_escape(body, value_ss.str());
+          first = false;
+        });
+        content_type = "application/x-www-form-urlencoded";
+      }
+    }
+
+    std::string message;
+    message.reserve(256 + target.size() + body.size());
+    message.append(method).append(" ").append(target).append(" HTTP/1.1\r\n");
+    message.append("Host: ").append(u.host_port).append("\r\n");
+    if (content_type.size())
+      message.append("Content-Type: ").append(content_type).append("\r\n");
+    if (body.size() or content_type.size())
+      message.append("Content-Length: ").append(std::to_string(body.size())).append("\r\n");
+    message.append("\r\n").append(body);
+
+    std::string response_body;
+    std::unordered_map<std::string, std::string> response_headers;
+    long status = send(fiber, u, message, method == "HEAD", response_body,
+                       fetch_headers ? &response_headers : nullptr);
+
+    if constexpr (fetch_headers)
+      return mmm(s::status = status, s::body = std::move(response_body),
+                 s::headers = std::move(response_headers));
+    else
+      return mmm(s::status = status, s::body = std::move(response_body));
+  }
+
+  template <typename... P>
+  auto get(async_fiber_context& fiber, std::string_view url, const P&... params) {
+    return (*this)(fiber, "GET", url, params...);
+  }
+  template <typename... P>
+  auto put(async_fiber_context& fiber, std::string_view url, const P&... params) {
+    return (*this)(fiber, "PUT", url, params...);
+  }
+  template <typename... P>
+  auto post(async_fiber_context& fiber, std::string_view url, const P&... params) {
+    return (*this)(fiber, "POST", url, params...);
+  }
+  template <typename... P>
+  auto delete_(async_fiber_context& fiber, std::string_view url, const P&... params) {
+    return (*this)(fiber, "DELETE", url, params...);
+  }
+
+  auto stats() {
+    long long requests = 0, connections = 0, reused = 0;
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto& sh : shards) {
+      requests += sh->requests.load(std::memory_order_relaxed);
+      connections += sh->connections.load(std::memory_order_relaxed);
+      reused += sh->reused.load(std::memory_order_relaxed);
     }
+    return mmm(s::requests = requests, s::connections = connections, s::reused = reused);
   }
 
-  S& sessions_;
-  U& users_;
-  L login_field_;
-  P password_field_;
-  decltype(mmm(std::declval<CB>()...)) callbacks_;
-};
+  int max_idle_connections;
+  std::chrono::microseconds timeout;
 
-template <typename... A> http_api http_authentication_api(http_authentication<A...>& auth) {
+private:
+  static constexpr size_t read_buffer_size = 16 * 1024;
+  static constexpr size_t max_headers_size = 64 * 1024;
 
-  http_api api;
+  enum exchange_status { done, connection_lost, invalid_response };
 
-  api.post("/login") = [&](http_request& request, http_response& response) {
-    if (!auth.login(request, response))
-      throw http_error::unauthorized("Bad login.");
+  struct url_parts {
+    std::string host;
+    std::string port;
+    std::string host_port; // As written in the url, the key of the connection pools.
+    std::string_view target;
   };
 
-  api.get("/logout") = [&](http_request& request, http_response& response) {
-    auth.logout(request, response);
+  struct pool {
+    std::vector<int> idle; // Keep-alive connections, the most recently used last.
+    sockaddr_storage addr;
+    socklen_t addr_len = 0; // 0 until the host is resolved.
   };
 
-  api.get("/signup") = [&](http_request& request, http_response& response) {
-    if (!auth.signup(request, response))
-      throw http_error::bad_request("User already exists.");
+  // State of one server thread.
+  struct shard {
+    ~shard() {
+      for (auto& p : pools)
+        for (int fd : p.second.idle)
+          ::close(fd);
+    }
+
+    std::unordered_map<std::string, pool> pools;
+    std::atomic<long long> requests = 0;
+    std::atomic<long long> connections = 0;
+    std::atomic<long long> reused = 0;
   };
 
-  return api;
-}
+  // Closes the connection unless it goes back to the pool.
+  struct connection_guard {
+    int fd;
+    ~connection_guard() {
+      if (fd != -1)
+        ::close(fd);
+    }
+  };
 
-// Disable this for now. (No time to install nettle on windows.)
-// #include <nettle/sha3.h>
-// inline std::string hash_sha3_512(const std::string& str)
-// {
-//   struct sha3_512_ctx ctx;
-//   sha3_512_init(&ctx);
-//   sha3_512_update(&ctx, str.size(), (const uint8_t*) str.data());
-//   uint8_t h[SHA3_512_DIGEST_SIZE];
-//   sha3_512_digest(&ctx, sizeof(h), h);
-//   return std::string((const char*)h, sizeof(h));
-// }
+  template <typename... T> [[noreturn]] static void error(const T&... parts) {
+    std::ostringstream errss;
+    errss << "async_http_client: ";
+    (errss << ... << parts);
+    throw std::runtime_error(errss.str());
+  }
+
+  static url_parts parse_url(std::string_view url) {
+    if (url.substr(0, 7) != "http://")
+      error("only http:// urls are supported: ", url);
+    url.remove_prefix(7);
+    size_t target_start = url.find_first_of("/?");
+    url_parts u;
+    u.host_port = std::string(url.substr(0, target_start));
+    u.target = target_start == std::string_view::npos ? std::string_view("/")
+                                                       : url.substr(target_start);
+    if (u.target[0] == '?')
+      error("missing path in ", url);
+
+    std::string_view authority = u.host_port;
+    size_t host_end = authority[0] == '[' ? authority.find(']') : authority.find(':');
+    if (authority[0] == '[') { // [ipv6]:port
+      if (host_end == std::string_view::npos)
+        error("invalid host in ", url);
+      u.host = std::string(authority.substr(1, host_end - 1));
+      host_end = authority.find(':', host_end);
+    } else
+      u.host = std::string(authority.substr(0, host_end));
+    u.port = host_end == std::string_view::npos ? "80"
+                                                : std::string(authority.substr(host_end + 1));
+    if (u.host.empty())
+      error("invalid host in ", url);
+    return u;
+  }
+
+  shard* add_shard() {
+    std::lock_guard<std::mutex> lock(mutex);
+    shards.emplace_back(new shard);
+    return shards.back().get();
+  }
+
+  static void resolve(async_fiber_context& fiber, const url_parts& u, pool& p) {
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICHOST;
+    addrinfo* result = nullptr;
+    int err = getaddrinfo(u.host.c_str(), u.port.c_str(), &hints, &result);
+    if (err == EAI_NONAME) {
+      // Name lookups may block, run them on the offload pool.
+      hints.ai_flags = 0;
+      err = await_blocking(fiber, [&] {
+        return getaddrinfo(u.host.c_str(), u.port.c_str(), &hints, &result);
+      });
+    }
+    if (err)
+      error("cannot resolve ", u.host_port, ": ", gai_strerror(err));
+    memcpy(&p.addr, result->ai_addr, result->ai_addrlen);
+    p.addr_len = result->ai_addrlen;
+    freeaddrinfo(result);
+  }
+
+  // An idle connection of \p, or a new one if \fresh or if there is none. -1 on failure.
+  int take_connection(shard& sh, pool& p, impl::upstream_io& io, bool fresh, bool& reused) {
+    auto* reactor = io.fiber.reactor;
+    while (!fresh and !p.idle.empty()) {
+      int fd = p.idle.back();
+      p.idle.pop_back();
+      if (reactor->closed_fds[fd]) { // Closed by the server while idle.
+        ::close(fd);
+        continue;
+      }
+      io.fiber.reassign_fd_to_this_fiber(fd);
+      sh.reused.fetch_add(1, std::memory_order_relaxed);
+      reused = true;
+      return fd;
+    }
+    reused = false;
+    int fd = impl::upstream_connect(io, (const sockaddr*)&p.addr, p.addr_len);
+    if (fd != -1)
+      sh.connections.fetch_add(1, std::memory_order_relaxed);
+    return fd;
+  }
+
+  // Send \message and read the response. Return the status code.
+  long send(async_fiber_context& fiber, const url_parts& u, std::string_view message, bool head,
+            std::string& body, std::unordered_map<std::string, std::string>* headers) {
+    shard& sh = *impl::thread_local_state<shard*>(thread_key, [this] { return add_shard(); });
+    sh.requests.fetch_add(1, std::memory_order_relaxed);
+    pool& p = sh.pools[u.host_port];
+    if (!p.addr_len)
+      resolve(fiber, u, p);
+
+    for (int attempt = 0;; attempt++) {
+      impl::upstream_io io(fiber, timeout);
+      bool reused = false;
+      connection_guard connection{take_connection(sh, p, io, attempt > 0, reused)};
+      if (connection.fd == -1) {
+        if (io.timed_out)
+          error(u.host_port, " timed out.");
+        if (fiber.is_closed())
+          error("request to ", u.host_port, " cancelled: the client closed its connection.");
+        p.addr_len = 0; // Resolve the host again at the next request.
+        error("cannot connect to ", u.host_port, ".");
+      }
 
-} // namespace li
+      long status = 0;
+      bool keep_alive = false;
+      size_t received = 0;
+      exchange_status result = exchange(io, connection.fd, message, head, status, body, headers,
+                                        keep_alive, received);
+      if (result == done) {
+        if (keep_alive and int(p.idle.size()) < max_idle_connections) {
+          p.idle.push_back(connection.fd);
+          connection.fd = -1;
+        }
+        return status;
+      }
+      if (io.timed_out)
+        error(u.host_port, " timed out.");
+      if (fiber.is_closed())
+        error("request to ", u.host_port, " cancelled: the client closed its connection.");
+      if (result == invalid_response)
+        error("invalid response from ", u.host_port, ".");
+      // The server may have closed the idle connection while the request was sent.
+      if (!(reused and received == 0 and attempt == 0))
+        error("connection to ", u.host_port, " lost.");
+      body.clear();
+      if (headers)
+        headers->clear();
+    }
+  }
 
-#endif // LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_HTTP_AUTHENTICATION_HH
+  exchange_status exchange(impl::upstream_io& io, int fd, std::string_view message, bool head,
+                           long& status, std::string& body,
+                           std::unordered_map<std::string, std::string>* headers,
+                           bool& keep_alive, size_t& received) {
+    if (!io.send_all(fd, message.data(), message.size()))
+      return connection_lost;
+
+    // Read the status line and the headers.
+    std::string buf(read_buffer_size, '\0');
+    size_t filled = 0;
+    size_t headers_size = 0;
+    while (!headers_size) {
+      if (filled == buf.size()) {
+        if (buf.size() >= max_headers_size)
+          return invalid_response;
+        buf.resize(buf.size() * 2);
+      }
+      long n = io.recv_some(fd, &buf[filled], buf.size() - filled);
+      if (n <= 0)
+        return connection_lost;
+      received += n;
+      size_t search_start = filled < 3 ? 0 : filled - 3;
+      filled += n;
+      size_t pos = std::string_view(buf.data(), filled).find("\r\n\r\n", search_start);
+      if (pos != std::string_view::npos)
+        headers_size = pos + 4;
+    }
 
-//#include <li/http_server/mhd.hh>
-#ifndef LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_SERVE_DIRECTORY_HH
-#define LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_SERVE_DIRECTORY_HH
+    std::string_view response_headers(buf.data(), headers_size);
+    if (response_headers.size() < 12 or response_headers.substr(0, 7) != "HTTP/1.")
+      return invalid_response;
+    keep_alive = response_headers[7] == '1';
+    status = atoi(response_headers.data() + 9);
+
+    long long content_length = -1;
+    bool chunked = false;
+    size_t cur = response_headers.find("\r\n") + 2;
+    while (cur + 2 < response_headers.size()) {
+      size_t end = response_headers.find("\r\n", cur);
+      std::string_view line = response_headers.substr(cur, end - cur);
+      cur = end + 2;
+      size_t colon = line.find(':');
+      if (colon == std::string_view::npos)
+        continue;
+      std::string_view key = line.substr(0, colon);
+      std::string_view value = line.substr(colon + 1);
+      while (value.size() and value[0] == ' ')
+        value.remove_prefix(1);
+      while (value.size() and isspace(value.back()))
+        value.remove_suffix(1);
+
+      if (impl::header_equals(key, "Content-Length"))
+        content_length = atoll(std::string(value).c_str());
+      else if (impl::header_equals(key, "Transfer-Encoding"))
+        chunked = value.find("chunked") != std::string_view::npos;
+      else if (impl::header_equals(key, "Connection"))
+        keep_alive = impl::header_equals(value, "keep-alive") or
+                     (keep_alive and !impl::header_equals(value, "close"));
+      if (headers)
+        (*headers)[std::string(key)] = std::string(value);
+    }
 
+    std::string_view buffered(buf.data() + headers_size, filled - headers_size);
+    if (head or status == 204 or status == 304 or status < 200) {
+      keep_alive = keep_alive and buffered.empty();
+    } else if (chunked) {
+      impl::chunked_body_decoder decoder;
+      auto on_data = [&](std::string_view data) { body.append(data); };
+      size_t used = decoder.feed(buffered, on_data);
+      size_t last_read = buffered.size();
+      while (!decoder.finished()) {
+        long n = io.recv_some(fd, &buf[0], buf.size());
+        if (n <= 0)
+          return connection_lost;
+        used = decoder.feed(std::string_view(buf.data(), n), on_data);
+        last_read = n;
+      }
+      keep_alive = keep_alive and used == last_read;
+    } else if (content_length >= 0) {
+      size_t first = std::min<size_t>(buffered.size(), content_length);
+      keep_alive = keep_alive and first == buffered.size();
+      body.resize(content_length);
+      memcpy(&body[0], buffered.data(), first);
+      for (size_t pos = first; pos < size_t(content_length);) {
+        long n = io.recv_some(fd, &body[pos], content_length - pos);
+        if (n <= 0)
+          return connection_lost;
+        pos += n;
+      }
+    } else {
+      // The body ends when the server closes the connection.
+      keep_alive = false;
+      body.append(buffered);
+      long n;
+      while ((n = io.recv_some(fd, &buf[0], buf.size())) > 0)
+        body.append(buf.data(), n);
+      if (n < 0)
+        return connection_lost;
+    }
+    return done;
+  }
 
+  std::mutex mutex; // Protects shards.
+  std::vector<std::unique_ptr<shard>> shards;
+  impl::thread_local_key thread_key; // Finds the shard of the current thread.
+};
 
+// The client shared by the whole process.
+inline async_http_client& default_async_http_client() {
+  static async_http_client client;
+  return client;
+}
 
-namespace li {
+// Requests from the fiber of a handler, with the default async_http_client.
+template <typename... P>
+auto http_get(async_fiber_context& fiber, std::string_view url, const P&... params) {
+  return default_async_http_client().get(fiber, url, params...);
+}
+template <typename... P>
+auto http_post(async_fiber_context& fiber, std::string_view url, const P&... params) {
+  return default_async_http_client().post(fiber, url, params...);
+}
+template <typename... P>
+auto http_put(async_fiber_context& fiber, std::string_view url, const P&... params) {
+  return default_async_http_client().put(fiber, url, params...);
+}
+template <typename... P>
+auto http_delete(async_fiber_context& fiber, std::string_view url, const P&... params) {
+  return default_async_http_client().delete_(fiber, url, params...);
+}
 
-namespace impl {
-  inline bool is_regular_file(const std::string& path) {
-    struct stat path_stat;
-    if (-1 == stat(path.c_str(), &path_stat))
-      return false;
-    return S_ISREG(path_stat.st_mode);
-  }
+} // namespace li
 
-  inline bool is_directory(const std::string& path) {
-    struct stat path_stat;
-    if (-1 == stat(path.c_str(), &path_stat))
-      return false;
-    return S_ISDIR(path_stat.st_mode);
-  }
+#endif // LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_ASYNC_HTTP_CLIENT_HH
 
-  inline bool starts_with(const char *pre, const char *str)
-  {
-      size_t lenpre = strlen(pre),
-            lenstr = strlen(str);
-      return lenstr < lenpre ? false : memcmp(pre, str, lenpre) == 0;
-  }
-} // namespace impl
+#ifndef LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_HTTP_INJECTOR_HH
+#define LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_HTTP_INJECTOR_HH
 
-inline auto serve_file(const std::string& root, std::string_view path, http_response& response) {
-  static char dot = '.', slash = '/';
 
-  // remove first slash if needed.
-  if (!path.empty() && path[0] == slash) {
-    path = std::string_view(path.data() + 1, path.size() - 1); // erase(0, 1);
-  }
 
-  // Directory listing not supported.
-  std::string full_path(root + std::string(path));
-  if (path.empty() || !impl::is_regular_file(full_path)) {
-    throw http_error::not_found("file not found.");
-  }
-  
-  // Check if file exists by real file path.
-  char realpath_out[PATH_MAX]{0};
-  if (nullptr == realpath(full_path.c_str(), realpath_out))
-    throw http_error::not_found("file not found.");
 
-  // Check that path is within the root directory.
-  if (!impl::starts_with(root.c_str(), realpath_out))
-    throw http_error::not_found("Access denied.");
+namespace li {
 
-  response.write_static_file(full_path);
-};
+namespace impl {
+// Calls to operator new in this thread. Only counted when the program replaces operator
+// new to increment it, see http_injector.
+inline thread_local long long allocation_count = 0;
+} // namespace impl
 
-inline auto serve_directory(const std::string& root) {
-  // extract root realpath. 
-  char realpath_out[PATH_MAX]{0};
-  if (nullptr == realpath(root.c_str(), realpath_out))
-    throw std::runtime_error(std::string("serve_directory error: Directory ") + root + " does not exists.");
+// Run raw requests through make_http_processor and an api without sockets: the connection
+// is a fiber reading from and writing to memory. Parsing, routing, handlers and response
+// formatting are the ones of http_serve, with zero syscalls.
+//
+//   http_injector inject(api);
+//   std::string_view response = inject("GET /hello HTTP/1.1\r\n\r\n");
+//
+// Handlers run on the calling thread. They can yield and park, the injector resumes them
+// right away, but they cannot wait for other file descriptors: async sql connections,
+// async_http_client, upstream and spawned fibers need http_serve.
+//
+// To count the allocations of a call, link a replacement of the global operator new that
+// increments impl::allocation_count, like tests/count_allocations.cc.
+struct http_injector {
 
-  // Check if it is a directory.
-  if (!impl::is_directory(realpath_out))
-  {
-    throw std::runtime_error(std::string("serve_directory error: ") + root + " is not a directory.");
-  }
+  typedef boost::context::continuation continuation;
 
-  // Ensure the root ends with a /
-  std::string real_root(realpath_out);
-  if (real_root.back() != '/')
-  {
-    real_root.push_back('/');
+  inline http_injector(api<http_request, http_response> api) {
+    api.freeze();
+    // The Date header is set once, http_serve updates it every second.
+    http_async_impl::http_top_header.tick();
+    processor_ = http_async_impl::make_http_processor(http_async_impl::make_api_handler(api));
+    reactor_.epoll_fd = -1;
+    reactor_.closed_fds.resize(1);
+    reactor_.parked_fibers.resize(1);
+    sockaddr_in peer{};
+    peer.sin_family = AF_INET;
+    peer.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    memcpy(&peer_, &peer, sizeof(peer));
+  }
+
+  // Process \input on a new connection: one request or pipelined requests. Bodies need a
+  // Content-Length: the server does not detect Transfer-Encoding: chunked request bodies
+  // (it looks at the Content-Type). The server reads at most \read_size bytes at a time
+  // (0: all the input at once). Return the bytes written by the server, valid until the
+  // next call.
+  inline std::string_view operator()(std::string_view input, int read_size = 0) {
+    socket_.input = input;
+    socket_.read_size = read_size;
+    socket_.output.clear();
+    long long allocations_start = impl::allocation_count;
+
+    continuation fiber =
+        boost::context::callcc(std::allocator_arg, stack_, [this](continuation&& sink) {
+          async_fiber_context ctx(&reactor_, std::move(sink), 0, 0, peer_);
+          ctx.memory = &socket_;
+          processor_(ctx);
+          return std::move(ctx.sink);
+        });
+    while (fiber)
+      fiber = fiber.resume();
+
+    // Timers of park_until are not used: parked fibers are resumed right away.
+    reactor_.timers = decltype(reactor_.timers)();
+    allocations_ = impl::allocation_count - allocations_start;
+    return socket_.output;
   }
 
-  http_api api;
-  api.get("/{{path...}}") = [real_root](http_request& request, http_response& response) {
-    auto path = request.url_parameters(s::path = std::string_view()).path;
-    return serve_file(real_root, path, response);
-  };
-  return api;
-}
+  // Calls to operator new during the last call. 0 when they are not counted.
+  inline long long allocations() const { return allocations_; }
+
+private:
+  std::function<void(async_fiber_context&)> processor_;
+  async_reactor reactor_;
+  boost::context::pooled_fixedsize_stack stack_;
+  memory_socket socket_;
+  sockaddr peer_;
+  long long allocations_ = 0;
+};
 
 } // namespace li
 
-#endif // LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_SERVE_DIRECTORY_HH
+#endif // LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_HTTP_INJECTOR_HH
 
 #ifndef LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_SQL_CRUD_API_HH
 #define LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_SQL_CRUD_API_HH
@@ -10247,34 +15745,21 @@ auto sql_crud_api(sql_orm_schema<A, B, C>& orm_schema) {
 
 namespace li {
 
+// Output buffer starting in a stack array of CHUNK_SIZE bytes and growing on the heap.
 template <int CHUNK_SIZE = 2000>
 struct growing_output_buffer {
 
-  growing_output_buffer() :
-    buffer_(sbo_, CHUNK_SIZE, [this] (const char* s, int size) {
-      // append s to the growing buffer.
-      int old_growing_size = growing_.size();
-      growing_.resize(growing_.size() + size);
-      memcpy(growing_.data() + old_growing_size, s, size);
-    }) {
-  }
+  growing_output_buffer() : buffer_(sbo_, CHUNK_SIZE) { buffer_.set_segment_chain(true); }
 
-  void reset() { growing_.clear(); buffer_.reset(); }
-  std::size_t size() { return buffer_.size() + growing_.size(); }
+  void reset() { buffer_.reset(); }
+  std::size_t size() { return buffer_.size(); }
 
-  std::string_view to_string_view() {
-    if (growing_.size() == 0) return buffer_.to_string_view();
-    else {
-      buffer_.flush();
-      return std::string_view(growing_);
-    }
-  }
+  std::string_view to_string_view() { return buffer_.to_string_view(); }
 
   template <typename T>
   growing_output_buffer& operator<<(T&& s) { buffer_ << s; return *this; }
 
   char sbo_[CHUNK_SIZE];
-  std::string growing_;
   output_buffer buffer_;
 };
 
@@ -10288,6 +15773,7 @@ struct growing_output_buffer {
 #define LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_HTTP_BENCHMARK_HH
 
 
+
 #ifndef LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_TIMER_HH
 #define LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_TIMER_HH
 
@@ -10514,6 +16000,485 @@ inline float http_benchmark(const std::vector<int>& sockets, int NTHREADS, int d
   return (1000. * nmessages / global_timer.ms());
 }
 
+// Histogram of positive integers with a fixed relative precision, with the layout of
+// HdrHistogram: values are grouped in buckets of power of two ranges, each split in
+// linear sub-buckets. With 3 significant digits, the values are stored with an error
+// below 0.1%, from 1 to \highest_value, in (log2(highest_value) - 10) * 1024 counters.
+struct hdr_histogram {
+
+  hdr_histogram(int64_t highest_value = 3600LL * 1000 * 1000 * 1000, int significant_digits = 3) {
+    int64_t largest_single_unit = 2 * int64_t(std::pow(10, significant_digits));
+    sub_bucket_half_count_magnitude = int(std::ceil(std::log2(double(largest_single_unit)))) - 1;
+    sub_bucket_half_count = 1 << sub_bucket_half_count_magnitude;
+    sub_bucket_count = 2 * sub_bucket_half_count;
+    int buckets = 1;
+    for (int64_t smallest_untrackable = sub_bucket_count; smallest_untrackable <= highest_value;
+         smallest_untrackable <<= 1)
+      buckets++;
+    counts.resize((buckets + 1) * sub_bucket_half_count, 0);
+    highest_trackable = highest_value;
+  }
+
+  // Values above the highest trackable value are clamped.
+  void record(int64_t value, int64_t count = 1) {
+    value = std::clamp<int64_t>(value, 0, highest_trackable);
+    counts[counts_index(value)] += count;
+    total += count;
+    sum += double(value) * count;
+    min_value = std::min(min_value, value);
+    max_value = std::max(max_value, value);
+  }
+
+  // Record \value measured by a closed-loop client sending a request every
+  // \expected_interval, and the requests it could not send while it was waiting
+  // (coordinated omission correction).
+  void record_corrected(int64_t value, int64_t expected_interval) {
+    record(value);
+    if (expected_interval <= 0)
+      return;
+    for (int64_t missed = value - expected_interval; missed >= expected_interval;
+         missed -= expected_interval)
+      record(missed);
+  }
+
+  void add(const hdr_histogram& other) {
+    for (size_t i = 0; i < other.counts.size(); i++)
+      if (other.counts[i])
+        record(value_from_index(i), other.counts[i]);
+  }
+
+  // Value below which \percentile percents of the recorded values are.
+  int64_t value_at_percentile(double percentile) const {
+    int64_t target = std::max<int64_t>(1, int64_t(std::ceil(percentile / 100 * total)));
+    int64_t seen = 0;
+    for (size_t i = 0; i < counts.size(); i++) {
+      seen += counts[i];
+      if (seen >= target)
+        return std::min(max_value, highest_equivalent_value(value_from_index(i)));
+    }
+    return max_value;
+  }
+
+  int64_t count() const { return total; }
+  int64_t min() const { return total ? min_value : 0; }
+  int64_t max() const { return max_value; }
+  double mean() const { return total ? sum / total : 0; }
+
+private:
+  int bucket_index(int64_t value) const {
+    int pow2_ceiling = 64 - __builtin_clzll(uint64_t(value) | (sub_bucket_count - 1));
+    return pow2_ceiling - (sub_bucket_half_count_magnitude + 1);
+  }
+
+  size_t counts_index(int64_t value) const {
+    int bucket = bucket_index(value);
+    int sub_bucket = int(value >> bucket);
+    return (size_t(bucket + 1) << sub_bucket_half_count_magnitude) + sub_bucket -
+           sub_bucket_half_count;
+  }
+
+  int64_t value_from_index(size_t index) const {
+    int bucket = int(index >> sub_bucket_half_count_magnitude) - 1;
+    int sub_bucket = int(index & (sub_bucket_half_count - 1)) + sub_bucket_half_count;
+    if (bucket < 0) {
+      sub_bucket -= sub_bucket_half_count;
+      bucket = 0;
+    }
+    return int64_t(sub_bucket) << bucket;
+  }
+
+  int64_t highest_equivalent_value(int64_t value) const {
+    int bucket = bucket_index(value);
+    int sub_bucket = int(value >> bucket);
+    int64_t range = int64_t(1) << (bucket + (sub_bucket >= sub_bucket_count ? 1 : 0));
+    return (int64_t(sub_bucket) << bucket) + range - 1;
+  }
+
+  int sub_bucket_half_count_magnitude;
+  int sub_bucket_half_count;
+  int sub_bucket_count;
+  int64_t highest_trackable;
+  std::vector<int64_t> counts;
+  int64_t total = 0;
+  double sum = 0;
+  int64_t min_value = INT64_MAX;
+  int64_t max_value = 0;
+};
+
+// One request sent by http_benchmark_open_loop. Times are in nanoseconds since the start.
+struct http_benchmark_record {
+  int request;       // Index in s::requests.
+  int64_t scheduled; // Send time given by the arrival schedule.
+  int64_t sent;
+  int64_t completed; // -1 if no response was received.
+  int status;
+};
+
+struct http_benchmark_result {
+  hdr_histogram latency;                   // Nanoseconds, from the scheduled send time.
+  std::vector<hdr_histogram> latency_per_request; // One per request template.
+  long long scheduled = 0;
+  long long completed = 0;
+  long long errors = 0;      // Requests without response: connection lost or still pending.
+  long long bad_status = 0;  // Responses with a status >= 400.
+  double seconds = 0;        // Duration of the schedule.
+  std::vector<http_benchmark_record> records; // Only with s::record_requests.
+
+  // Print the latency percentiles in microseconds, per request template and in total.
+  void print(const std::vector<std::string>& names = {}, FILE* out = stdout) const {
+    fprintf(out, "%-24s %10s %9s %9s %9s %9s\n", "request", "count", "p50", "p99", "p999", "max");
+    auto line = [&](const std::string& name, const hdr_histogram& h) {
+      fprintf(out, "%-24s %10lld %9.1f %9.1f %9.1f %9.1f\n", name.c_str(), (long long)h.count(),
+              h.value_at_percentile(50) / 1e3, h.value_at_percentile(99) / 1e3,
+              h.value_at_percentile(99.9) / 1e3, h.max() / 1e3);
+    };
+    if (latency_per_request.size() > 1)
+      for (size_t i = 0; i < latency_per_request.size(); i++)
+        line(i < names.size() ? names[i] : "#" + std::to_string(i), latency_per_request[i]);
+    line("all", latency);
+    fprintf(out, "%.0f requests/s, %lld errors, %lld responses >= 400\n", completed / seconds,
+            errors, bad_status);
+  }
+};
+
+namespace http_benchmark_impl {
+
+inline int connect_blocking(const sockaddr_in& server) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  if (connect(fd, (const sockaddr*)&server, sizeof(server))) {
+    close(fd);
+    return -1;
+  }
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+  return fd;
+}
+
+// Incremental parser of the responses of a connection.
+struct response_reader {
+
+  // Parse the responses in \buffer, calling \on_response(status) for each complete one.
+  // \no_body() tells if the next response has no body (response to HEAD).
+  template <typename N, typename F> void feed(std::string& buffer, N no_body, F on_response) {
+    size_t pos = 0;
+    while (pos < buffer.size()) {
+      if (!in_body) {
+        size_t end = buffer.find("\r\n\r\n", pos);
+        if (end == std::string::npos)
+          break;
+        std::string_view headers(buffer.data() + pos, end + 4 - pos);
+        pos = end + 4;
+        status = headers.size() > 12 ? atoi(headers.data() + 9) : 0;
+        remaining = 0;
+        chunked = false;
+        size_t cur = headers.find("\r\n") + 2;
+        while (cur < headers.size()) {
+          size_t line_end = headers.find("\r\n", cur);
+          std::string_view line = headers.substr(cur, line_end - cur);
+          cur = line_end + 2;
+          size_t colon = line.find(':');
+          if (colon == std::string_view::npos)
+            continue;
+          std::string_view key = line.substr(0, colon);
+          if (impl::header_equals(key, "Content-Length"))
+            remaining = atoll(line.data() + colon + 1);
+          else if (impl::header_equals(key, "Transfer-Encoding"))
+            chunked = line.find("chunked") != std::string_view::npos;
+        }
+        if (no_body() or status == 204 or status == 304 or status < 200)
+          remaining = 0, chunked = false;
+        decoder = impl::chunked_body_decoder();
+        in_body = true;
+      }
+      if (chunked) {
+        pos += decoder.feed(std::string_view(buffer.data() + pos, buffer.size() - pos),
+                            [](std::string_view) {});
+        if (!decoder.finished())
+          break;
+      } else {
+        size_t n = std::min<size_t>(remaining, buffer.size() - pos);
+        pos += n;
+        remaining -= n;
+        if (remaining)
+          break;
+      }
+      in_body = false;
+      on_response(status);
+    }
+    buffer.erase(0, pos);
+  }
+
+  bool in_body = false;
+  bool chunked = false;
+  int status = 0;
+  long long remaining = 0;
+  impl::chunked_body_decoder decoder;
+};
+
+} // namespace http_benchmark_impl
+
+// Open-loop load generator: requests are sent on a fixed schedule, whatever the response
+// times of the server, like independent clients would do. Latencies are measured from the
+// scheduled send time, so a request waiting behind a slow response also counts the wait
+// (no coordinated omission).
+//
+//   auto result = http_benchmark_open_loop(8080, s::rate = 20000, s::duration = 10000,
+//                                          s::connections = 64, s::poisson,
+//                                          s::requests = std::vector<std::string>{
+//                                            "GET /a HTTP/1.1\r\nHost: x\r\n\r\n",
+//                                            "GET /b HTTP/1.1\r\nHost: x\r\n\r\n"},
+//                                          s::weights = std::vector<double>{9, 1});
+//   result.print({"/a", "/b"});
+//
+// Options:
+//   s::rate: requests per second (default 1000).
+//   s::duration: length of the schedule in milliseconds (default 5000).
+//   s::connections: keep-alive connections (default 10), opened before the schedule starts.
+//   s::nthreads: client threads (default 1), each one sends rate / nthreads requests per
+//                second on connections / nthreads connections.
+//   s::poisson: exponential intervals between requests. Default: constant interval.
+//   s::requests: raw request templates (default: GET /). s::weights: their frequencies.
+//   s::pipelined: send each request as soon as it is scheduled, on the next connection.
+//                 Default: at most one request in flight per connection, the others wait
+//                 for a free connection.
+//   s::record_requests: fill result.records with the timestamps of every request.
+//   s::host: ipv4 address of the server (default 127.0.0.1).
+template <typename... O> http_benchmark_result http_benchmark_open_loop(int port, O... opts) {
+  typedef std::chrono::steady_clock clock;
+  using namespace http_benchmark_impl;
+
+  auto options = mmm(opts...);
+  double rate = get_or(options, s::rate, 1000);
+  int duration_ms = get_or(options, s::duration, 5000);
+  int nconnections = get_or(options, s::connections, 10);
+  int nthreads = std::max(1, std::min<int>(get_or(options, s::nthreads, 1), nconnections));
+  bool poisson = has_key(options, s::poisson);
+  bool pipelined = has_key(options, s::pipelined);
+  bool record_requests = has_key(options, s::record_requests);
+  std::vector<std::string> requests =
+      get_or(options, s::requests, std::vector<std::string>{"GET / HTTP/1.1\r\n\r\n"});
+  std::vector<double> weights =
+      get_or(options, s::weights, std::vector<double>(requests.size(), 1.));
+  std::string host = get_or(options, s::host, std::string("127.0.0.1"));
+
+  sockaddr_in server;
+  memset(&server, 0, sizeof(server));
+  server.sin_family = AF_INET;
+  server.sin_addr.s_addr = inet_addr(host.c_str());
+  server.sin_port = htons(port);
+
+  std::vector<bool> head(requests.size());
+  for (size_t i = 0; i < requests.size(); i++)
+    head[i] = requests[i].compare(0, 5, "HEAD ") == 0;
+
+  http_benchmark_result result;
+  result.latency_per_request.resize(requests.size());
+  result.seconds = duration_ms / 1000.;
+  std::mutex result_mutex;
+
+  auto start = clock::now() + std::chrono::milliseconds(100);
+  auto end = start + std::chrono::milliseconds(duration_ms);
+  auto drain_deadline = end + std::chrono::seconds(2);
+  auto since_start = [&](clock::time_point t) {
+    return int64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(t - start).count());
+  };
+
+  auto client = [&](int thread_id) {
+    struct pending {
+      int request;
+      clock::time_point scheduled;
+      clock::time_point sent;
+    };
+    struct connection {
+      int fd = -1;
+      std::string input;
+      std::string output;
+      std::deque<pending> in_flight;
+      response_reader reader;
+    };
+
+    int first = thread_id * nconnections / nthreads;
+    int last = (thread_id + 1) * nconnections / nthreads;
+    std::vector<connection> connections(last - first);
+    int epoll_fd = epoll_create1(0);
+    auto open = [&](int i) {
+      connection& c = connections[i];
+      c = connection();
+      c.fd = connect_blocking(server);
+      if (c.fd < 0)
+        return false;
+      epoll_event event;
+      event.data.u32 = i;
+      event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+      ::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c.fd, &event);
+      return true;
+    };
+    for (size_t i = 0; i < connections.size(); i++)
+      if (!open(i))
+        http_benchmark_impl::error("Cannot connect to server");
+
+    std::mt19937_64 random(thread_id + 1);
+    std::discrete_distribution<int> pick_request(weights.begin(), weights.end());
+    double thread_rate = rate / nthreads;
+    std::exponential_distribution<double> exponential(thread_rate);
+    auto next_interval = [&] {
+      double seconds = poisson ? exponential(random) : 1. / thread_rate;
+      return std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(seconds));
+    };
+
+    hdr_histogram latency;
+    std::vector<hdr_histogram> latency_per_request(requests.size());
+    std::vector<http_benchmark_record> records;
+    long long scheduled = 0, completed = 0, errors = 0, bad_status = 0;
+    std::deque<pending> backlog; // Scheduled, waiting for a free connection.
+    size_t next_connection = 0;
+    size_t in_flight = 0;
+
+    auto finish = [&](const pending& p, clock::time_point now, int status) {
+      if (status) {
+        int64_t ns = int64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                 now - p.scheduled).count());
+        latency.record(ns);
+        latency_per_request[p.request].record(ns);
+        completed++;
+        bad_status += status >= 400;
+      } else
+        errors++;
+      if (record_requests)
+        records.push_back({p.request, since_start(p.scheduled), since_start(p.sent),
+                           status ? since_start(now) : -1, status});
+    };
+
+    auto flush = [&](connection& c) {
+      while (c.output.size()) {
+        ssize_t n = ::send(c.fd, c.output.data(), c.output.size(), MSG_NOSIGNAL);
+        if (n <= 0)
+          return n < 0 and errno == EAGAIN;
+        c.output.erase(0, n);
+      }
+      return true;
+    };
+
+    // A failed connection loses its requests in flight, and is opened again.
+    auto reset = [&](int i, clock::time_point now) {
+      connection& c = connections[i];
+      for (auto& p : c.in_flight)
+        finish(p, now, 0);
+      in_flight -= c.in_flight.size();
+      close(c.fd);
+      open(i);
+    };
+
+    auto send_request = [&](int i, pending p, clock::time_point now) {
+      connection& c = connections[i];
+      p.sent = now;
+      c.output += requests[p.request];
+      c.in_flight.push_back(p);
+      in_flight++;
+      if (!flush(c))
+        reset(i, now);
+    };
+
+    auto next_arrival = start + next_interval() * thread_id / nthreads;
+    epoll_event events[64];
+    while (true) {
+      auto now = clock::now();
+      for (; next_arrival <= now and next_arrival < end; next_arrival += next_interval()) {
+        backlog.push_back({pick_request(random), next_arrival, next_arrival});
+        scheduled++;
+      }
+
+      // Dispatch the scheduled requests.
+      while (backlog.size()) {
+        int i = -1;
+        for (size_t k = 0; k < connections.size() and i == -1; k++) {
+          size_t c = (next_connection + k) % connections.size();
+          if (connections[c].fd != -1 and (pipelined or connections[c].in_flight.empty()))
+            i = c;
+        }
+        if (i == -1)
+          break;
+        next_connection = i + 1;
+        send_request(i, backlog.front(), now);
+        backlog.pop_front();
+      }
+
+      if (now >= drain_deadline or (now >= end and backlog.empty() and in_flight == 0))
+        break;
+
+      // Sleep until the next arrival, polling when it is less than a millisecond away.
+      auto until = next_arrival < end ? next_arrival : drain_deadline;
+      auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(until - now);
+      int n = epoll_wait(epoll_fd, events, 64, std::max(0, int(wait.count()) - 1));
+      now = clock::now();
+      for (int e = 0; e < n; e++) {
+        int i = events[e].data.u32;
+        connection& c = connections[i];
+        if (events[e].events & EPOLLOUT and !flush(c)) {
+          reset(i, now);
+          continue;
+        }
+        bool closed = events[e].events & (EPOLLERR | EPOLLHUP);
+        char buf[65536];
+        while (!closed) {
+          ssize_t r = ::recv(c.fd, buf, sizeof(buf), 0);
+          if (r > 0)
+            c.input.append(buf, r);
+          else {
+            closed = r == 0 or errno != EAGAIN;
+            break;
+          }
+        }
+        c.reader.feed(
+            c.input, [&] { return c.in_flight.size() and head[c.in_flight.front().request]; },
+            [&](int status) {
+              if (c.in_flight.empty())
+                return;
+              finish(c.in_flight.front(), now, status);
+              c.in_flight.pop_front();
+              in_flight--;
+            });
+        if (closed)
+          reset(i, now);
+      }
+    }
+
+    // Requests that did not get a response before the drain deadline.
+    auto now = clock::now();
+    for (auto& p : backlog)
+      finish(p, now, 0);
+    for (auto& c : connections) {
+      for (auto& p : c.in_flight)
+        finish(p, now, 0);
+      close(c.fd);
+    }
+    close(epoll_fd);
+
+    std::lock_guard<std::mutex> lock(result_mutex);
+    result.latency.add(latency);
+    for (size_t i = 0; i < requests.size(); i++)
+      result.latency_per_request[i].add(latency_per_request[i]);
+    result.scheduled += scheduled;
+    result.completed += completed;
+    result.errors += errors;
+    result.bad_status += bad_status;
+    result.records.insert(result.records.end(), records.begin(), records.end());
+  };
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < nthreads; t++)
+    threads.emplace_back(client, t);
+  for (auto& t : threads)
+    t.join();
+  if (record_requests)
+    std::sort(result.records.begin(), result.records.end(),
+              [](auto& a, auto& b) { return a.scheduled < b.scheduled; });
+  return result;
+}
+
 } // namespace li
 
 #endif // LITHIUM_SINGLE_HEADER_GUARD_LI_HTTP_SERVER_HTTP_BENCHMARK_HH
@@ -9,6 +9,7 @@
 
 #include <cassert>
 #include <cmath>
+#include <cstdint>
 #include <cstring>
 #include <functional>
 #include <iostream>
@@ -19,6 +20,7 @@
 #include <string>
 #include <string_view>
 #include <tuple>
+#include <type_traits>
 #include <unordered_map>
 #include <utility>
 #include <variant>
@@ -588,7 +590,7 @@ class symbol : public assignable<S>,
     }                                                                                              \
     template <typename T> static constexpr auto has_member(long) { return std::false_type{}; }     \
                                                                                                    \
-    static inline auto symbol_string() { return #NAME; }                                           \
+    static constexpr auto symbol_string() { return #NAME; }                                        \
     static inline auto json_key_string() { return "\"" #NAME "\":"; }                              \
   };                                                                                               \
   static constexpr NAME##_t NAME;                                                                  \
@@ -646,11 +648,24 @@ template <typename T, typename S> decltype(auto) symbol_member_or_getter_access(
   }
 }
 
-template <typename S> auto symbol_string(symbol<S> v) { return S::symbol_string(); }
+template <typename S> constexpr auto symbol_string(symbol<S> v) { return S::symbol_string(); }
 
 template <typename V> auto symbol_string(V v, typename V::_iod_symbol_type* = 0) {
   return V::_iod_symbol_type::symbol_string();
 }
+
+// FNV-1a hash of a string. Allows to match a string known at runtime against symbols.
+constexpr uint64_t symbol_hash(std::string_view str) {
+  uint64_t h = 0xcbf29ce484222325ull;
+  for (char c : str)
+    h = (h ^ uint8_t(c)) * 0x100000001b3ull;
+  return h;
+}
+
+// Hash of the symbol name, computed at compile time.
+template <typename S> constexpr uint64_t symbol_hash(symbol<S>) {
+  return std::integral_constant<uint64_t, symbol_hash(std::string_view(S::symbol_string()))>::value;
+}
 } // namespace li
 
 #endif // LITHIUM_SINGLE_HEADER_GUARD_LI_SYMBOL_SYMBOL_HH
@@ -1046,7 +1061,8 @@ inline decltype(auto) wrap_json_output_stream(std::ostringstream& s) {
   return mmm(s::append = [&s](auto c) { s << c; });
 }
 
-inline decltype(auto) wrap_json_output_stream(std::string& s) {
+template <typename A>
+inline decltype(auto) wrap_json_output_stream(std::basic_string<char, std::char_traits<char>, A>& s) {
   return mmm(s::append = [&s](auto c) {
     using C = std::remove_reference_t<decltype(c)>;
     if constexpr(std::is_same_v<C, char> || std::is_same_v<C, unsigned char> || std::is_same_v<C, int>)
@@ -1591,8 +1607,9 @@ template <typename S> struct json_parser {
       return JSON_INVALID_TYPE<T>::error;
   }
 
-  // Strings
-  inline json_error_code fill(std::string& str) {
+  // Strings, with any allocator.
+  template <typename A>
+  inline json_error_code fill(std::basic_string<char, std::char_traits<char>, A>& str) {
     eat_spaces();
     str.clear();
     return json_to_utf8(ss, str);
@@ -7,10 +7,12 @@
 
 #pragma once
 
+#include <algorithm>
 #include <any>
 #include <atomic>
 #include <boost/lexical_cast.hpp>
 #include <cassert>
+#include <cstdint>
 #include <cstring>
 #include <deque>
 #include <iostream>
@@ -20,7 +22,9 @@
 #include <mysql.h>
 #include <optional>
 #include <sstream>
+#include <stdexcept>
 #include <string>
+#include <string_view>
 #if __linux__
 #include <sys/epoll.h>
 #endif
@@ -29,6 +33,7 @@
 #endif
 #include <thread>
 #include <tuple>
+#include <type_traits>
 #include <unordered_map>
 #include <utility>
 #include <vector>
@@ -554,7 +559,7 @@ class symbol : public assignable<S>,
     }                                                                                              \
     template <typename T> static constexpr auto has_member(long) { return std::false_type{}; }     \
                                                                                                    \
-    static inline auto symbol_string() { return #NAME; }                                           \
+    static constexpr auto symbol_string() { return #NAME; }                                        \
     static inline auto json_key_string() { return "\"" #NAME "\":"; }                              \
   };                                                                                               \
   static constexpr NAME##_t NAME;                                                                  \
@@ -612,11 +617,24 @@ template <typename T, typename S> decltype(auto) symbol_member_or_getter_access(
   }
 }
 
-template <typename S> auto symbol_string(symbol<S> v) { return S::symbol_string(); }
+template <typename S> constexpr auto symbol_string(symbol<S> v) { return S::symbol_string(); }
 
 template <typename V> auto symbol_string(V v, typename V::_iod_symbol_type* = 0) {
   return V::_iod_symbol_type::symbol_string();
 }
+
+// FNV-1a hash of a string. Allows to match a string known at runtime against symbols.
+constexpr uint64_t symbol_hash(std::string_view str) {
+  uint64_t h = 0xcbf29ce484222325ull;
+  for (char c : str)
+    h = (h ^ uint8_t(c)) * 0x100000001b3ull;
+  return h;
+}
+
+// Hash of the symbol name, computed at compile time.
+template <typename S> constexpr uint64_t symbol_hash(symbol<S>) {
+  return std::integral_constant<uint64_t, symbol_hash(std::string_view(S::symbol_string()))>::value;
+}
 } // namespace li
 
 #endif // LITHIUM_SINGLE_HEADER_GUARD_LI_SYMBOL_SYMBOL_HH
@@ -880,6 +898,30 @@ constexpr auto forward_tuple_as_metamap(std::tuple<S...> keys, const std::tuple<
 
 
 namespace li {
+
+// True if the fiber type Y knows when the client connection it serves is closed.
+template <typename Y, typename = void> struct has_is_closed : std::false_type {};
+template <typename Y>
+struct has_is_closed<Y, std::void_t<decltype(std::declval<Y&>().is_closed())>> : std::true_type {
+};
+
+// Thrown when the client of the fiber closed its connection. It is not an application
+// error: the handlers of http_serve drop the request silently, without logging it or
+// answering.
+struct sql_client_closed : public std::runtime_error {
+  sql_client_closed()
+      : std::runtime_error("sql request cancelled: the client closed its connection.") {}
+};
+
+// Throw sql_client_closed if the client of \fiber closed its connection: no new query or
+// database connection is started for a client that is gone. Calls already sent to the
+// database complete, so the database connection goes back to the pool in a clean state.
+template <typename Y> void sql_check_client_connection(Y& fiber) {
+  if constexpr (has_is_closed<Y>::value)
+    if (fiber.is_closed())
+      throw sql_client_closed();
+}
+
 struct sql_blob : public std::string {
   using std::string::string;
   using std::string::operator=;
@@ -1098,15 +1140,10 @@ template <typename Y> struct mysql_functions_non_blocking {
 
     bool error = false;
     while (status) {
-      try {
-        fiber_.yield();
-      } catch (typename Y::exception_type& e) {
-        // Yield thrown a exception (probably because a closed connection).
-        // Mark the connection as broken because it is left in a undefined state.
-        connection_status = 1;
-        throw std::move(e);
-      }
-
+      // A closed client connection does not interrupt the call: the connection would be
+      // left in an undefined state. The next query fails instead
+      // (LI_MYSQL_NONBLOCKING_QUERY_WRAPPER).
+      fiber_.yield();
       status = fn_cont(&ret, std::forward<A1>(a1), status);
     }
     if (ret and ret != MYSQL_NO_DATA and ret != MYSQL_DATA_TRUNCATED)
@@ -1122,18 +1159,25 @@ template <typename Y> struct mysql_functions_non_blocking {
   template <typename... A> auto FN(int& connection_status, A&&... a) {                                                     \
     return mysql_non_blocking_call(connection_status, #FN, ERR, ::FN##_start, ::FN##_cont, std::forward<A>(a)...);              \
   }
+// Calls starting a new query fail fast when the client is gone.
+#define LI_MYSQL_NONBLOCKING_QUERY_WRAPPER(ERR, FN)                                                     \
+  template <typename... A> auto FN(int& connection_status, A&&... a) {                                                     \
+    sql_check_client_connection(fiber_);                                                             \
+    return mysql_non_blocking_call(connection_status, #FN, ERR, ::FN##_start, ::FN##_cont, std::forward<A>(a)...);              \
+  }
 
   LI_MYSQL_NONBLOCKING_WRAPPER(mysql_error, mysql_fetch_row)
-  LI_MYSQL_NONBLOCKING_WRAPPER(mysql_error, mysql_real_query)
+  LI_MYSQL_NONBLOCKING_QUERY_WRAPPER(mysql_error, mysql_real_query)
   LI_MYSQL_NONBLOCKING_WRAPPER(mysql_error, mysql_free_result)
-  LI_MYSQL_NONBLOCKING_WRAPPER(mysql_stmt_error, mysql_stmt_execute)
+  LI_MYSQL_NONBLOCKING_QUERY_WRAPPER(mysql_stmt_error, mysql_stmt_execute)
   LI_MYSQL_NONBLOCKING_WRAPPER(mysql_stmt_error, mysql_stmt_reset)
-  LI_MYSQL_NONBLOCKING_WRAPPER(mysql_stmt_error, mysql_stmt_prepare)
+  LI_MYSQL_NONBLOCKING_QUERY_WRAPPER(mysql_stmt_error, mysql_stmt_prepare)
   LI_MYSQL_NONBLOCKING_WRAPPER(mysql_stmt_error, mysql_stmt_fetch)
   LI_MYSQL_NONBLOCKING_WRAPPER(mysql_stmt_error, mysql_stmt_free_result)
   LI_MYSQL_NONBLOCKING_WRAPPER(mysql_stmt_error, mysql_stmt_store_result)
 
 #undef LI_MYSQL_NONBLOCKING_WRAPPER
+#undef LI_MYSQL_NONBLOCKING_QUERY_WRAPPER
 
   Y& fiber_;
 };
@@ -1467,7 +1511,8 @@ template <typename I> struct sql_result {
 
   I impl_;
 
-  sql_result() = delete;
+  // Construct the implementation in place with \args.
+  template <typename... A> sql_result(A&&... args) : impl_{std::forward<A>(args)...} {}
   sql_result& operator=(sql_result&) = delete;
   sql_result(const sql_result&) = delete;
 
@@ -1688,6 +1733,9 @@ namespace li {
  */
 template <typename B> struct mysql_statement_result {
 
+  mysql_statement_result(B& mysql_wrapper, mysql_statement_data& data,
+                         std::shared_ptr<mysql_connection_data> connection)
+      : mysql_wrapper_(mysql_wrapper), data_(data), connection_(std::move(connection)) {}
   mysql_statement_result& operator=(mysql_statement_result&) = delete;
   mysql_statement_result(const mysql_statement_result&) = delete;
 
@@ -1976,8 +2024,7 @@ sql_result<mysql_statement_result<B>> mysql_statement<B>::operator()(T&&... args
   mysql_wrapper_.mysql_stmt_execute(connection_->error_, data_.stmt_);
 
   // Return the wrapped mysql result.
-  return sql_result<mysql_statement_result<B>>{
-      mysql_statement_result<B>{mysql_wrapper_, data_, connection_}};
+  return sql_result<mysql_statement_result<B>>{mysql_wrapper_, data_, connection_};
 }
 
 } // namespace li
@@ -2015,6 +2062,8 @@ template <typename B> struct mysql_result {
   bool end_of_result_ = false;
   int current_row_num_fields_ = 0;
   
+  mysql_result(B& mysql_wrapper, std::shared_ptr<mysql_connection_data> connection)
+      : mysql_wrapper_(mysql_wrapper), connection_(std::move(connection)) {}
   mysql_result& operator=(mysql_result&) = delete;
   mysql_result(const mysql_result&) = delete;
 
@@ -2198,8 +2247,7 @@ template <typename B> long long int mysql_connection<B>::last_insert_rowid() {
 template <typename B>
 sql_result<mysql_result<B>> mysql_connection<B>::operator()(const std::string& rq) {
   mysql_wrapper_.mysql_real_query(data_->error_, data_->connection_, rq.c_str(), rq.size());
-  return sql_result<mysql_result<B>>{
-      mysql_result<B>{mysql_wrapper_, data_}};
+  return sql_result<mysql_result<B>>{mysql_wrapper_, data_};
 }
 
 template <typename B>
@@ -2256,6 +2304,7 @@ template <typename B> mysql_statement<B> mysql_connection<B>::prepare(const std:
 #define LITHIUM_SINGLE_HEADER_GUARD_LI_SQL_SQL_DATABASE_HH
 
 
+
 namespace li {
 // thread local map of sql_database<I>* -> sql_database_thread_local_data<I>*;
 // This is used to store the thread local async connection pool.
@@ -2275,7 +2324,6 @@ template <typename I> struct sql_database_thread_local_data {
 };
 
 struct active_yield {
-  typedef std::runtime_error exception_type;
   int fiber_id = 0;
   inline void defer(std::function<void()>) {}
   inline void defer_fiber_resume(int fiber_id) {}
@@ -2286,6 +2334,12 @@ struct active_yield {
   inline void yield() {}
 };
 
+// True if the fiber type Y can park: wait without being resumed until another fiber
+// calls defer_fiber_resume(Y::fiber_id).
+template <typename Y, typename = void> struct has_park : std::false_type {};
+template <typename Y>
+struct has_park<Y, std::void_t<decltype(std::declval<Y&>().park())>> : std::true_type {};
+
 template <typename I> struct sql_database {
   I impl;
 
@@ -2353,6 +2407,9 @@ template <typename I> struct sql_database {
    *                                            descriptor fd
    *    - void yield() // Yield the current epoll fiber.
    *
+   *  When the pool is full, fibers providing bool park() are parked until a connection
+   *  is released instead of yielding in a loop.
+   *
    * @return the new connection.
    */
   template <typename Y> inline auto connect(Y& fiber) {
@@ -2377,6 +2434,7 @@ template <typename I> struct sql_database {
     bool reuse = false;
     while (!data) {
 
+      sql_check_client_connection(fiber);
       if (!pool.connections.empty()) {
         auto lock = [&pool, this] {
           if constexpr (std::is_same_v<Y, active_yield>)
@@ -2392,18 +2450,28 @@ template <typename I> struct sql_database {
             throw std::runtime_error("Maximum number of sql connection exeeded.");
           else
           {
-            // std::cout << "Waiting for a free sql connection..." << std::endl;
-            //  pool.waiting_list.push_back(fiber.fiber_id);
-            fiber.yield();
+            // Wait for a connection to go back to the pool: the deleter of the connection
+            // resumes the first fiber of waiting_list. Fibers that cannot park keep
+            // yielding. A fiber whose client is gone stops at the next iteration.
+            if constexpr (has_park<Y>::value) {
+              pool.waiting_list.push_back(fiber.fiber_id);
+              if (!fiber.park())
+                fiber.yield();
+              auto it = std::find(pool.waiting_list.begin(), pool.waiting_list.end(),
+                                  fiber.fiber_id);
+              if (it != pool.waiting_list.end())
+                pool.waiting_list.erase(it);
+            } else
+              fiber.yield();
           }
           continue;
         }
         pool.n_connections++;
         try {
           data = impl.new_connection(fiber);
-        } catch (typename Y::exception_type& e) {
+        } catch (...) {
           pool.n_connections--;
-          throw std::move(e);
+          throw;
         }
 
         if (!data)
@@ -2415,6 +2483,14 @@ template <typename I> struct sql_database {
     assert(data->error_ == 0);
     
     auto sptr = std::shared_ptr<connection_data_type>(data, [pool, this, &fiber](connection_data_type* data) {
+          // The released connection, or its slot, goes to the first waiting fiber.
+          if constexpr (!std::is_same_v<Y, active_yield>)
+            if (pool.waiting_list.size()) {
+              int next_fiber_id = pool.waiting_list.front();
+              pool.waiting_list.pop_front();
+              fiber.defer_fiber_resume(next_fiber_id);
+            }
+
           if (!data->error_ && pool.connections.size() < pool.max_connections) {
             auto lock = [&pool, this] {
               if constexpr (std::is_same_v<Y, active_yield>)
@@ -2423,14 +2499,6 @@ template <typename I> struct sql_database {
             }();
 
             pool.connections.push_back(data);
-            if constexpr (!std::is_same_v<Y, active_yield>)
-             if (pool.waiting_list.size())
-             {
-               int next_fiber_id = pool.waiting_list.front();
-               pool.waiting_list.pop_front();
-               fiber.defer_fiber_resume(next_fiber_id);
-             }
-           
           } else {
             // This is not an error since connection pool.max_connections can vary during execution.
             // It is ok just to discard extraneous in order to reach a lower pool.max_connections.
@@ -2580,17 +2648,10 @@ inline mysql_connection_data* mysql_database_impl::new_connection(Y& fiber) {
       fiber.epoll_add(mysql_fd, EVFILT_READ | EVFILT_WRITE);
     #endif
       
-    while (status)
-      try {
-        fiber.yield();
-        status = mysql_real_connect_cont(&connection, mysql, status);
-      } catch (typename Y::exception_type& e) {
-        // Yield thrown a exception (probably because a closed connection).
-        // std::cerr << "Warning: yield threw an exception while connecting to mysql: "
-        //  << total_number_of_mysql_connections << std::endl;
-        mysql_close(mysql);
-        throw std::move(e);
-      }
+    while (status) {
+      fiber.yield();
+      status = mysql_real_connect_cont(&connection, mysql, status);
+    }
     if (!connection) {
       // Error in mysql_real_connect_cont
       return nullptr;
@@ -7,11 +7,13 @@
 
 #pragma once
 
+#include <algorithm>
 #include <any>
 #include <arpa/inet.h>
 #include <atomic>
 #include <boost/lexical_cast.hpp>
 #include <cassert>
+#include <cstdint>
 #include <cstring>
 #include <deque>
 #include <iostream>
@@ -27,7 +29,9 @@
 #include <mutex>
 #include <optional>
 #include <sstream>
+#include <stdexcept>
 #include <string>
+#include <string_view>
 #if __linux__
 #include <sys/epoll.h>
 #endif
@@ -36,6 +40,7 @@
 #endif
 #include <thread>
 #include <tuple>
+#include <type_traits>
 #include <unistd.h>
 #include <unordered_map>
 #include <utility>
@@ -569,7 +574,7 @@ class symbol : public assignable<S>,
     }                                                                                              \
     template <typename T> static constexpr auto has_member(long) { return std::false_type{}; }     \
                                                                                                    \
-    static inline auto symbol_string() { return #NAME; }                                           \
+    static constexpr auto symbol_string() { return #NAME; }                                        \
     static inline auto json_key_string() { return "\"" #NAME "\":"; }                              \
   };                                                                                               \
   static constexpr NAME##_t NAME;                                                                  \
@@ -627,11 +632,24 @@ template <typename T, typename S> decltype(auto) symbol_member_or_getter_access(
   }
 }
 
-template <typename S> auto symbol_string(symbol<S> v) { return S::symbol_string(); }
+template <typename S> constexpr auto symbol_string(symbol<S> v) { return S::symbol_string(); }
 
 template <typename V> auto symbol_string(V v, typename V::_iod_symbol_type* = 0) {
   return V::_iod_symbol_type::symbol_string();
 }
+
+// FNV-1a hash of a string. Allows to match a string known at runtime against symbols.
+constexpr uint64_t symbol_hash(std::string_view str) {
+  uint64_t h = 0xcbf29ce484222325ull;
+  for (char c : str)
+    h = (h ^ uint8_t(c)) * 0x100000001b3ull;
+  return h;
+}
+
+// Hash of the symbol name, computed at compile time.
+template <typename S> constexpr uint64_t symbol_hash(symbol<S>) {
+  return std::integral_constant<uint64_t, symbol_hash(std::string_view(S::symbol_string()))>::value;
+}
 } // namespace li
 
 #endif // LITHIUM_SINGLE_HEADER_GUARD_LI_SYMBOL_SYMBOL_HH
@@ -900,6 +918,30 @@ constexpr auto forward_tuple_as_metamap(std::tuple<S...> keys, const std::tuple<
 
 
 namespace li {
+
+// True if the fiber type Y knows when the client connection it serves is closed.
+template <typename Y, typename = void> struct has_is_closed : std::false_type {};
+template <typename Y>
+struct has_is_closed<Y, std::void_t<decltype(std::declval<Y&>().is_closed())>> : std::true_type {
+};
+
+// Thrown when the client of the fiber closed its connection. It is not an application
+// error: the handlers of http_serve drop the request silently, without logging it or
+// answering.
+struct sql_client_closed : public std::runtime_error {
+  sql_client_closed()
+      : std::runtime_error("sql request cancelled: the client closed its connection.") {}
+};
+
+// Throw sql_client_closed if the client of \fiber closed its connection: no new query or
+// database connection is started for a client that is gone. Calls already sent to the
+// database complete, so the database connection goes back to the pool in a clean state.
+template <typename Y> void sql_check_client_connection(Y& fiber) {
+  if constexpr (has_is_closed<Y>::value)
+    if (fiber.is_closed())
+      throw sql_client_closed();
+}
+
 struct sql_blob : public std::string {
   using std::string::string;
   using std::string::operator=;
@@ -1122,28 +1164,10 @@ PGresult* pg_wait_for_next_result(PGconn* connection, Y& fiber,
 
     if (PQisBusy(connection)) {
       // std::cout << "isbusy" << std::endl;
-      try {
-        fiber.yield();
-      } catch (typename Y::exception_type& e) {
-        // Free results.
-        // Yield thrown a exception (probably because a closed connection).
-        // Flush the remaining results.
-        while (true)
-        {
-          if (PQconsumeInput(connection) == 0)
-          {
-            connection_status = 1;
-            break;
-          }
-          if (!PQisBusy(connection))
-          {
-            PGresult* res = PQgetResult(connection);
-            if (res) PQclear(res);
-            else break;
-          }
-        }
-        throw std::move(e);
-      }
+      // If the client closed its connection, keep waiting: the query completes and the
+      // database connection goes back to the pool in a clean state. The next query of
+      // this client fails (sql_check_client_connection).
+      fiber.yield();
     } else {
       // std::cout << "notbusy" << std::endl;
       PGresult* res = PQgetResult(connection);
@@ -1172,18 +1196,13 @@ template <typename Y> PGresult* pgsql_result<Y>::wait_for_next_result() {
 }
 
 template <typename Y> void pgsql_result<Y>::flush_results() {
-  try {
-    while (true)
-    {
-      if (connection_->error_ == 1) break;
-      PGresult* res = pg_wait_for_next_result(connection_->pgconn_, fiber_, connection_->error_, true);
-      if (res)
-        PQclear(res);
-      else break;
-    }
-  } catch (typename Y::exception_type& e) {
-    // Forward fiber execptions.
-    throw std::move(e);
+  while (true)
+  {
+    if (connection_->error_ == 1) break;
+    PGresult* res = pg_wait_for_next_result(connection_->pgconn_, fiber_, connection_->error_, true);
+    if (res)
+      PQclear(res);
+    else break;
   }
 }
 
@@ -1502,7 +1521,8 @@ template <typename I> struct sql_result {
 
   I impl_;
 
-  sql_result() = delete;
+  // Construct the implementation in place with \args.
+  template <typename... A> sql_result(A&&... args) : impl_{std::forward<A>(args)...} {}
   sql_result& operator=(sql_result&) = delete;
   sql_result(const sql_result&) = delete;
 
@@ -1828,6 +1848,7 @@ sql_result<pgsql_result<Y>> pgsql_statement<Y>::operator()(T&&... args) {
     i += bind_compute_nparam(a);
   });
 
+  sql_check_client_connection(fiber_);
   if (!PQsendQueryPrepared(connection_->pgconn_, data_.stmt_name.c_str(), nparams, values, lengths, binary,
                            1)) {
     throw std::runtime_error(std::string("Postresql error:") + PQerrorMessage(connection_->pgconn_));
@@ -1836,8 +1857,7 @@ sql_result<pgsql_result<Y>> pgsql_statement<Y>::operator()(T&&... args) {
   // Now calling pqflush seems to work aswell...
   // connection_->flush(this->fiber_);
 
-  return sql_result<pgsql_result<Y>>{
-      pgsql_result<Y>{this->connection_, this->fiber_}};
+  return sql_result<pgsql_result<Y>>{this->connection_, this->fiber_};
 }
 
 // FIXME long long int affected_rows() { return pgsql_stmt_affected_rows(data_.stmt_); }
@@ -1882,10 +1902,10 @@ template <typename Y> struct pgsql_connection {
   // pgsql_statement<Y> operator()(const std::string& rq) { return prepare(rq)(); }
 
   auto operator()(const std::string& rq) {
+    sql_check_client_connection(fiber_);
     if (!PQsendQueryParams(connection_, rq.c_str(), 0, nullptr, nullptr, nullptr, nullptr, 1))
       throw std::runtime_error(std::string("Postresql error:") + PQerrorMessage(connection_));
-    return sql_result<pgsql_result<Y>>{
-        pgsql_result<Y>{this->data_, this->fiber_, data_->error_}};
+    return sql_result<pgsql_result<Y>>{this->data_, this->fiber_, data_->error_};
   }
 
   // PQsendQueryParams
@@ -1905,6 +1925,7 @@ template <typename Y> struct pgsql_connection {
     }
     std::string stmt_name = boost::lexical_cast<std::string>(stm_cache_.size());
 
+    sql_check_client_connection(fiber_);
     if (!PQsendPrepare(connection_, stmt_name.c_str(), rq.c_str(), 0, nullptr)) {
       throw std::runtime_error(std::string("PQsendPrepare error") + PQerrorMessage(connection_));
     }
@@ -1944,6 +1965,7 @@ template <typename Y> struct pgsql_connection {
 #define LITHIUM_SINGLE_HEADER_GUARD_LI_SQL_SQL_DATABASE_HH
 
 
+
 namespace li {
 // thread local map of sql_database<I>* -> sql_database_thread_local_data<I>*;
 // This is used to store the thread local async connection pool.
@@ -1963,7 +1985,6 @@ template <typename I> struct sql_database_thread_local_data {
 };
 
 struct active_yield {
-  typedef std::runtime_error exception_type;
   int fiber_id = 0;
   inline void defer(std::function<void()>) {}
   inline void defer_fiber_resume(int fiber_id) {}
@@ -1974,6 +1995,12 @@ struct active_yield {
   inline void yield() {}
 };
 
+// True if the fiber type Y can park: wait without being resumed until another fiber
+// calls defer_fiber_resume(Y::fiber_id).
+template <typename Y, typename = void> struct has_park : std::false_type {};
+template <typename Y>
+struct has_park<Y, std::void_t<decltype(std::declval<Y&>().park())>> : std::true_type {};
+
 template <typename I> struct sql_database {
   I impl;
 
@@ -2041,6 +2068,9 @@ template <typename I> struct sql_database {
    *                                            descriptor fd
    *    - void yield() // Yield the current epoll fiber.
    *
+   *  When the pool is full, fibers providing bool park() are parked until a connection
+   *  is released instead of yielding in a loop.
+   *
    * @return the new connection.
    */
   template <typename Y> inline auto connect(Y& fiber) {
@@ -2065,6 +2095,7 @@ template <typename I> struct sql_database {
     bool reuse = false;
     while (!data) {
 
+      sql_check_client_connection(fiber);
       if (!pool.connections.empty()) {
         auto lock = [&pool, this] {
           if constexpr (std::is_same_v<Y, active_yield>)
@@ -2080,18 +2111,28 @@ template <typename I> struct sql_database {
             throw std::runtime_error("Maximum number of sql connection exeeded.");
           else
           {
-            // std::cout << "Waiting for a free sql connection..." << std::endl;
-            //  pool.waiting_list.push_back(fiber.fiber_id);
-            fiber.yield();
+            // Wait for a connection to go back to the pool: the deleter of the connection
+            // resumes the first fiber of waiting_list. Fibers that cannot park keep
+            // yielding. A fiber whose client is gone stops at the next iteration.
+            if constexpr (has_park<Y>::value) {
+              pool.waiting_list.push_back(fiber.fiber_id);
+              if (!fiber.park())
+                fiber.yield();
+              auto it = std::find(pool.waiting_list.begin(), pool.waiting_list.end(),
+                                  fiber.fiber_id);
+              if (it != pool.waiting_list.end())
+                pool.waiting_list.erase(it);
+            } else
+              fiber.yield();
           }
           continue;
         }
         pool.n_connections++;
         try {
           data = impl.new_connection(fiber);
-        } catch (typename Y::exception_type& e) {
+        } catch (...) {
           pool.n_connections--;
-          throw std::move(e);
+          throw;
         }
 
         if (!data)
@@ -2103,6 +2144,14 @@ template <typename I> struct sql_database {
     assert(data->error_ == 0);
     
     auto sptr = std::shared_ptr<connection_data_type>(data, [pool, this, &fiber](connection_data_type* data) {
+          // The released connection, or its slot, goes to the first waiting fiber.
+          if constexpr (!std::is_same_v<Y, active_yield>)
+            if (pool.waiting_list.size()) {
+              int next_fiber_id = pool.waiting_list.front();
+              pool.waiting_list.pop_front();
+              fiber.defer_fiber_resume(next_fiber_id);
+            }
+
           if (!data->error_ && pool.connections.size() < pool.max_connections) {
             auto lock = [&pool, this] {
               if constexpr (std::is_same_v<Y, active_yield>)
@@ -2111,14 +2160,6 @@ template <typename I> struct sql_database {
             }();
 
             pool.connections.push_back(data);
-            if constexpr (!std::is_same_v<Y, active_yield>)
-             if (pool.waiting_list.size())
-             {
-               int next_fiber_id = pool.waiting_list.front();
-               pool.waiting_list.pop_front();
-               fiber.defer_fiber_resume(next_fiber_id);
-             }
-           
           } else {
             // This is not an error since connection pool.max_connections can vary during execution.
             // It is ok just to discard extraneous in order to reach a lower pool.max_connections.
@@ -2220,24 +2261,18 @@ struct pgsql_database_impl {
       fiber.epoll_add(pgsql_fd, EVFILT_READ | EVFILT_WRITE);
     #endif
 
-    try {
-      while (status != PGRES_POLLING_FAILED and status != PGRES_POLLING_OK) {
-        int new_pgsql_fd = PQsocket(connection);
-        if (new_pgsql_fd != pgsql_fd) {
-          pgsql_fd = new_pgsql_fd;
-          #if __linux__
-            fiber.epoll_add(pgsql_fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP);
-          #elif __APPLE__
-            fiber.epoll_add(pgsql_fd, EVFILT_READ | EVFILT_WRITE);
-          #endif
-        }
-        fiber.yield();
-        status = PQconnectPoll(connection);
+    while (status != PGRES_POLLING_FAILED and status != PGRES_POLLING_OK) {
+      int new_pgsql_fd = PQsocket(connection);
+      if (new_pgsql_fd != pgsql_fd) {
+        pgsql_fd = new_pgsql_fd;
+        #if __linux__
+          fiber.epoll_add(pgsql_fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP);
+        #elif __APPLE__
+          fiber.epoll_add(pgsql_fd, EVFILT_READ | EVFILT_WRITE);
+        #endif
       }
-    } catch (typename Y::exception_type& e) {
-      // Yield thrown a exception (probably because a closed connection).
-      PQfinish(connection);
-      throw std::move(e);
+      fiber.yield();
+      status = PQconnectPoll(connection);
     }
     // std::cout << "CONNECTED " << std::endl;
     #if __linux__
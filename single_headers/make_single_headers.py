@@ -8,8 +8,10 @@ from os.path import join
 
 WITH_LINE_DIRECTIVES = False
 
-LINUX_ONLY_HEADERS = ['sys/epoll.h']
+LINUX_ONLY_HEADERS = ['sys/epoll.h', 'sys/eventfd.h']
 APPLE_ONLY_HEADERS = ['sys/event.h', 'libkern/OSByteOrder.h', 'machine/endian.h']
+# Only available with -std=c++20 (see coro_reactor.hh).
+COROUTINE_HEADERS = ['<coroutine>']
 
 def include_directive(d):
     linux_only = False
@@ -20,6 +22,9 @@ def include_directive(d):
     for ah in APPLE_ONLY_HEADERS:
         if ah in d:
             apple_only = True
+    for ch in COROUTINE_HEADERS:
+        if ch in d:
+            return f"#if defined(__cpp_impl_coroutine) && __has_include({ch})\n{d}#endif\n"
     if linux_only:
         return f"#if __linux__\n{d}#endif\n"
     if apple_only: